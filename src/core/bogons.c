@@ -75,6 +75,7 @@ bogons_load(FILE *f)
 	filestat_t buf;
 
 	bogons_db = iprange_new();
+	iprange_compile(bogons_db);
 	if (-1 == fstat(fileno(f), &buf)) {
 		g_warning("cannot stat %s: %m", bogons_file);
 	} else {
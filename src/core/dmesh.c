@@ -75,12 +75,14 @@
 #include "lib/pslist.h"
 #include "lib/shuffle.h"
 #include "lib/str.h"
+#include "lib/stringify.h"
 #include "lib/strtok.h"
 #include "lib/timestamp.h"
 #include "lib/tm.h"
 #include "lib/unsigned.h"
 #include "lib/url.h"
 #include "lib/urn.h"
+#include "lib/vsort.h"
 #include "lib/walloc.h"
 
 #include "lib/override.h"	/* Must be the last header included */
@@ -100,6 +102,25 @@ struct dmesh {				/**< A download mesh bucket */
 	htable_t *by_guid;		/**< Entries indexed by GUID (firewalled entries) */
 	time_t last_update;		/**< Timestamp of last insert/expire in the mesh */
 	const sha1_t *sha1;		/**< The SHA1 of this mesh */
+	struct dmesh_altloc *alt;	/**< Cached X-Alt candidates, freshest first */
+	size_t alt_count;		/**< Amount of cached X-Alt candidates */
+	size_t alt_size;		/**< Allocated slots in `alt' */
+	uint8 alt_valid;		/**< Whether cached candidates are up-to-date */
+	uint8 alt_complete;		/**< Whether candidates are for a finished file */
+};
+
+/**
+ * A candidate for X-Alt emission, with its compact form pre-formatted.
+ *
+ * Generating alt-locs happens for each upload reply and each download
+ * request, so for popular files we keep the entries that could be
+ * propagated, leaving only the per-request filtering to be done.
+ */
+struct dmesh_altloc {
+	time_t inserted;		/**< When entry was inserted in mesh */
+	host_addr_t addr;		/**< Address of the alt-loc */
+	uint16 port;			/**< Port of the alt-loc */
+	char url[HOST_ADDR_PORT_BUFLEN];	/**< Compact "addr:port" form */
 };
 
 struct dmesh_entry {
@@ -592,10 +613,24 @@ dm_alloc(const struct sha1 *sha1)
 	dm->by_host = htable_create_any(packed_host_hash_func,
 		packed_host_hash_func2, packed_host_eq_func);
 	dm->by_guid = htable_create(HASH_KEY_FIXED, GUID_RAW_SIZE);
+	dm->alt = NULL;
+	dm->alt_count = dm->alt_size = 0;
+	dm->alt_valid = FALSE;
 
 	return dm;
 }
 
+/**
+ * Invalidate the cached X-Alt candidates of the mesh bucket, to be called
+ * whenever an entry is added or removed, or when its propagation status
+ * changes.
+ */
+static inline void
+dm_alt_invalidate(struct dmesh *dm)
+{
+	dm->alt_valid = FALSE;
+}
+
 /**
  * Free download mesh structure.
  */
@@ -617,6 +652,7 @@ dm_free(struct dmesh *dm)
 	htable_free_null(&dm->by_guid);
 
 	atom_sha1_free_null(&dm->sha1);
+	HFREE_NULL(dm->alt);
 	WFREE(dm);
 }
 
@@ -657,6 +693,7 @@ dm_remove_entry(struct dmesh *dm, struct dmesh_entry *dme)
 	found = list_remove(dm->entries, dme);		/* Remove from list... */
 
 	g_assert(found);
+	dm_alt_invalidate(dm);
 
 	/* ...and from the proper hash table */
 
@@ -700,6 +737,7 @@ dm_remove(struct dmesh *dm, const host_addr_t addr, uint16 port)
 
 	g_assert(found);
 	g_assert(!dme->fw_entry);
+	dm_alt_invalidate(dm);
 
 	htable_remove(dm->by_host, &packed);	/* And from hash table */
 	wfree_packed_host(deconstify_pointer(key), NULL);
@@ -1016,6 +1054,7 @@ dmesh_raw_add(const struct sha1 *sha1, const dmesh_urlinfo_t *info,
 		if (dme->e.url.idx != idx && idx == URN_INDEX) {
 			dme->e.url.idx = idx;
 			atom_str_change(&dme->e.url.name, name);
+			dm_alt_invalidate(dm);
 		}
 
 		if (stamp > dme->stamp)		/* Don't move stamp back in the past */
@@ -1055,6 +1094,7 @@ dmesh_raw_add(const struct sha1 *sha1, const dmesh_urlinfo_t *info,
 
 		list_append(dm->entries, dme);
 		dm->last_update = now;
+		dm_alt_invalidate(dm);
 
 		htable_insert(dm->by_host, walloc_packed_host(addr, port), dme);
 
@@ -1349,6 +1389,8 @@ dmesh_negative_alt(const struct sha1 *sha1, host_addr_t reporter,
 	 */
 
 	if (hash_list_length(dme->bad) + 1 < MIN_BAD_REPORT) {
+		if (0 == hash_list_length(dme->bad))
+			dm_alt_invalidate(dm);		/* Entry now has negative feedback */
 		hash_list_append(dme->bad, WCOPY(&net));
 	} else {
 		/* Add entry to the banned mesh if not a firewalled source */
@@ -1407,6 +1449,14 @@ retry:
 	g_assert(dme->e.url.port == port);
 	g_assert(host_addr_equiv(dme->e.url.addr, addr));
 
+	/*
+	 * Changing the status or the negative feedback of the entry changes
+	 * whether it will be propagated in X-Alt.
+	 */
+
+	if (dme->good != good || (good && dme->bad != NULL))
+		dm_alt_invalidate(dm);
+
 	/*
 	 * Get rid of the "bad" reporting if we're flagging it as good!
 	 */
@@ -1919,6 +1969,88 @@ dmesh_fwalt_string(char *buf, size_t size,
 	return rw;
 }
 
+/**
+ * Sort X-Alt candidates by decreasing insertion time.
+ */
+static int
+dmesh_altloc_cmp(const void *a, const void *b)
+{
+	const struct dmesh_altloc *la = a, *lb = b;
+
+	return CMP(lb->inserted, la->inserted);
+}
+
+/**
+ * Rebuild the cached X-Alt candidates of the mesh bucket: these are the
+ * non-firewalled entries that can be requested by hash and which we are
+ * willing to propagate, sorted so that the freshest come first.
+ *
+ * @param dm			the mesh bucket
+ * @param complete_file	whether the SHA1 is that of a finished file
+ */
+static void
+dm_alt_build(struct dmesh *dm, bool complete_file)
+{
+	list_iter_t *iter;
+	size_t n = 0;
+
+	if (dm->alt_size < list_length(dm->entries)) {
+		dm->alt_size = list_length(dm->entries);
+		HREALLOC_ARRAY(dm->alt, dm->alt_size);
+	}
+
+	iter = list_iter_before_head(dm->entries);
+
+	while (list_iter_has_next(iter)) {
+		const struct dmesh_entry *dme = list_iter_next(iter);
+		struct dmesh_altloc *al;
+		size_t url_len;
+
+		if (dme->fw_entry || dme->e.url.idx != URN_INDEX)
+			continue;
+
+		/*
+		 * When downloading (i.e. when the file is not complete), we have the
+		 * neceesary feedback to spot good sources.  When sharing a complete
+		 * file, all we can do is skip entries for which we got bad feedback.
+		 */
+
+		if (complete_file) {
+			if (dme->bad)		/* Skip entries with negative feedback */
+				continue;
+		} else {
+			if (!dme->good)
+				continue;		/* Only propagate good alt locs */
+		}
+
+		g_assert(n < dm->alt_size);
+
+		al = &dm->alt[n++];
+		al->inserted = dme->inserted;
+		al->addr = dme->e.url.addr;
+		al->port = dme->e.url.port;
+
+		url_len = dmesh_entry_compact(dme, ARYLEN(al->url));
+
+		/* Buffer was large enough */
+		g_assert((size_t) -1 != url_len && url_len < sizeof al->url);
+	}
+
+	list_iter_free(&iter);
+
+	vsort(dm->alt, n, sizeof dm->alt[0], dmesh_altloc_cmp);
+
+	dm->alt_count = n;
+	dm->alt_valid = TRUE;
+	dm->alt_complete = booleanize(complete_file);
+
+	if (GNET_PROPERTY(dmesh_debug) > 4) {
+		g_debug("MESH %s: cached %zu X-Alt candidate%s out of %u entr%s",
+			sha1_base32(dm->sha1), n, plural(n),
+			list_length(dm->entries), plural_y(list_length(dm->entries)));
+	}
+}
+
 /**
  * Build alternate location headers for a given SHA1 key.  We generate at
  * most `size' bytes of data into `alt'.
@@ -1968,8 +2100,8 @@ dmesh_alternate_location(const struct sha1 *sha1,
 	size_t len = 0;
 	pslist_t *l;
 	int nselected = 0;
-	struct dmesh_entry *selected[MAX_ENTRIES];
-	int i;
+	const struct dmesh_altloc *selected[MAX_ENTRIES];
+	size_t i;
 	pslist_t *by_addr;
 	size_t maxlinelen = 0;
 	header_fmt_t *fmt;
@@ -2146,68 +2278,45 @@ dmesh_alternate_location(const struct sha1 *sha1,
 	}
 
 	/*
-	 * Go through the list, selecting new entries that can fit.
-	 * We'll do two passes.  The first pass identifies the candidates.
+	 * Go through the cached candidates, selecting new entries that can fit.
+	 * We'll do two passes.  The first pass identifies the candidates among
+	 * the ones inserted after `last_sent', which come first in the cache.
 	 * The second pass randomly selects items until we fill the room
 	 * allocated.
 	 */
 
-	ZERO(&selected);
+	complete_file = sha1_of_finished_file(sha1);
+
+	if (!dm->alt_valid || dm->alt_complete != booleanize(complete_file))
+		dm_alt_build(dm, complete_file);
 
 	/*
 	 * First pass.
 	 */
 
-	i = 0;
-	iter = list_iter_before_head(dm->entries);
-	complete_file = sha1_of_finished_file(sha1);
+	for (i = 0; i < dm->alt_count; i++) {
+		const struct dmesh_altloc *al = &dm->alt[i];
 
-	while (list_iter_has_next(iter)) {
-		struct dmesh_entry *dme = list_iter_next(iter);
+		if (delta_time(al->inserted, last_sent) <= 0)
+			break;				/* Remaining candidates are older */
 
-		if (dme->fw_entry)
+		if (host_addr_equiv(al->addr, addr))
 			continue;
 
-		/*
-		 * When downloading (i.e. when the file is not complete), we have the
-		 * neceesary feedback to spot good sources.  When sharing a complete
-		 * file, all we can do is skip entries for which we got bad feedback.
-		 */
-
-		if (complete_file) {
-			if (dme->bad)		/* Skip entries with negative feedback */
-				continue;
-		} else {
-			if (!dme->good)
-				continue;		/* Only propagate good alt locs */
-		}
-
-		if (delta_time(dme->inserted, last_sent) <= 0)
-			continue;
-
-		if (host_addr_equiv(dme->e.url.addr, addr))
-			continue;
-
-		if (!hcache_addr_within_net(dme->e.url.addr, net))
-			continue;
-
-		if (dme->e.url.idx != URN_INDEX)
+		if (!hcache_addr_within_net(al->addr, net))
 			continue;
 
-		if (g2_cache_lookup(dme->e.url.addr, dme->e.url.port))
+		if (g2_cache_lookup(al->addr, al->port))
 			continue;			/* Don't pollute with G2-only entries */
 
-		if (local_addr_cache_lookup(dme->e.url.addr, dme->e.url.port))
+		if (local_addr_cache_lookup(al->addr, al->port))
 			continue;			/* Don't pollute with our recent addresses */
 
-		g_assert(i < MAX_ENTRIES);
+		g_assert(nselected < MAX_ENTRIES);
 
-		selected[i++] = dme;
+		selected[nselected++] = al;
 	}
 
-	nselected = i;
-	list_iter_free(&iter);
-
 	if (nselected == 0)
 		goto nomore;
 
@@ -2219,18 +2328,12 @@ dmesh_alternate_location(const struct sha1 *sha1,
 
 	SHUFFLE_ARRAY_N(selected, nselected);
 
-	for (i = 0; i < nselected; i++) {
-		struct dmesh_entry *dme = selected[i];
-		size_t url_len;
-
-		g_assert(delta_time(dme->inserted, last_sent) > 0);
-
-		url_len = dmesh_entry_compact(dme, ARYLEN(url));
+	for (i = 0; i < UNSIGNED(nselected); i++) {
+		const struct dmesh_altloc *al = selected[i];
 
-		/* Buffer was large enough */
-		g_assert((size_t) -1 != url_len && url_len < sizeof url);
+		g_assert(delta_time(al->inserted, last_sent) > 0);
 
-		if (header_fmt_append_value(fmt, url))
+		if (header_fmt_append_value(fmt, al->url))
 			added = TRUE;
 	}
 
@@ -70,12 +70,15 @@
 #include "sockets.h"
 #include "thex_download.h"
 #include "token.h"
+#include "tth_cache.h"
 #include "udp.h"
 #include "uploads.h"
+#include "verify_bitprint.h"
 #include "verify_sha1.h"
 #include "verify_tth.h"
 #include "version.h"
 #include "vmsg.h"
+#include "writeback.h"
 
 #include "g2/build.h"
 #include "g2/node.h"
@@ -96,8 +99,10 @@
 #include "lib/cstr.h"
 #include "lib/dbus_util.h"
 #include "lib/dualhash.h"
+#include "lib/elist.h"
 #include "lib/endian.h"
 #include "lib/entropy.h"
+#include "lib/erbtree.h"
 #include "lib/file.h"
 #include "lib/file_object.h"
 #include "lib/filename.h"
@@ -115,7 +120,6 @@
 #include "lib/magnet.h"
 #include "lib/palloc.h"
 #include "lib/parse.h"
-#include "lib/plist.h"
 #include "lib/pslist.h"
 #include "lib/random.h"
 #include "lib/sequence.h"
@@ -188,6 +192,8 @@ static void download_incomplete_header(struct download *d);
 static bool has_blank_guid(const struct download *d);
 static void download_verify_sha1(struct download *d);
 static void download_verify_tigertree(struct download *d);
+static void download_verify_tigertree_computed(struct download *d,
+	const struct verify *bitprint);
 static bool download_get_server_name(struct download *d, header_t *header);
 static bool use_push_proxy(struct download *d);
 static void download_unavailable(struct download *d,
@@ -200,6 +206,9 @@ static void download_queue_hold(struct download *d, uint32 hold,
 static void download_force_stop(struct download *d, const char * reason, ...);
 static void download_reparent(struct download *d, struct dl_server *new_server);
 static void download_silent_flush(struct download *d);
+static void download_write_unsuspend(struct download *d);
+static void download_write_unpark(struct download *d);
+static bool download_write_next(struct download *d, bool trimmed);
 static void change_server_addr(struct dl_server *server,
 	const host_addr_t new_addr, const uint16 new_port);
 static struct download *download_pick_another(const struct download *d);
@@ -208,6 +217,7 @@ static void download_got_push_route(const guid_t *guid);
 static bool download_dirty;
 static bool download_shutdown;
 static bool queue_frozen_on_write_error;
+static uint download_throttled;
 
 static void download_store(void);
 static void download_retrieve(void);
@@ -415,20 +425,42 @@ server_host_info(const struct dl_server *server)
  * This `dl_key' is inserted in the `dl_by_host' hash table were we find a
  * `dl_server' structure describing all the downloads for the given host.
  *
- * All `dl_server' structures are also inserted in the `dl_by_time' struct,
- * where hosts are sorted based on their retry time.
+ * The `dl_server' structures having downloads to schedule are also either
+ * in the `dl_by_time' tree, where hosts are sorted based on the time at which
+ * the scheduler must consider them again, or in the `dl_ready' list once
+ * that time has come.  That way, the scheduler only visits servers that may
+ * have something to start.
  */
 
 static hikset_t *dl_by_host;
+static erbtree_t dl_by_time;
+static elist_t dl_ready = ELIST_INIT(offsetof(struct dl_server, sched_link));
 
-#define DHASH_SIZE	(1UL << 10)	/**< Hash list size, must be a power of 2 */
-#define DHASH_MASK 	(DHASH_SIZE - 1)
-#define DL_HASH(x)	((x) & DHASH_MASK)
-
+/**
+ * Download scheduler statistics.
+ */
 static struct {
-	plist_t *servers[DHASH_SIZE];	/**< Lists of servers, by retry time */
-	int change[DHASH_SIZE];			/**< Counts changes to the list */
-} dl_by_time;
+	uint64 runs;			/**< Scheduling passes */
+	uint64 woken;			/**< Servers moved to the ready list */
+	uint64 visits;			/**< Servers visited */
+	uint64 examined;		/**< Downloads examined */
+	uint64 started;			/**< Downloads started */
+	uint64 scan_us;			/**< Total time spent scheduling, in usecs */
+	int64 visits_ema;		/**< EMA of servers visited per pass (scaled) */
+	int64 started_ema;		/**< EMA of downloads started per pass (scaled) */
+	int64 scan_us_ema;		/**< EMA of pass duration, in usecs (scaled) */
+} dl_sched_stats;
+
+#define DL_SCHED_EMA_SCALE	256		/**< Fixed-point scaling of the EMAs */
+
+/**
+ * Update a scaled EMA of scheduler statistics, with a 1/8 smoothing factor.
+ */
+static inline void
+dl_sched_ema_update(int64 *ema, uint64 value)
+{
+	*ema += ((int64) value * DL_SCHED_EMA_SCALE - *ema) / 8;
+}
 
 /**
  * To handle download meshes, where we only know the IP/port of the host and
@@ -598,6 +630,10 @@ download_pipeline_can_initiate(const struct download *d)
 
 	download_check(d);
 	g_assert(DOWNLOAD_IS_ACTIVE(d));
+
+	if (d->write_throttled || d->write_parked)
+		return FALSE;				/* Not reading, no I/O source */
+
 	g_assert(d->bio != NULL);
 
 	fi = d->file_info;
@@ -1058,8 +1094,15 @@ download_free(struct download **d_ptr)
 	d = *d_ptr;
 	download_check(d);
 
-	hikset_remove(dl_by_id, d->id);
-	dualhash_remove_key(dl_thex, d->id);
+	/*
+	 * A clone shares the ID of its parent and replaces it in the table,
+	 * so only the download registered under the ID may clear it.
+	 */
+
+	if (hikset_lookup(dl_by_id, d->id) == d) {
+		hikset_remove(dl_by_id, d->id);
+		dualhash_remove_key(dl_thex, d->id);
+	}
 	atom_guid_free_null(&d->id);
 	d->magic = 0;
 	WFREE(d);
@@ -1133,15 +1176,17 @@ dl_retry_cmp(const void *p, const void *q)
 }
 
 /**
- * Compare two `dl_server' structures based on the `retry_after' field.
+ * Compare two `dl_server' structures based on the `sched_after' field.
  * The smaller that time, the smaller the structure is.
  */
 static int
-dl_server_retry_cmp(const void *p, const void *q)
+dl_server_sched_cmp(const void *p, const void *q)
 {
 	const struct dl_server *a = p, *b = q;
+	int c;
 
-	return CMP(a->retry_after, b->retry_after);
+	c = CMP(a->sched_after, b->sched_after);
+	return 0 != c ? c : ptr_cmp(a, b);
 }
 
 /**
@@ -1316,6 +1361,9 @@ download_init(void)
 		offsetof(struct download, id), HASH_KEY_FIXED, GUID_RAW_SIZE);
 	dhl_by_sha1 = htable_create(HASH_KEY_FIXED, SHA1_RAW_SIZE);
 	dl_thex = dualhash_new(guid_hash, guid_eq, guid_hash, guid_eq);
+	erbtree_init(&dl_by_time, dl_server_sched_cmp,
+		offsetof(struct dl_server, sched_node));
+	writeback_init();
 	local_pushes = aging_make(DOWNLOAD_PUSH_FREQ, dl_key_hash, dl_key_eq, NULL);
 
 	header_features_add_guarded(FEATURES_DOWNLOADS, "browse",
@@ -1410,6 +1458,28 @@ buffers_free(struct download *d)
 	d->buffers = NULL;
 }
 
+/**
+ * Detach the data held in the read buffers, which were handed over for
+ * writing.
+ *
+ * The data remain accounted as buffered by the fileinfo until written.
+ */
+static void
+buffers_detach(struct download *d)
+{
+	struct dl_buffers *b;
+
+	download_check(d);
+	g_assert(d->buffers != NULL);
+
+	b = d->buffers;
+	g_assert(b->mode == DL_BUF_READING);
+	g_assert(b->held > 0);
+
+	b->list = slist_new();		/* Old list now owned by the writing layer */
+	b->held = 0;
+}
+
 /**
  * Reset the I/O vector for reading from the start.
  */
@@ -1754,32 +1824,100 @@ buffers_strip_trailing(struct download *d, size_t amount)
 /* ----------------------------------------- */
 
 /**
- * Insert server by retry time into the `dl_by_time' structure.
+ * Schedule server to be considered at the specified time, putting it in
+ * the `dl_ready' list if that time has already come or in the `dl_by_time'
+ * tree otherwise.
  */
 static void
-dl_by_time_insert(struct dl_server *server)
+dl_sched_insert(struct dl_server *server, time_t when)
 {
-	uint idx = DL_HASH(server->retry_after);
+	g_assert(dl_server_valid(server));
+	g_assert(DL_SCHED_NONE == server->sched);
+
+	server->sched_after = when;
+
+	if (delta_time(tm_time(), when) >= 0) {
+		server->sched = DL_SCHED_READY;
+		elist_append(&dl_ready, server);
+	} else {
+		server->sched = DL_SCHED_TIMER;
+		erbtree_insert(&dl_by_time, &server->sched_node);
+	}
+}
 
+/**
+ * Remove server from the scheduling structures.
+ */
+static void
+dl_sched_remove(struct dl_server *server)
+{
 	g_assert(dl_server_valid(server));
 
-	dl_by_time.change[idx]++;
-	dl_by_time.servers[idx] = plist_insert_sorted(dl_by_time.servers[idx],
-		server, dl_server_retry_cmp);
+	switch (server->sched) {
+	case DL_SCHED_NONE:
+		return;
+	case DL_SCHED_TIMER:
+		erbtree_remove(&dl_by_time, &server->sched_node);
+		break;
+	case DL_SCHED_READY:
+		elist_remove(&dl_ready, server);
+		break;
+	}
+
+	server->sched = DL_SCHED_NONE;
+}
+
+/**
+ * Insert server by retry time into the scheduling structures.
+ */
+static void
+dl_by_time_insert(struct dl_server *server)
+{
+	dl_sched_insert(server, server->retry_after);
 }
 
 /**
- * Remove server from the `dl_by_time' structure.
+ * Remove server from the scheduling structures.
  */
 static void
 dl_by_time_remove(struct dl_server *server)
 {
-	uint idx = DL_HASH(server->retry_after);
+	dl_sched_remove(server);
+}
 
+/**
+ * Make sure the server will be considered by the scheduler as soon as its
+ * retry time has come, because something changed in its waiting downloads.
+ */
+static void
+download_server_wakeup(struct dl_server *server)
+{
 	g_assert(dl_server_valid(server));
 
-	dl_by_time.change[idx]++;
-	dl_by_time.servers[idx] = plist_remove(dl_by_time.servers[idx], server);
+	if (
+		DL_SCHED_READY == server->sched ||
+		(
+			DL_SCHED_TIMER == server->sched &&
+			server->sched_after == server->retry_after
+		)
+	)
+		return;
+
+	dl_sched_remove(server);
+	dl_sched_insert(server, server->retry_after);
+}
+
+/**
+ * Make sure the scheduler reconsiders the download, if it is waiting, after
+ * it was resumed or unsuspended.
+ */
+static void
+download_wakeup(const struct download *d)
+{
+	download_check(d);
+
+	if (DL_LIST_WAITING == d->list_idx)
+		download_server_wakeup(d->server);
 }
 
 /**
@@ -3609,6 +3747,8 @@ download_info_change_all(fileinfo_t *old_fi, fileinfo_t *new_fi)
 		d->flags &= ~DL_F_SUSPENDED;
 		if (new_fi->flags & FI_F_SUSPEND)
 			d->flags |= DL_F_SUSPENDED;
+		else
+			download_wakeup(d);
 
 		if (is_running)
 			download_queue(d, _("Requeued by file info change"));
@@ -3762,6 +3902,71 @@ download_set_socket_rx_size(unsigned rx_size)
 	hash_list_iter_release(&iter);
 }
 
+/**
+ * Retrieve asynchronous writing statistics for the active downloads and
+ * the ones still having data being written.
+ *
+ * @return list of download_write_info_t that must be freed by calling
+ * download_write_info_list_free_null().
+ */
+pslist_t *
+download_write_info_list(void)
+{
+	hash_list_iter_t *iter;
+	pslist_t *sl = NULL;
+
+	iter = hash_list_iterator(sl_downloads);
+
+	while (hash_list_iter_has_next(iter)) {
+		const struct download *d = hash_list_iter_next(iter);
+		download_write_info_t *dwi;
+
+		download_check(d);
+
+		if (!DOWNLOAD_IS_ACTIVE(d) && 0 == d->writes_pending)
+			continue;
+
+		WALLOC0(dwi);
+		dwi->magic = DOWNLOAD_WRITE_INFO_MAGIC;
+		dwi->host = atom_str_get(download_host_info(d));
+		dwi->name = atom_str_get(download_basename(d));
+		dwi->pending = d->writes_pending;
+		dwi->queued = d->writes_queued;
+		dwi->latency = d->write_latency;
+
+		sl = pslist_prepend(sl, dwi);
+	}
+
+	hash_list_iter_release(&iter);
+
+	return pslist_reverse(sl);
+}
+
+static void
+download_write_info_free(void *data, void *udata)
+{
+	download_write_info_t *dwi = data;
+
+	download_write_info_check(dwi);
+	(void) udata;
+
+	atom_str_free_null(&dwi->host);
+	atom_str_free_null(&dwi->name);
+	WFREE(dwi);
+}
+
+/**
+ * Free list created by download_write_info_list() and nullify pointer.
+ */
+void
+download_write_info_list_free_null(pslist_t **sl_ptr)
+{
+	pslist_t *sl = *sl_ptr;
+
+	pslist_foreach(sl, download_write_info_free, NULL);
+	pslist_free_null(sl_ptr);
+}
+
 static void
 download_set_sha1(struct download *d, const struct sha1 *sha1)
 {
@@ -3801,6 +4006,7 @@ download_add_to_list(struct download *d, enum dl_list idx)
 
 	if (idx == DL_LIST_WAITING) {
 		server_list_insert_download_sorted(server, idx, d);
+		download_server_wakeup(server);
 	} else {
 		server_list_prepend_download(server, idx, d);
 	}
@@ -3860,6 +4066,7 @@ download_move_to_list(struct download *d, enum dl_list idx)
 
 	if (idx == DL_LIST_WAITING) {
 		server_list_insert_download_sorted(server, idx, d);
+		download_server_wakeup(server);
 	} else {
 		server_list_append_download(server, idx, d);
 	}
@@ -3919,6 +4126,7 @@ download_clone(struct download *d)
 	cd->sha1 = d->sha1 ? atom_sha1_get(d->sha1) : NULL;
 	cd->file_name = atom_str_get(d->file_name);
 	cd->id = atom_guid_get(d->id);
+	hikset_insert_key(dl_by_id, &cd->id);	/* Clone is now found by ID */
 	cd->uri = d->uri ? atom_str_get(d->uri) : NULL;
 	cd->flags &= ~(DL_F_MUST_IGNORE | DL_F_SWITCHED |
 		DL_F_FROM_PLAIN | DL_F_FROM_ERROR | DL_F_CLONED | DL_F_NO_PIPELINE);
@@ -3979,6 +4187,7 @@ download_clone(struct download *d)
 	cd->buffers = NULL;		/* Allocated at each new request */
 	cd->thex = NULL;
 	cd->browse = NULL;
+	cd->write_throttled = cd->write_parked = FALSE;	/* Parent's RX state */
 
 	/*
 	 * The following have been copied and appropriated by the cloned download.
@@ -3989,6 +4198,8 @@ download_clone(struct download *d)
 	d->socket = NULL;
 	d->ranges = NULL;
 	d->pipeline = NULL;
+	d->writes_pending = 0;		/* Completions will be looked up by ID */
+	d->writes_queued = 0;
 	d->flags |= DL_F_CLONED;		/* Don't persist parent download */
 
 	return cd;
@@ -4598,10 +4809,16 @@ download_stop_v(struct download *d, download_status_t new_status,
 		g_assert(d->file_info->recvcount <= d->file_info->lifecount);
 
 		was_active = TRUE;
+		download_write_unsuspend(d);
 
 		/*
 		 * If there is unflushed downloaded data, try to flush it now,
 		 * unless the file is already complete.
+		 *
+		 * We do not wait for the asynchronous writes of the download to
+		 * complete: the data they carry is marked DONE by their completion
+		 * callback, which looks the download and its file up by ID, and
+		 * which launches the verification if that completes the file.
 		 */
 
 		if (d->buffers != NULL) {
@@ -4627,6 +4844,8 @@ download_stop_v(struct download *d, download_status_t new_status,
 			buffers_free(d);
 		}
 
+		d->write_error = 0;			/* Reported when it happened */
+
 		d->file_info->recvcount--;
 		d->file_info->dirty_status = TRUE;
 	}
@@ -5372,6 +5591,7 @@ queue_suspend_downloads_with_file(fileinfo_t *fi, bool suspend)
 			d->flags |= DL_F_SUSPENDED;		/* Can no longer be scheduled */
 		} else {
 			d->flags &= ~DL_F_SUSPENDED;
+			download_wakeup(d);
 		}
 	}
 	pslist_free_null(&sources);
@@ -5933,6 +6153,34 @@ download_bad_source(struct download *d)
 			d->record_index, d->file_name);
 }
 
+/**
+ * Called when data received from this source did not match the Tiger tree
+ * of the file, the range having been invalidated already.
+ *
+ * @param d		the download source that supplied the bad data
+ * @param from	start of the invalidated range
+ * @param to	end of the invalidated range (excluded)
+ */
+void
+download_bad_slice(struct download *d, filesize_t from, filesize_t to)
+{
+	download_check(d);
+
+	if (GNET_PROPERTY(download_debug)) {
+		g_debug("%s(): bad data in [%s, %s[ for \"%s\" from %s",
+			G_STRFUNC, filesize_to_string(from), filesize_to_string2(to),
+			download_basename(d), download_host_info(d));
+	}
+
+	d->mismatches++;
+	download_bad_source(d);
+
+	if (DOWNLOAD_IS_RUNNING(d)) {
+		download_stop(d, GTA_DL_ERROR, _("Bad data @ %s"),
+			filesize_to_string(from));
+	}
+}
+
 /**
  * Establish asynchronous connection to remote server.
  *
@@ -6153,6 +6401,7 @@ download_request_start(struct download *d)
 
 	d->flags &= ~DL_F_PAUSED;
 	file_info_resume(d->file_info);
+	download_wakeup(d);
 
 	download_start(d, TRUE);
 }
@@ -6560,195 +6809,275 @@ download_pick_another(const struct download *d)
 }
 
 /**
- * Pick up new downloads from the queue as needed.
+ * Look for a download we could start on a ready server, and start it.
+ *
+ * When nothing can be started yet, the server is put back in the timer tree
+ * until the earliest time at which one of its waiting downloads could be
+ * started, or removed from the scheduling structures altogether if it has
+ * nothing to start until its downloads change.  It otherwise remains in the
+ * ready list, to be visited again during the next pass.
+ *
+ * @param server		the server to consider
+ * @param now			current time
  */
 static void
-download_pickup_queued(void)
+download_pickup_server(struct dl_server *server, time_t now)
 {
-	time_t now = tm_time();
-	uint i;
-
-	/*
-	 * To select downloads, we iterate over the sorted `dl_by_time' list and
-	 * look for something we could schedule.
-	 *
-	 * Note that we jump from one host to the other, even if we have multiple
-	 * things to schedule on the same host: It's better to spread load among
-	 * all hosts first.
-	 */
-
-	for (i = 0; i < DHASH_SIZE; i++) {
-		plist_t *l;
-		int last_change;
-
-		if (download_queue_is_frozen())
-			break;
-
-		if (count_running_downloads() >= GNET_PROPERTY(max_downloads))
-			break;
-
-		if (!bws_can_connect(SOCK_TYPE_DOWNLOAD))
-			break;
-
-	retry:
-		l = dl_by_time.servers[i];
-		last_change = dl_by_time.change[i];
+	list_iter_t *iter;
+	struct download *d;
+	uint n;
+	bool only_special = FALSE;
+	bool ready = FALSE;
+	time_t wake = TIME_T_MAX;
 
-		for (/* NOTHING */; NULL != l; l = plist_next(l)) {
-			struct dl_server *server = l->data;
-			list_iter_t *iter;
-			struct download *d;
-			uint n;
-			bool only_special = FALSE;
+	g_assert(dl_server_valid(server));
+	g_assert(DL_SCHED_READY == server->sched);
 
-			g_assert(dl_server_valid(server));
+	dl_sched_stats.visits++;
 
-			if (count_running_downloads() >= GNET_PROPERTY(max_downloads))
-				break;
+	if (server_list_length(server, DL_LIST_WAITING) == 0) {
+		dl_sched_remove(server);	/* Woken up when a download is queued */
+		return;
+	}
 
-			/*
-			 * List is sorted, so as soon as we go beyond the current time,
-			 * we can stop.
-			 */
+	if (
+		count_running_on_server(server)
+			>= GNET_PROPERTY(max_host_downloads)
+	) {
+		download_list_send_head_ping(server->list[DL_LIST_WAITING]);
 
-			if (delta_time(now, server->retry_after) < 0)
-				break;
+		/*
+		 * Normally, special downloads are served by remote servents
+		 * regardless of the amount of upload slots or per host
+		 * restrictions (since these downloads are small, usually).
+		 *
+		 * Hence, allow such special downloads to be scheduled even
+		 * if we reached the configured local maximum.
+		 */
 
-			if (server_list_length(server, DL_LIST_WAITING) == 0)
-				continue;
+		only_special = TRUE;
+	}
 
-			if (
-				count_running_on_server(server)
-					>= GNET_PROPERTY(max_host_downloads)
-			) {
-				download_list_send_head_ping(server->list[DL_LIST_WAITING]);
+	/*
+	 * Avoid hammering servers.  In case we have multiple files queued
+	 * on that server, we must not issue all the requests in a short
+	 * period of time as this can be frowned upon.
+	 */
 
-				/*
-				 * Normally, special downloads are served by remote servents
-				 * regardless of the amount of upload slots or per host
-				 * restrictions (since these downloads are small, usually).
-				 *
-				 * Hence, allow such special downloads to be scheduled even
-				 * if we reached the configured local maximum.
-				 */
+	if (delta_time(now, server->last_connect) < DOWNLOAD_CONNECT_DELAY) {
+		dl_sched_remove(server);
+		dl_sched_insert(server,
+			time_advance(server->last_connect, DOWNLOAD_CONNECT_DELAY));
+		return;
+	}
 
-				only_special = TRUE;
-			}
+	/*
+	 * OK, select a download within the waiting list, but do not
+	 * remove it yet.  This will be done by download_start().
+	 */
 
-			/*
-			 * Avoid hammering servers.  In case we have multiple files queued
-			 * on that server, we must not issue all the requests in a short
-			 * period of time as this can be frowned upon.
-			 */
+	g_assert(server->list[DL_LIST_WAITING]);	/* Since count != 0 */
 
-			if (delta_time(now, server->last_connect) < DOWNLOAD_CONNECT_DELAY)
-				continue;
+	n = 0;
+	d = NULL;
+	iter = list_iter_before_head(server->list[DL_LIST_WAITING]);
+	while (list_iter_has_next(iter)) {
+		struct download *cur;
 
-			/*
-			 * OK, select a download within the waiting list, but do not
-			 * remove it yet.  This will be done by download_start().
-			 */
+		cur = list_iter_next(iter);
+		download_check(cur);
+		dl_sched_stats.examined++;
 
-			g_assert(server->list[DL_LIST_WAITING]);	/* Since count != 0 */
+		/* Woken up when resumed */
+		if (cur->flags & (DL_F_SUSPENDED | DL_F_PAUSED))
+			continue;
 
-			n = 0;
-			d = NULL;
-			iter = list_iter_before_head(server->list[DL_LIST_WAITING]);
-			while (list_iter_has_next(iter)) {
-				struct download *cur;
+		if (only_special && !download_is_special(cur)) {
+			ready = TRUE;		/* Until a running download ends */
+			continue;
+		}
 
-				cur = list_iter_next(iter);
-				download_check(cur);
+		if (download_has_enough_active_sources(cur)) {
+			download_send_head_ping(cur);
+			ready = TRUE;		/* Until the other sources stop */
+			continue;
+		}
 
-				if (cur->flags & (DL_F_SUSPENDED | DL_F_PAUSED))
-					continue;
+		if (
+			delta_time(now, cur->last_update) <=
+				(time_delta_t) cur->timeout_delay
+		) {
+			download_send_head_ping(cur);
+			wake = MIN(wake,
+				time_advance(cur->last_update, cur->timeout_delay + 1));
+			continue;
+		}
 
-				if (only_special && !download_is_special(cur))
-					continue;
+		/* Note that we skip over paused and suspended downloads */
+		if (delta_time(now, cur->retry_after) < 0) {
+			wake = MIN(wake, cur->retry_after);
+			break;	/* List is sorted */
+		}
 
-				if (download_has_enough_active_sources(cur)) {
-					download_send_head_ping(cur);
-					continue;
-				}
+		if (d) {
+			if ((NULL != d->thex) == (NULL != cur->thex)) {
+				/*
+				 * Pick the download with the most progress. Otherwise
+				 * we easily end up with dozens of partials from the
+				 * the server.
+				 */
 
 				if (
-					delta_time(now, cur->last_update) <=
-						(time_delta_t) cur->timeout_delay
+					download_total_progress(d)
+						>= download_total_progress(cur)
 				) {
 					download_send_head_ping(cur);
 					continue;
 				}
+			}
 
-				/* Note that we skip over paused and suspended downloads */
-				if (delta_time(now, cur->retry_after) < 0)
-					break;	/* List is sorted */
-
-				if (d) {
-					if ((NULL != d->thex) == (NULL != cur->thex)) {
-						/*
-						 * Pick the download with the most progress. Otherwise
-						 * we easily end up with dozens of partials from the
-						 * the server.
-						 */
-
-						if (
-							download_total_progress(d)
-								>= download_total_progress(cur)
-						) {
-							download_send_head_ping(cur);
-							continue;
-						}
-					}
-
-					/* Give priority to THEX downloads */
-					if (d->thex && NULL == cur->thex) {
-						download_send_head_ping(cur);
-						continue;
-					}
-				}
+			/* Give priority to THEX downloads */
+			if (d->thex && NULL == cur->thex) {
+				download_send_head_ping(cur);
+				continue;
+			}
+		}
 
-				if (d)
-					download_send_head_ping(d);
+		if (d)
+			download_send_head_ping(d);
 
-				d = cur;
+		d = cur;
 
-				/*
-				 * If there are a lot of downloads queued at a single server we
-				 * might spend a lot of time scanning the queue of a download
-				 * to pick. Thus limit the amount of items we're going to take
-				 * into account.
-				 */
+		/*
+		 * If there are a lot of downloads queued at a single server we
+		 * might spend a lot of time scanning the queue of a download
+		 * to pick. Thus limit the amount of items we're going to take
+		 * into account.
+		 */
 
-				if (n++ > 100)
-					break;
-			}
-			list_iter_free(&iter);
+		if (n++ > 100)
+			break;
+	}
+	list_iter_free(&iter);
 
-			if (d) {
-				download_start(d, FALSE);
-			}
+	/*
+	 * Starting the download can change the server's scheduling state, or
+	 * even reclaim the server, so we must not touch it afterwards.
+	 */
 
+	if (d) {
+		dl_sched_stats.started++;
+		download_start(d, FALSE);
+		return;
+	}
 
-			/*
-			 * It's possible that download_start() ended-up changing the
-			 * dl_by_time list we're iterating over.  That's why all changes
-			 * to that list update the dl_by_time_change variable, which we
-			 * snapshot upon entry into the loop.
-			 *		--RAM, 24/08/2002.
-			 */
+	if (ready)
+		return;
 
-			if (last_change != dl_by_time.change[i])
-				goto retry;
-		}
-	}
+	dl_sched_remove(server);
+	if (wake != TIME_T_MAX)
+		dl_sched_insert(server, wake);
 }
 
 /**
- * Invoked by the query hit parsing layer when push-proxies are discovered
- * for some GUID.
+ * Pick up new downloads from the queue as needed.
  */
-void
-download_got_push_proxies(const struct guid *guid,
+static void
+download_pickup_queued(void)
+{
+	time_t now = tm_time();
+	struct dl_server *server;
+	size_t n;
+	uint64 visits, started, elapsed;
+	tm_t start, end;
+
+	tm_now_exact(&start);
+	visits = dl_sched_stats.visits;
+	started = dl_sched_stats.started;
+	dl_sched_stats.runs++;
+
+	/*
+	 * Move the servers whose scheduling time has come from the timer tree,
+	 * sorted by increasing time, to the list of ready servers.
+	 */
+
+	while (NULL != (server = erbtree_head(&dl_by_time))) {
+		g_assert(dl_server_valid(server));
+		g_assert(DL_SCHED_TIMER == server->sched);
+
+		if (delta_time(now, server->sched_after) < 0)
+			break;
+
+		erbtree_remove(&dl_by_time, &server->sched_node);
+		server->sched = DL_SCHED_READY;
+		elist_append(&dl_ready, server);
+		dl_sched_stats.woken++;
+	}
+
+	/*
+	 * Visit each ready server at most once, rotating the list so that the
+	 * next pass resumes where we stopped.
+	 *
+	 * Note that we jump from one host to the other, even if we have multiple
+	 * things to schedule on the same host: It's better to spread load among
+	 * all hosts first.
+	 */
+
+	for (n = elist_count(&dl_ready); n != 0; n--) {
+		if (download_queue_is_frozen())
+			break;
+
+		if (count_running_downloads() >= GNET_PROPERTY(max_downloads))
+			break;
+
+		if (!bws_can_connect(SOCK_TYPE_DOWNLOAD))
+			break;
+
+		server = elist_head(&dl_ready);
+		elist_rotate_left(&dl_ready);
+		download_pickup_server(server, now);
+	}
+
+	tm_now_exact(&end);
+	elapsed = tm_elapsed_us(&end, &start);
+
+	dl_sched_stats.scan_us += elapsed;
+	dl_sched_ema_update(&dl_sched_stats.visits_ema,
+		dl_sched_stats.visits - visits);
+	dl_sched_ema_update(&dl_sched_stats.started_ema,
+		dl_sched_stats.started - started);
+	dl_sched_ema_update(&dl_sched_stats.scan_us_ema, elapsed);
+}
+
+/**
+ * Retrieve download scheduler statistics.
+ */
+void
+download_sched_info(download_sched_info_t *dsi)
+{
+	g_assert(dsi != NULL);
+
+	ZERO(dsi);
+	dsi->servers = hikset_count(dl_by_host);
+	dsi->ready = elist_count(&dl_ready);
+	dsi->sleeping = erbtree_count(&dl_by_time);
+	dsi->runs = dl_sched_stats.runs;
+	dsi->woken = dl_sched_stats.woken;
+	dsi->visits = dl_sched_stats.visits;
+	dsi->examined = dl_sched_stats.examined;
+	dsi->started = dl_sched_stats.started;
+	dsi->scan_us = dl_sched_stats.scan_us;
+	dsi->visit_rate = (double) dl_sched_stats.visits_ema / DL_SCHED_EMA_SCALE;
+	dsi->start_rate = (double) dl_sched_stats.started_ema / DL_SCHED_EMA_SCALE;
+	dsi->scan_cost = (double) dl_sched_stats.scan_us_ema / DL_SCHED_EMA_SCALE;
+}
+
+/**
+ * Invoked by the query hit parsing layer when push-proxies are discovered
+ * for some GUID.
+ */
+void
+download_got_push_proxies(const struct guid *guid,
 	const gnet_host_vec_t *proxies, bool g2)
 {
 	struct dl_server *server;
@@ -8213,6 +8542,7 @@ download_request_resume(struct download *d)
 	if (!FILE_INFO_FINISHED(d->file_info)) {
 		d->flags &= ~DL_F_PAUSED;
 		file_info_resume(d->file_info);
+		download_wakeup(d);
 		download_resume(d);
 	}
 }
@@ -9035,137 +9365,548 @@ download_overlap_check(struct download *d)
 		}
 
 		/*
-		 * Sanity check: if the file is bigger than when we started, abort
-		 * immediately.
+		 * Sanity check: if the file is bigger than when we started, abort
+		 * immediately.
+		 */
+
+		if (!fi->use_swarming && d->chunk.start != fi->done) {
+			g_message("file '%s' changed size (now %s, but was %s)",
+					fi->pathname, uint64_to_string(sb.st_size),
+					uint64_to_string2(d->chunk.start));
+			download_queue_delay(d, GNET_PROPERTY(download_retry_stopped_delay),
+					_("Stopped (Output file size changed)"));
+			goto out;
+		}
+	}
+
+	{
+		ssize_t r;
+
+		data = walloc(d->chunk.overlap);
+		g_assert(d->chunk.start >= d->chunk.overlap);
+		r = file_object_pread(fo, data, d->chunk.overlap,
+				d->chunk.start - d->chunk.overlap);
+
+		if ((ssize_t) -1 == r) {
+			const char *error = g_strerror(errno);
+			g_warning("cannot read resuming data for \"%s\": %m",
+					fi->pathname);
+			download_stop(d, GTA_DL_ERROR, _("Can't read resume data: %s"),
+				error);
+			goto out;
+		} else if ((size_t) r != d->chunk.overlap) {
+			g_warning(
+				"short read (got %zu instead of %u bytes at offset %zu) "
+				"on resuming data for \"%s\"",
+				r, d->chunk.overlap, (size_t) d->chunk.start - d->chunk.overlap,
+				fi->pathname);
+			download_stop(d, GTA_DL_ERROR, _("Short read on resume data"));
+			goto out;
+		}
+	}
+
+	if (!buffers_match(d, data, d->chunk.overlap)) {
+		/*
+		 * Resuming data mismatch.
+		 */
+
+		if (GNET_PROPERTY(download_debug) > 1) {
+			g_debug("%u overlapping bytes UNMATCHED at offset %s for \"%s\"",
+				(uint) d->chunk.overlap,
+				uint64_to_string(d->chunk.start - d->chunk.overlap),
+				download_basename(d));
+        }
+
+		d->pos += d->buffers->held;	/* Keep track of what we read so far */
+		d->pos -= d->chunk.overlap;	/* Overlap did not count as chunk data */
+		d->mismatches++;
+		buffers_discard(d);			/* Discard everything we read so far */
+
+		if (GNET_PROPERTY(dl_remove_file_on_mismatch)) {
+			download_bad_source(d);	/* Until proven otherwise if we resume it */
+			download_queue(d, _("Resuming data mismatch @ %s"),
+				uint64_to_string(d->chunk.start - d->chunk.overlap));
+			download_remove_file(d, TRUE);
+			goto out;
+		}
+
+		/*
+		 * If we have not seen too many resuming mismatches from this source,
+		 * maybe we got fooled earlier and downloaded some bad data.  Give
+		 * this source a chance: if we don't have too much data requested,
+		 * simply ignore them and get a chance to issue a new request later.
+		 *		--RAM, 2007-05-05
+		 */
+
+		download_backout(d);	/* Forget some bytes at mismatch point */
+
+		if (
+			d->mismatches <= DOWNLOAD_MAX_IGN_REQS &&
+			d->keep_alive &&
+			download_can_ignore(d)
+		) {
+			success = TRUE;			/* Act as if overlapping was OK */
+			gnet_stats_inc_general(GNR_IGNORING_AFTER_MISMATCH);
+			goto out;
+		}
+
+		download_bad_source(d);	/* Until proven otherwise if we resume it */
+
+		/*
+		 * Don't always keep this source, and since there is doubt,
+		 * leave it to randomness.
+		 */
+
+		if (random_value(99) >= 50)
+			download_stop(d, GTA_DL_ERROR,
+				_("Resuming data mismatch @ %s"),
+				uint64_to_string(d->chunk.start - d->chunk.overlap));
+		else
+			download_queue_delay(d, GNET_PROPERTY(download_retry_busy_delay),
+				_("Resuming data mismatch @ %s"),
+				uint64_to_string(d->chunk.start - d->chunk.overlap));
+		goto out;
+	}
+
+	/*
+	 * Great, resuming data matched!
+	 * Remove the overlapping data from the read buffers.
+	 */
+
+	buffers_check_held(d);
+	buffers_strip_leading(d, d->chunk.overlap);
+	buffers_check_held(d);
+
+	if (GNET_PROPERTY(download_debug) > 3)
+		g_debug("%u overlapping bytes MATCHED "
+			"at offset %s for \"%s\"",
+			(uint) d->chunk.overlap,
+			uint64_to_string(d->chunk.start - d->chunk.overlap),
+			download_basename(d));
+
+	success = TRUE;
+
+out:
+	WFREE_NULL(data, d->chunk.overlap);
+	file_object_release(&fo);
+
+	return success;
+}
+
+/**
+ * Freeze the download queue on write errors that will not go away by
+ * themselves.
+ */
+static void
+download_write_error(int error)
+{
+	switch (error) {
+	case ENOSPC:	/* No space left */
+		queue_frozen_on_write_error = TRUE;
+		/* FALL THROUGH */
+	case EDQUOT:	/* quota exceeded */
+	case EROFS:		/* read-only filesystem */
+	case EIO:		/* I/O error */
+		if (!download_queue_is_frozen()) {
+			download_freeze_queue();
+			g_warning("freezing download queue due to write error: %s",
+				g_strerror(error));
+		}
+		break;
+	}
+}
+
+enum dl_write_magic { DL_WRITE_MAGIC = 0x7d02e4c9 };
+
+/**
+ * Context of an asynchronous write.
+ *
+ * The download and the fileinfo are referenced by their IDs since either
+ * of them can be gone when the write completes.
+ */
+struct dl_write {
+	enum dl_write_magic magic;
+	const struct guid *id;		/**< Download ID (atom) */
+	const struct guid *fi_guid;	/**< Fileinfo GUID (atom) */
+	filesize_t from;			/**< Start of written range */
+	filesize_t to;				/**< End of written range (excluded) */
+};
+
+static inline void
+dl_write_check(const struct dl_write * const dw)
+{
+	g_assert(dw != NULL);
+	g_assert(DL_WRITE_MAGIC == dw->magic);
+}
+
+static void
+dl_write_free(struct dl_write *dw)
+{
+	dl_write_check(dw);
+
+	atom_guid_free_null(&dw->id);
+	atom_guid_free_null(&dw->fi_guid);
+	dw->magic = 0;
+	WFREE(dw);
+}
+
+/**
+ * Stop reading from a source, whose data cannot be written for now.
+ */
+static void
+download_rx_suspend(struct download *d)
+{
+	g_assert(d->rx != NULL);
+
+	if (d->write_throttled || d->write_parked)
+		return;					/* Already suspended */
+
+	rx_disable(d->rx);
+	d->bio = NULL;				/* Was a copy via rx_bio_source(), now freed */
+}
+
+/**
+ * Resume reading from a source, unless it is still suspended for another
+ * reason.
+ */
+static void
+download_rx_resume(struct download *d)
+{
+	g_assert(d->rx != NULL);
+
+	if (d->write_throttled || d->write_parked)
+		return;					/* Still suspended */
+
+	rx_enable(d->rx);
+	d->bio = rx_bio_source(d->rx);
+	d->last_update = tm_time();	/* Source was not stalling */
+}
+
+/**
+ * Stop reading from a source until the write-behind layer is no longer
+ * congested, instead of letting the source buffer more data.
+ */
+static void
+download_write_throttle(struct download *d)
+{
+	download_check(d);
+
+	if (d->write_throttled)
+		return;
+
+	download_rx_suspend(d);
+	d->write_throttled = TRUE;
+	download_throttled++;
+}
+
+/**
+ * Resume reading from all the throttled sources, once enough data have been
+ * written for the write-behind layer to no longer be congested.
+ */
+static void
+download_write_unthrottle(void)
+{
+	hash_list_iter_t *iter;
+
+	if (0 == download_throttled || writeback_congested())
+		return;
+
+	iter = hash_list_iterator(sl_downloads);
+
+	while (hash_list_iter_has_next(iter)) {
+		struct download *d = hash_list_iter_next(iter);
+
+		download_check(d);
+
+		if (d->write_throttled) {
+			g_assert(download_throttled != 0);
+			d->write_throttled = FALSE;
+			download_throttled--;
+			download_rx_resume(d);
+		}
+	}
+
+	hash_list_iter_release(&iter);
+
+	g_assert(0 == download_throttled);
+}
+
+/**
+ * Stop reading from a source that needs its pending writes to be completed
+ * before it can decide what to do next.  It will be resumed by the
+ * completion callback of its last write.
+ *
+ * @param d			the download
+ * @param trimmed	whether data were trimmed during the last flush
+ */
+static void
+download_write_park(struct download *d, bool trimmed)
+{
+	download_check(d);
+	g_assert(!d->write_parked);
+	g_assert(d->writes_pending != 0);
+
+	download_rx_suspend(d);
+	d->write_parked = TRUE;
+	d->write_trimmed = booleanize(trimmed);
+}
+
+/**
+ * Forget that a stopping source was suspended, since its RX stack is going
+ * to be freed anyway.
+ */
+static void
+download_write_unsuspend(struct download *d)
+{
+	if (d->write_throttled) {
+		g_assert(download_throttled != 0);
+		d->write_throttled = FALSE;
+		download_throttled--;
+	}
+
+	d->write_parked = FALSE;
+}
+
+/**
+ * Launch the verification of a file completed by the asynchronous write of
+ * a source which was stopped meanwhile.
+ *
+ * Receiving sources notice by themselves that the file is complete, and
+ * so do the sources which are still establishing their connection.  When
+ * there are none, we stop the remaining sources and verify the file
+ * through the first one, as download_resume_bg_tasks() does at startup.
+ */
+static void
+download_written_completed(fileinfo_t *fi)
+{
+	pslist_t *sources, *sl;
+	struct download *vd = NULL;
+
+	file_info_check(fi);
+	g_assert(FILE_INFO_COMPLETE(fi));
+
+	if (download_shutdown || FILE_INFO_FINISHED(fi))
+		return;
+
+	if (fi->flags & (FI_F_VERIFYING | FI_F_PAUSED | FI_F_SEEDING))
+		return;
+
+	sources = file_info_get_sources(fi);
+
+	PSLIST_FOREACH(sources, sl) {
+		struct download *d = sl->data;
+
+		download_check(d);
+
+		if (DOWNLOAD_IS_RUNNING(d))
+			goto done;			/* Will notice that file is complete */
+	}
+
+	PSLIST_FOREACH(sources, sl) {
+		struct download *d = sl->data;
+
+		if (GTA_DL_REMOVED == d->status || (d->flags & DL_F_SUSPENDED))
+			continue;
+
+		if (DOWNLOAD_IS_QUEUED(d))
+			download_unqueue(d, FALSE);
+
+		if (!DOWNLOAD_IS_STOPPED(d))
+			download_stop(d, GTA_DL_COMPLETED, no_reason);
+
+		if (NULL == vd && DL_LIST_STOPPED == d->list_idx)
+			vd = d;
+	}
+
+	if (vd != NULL)
+		download_verify_sha1(vd);
+
+done:
+	pslist_free(sources);
+}
+
+/**
+ * Completion callback for asynchronous writes.
+ *
+ * The written range is marked DONE, and the download is told about failures
+ * so that it stops at its next flush.  Sources waiting for writes to be
+ * completed are resumed.
+ *
+ * The download may have been stopped since it submitted the write, in which
+ * case the range it was writing to is no longer BUSY, but the data we wrote
+ * are still accounted for.
+ */
+static void
+download_written(void *arg, size_t written, int error, uint ms)
+{
+	struct dl_write *dw = arg;
+	size_t size;
+	struct download *d;
+	const struct download *writer = NULL;
+	fileinfo_t *fi;
+	bool completed = FALSE;
+
+	dl_write_check(dw);
+
+	size = dw->to - dw->from;
+	d = hikset_lookup(dl_by_id, dw->id);
+	fi = file_info_by_guid(dw->fi_guid);
+
+	if (d != NULL) {
+		download_check(d);
+		g_assert(d->writes_pending != 0);
+
+		d->writes_pending--;
+		d->writes_queued -= MIN(size, d->writes_queued);
+		d->write_latency = (d->write_latency * 3 + ms) / 4;
+
+		if (error != 0 && 0 == d->write_error && DOWNLOAD_IS_ACTIVE(d))
+			d->write_error = error;
+
+		if (d->file_info == fi)
+			writer = d;			/* Did not switch to another file meanwhile */
+	}
+
+	if (fi != NULL) {
+		if (fi->buffered >= size)
+			fi->buffered -= size;
+		else
+			fi->buffered = 0;		/* Not critical, be fault-tolerant */
+
+		/*
+		 * If the file was completed by other sources meanwhile, our data
+		 * is irrelevant.
 		 */
 
-		if (!fi->use_swarming && d->chunk.start != fi->done) {
-			g_message("file '%s' changed size (now %s, but was %s)",
-					fi->pathname, uint64_to_string(sb.st_size),
-					uint64_to_string2(d->chunk.start));
-			download_queue_delay(d, GNET_PROPERTY(download_retry_stopped_delay),
-					_("Stopped (Output file size changed)"));
-			goto out;
+		if (written != 0 && !FILE_INFO_COMPLETE(fi)) {
+			file_info_written(fi, writer, dw->from, dw->from + written);
+			gnet_prop_set_guint64_val(PROP_DL_BYTE_COUNT,
+				GNET_PROPERTY(dl_byte_count) + written);
+			completed = FILE_INFO_COMPLETE(fi);
 		}
 	}
 
-	{
-		ssize_t r;
+	if (error != 0) {
+		download_write_error(error);
+		g_warning("write of %zu bytes at offset %s to file \"%s\" failed: %s",
+			size - written, filesize_to_string(dw->from + written),
+			NULL == fi ? "<removed>" : filepath_basename(fi->pathname),
+			g_strerror(error));
+	}
 
-		data = walloc(d->chunk.overlap);
-		g_assert(d->chunk.start >= d->chunk.overlap);
-		r = file_object_pread(fo, data, d->chunk.overlap,
-				d->chunk.start - d->chunk.overlap);
+	download_write_unthrottle();
 
-		if ((ssize_t) -1 == r) {
-			const char *error = g_strerror(errno);
-			g_warning("cannot read resuming data for \"%s\": %m",
-					fi->pathname);
-			download_stop(d, GTA_DL_ERROR, _("Can't read resume data: %s"),
-				error);
-			goto out;
-		} else if ((size_t) r != d->chunk.overlap) {
-			g_warning(
-				"short read (got %zu instead of %u bytes at offset %zu) "
-				"on resuming data for \"%s\"",
-				r, d->chunk.overlap, (size_t) d->chunk.start - d->chunk.overlap,
-				fi->pathname);
-			download_stop(d, GTA_DL_ERROR, _("Short read on resume data"));
-			goto out;
-		}
-	}
+	if (d != NULL && d->write_parked && 0 == d->writes_pending)
+		download_write_unpark(d);
 
-	if (!buffers_match(d, data, d->chunk.overlap)) {
-		/*
-		 * Resuming data mismatch.
-		 */
+	/*
+	 * Resuming the source may have changed the file status, look it up
+	 * again before checking whether someone has to verify it.
+	 */
 
-		if (GNET_PROPERTY(download_debug) > 1) {
-			g_debug("%u overlapping bytes UNMATCHED at offset %s for \"%s\"",
-				(uint) d->chunk.overlap,
-				uint64_to_string(d->chunk.start - d->chunk.overlap),
-				download_basename(d));
-        }
+	if (completed) {
+		fi = file_info_by_guid(dw->fi_guid);
+		if (fi != NULL && FILE_INFO_COMPLETE(fi))
+			download_written_completed(fi);
+	}
 
-		d->pos += d->buffers->held;	/* Keep track of what we read so far */
-		d->pos -= d->chunk.overlap;	/* Overlap did not count as chunk data */
-		d->mismatches++;
-		buffers_discard(d);			/* Discard everything we read so far */
+	dl_write_free(dw);
+}
 
-		if (GNET_PROPERTY(dl_remove_file_on_mismatch)) {
-			download_bad_source(d);	/* Until proven otherwise if we resume it */
-			download_queue(d, _("Resuming data mismatch @ %s"),
-				uint64_to_string(d->chunk.start - d->chunk.overlap));
-			download_remove_file(d, TRUE);
-			goto out;
-		}
+/**
+ * Hand over the buffered data to the writing thread.
+ *
+ * The range stays BUSY until the data is written, at which time it will be
+ * marked DONE, but the download can go on receiving data meanwhile.
+ *
+ * @return TRUE if data will be written asynchronously, FALSE if they have
+ * to be written synchronously.
+ */
+static bool
+download_write_submit(struct download *d)
+{
+	struct dl_buffers *b;
+	struct dl_write *dw;
+	size_t size;
 
-		/*
-		 * If we have not seen too many resuming mismatches from this source,
-		 * maybe we got fooled earlier and downloaded some bad data.  Give
-		 * this source a chance: if we don't have too much data requested,
-		 * simply ignore them and get a chance to issue a new request later.
-		 *		--RAM, 2007-05-05
-		 */
+	download_check(d);
+	b = d->buffers;
+	g_assert(b != NULL);
+	g_assert(b->held > 0);
 
-		download_backout(d);	/* Forget some bytes at mismatch point */
+	/*
+	 * When the file size is not known, fi->done is updated by assuming
+	 * we download sequentially, hence data must be written synchronously.
+	 */
 
-		if (
-			d->mismatches <= DOWNLOAD_MAX_IGN_REQS &&
-			d->keep_alive &&
-			download_can_ignore(d)
-		) {
-			success = TRUE;			/* Act as if overlapping was OK */
-			gnet_stats_inc_general(GNR_IGNORING_AFTER_MISMATCH);
-			goto out;
-		}
+	if (!d->file_info->file_size_known || !writeback_enabled())
+		return FALSE;
 
-		download_bad_source(d);	/* Until proven otherwise if we resume it */
+	size = b->held;
 
-		/*
-		 * Don't always keep this source, and since there is doubt,
-		 * leave it to randomness.
-		 */
+	WALLOC0(dw);
+	dw->magic = DL_WRITE_MAGIC;
+	dw->id = atom_guid_get(d->id);
+	dw->fi_guid = atom_guid_get(d->file_info->guid);
+	dw->from = d->pos;
+	dw->to = d->pos + size;
 
-		if (random_value(99) >= 50)
-			download_stop(d, GTA_DL_ERROR,
-				_("Resuming data mismatch @ %s"),
-				uint64_to_string(d->chunk.start - d->chunk.overlap));
-		else
-			download_queue_delay(d, GNET_PROPERTY(download_retry_busy_delay),
-				_("Resuming data mismatch @ %s"),
-				uint64_to_string(d->chunk.start - d->chunk.overlap));
-		goto out;
+	if (
+		!writeback_submit(d->out_file, d->pos, b->list, size,
+			download_written, dw)
+	) {
+		dl_write_free(dw);
+		return FALSE;
 	}
 
-	/*
-	 * Great, resuming data matched!
-	 * Remove the overlapping data from the read buffers.
-	 */
+	buffers_detach(d);
 
-	buffers_check_held(d);
-	buffers_strip_leading(d, d->chunk.overlap);
-	buffers_check_held(d);
+	d->pos += size;
+	d->writes_pending++;
+	d->writes_queued += size;
 
-	if (GNET_PROPERTY(download_debug) > 3)
-		g_debug("%u overlapping bytes MATCHED "
-			"at offset %s for \"%s\"",
-			(uint) d->chunk.overlap,
-			uint64_to_string(d->chunk.start - d->chunk.overlap),
-			download_basename(d));
+	return TRUE;
+}
 
-	success = TRUE;
+/**
+ * Check whether an asynchronous write of the download failed.
+ *
+ * The data we hold cannot be saved either and are discarded.
+ *
+ * @param d			the download
+ * @param may_stop	whether we can stop the download on errors
+ *
+ * @return TRUE if OK, FALSE on failure.
+ */
+static bool
+download_write_check(struct download *d, bool may_stop)
+{
+	const char *error;
 
-out:
-	WFREE_NULL(data, d->chunk.overlap);
-	file_object_release(&fo);
+	download_check(d);
 
-	return success;
+	if G_LIKELY(0 == d->write_error)
+		return TRUE;
+
+	error = g_strerror(d->write_error);
+	d->write_error = 0;
+
+	if (d->buffers != NULL && d->buffers->held > 0)
+		buffers_discard(d);
+
+	if (may_stop)
+		download_queue_delay(d, GNET_PROPERTY(download_retry_busy_delay),
+			_("Can't save data: %s"), error);
+
+	return FALSE;
 }
 
 /**
  * Flush buffered data to disk.
  *
+ * Data are handed over to the writing thread when possible, in which case
+ * they are not yet on disk when we return.
+ *
  * @param d			the download to flush
  * @param trimmed	if not NULL, filled with whether we trimmed data or not
  * @param may_stop	whether we can stop the download on errors
@@ -9216,6 +9957,12 @@ download_flush(struct download *d, bool *trimmed, bool may_stop)
 		*trimmed = FALSE;
 	}
 
+	if (!download_write_check(d, may_stop))
+		return FALSE;
+
+	if (download_write_submit(d))
+		return TRUE;
+
 	/*
 	 * writev() and others do not necessarily flush the complete buffer
 	 * to disk, especially if the configured buffer size is large. As
@@ -9274,19 +10021,7 @@ download_flush(struct download *d, bool *trimmed, bool may_stop)
 	if ((ssize_t) -1 == written) {
 		const char *error;
 
-		switch (errno) {
-		case ENOSPC:	/* No space left */
-			queue_frozen_on_write_error = TRUE;
-			/* FALL THROUGH */
-		case EDQUOT:	/* quota exceeded */
-		case EROFS:		/* read-only filesystem */
-		case EIO:		/* I/O error */
-			if (!download_queue_is_frozen()) {
-				download_freeze_queue();
-				g_warning("freezing download queue due to write error: %m");
-			}
-			break;
-		}
+		download_write_error(errno);
 
 	   	error = g_strerror(errno);
 		g_warning("write of %lu bytes to file \"%s\" failed: %m",
@@ -9509,7 +10244,6 @@ download_write_data(struct download *d)
 	struct dl_buffers *b;
 	fileinfo_t *fi;
 	bool trimmed = FALSE;
-	enum dl_chunk_status status = DL_CHUNK_BUSY;
 	bool should_flush;
 
 	download_check(d);
@@ -9520,6 +10254,14 @@ download_write_data(struct download *d)
 	g_assert(fi->lifecount > 0);
 	g_assert(fi->lifecount <= fi->refcount);
 
+	/*
+	 * Data still delivered by the RX stack after we suspended reading to
+	 * wait for our writes are only buffered until we are resumed.
+	 */
+
+	if (d->write_parked)
+		return TRUE;
+
 	/*
 	 * If we have an overlapping window and DL_F_OVERLAPPED is not set yet,
 	 * then the leading data we have in the buffer are overlapping data.
@@ -9586,6 +10328,51 @@ download_write_data(struct download *d)
 	if (!download_flush(d, &trimmed, TRUE))
 		return FALSE;
 
+	/*
+	 * Unless we are still within our requested chunk, what we do next
+	 * depends on the data we wrote being accounted for.  Moreover, a source
+	 * only owns one BUSY chunk, so it cannot request another one whilst
+	 * data is still being written to the current one.  Park the source
+	 * until its pending writes are completed then.
+	 *
+	 * Otherwise, stop reading from the source if the data of all the
+	 * sources cannot be written fast enough.
+	 */
+
+	if (0 != d->writes_pending) {
+		if (
+			d->pos >= d->chunk.end ||
+			(fi->use_swarming &&
+				DL_CHUNK_BUSY != file_info_pos_status(fi, d->pos))
+		) {
+			download_write_park(d, trimmed);
+			return TRUE;
+		}
+
+		if (writeback_congested())
+			download_write_throttle(d);
+	}
+
+	return download_write_next(d, trimmed);
+}
+
+/**
+ * Decide what to do next, once the data written by the download have been
+ * accounted for.
+ *
+ * @param d			the download
+ * @param trimmed	whether data were trimmed during the last flush
+ *
+ * @return FALSE if an error occurred.
+ */
+static bool
+download_write_next(struct download *d, bool trimmed)
+{
+	fileinfo_t *fi = d->file_info;
+	enum dl_chunk_status status = DL_CHUNK_BUSY;
+
+	download_check(d);
+
 	/*
 	 * End download if we have completed it.
 	 */
@@ -9712,6 +10499,28 @@ partial_done:
 	}
 }
 
+/**
+ * Resume a source parked by download_write_park(), once all its writes
+ * have been completed.
+ */
+static void
+download_write_unpark(struct download *d)
+{
+	bool trimmed;
+
+	download_check(d);
+	g_assert(d->write_parked);
+	g_assert(0 == d->writes_pending);
+	g_assert(DOWNLOAD_IS_ACTIVE(d));
+
+	trimmed = d->write_trimmed;
+	d->write_parked = FALSE;
+	download_rx_resume(d);
+
+	if (download_write_check(d, TRUE))
+		(void) download_write_next(d, trimmed);
+}
+
 #if 0 /* UNUSED */
 /**
  * Refresh IP:port, download index and name, by looking at the new location
@@ -12886,6 +13695,7 @@ rx_stack_setup:
 				error);
 			return;
 		}
+		file_info_preallocate(fi, d->out_file);
 	}
 
 file_opened:
@@ -15426,10 +16236,14 @@ download_verifying_done(struct download *d)
 
 /**
  * Called when download verification is finished and digest is known.
+ *
+ * When the TTH was computed along with the SHA1, the verification context
+ * is given as ``bitprint'' so that the TTH can be checked without reading
+ * the file again.
  */
 static void
 download_verify_sha1_done(struct download *d,
-	const struct sha1 *sha1, uint elapsed)
+	const struct sha1 *sha1, uint elapsed, const struct verify *bitprint)
 {
 	fileinfo_t *fi;
 
@@ -15457,8 +16271,22 @@ download_verify_sha1_done(struct download *d,
 
 	ignore_add_sha1(file_info_readable_filename(fi), fi->cha1);
 
+	/*
+	 * When the TTH we computed matches, persist its leaves right now: if
+	 * the file is seeded, file_info_mark_completed() will then not need
+	 * to hash it again to serve THEX requests.
+	 */
+
+	if (bitprint != NULL && tth_eq(fi->tth, verify_bitprint_tth(bitprint))) {
+		tth_cache_insert(fi->tth, verify_bitprint_leaves(bitprint),
+			verify_bitprint_leave_count(bitprint));
+	}
+
 	if (fi->tth && (!has_good_sha1(d) || GNET_PROPERTY(tigertree_debug) > 1)) {
-		download_verify_tigertree(d);
+		if (bitprint != NULL)
+			download_verify_tigertree_computed(d, bitprint);
+		else
+			download_verify_tigertree(d);
 	} else {
 		download_verifying_done(d);
 	}
@@ -15528,7 +16356,7 @@ download_verify_sha1_callback(const struct verify *ctx,
 	case VERIFY_DONE:
 		gnet_prop_set_boolean_val(PROP_SHA1_VERIFYING, FALSE);
 		download_verify_sha1_done(d,
-			verify_sha1_digest(ctx), verify_elapsed(ctx));
+			verify_sha1_digest(ctx), verify_elapsed(ctx), NULL);
 		return TRUE;
 	case VERIFY_ERROR:
 		gnet_prop_set_boolean_val(PROP_SHA1_VERIFYING, FALSE);
@@ -15543,8 +16371,35 @@ download_verify_sha1_callback(const struct verify *ctx,
 	return FALSE;
 }
 
+static bool
+download_verify_bitprint_callback(const struct verify *ctx,
+	enum verify_status status, void *user_data)
+{
+	struct download *d = user_data;
+
+	download_check(d);
+	g_assert(!FILE_INFO_FINISHED(d->file_info));
+
+	/*
+	 * The combined computation reports as a SHA1 verification, the TTH
+	 * being checked only once the SHA1 is known.
+	 */
+
+	if (VERIFY_DONE == status) {
+		gnet_prop_set_boolean_val(PROP_SHA1_VERIFYING, FALSE);
+		download_verify_sha1_done(d,
+			verify_bitprint_sha1(ctx), verify_elapsed(ctx), ctx);
+		return TRUE;
+	}
+
+	return download_verify_sha1_callback(ctx, status, user_data);
+}
+
 /**
  * Main entry point for verifying the SHA1 of a completed download.
+ *
+ * When the TTH of the file is known, it is computed along with the SHA1
+ * so that the file is read only once.
  */
 static void
 download_verify_sha1(struct download *d)
@@ -15593,8 +16448,14 @@ download_verify_sha1(struct download *d)
 	queue_suspend_downloads_with_file(fi, TRUE);
 	d->flags &= ~DL_F_CLONED;		/* Has to be persisted until SHA-1 is OK */
 
-	inserted = verify_sha1_enqueue(TRUE, download_pathname(d),
-					download_filesize(d), download_verify_sha1_callback, d);
+	if (fi->tth != NULL) {
+		inserted = verify_bitprint_enqueue(TRUE, download_pathname(d),
+						download_filesize(d),
+						download_verify_bitprint_callback, d);
+	} else {
+		inserted = verify_sha1_enqueue(TRUE, download_pathname(d),
+						download_filesize(d), download_verify_sha1_callback, d);
+	}
 
 	g_assert(inserted); /* There cannot be duplicates */
 
@@ -15789,6 +16650,38 @@ download_verify_tigertree_done(struct download *d,
 	}
 }
 
+/**
+ * Check the TTH computed along with the SHA1 of the completed download.
+ */
+static void
+download_verify_tigertree_computed(struct download *d,
+	const struct verify *bitprint)
+{
+	fileinfo_t *fi;
+
+	download_check(d);
+	fi = d->file_info;
+	file_info_check(fi);
+	g_assert(FILE_INFO_COMPLETE(fi));
+	g_assert(d->list_idx == DL_LIST_STOPPED);
+	g_assert(!(fi->flags & FI_F_VERIFYING));
+
+	if (GNET_PROPERTY(verify_debug) > 1) {
+		g_debug("checking TTH computed with SHA-1 of completed %s",
+			download_pathname(d));
+	}
+
+	download_set_status(d, GTA_DL_VERIFYING);
+	gnet_stats_inc_general(GNR_TTH_VERIFICATIONS);
+	fi->flags |= FI_F_VERIFYING;
+	fi->tth_check = TRUE;
+
+	download_verify_tigertree_done(d,
+		verify_bitprint_tth(bitprint), verify_elapsed(bitprint),
+		verify_bitprint_leaves(bitprint),
+		verify_bitprint_leave_count(bitprint));
+}
+
 /**
  * Called when we cannot verify the TTH for the file (I/O error, etc...).
  */
@@ -16062,6 +16955,7 @@ download_close(void)
 	download_clear_stopped(TRUE, TRUE, TRUE, TRUE, TRUE);
 	download_remove_all();
 	download_free_removed();
+	writeback_close();
 
 	hash_list_free(&sl_downloads);
 	hash_list_free(&sl_unqueued);
@@ -17030,6 +17924,14 @@ download_timer(time_t now)
 				}
 			}
 
+			/*
+			 * Sources we stopped reading from whilst waiting for data to
+			 * be written are not stalling: do not let them time out.
+			 */
+
+			if (d->write_throttled || d->write_parked)
+				d->last_update = now;
+
 			/*
 			 * See whether it's not time to issue the next request ahead
 			 * of time (HTTP pipelining) to reduce latency between chunk
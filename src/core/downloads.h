@@ -44,6 +44,47 @@
 #include "if/core/downloads.h"
 #include "if/core/search.h"			/* For gnet_host_vec_t */
 
+enum download_write_info_magic { DOWNLOAD_WRITE_INFO_MAGIC = 0x1c5e0b97 };
+
+/**
+ * Asynchronous writing statistics of a download source.
+ */
+typedef struct download_write_info {
+	enum download_write_info_magic magic;
+	const char *host;			/**< Source host (atom) */
+	const char *name;			/**< File name (atom) */
+	uint32 pending;				/**< Writes in progress */
+	size_t queued;				/**< Amount of data being written */
+	uint latency;				/**< Average write latency, in ms */
+} download_write_info_t;
+
+static inline void
+download_write_info_check(const struct download_write_info * const dwi)
+{
+	g_assert(dwi != NULL);
+	g_assert(DOWNLOAD_WRITE_INFO_MAGIC == dwi->magic);
+}
+
+/**
+ * Download scheduler statistics.
+ *
+ * Rates are averaged over the scheduling passes, which happen every second.
+ */
+typedef struct download_sched_info {
+	size_t servers;				/**< Amount of known servers */
+	size_t ready;				/**< Servers ready to be scheduled */
+	size_t sleeping;			/**< Servers waiting for their time to come */
+	uint64 runs;				/**< Scheduling passes */
+	uint64 woken;				/**< Servers whose time came */
+	uint64 visits;				/**< Servers visited */
+	uint64 examined;			/**< Waiting downloads examined */
+	uint64 started;				/**< Downloads started */
+	uint64 scan_us;				/**< Total time spent scheduling, in usecs */
+	double visit_rate;			/**< Servers visited per pass */
+	double start_rate;			/**< Downloads started per pass */
+	double scan_cost;			/**< Average pass duration, in usecs */
+} download_sched_info_t;
+
 /*
  * Global Functions.
  */
@@ -62,6 +103,7 @@ void download_stop(struct download *, download_status_t,
 	const char *, ...) G_PRINTF(3, 4);
 void download_stop_v(struct download *d, download_status_t new_status,
     const char * reason, va_list ap);
+void download_bad_slice(struct download *d, filesize_t from, filesize_t to);
 void download_push_ack(struct gnutella_socket *);
 void download_forget(struct download *, bool unavailable);
 bool download_start_prepare(struct download *d);
@@ -145,6 +187,10 @@ void download_abort(struct download *d);
 void download_got_fw_node_info(const struct guid *guid,
 	host_addr_t addr, uint16 port, const char *fwinfo);
 
+struct pslist *download_write_info_list(void);
+void download_write_info_list_free_null(struct pslist **sl_ptr);
+void download_sched_info(download_sched_info_t *dsi);
+
 const char *server_host_info(const struct dl_server *server);
 const char *download_status_to_string(const struct download *d);
 
@@ -72,13 +72,13 @@
 #include "lib/concat.h"
 #include "lib/crash.h"
 #include "lib/cstr.h"
-#include "lib/eclist.h"
 #include "lib/endian.h"
 #include "lib/entropy.h"
 #include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/file_object.h"
 #include "lib/filename.h"
+#include "lib/fs_free_space.h"
 #include "lib/glib-missing.h"
 #include "lib/halloc.h"
 #include "lib/header.h"
@@ -120,6 +120,7 @@
 #define FI_DHT_QUEUED_DELAY	150			/**< Penalty per queued source */
 #define FI_DHT_RECV_DELAY	600			/**< Penalty per active source */
 #define FI_DHT_RECV_THRESH	5			/**< No query if that many active */
+#define FI_PREALLOC_SPARE	(64 * 1024 * 1024)	/**< Free space to leave */
 
 /*
  * Aligning requested blocks is just a convenience, to make it easier later
@@ -139,6 +140,11 @@ enum dl_file_chunk_magic { DL_FILE_CHUNK_MAGIC = 0x563b483d };
  * These are linked to form the chunklist, the list of all the chunks defined
  * for the file and which are either completed, reserved, or empty (not yet
  * downloaded).
+ *
+ * Chunks are also indexed by offset in the fi->chunkmap tree, and the EMPTY
+ * and BUSY ones in fi->chunkholes and fi->chunkbusy respectively, so that
+ * positional lookups do not need to walk the whole list, which can become
+ * very long for large files fetched from many sources.
  */
 struct dl_file_chunk {
 	enum dl_file_chunk_magic magic;
@@ -147,6 +153,8 @@ struct dl_file_chunk {
 	filesize_t to;					/**< Range offset end (byte EXCLUDED) */
 	const download_t *download;		/**< Download which "reserved" range */
 	slink_t lk;						/**< Embedded one-way link */
+	rbnode_t node;					/**< Embedded node in fi->chunkmap */
+	rbnode_t snode;					/**< Embedded node in the status tree */
 };
 
 static inline void
@@ -549,6 +557,9 @@ struct trailer {
 static fileinfo_t *file_info_retrieve_binary(const char *pathname);
 static void fi_free(fileinfo_t *fi);
 static void fi_update_seen_on_network(gnet_src_t srcid);
+static void fi_slices_written(fileinfo_t *fi, const struct download *d,
+	filesize_t from, filesize_t to);
+static void fi_slices_scan(fileinfo_t *fi);
 static const char *file_info_new_outname(const char *dir, const char *name);
 static bool looks_like_urn(const char *filename);
 
@@ -675,6 +686,294 @@ dl_file_chunk_free(struct dl_file_chunk **fc_ptr)
 	}
 }
 
+/**
+ * Compares two chunks so that two chunks are equal when they overlap.
+ */
+static int
+fi_chunk_overlap_cmp(const void *a, const void *b)
+{
+	const struct dl_file_chunk *ca = a, *cb = b;
+
+	if (ca->to <= cb->from)			/* `to' is NOT part of the chunk range */
+		return -1;
+
+	if (cb->to <= ca->from)
+		return +1;
+
+	return 0;		/* Overlapping chunks are equal */
+}
+
+/**
+ * @return the tree indexing the chunks bearing the given status, NULL if
+ * the chunks with that status are not indexed separately.
+ */
+static erbtree_t *
+fi_chunk_status_tree(fileinfo_t *fi, enum dl_chunk_status status)
+{
+	switch (status) {
+	case DL_CHUNK_EMPTY:	return &fi->chunkholes;
+	case DL_CHUNK_BUSY:		return &fi->chunkbusy;
+	case DL_CHUNK_DONE:		break;
+	}
+
+	return NULL;
+}
+
+/**
+ * Index chunk in the trees of the fileinfo.
+ */
+static void
+fi_chunk_index(fileinfo_t *fi, struct dl_file_chunk *fc)
+{
+	erbtree_t *t;
+	void *old;
+
+	dl_file_chunk_check(fc);
+
+	old = erbtree_insert(&fi->chunkmap, &fc->node);
+	g_assert_log(NULL == old,
+		"%s(): chunk [%s, %s] overlaps with existing chunk in \"%s\"",
+		G_STRFUNC, filesize_to_string(fc->from), filesize_to_string2(fc->to),
+		fi->pathname);
+
+	t = fi_chunk_status_tree(fi, fc->status);
+	if (t != NULL)
+		erbtree_insert(t, &fc->snode);
+}
+
+/**
+ * Remove chunk from the trees of the fileinfo.
+ */
+static void
+fi_chunk_unindex(fileinfo_t *fi, struct dl_file_chunk *fc)
+{
+	erbtree_t *t;
+
+	dl_file_chunk_check(fc);
+
+	erbtree_remove(&fi->chunkmap, &fc->node);
+
+	t = fi_chunk_status_tree(fi, fc->status);
+	if (t != NULL)
+		erbtree_remove(t, &fc->snode);
+}
+
+/**
+ * Index all the chunks of the fileinfo, which must form a consistent list.
+ */
+static void
+fi_chunk_index_all(fileinfo_t *fi)
+{
+	struct dl_file_chunk *fc;
+
+	g_assert(0 == erbtree_count(&fi->chunkmap));
+
+	ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
+		fi_chunk_index(fi, fc);
+	}
+}
+
+/**
+ * Change the status of a chunk, moving it to the proper status tree.
+ */
+static void
+fi_chunk_set_status(fileinfo_t *fi, struct dl_file_chunk *fc,
+	enum dl_chunk_status status)
+{
+	erbtree_t *t;
+
+	dl_file_chunk_check(fc);
+
+	if (fc->status == status)
+		return;
+
+	t = fi_chunk_status_tree(fi, fc->status);
+	if (t != NULL)
+		erbtree_remove(t, &fc->snode);
+
+	fc->status = status;
+
+	t = fi_chunk_status_tree(fi, status);
+	if (t != NULL)
+		erbtree_insert(t, &fc->snode);
+}
+
+/**
+ * Append chunk at the end of the chunklist.
+ */
+static void
+fi_chunk_append(fileinfo_t *fi, struct dl_file_chunk *fc)
+{
+	eslist_append(&fi->chunklist, fc);
+	fi_chunk_index(fi, fc);
+}
+
+/**
+ * Insert new chunk `nfc' after chunk `fc' in the chunklist.
+ *
+ * The range of `fc' must have already been adjusted so that the two chunks
+ * do not overlap.
+ */
+static void
+fi_chunk_insert_after(fileinfo_t *fi,
+	struct dl_file_chunk *fc, struct dl_file_chunk *nfc)
+{
+	eslist_insert_after(&fi->chunklist, fc, nfc);
+	fi_chunk_index(fi, nfc);
+}
+
+/**
+ * Remove the chunk following `fc' in the chunklist.
+ *
+ * @return the removed chunk.
+ */
+static struct dl_file_chunk *
+fi_chunk_remove_after(fileinfo_t *fi, struct dl_file_chunk *fc)
+{
+	struct dl_file_chunk *removed;
+
+	removed = eslist_remove_after(&fi->chunklist, fc);
+	fi_chunk_unindex(fi, removed);
+
+	return removed;
+}
+
+/**
+ * Lookup chunk holding the byte at the given offset.
+ *
+ * @return the chunk found in the tree, NULL if none.
+ */
+static struct dl_file_chunk *
+fi_chunk_lookup(const erbtree_t *t, filesize_t pos)
+{
+	struct dl_file_chunk key;
+
+	key.from = pos;
+	key.to = pos + 1;
+
+	return erbtree_lookup(t, &key);
+}
+
+/**
+ * Lookup first chunk holding the byte at the given offset or lying after it.
+ *
+ * @return the chunk found in the tree, NULL if none.
+ */
+static struct dl_file_chunk *
+fi_chunk_lookup_ceil(const erbtree_t *t, filesize_t pos)
+{
+	struct dl_file_chunk key;
+
+	key.from = pos;
+	key.to = pos + 1;
+
+	return erbtree_lookup_ceil(t, &key);
+}
+
+/**
+ * Find the first empty chunk lying at or after the given chunk, wrapping
+ * around to the first empty chunk of the file when there is none.
+ *
+ * @param fi		the fileinfo
+ * @param chunk		the chunk where the search starts (NULL for file start)
+ *
+ * @return the empty chunk found, NULL if there are no empty chunks.
+ */
+static const struct dl_file_chunk *
+fi_chunk_hole_after(const fileinfo_t *fi, const struct dl_file_chunk *chunk)
+{
+	const struct dl_file_chunk *fc = NULL;
+
+	if (chunk != NULL)
+		fc = fi_chunk_lookup_ceil(&fi->chunkholes, chunk->from);
+
+	if (NULL == fc)
+		fc = erbtree_head(&fi->chunkholes);
+
+	return fc;
+}
+
+/**
+ * Find the first empty chunk intersecting with the ranges offered by a
+ * source, starting with the chunks lying at or after the given chunk and
+ * then wrapping around to the start of the file.
+ *
+ * The search is driven by the offered ranges, which are usually far less
+ * numerous than the empty chunks of a fragmented file: each range costs a
+ * single lookup in the tree of empty chunks.
+ *
+ * @param fi		the fileinfo
+ * @param ranges	the ranges offered by the source
+ * @param chunk		the chunk where the search starts (NULL for file start)
+ * @param from		where the start of the intersection is written
+ * @param to		where the end of the intersection is written (excluded)
+ *
+ * @return TRUE if we found an empty chunk intersecting with the ranges.
+ */
+static bool
+fi_find_offered_hole(const fileinfo_t *fi, const http_rangeset_t *ranges,
+	const struct dl_file_chunk *chunk, filesize_t *from, filesize_t *to)
+{
+	filesize_t offset = NULL == chunk ? 0 : chunk->from;
+	int pass;
+
+	/*
+	 * Since `offset' is a chunk boundary, empty chunks lie either entirely
+	 * before or entirely after it.  The first pass looks at the ranges
+	 * after the offset, the second one at the ranges before.
+	 */
+
+	for (pass = 0; pass < 2; pass++) {
+		const http_range_t *r;
+
+		for (
+			r = http_range_first(ranges);
+			r != NULL;
+			r = http_range_next(ranges, r)
+		) {
+			const struct dl_file_chunk *fc;
+			filesize_t start, end;
+
+			/*
+			 * NB: Contrary to fi chunks, the upper boundary of the range
+			 * (r->end) is part of the range.
+			 */
+
+			start = r->start;
+			end = r->end + 1;
+
+			if (0 == pass) {
+				if (end <= offset)
+					continue;
+				start = MAX(start, offset);
+			} else {
+				if (start >= offset)
+					break;
+				end = MIN(end, offset);
+			}
+
+			fc = fi_chunk_lookup_ceil(&fi->chunkholes, start);
+
+			if (fc != NULL && fc->from < end) {
+				dl_file_chunk_check(fc);
+
+				/*
+				 * Intersect range and chunk, [from, to[ is the result.
+				 */
+
+				*from = MAX(start, fc->from);
+				*to = MIN(end, fc->to);
+
+				g_assert(*from < *to);		/* Intersection is non-empty */
+
+				return TRUE;
+			}
+		}
+	}
+
+	return FALSE;
+}
+
 static struct dl_avail_chunk *
 dl_avail_chunk_alloc(void)
 {
@@ -1010,6 +1309,7 @@ fi_tigertree_free(fileinfo_t *fi)
 	if (fi->tigertree.leaves != NULL) {
 		g_assert(fi->tigertree.num_leaves != 0);
 		WFREE_ARRAY(fi->tigertree.leaves, fi->tigertree.num_leaves);
+		XFREE_NULL(fi->tigertree.slices);
 		ZERO(&fi->tigertree);
 	}
 }
@@ -1035,6 +1335,9 @@ file_info_got_tigertree(fileinfo_t *fi,
 
 		/* Update the GUI */
 		fi_event_trigger(fi, EV_FI_INFO_CHANGED);
+
+		/* Check the data we already have against the new tree */
+		fi_slices_scan(fi);
 	}
 }
 
@@ -1133,6 +1436,9 @@ file_info_chunklist_free(fileinfo_t *fi)
 {
 	file_info_check(fi);
 
+	erbtree_clear(&fi->chunkmap);
+	erbtree_clear(&fi->chunkholes);
+	erbtree_clear(&fi->chunkbusy);
 	eslist_wfree(&fi->chunklist, sizeof(struct dl_file_chunk));
 }
 
@@ -1306,7 +1612,7 @@ fi_extend_chunklist(fileinfo_t *fi, filesize_t size)
 	fc->from = fi->size;
 	fc->to = size;
 	fc->status = DL_CHUNK_EMPTY;
-	eslist_append(&fi->chunklist, fc);
+	fi_chunk_append(fi, fc);
 
 	/*
 	 * Don't remove/re-insert `fi' from hash tables: when this routine is
@@ -1318,16 +1624,153 @@ fi_extend_chunklist(fileinfo_t *fi, filesize_t size)
 	g_assert(file_info_check_chunklist(fi, TRUE));
 }
 
+/**
+ * Reserve disk space for the range [from, to) of the output file, so that
+ * the filesystem can lay it out contiguously although the data will be
+ * written at random offsets by the various sources.
+ *
+ * Nothing is done when preallocation is disabled, for small files or files
+ * whose size is unknown, or when it would leave the filesystem with too
+ * little free space.
+ */
+static void
+fi_preallocate(fileinfo_t *fi, const file_object_t *fo,
+	filesize_t from, filesize_t to)
+{
+	filesize_t free_space;
+	char *path;
+
+	file_info_check(fi);
+
+	if (!GNET_PROPERTY(download_preallocate))
+		return;
+
+	if (!fi->file_size_known || (fi->flags & (FI_F_TRANSIENT | FI_F_SEEDING)))
+		return;
+
+	if (fi->size < GNET_PROPERTY(download_preallocate_min_size) || from >= to)
+		return;
+
+	path = filepath_directory(fi->pathname);
+	free_space = fs_free_space(path);
+	HFREE_NULL(path);
+
+	if (free_space < to - from + FI_PREALLOC_SPARE) {
+		if (GNET_PROPERTY(fileinfo_debug)) {
+			g_debug("FILEINFO not preallocating %s bytes for \"%s\": "
+				"only %s bytes free",
+				filesize_to_string(to - from), fi->pathname,
+				filesize_to_string2(free_space));
+		}
+		return;
+	}
+
+	if (-1 == file_object_preallocate(fo, from, to - from)) {
+		/*
+		 * Not all filesystems support preallocation, and we do not want
+		 * it emulated by writing to all the blocks: stay silent then.
+		 */
+
+		if (ENOTSUP != errno && EOPNOTSUPP != errno) {
+			g_warning("%s(): cannot preallocate %s bytes at %s in \"%s\": %m",
+				G_STRFUNC, filesize_to_string(to - from),
+				filesize_to_string2(from), fi->pathname);
+		} else if (GNET_PROPERTY(fileinfo_debug)) {
+			g_debug("FILEINFO cannot preallocate \"%s\": %m", fi->pathname);
+		}
+		return;
+	}
+
+	if (GNET_PROPERTY(fileinfo_debug) > 1) {
+		g_debug("FILEINFO preallocated %s bytes at %s in \"%s\"",
+			filesize_to_string(to - from), filesize_to_string2(from),
+			fi->pathname);
+	}
+}
+
+/**
+ * Reserve disk space for the whole output file, which was just created.
+ *
+ * @param fi		the fileinfo
+ * @param fo		the file object of the output file, opened for writing
+ */
+void
+file_info_preallocate(fileinfo_t *fi, const file_object_t *fo)
+{
+	file_info_check(fi);
+	g_assert(fo != NULL);
+
+	fi_preallocate(fi, fo, 0, fi->size);
+}
+
+/**
+ * Count the extents making up the output file on disk, to monitor its
+ * fragmentation.
+ *
+ * @return the amount of extents, -1 if the file does not exist or the
+ * information is not available.
+ */
+long
+file_info_extents(const fileinfo_t *fi)
+{
+	file_object_t *fo;
+	long n;
+
+	file_info_check(fi);
+
+	fo = file_object_open(fi->pathname, O_RDONLY);
+
+	if (NULL == fo)
+		return -1;
+
+	n = file_object_extents(fo);
+	file_object_release(&fo);
+
+	return n;
+}
+
+/**
+ * Preallocate the range [from, to) of the output file, if it exists.
+ */
+static void
+fi_preallocate_existing(fileinfo_t *fi, filesize_t from, filesize_t to)
+{
+	file_object_t *fo;
+
+	/*
+	 * We don't create the file if it does not already exist: it will be
+	 * preallocated as a whole when it is created.
+	 */
+
+	fo = file_object_open(fi->pathname, O_WRONLY);
+
+	if (fo != NULL) {
+		fi_preallocate(fi, fo, from, to);
+		file_object_release(&fo);
+	}
+}
+
 /**
  * Resize fileinfo to be `size' bytes, by adding empty chunk at the tail.
  */
 static void
 fi_resize(fileinfo_t *fi, filesize_t size)
 {
+	filesize_t old_size;
+
 	file_info_check(fi);
 	g_assert(!fi->hashed);
 
+	old_size = fi->size;
 	fi_extend_chunklist(fi, size);
+
+	/*
+	 * When growing a file that we already started to download, extend
+	 * the disk space reserved for it.
+	 */
+
+	if (old_size != 0 && !(fi->flags & (FI_F_TRANSIENT | FI_F_SEEDING)))
+		fi_preallocate_existing(fi, old_size, size);
 }
 
 /**
@@ -1910,6 +2353,12 @@ file_info_allocate(void)
 	WALLOC0(fi);
 	fi->magic = FI_MAGIC;
 	eslist_init(&fi->chunklist, offsetof(struct dl_file_chunk, lk));
+	erbtree_init(&fi->chunkmap, fi_chunk_overlap_cmp,
+		offsetof(struct dl_file_chunk, node));
+	erbtree_init(&fi->chunkholes, fi_chunk_overlap_cmp,
+		offsetof(struct dl_file_chunk, snode));
+	erbtree_init(&fi->chunkbusy, fi_chunk_overlap_cmp,
+		offsetof(struct dl_file_chunk, snode));
 	eslist_init(&fi->available, offsetof(struct dl_avail_chunk, lk));
 
 	return fi;
@@ -2187,6 +2636,13 @@ G_STMT_START {				\
 		/* NOT REACHED */
 	}
 
+	/*
+	 * Chunks read from the trailer are only indexed once we know they
+	 * form a consistent list.
+	 */
+
+	fi_chunk_index_all(fi);
+
 	/*
 	 * Pre-v4 (32-bit) trailers lacked the created and ntime fields.
 	 * Pre-v5 (32-bit) trailers lacked the fskn (file size known) indication.
@@ -3138,7 +3594,7 @@ fi_reset_chunks(fileinfo_t *fi)
 		fc->from = 0;
 		fc->to = fi->size;
 		fc->status = DL_CHUNK_EMPTY;
-		eslist_append(&fi->chunklist, fc);
+		fi_chunk_append(fi, fc);
 	}
 
 	fi->generation = 0;		/* Restarting from scratch... */
@@ -3164,10 +3620,16 @@ fi_copy_chunks(fileinfo_t *fi, fileinfo_t *trailer)
 		fi->cha1 = atom_sha1_get(trailer->cha1);
 
 	ESLIST_FOREACH_DATA(&trailer->chunklist, fc) {
+		struct dl_file_chunk *nfc;
+
 		dl_file_chunk_check(fc);
 		g_assert(fc->from <= fc->to);
 
-		eslist_append(&fi->chunklist, WCOPY(fc));
+		nfc = dl_file_chunk_alloc();
+		nfc->from = fc->from;
+		nfc->to = fc->to;
+		nfc->status = fc->status;
+		fi_chunk_append(fi, nfc);
 	}
 
 	file_info_merge_adjacent(fi); /* Recalculates also fi->done */
@@ -3801,7 +4263,7 @@ file_info_retrieve(void)
 							filesize_to_string(fi->size));
 						damaged = TRUE;
 					} else {
-						eslist_append(&fi->chunklist, fc);
+						fi_chunk_append(fi, fc);
 					}
 				}
 			}
@@ -3946,7 +4408,7 @@ file_info_create(const char *file, const char *path, filesize_t size,
 		fi->size = fc->to = st.st_size;
 		fc->status = DL_CHUNK_DONE;
 		fi->modified = st.st_mtime;
-		eslist_append(&fi->chunklist, fc);
+		fi_chunk_append(fi, fc);
 		fi->dirty = TRUE;
 	}
 
@@ -4417,7 +4879,7 @@ file_info_merge_adjacent(fileinfo_t *fi)
 			void *removed;
 
 			fc1->to = fc2->to;
-			removed = eslist_remove_after(&fi->chunklist, fc1);
+			removed = fi_chunk_remove_after(fi, fc1);
 			g_assert(removed == fc2);
 			dl_file_chunk_free(&fc2);
 			fc2 = fc1;					/* new current chunk */
@@ -4488,7 +4950,7 @@ file_info_size_known(struct download *d, filesize_t size)
 			fc->to = fi->done;			/* Byte at that offset is excluded */
 			fc->status = DL_CHUNK_DONE;
 
-			eslist_append(&fi->chunklist, fc);
+			fi_chunk_append(fi, fc);
 		} else {
 			fc->to = fi->done;
 
@@ -4499,7 +4961,7 @@ file_info_size_known(struct download *d, filesize_t size)
 			while (NULL != eslist_next(&fc->lk)) {
 				struct dl_file_chunk *fcn;
 
-				fcn = eslist_remove_after(&fi->chunklist, fc);
+				fcn = fi_chunk_remove_after(fi, fc);
 				dl_file_chunk_free(&fcn);
 			}
 		}
@@ -4518,7 +4980,7 @@ file_info_size_known(struct download *d, filesize_t size)
 		fc->to = size;				/* Byte at that offset is excluded */
 		fc->status = DL_CHUNK_BUSY;
 		fc->download = d;
-		eslist_append(&fi->chunklist, fc);
+		fi_chunk_append(fi, fc);
 	}
 
 	fi->file_size_known = TRUE;
@@ -4529,6 +4991,7 @@ file_info_size_known(struct download *d, filesize_t size)
 
 	if (0 == (FI_F_TRANSIENT & fi->flags)) {
 		file_info_hash_insert_name_size(fi);
+		fi_preallocate_existing(fi, fi->done, fi->size);
 	}
 
 	g_assert(file_info_check_chunklist(fi, TRUE));
@@ -4540,33 +5003,37 @@ file_info_size_known(struct download *d, filesize_t size)
  * Marks a chunk of the file with given status.
  * The bytes range from `from' (included) to `to' (excluded).
  *
- * When not marking the chunk as EMPTY, the range is linked to
- * the supplied download `d' so we know who "owns" it currently.
+ * When marking the chunk as BUSY, the range is linked to the supplied
+ * download `d' so we know who "owns" it currently.  Otherwise, `d' may be
+ * NULL, and when marking the chunk as DONE it is the download which wrote
+ * the data, if still known.
  */
-void
-file_info_update(const struct download *d, filesize_t from, filesize_t to,
-		enum dl_chunk_status status)
+static void
+fi_update(fileinfo_t *fi, const struct download *d,
+	filesize_t from, filesize_t to, enum dl_chunk_status status)
 {
 	struct dl_file_chunk *fc, *nfc, *prevfc;
 	slink_t *sl;
-	fileinfo_t *fi;
 	bool found = FALSE;
 	int n, againcount = 0;
 	bool need_merging;
 	const struct download *newval;
+	filesize_t start = from;
 
-	download_check(d);
-	fi = d->file_info;
 	file_info_check(fi);
-	g_assert(fi->refcount > 0);
+	g_assert(NULL == d || fi->refcount > 0);
 	g_assert(from < to);
+	g_assert(NULL == d || d->file_info == fi);
 
 	switch (status) {
 	case DL_CHUNK_DONE:
+		if (d != NULL)
+			download_check(d);
 		need_merging = FALSE;
 		newval = d;
 		goto status_ok;
 	case DL_CHUNK_BUSY:
+		download_check(d);
 		need_merging = TRUE;
 		newval = d;
 		g_assert(fi->lifecount > 0);
@@ -4611,7 +5078,7 @@ again:
 	if (++againcount > 10) {
 		g_error("%s(%s, %s, %d) is looping for \"%s\"! Man battle stations!",
 			G_STRFUNC, filesize_to_string(from), filesize_to_string2(to),
-			status, d->file_name);
+			status, fi->pathname);
 		return;
 	}
 
@@ -4645,7 +5112,7 @@ again:
 
 			if (DL_CHUNK_DONE == status)
 				fi->done += to - from;
-			fc->status = status;
+			fi_chunk_set_status(fi, fc, status);
 			fc->download = newval;
 			found = TRUE;
 			g_assert(file_info_check_chunklist(fi, TRUE));
@@ -4660,7 +5127,7 @@ again:
 
 			if (DL_CHUNK_DONE == status)
 				fi->done += fc->to - from;
-			fc->status = status;
+			fi_chunk_set_status(fi, fc, status);
 			fc->download = newval;
 			from = fc->to;
 			g_assert(file_info_check_chunklist(fi, TRUE));
@@ -4691,9 +5158,9 @@ again:
 				nfc->download = fc->download;
 
 				fc->to = to;
-				fc->status = status;
+				fi_chunk_set_status(fi, fc, status);
 				fc->download = newval;
-				eslist_insert_after(&fi->chunklist, fc, nfc);
+				fi_chunk_insert_after(fi, fc, nfc);
 				g_assert(file_info_check_chunklist(fi, TRUE));
 			}
 
@@ -4701,9 +5168,13 @@ again:
 			break;
 
 		} else if (fc->from < from && fc->to >= to) {
+			filesize_t end = fc->to;
 
 			/*
 			 * New chunk [from, to] lies within ]fc->from, fc->to].
+			 *
+			 * Chunk `fc' is truncated first so that the chunks we insert
+			 * after it do not overlap with it in the indexing trees.
 			 */
 
 			if (DL_CHUNK_DONE == fc->status)
@@ -4712,13 +5183,14 @@ again:
 			if (DL_CHUNK_DONE == status)
 				fi->done += to - from;
 
-			if (fc->to > to) {
+			fc->to = from;
+
+			if (end > to) {
 				nfc = dl_file_chunk_alloc();
 				nfc->from = to;
-				nfc->to = fc->to;
+				nfc->to = end;
 				nfc->status = fc->status;
 				nfc->download = fc->download;
-				eslist_insert_after(&fi->chunklist, fc, nfc);
 
 				if (DL_CHUNK_BUSY == nfc->status) {
 					/*
@@ -4730,6 +5202,8 @@ again:
 					nfc->status = DL_CHUNK_EMPTY;
 					nfc->download = NULL;
 				}
+
+				fi_chunk_insert_after(fi, fc, nfc);
 			}
 
 			nfc = dl_file_chunk_alloc();
@@ -4737,9 +5211,7 @@ again:
 			nfc->to = to;
 			nfc->status = status;
 			nfc->download = newval;
-			eslist_insert_after(&fi->chunklist, fc, nfc);
-
-			fc->to = from;
+			fi_chunk_insert_after(fi, fc, nfc);
 
 			found = TRUE;
 			g_assert(file_info_check_chunklist(fi, TRUE));
@@ -4755,15 +5227,16 @@ again:
 			if (DL_CHUNK_DONE == status)
 				fi->done += fc->to - from;
 
+			tmp = fc->to;
+			fc->to = from;
+
 			nfc = dl_file_chunk_alloc();
 			nfc->from = from;
-			nfc->to = fc->to;
+			nfc->to = tmp;
 			nfc->status = status;
 			nfc->download = newval;
-			eslist_insert_after(&fi->chunklist, fc, nfc);
+			fi_chunk_insert_after(fi, fc, nfc);
 
-			tmp = fc->to;
-			fc->to = from;
 			from = tmp;
 			g_assert(file_info_check_chunklist(fi, TRUE));
 			goto again;
@@ -4799,14 +5272,402 @@ again:
 	if (fi->flags & FI_F_TRANSIENT)
 		goto done;
 
+	if (DL_CHUNK_DONE == status)
+		fi_slices_written(fi, d, start, to);
+
 	if (fi->dirty) {
-		file_info_store_binary(d->file_info, FALSE);
+		file_info_store_binary(fi, FALSE);
 	}
 
 done:
 	file_info_changed(fi);
 }
 
+/**
+ * Marks a chunk of the file with given status.
+ * The bytes range from `from' (included) to `to' (excluded).
+ *
+ * When not marking the chunk as EMPTY, the range is linked to
+ * the supplied download `d' so we know who "owns" it currently.
+ */
+void
+file_info_update(const struct download *d, filesize_t from, filesize_t to,
+		enum dl_chunk_status status)
+{
+	download_check(d);
+
+	fi_update(d->file_info, d, from, to, status);
+}
+
+/**
+ * Marks a range of the file as DONE once its data have been written to disk.
+ *
+ * When the data is written asynchronously, the download which supplied it
+ * may be gone by the time the write completes, hence `d' may be NULL.
+ */
+void
+file_info_written(fileinfo_t *fi, const struct download *d,
+	filesize_t from, filesize_t to)
+{
+	file_info_check(fi);
+	g_assert(NULL == d || d->file_info == fi);
+
+	fi_update(fi, d, from, to, DL_CHUNK_DONE);
+}
+
+/***
+ *** Incremental verification of downloaded data against the Tiger tree.
+ ***
+ *** Each leaf of the Tiger tree we got for a file covers a slice of the
+ *** file.  As soon as a slice is completely downloaded, its TTH is computed
+ *** by the TTH verification thread and compared with the leaf, so that bad
+ *** data is discarded immediately instead of being noticed only when the
+ *** whole file fails its final SHA1 check.
+ ***/
+
+enum fi_slice_state {
+	FI_SLICE_UNCHECKED = 0,		/**< Not verified yet */
+	FI_SLICE_QUEUED,			/**< Queued for verification */
+	FI_SLICE_VERIFIED			/**< Data matches the Tiger tree */
+};
+
+/**
+ * Verification state of a slice.
+ */
+struct fi_slice {
+	gnet_src_t source;			/**< Last source which wrote data there */
+	filesize_t amount;			/**< Bytes written there by that source */
+	uint8 state;				/**< A fi_slice_state value */
+	uint8 written;				/**< Whether source was recorded */
+	uint8 mixed;				/**< Written by several sources */
+};
+
+enum fi_slice_check_magic { FI_SLICE_CHECK_MAGIC = 0x6e1c83a5 };
+
+/**
+ * Context of a queued slice verification.
+ */
+struct fi_slice_check {
+	enum fi_slice_check_magic magic;
+	const struct guid *guid;	/**< Fileinfo GUID (atom) */
+	size_t num_leaves;			/**< Amount of tree leaves when queued */
+	size_t slice;				/**< Index of the slice to check */
+};
+
+static inline void
+fi_slice_check_check(const struct fi_slice_check * const sc)
+{
+	g_assert(sc != NULL);
+	g_assert(FI_SLICE_CHECK_MAGIC == sc->magic);
+}
+
+static void
+fi_slice_check_free(struct fi_slice_check *sc)
+{
+	fi_slice_check_check(sc);
+
+	atom_guid_free_null(&sc->guid);
+	sc->magic = 0;
+	WFREE(sc);
+}
+
+/**
+ * Compute the file range covered by a slice.
+ */
+static void
+fi_slice_range(const fileinfo_t *fi, size_t i,
+	filesize_t *from, filesize_t *to)
+{
+	g_assert(i < fi->tigertree.num_leaves);
+
+	*from = i * fi->tigertree.slice_size;
+	*to = MIN(*from + fi->tigertree.slice_size, fi->size);
+}
+
+/**
+ * @return whether the whole range [from, to) has been downloaded.
+ */
+static bool
+fi_range_is_done(const fileinfo_t *fi, filesize_t from, filesize_t to)
+{
+	struct dl_file_chunk key;
+
+	if (from >= to)
+		return TRUE;
+
+	/*
+	 * The range is done when no EMPTY or BUSY chunk overlaps with it, and
+	 * looking up the range in these trees yields any overlapping chunk.
+	 */
+
+	key.from = from;
+	key.to = to;
+
+	return NULL == erbtree_lookup(&fi->chunkholes, &key) &&
+		NULL == erbtree_lookup(&fi->chunkbusy, &key);
+}
+
+/**
+ * @return whether incremental verification of slices can be done.
+ */
+static bool
+fi_slices_checkable(const fileinfo_t *fi)
+{
+	return fi->tigertree.leaves != NULL &&
+		fi->tigertree.slice_size != 0 &&
+		fi->file_size_known &&
+		!((FI_F_TRANSIENT | FI_F_SEEDING | FI_F_STRIPPED) & fi->flags);
+}
+
+/**
+ * @return the verification state of the i-th slice.
+ */
+static struct fi_slice *
+fi_slice_get(fileinfo_t *fi, size_t i)
+{
+	g_assert(i < fi->tigertree.num_leaves);
+
+	if (NULL == fi->tigertree.slices)
+		XMALLOC0_ARRAY(fi->tigertree.slices, fi->tigertree.num_leaves);
+
+	return &fi->tigertree.slices[i];
+}
+
+/**
+ * Handle the result of a slice verification.
+ *
+ * @param fi	the fileinfo
+ * @param i		the slice index
+ * @param tth	the TTH computed for the slice
+ */
+static void
+fi_slice_checked(fileinfo_t *fi, size_t i, const struct tth *tth)
+{
+	struct fi_slice *s = fi_slice_get(fi, i);
+	filesize_t from, to;
+	bool whole;
+
+	fi_slice_range(fi, i, &from, &to);
+
+	if (tth_eq(tth, &fi->tigertree.leaves[i])) {
+		s->state = FI_SLICE_VERIFIED;
+
+		if (GNET_PROPERTY(tigertree_debug) > 1) {
+			g_debug("TTH slice #%zu [%s, %s[ OK for \"%s\"",
+				i, filesize_to_string(from), filesize_to_string2(to),
+				fi->pathname);
+		}
+		return;
+	}
+
+	/*
+	 * The range may have been invalidated whilst it was being hashed,
+	 * in which case it will be checked again once downloaded anew.
+	 */
+
+	if (!fi_range_is_done(fi, from, to)) {
+		s->state = FI_SLICE_UNCHECKED;
+		return;
+	}
+
+	/*
+	 * Only penalize the source when it alone supplied all the slice data.
+	 * Being the only source recorded is not enough: part of the slice may
+	 * have been downloaded before, for instance in a previous session.
+	 */
+
+	whole = s->written && !s->mixed && s->amount >= to - from;
+
+	g_message("TTH slice #%zu [%s, %s[ mismatch for \"%s\"%s",
+		i, filesize_to_string(from), filesize_to_string2(to),
+		filepath_basename(fi->pathname),
+		s->mixed ? " (data from several sources)" :
+		!whole ? " (data partly from unknown sources)" : "");
+
+	if (whole) {
+		struct download *d = src_get_download(s->source);
+
+		if (d != NULL && d->file_info == fi)
+			download_bad_slice(d, from, to);
+	}
+
+	ZERO(s);
+	fi_update(fi, NULL, from, to, DL_CHUNK_EMPTY);
+	fi->dirty = TRUE;
+}
+
+/**
+ * Verification callback for slices, invoked in the main thread.
+ */
+static bool
+fi_slice_check_callback(const struct verify *ctx, enum verify_status status,
+	void *user_data)
+{
+	struct fi_slice_check *sc = user_data;
+	fileinfo_t *fi;
+	struct fi_slice *s = NULL;
+
+	fi_slice_check_check(sc);
+
+	/*
+	 * The fileinfo may have been removed or got a new tree since the
+	 * slice was queued.
+	 */
+
+	fi = file_info_by_guid(sc->guid);
+
+	if (
+		fi != NULL && fi_slices_checkable(fi) &&
+		fi->tigertree.num_leaves == sc->num_leaves
+	)
+		s = fi_slice_get(fi, sc->slice);
+
+	switch (status) {
+	case VERIFY_START:
+		{
+			filesize_t from, to;
+
+			if (NULL == s || FILE_INFO_COMPLETE(fi))
+				return FALSE;	/* Final verification will be done anyway */
+
+			fi_slice_range(fi, sc->slice, &from, &to);
+			return fi_range_is_done(fi, from, to);
+		}
+	case VERIFY_PROGRESS:
+		return s != NULL;
+	case VERIFY_DONE:
+		if (s != NULL)
+			fi_slice_checked(fi, sc->slice, verify_tth_digest(ctx));
+		goto done;
+	case VERIFY_ERROR:
+	case VERIFY_SHUTDOWN:
+		if (s != NULL && FI_SLICE_QUEUED == s->state)
+			s->state = FI_SLICE_UNCHECKED;
+		goto done;
+	case VERIFY_INVALID:
+		break;
+	}
+	g_assert_not_reached();
+	return FALSE;
+
+done:
+	fi_slice_check_free(sc);
+	return TRUE;
+}
+
+/**
+ * Queue verification of the i-th slice if it is completely downloaded
+ * and not already checked.
+ */
+static void
+fi_slice_check_enqueue(fileinfo_t *fi, size_t i)
+{
+	struct fi_slice *s = fi_slice_get(fi, i);
+	struct fi_slice_check *sc;
+	filesize_t from, to;
+
+	if (FI_SLICE_UNCHECKED != s->state)
+		return;
+
+	fi_slice_range(fi, i, &from, &to);
+
+	if (!fi_range_is_done(fi, from, to))
+		return;
+
+	WALLOC0(sc);
+	sc->magic = FI_SLICE_CHECK_MAGIC;
+	sc->guid = atom_guid_get(fi->guid);
+	sc->num_leaves = fi->tigertree.num_leaves;
+	sc->slice = i;
+
+	if (
+		verify_tth_append(fi->pathname, from, to - from,
+			fi_slice_check_callback, sc)
+	) {
+		s->state = FI_SLICE_QUEUED;
+	} else {
+		fi_slice_check_free(sc);
+	}
+}
+
+/**
+ * Record that data were written to the file by a download, queueing the
+ * verification of the slices that became complete.
+ *
+ * @param fi	the fileinfo
+ * @param d		the download that wrote the data, NULL if unknown
+ * @param from	start of the written range
+ * @param to	end of the written range (excluded)
+ */
+static void
+fi_slices_written(fileinfo_t *fi, const struct download *d,
+	filesize_t from, filesize_t to)
+{
+	size_t i, first, last;
+
+	if (!fi_slices_checkable(fi))
+		return;
+
+	g_assert(from < to);
+	g_return_if_fail(to <= fi->size);
+
+	first = from / fi->tigertree.slice_size;
+	last = (to - 1) / fi->tigertree.slice_size;
+
+	g_return_if_fail(last < fi->tigertree.num_leaves);
+
+	for (i = first; i <= last; i++) {
+		struct fi_slice *s = fi_slice_get(fi, i);
+		filesize_t start, end;
+
+		fi_slice_range(fi, i, &start, &end);
+		start = MAX(start, from);
+		end = MIN(end, to);
+
+		/*
+		 * Data from an unknown source cannot be attributed.
+		 */
+
+		if (NULL == d)
+			s->mixed = TRUE;
+		else if (s->written && s->source != d->src_handle)
+			s->mixed = TRUE;
+		if (d != NULL) {
+			if (s->written && s->source == d->src_handle)
+				s->amount += end - start;
+			else
+				s->amount = end - start;
+			s->source = d->src_handle;
+		}
+		s->written = TRUE;
+
+		/*
+		 * Data written over an already verified slice have to be
+		 * checked again.
+		 */
+
+		if (FI_SLICE_VERIFIED == s->state)
+			s->state = FI_SLICE_UNCHECKED;
+
+		fi_slice_check_enqueue(fi, i);
+	}
+}
+
+/**
+ * Queue verification of all the slices already downloaded.
+ */
+static void
+fi_slices_scan(fileinfo_t *fi)
+{
+	size_t i;
+
+	if (!fi_slices_checkable(fi) || FILE_INFO_COMPLETE(fi))
+		return;
+
+	for (i = 0; i < fi->tigertree.num_leaves; i++)
+		fi_slice_check_enqueue(fi, i);
+}
+
 /**
  * Go through all chunks that belong to the download,
  * and unmark them as busy.
@@ -4840,7 +5701,7 @@ file_info_clear_download(struct download *d, bool lifecount)
 		if (fc->download == d) {
 		    fc->download = NULL;
 		    if (DL_CHUNK_BUSY == fc->status)
-				fc->status = DL_CHUNK_EMPTY;
+				fi_chunk_set_status(fi, fc, DL_CHUNK_EMPTY);
 		}
 	}
 	file_info_merge_adjacent(fi);
@@ -4895,7 +5756,7 @@ restart:
 	ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
 		dl_file_chunk_check(fc);
 		g_assert(NULL == fc->download);
-		fc->status = DL_CHUNK_EMPTY;
+		fi_chunk_set_status(fi, fc, DL_CHUNK_EMPTY);
 	}
 
 	file_info_merge_adjacent(fi);
@@ -4915,12 +5776,16 @@ file_info_chunk_status(fileinfo_t *fi, filesize_t from, filesize_t to)
 	file_info_check(fi);
 	g_assert(file_info_check_chunklist(fi, TRUE));
 
-	ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
-		dl_file_chunk_check(fc);
+	/*
+	 * Only the chunk holding `from' can hold the whole range.  An empty
+	 * range lying at a chunk boundary belongs to the chunk ending there.
+	 */
 
-		if (from >= fc->from && to <= fc->to)
-			return fc->status;
-	}
+	fc = fi_chunk_lookup(&fi->chunkmap,
+			(from == to && from != 0) ? from - 1 : from);
+
+	if (fc != NULL && from >= fc->from && to <= fc->to)
+		return fc->status;
 
 	/*
 	 * Ending up here will normally mean that the tested range falls over
@@ -4946,51 +5811,44 @@ file_info_new_chunk_owner(const struct download *d,
 	filesize_t from, filesize_t to)
 {
 	fileinfo_t *fi;
-	const struct download *old = NULL;
-	const slink_t *sl;
+	const struct download *old;
+	struct dl_file_chunk *fc;
+	rbnode_t *rn, *next;
 
 	download_check(d);
 	fi = d->file_info;
 	file_info_check(fi);
 	g_assert(file_info_check_chunklist(fi, TRUE));
 
-	ESLIST_FOREACH(&fi->chunklist, sl) {
-		struct dl_file_chunk *fc = eslist_data(&fi->chunklist, sl);
+	/*
+	 * We're looking for the first busy chunk intersecting with [from, to],
+	 * which happens when one of the segment bounds lies within the chunk.
+	 */
 
-		dl_file_chunk_check(fc);
+	fc = fi_chunk_lookup(&fi->chunkbusy, from);
+	if (NULL == fc)
+		fc = fi_chunk_lookup(&fi->chunkbusy, to);
 
-		/*
-		 * We're looking for the first busy chunk intersecting with [from, to],
-		 * which happens when one of the segment bounds lies within the chunk.
-		 */
+	if (NULL == fc)
+		return;
 
-		if (DL_CHUNK_BUSY != fc->status)
-			continue;
+	dl_file_chunk_check(fc);
+	g_assert(fc->download != NULL);
+	download_check(fc->download);
+	g_assert(fc->download != d);
 
-		if (
-			(from >= fc->from && from < fc->to) ||
-			(to >= fc->from && to < fc->to)
-		) {
-			g_assert(fc->download != NULL);
-			download_check(fc->download);
-			g_assert(fc->download != d);
+	old = fc->download;
+	fc->download = d;
 
-			old = fc->download;
-			fc->download = d;
-			break;
-		}
-	}
+	for (rn = erbtree_next(&fc->snode); rn != NULL; rn = next) {
+		struct dl_file_chunk *bfc = erbtree_data(&fi->chunkbusy, rn);
 
-	if (old != NULL) {
-		for (sl = eslist_next(sl); sl != NULL; sl = eslist_next(sl)) {
-			struct dl_file_chunk *fc = eslist_data(&fi->chunklist, sl);
+		dl_file_chunk_check(bfc);
+		next = erbtree_next(rn);	/* `rn' may be removed from the tree */
 
-			dl_file_chunk_check(fc);
-
-			if (DL_CHUNK_BUSY == fc->status && fc->download == old) {
-				fc->status = DL_CHUNK_EMPTY;
-				fc->download = NULL;
-			}
+		if (bfc->download == old) {
+			fi_chunk_set_status(fi, bfc, DL_CHUNK_EMPTY);
+			bfc->download = NULL;
 		}
 	}
 }
@@ -5007,10 +5865,11 @@ file_info_pos_status(fileinfo_t *fi, filesize_t pos)
 	file_info_check(fi);
 	g_assert(file_info_check_chunklist(fi, TRUE));
 
-	ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
+	fc = fi_chunk_lookup(&fi->chunkmap, pos);
+
+	if (fc != NULL) {
 		dl_file_chunk_check(fc);
-		if (pos >= fc->from && pos < fc->to)
-			return fc->status;
+		return fc->status;
 	}
 
 	if (pos > fi->size) {
@@ -5060,7 +5919,7 @@ fi_check_file(fileinfo_t *fi)
 static int
 fi_busy_count(fileinfo_t *fi, const struct download *d)
 {
-	const struct dl_file_chunk *fc;
+	rbnode_t *rn;
 	int count = 0;
 	int pipelined = 0;
 
@@ -5068,15 +5927,16 @@ fi_busy_count(fileinfo_t *fi, const struct download *d)
 	file_info_check(fi);
 	g_assert(file_info_check_chunklist(fi, TRUE));
 
-	ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
+	ERBTREE_FOREACH(&fi->chunkbusy, rn) {
+		const struct dl_file_chunk *fc = erbtree_data(&fi->chunkbusy, rn);
+
 		dl_file_chunk_check(fc);
-		if (fc->download != NULL) {
-			download_check(d);
-			if (fc->download == d && DL_CHUNK_BUSY == fc->status) {
-				count++;
-				if (download_pipelining(d))
-					pipelined++;
-			}
+		g_assert(DL_CHUNK_BUSY == fc->status);
+
+		if (fc->download == d) {
+			count++;
+			if (download_pipelining(d))
+				pipelined++;
 		}
 	}
 
@@ -5085,23 +5945,6 @@ fi_busy_count(fileinfo_t *fi, const struct download *d)
 	return count;
 }
 
-/**
- * Compares two offered ranges so that two ranges are equal when they overlap.
- */
-static int
-fi_chunk_overlap_cmp(const void *a, const void *b)
-{
-	const struct dl_file_chunk *ca = a, *cb = b;
-
-	if (ca->to <= cb->from)			/* `to' is NOT part of the chunk range */
-		return -1;
-
-	if (cb->to <= ca->from)
-		return +1;
-
-	return 0;		/* Overlapping chunks are equal */
-}
-
 /**
  * Select a chunk randomly among the rarest chunks offered on the network.
  *
@@ -5121,7 +5964,6 @@ fi_chunk_overlap_cmp(const void *a, const void *b)
 static const struct dl_file_chunk *
 fi_pick_rarest_chunk(fileinfo_t *fi, const download_t *d, filesize_t size)
 {
-	rbtree_t *missing;
 	http_rangeset_t *offered;
 	const struct dl_file_chunk *fc;
 	const struct dl_file_chunk *first, *candidate = NULL;
@@ -5142,41 +5984,29 @@ fi_pick_rarest_chunk(fileinfo_t *fi, const download_t *d, filesize_t size)
 		 * See whether chunks up to ``pfsp_first_chunk'' bytes are free.
 		 */
 
-		ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
-			if (fc->from >= GNET_PROPERTY(pfsp_first_chunk))
-				break;
-
-			if (DL_CHUNK_EMPTY == fc->status) {
-				if (GNET_PROPERTY(download_debug)) {
-					g_debug("%s(): less than %u bytes, using first chunk",
-						G_STRFUNC, GNET_PROPERTY(pfsp_first_chunk));
-				}
+		fc = erbtree_head(&fi->chunkholes);
 
-				candidate = first;
-				goto done;
+		if (fc != NULL && fc->from < GNET_PROPERTY(pfsp_first_chunk)) {
+			if (GNET_PROPERTY(download_debug)) {
+				g_debug("%s(): less than %u bytes, using first chunk",
+					G_STRFUNC, GNET_PROPERTY(pfsp_first_chunk));
 			}
+
+			candidate = first;
+			goto done;
 		}
 	}
 
 	/*
-	 * The `missing' red-black tree contains the file chunks that are still
+	 * The fi->chunkholes tree contains the file chunks that are still
 	 * empty and need to be downloaded.
 	 *
 	 * The `offered' set contains the HTTP ranges offered by the source,
 	 * if any given.  If NULL, it means the source covers the whole file.
 	 */
 
-	missing = rbtree_create(fi_chunk_overlap_cmp);
 	offered = NULL == d ? NULL : d->ranges;
 
-	ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
-		dl_file_chunk_check(fc);
-
-		if (DL_CHUNK_EMPTY == fc->status) {
-			rbtree_insert(missing, fc);
-		}
-	}
-
 	/*
 	 * Find the first missing chunk that is also offered, starting with the
 	 * rarest available chunk: the fi->available list is sorted by increasing
@@ -5206,7 +6036,7 @@ fi_pick_rarest_chunk(fileinfo_t *fi, const download_t *d, filesize_t size)
 		crange.from = fa->from;
 		crange.to = fa->to;
 
-		dfc = rbtree_lookup(missing, &crange);
+		dfc = erbtree_lookup(&fi->chunkholes, &crange);
 
 		if (dfc != NULL) {
 			/* Rare range overlaps with missing range */
@@ -5318,7 +6148,7 @@ fi_pick_rarest_chunk(fileinfo_t *fi, const download_t *d, filesize_t size)
 			nfc->status = dfc->status;
 			dfc->to = start;
 
-			eslist_insert_after(&fi->chunklist, dfc, nfc);
+			fi_chunk_insert_after(fi, dfc, nfc);
 			candidate = nfc;
 
 			if (
@@ -5340,8 +6170,6 @@ fi_pick_rarest_chunk(fileinfo_t *fi, const download_t *d, filesize_t size)
 	if (NULL == candidate)
 		candidate = first;
 
-	rbtree_free_null(&missing);
-
 done:
 	if (GNET_PROPERTY(fileinfo_debug) || GNET_PROPERTY(download_debug)) {
 		g_debug("%s(): returning [%s, %s] (%u) for \"%s\"",
@@ -5369,7 +6197,7 @@ static const struct dl_file_chunk *
 fi_pick_chunk(fileinfo_t *fi)
 {
 	filesize_t offset = 0, empty = 0;
-	slink_t *sl;
+	rbnode_t *rn;
 	const struct dl_file_chunk *candidate = NULL;
 
 	file_info_check(fi);
@@ -5380,18 +6208,13 @@ fi_pick_chunk(fileinfo_t *fi)
 
 		/*
 		 * Check whether first chunks cover at least "pfsp_first_chunk" bytes
-		 * long.  If not, return that first chunk.
+		 * long.  If not, return the first empty chunk.
 		 */
 
-		ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
-			dl_file_chunk_check(fc);
-
-			if (fc->from >= GNET_PROPERTY(pfsp_first_chunk))
-				break;		/* Already past the first "pfsp_first_chunk" bytes */
+		fc = erbtree_head(&fi->chunkholes);
 
-			if (DL_CHUNK_EMPTY == fc->status)
-				return fc;
-		}
+		if (fc != NULL && fc->from < GNET_PROPERTY(pfsp_first_chunk))
+			return fc;
 	}
 
 	if (GNET_PROPERTY(pfsp_last_chunk) > 0) {
@@ -5408,14 +6231,10 @@ fi_pick_chunk(fileinfo_t *fi)
 			? fi->size - GNET_PROPERTY(pfsp_last_chunk)
 			: 0;
 
-		ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
-			dl_file_chunk_check(fc);
-
-			if (DL_CHUNK_EMPTY != fc->status)
-				continue;
+		fc = fi_chunk_lookup_ceil(&fi->chunkholes, last_chunk_offset);
 
-			if (fc->to <= last_chunk_offset)
-				continue;
+		if (fc != NULL) {
+			dl_file_chunk_check(fc);
 
 			offset = fc->from < last_chunk_offset
 				? last_chunk_offset
@@ -5433,14 +6252,10 @@ fi_pick_chunk(fileinfo_t *fi)
 	 * where this random number falls into.
 	 */
 
-	ESLIST_FOREACH(&fi->chunklist, sl) {
-		const struct dl_file_chunk *fc = eslist_data(&fi->chunklist, sl);
+	ERBTREE_FOREACH(&fi->chunkholes, rn) {
+		const struct dl_file_chunk *fc = erbtree_data(&fi->chunkholes, rn);
 
 		dl_file_chunk_check(fc);
-
-		if (DL_CHUNK_EMPTY != fc->status)
-			continue;
-
 		empty += fc->to - fc->from;		/* Sums "empty" data */
 	}
 
@@ -5461,21 +6276,18 @@ fi_pick_chunk(fileinfo_t *fi)
 	 * to start downloading.
 	 *
 	 * To find the chunk to which that point belong, we need to iterate
-	 * again over the list of chunks, decreasing the offset until we reach
+	 * again over the empty chunks, decreasing the offset until we reach
 	 * an offset whose value falls within the length of the current chunk.
 	 */
 
 	offset = get_random_file_offset(empty);
 
-	ESLIST_FOREACH(&fi->chunklist, sl) {
-		const struct dl_file_chunk *fc = eslist_data(&fi->chunklist, sl);
+	ERBTREE_FOREACH(&fi->chunkholes, rn) {
+		const struct dl_file_chunk *fc = erbtree_data(&fi->chunkholes, rn);
 		filesize_t len;
 
 		dl_file_chunk_check(fc);
 
-		if (DL_CHUNK_EMPTY != fc->status)
-			continue;
-
 		len = fc->to - fc->from;
 
 		if (offset < len) {
@@ -5546,7 +6358,7 @@ selected:
 		nfc->status = DL_CHUNK_EMPTY;
 		fc->to = nfc->from;
 
-		eslist_insert_after(&fi->chunklist, fc, nfc);
+		fi_chunk_insert_after(fi, fc, nfc);
 		candidate = nfc;
 	}
 
@@ -5619,7 +6431,7 @@ fi_missing_coverage(const struct download *d)
 	fileinfo_t *fi;
 	filesize_t missing_size = 0;
 	filesize_t covered_size = 0;
-	const struct dl_file_chunk *fc;
+	rbnode_t *rn;
 
 	download_check(d);
 	fi = d->file_info;
@@ -5643,12 +6455,11 @@ fi_missing_coverage(const struct download *d)
 		return available ? (available * 1.0) / (fi->size * 1.0) : 1.0;
 	}
 
-	ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
+	ERBTREE_FOREACH(&fi->chunkholes, rn) {
+		const struct dl_file_chunk *fc = erbtree_data(&fi->chunkholes, rn);
 		const http_range_t *r;
 
-		if (DL_CHUNK_EMPTY != fc->status)
-			continue;
-
+		dl_file_chunk_check(fc);
 		missing_size += fc->to - fc->from;
 
 		/*
@@ -5697,14 +6508,14 @@ fi_missing_coverage(const struct download *d)
 static const struct dl_file_chunk *
 fi_find_largest(const fileinfo_t *fi, const struct download *d)
 {
-	const struct dl_file_chunk *fc;
+	rbnode_t *rn;
 	const struct dl_file_chunk *largest = NULL;
 
-	ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
-		dl_file_chunk_check(fc);
+	ERBTREE_FOREACH(&fi->chunkbusy, rn) {
+		const struct dl_file_chunk *fc = erbtree_data(&fi->chunkbusy, rn);
 
-		if (DL_CHUNK_BUSY != fc->status)
-			continue;
+		dl_file_chunk_check(fc);
+		g_assert(DL_CHUNK_BUSY == fc->status);
 
 		/*
 		 * When doing HTTP pipelining, we need to exclude chunks owned by
@@ -5735,17 +6546,16 @@ fi_find_largest(const fileinfo_t *fi, const struct download *d)
 static const struct dl_file_chunk *
 fi_find_slowest(const fileinfo_t *fi, const struct download *d)
 {
-	const struct dl_file_chunk *fc;
+	rbnode_t *rn;
 	const struct dl_file_chunk *slowest = NULL;
 	uint slowest_speed_avg = MAX_INT_VAL(uint);
 
-	ESLIST_FOREACH_DATA(&fi->chunklist, fc) {
+	ERBTREE_FOREACH(&fi->chunkbusy, rn) {
+		const struct dl_file_chunk *fc = erbtree_data(&fi->chunkbusy, rn);
 		uint speed_avg;
 
 		dl_file_chunk_check(fc);
-
-		if (DL_CHUNK_BUSY != fc->status)
-			continue;
+		g_assert(DL_CHUNK_BUSY == fc->status);
 
 		/*
 		 * Avoid self-competing with our own chunks when doing HTTP pipelining.
@@ -5990,14 +6800,13 @@ file_info_reserve(const struct download *d,
 enum dl_chunk_status
 file_info_find_hole(const struct download *d, filesize_t *from, filesize_t *to)
 {
-	slink_t *sl;
+	rbnode_t *rn;
 	fileinfo_t *fi = d->file_info;
 	filesize_t chunksize;
 	unsigned busy = 0;
 	unsigned pipelined = 0;
 	int reserved;
-	eclist_t cklist;
-	const struct dl_file_chunk *chunk = NULL;
+	const struct dl_file_chunk *fc, *chunk = NULL;
 
 	file_info_check(fi);
 	g_assert(fi->refcount > 0);
@@ -6091,28 +6900,16 @@ file_info_find_hole(const struct download *d, filesize_t *from, filesize_t *to)
 	}
 
 	/*
-	 * Iteration is done using a "circular" list illusion, to be able to
-	 * nicely iterate even if we don't start from the head.
+	 * Take the first empty chunk lying after the chunk we picked, wrapping
+	 * around to the first empty chunk of the file if there is none.
 	 */
 
-	eclist_init(&cklist, &fi->chunklist, chunk);
+	fc = fi_chunk_hole_after(fi, chunk);
 	chunk = NULL;		/* Will be set if we pick a chunk aggressively */
 
-	ECLIST_FOREACH(&cklist, sl) {
-		const struct dl_file_chunk *fc = eclist_data(&cklist, sl);
-
+	if (fc != NULL) {
 		dl_file_chunk_check(fc);
 
-		if (DL_CHUNK_EMPTY != fc->status) {
-			if (DL_CHUNK_BUSY == fc->status) {
-				g_assert(fc->download != NULL);
-				download_check(fc->download);
-				if (fc->download != d && download_pipelining(fc->download))
-					pipelined++;
-			}
-			continue;
-		}
-
 		*from = fc->from;
 		*to = fc->to;
 		if ((fc->to - fc->from) > chunksize)
@@ -6120,6 +6917,16 @@ file_info_find_hole(const struct download *d, filesize_t *from, filesize_t *to)
 		goto selected;
 	}
 
+	ERBTREE_FOREACH(&fi->chunkbusy, rn) {
+		fc = erbtree_data(&fi->chunkbusy, rn);
+
+		dl_file_chunk_check(fc);
+		g_assert(fc->download != NULL);
+		download_check(fc->download);
+		if (fc->download != d && download_pipelining(fc->download))
+			pipelined++;
+	}
+
 	busy -= pipelined;
 	g_assert(fi->lifecount > (int32) busy); /* Or we'd found a chunk before */
 
@@ -6159,10 +6966,9 @@ file_info_find_available_hole(
 	const struct download *d, http_rangeset_t *ranges,
 	filesize_t *from, filesize_t *to)
 {
-	slink_t *sl;
+	rbnode_t *rn;
 	fileinfo_t *fi;
 	filesize_t chunksize = 0;
-	eclist_t cklist;
 	uint busy = 0;
 	uint pipelined = 0;
 	const struct dl_file_chunk *chunk = NULL;
@@ -6207,55 +7013,24 @@ file_info_find_available_hole(
 	}
 
 	/*
-	 * Iteration is done using a "circular" list illusion, to be able to
-	 * nicely iterate even if we don't start from the head.
+	 * Look for the first empty chunk intersecting with the available
+	 * ranges, starting after the chunk we picked and wrapping around.
 	 */
 
-	eclist_init(&cklist, &fi->chunklist, chunk);
-	chunk = NULL;		/* Will be set if we pick a chunk aggressively */
-
-	ECLIST_FOREACH(&cklist, sl) {
-		const struct dl_file_chunk *fc = eclist_data(&cklist, sl);
-		const http_range_t *r;
-
-		if (DL_CHUNK_EMPTY != fc->status) {
-			if (DL_CHUNK_BUSY == fc->status) {
-				busy++;		/* Will be used by aggresive code below */
-				g_assert(fc->download != NULL);
-				download_check(fc->download);
-				if (download_pipelining(fc->download))
-					pipelined++;
-			}
-			continue;
-		}
-
-		/*
-		 * Look whether this empty chunk intersects with one of the
-		 * available ranges.
-		 *
-		 * NB: Contrary to fi chunks, the upper boundary of the range
-		 * (r->end) is part of the range.
-		 */
-
-		r = http_rangeset_lookup(ranges, fc->from, fc->to - 1);
-
-		if (r != NULL) {
-			filesize_t start, end;
-
-			/*
-			 * Intersect range and chunk, [start, end[ is the result.
-			 */
+	if (fi_find_offered_hole(fi, ranges, chunk, from, to))
+		goto found;
 
-			start = MAX(r->start, fc->from);
-			end = r->end + 1;
-			end = MIN(end, fc->to);
+	chunk = NULL;		/* Will be set if we pick a chunk aggressively */
 
-			g_assert(start < end);		/* Intersection is non-empty */
+	ERBTREE_FOREACH(&fi->chunkbusy, rn) {
+		const struct dl_file_chunk *fc = erbtree_data(&fi->chunkbusy, rn);
 
-			*from = start;
-			*to = end;
-			goto found;
-		}
+		dl_file_chunk_check(fc);
+		busy++;		/* Will be used by aggresive code below */
+		g_assert(fc->download != NULL);
+		download_check(fc->download);
+		if (download_pipelining(fc->download))
+			pipelined++;
 	}
 
 	busy -= pipelined;
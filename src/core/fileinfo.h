@@ -44,6 +44,7 @@
 
 #define FI_LOW_SRC_COUNT	5			/**< Few sources known if beneath */
 
+struct file_object;
 struct guid;
 
 /*
@@ -59,6 +60,8 @@ int file_info_has_trailer(const char *path);
 void file_info_retrieve(void);
 void file_info_store(void);
 void file_info_store_binary(fileinfo_t *fi, bool force);
+void file_info_preallocate(fileinfo_t *fi, const struct file_object *fo);
+long file_info_extents(const fileinfo_t *fi);
 void file_info_store_if_dirty(void);
 void file_info_set_discard(fileinfo_t *fi, bool state);
 enum dl_chunk_status file_info_find_hole(
@@ -85,6 +88,8 @@ void file_info_size_known(struct download *d, filesize_t size);
 void file_info_size_unknown(fileinfo_t *fi);
 void file_info_update(const struct download *d, filesize_t from, filesize_t to,
 	enum dl_chunk_status status);
+void file_info_written(fileinfo_t *fi, const struct download *d,
+	filesize_t from, filesize_t to);
 void file_info_new_chunk_owner(const struct download *d,
 	filesize_t from, filesize_t to);
 enum dl_chunk_status file_info_pos_status(fileinfo_t *fi,
@@ -437,6 +437,7 @@ void
 gip_init(void)
 {
 	geo_db = iprange_new();
+	iprange_compile(geo_db);
 
 	gip_retrieve(GIP_IPV4);
 	gip_retrieve(GIP_IPV6);
@@ -44,6 +44,8 @@
 #include "if/dht/kademlia.h"
 #include "if/gnet_property_priv.h"
 
+#include "sdbm/sdbm.h"
+
 #include "lib/entropy.h"
 #include "lib/event.h"
 #include "lib/random.h"
@@ -930,6 +932,29 @@ gnet_stats_g2_count_flowc(const gnutella_node_t *n,
 	gnet_stats_flowc_internal(t, f, ttl, hops, len);
 }
 
+/**
+ * Refresh the SDBM background flushing statistics.
+ *
+ * These are collected by the SDBM layer, which does not know about us.
+ */
+static void
+gnet_stats_update_sdbm(void)
+{
+	struct sdbm_bgflush_stats bs;
+
+	sdbm_bgflush_stats(&bs);
+
+	GNET_STATS_LOCK;
+	gnet_stats.general[GNR_SDBM_BG_FLUSHED_PAGES] = bs.pages;
+	gnet_stats.general[GNR_SDBM_BG_FLUSH_BATCHES] = bs.batches;
+	gnet_stats.general[GNR_SDBM_BG_FLUSH_LATENCY] =
+		bs.latency / MAX(bs.batches, 1);
+	gnet_stats.general[GNR_SDBM_BG_FLUSH_MAX_LATENCY] = bs.max_latency;
+	gnet_stats.general[GNR_SDBM_BG_FLUSH_STALLS] = bs.stalls;
+	gnet_stats.general[GNR_SDBM_BG_FLUSH_STALL_TIME] = bs.stall_time;
+	GNET_STATS_UNLOCK;
+}
+
 /***
  *** Public functions (gnet.h)
  ***/
@@ -939,6 +964,8 @@ gnet_stats_get(gnet_stats_t *s)
 {
     g_assert(s != NULL);
 
+	gnet_stats_update_sdbm();
+
 	GNET_STATS_LOCK;
     *s = gnet_stats;
 	GNET_STATS_UNLOCK;
@@ -293,6 +293,7 @@ hostiles_load(FILE *f, hostiles_t which)
 	g_assert(NULL == hostile_db[which]);
 
 	hostile_db[which] = iprange_new();
+	iprange_compile(hostile_db[which]);
 
 	while (fgets(ARYLEN(line), f)) {
 		linenum++;
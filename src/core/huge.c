@@ -48,25 +48,30 @@
 #include "settings.h"
 #include "share.h"
 #include "spam.h"
-#include "verify_sha1.h"
+#include "tth_cache.h"
+#include "verify_bitprint.h"
 #include "verify_tth.h"
 #include "version.h"
 
 #include "lib/atoms.h"
 #include "lib/base32.h"
 #include "lib/cq.h"
+#include "lib/crc.h"
+#include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/gnet_host.h"
 #include "lib/halloc.h"
 #include "lib/hashing.h"
 #include "lib/header.h"
 #include "lib/hikset.h"
+#include "lib/hstrfn.h"
 #include "lib/parse.h"
 #include "lib/pattern.h"
 #include "lib/sha1.h"
 #include "lib/stringify.h"
 #include "lib/tm.h"
 #include "lib/urn.h"
+#include "lib/vmm.h"
 #include "lib/walloc.h"
 
 #include "if/gnet_property.h"
@@ -76,9 +81,14 @@
 
 #define HUGE_SHA1_CACHE_FREQ	60	/* seconds, for SHA1 cache dumps */
 
+#define HUGE_CACHE_MAGIC		"GTKGHASH"
+#define HUGE_CACHE_VERSION		1
+#define HUGE_CACHE_ALIGN		8		/* Record alignment */
+#define HUGE_CACHE_GARBAGE_MIN	1024	/* Min superseded records to compact */
+
 /**
  * There's an in-core cache (the hash table ``sha1_cache''), and a
- * persistent copy (normally in ~/.gtk-gnutella/sha1_cache). The
+ * persistent copy (normally in ~/.gtk-gnutella/sha1_cache.bin). The
  * in-core cache is filled with the persistent one at launch. When the
  * "shared_file" (the records describing the shared files, see
  * share.h) are created, a call is made to sha1_set_digest to fill the
@@ -89,10 +99,10 @@
  * modification time. If they're identical to the ones in the cache,
  * the digest is considered to be accurate, and is used. If the file
  * size or last modification time don't match, the digest is computed
- * again and stored in the in-core cache, but it isn't stored in the
- * persistent one. Instead, the cache is marked as dirty, and will be
- * entirely overwritten by dump_cache, called when everything has been
- * computed.
+ * again, stored in the in-core cache and a new record superseding the
+ * old one is appended to the persistent cache.  When too many records
+ * have been superseded, the persistent cache is compacted by dump_cache,
+ * which rewrites it entirely.
  */
 
 struct sha1_cache_entry {
@@ -105,13 +115,48 @@ struct sha1_cache_entry {
                                      file in the share library      */
 };
 
+/**
+ * Header of the persistent cache.
+ *
+ * This is a local cache, hence it is written in native byte order.  The
+ * header is followed by records, each one immediately followed by the
+ * file path (not NUL-terminated) and padded so that the next record is
+ * properly aligned.  A record for a path supersedes all the previous
+ * records for the same path.
+ */
+struct huge_cache_header {
+	char magic[8];				/**< HUGE_CACHE_MAGIC */
+	uint32 version;				/**< HUGE_CACHE_VERSION */
+	uint32 reserved;
+};
+
+struct huge_cache_record {
+	uint64 size;				/**< File size */
+	uint64 mtime;				/**< Last modification time */
+	uint32 hash;				/**< Hash of the path */
+	uint32 crc;					/**< CRC32 of record and path, with crc = 0 */
+	uint16 pathlen;				/**< Length of path */
+	uint8 flags;				/**< HUGE_CACHE_F_* flags */
+	uint8 reserved;
+	struct sha1 sha1;			/**< SHA-1 of file */
+	struct tth tth;				/**< TTH of file, if HUGE_CACHE_F_TTH */
+};
+
+#define HUGE_CACHE_F_TTH	(1U << 0)	/**< Record holds a TTH */
+
 static hikset_t *sha1_cache;
 
 /**
- * cache_dirty = TRUE means that in-core cache is different from the disk one.
+ * cache_dirty = TRUE means that in-core cache has changes that could not
+ * be appended to the disk one, which must therefore be rewritten.
  */
 static bool cache_dirty;
 static time_t cache_dumped;
+static size_t cache_records;	/**< Records in the persistent cache */
+static int cache_fd = -1;		/**< Opened for appending to the cache */
+
+static const char sha1_cache_file[] = "sha1_cache.bin";
+static const char sha1_cache_text[] = "sha1_cache";		/* Old format */
 
 static cpattern_t *has_http_urls;
 
@@ -161,71 +206,175 @@ add_volatile_cache_entry(const char *filename, filesize_t size, time_t mtime,
 
 /* Disk cache */
 
-static const char sha1_persistent_cache_file_header[] =
-"#\n"
-"# gtk-gnutella SHA1 cache file.\n"
-"# This file is automatically generated.\n"
-"# Format is: URN<TAB>file_size<TAB>file_mtime<TAB>file_name\n"
-"# Comment lines start with a sharp (#)\n"
-"#\n"
-"\n";
+/**
+ * @return the path of the persistent cache, to be freed with hfree().
+ */
+static char *
+cache_path(void)
+{
+	return make_pathname(settings_config_dir(), sha1_cache_file);
+}
 
-static void
-cache_entry_print(FILE *f, const char *filename,
-	const struct sha1 *sha1, const struct tth *tth,
-	filesize_t size, time_t mtime)
+/**
+ * @return the size of a record holding a path of given length, padded so
+ * that the following record is aligned.
+ */
+static inline size_t
+cache_record_size(size_t pathlen)
 {
-	char size_buf[UINT64_DEC_BUFLEN], mtime_buf[UINT64_DEC_BUFLEN];
+	return round_size(HUGE_CACHE_ALIGN,
+		sizeof(struct huge_cache_record) + pathlen);
+}
 
-	g_return_if_fail(f);
-	g_return_if_fail(filename);
-	g_return_if_fail(sha1);
-	g_return_if_fail(size > 0);
+/**
+ * Compute the CRC of a record, its crc field being taken as zero.
+ *
+ * @param r		the record, followed by its path and padding
+ * @param len	the total record length, as given by cache_record_size()
+ */
+static uint32
+cache_record_crc(const struct huge_cache_record *r, size_t len)
+{
+	static const uint32 zero;
+	size_t off = offsetof(struct huge_cache_record, pathlen);
+	uint32 crc;
+
+	crc = crc32_update(0, r, offsetof(struct huge_cache_record, crc));
+	crc = crc32_update(crc, &zero, sizeof zero);
+	return crc32_update(crc, const_ptr_add_offset(r, off), len - off);
+}
+
+/**
+ * Build the persistent record for a cache entry.
+ *
+ * @param e		the cache entry
+ * @param len	where the length of the record is written
+ *
+ * @return the record, to be freed with hfree(), or NULL if the path is
+ * too long to be recorded.
+ */
+static void *
+cache_record_build(const struct sha1_cache_entry *e, size_t *len)
+{
+	struct huge_cache_record *r;
+	size_t pathlen = strlen(e->file_name);
+
+	if G_UNLIKELY(pathlen > MAX_INT_VAL(uint16))
+		return NULL;
+
+	*len = cache_record_size(pathlen);
+	r = halloc0(*len);
+	r->size = e->size;
+	r->mtime = e->mtime;
+	r->hash = binary_hash(e->file_name, pathlen);
+	r->pathlen = pathlen;
+	r->sha1 = *e->sha1;
+	if (e->tth != NULL) {
+		r->flags |= HUGE_CACHE_F_TTH;
+		r->tth = *e->tth;
+	}
+	memcpy(ptr_add_offset(r, sizeof *r), e->file_name, pathlen);
+	r->crc = cache_record_crc(r, *len);
+
+	return r;
+}
+
+/**
+ * Open the persistent cache for appending, writing its header when empty.
+ *
+ * @return TRUE if we can append to the cache.
+ */
+static bool
+cache_open_append(void)
+{
+	filestat_t sb;
+	char *path;
 
-	uint64_to_string_buf(size, ARYLEN(size_buf));
-	uint64_to_string_buf(mtime, ARYLEN(mtime_buf));
+	if (cache_fd != -1)
+		return TRUE;
+
+	path = cache_path();
+	cache_fd = file_create(path, O_WRONLY | O_APPEND, S_IRUSR | S_IWUSR);
+
+	if (-1 == cache_fd)
+		goto done;
 
-	fprintf(f, "%s\t%s\t%s\t%s\n", bitprint_to_urn_string(sha1, tth),
-		size_buf, mtime_buf, filename);
+	if (-1 == fstat(cache_fd, &sb)) {
+		g_warning("%s(): could not stat \"%s\": %m", G_STRFUNC, path);
+		fd_close(&cache_fd);
+	} else if (0 == sb.st_size) {
+		struct huge_cache_header h;
+
+		ZERO(&h);
+		memcpy(h.magic, HUGE_CACHE_MAGIC, sizeof h.magic);
+		h.version = HUGE_CACHE_VERSION;
+
+		if (sizeof h != UNSIGNED(write(cache_fd, &h, sizeof h))) {
+			g_warning("%s(): could not write to \"%s\": %m", G_STRFUNC, path);
+			fd_close(&cache_fd);
+		}
+		cache_records = 0;
+	}
+
+done:
+	HFREE_NULL(path);
+	return cache_fd != -1;
 }
 
 /**
  * Add an entry to the persistent cache.
+ *
+ * If the record cannot be appended, the persistent cache is flagged as
+ * dirty to have it rewritten entirely later.
  */
 static void
-add_persistent_cache_entry(const char *filename, filesize_t size,
-	time_t mtime, const struct sha1 *sha1, const struct tth *tth)
+add_persistent_cache_entry(const struct sha1_cache_entry *e)
 {
-	char *pathname;
-	FILE *f;
+	void *r;
+	size_t len;
 
-	pathname = make_pathname(settings_config_dir(), "sha1_cache");
-	f = file_fopen(pathname, "a");
-	if (f) {
-		filestat_t sb;
+	if G_UNLIKELY(cache_dirty)
+		return;		/* Will be rewritten anyway */
 
-		/*
-		 * If we're adding the very first entry (file empty), then emit header.
-		 */
+	r = cache_record_build(e, &len);
+
+	if (NULL == r)
+		return;		/* Path too long, cannot be persisted */
 
-		if (fstat(fileno(f), &sb)) {
-			g_warning("%s(): could not stat \"%s\": %m", G_STRFUNC, pathname);
+	if (cache_open_append()) {
+		if (len == UNSIGNED(write(cache_fd, r, len))) {
+			cache_records++;
 		} else {
-			if (0 == sb.st_size) {
-				fputs(sha1_persistent_cache_file_header, f);
-			}
-			cache_entry_print(f, filename, sha1, tth, size, mtime);
+			g_warning("%s(): could not append to SHA1 cache: %m", G_STRFUNC);
+			fd_close(&cache_fd);
+			cache_dirty = TRUE;
 		}
-		fclose(f);
 	} else {
-		g_warning("%s(): could not open \"%s\": %m", G_STRFUNC, pathname);
+		cache_dirty = TRUE;
 	}
-	HFREE_NULL(pathname);
+
+	HFREE_NULL(r);
+}
+
+/**
+ * @return TRUE if enough records were superseded in the persistent cache
+ * to warrant its compaction.
+ */
+static bool
+cache_needs_compaction(void)
+{
+	size_t live = hikset_count(sha1_cache);
+	size_t garbage = cache_records > live ? cache_records - live : 0;
+
+	return garbage >= HUGE_CACHE_GARBAGE_MIN && garbage >= live / 4;
 }
 
 struct dump_cache_context {
 	FILE *f;
+	size_t records;
+	size_t bytes;
 	bool forced;
+	bool failed;
 };
 
 /**
@@ -238,47 +387,264 @@ dump_cache_one_entry(void *value, void *udata)
 	struct sha1_cache_entry *e = value;
 	struct dump_cache_context *ctx = udata;
 
+	if (ctx->failed)
+		return;
+
 	if (ctx->forced || e->shared) {
-		cache_entry_print(ctx->f,
-			e->file_name, e->sha1, e->tth, e->size, e->mtime);
+		void *r;
+		size_t len;
+
+		r = cache_record_build(e, &len);
+		if (r != NULL) {
+			if (1 == fwrite(r, len, 1, ctx->f)) {
+				ctx->records++;
+				ctx->bytes += len;
+			} else {
+				ctx->failed = TRUE;
+			}
+			HFREE_NULL(r);
+		}
 	}
 }
 
 /**
- * Dump the whole in-memory cache onto disk.
+ * Rewrite the whole in-memory cache onto disk, compacting the persistent
+ * cache.
+ *
+ * Unless forced, this is only done when the persistent cache is dirty or
+ * holds too many superseded records.
+ *
+ * @return TRUE if the persistent cache was rewritten.
  */
-static void
+static bool
 dump_cache(bool force)
 {
-	FILE *f;
-	file_path_t fp;
+	struct huge_cache_header h;
+	struct dump_cache_context ctx;
+	char *path, *tmp;
+	tm_t start, end;
+	bool ok = FALSE;
 
-	if (!force && !cache_dirty)
-		return;
+	if (!force && !cache_dirty && !cache_needs_compaction())
+		return FALSE;
 
-	file_path_set(&fp, settings_config_dir(), "sha1_cache");
-	f = file_config_open_write("SHA-1 cache", &fp);
-	if (f) {
-		struct dump_cache_context ctx;
+	tm_now_exact(&start);
+
+	ZERO(&h);
+	memcpy(h.magic, HUGE_CACHE_MAGIC, sizeof h.magic);
+	h.version = HUGE_CACHE_VERSION;
 
-		fputs(sha1_persistent_cache_file_header, f);
-		ctx.f = f;
-		ctx.forced = force;
-		hikset_foreach(sha1_cache, dump_cache_one_entry, &ctx);
-		if (file_config_close(f, &fp)) {
+	ZERO(&ctx);
+	ctx.forced = force;
+
+	path = cache_path();
+	tmp = h_strconcat(path, ".new", NULL_PTR);
+	ctx.f = file_fopen(tmp, "wb");
+
+	if (ctx.f != NULL) {
+		ok = 1 == fwrite(&h, sizeof h, 1, ctx.f);
+		if (ok) {
+			hikset_foreach(sha1_cache, dump_cache_one_entry, &ctx);
+			ok = !ctx.failed;
+		}
+
+		if (0 != file_sync_fclose(ctx.f))
+			ok = FALSE;
+
+		/*
+		 * The file opened for appending is the one we are replacing.
+		 */
+
+		if (ok) {
+			fd_close(&cache_fd);
+			if (-1 == rename(tmp, path)) {
+				g_warning("%s(): cannot rename %s as %s: %m",
+					G_STRFUNC, tmp, path);
+				ok = FALSE;
+			}
+		}
+
+		if (ok) {
 			cache_dirty = FALSE;
+			cache_records = ctx.records;
+		} else {
+			g_warning("%s(): cannot write %s", G_STRFUNC, tmp);
+			unlink(tmp);
 		}
 	}
 
+	HFREE_NULL(tmp);
+	HFREE_NULL(path);
+
+	if (ok && GNET_PROPERTY(share_debug)) {
+		tm_now_exact(&end);
+		g_info("%s(): wrote %zu record%s (%zu bytes) in %u ms",
+			G_STRFUNC, ctx.records, plural(ctx.records),
+			ctx.bytes + sizeof h, (unsigned) tm_elapsed_ms(&end, &start));
+	}
+
 	/*
 	 * Update the timestamp even on failure to avoid that we retry this
 	 * too frequently.
 	 */
 	cache_dumped = tm_time();
+
+	return ok;
+}
+
+/**
+ * Load the records of the persistent cache into memory.
+ *
+ * Parsing stops at the first invalid record, which can only happen if we
+ * crashed whilst appending to the cache: the cache is then flagged as
+ * dirty so that it gets rewritten.
+ *
+ * Contrary to the old text format, we no longer stat() each file whilst
+ * loading, which would make startup I/O-bound on large libraries: the
+ * entries are checked against the actual file size and modification time
+ * when used, and entries for files that are no longer shared are removed
+ * by huge_sha1_cache_prune() after the first library scan.
+ *
+ * @return TRUE if the persistent cache was found and loaded.
+ */
+static bool G_COLD
+sha1_load_cache(void)
+{
+	const struct huge_cache_header *h;
+	const void *p, *end;
+	filestat_t sb;
+	char *path, *name = NULL;
+	size_t namelen = 0, records = 0;
+	void *base;
+	tm_t start, done;
+	int fd;
+
+	tm_now_exact(&start);
+
+	path = cache_path();
+	fd = file_open_missing(path, O_RDONLY);
+	HFREE_NULL(path);
+
+	if (-1 == fd)
+		return FALSE;
+
+	if (-1 == fstat(fd, &sb) || UNSIGNED(sb.st_size) < sizeof *h) {
+		fd_forget_and_close(&fd);
+		return FALSE;
+	}
+
+#ifdef HAS_MMAP
+	base = vmm_mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	fd_forget_and_close(&fd);
+
+	if (MAP_FAILED == base) {
+		g_warning("%s(): cannot map %s: %m", G_STRFUNC, sha1_cache_file);
+		return FALSE;
+	}
+#else	/* !HAS_MMAP */
+	base = halloc(sb.st_size);
+	if (UNSIGNED(sb.st_size) != UNSIGNED(read(fd, base, sb.st_size))) {
+		g_warning("%s(): cannot read %s: %m", G_STRFUNC, sha1_cache_file);
+		fd_forget_and_close(&fd);
+		HFREE_NULL(base);
+		return FALSE;
+	}
+	fd_forget_and_close(&fd);
+#endif	/* HAS_MMAP */
+
+	h = base;
+
+	if (
+		0 != memcmp(h->magic, HUGE_CACHE_MAGIC, sizeof h->magic) ||
+		HUGE_CACHE_VERSION != h->version
+	) {
+		g_warning("%s(): ignoring invalid %s", G_STRFUNC, sha1_cache_file);
+		cache_dirty = TRUE;
+		goto done;
+	}
+
+	p = const_ptr_add_offset(base, sizeof *h);
+	end = const_ptr_add_offset(base, sb.st_size);
+
+	while (p != end) {
+		const struct huge_cache_record *r = p;
+		struct sha1_cache_entry *cached;
+		const struct tth *tth;
+		size_t len;
+
+		if (ptr_diff(end, p) < sizeof *r)
+			break;
+
+		len = cache_record_size(r->pathlen);
+
+		if (
+			ptr_diff(end, p) < len ||
+			r->crc != cache_record_crc(r, len)
+		)
+			break;
+
+		if (r->pathlen >= namelen) {
+			namelen = r->pathlen + 1;
+			name = hrealloc(name, namelen);
+		}
+		memcpy(name, const_ptr_add_offset(r, sizeof *r), r->pathlen);
+		name[r->pathlen] = '\0';
+
+		if (r->hash != binary_hash(name, r->pathlen))
+			break;
+
+		tth = (r->flags & HUGE_CACHE_F_TTH) ? &r->tth : NULL;
+		cached = hikset_lookup(sha1_cache, name);
+
+		if (cached != NULL) {
+			cached->size = r->size;
+			cached->mtime = r->mtime;
+			atom_sha1_change(&cached->sha1, &r->sha1);
+			atom_tth_change(&cached->tth, tth);
+		} else {
+			add_volatile_cache_entry(name, r->size, r->mtime,
+				&r->sha1, tth, FALSE);
+		}
+
+		records++;
+		p = const_ptr_add_offset(p, len);
+	}
+
+	if (p != end) {
+		g_warning("%s(): ignoring last %zu bytes of %s after %zu record%s",
+			G_STRFUNC, ptr_diff(end, p), sha1_cache_file,
+			records, plural(records));
+		cache_dirty = TRUE;
+	}
+
+	cache_records = records;
+	HFREE_NULL(name);
+
+	if (GNET_PROPERTY(share_debug)) {
+		size_t n = hikset_count(sha1_cache);
+
+		tm_now_exact(&done);
+		g_info("%s(): loaded %zu entr%s from %zu record%s (%s bytes) in %u ms",
+			G_STRFUNC, n, plural_y(n), records, plural(records),
+			filesize_to_string(sb.st_size),
+			(unsigned) tm_elapsed_ms(&done, &start));
+	}
+
+	/* FALL THROUGH */
+
+done:
+#ifdef HAS_MMAP
+	if (-1 == vmm_munmap(base, sb.st_size))
+		g_warning("%s(): munmap() failed: %m", G_STRFUNC);
+#else
+	HFREE_NULL(base);
+#endif
+
+	return TRUE;
 }
 
 /**
- * This function is used to read the disk cache into memory.
+ * This function is used to read the old text disk cache into memory.
  *
  * It must be passed one line from the cache (ending with '\n'). It
  * performs all the syntactic processing to extract the fields from
@@ -386,6 +752,9 @@ failure:
 
 /**
  * Read the whole persistent cache into memory.
+ *
+ * When there is no binary cache yet, the old text cache is loaded instead
+ * and converted.
  */
 static void G_COLD
 sha1_read_cache(void)
@@ -396,7 +765,13 @@ sha1_read_cache(void)
 
 	g_return_if_fail(settings_config_dir());
 
-	file_path_set(fp, settings_config_dir(), "sha1_cache");
+	if (sha1_load_cache()) {
+		if (cache_dirty)
+			dump_cache(TRUE);
+		return;
+	}
+
+	file_path_set(fp, settings_config_dir(), sha1_cache_text);
 	f = file_config_open_read("SHA-1 cache", fp, N_ITEMS(fp));
 	if (f) {
 		for (;;) {
@@ -414,7 +789,18 @@ sha1_read_cache(void)
 			}
 		}
 		fclose(f);
-		dump_cache(TRUE);
+
+		if (dump_cache(TRUE)) {
+			char *path = make_pathname(settings_config_dir(), sha1_cache_text);
+
+			if (GNET_PROPERTY(share_debug)) {
+				g_info("%s(): converted \"%s\" into \"%s\"",
+					G_STRFUNC, sha1_cache_text, sha1_cache_file);
+			}
+			if (-1 == unlink(path))
+				g_warning("%s(): cannot unlink \"%s\": %m", G_STRFUNC, path);
+			HFREE_NULL(path);
+		}
 	}
 }
 
@@ -451,14 +837,16 @@ cache_dump_due(cqueue_t *cq, void *unused_obj)
 }
 
 /**
- * Dump the cache at most about once per HUGE_SHA1_CACHE_FREQ secs..
+ * Rewrite the cache when needed, at most about once per
+ * HUGE_SHA1_CACHE_FREQ secs..
  */
 static void
 cache_dump_schedule(void)
 {
 	time_delta_t t;
 
-	cache_dirty = TRUE;
+	if (!cache_dirty && !cache_needs_compaction())
+		return;
 
 	if G_UNLIKELY(0 == cache_dumped) {
 		t = 0;
@@ -537,15 +925,15 @@ huge_update_hashes(shared_file_t *sf,
 	if (cached) {
 		update_volatile_cache(cached, shared_file_size(sf),
 			shared_file_modification_time(sf), sha1, tth);
+		add_persistent_cache_entry(cached);	/* Supersedes older record */
 
-		cache_dump_schedule(); 	/* Dump cache once per minute */
+		cache_dump_schedule(); 	/* Compact cache at most once per minute */
 	} else {
 		add_volatile_cache_entry(shared_file_path(sf),
 			shared_file_size(sf), shared_file_modification_time(sf),
 			sha1, tth, TRUE);
-		add_persistent_cache_entry(shared_file_path(sf),
-			shared_file_size(sf), shared_file_modification_time(sf),
-			sha1, tth);
+		cached = hikset_lookup(sha1_cache, shared_file_path(sf));
+		add_persistent_cache_entry(cached);
 	}
 	return TRUE;
 }
@@ -629,8 +1017,19 @@ huge_verify_callback(const struct verify *ctx, enum verify_status status,
 	case VERIFY_PROGRESS:
 		return shared_file_indexed(sf);
 	case VERIFY_DONE:
-		huge_update_hashes(sf, verify_sha1_digest(ctx), NULL);
-		request_tigertree(sf, TRUE);
+		{
+			const struct tth *tth = verify_bitprint_tth(ctx);
+
+			/*
+			 * The TTH leaves are persisted before updating the hashes, as
+			 * done by request_tigertree_callback(), so that the shared file
+			 * is known to have its TTH available.
+			 */
+
+			tth_cache_insert(tth, verify_bitprint_leaves(ctx),
+				verify_bitprint_leave_count(ctx));
+			huge_update_hashes(sf, verify_bitprint_sha1(ctx), tth);
+		}
 		/* FALL THROUGH */
 	case VERIFY_ERROR:
 	case VERIFY_SHUTDOWN:
@@ -647,8 +1046,7 @@ huge_verify_callback(const struct verify *ctx, enum verify_status status,
 /**
  * Put the shared file on the stack of the things to do.
  *
- * We first begin with the computation of the SHA1, and when completed we
- * will continue with the TTH computation.
+ * Both the SHA1 and the TTH are computed in a single pass over the file.
  */
 static void
 queue_shared_file_for_sha1_computation(shared_file_t *sf)
@@ -657,7 +1055,7 @@ queue_shared_file_for_sha1_computation(shared_file_t *sf)
 
  	shared_file_check(sf);
 
-	inserted = verify_sha1_enqueue(FALSE, shared_file_path(sf),
+	inserted = verify_bitprint_enqueue(FALSE, shared_file_path(sf),
 					shared_file_size(sf), huge_verify_callback,
 					shared_file_ref(sf));
 
@@ -729,7 +1127,6 @@ request_sha1(shared_file_t *sf)
 	cached = hikset_lookup(sha1_cache, shared_file_path(sf));
 
 	if (cached && cached_entry_up_to_date(cached, sf)) {
-		cache_dirty = TRUE;
 		cached->shared = TRUE;
 		shared_file_set_sha1(sf, cached->sha1);
 		shared_file_set_tth(sf, cached->tth);
@@ -1099,6 +1496,7 @@ void
 huge_close(void)
 {
 	dump_cache(FALSE);
+	fd_close(&cache_fd);
 
 	hikset_foreach(sha1_cache, cache_free_entry, NULL);
 	hikset_free_null(&sha1_cache);
@@ -3275,6 +3275,7 @@ share_close(void)
 	share_free();
 	shared_dirs_free();
 	huge_close();
+	tth_cache_close();
 	qrp_close();
 	oob_proxy_close();
 	oob_close();			/* References hits, so needs ``sha1_to_share'' */
@@ -4167,6 +4168,7 @@ share_init(void)
 	size_t i;
 
 	huge_init();
+	tth_cache_init();
 	qrp_init();
 	qhit_init();
 	oob_init();
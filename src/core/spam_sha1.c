@@ -29,6 +29,14 @@
  *
  * SHA-1 based spam filtering.
  *
+ * The SHA-1s listed in the text file are compiled into a binary cache, which
+ * is memory-mapped on the next startups as long as the text file is not
+ * changed, saving the parsing time and the memory of the sorted table.
+ *
+ * In the binary cache, SHA-1s are sorted and indexed by their leading bits
+ * so that checking for a SHA-1 only touches one bucket of the index and
+ * usually one SHA-1 in the data.
+ *
  * @author Markus Goetz
  * @date 2003
  * @author Raphael Manfredi
@@ -46,12 +54,19 @@
 #include "lib/ascii.h"
 #include "lib/atoms.h"
 #include "lib/dbmw.h"
+#include "lib/endian.h"
+#include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/halloc.h"
+#include "lib/hstrfn.h"
 #include "lib/path.h"
+#include "lib/pow2.h"
 #include "lib/sorted_array.h"
 #include "lib/str.h"
+#include "lib/vmm.h"
+#include "lib/vsort.h"
 #include "lib/watcher.h"
+#include "lib/xmalloc.h"
 
 #include "if/gnet_property.h"
 #include "if/gnet_property_priv.h"
@@ -64,10 +79,48 @@
 #define SPAM_DB_RUN_CACHESIZE	128		/* During operations, less demanding */
 #define SPAM_DBMW_CACHESIZE		1024	/* DB wrapper cache size */
 
+#define SPAM_CACHE_MAGIC		"GTKGSHA1"
+#define SPAM_CACHE_VERSION		1
+#define SPAM_CACHE_BITS_MIN		8	/* Minimum amount of bits for buckets */
+#define SPAM_CACHE_BITS_MAX		20	/* Maximum amount of bits for buckets */
+
 static const char spam_sha1_file[] = "spam_sha1.txt";
 static const char spam_sha1_what[] = "Spam SHA-1 database";
+static const char spam_sha1_cache[] = "spam_sha1.bin";
 static char db_spambase[] = "spam_sha1";
 
+/**
+ * Header of the binary SHA-1 cache.
+ *
+ * This is a local cache, so it is written in native byte order.  The header
+ * is followed by the bucket index, made of (1 << bits) + 1 integers giving
+ * the position of the first SHA-1 starting with the bucket number, and then
+ * by the sorted SHA-1s.
+ */
+struct spam_cache_header {
+	char magic[8];				/**< SPAM_CACHE_MAGIC */
+	uint32 version;				/**< SPAM_CACHE_VERSION */
+	uint32 count;				/**< Amount of SHA-1s */
+	uint32 bits;				/**< Leading SHA-1 bits used to index buckets */
+	uint32 reserved;
+	uint64 mtime;				/**< Modification time of the text file */
+	uint64 size;				/**< Size of the text file */
+};
+
+/**
+ * The memory-mapped binary cache.
+ */
+struct spam_cache {
+	void *base;					/**< Start of memory-mapped file */
+	size_t size;				/**< Size of mapping */
+	const uint32 *index;		/**< Bucket index */
+	const struct sha1 *sha1;	/**< Sorted SHA-1s */
+	uint32 count;				/**< Amount of SHA-1s */
+	uint shift;					/**< Shift to get bucket from leading bits */
+};
+
+static struct spam_cache spam_cache;
+
 enum spam_state {
 	SPAM_UNINITIALIZED = 0,
 	SPAM_LOADING = 1,
@@ -127,12 +180,53 @@ spam_lut_create(void)
 	}
 }
 
+/**
+ * Wrap the SDBM lookup table once loading is finished.
+ */
+static void
+spam_lut_wrap(void)
+{
+	dbmap_t *dm = sha1_lut.d.dm;
+
+	/*
+	 * Now that loading is finished, we can wrap the dbmap to use some
+	 * amount of high-level caching, and therefore reduce the amount
+	 * of low-level caching done.
+	 */
+
+	dbmap_set_cachesize(dm, SPAM_DB_RUN_CACHESIZE);
+	sha1_lut.d.dw = dbmw_create(dm, spam_sha1_what,
+		0, 0,
+		NULL, NULL, NULL,
+		SPAM_DBMW_CACHESIZE, sha1_hash, sha1_eq);
+}
+
+/**
+ * Create the lookup table on the first SHA-1 we have to add to it.
+ *
+ * There is no lookup table when the SHA-1s were all found in the binary
+ * cache, unless other SHA-1s are later added (from the spam file).
+ */
+static void
+spam_lut_need(void)
+{
+	if (sha1_lut.tab != NULL || sha1_lut.d.dm != NULL)
+		return;
+
+	spam_lut_create();
+
+	if (SPAM_LOADED == sha1_lut.state && NULL == sha1_lut.tab)
+		spam_lut_wrap();
+}
+
 void
 spam_sha1_add(const struct sha1 *sha1)
 {
 	g_assert(sha1_lut.state != SPAM_UNINITIALIZED);
 	g_return_if_fail(sha1);
 
+	spam_lut_need();
+
 	if (sha1_lut.tab)
 		sorted_array_add(sha1_lut.tab, sha1);
 	else {
@@ -158,47 +252,258 @@ spam_sha1_sync(void)
 {
 	if (sha1_lut.tab) {
 		sorted_array_sync(sha1_lut.tab, sha1_collision);
-	} else if (SPAM_LOADING == sha1_lut.state) {
-		dbmap_t *dm = sha1_lut.d.dm;
+	} else if (SPAM_LOADING == sha1_lut.state && sha1_lut.d.dm != NULL) {
+		spam_lut_wrap();
+	}
+}
 
-		/*
-		 * Now that loading is finished, we can wrap the dbmap to use some
-		 * amount of high-level caching, and therefore reduce the amount
-		 * of low-level caching done.
-		 */
+/**
+ * @return the path of the binary cache, to be freed with hfree().
+ */
+static char *
+spam_cache_path(void)
+{
+	return make_pathname(settings_gnet_db_dir(), spam_sha1_cache);
+}
+
+/**
+ * Compute size of the bucket index, in bytes.
+ */
+static inline size_t
+spam_cache_index_size(uint bits)
+{
+	return ((1U << bits) + 1) * sizeof(uint32);
+}
+
+/**
+ * Check whether SHA-1 is listed in the binary cache.
+ */
+static bool
+spam_cache_lookup(const struct sha1 *sha1)
+{
+	const struct spam_cache *sc = &spam_cache;
+	uint32 b, i, end;
+
+	b = peek_be32(sha1->data) >> sc->shift;
+	end = sc->index[b + 1];
+
+	/*
+	 * Buckets are sized to hold about one SHA-1, so a linear scan is faster
+	 * than anything else.
+	 */
 
-		dbmap_set_cachesize(dm, SPAM_DB_RUN_CACHESIZE);
-		sha1_lut.d.dw = dbmw_create(dm, spam_sha1_what,
-			0, 0,
-			NULL, NULL, NULL,
-			SPAM_DBMW_CACHESIZE, sha1_hash, sha1_eq);
+	for (i = sc->index[b]; i < end; i++) {
+		int c = sha1_cmp(&sc->sha1[i], sha1);
+
+		if (c >= 0)
+			return 0 == c;
 	}
+
+	return FALSE;
 }
 
 /**
- * Load spam database from the supplied FILE.
+ * Unmap the binary cache.
+ */
+static void
+spam_cache_close(void)
+{
+	if (spam_cache.base != NULL) {
+		if (-1 == vmm_munmap(spam_cache.base, spam_cache.size))
+			g_warning("%s(): munmap() failed: %m", G_STRFUNC);
+	}
+	ZERO(&spam_cache);
+}
+
+/**
+ * Map the binary cache, provided it is valid and was built from the text
+ * file whose status is given.
  *
- * The current file format is as follows:
+ * @return TRUE if the cache is now usable.
+ */
+static bool
+spam_cache_open(const filestat_t *st)
+{
+#ifdef HAS_MMAP
+	const struct spam_cache_header *h;
+	const uint32 *index;
+	filestat_t buf;
+	char *path;
+	void *p;
+	size_t i;
+	int fd;
+
+	path = spam_cache_path();
+	fd = file_open_missing(path, O_RDONLY);
+	HFREE_NULL(path);
+
+	if (-1 == fd)
+		return FALSE;
+
+	if (
+		-1 == fstat(fd, &buf) ||
+		UNSIGNED(buf.st_size) < sizeof *h + spam_cache_index_size(0)
+	) {
+		fd_forget_and_close(&fd);
+		return FALSE;
+	}
+
+	p = vmm_mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	fd_forget_and_close(&fd);
+
+	if (MAP_FAILED == p) {
+		g_warning("%s(): cannot map %s: %m", G_STRFUNC, spam_sha1_cache);
+		return FALSE;
+	}
+
+	h = p;
+
+	if (
+		0 != memcmp(h->magic, SPAM_CACHE_MAGIC, sizeof h->magic) ||
+		SPAM_CACHE_VERSION != h->version ||
+		UNSIGNED(st->st_mtime) != h->mtime ||
+		UNSIGNED(st->st_size) != h->size ||
+		h->bits < SPAM_CACHE_BITS_MIN || h->bits > SPAM_CACHE_BITS_MAX ||
+		UNSIGNED(buf.st_size) != sizeof *h +
+			spam_cache_index_size(h->bits) + (size_t) h->count * SHA1_RAW_SIZE
+	) {
+		if (GNET_PROPERTY(spam_debug))
+			g_debug("%s(): %s is stale or invalid", G_STRFUNC, spam_sha1_cache);
+		vmm_munmap(p, buf.st_size);
+		return FALSE;
+	}
+
+	/*
+	 * Lookups trust the bucket index to stay within the mapped SHA-1s, so
+	 * it must start at 0, never decrease and end with the SHA-1 count.
+	 */
+
+	index = const_ptr_add_offset(p, sizeof *h);
+
+	if (0 != index[0] || index[1U << h->bits] != h->count)
+		goto corrupted;
+
+	for (i = 0; i < 1U << h->bits; i++) {
+		if (index[i] > index[i + 1])
+			goto corrupted;
+	}
+
+	spam_cache.base = p;
+	spam_cache.size = buf.st_size;
+	spam_cache.count = h->count;
+	spam_cache.shift = 32 - h->bits;
+	spam_cache.index = index;
+	spam_cache.sha1 = const_ptr_add_offset(index,
+		spam_cache_index_size(h->bits));
+
+	return TRUE;
+
+corrupted:
+	g_warning("%s(): corrupted bucket index in %s", G_STRFUNC, spam_sha1_cache);
+	vmm_munmap(p, buf.st_size);
+	return FALSE;
+#else	/* !HAS_MMAP */
+	(void) st;
+	return FALSE;
+#endif	/* HAS_MMAP */
+}
+
+/**
+ * Write the binary cache for the sorted SHA-1s.
  *
- * # Comment
- * <SHA1 #1>
- * <SHA1 #2>
- * etc...
+ * @param vec	the sorted SHA-1s, without duplicates
+ * @param count	amount of SHA-1s
+ * @param st	status of the text file from which SHA-1s were loaded
  *
- * @returns the amount of entries loaded or -1 on failure.
+ * @return TRUE if the cache was successfully written.
  */
-static ulong G_COLD
-spam_sha1_load(FILE *f)
+static bool
+spam_cache_write(const struct sha1 *vec, size_t count, const filestat_t *st)
+{
+	struct spam_cache_header h;
+	uint32 *index;
+	size_t i, j, buckets;
+	char *path, *tmp;
+	FILE *f;
+	bool ok = FALSE;
+
+	if (count >= MAX_INT_VAL(uint32))
+		return FALSE;
+
+	ZERO(&h);
+	memcpy(h.magic, SPAM_CACHE_MAGIC, sizeof h.magic);
+	h.version = SPAM_CACHE_VERSION;
+	h.count = count;
+	h.bits = 0 == count ? SPAM_CACHE_BITS_MIN : highest_bit_set(count);
+	h.bits = MAX(h.bits, SPAM_CACHE_BITS_MIN);
+	h.bits = MIN(h.bits, SPAM_CACHE_BITS_MAX);
+	h.mtime = st->st_mtime;
+	h.size = st->st_size;
+
+	/*
+	 * Since SHA-1s are sorted, the bucket numbers of successive SHA-1s are
+	 * increasing.  Each bucket points to the first SHA-1 not lying in a
+	 * previous bucket.
+	 */
+
+	buckets = (size_t) 1 << h.bits;
+	XMALLOC_ARRAY(index, buckets + 1);
+
+	for (i = 0, j = 0; i < buckets; i++) {
+		while (j < count && (peek_be32(vec[j].data) >> (32 - h.bits)) < i)
+			j++;
+		index[i] = j;
+	}
+	index[buckets] = count;
+
+	path = spam_cache_path();
+	tmp = h_strconcat(path, ".new", NULL_PTR);
+	f = file_fopen(tmp, "wb");
+
+	if (f != NULL) {
+		ok = 1 == fwrite(&h, sizeof h, 1, f) &&
+			buckets + 1 == fwrite(index, sizeof index[0], buckets + 1, f) &&
+			count == fwrite(vec, SHA1_RAW_SIZE, count, f);
+
+		if (0 != file_sync_fclose(f))
+			ok = FALSE;
+
+		if (ok && -1 == rename(tmp, path)) {
+			g_warning("%s(): cannot rename %s as %s: %m", G_STRFUNC, tmp, path);
+			ok = FALSE;
+		}
+
+		if (!ok) {
+			g_warning("%s(): cannot write %s", G_STRFUNC, tmp);
+			unlink(tmp);
+		}
+	}
+
+	XFREE_NULL(index);
+	HFREE_NULL(tmp);
+	HFREE_NULL(path);
+
+	return ok;
+}
+
+/**
+ * Parse spam database from the supplied FILE.
+ *
+ * @param f			the opened text file
+ * @param vec_ptr	where the allocated vector of sorted SHA-1s is returned
+ *
+ * @return the amount of unique SHA-1s parsed.
+ */
+static size_t G_COLD
+spam_sha1_parse(FILE *f, struct sha1 **vec_ptr)
 {
 	char line[1024];
 	uint line_no = 0;
-	ulong item_count = 0;
+	size_t count = 0, capacity = 0, i, j;
+	struct sha1 *vec = NULL;
 
 	g_assert(f);
 
-	spam_lut_create();
-	sha1_lut.state = SPAM_LOADING;
-
 	while (fgets(ARYLEN(line), f)) {
 		const struct sha1 *sha1;
 		size_t len;
@@ -242,15 +547,95 @@ spam_sha1_load(FILE *f)
 				G_STRFUNC, line_no);
 			continue;
 		}
-		spam_sha1_add(sha1);
-		item_count++;
+
+		if (count == capacity) {
+			capacity = MAX(1024, 2 * capacity);
+			XREALLOC_ARRAY(vec, capacity);
+		}
+		vec[count++] = *sha1;
+	}
+
+	if (count > 1)
+		vsort(vec, count, sizeof vec[0], sha1_cmp_func);
+
+	for (i = j = 0; i < count; i++) {
+		if (j != 0 && sha1_eq(&vec[j - 1], &vec[i])) {
+			sha1_collision(&vec[j - 1], &vec[i]);
+			continue;
+		}
+		vec[j++] = vec[i];
+	}
+
+	*vec_ptr = vec;
+	return j;
+}
+
+/**
+ * Load spam database from the supplied FILE.
+ *
+ * The current file format is as follows:
+ *
+ * # Comment
+ * <SHA1 #1>
+ * <SHA1 #2>
+ * etc...
+ *
+ * @returns the amount of entries loaded or -1 on failure.
+ */
+static ulong G_COLD
+spam_sha1_load(FILE *f)
+{
+	filestat_t buf;
+	ulong item_count = 0;
+	bool cached = FALSE;
+
+	g_assert(f);
+
+	sha1_lut.state = SPAM_LOADING;
+
+	/*
+	 * If the binary cache was built from the same text file, map it and
+	 * we are done.  Otherwise parse the text file and rebuild the cache.
+	 *
+	 * Should the cache not be usable, we revert to loading the SHA-1s in
+	 * the lookup table, which is otherwise not created.
+	 */
+
+	if (-1 == fstat(fileno(f), &buf)) {
+		g_warning("%s(): cannot stat %s: %m", G_STRFUNC, spam_sha1_file);
+		ZERO(&buf);
+	} else if (spam_cache_open(&buf)) {
+		item_count = spam_cache.count;
+		cached = TRUE;
+	}
+
+	if (!cached) {
+		struct sha1 *vec;
+		size_t i, n;
+
+		n = spam_sha1_parse(f, &vec);
+
+		if (0 == buf.st_mtime || !spam_cache_write(vec, n, &buf))
+			cached = FALSE;
+		else
+			cached = spam_cache_open(&buf);
+
+		if (!cached) {
+			for (i = 0; i < n; i++)
+				spam_sha1_add(&vec[i]);
+		}
+
+		item_count = n;
+		XFREE_NULL(vec);
 	}
 
 	spam_sha1_sync();
 	sha1_lut.state = SPAM_LOADED;
 
-	if (GNET_PROPERTY(spam_debug))
-		g_debug("loaded %lu SPAM SHA-1 keys", item_count);
+	if (GNET_PROPERTY(spam_debug)) {
+		g_debug("loaded %lu SPAM SHA-1 keys%s",
+			item_count, cached ? " (cached)" : "");
+	}
 
 	return item_count;
 }
@@ -335,6 +720,7 @@ spam_sha1_init(void)
 void
 spam_sha1_close(void)
 {
+	spam_cache_close();
 	sorted_array_free(&sha1_lut.tab);
 	if (sha1_lut.d.dw) {
 		dbmw_destroy(sha1_lut.d.dw, TRUE);
@@ -354,6 +740,15 @@ bool
 spam_sha1_check(const struct sha1 *sha1)
 {
 	g_return_val_if_fail(sha1, FALSE);
+
+	if (spam_cache.base != NULL && spam_cache_lookup(sha1))
+		return TRUE;
+
+	/*
+	 * The lookup table only exists when the binary cache could not be used
+	 * or when SHA-1s were added from the spam file.
+	 */
+
 	if (sha1_lut.tab)
 		return NULL != sorted_array_lookup(sha1_lut.tab, sha1);
 
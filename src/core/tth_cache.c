@@ -28,12 +28,16 @@
  *
  * Caching of tigertree data.
  *
- * The tigertree data for each shared file is stored in a file in the directory
- * GTK_GNUTELLA_DIR/tth_cache/ in raw binary form. For example, if the root
- * hash is 5EDB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ, the tigertree data is
- * stored in
- * $GTK_GNUTELLA_DIR/tth_cache/5E/DB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ.
- * This avoids storing too many files per directory.
+ * The tigertree data of all the shared files are packed in a single data
+ * file, GTK_GNUTELLA_DIR/tth_cache.dat, in raw binary form.  The location
+ * of the data for a given root hash is given by an index, a hash table
+ * keyed by the root hash which is kept in memory and periodically saved to
+ * GTK_GNUTELLA_DIR/tth_cache.idx.
+ *
+ * Space freed in the data file when entries are removed is reused by new
+ * entries, and the data file is compacted in the background when too much
+ * of it is unused, by moving the entries at the end of the file into the
+ * holes and truncating the file.
  *
  * Only the leaves at TTH_MAX_DEPTH or above are stored. The root hash and the
  * nodes at each level between above these leaves can be calculated from the
@@ -41,6 +45,14 @@
  *
  * If the depth is 1 (root only), nothing is stored.
  *
+ * Formerly, the tigertree data for each shared file was stored in its own
+ * file under GTK_GNUTELLA_DIR/tth_cache/.  For instance, if the root hash
+ * was 5EDB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ, the tigertree data was
+ * stored in
+ * $GTK_GNUTELLA_DIR/tth_cache/5E/DB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ.
+ * These files are migrated to the packed store in the background, and
+ * individually when they are looked up before the migration is complete.
+ *
  * @author Christian Biere
  * @date 2007
  * @author Raphael Manfredi
@@ -56,21 +68,29 @@
 
 #include "lib/atoms.h"
 #include "lib/base32.h"
+#include "lib/compat_pio.h"
+#include "lib/cq.h"
+#include "lib/endian.h"
+#include "lib/erbtree.h"
 #include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/ftw.h"
 #include "lib/halloc.h"
 #include "lib/hset.h"
 #include "lib/hstrfn.h"
+#include "lib/mutex.h"
 #include "lib/path.h"
+#include "lib/pow2.h"
 #include "lib/pslist.h"
-#include "lib/spinlock.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/thread.h"
 #include "lib/tigertree.h"
 #include "lib/timestamp.h"
+#include "lib/vmm.h"
+#include "lib/vsort.h"
 #include "lib/walloc.h"
+#include "lib/xmalloc.h"
 
 #include "if/gnet_property_priv.h"
 #include "if/core/main.h"		/* For debugging() */
@@ -83,14 +103,88 @@
 #define TTH_FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP) /* 0640 */
 #endif
 
+#define TTH_CACHE_MAGIC			"GTKGTTHC"
+#define TTH_CACHE_VERSION		1
+#define TTH_CACHE_SLOTS_MIN		1024		/**< Minimum index size */
+#define TTH_CACHE_SYNC_PERIOD	(60 * 1000)	/**< Index sync period, in ms */
+#define TTH_CACHE_COMPACT_MIN	(64 * 1024)	/**< Min free leaves to compact */
+#define TTH_CACHE_MOVE_FAILURES	64			/**< Max consecutive failed moves */
+
+/**
+ * Header of the index file.
+ *
+ * This is a local file, hence it is written in native byte order.  The
+ * header is followed by the index slots.
+ */
+struct tth_cache_header {
+	char magic[8];				/**< TTH_CACHE_MAGIC */
+	uint32 version;				/**< TTH_CACHE_VERSION */
+	uint32 slots;				/**< Amount of slots, a power of 2 */
+	uint32 count;				/**< Amount of used slots */
+	uint32 reserved;
+};
+
+/**
+ * An index slot, in a hash table using open addressing with linear probing.
+ *
+ * Offsets and lengths in the data file are expressed in leaves, which
+ * allows addressing of up to 96 GiB of tigertree data.
+ */
+struct tth_slot {
+	struct tth tth;				/**< Root hash */
+	uint32 offset;				/**< Offset of leaves in data file */
+	uint16 leaves;				/**< Amount of leaves, 0 if slot unused */
+	uint16 flags;				/**< TTH_SLOT_F_* flags */
+};
+
+#define TTH_SLOT_F_DELETED	(1U << 0)	/**< Removed entry (tombstone) */
+#define TTH_SLOT_F_NEW		(1U << 1)	/**< Inserted during this session */
+
+/**
+ * A hole in the data file.
+ */
+struct tth_hole {
+	rbnode_t node;				/**< Embedded tree node, ordered by offset */
+	uint32 offset;				/**< Start of hole, in leaves */
+	uint32 leaves;				/**< Length of hole, in leaves */
+};
+
+/**
+ * The packed tigertree store.
+ */
+static struct tth_store {
+	struct tth_slot *slots;		/**< The index */
+	size_t capacity;			/**< Amount of slots, a power of 2 */
+	size_t count;				/**< Used slots */
+	size_t deleted;				/**< Deleted slots */
+	erbtree_t holes;			/**< Holes in the data file */
+	uint64 live;				/**< Amount of leaves in use */
+	uint32 end;					/**< End of the data, in leaves */
+	int fd;						/**< Data file */
+	bool dirty;					/**< Whether index needs to be saved */
+	bool legacy;				/**< Old tth_cache/ tree to be migrated */
+} tth_store;
+
 /**
- * This lock is used to protect the creation / removal of directories
- * under the TTH cache.
+ * This lock protects the store, including the data file.
  */
-static spinlock_t tth_path_lk = SPINLOCK_INIT;
+static mutex_t tth_store_mtx = MUTEX_INIT;
+
+#define TTH_STORE_LOCK		mutex_lock(&tth_store_mtx)
+#define TTH_STORE_UNLOCK	mutex_unlock(&tth_store_mtx)
+
+/**
+ * This lock serializes the saving of the index.
+ */
+static mutex_t tth_sync_mtx = MUTEX_INIT;
+
+#define TTH_SYNC_LOCK		mutex_lock(&tth_sync_mtx)
+#define TTH_SYNC_UNLOCK		mutex_unlock(&tth_sync_mtx)
+
+static const char tth_cache_data_file[] = "tth_cache.dat";
+static const char tth_cache_index_file[] = "tth_cache.idx";
 
-#define TTH_PATH_LOCK		spinlock(&tth_path_lk)
-#define TTH_PATH_UNLOCK		spinunlock(&tth_path_lk)
+static cperiodic_t *tth_cache_sync_ev;
 
 static const char *
 tth_cache_directory(void)
@@ -116,292 +210,1081 @@ tth_cache_pathname(const struct tth *tth)
 			&hash[0], G_DIR_SEPARATOR, &hash[2]);
 }
 
+static size_t
+tth_cache_leave_count(const struct tth *tth, const filestat_t *sb)
+{
+	g_return_val_if_fail(tth, 0);
+	g_return_val_if_fail(sb, 0);
+
+	if (!S_ISREG(sb->st_mode)) {
+		g_warning("%s(%s): not a regular file", G_STRFUNC, tth_base32(tth));
+		return 0;
+	}
+	if (
+		sb->st_size % TTH_RAW_SIZE ||
+		sb->st_size < TTH_RAW_SIZE ||
+		sb->st_size > TTH_MAX_LEAVES * TTH_RAW_SIZE
+	) {
+		g_warning("%s(%s): bad filesize %s", G_STRFUNC,
+			tth_base32(tth), fileoffset_t_to_string(sb->st_size));
+		return 0;
+	}
+
+	return sb->st_size / TTH_RAW_SIZE;
+}
+
+/**
+ * Hole comparison routine, by offset.
+ */
 static int
-tth_cache_file_create(const struct tth *tth)
+tth_hole_cmp(const void *a, const void *b)
+{
+	const struct tth_hole *ha = a, *hb = b;
+
+	return CMP(ha->offset, hb->offset);
+}
+
+/**
+ * @return the index of the first slot to probe for the given root hash.
+ */
+static inline size_t
+tth_slot_first(const struct tth *tth)
+{
+	return peek_le32(tth->data) & (tth_store.capacity - 1);
+}
+
+/**
+ * Locate the slot of a root hash.
+ *
+ * The store must be locked.
+ *
+ * @return the slot, NULL if the root hash is not in the store.
+ */
+static struct tth_slot *
+tth_store_find(const struct tth *tth)
+{
+	size_t i, mask = tth_store.capacity - 1;
+
+	if G_UNLIKELY(NULL == tth_store.slots)
+		return NULL;
+
+	for (i = tth_slot_first(tth); /* empty */; i = (i + 1) & mask) {
+		struct tth_slot *s = &tth_store.slots[i];
+
+		if (0 == s->leaves) {
+			if (0 == (s->flags & TTH_SLOT_F_DELETED))
+				return NULL;
+		} else if (tth_eq(&s->tth, tth)) {
+			return s;
+		}
+	}
+
+	g_assert_not_reached();
+	return NULL;
+}
+
+/**
+ * Insert slot in the index, which must have room for it.
+ *
+ * @return the slot used.
+ */
+static struct tth_slot *
+tth_store_slot_insert(const struct tth_slot *slot)
 {
-	char *pathname;
-	int accmode;
+	size_t i, mask = tth_store.capacity - 1;
+	struct tth_slot *s;
+
+	g_assert(slot->leaves != 0);
+
+	for (i = tth_slot_first(&slot->tth); /* empty */; i = (i + 1) & mask) {
+		s = &tth_store.slots[i];
+		if (0 == s->leaves)
+			break;
+	}
+
+	if (s->flags & TTH_SLOT_F_DELETED) {
+		g_assert(tth_store.deleted != 0);
+		tth_store.deleted--;
+	}
+
+	*s = *slot;
+	tth_store.count++;
+
+	return s;
+}
+
+/**
+ * Resize the index so that it can hold about twice the amount of used slots,
+ * cleaning up all the deleted slots.
+ */
+static void
+tth_store_resize(void)
+{
+	struct tth_slot *old = tth_store.slots;
+	size_t i, capacity = tth_store.capacity;
+
+	tth_store.capacity = TTH_CACHE_SLOTS_MIN;
+	while (tth_store.capacity < 4 * (tth_store.count + 1))
+		tth_store.capacity *= 2;
+
+	tth_store.slots =
+		vmm_alloc0(tth_store.capacity * sizeof tth_store.slots[0]);
+	tth_store.count = tth_store.deleted = 0;
+
+	for (i = 0; i < capacity; i++) {
+		if (old[i].leaves != 0)
+			tth_store_slot_insert(&old[i]);
+	}
+
+	if (old != NULL)
+		vmm_free(old, capacity * sizeof old[0]);
+}
+
+/**
+ * Create slot for a root hash which is not present in the store.
+ *
+ * @return the new slot, to be filled by the caller.
+ */
+static struct tth_slot *
+tth_store_slot_new(const struct tth *tth, uint32 offset, uint16 leaves)
+{
+	struct tth_slot slot;
+
+	if ((tth_store.count + tth_store.deleted + 1) * 2 > tth_store.capacity)
+		tth_store_resize();
+
+	ZERO(&slot);
+	slot.tth = *tth;
+	slot.offset = offset;
+	slot.leaves = leaves;
+
+	return tth_store_slot_insert(&slot);
+}
+
+/**
+ * Mark slot as deleted.
+ */
+static void
+tth_store_slot_delete(struct tth_slot *s)
+{
+	g_assert(s->leaves != 0);
+	g_assert(tth_store.count != 0);
+
+	s->leaves = 0;
+	s->flags = TTH_SLOT_F_DELETED;
+	tth_store.count--;
+	tth_store.deleted++;
+	tth_store.dirty = TRUE;
+}
+
+/**
+ * Release space in the data file, merging it with adjacent holes.
+ *
+ * Space released at the end of the data is given back.
+ */
+static void
+tth_store_release(uint32 offset, uint32 leaves)
+{
+	struct tth_hole *h, *p;
+	rbnode_t *rn;
+
+	g_assert(tth_store.live >= leaves);
+
+	tth_store.live -= leaves;
+
+	WALLOC0(h);
+	h->offset = offset;
+	h->leaves = leaves;
+	p = erbtree_insert(&tth_store.holes, &h->node);
+
+	g_assert_log(NULL == p, "%s(): space at %u released twice",
+		G_STRFUNC, offset);
+
+	rn = erbtree_prev(&h->node);
+	if (rn != NULL) {
+		p = erbtree_data(&tth_store.holes, rn);
+		g_assert(p->offset + p->leaves <= h->offset);
+		if (p->offset + p->leaves == h->offset) {
+			p->leaves += h->leaves;
+			erbtree_remove(&tth_store.holes, &h->node);
+			WFREE(h);
+			h = p;
+		}
+	}
+
+	rn = erbtree_next(&h->node);
+	if (rn != NULL) {
+		p = erbtree_data(&tth_store.holes, rn);
+		g_assert(h->offset + h->leaves <= p->offset);
+		if (h->offset + h->leaves == p->offset) {
+			h->leaves += p->leaves;
+			erbtree_remove(&tth_store.holes, &p->node);
+			WFREE(p);
+		}
+	}
+
+	if (h->offset + h->leaves == tth_store.end) {
+		tth_store.end = h->offset;
+		erbtree_remove(&tth_store.holes, &h->node);
+		WFREE(h);
+	}
+}
+
+/**
+ * Allocate space in the data file, using the first hole large enough.
+ *
+ * @param leaves	amount of leaves to allocate
+ * @param limit		the allocated space must end before this offset
+ * @param offset	where the allocated offset is written
+ *
+ * @return TRUE if space was allocated.
+ */
+static bool
+tth_store_allocate(uint32 leaves, uint32 limit, uint32 *offset)
+{
+	rbnode_t *rn;
+
+	ERBTREE_FOREACH(&tth_store.holes, rn) {
+		struct tth_hole *h = erbtree_data(&tth_store.holes, rn);
+
+		if (h->offset + leaves > limit)
+			return FALSE;
+
+		if (h->leaves >= leaves) {
+			*offset = h->offset;
+			if (h->leaves == leaves) {
+				erbtree_remove(&tth_store.holes, &h->node);
+				WFREE(h);
+			} else {
+				h->offset += leaves;	/* Keeps ordering */
+				h->leaves -= leaves;
+			}
+			goto allocated;
+		}
+	}
+
+	if (
+		tth_store.end > MAX_INT_VAL(uint32) - leaves ||
+		tth_store.end + leaves > limit
+	)
+		return FALSE;
+
+	*offset = tth_store.end;
+	tth_store.end += leaves;
+
+	/* FALL THROUGH */
+
+allocated:
+	tth_store.live += leaves;
+	return TRUE;
+}
+
+/**
+ * Read leaves from the data file.
+ *
+ * @return TRUE on success.
+ */
+static bool
+tth_store_read(const struct tth *tth, uint32 offset, struct tth *leaves,
+	size_t n)
+{
+	size_t size = n * TTH_RAW_SIZE;
+	ssize_t ret;
+
+	STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
+
+	ret = compat_pread(tth_store.fd, leaves, size,
+			(filesize_t) offset * TTH_RAW_SIZE);
+
+	if ((ssize_t) -1 == ret) {
+		g_warning("%s(%s): pread() failed: %m", G_STRFUNC, tth_base32(tth));
+	} else if ((size_t) ret != size) {
+		g_warning("%s(%s): incomplete pread()", G_STRFUNC, tth_base32(tth));
+	}
+
+	return (size_t) ret == size;
+}
+
+/**
+ * Write leaves to the data file.
+ *
+ * @return TRUE on success.
+ */
+static bool
+tth_store_write(const struct tth *tth, uint32 offset,
+	const struct tth *leaves, size_t n)
+{
+	size_t size = n * TTH_RAW_SIZE;
+	ssize_t ret;
+
+	ret = compat_pwrite(tth_store.fd, leaves, size,
+			(filesize_t) offset * TTH_RAW_SIZE);
+
+	if ((ssize_t) -1 == ret) {
+		g_warning("%s(%s): pwrite() failed: %m", G_STRFUNC, tth_base32(tth));
+	} else if ((size_t) ret != size) {
+		g_warning("%s(%s): incomplete pwrite()", G_STRFUNC, tth_base32(tth));
+	}
+
+	return (size_t) ret == size;
+}
+
+/**
+ * Store leaves for a root hash, superseding any previous entry.
+ *
+ * @return TRUE if leaves were stored.
+ */
+static bool
+tth_store_insert(const struct tth *tth, const struct tth *leaves, size_t n)
+{
+	struct tth_slot *s;
+	uint32 offset;
+	bool ok = FALSE;
+
+	g_assert(n > 1 && n <= TTH_MAX_LEAVES);
+
+	TTH_STORE_LOCK;
+
+	if G_UNLIKELY(-1 == tth_store.fd)
+		goto done;		/* Store unavailable, or closed */
+
+	s = tth_store_find(tth);
+
+	if (s != NULL && s->leaves != n) {
+		tth_store_release(s->offset, s->leaves);
+		tth_store_slot_delete(s);
+		s = NULL;
+	}
+
+	if (NULL == s) {
+		if (!tth_store_allocate(n, MAX_INT_VAL(uint32), &offset)) {
+			g_warning("%s(%s): TTH cache is full", G_STRFUNC, tth_base32(tth));
+			goto done;
+		}
+		s = tth_store_slot_new(tth, offset, n);
+	}
+
+	s->flags |= TTH_SLOT_F_NEW;
+	tth_store.dirty = TRUE;
+
+	if (tth_store_write(tth, s->offset, leaves, n)) {
+		ok = TRUE;
+	} else {
+		tth_store_release(s->offset, s->leaves);
+		tth_store_slot_delete(s);
+	}
+
+	/* FALL THROUGH */
+
+done:
+	TTH_STORE_UNLOCK;
+	return ok;
+}
+
+/**
+ * Import old cached entry into the packed store, removing the file.
+ *
+ * @param tth		the root hash
+ * @param path		the path of the old cached entry
+ *
+ * @return TRUE if the entry was imported.
+ */
+static bool
+tth_cache_legacy_import(const struct tth *tth, const char *path)
+{
+	struct tth *leaves = NULL;
+	filestat_t sb;
+	size_t n = 0;
+	bool ok = FALSE, remove = FALSE;
 	int fd;
 
-	g_return_val_if_fail(tth, -1);
+	fd = file_open_missing(path, O_RDONLY);
+	if (-1 == fd)
+		return FALSE;
+
+	if (fstat(fd, &sb)) {
+		g_warning("%s(%s): fstat() failed: %m", G_STRFUNC, tth_base32(tth));
+		goto done;
+	}
+
+	n = tth_cache_leave_count(tth, &sb);
+
+	if (n > 1) {
+		size_t size = n * TTH_RAW_SIZE;
+		struct tth root;
+
+		leaves = halloc(size);
+		if ((ssize_t) size != read(fd, leaves, size)) {
+			g_warning("%s(%s): read() failed: %m", G_STRFUNC, tth_base32(tth));
+			goto done;
+		}
+
+		root = tt_root_hash(leaves, n);
+		if (tth_eq(tth, &root)) {
+			remove = ok = tth_store_insert(tth, leaves, n);
+		} else {
+			g_warning("%s(): removing corrupted tigertree for %s",
+				G_STRFUNC, tth_base32(tth));
+			remove = TRUE;
+		}
+	} else {
+		remove = TRUE;		/* Invalid entry */
+	}
+
+	/* FALL THROUGH */
+
+done:
+	fd_forget_and_close(&fd);
+	HFREE_NULL(leaves);
+
+	if (remove && -1 == unlink(path))
+		g_warning("%s(): cannot remove %s: %m", G_STRFUNC, path);
+
+	return ok;
+}
+
+/**
+ * Locate entry in the store, importing it from the old tree if needed.
+ *
+ * @param tth		the root hash
+ * @param slot		where the slot is copied, if found
+ *
+ * @return TRUE if the entry was found.
+ */
+static bool
+tth_store_locate(const struct tth *tth, struct tth_slot *slot)
+{
+	const struct tth_slot *s;
+	bool legacy;
+
+	TTH_STORE_LOCK;
+	s = tth_store_find(tth);
+	if (s != NULL)
+		*slot = *s;
+	legacy = tth_store.legacy;
+	TTH_STORE_UNLOCK;
+
+	if (NULL == s && legacy) {
+		char *path = tth_cache_pathname(tth);
+		bool imported = tth_cache_legacy_import(tth, path);
+
+		HFREE_NULL(path);
+
+		if (imported)
+			return tth_store_locate(tth, slot);
+	}
+
+	return s != NULL;
+}
+
+void
+tth_cache_insert(const struct tth *tth, const struct tth *leaves, int n_leaves)
+{
+	g_return_if_fail(tth);
+	g_return_if_fail(leaves);
+	g_return_if_fail(n_leaves >= 1);
+	g_return_if_fail(n_leaves <= TTH_MAX_LEAVES);
+
+	{
+		struct tth root;
+
+		root = tt_root_hash(leaves, n_leaves);
+		g_return_if_fail(tth_eq(tth, &root));
+	}
+
+	if (1 == n_leaves)
+		return;
+
+	tth_store_insert(tth, leaves, n_leaves);
+}
+
+/**
+ * @return The number of leaves or zero if unknown.
+ */
+size_t
+tth_cache_lookup(const struct tth *tth, filesize_t filesize)
+{
+	size_t expected, leave_count = 0;
+
+	g_return_val_if_fail(tth, 0);
+
+	expected = tt_good_node_count(filesize);
+	if (expected > 1) {
+		struct tth_slot slot;
+
+		if (tth_store_locate(tth, &slot))
+			leave_count = slot.leaves;
+	} else {
+		leave_count = 1;
+	}
+	return expected != leave_count ? 0 : leave_count;
+}
+
+void
+tth_cache_remove(const struct tth *tth)
+{
+	struct tth_slot *s;
+
+	g_return_if_fail(tth);
+
+	TTH_STORE_LOCK;
+
+	s = tth_store_find(tth);
+	if (s != NULL) {
+		tth_store_release(s->offset, s->leaves);
+		tth_store_slot_delete(s);
+	}
+
+	TTH_STORE_UNLOCK;
+}
+
+/**
+ * Read the leaves of the cached entry, with a single read from the data file.
+ */
+static size_t
+tth_cache_get_leaves(const struct tth *tth,
+	struct tth leaves[TTH_MAX_LEAVES], size_t n)
+{
+	struct tth_slot slot;
+	const struct tth_slot *s;
+	size_t num_leaves = 0;
+
+	g_return_val_if_fail(tth, 0);
+	g_return_val_if_fail(leaves, 0);
 
-	accmode = O_WRONLY | O_TRUNC;
-	pathname = tth_cache_pathname(tth);
+	if (!tth_store_locate(tth, &slot))
+		return 0;
 
 	/*
-	 * Critical section required since we could have a concurrent thread
-	 * deciding to remove empty directories whilst we are attempting
-	 * to create a new directory to store the new cached entry!
+	 * The entry could have been moved by a concurrent compaction since
+	 * we located it, hence we need to look it up again.
 	 */
 
-	TTH_PATH_LOCK;
+	TTH_STORE_LOCK;
+
+	s = tth_store_find(tth);
+	if (s != NULL) {
+		size_t n_leaves = MIN(n, s->leaves);
+
+		if (tth_store_read(tth, s->offset, leaves, n_leaves))
+			num_leaves = n_leaves;
+	}
+
+	TTH_STORE_UNLOCK;
 
-	fd = file_create_missing(pathname, accmode, TTH_FILE_MODE);
-	if (fd < 0 && ENOENT == errno) {
-		char *dir = filepath_directory(pathname);
-		if (0 == create_directory(dir, DEFAULT_DIRECTORY_MODE)) {
-			fd = file_create(pathname, accmode, TTH_FILE_MODE);
+	return num_leaves;
+}
+
+size_t
+tth_cache_get_tree(const struct tth *tth, filesize_t filesize,
+	const struct tth **tree)
+{
+	static struct tth nodes[TTH_MAX_LEAVES * 2];
+	size_t n_leaves, expected;
+
+	g_return_val_if_fail(tth, 0);
+	g_return_val_if_fail(tree, 0);
+
+	expected = tt_good_node_count(filesize);
+	if (1 == expected) {
+		nodes[0] = *tth;
+		*tree = &nodes[0];
+		return 1;
+	}
+
+	*tree = NULL;
+
+	n_leaves = tth_cache_get_leaves(tth,
+					&nodes[TTH_MAX_LEAVES], TTH_MAX_LEAVES);
+	g_assert(n_leaves <= TTH_MAX_LEAVES);
+
+	if (expected == n_leaves) {
+		size_t n_nodes, dst, src;
+
+		n_nodes = n_leaves;
+		dst = TTH_MAX_LEAVES;
+
+		while (n_leaves > 1) {
+			src = dst;
+			dst = src - (n_leaves + 1) / 2;
+
+			n_leaves = tt_compute_parents(&nodes[dst], &nodes[src], n_leaves);
+			n_nodes += n_leaves;
+		}
+
+		if (tth_eq(tth, &nodes[dst])) {
+			*tree = &nodes[dst];
+			return n_nodes;
 		}
-		HFREE_NULL(dir);
 	}
 
-	TTH_PATH_UNLOCK;
+	if (n_leaves != 0) {
+		g_warning("%s(): removing corrupted tigertree for %s",
+			G_STRFUNC, tth_base32(tth));
+		tth_cache_remove(tth);
+	}
+	return 0;
+}
 
-	HFREE_NULL(pathname);
-	return fd;
+/**
+ * Get amount of leaves stored in the cached TTH entry.
+ *
+ * @param tth		the TTH for which we want the information
+ *
+ * @return 0 if the entry could not be located, the amount of leaves otherwise.
+ */
+size_t
+tth_cache_get_nleaves(const struct tth *tth)
+{
+	struct tth_slot slot;
+
+	g_return_val_if_fail(tth != NULL, 0);
+
+	return tth_store_locate(tth, &slot) ? slot.leaves : 0;
 }
 
+/**
+ * Save the index if it changed.
+ */
+static void
+tth_store_sync(void)
+{
+	struct tth_cache_header h;
+	struct tth_slot *slots;
+	size_t size;
+	char *path, *tmp;
+	FILE *f;
+	bool ok = FALSE;
+
+	TTH_SYNC_LOCK;
+
+	/*
+	 * Take a snapshot of the index, to avoid keeping the store locked
+	 * whilst we write it.
+	 */
+
+	TTH_STORE_LOCK;
+
+	if (!tth_store.dirty || NULL == tth_store.slots) {
+		TTH_STORE_UNLOCK;
+		TTH_SYNC_UNLOCK;
+		return;
+	}
+
+	ZERO(&h);
+	memcpy(h.magic, TTH_CACHE_MAGIC, sizeof h.magic);
+	h.version = TTH_CACHE_VERSION;
+	h.slots = tth_store.capacity;
+	h.count = tth_store.count;
+
+	size = tth_store.capacity * sizeof slots[0];
+	slots = vmm_alloc(size);
+	memcpy(slots, tth_store.slots, size);
+	tth_store.dirty = FALSE;
+
+	TTH_STORE_UNLOCK;
+
+	path = make_pathname(settings_config_dir(), tth_cache_index_file);
+	tmp = h_strconcat(path, ".new", NULL_PTR);
+	f = file_fopen(tmp, "wb");
+
+	if (f != NULL) {
+		ok = 1 == fwrite(&h, sizeof h, 1, f) &&
+			h.slots == fwrite(slots, sizeof slots[0], h.slots, f);
+
+		if (0 != file_sync_fclose(f))
+			ok = FALSE;
+
+		if (ok && -1 == rename(tmp, path)) {
+			g_warning("%s(): cannot rename %s as %s: %m", G_STRFUNC, tmp, path);
+			ok = FALSE;
+		}
+
+		if (!ok) {
+			g_warning("%s(): cannot write %s", G_STRFUNC, tmp);
+			unlink(tmp);
+		}
+	}
+
+	if (!ok) {
+		TTH_STORE_LOCK;
+		tth_store.dirty = TRUE;		/* Will retry later */
+		TTH_STORE_UNLOCK;
+	}
+
+	vmm_free(slots, size);
+	HFREE_NULL(tmp);
+	HFREE_NULL(path);
+
+	TTH_SYNC_UNLOCK;
+}
+
+/**
+ * Callout queue periodic event to save the index.
+ */
+static bool
+tth_cache_periodic_sync(void *unused_obj)
+{
+	(void) unused_obj;
+
+	tth_store_sync();
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * An extent in the data file, used when loading the index and compacting.
+ */
+struct tth_extent {
+	struct tth tth;				/**< Root hash of the entry */
+	uint32 offset;				/**< Offset of leaves in data file */
+	uint32 leaves;				/**< Amount of leaves */
+};
+
+/**
+ * Extent comparison routine, by increasing offset.
+ */
+static int
+tth_extent_cmp(const void *a, const void *b)
+{
+	const struct tth_extent *ea = a, *eb = b;
+
+	return CMP(ea->offset, eb->offset);
+}
+
+/**
+ * Extent comparison routine, by decreasing offset.
+ */
 static int
-tth_cache_file_open(const struct tth *tth)
+tth_extent_revcmp(const void *a, const void *b)
+{
+	return tth_extent_cmp(b, a);
+}
+
+/**
+ * Load the saved index, computing the holes in the data file.
+ *
+ * Entries that do not fit in the data file or that overlap with another
+ * entry are discarded.  Space in the data file not referenced by the index
+ * (because we did not save the index after writing new entries) becomes
+ * a hole, to be reused.
+ *
+ * @param size		the size of the data file
+ */
+static void G_COLD
+tth_store_load(filesize_t size)
 {
-	char *pathname;
+	const struct tth_cache_header *h;
+	const struct tth_slot *slots;
+	struct tth_extent *ext;
+	filestat_t sb;
+	char *path;
+	void *base;
+	uint64 max = size / TTH_RAW_SIZE;
+	size_t i, n, dropped = 0;
+	uint32 end;
 	int fd;
 
-	g_return_val_if_fail(tth, -1);
+	path = make_pathname(settings_config_dir(), tth_cache_index_file);
+	fd = file_open_missing(path, O_RDONLY);
+	HFREE_NULL(path);
+
+	if (-1 == fd)
+		return;
+
+	if (-1 == fstat(fd, &sb) || UNSIGNED(sb.st_size) < sizeof *h) {
+		fd_forget_and_close(&fd);
+		return;
+	}
+
+#ifdef HAS_MMAP
+	base = vmm_mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	fd_forget_and_close(&fd);
+
+	if (MAP_FAILED == base) {
+		g_warning("%s(): cannot map %s: %m", G_STRFUNC, tth_cache_index_file);
+		return;
+	}
+#else	/* !HAS_MMAP */
+	base = halloc(sb.st_size);
+	if (UNSIGNED(sb.st_size) != UNSIGNED(read(fd, base, sb.st_size))) {
+		g_warning("%s(): cannot read %s: %m", G_STRFUNC, tth_cache_index_file);
+		fd_forget_and_close(&fd);
+		HFREE_NULL(base);
+		return;
+	}
+	fd_forget_and_close(&fd);
+#endif	/* HAS_MMAP */
+
+	h = base;
+
+	if (
+		0 != memcmp(h->magic, TTH_CACHE_MAGIC, sizeof h->magic) ||
+		TTH_CACHE_VERSION != h->version ||
+		!IS_POWER_OF_2(h->slots) || h->slots < TTH_CACHE_SLOTS_MIN ||
+		h->count > h->slots / 2 ||
+		UNSIGNED(sb.st_size) != sizeof *h + h->slots * sizeof slots[0]
+	) {
+		g_warning("%s(): ignoring invalid %s",
+			G_STRFUNC, tth_cache_index_file);
+		goto done;
+	}
 
-	pathname = tth_cache_pathname(tth);
-	fd = file_open_missing(pathname, O_RDONLY);
-	HFREE_NULL(pathname);
-	return fd;
-}
+	/*
+	 * Sort the saved entries by offset to validate them and spot the holes.
+	 */
 
-static bool
-tth_cache_file_exists(const struct tth *tth)
-{
-	bool ret;
-	char *pathname;
+	slots = const_ptr_add_offset(base, sizeof *h);
+	XMALLOC_ARRAY(ext, h->count + 1);
 
-	g_return_val_if_fail(tth, FALSE);
+	for (i = n = 0; i < h->slots && n < h->count; i++) {
+		const struct tth_slot *s = &slots[i];
 
-	pathname = tth_cache_pathname(tth);
-	ret = file_exists(pathname);
-	HFREE_NULL(pathname);
-	return ret;
-}
+		if (0 == s->leaves)
+			continue;
 
-void
-tth_cache_insert(const struct tth *tth, const struct tth *leaves, int n_leaves)
-{
-	int fd;
+		if (s->leaves > TTH_MAX_LEAVES || s->offset + s->leaves > max) {
+			dropped++;
+			continue;
+		}
 
-	g_return_if_fail(tth);
-	g_return_if_fail(leaves);
-	g_return_if_fail(n_leaves >= 1);
+		ext[n].tth = s->tth;
+		ext[n].offset = s->offset;
+		ext[n].leaves = s->leaves;
+		n++;
+	}
 
-	{
-		struct tth root;
+	vsort(ext, n, sizeof ext[0], tth_extent_cmp);
 
-		root = tt_root_hash(leaves, n_leaves);
-		g_return_if_fail(tth_eq(tth, &root));
-	}
+	tth_store.capacity = h->slots;
+	tth_store.slots =
+		vmm_alloc0(tth_store.capacity * sizeof tth_store.slots[0]);
 
-	if (1 == n_leaves)
-		return;
+	for (i = 0, end = 0; i < n; i++) {
+		const struct tth_extent *e = &ext[i];
 
-	fd = tth_cache_file_create(tth);
-	if (fd >= 0) {
-		size_t size;
-		ssize_t ret;
+		if (e->offset < end || NULL != tth_store_find(&e->tth)) {
+			dropped++;
+			continue;
+		}
 
-		STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
+		if (e->offset != end) {
+			struct tth_hole *hole;
 
-		size = TTH_RAW_SIZE * n_leaves;
-		ret = write(fd, leaves, size);
-		if ((ssize_t) -1 == ret) {
-			g_warning("%s(%s): write() failed: %m", G_STRFUNC, tth_base32(tth));
-		} else if ((size_t) ret != size) {
-			g_warning("%s(%s): incomplete write()", G_STRFUNC, tth_base32(tth));
+			WALLOC0(hole);
+			hole->offset = end;
+			hole->leaves = e->offset - end;
+			erbtree_insert(&tth_store.holes, &hole->node);
 		}
-		fd_forget_and_close(&fd);
+
+		tth_store_slot_new(&e->tth, e->offset, e->leaves);
+		tth_store.live += e->leaves;
+		end = e->offset + e->leaves;
 	}
-}
 
-static size_t
-tth_cache_leave_count(const struct tth *tth, const filestat_t *sb)
-{
-	g_return_val_if_fail(tth, 0);
-	g_return_val_if_fail(sb, 0);
+	tth_store.end = end;
+	XFREE_NULL(ext);
 
-	if (!S_ISREG(sb->st_mode)) {
-		g_warning("%s(%s): not a regular file", G_STRFUNC, tth_base32(tth));
-		return 0;
+	if (dropped != 0) {
+		g_warning("%s(): dropped %zu invalid entr%s from %s",
+			G_STRFUNC, dropped, plural_y(dropped), tth_cache_index_file);
+		tth_store.dirty = TRUE;
 	}
-	if (
-		sb->st_size % TTH_RAW_SIZE ||
-		sb->st_size < TTH_RAW_SIZE ||
-		sb->st_size > TTH_MAX_LEAVES * TTH_RAW_SIZE
-	) {
-		g_warning("%s(%s): bad filesize %s", G_STRFUNC,
-			tth_base32(tth), fileoffset_t_to_string(sb->st_size));
-		return 0;
+
+	if (debugging(0)) {
+		g_info("%s(): loaded %zu entr%s, %zu hole%s, %s free in TTH cache",
+			G_STRFUNC, tth_store.count, plural_y(tth_store.count),
+			erbtree_count(&tth_store.holes),
+			plural(erbtree_count(&tth_store.holes)),
+			compact_size((tth_store.end - tth_store.live) * TTH_RAW_SIZE,
+				FALSE));
 	}
 
-	return sb->st_size / TTH_RAW_SIZE;
+	/* FALL THROUGH */
+
+done:
+#ifdef HAS_MMAP
+	if (-1 == vmm_munmap(base, sb.st_size))
+		g_warning("%s(): munmap() failed: %m", G_STRFUNC);
+#else
+	HFREE_NULL(base);
+#endif
 }
 
 /**
- * @return The number of leaves or zero if unknown.
+ * Truncate the data file at the end of the data.
+ *
+ * The store must be locked.
  */
-size_t
-tth_cache_lookup(const struct tth *tth, filesize_t filesize)
+static void
+tth_store_truncate(void)
 {
-	size_t expected, leave_count = 0;
-
-	g_return_val_if_fail(tth, 0);
+	fileoffset_t size = (fileoffset_t) tth_store.end * TTH_RAW_SIZE;
 
-	expected = tt_good_node_count(filesize);
-	if (expected > 1) {
-		filestat_t sb;
-		char *pathname;
-
-		pathname = tth_cache_pathname(tth);
-		if (stat(pathname, &sb)) {
-			leave_count = 0;
-			if (ENOENT != errno) {
-				g_warning("%s(%s): stat(\"%s\") failed: %m",
-					G_STRFUNC, tth_base32(tth), pathname);
-			}
-		} else {
-			leave_count = tth_cache_leave_count(tth, &sb);
-		}
-		HFREE_NULL(pathname);
-	} else {
-		leave_count = 1;
+	if (-1 == ftruncate(tth_store.fd, size)) {
+		g_warning("%s(): cannot truncate %s to %s bytes: %m",
+			G_STRFUNC, tth_cache_data_file, fileoffset_t_to_string(size));
 	}
-	return expected != leave_count ? 0 : leave_count;
 }
 
-void
-tth_cache_remove(const struct tth *tth)
+/**
+ * Compact the data file if too much of it is unused.
+ *
+ * Entries are moved, starting with the one at the end of the data file,
+ * into the first hole large enough to hold them, until the amount of
+ * free space becomes small enough or we can no longer move entries.
+ *
+ * The store is only locked whilst each entry is moved, so that compaction
+ * does not prevent concurrent accesses.
+ */
+static void
+tth_store_compact(void)
 {
-	char *pathname;
+	struct tth_extent *ext;
+	struct tth *leaves;
+	size_t i, n, moved = 0, failures = 0;
+	uint32 start;
 
-	g_return_if_fail(tth);
+	TTH_STORE_LOCK;
 
-	pathname = tth_cache_pathname(tth);
-	unlink(pathname);
-	HFREE_NULL(pathname);
-}
+	start = tth_store.end;
 
-static size_t
-tth_cache_get_leaves(const struct tth *tth,
-	struct tth leaves[TTH_MAX_LEAVES], size_t n)
-{
-	int fd, num_leaves = 0;
+	if (
+		NULL == tth_store.slots ||
+		tth_store.end - tth_store.live < TTH_CACHE_COMPACT_MIN ||
+		(tth_store.end - tth_store.live) * 4 < tth_store.end
+	) {
+		TTH_STORE_UNLOCK;
+		return;
+	}
 
-	g_return_val_if_fail(tth, 0);
-	g_return_val_if_fail(leaves, 0);
+	XMALLOC_ARRAY(ext, tth_store.count + 1);
 
-	fd = tth_cache_file_open(tth);
-	if (fd >= 0) {
-		filestat_t sb;
+	for (i = n = 0; i < tth_store.capacity; i++) {
+		const struct tth_slot *s = &tth_store.slots[i];
 
-		if (fstat(fd, &sb)) {
-			g_warning("%s(%s): fstat() failed: %m", G_STRFUNC, tth_base32(tth));
-		} else {
-			size_t n_leaves;
+		if (0 == s->leaves)
+			continue;
+
+		ext[n].tth = s->tth;
+		ext[n].offset = s->offset;
+		ext[n].leaves = s->leaves;
+		n++;
+	}
+
+	TTH_STORE_UNLOCK;
 
-			n_leaves = tth_cache_leave_count(tth, &sb);
-			n_leaves = MIN(n, n_leaves);
-			if (n_leaves > 0) {
-				size_t size;
-				ssize_t ret;
+	vsort(ext, n, sizeof ext[0], tth_extent_revcmp);
+	XMALLOC_ARRAY(leaves, TTH_MAX_LEAVES);
 
-				STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
+	for (i = 0; i < n; i++) {
+		const struct tth_extent *e = &ext[i];
+		struct tth_slot *s;
+		uint32 offset;
+		bool done;
 
-				size = TTH_RAW_SIZE * n_leaves;
-				ret = read(fd, &leaves[0].data, size);
-				if ((size_t) ret == size) {
-					num_leaves = n_leaves;
+		TTH_STORE_LOCK;
+
+		s = tth_store_find(&e->tth);
+
+		if (
+			-1 != tth_store.fd && s != NULL &&
+			s->offset == e->offset && s->leaves == e->leaves
+		) {
+			if (tth_store_allocate(s->leaves, s->offset, &offset)) {
+				if (
+					tth_store_read(&s->tth, s->offset, leaves, s->leaves) &&
+					tth_store_write(&s->tth, offset, leaves, s->leaves)
+				) {
+					tth_store_release(s->offset, s->leaves);
+					s->offset = offset;
+					tth_store.dirty = TRUE;
+					failures = 0;
+					moved++;
+				} else {
+					tth_store_release(offset, s->leaves);
+					failures = TTH_CACHE_MOVE_FAILURES;		/* I/O error */
 				}
+			} else {
+				failures++;
 			}
 		}
-		fd_forget_and_close(&fd);
-	}
-	return num_leaves;
-}
 
-size_t
-tth_cache_get_tree(const struct tth *tth, filesize_t filesize,
-	const struct tth **tree)
-{
-	static struct tth nodes[TTH_MAX_LEAVES * 2];
-	size_t n_leaves, expected;
+		done = -1 == tth_store.fd ||
+			failures >= TTH_CACHE_MOVE_FAILURES ||
+			(tth_store.end - tth_store.live) * 10 < tth_store.end;
 
-	g_return_val_if_fail(tth, 0);
-	g_return_val_if_fail(tree, 0);
+		TTH_STORE_UNLOCK;
 
-	expected = tt_good_node_count(filesize);
-	if (1 == expected) {
-		nodes[0] = *tth;
-		*tree = &nodes[0];
-		return 1;
+		if (done)
+			break;
 	}
 
-	*tree = NULL;
-
-	n_leaves = tth_cache_get_leaves(tth,
-					&nodes[TTH_MAX_LEAVES], TTH_MAX_LEAVES);
-	g_assert(n_leaves <= TTH_MAX_LEAVES);
-
-	if (expected == n_leaves) {
-		size_t n_nodes, dst, src;
-
-		n_nodes = n_leaves;
-		dst = TTH_MAX_LEAVES;
+	XFREE_NULL(leaves);
+	XFREE_NULL(ext);
 
-		while (n_leaves > 1) {
-			src = dst;
-			dst = src - (n_leaves + 1) / 2;
+	TTH_STORE_LOCK;
 
-			n_leaves = tt_compute_parents(&nodes[dst], &nodes[src], n_leaves);
-			n_nodes += n_leaves;
-		}
+	if (-1 != tth_store.fd)
+		tth_store_truncate();
 
-		if (tth_eq(tth, &nodes[dst])) {
-			*tree = &nodes[dst];
-			return n_nodes;
-		}
+	if (debugging(0)) {
+		g_info("%s(): moved %zu entr%s, TTH cache shrunk by %s",
+			G_STRFUNC, moved, plural_y(moved),
+			compact_size(
+				(uint64) (start - MIN(start, tth_store.end)) * TTH_RAW_SIZE,
+				FALSE));
 	}
 
-	if (tth_cache_file_exists(tth)) {
-		g_warning("%s(): removing corrupted tigertree for %s",
-			G_STRFUNC, tth_base32(tth));
-		tth_cache_remove(tth);
-	}
-	return 0;
+	TTH_STORE_UNLOCK;
 }
 
 /**
- * Get amount of leaves stored in the cached TTH entry.
+ * Remove entries created before this session that are not shared.
  *
- * @param tth		the TTH for which we want the information
+ * We do not remove entries created during this session: users could start
+ * unsharing directories, moving files around, add new files, etc..  Each
+ * time a new library rescan occurs, we're going to create new entries, or
+ * some cached entries could become unused for a while and then files will
+ * reappear in the library.
  *
- * @return 0 if the entry could not be located, the amount of leaves otherwise.
+ * By only ever cleaning up entries created before the current session,
+ * we have a higher likelyhood of processing an obsolete cache entry.
  */
-size_t
-tth_cache_get_nleaves(const struct tth *tth)
+static void
+tth_store_prune(void)
 {
-	int fd;
-	filesize_t nleaves = 0;
+	hset_t *shared;
+	size_t i, pruned = 0;
 
-	g_return_val_if_fail(tth != NULL, 0);
+	shared = share_tthset_get();
 
-	fd = tth_cache_file_open(tth);
+	TTH_STORE_LOCK;
 
-	if (fd >= 0) {
-		filestat_t sb;
+	for (i = 0; i < tth_store.capacity; i++) {
+		struct tth_slot *s = &tth_store.slots[i];
 
-		if (fstat(fd, &sb)) {
-			g_warning("%s(%s): fstat() failed: %m", G_STRFUNC, tth_base32(tth));
-		} else {
-			nleaves = tth_cache_leave_count(tth, &sb);
-		}
+		if (0 == s->leaves || (s->flags & TTH_SLOT_F_NEW))
+			continue;
 
-		fd_forget_and_close(&fd);
+		if (!hset_contains(shared, &s->tth)) {
+			if (debugging(0)) {
+				g_debug("%s(): unshared TTH %s",
+					G_STRFUNC, tth_base32(&s->tth));
+			}
+			tth_store_release(s->offset, s->leaves);
+			tth_store_slot_delete(s);
+			pruned++;
+		}
 	}
 
-	return nleaves;
+	TTH_STORE_UNLOCK;
+
+	share_tthset_free(shared);
+
+	if (debugging(0) && pruned != 0) {
+		g_info("%s(): removed %zu unshared entr%s from TTH cache",
+			G_STRFUNC, pruned, plural_y(pruned));
+	}
 }
 
 /**
@@ -414,24 +1297,10 @@ tth_cache_dir_rmdir(const char *path)
 	if (debugging(0))
 		g_message("%s(): removing TTH cache directory %s", G_STRFUNC, path);
 
-	/*
-	 * To avoid any conflicts with another thread attempting to create a
-	 * file under that directory, take a lock.
-	 *
-	 * Note that there is a race condition between the traversal that detects
-	 * the directory is empty and the time we actually attempt to remove it.
-	 * Hence, we silence any error having to deal with the directory being
-	 * non-empty and therefore non-removable.
-	 */
-
-	TTH_PATH_LOCK;
-
 	if (-1 == rmdir(path) && ENOTEMPTY != errno) {
 		g_warning("%s(): cannot remove TTH cache directory %s: %m",
 			G_STRFUNC, path);
 	}
-
-	TTH_PATH_UNLOCK;
 }
 
 
@@ -451,7 +1320,7 @@ tth_cache_cleanup_rmdir(
 			tth_cache_dir_rmdir(info->fpath);	/* Try, we can't read it */
 		} else if (FTW_F_DONE & info->flags) {
 			void *cnt = (*dirsp)->data;
-			if (NULL == cnt && 0 != info->level)
+			if (NULL == cnt)
 				tth_cache_dir_rmdir(info->fpath);
 			*dirsp = pslist_delete_link(*dirsp, *dirsp);	/* Strip head */
 		} else {
@@ -464,46 +1333,37 @@ tth_cache_cleanup_rmdir(
 	return FTW_STATUS_OK;
 }
 
-/**
- * Unlink cached file entry, warning if it cannot be done but otherwise not
- * logging anything on success.
- *
- * @return TRUE on success
- */
-static bool
-tth_cache_file_unlink(const char *path, const char *reason)
-{
-	if (-1 == unlink(path)) {
-		g_warning("%s(): cannot remove %s TTH cache entry %s: %m",
-			G_STRFUNC, reason, path);
-		return FALSE;
-	}
-
-	return TRUE;
-}
-
 /**
  * Remove cached file entry, logging success.
  */
 static void
 tth_cache_file_remove(const char *path, const char *reason)
 {
-	if (tth_cache_file_unlink(path, reason))
+	if (-1 == unlink(path)) {
+		g_warning("%s(): cannot remove %s TTH cache entry %s: %m",
+			G_STRFUNC, reason, path);
+	} else {
 		g_message("removed %s TTH cache entry: %s", reason, path);
+	}
 }
 
 /**
- * ftw_foreach() callback to remove obsolete / spurious files.
+ * ftw_foreach() callback to import old cached files into the store.
  */
 static ftw_status_t
-tth_cache_cleanup_unlink(
-	const ftw_info_t *info, const filestat_t *sb, void *data)
+tth_cache_migrate_file(
+	const ftw_info_t *info, const filestat_t *unused_sb, void *data)
 {
-	const hset_t *shared = data;
+	size_t *imported = data;
+
+	(void) unused_sb;
 
 	if (FTW_F_DIR & info->flags)
 		return FTW_STATUS_OK;
 
+	if (-1 == tth_store.fd)
+		return FTW_STATUS_ABORT;	/* Store was closed */
+
 	if ((FTW_F_OTHER | FTW_F_SYMLINK) & info->flags) {
 		tth_cache_file_remove(info->fpath, "alien");
 		return FTW_STATUS_OK;
@@ -541,36 +1401,10 @@ tth_cache_cleanup_unlink(
 			TTH_RAW_SIZE != base32_decode(VARLEN(tth), b32, TTH_BASE32_SIZE)
 		) {
 			tth_cache_file_remove(info->fpath, "invalid");
-			goto done;
-		}
-
-		/*
-		 * At this point, we have a valid TTH cache filename.
-		 *
-		 * We want to only process files created before the session started.
-		 *
-		 * The rationale is that users could start unsharing directories,
-		 * moving files around, add new files, etc..  Each time a new library
-		 * rescan occurs, we're going to create new TTH cache files, or some
-		 * cached files could become unused for a while and then files will
-		 * reappear in the library.
-		 *
-		 * By only ever cleaning up files created before the current session,
-		 * we have a higher likelyhood of processing an obsolete cache entry.
-		 */
-
-		if (delta_time(sb->st_mtime, GNET_PROPERTY(session_start_stamp)) >= 0)
-			goto done;		/* Created after session started, skip */
-
-		if (!hset_contains(shared, &tth)) {
-			if (debugging(0))
-				g_debug("%s(): unshared TTH (%s)", G_STRFUNC, info->rpath);
-			(void) tth_cache_file_unlink(info->fpath, "unshared");
+		} else if (tth_cache_legacy_import(&tth, info->fpath)) {
+			(*imported)++;
 		}
 
-		/* FALL THROUGH */
-
-	done:
 		g_strfreev(path);
 		return FTW_STATUS_OK;
 	}
@@ -579,44 +1413,33 @@ tth_cache_cleanup_unlink(
 	return FTW_STATUS_ERROR;
 }
 
-static int tth_cache_cleanups;
-
 /**
- * Main entry point for the thread that cleans up the TTH cache.
+ * Migrate the old tth_cache/ tree into the packed store, removing it.
  */
-static void *
-tth_cache_cleanup_thread(void *unused_arg)
+static void
+tth_cache_migrate(void)
 {
-	hset_t *shared;
 	const char *rootdir = tth_cache_directory();
 	pslist_t *dirstack;
 	uint32 flags;
 	ftw_status_t res;
+	size_t imported = 0;
 
-	(void) unused_arg;
-
-	if (!is_directory(rootdir))
-		goto done;			/* No TTH cache */
-
-	/*
-	 * First pass: spot all file entries that are older than our start
-	 * time (i.e. were created in another session) and which cannot be
-	 * associated with a shared file.
-	 */
-
-	shared = share_tthset_get();
 	flags = FTW_O_PHYS | FTW_O_MOUNT | FTW_O_ALL;
-	res = ftw_foreach(rootdir, flags, 0, tth_cache_cleanup_unlink, shared);
-	share_tthset_free(shared);
+	res = ftw_foreach(rootdir, flags, 0, tth_cache_migrate_file, &imported);
+
+	if (debugging(0) || imported != 0) {
+		g_info("%s(): imported %zu entr%s into TTH cache",
+			G_STRFUNC, imported, plural_y(imported));
+	}
 
 	if (res != FTW_STATUS_OK) {
-		g_warning("%s(): initial traversal failed with %d, aborting",
-			G_STRFUNC, res);
-		goto done;
+		g_warning("%s(): traversal failed with %d, aborting", G_STRFUNC, res);
+		return;
 	}
 
 	/*
-	 * Second pass: spot empty directories and remove them.
+	 * Remove the now empty directories, including the root directory.
 	 */
 
 	flags |= FTW_O_ENTRY | FTW_O_DEPTH;
@@ -624,6 +1447,33 @@ tth_cache_cleanup_thread(void *unused_arg)
 	(void) ftw_foreach(rootdir, flags, 0, tth_cache_cleanup_rmdir, &dirstack);
 	pslist_free(dirstack);
 
+	if (!is_directory(rootdir)) {
+		TTH_STORE_LOCK;
+		tth_store.legacy = FALSE;
+		TTH_STORE_UNLOCK;
+	}
+}
+
+static int tth_cache_cleanups;
+
+/**
+ * Main entry point for the thread that cleans up the TTH cache.
+ */
+static void *
+tth_cache_cleanup_thread(void *unused_arg)
+{
+	(void) unused_arg;
+
+	if (-1 == tth_store.fd)
+		goto done;			/* No TTH cache */
+
+	if (tth_store.legacy)
+		tth_cache_migrate();
+
+	tth_store_prune();
+	tth_store_compact();
+	tth_store_sync();
+
 	/* FALL THROUGH */
 
 done:
@@ -648,16 +1498,83 @@ tth_cache_cleanup(void)
 	}
 }
 
-void
+void G_COLD
 tth_cache_init(void)
 {
-	/* NOTHING */
+	filestat_t sb;
+	char *path;
+
+	erbtree_init(&tth_store.holes, tth_hole_cmp,
+		offsetof(struct tth_hole, node));
+
+	path = make_pathname(settings_config_dir(), tth_cache_data_file);
+	tth_store.fd = file_create(path, O_RDWR, TTH_FILE_MODE);
+	HFREE_NULL(path);
+
+	if (-1 == tth_store.fd)
+		return;
+
+	if (-1 == fstat(tth_store.fd, &sb)) {
+		g_warning("%s(): cannot stat %s: %m", G_STRFUNC, tth_cache_data_file);
+		fd_close(&tth_store.fd);
+		return;
+	}
+
+	tth_store_load(sb.st_size);
+
+	if (NULL == tth_store.slots)
+		tth_store_resize();
+
+	/*
+	 * Discard data not referenced by the index at the end of the file.
+	 */
+
+	if (UNSIGNED(sb.st_size) != (filesize_t) tth_store.end * TTH_RAW_SIZE)
+		tth_store_truncate();
+
+	tth_store.legacy = is_directory(tth_cache_directory());
+
+	tth_cache_sync_ev = cq_periodic_main_add(
+		TTH_CACHE_SYNC_PERIOD, tth_cache_periodic_sync, NULL);
 }
 
-void
+/**
+ * Free hole, erbtree_discard() callback.
+ */
+static void
+tth_hole_free(void *data)
+{
+	struct tth_hole *h = data;
+
+	WFREE(h);
+}
+
+void G_COLD
 tth_cache_close(void)
 {
-	/* NOTHING */
+	cq_periodic_remove(&tth_cache_sync_ev);
+	tth_store_sync();
+
+	/*
+	 * Closing the data file prevents any concurrent cleanup thread from
+	 * further accessing the store.
+	 */
+
+	TTH_STORE_LOCK;
+
+	fd_close(&tth_store.fd);
+
+	if (tth_store.slots != NULL) {
+		vmm_free(tth_store.slots,
+			tth_store.capacity * sizeof tth_store.slots[0]);
+		tth_store.slots = NULL;
+	}
+
+	erbtree_discard(&tth_store.holes, tth_hole_free);
+	ZERO(&tth_store);
+	tth_store.fd = -1;
+
+	TTH_STORE_UNLOCK;
 }
 
 /* vi: set ts=4 sw=4 cindent: */
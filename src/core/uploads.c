@@ -6497,6 +6497,25 @@ upload_get_info(gnet_upload_t uh)
     return info;
 }
 
+/**
+ * Count the disk extents of the file being uploaded, which matters for the
+ * sequential reads done by sendfile().
+ *
+ * This is not part of the upload information because walking the extent
+ * map is too costly to be done on every refresh.
+ *
+ * @return the amount of extents, -1 if unknown.
+ */
+long
+upload_extents(gnet_upload_t uh)
+{
+	struct upload *u = upload_find_by_handle(uh);
+
+	g_return_val_if_fail(u, -1);
+
+	return NULL == u->file ? -1 : file_object_extents(u->file);
+}
+
 void
 upload_free_info(gnet_upload_info_t *info)
 {
@@ -210,6 +210,7 @@ struct upload *upload_alloc(void);
 void upload_free(struct upload **ptr);
 
 const char *upload_host_info(const struct upload *u);
+long upload_extents(gnet_upload_t uh);
 
 #endif /* _core_uploads_h_ */
 
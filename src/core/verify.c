@@ -65,6 +65,7 @@
 #include "lib/compat_misc.h"
 #include "lib/constants.h"
 #include "lib/cq.h"
+#include "lib/elist.h"
 #include "lib/entropy.h"
 #include "lib/file.h"
 #include "lib/file_object.h"
@@ -72,6 +73,10 @@
 #include "lib/halloc.h"
 #include "lib/hashing.h"
 #include "lib/hashlist.h"
+#include "lib/misc.h"			/* For short_rate() */
+#include "lib/mutex.h"
+#include "lib/pslist.h"
+#include "lib/spinlock.h"
 #include "lib/str.h"
 #include "lib/stringify.h"		/* For short_time_ascii() */
 #include "lib/teq.h"
@@ -82,8 +87,12 @@
 #include "lib/override.h"	/* Must be the last header included */
 
 #define HASH_BUF_SIZE		(128 * 1024)	/**< Size of the reading buffer */
+#define HASH_THREAD_BUF		(512 * 1024)	/**< Buffer per parallel thread */
+#define HASH_PARALLEL_MIN	(64 * 1024 * 1024)	/**< Min size for parallelism */
+#define HASH_PARALLEL_MAX	16				/**< Max threads for a file */
+#define HASH_READAHEAD		8				/**< Buffers read ahead */
 
-#define HASH_THREAD_MAX			2			/**< At most 2 hashing threads */
+#define HASH_THREAD_MAX			3			/**< At most 3 hashing threads */
 #define VERIFY_DEFERRED			10			/**< ms: deferred free timeout */
 #define VERIFY_PROGRESS_NOTIFY	1			/**< s: progress notification */
 
@@ -110,6 +119,18 @@ struct verify {
 	time_t last_progress;		/**< Last time we informed about progress */
 	char *buffer;				/**< Read buffer */
 	size_t buffer_size;			/**< Size of buffer in bytes. */
+	filesize_t ahead;			/**< Read-ahead requested up to there */
+	filesize_t dropped;			/**< Cached data dropped up to there */
+
+	/* Statistics, read concurrently by verify_info_list() */
+	spinlock_t lock;			/**< Protects statistics */
+	const char *pathname;		/**< Atom: path of file being hashed */
+	tm_t file_start;			/**< When we started to hash the file */
+	long extents;				/**< Extents of file, -1 if unknown */
+	uint64 bytes;				/**< Total amount of bytes hashed */
+	uint64 busy_ms;				/**< Total time spent on previous files */
+	size_t files;				/**< Amount of files fully hashed */
+	link_t lnk;					/**< Links all verification contexts */
 
 	enum verify_status status;	/**< Used for callback multiplexing. */
 	uint8 shutdowned;			/**< Flag indicating context was shutdown */
@@ -126,6 +147,18 @@ verify_check(const struct verify * const ctx)
 	g_assert(VERIFY_MAGIC == ctx->magic);
 }
 
+/**
+ * List of all the verification contexts, for verify_info_list().
+ */
+static elist_t verify_list = ELIST_INIT(offsetof(struct verify, lnk));
+static mutex_t verify_list_mtx = MUTEX_INIT;
+
+#define VERIFY_LIST_LOCK		mutex_lock(&verify_list_mtx)
+#define VERIFY_LIST_UNLOCK		mutex_unlock(&verify_list_mtx)
+
+#define VERIFY_STATS_LOCK(c)	spinlock(&(c)->lock)
+#define VERIFY_STATS_UNLOCK(c)	spinunlock(&(c)->lock)
+
 static inline void
 verify_hash_init(const struct verify * const ctx)
 {
@@ -150,6 +183,47 @@ verify_hash_name(const struct verify * const ctx)
 	return ctx->hash.name();
 }
 
+/**
+ * Let the hash computation use several threads when the file is large and
+ * there is nothing else queued, so that a single large file can use all
+ * the CPUs.
+ *
+ * The reading buffer is enlarged accordingly, to give each thread enough
+ * data to process at every step.
+ */
+static void
+verify_hash_threads(struct verify *ctx)
+{
+	uint n = 1;
+	size_t size;
+
+	if (NULL == ctx->hash.threads)
+		return;
+
+	if (
+		ctx->end - ctx->start >= HASH_PARALLEL_MIN &&
+		0 == hash_list_length(ctx->files_to_hash)
+	) {
+		long cpus = getcpucount();
+		n = MIN(cpus, HASH_PARALLEL_MAX);
+		n = MAX(n, 1);
+	}
+
+	ctx->hash.threads(n);
+
+	if (n > 1 && GNET_PROPERTY(verify_debug)) {
+		g_debug("%s hashing of %s using %u threads",
+			verify_hash_name(ctx), file_object_pathname(ctx->file), n);
+	}
+
+	size = 1 == n ? HASH_BUF_SIZE : n * HASH_THREAD_BUF;
+
+	if (size != ctx->buffer_size) {
+		ctx->buffer = hrealloc(ctx->buffer, size);
+		ctx->buffer_size = size;
+	}
+}
+
 enum verify_file_magic { VERIFY_FILE_MAGIC = 0x063ac7adU };
 
 struct verify_file {
@@ -611,9 +685,14 @@ verify_new(const struct verify_hash *hash)
 	*(struct verify_hash *) &ctx->hash = *hash;		/* Assignment to "const" */
 	ctx->files_to_hash = hash_list_new(verify_item_hash, verify_item_equal);
 	hash_list_thread_safe(ctx->files_to_hash);
+	spinlock_init(&ctx->lock);
 
 	verify_thread_create_if_needed(ctx);
 
+	VERIFY_LIST_LOCK;
+	elist_append(&verify_list, ctx);
+	VERIFY_LIST_UNLOCK;
+
 	return ctx;
 }
 
@@ -652,7 +731,12 @@ verify_deferred_free(cqueue_t *cq, void *data)
 			g_debug("freeing %s verification context", verify_hash_name(ctx));
 		}
 
+		VERIFY_LIST_LOCK;
+		elist_remove(&verify_list, ctx);
+		VERIFY_LIST_UNLOCK;
+
 		hash_list_free(&ctx->files_to_hash);
+		spinlock_destroy(&ctx->lock);
 		ctx->magic = 0;
 		WFREE(ctx);
 	}
@@ -715,6 +799,46 @@ verify_context_free(void *data)
 	}
 }
 
+/**
+ * Release the file being hashed, accounting the time spent on it.
+ */
+static void
+verify_file_release(struct verify *ctx)
+{
+	const char *pathname;
+	uint64 elapsed;
+	tm_t now;
+
+	if (NULL == ctx->file)
+		return;
+
+	file_object_release(&ctx->file);
+	tm_now_exact(&now);
+
+	VERIFY_STATS_LOCK(ctx);
+	pathname = ctx->pathname;
+	ctx->pathname = NULL;
+	elapsed = tm_elapsed_ms(&now, &ctx->file_start);
+	ctx->busy_ms += elapsed;
+	VERIFY_STATS_UNLOCK(ctx);
+
+	/*
+	 * Reporting the file fragmentation along with the hashing rate lets
+	 * us assess how much the disk layout impacts sequential reads.
+	 */
+
+	if (GNET_PROPERTY(verify_debug) && elapsed != 0) {
+		filesize_t hashed = ctx->offset - ctx->start;
+
+		g_debug("%s hashed %s bytes of \"%s\" at %s (%ld extent%s)",
+			verify_hash_name(ctx), filesize_to_string(hashed), pathname,
+			short_rate(hashed * 1000 / elapsed, FALSE),
+			ctx->extents, plural(ctx->extents));
+	}
+
+	atom_str_free_null(&pathname);
+}
+
 static void
 verify_next_file(struct verify *ctx)
 {
@@ -730,9 +854,12 @@ verify_next_file(struct verify *ctx)
 
 		ctx->user_data = item->user_data;
 		ctx->callback = item->callback;
+
+		VERIFY_STATS_LOCK(ctx);
 		ctx->start = item->offset;
 		ctx->end = item->offset + item->amount;
 		ctx->offset = ctx->start;
+		VERIFY_STATS_UNLOCK(ctx);
 
 		if (verify_start(ctx)) {
 			ctx->file = file_object_open(item->pathname, O_RDONLY);
@@ -755,13 +882,32 @@ verify_next_file(struct verify *ctx)
 	}
 
 	if (ctx->file) {
+		const char *pathname = atom_str_get(file_object_pathname(ctx->file));
+		long extents = -1;
+
+		/*
+		 * Walking the extent map of large files is not free, so we only
+		 * count extents when they are going to be logged.
+		 */
+
+		if (GNET_PROPERTY(verify_debug))
+			extents = file_object_extents(ctx->file);
+
 		if (GNET_PROPERTY(verify_debug)) {
 			g_debug("verifying %s digest for %s",
-				verify_hash_name(ctx), file_object_pathname(ctx->file));
+				verify_hash_name(ctx), pathname);
 		}
 		verify_hash_init(ctx);
+		verify_hash_threads(ctx);
 		file_object_fadvise_sequential(ctx->file);
+		ctx->ahead = ctx->dropped = ctx->start;
 		ctx->last_progress = ctx->started = tm_time_exact();
+
+		VERIFY_STATS_LOCK(ctx);
+		ctx->pathname = pathname;
+		ctx->extents = extents;
+		tm_now_exact(&ctx->file_start);
+		VERIFY_STATS_UNLOCK(ctx);
 	}
 	return;
 
@@ -770,8 +916,6 @@ done:
 		verify_shutdown(ctx);
 	else
 		verify_failure(ctx);
-
-	file_object_release(&ctx->file);
 }
 
 static void
@@ -787,9 +931,57 @@ verify_final(struct verify *ctx)
 			file_object_pathname(ctx->file));
 		verify_failure(ctx);
 	} else {
+		VERIFY_STATS_LOCK(ctx);
+		ctx->files++;
+		VERIFY_STATS_UNLOCK(ctx);
 		verify_done(ctx);
 	}
-	file_object_release(&ctx->file);
+	verify_file_release(ctx);
+}
+
+/**
+ * Keep reads in flight ahead of the data being hashed, so that the disk
+ * can fetch the next buffers whilst we are hashing the current one.
+ *
+ * Read-ahead is requested by chunks of half the window, to limit the amount
+ * of system calls.
+ */
+static void
+verify_readahead(struct verify *ctx)
+{
+	filesize_t window = (filesize_t) HASH_READAHEAD * ctx->buffer_size;
+	filesize_t target;
+
+	g_assert(ctx->ahead >= ctx->offset);
+
+	if (ctx->ahead >= ctx->end || ctx->ahead - ctx->offset > window / 2)
+		return;
+
+	target = MIN(ctx->offset + window, ctx->end);
+	file_object_fadvise_willneed(ctx->file, ctx->ahead, target - ctx->ahead);
+	ctx->ahead = target;
+}
+
+/**
+ * When configured to, drop the data we hashed from the page cache, so that
+ * hashing large files does not evict data more useful to keep around.
+ */
+static void
+verify_drop_behind(struct verify *ctx)
+{
+	filesize_t window = (filesize_t) HASH_READAHEAD * ctx->buffer_size;
+
+	if (!GNET_PROPERTY(verify_drop_cache))
+		return;
+
+	if (ctx->offset - ctx->dropped < window && ctx->offset != ctx->end)
+		return;
+
+	if (ctx->offset != ctx->dropped) {
+		file_object_fadvise_dontneed(ctx->file,
+			ctx->dropped, ctx->offset - ctx->dropped);
+		ctx->dropped = ctx->offset;
+	}
 }
 
 static void
@@ -805,6 +997,7 @@ verify_update(struct verify *ctx)
 
 		amount = ctx->end - ctx->offset;
 		n = MIN(amount, ctx->buffer_size);
+		verify_readahead(ctx);
 		r = file_object_pread(ctx->file, ctx->buffer, n, ctx->offset);
 	} else {
 		r = 0;
@@ -821,7 +1014,10 @@ verify_update(struct verify *ctx)
 	} else {
 		time_t now;
 
+		VERIFY_STATS_LOCK(ctx);
 		ctx->offset += (size_t) r;
+		ctx->bytes += (size_t) r;
+		VERIFY_STATS_UNLOCK(ctx);
 
 		if (verify_hash_update(ctx, ctx->buffer, r)) {
 			g_warning("%s computation error for \"%s\"",
@@ -829,6 +1025,8 @@ verify_update(struct verify *ctx)
 			goto error;
 		}
 
+		verify_drop_behind(ctx);
+
 		/*
 		 * Don't inform about progress too frequently: if we're running in
 		 * a dedicated thread, the notification will issue a cross-thread RPC
@@ -851,7 +1049,7 @@ verify_update(struct verify *ctx)
 
 error:
 	verify_failure(ctx);
-	file_object_release(&ctx->file);
+	verify_file_release(ctx);
 }
 
 /**
@@ -903,7 +1101,7 @@ verify_bg_sighandler(struct bgtask *bt, void *data, bgsig_t sig)
 
 	if (ctx->file != NULL) {
 		verify_shutdown(ctx);
-		file_object_release(&ctx->file);
+		verify_file_release(ctx);
 	}
 	HFREE_NULL(ctx->buffer);
 
@@ -1129,4 +1327,100 @@ verify_enqueue(struct verify *ctx, int high_priority,
 	return inserted;
 }
 
+static void
+verify_queued_amount(void *data, void *udata)
+{
+	const struct verify_file *item = data;
+	filesize_t *amount = udata;
+
+	verify_file_check(item);
+
+	*amount += item->amount;
+}
+
+/**
+ * Retrieve information about all the verification contexts.
+ *
+ * @return list of verify_info_t that must be freed by calling
+ * verify_info_list_free_null().
+ */
+pslist_t *
+verify_info_list(void)
+{
+	pslist_t *sl = NULL;
+	struct verify *ctx;
+
+	VERIFY_LIST_LOCK;
+
+	ELIST_FOREACH_DATA(&verify_list, ctx) {
+		verify_info_t *vi;
+		filesize_t queued_bytes = 0;
+		uint64 elapsed = 0;
+		tm_t now;
+
+		verify_check(ctx);
+
+		WALLOC0(vi);
+		vi->magic = VERIFY_INFO_MAGIC;
+		vi->name = verify_hash_name(ctx);
+
+		hash_list_lock(ctx->files_to_hash);
+		vi->queued = hash_list_length(ctx->files_to_hash);
+		hash_list_foreach(ctx->files_to_hash,
+			verify_queued_amount, &queued_bytes);
+		hash_list_unlock(ctx->files_to_hash);
+		vi->queued_bytes = queued_bytes;
+
+		tm_now_exact(&now);
+
+		VERIFY_STATS_LOCK(ctx);
+		if (ctx->pathname != NULL) {
+			vi->pathname = atom_str_get(ctx->pathname);
+			vi->hashed = ctx->offset - ctx->start;
+			vi->size = ctx->end - ctx->start;
+			vi->extents = ctx->extents;
+			elapsed = tm_elapsed_ms(&now, &ctx->file_start);
+		}
+		vi->bytes = ctx->bytes;
+		vi->files = ctx->files;
+		vi->busy_ms = ctx->busy_ms + elapsed;
+		VERIFY_STATS_UNLOCK(ctx);
+
+		if (elapsed != 0)
+			vi->rate = vi->hashed * 1000 / elapsed;
+		if (vi->busy_ms != 0)
+			vi->avg_rate = vi->bytes * 1000 / vi->busy_ms;
+
+		sl = pslist_prepend(sl, vi);
+	}
+
+	VERIFY_LIST_UNLOCK;
+
+	return pslist_reverse(sl);
+}
+
+static void
+verify_info_free(void *data, void *udata)
+{
+	verify_info_t *vi = data;
+
+	verify_info_check(vi);
+	(void) udata;
+
+	atom_str_free_null(&vi->pathname);
+	WFREE(vi);
+}
+
+/**
+ * Free list created by verify_info_list() and nullify pointer.
+ */
+void
+verify_info_list_free_null(pslist_t **sl_ptr)
+{
+	pslist_t *sl = *sl_ptr;
+
+	pslist_foreach(sl, verify_info_free, NULL);
+	pslist_free_null(sl_ptr);
+}
+
 /* vi: set ts=4 sw=4 cindent: */
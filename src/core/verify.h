@@ -59,6 +59,7 @@ struct verify_hash {
 	void 			(*init)(filesize_t amount);
 	int  			(*update)(const void *data, size_t size);
 	int 			(*final)(void);
+	void			(*threads)(uint n);		/**< Optional */
 };
 
 struct verify *verify_new(const struct verify_hash *);
@@ -72,6 +73,39 @@ enum verify_status verify_status(const struct verify *);
 filesize_t verify_hashed(const struct verify *);
 uint verify_elapsed(const struct verify *);
 
+enum verify_info_magic { VERIFY_INFO_MAGIC = 0x3a9e54c1 };
+
+/**
+ * Verification statistics that can be retrieved.
+ */
+typedef struct verify_info {
+	enum verify_info_magic magic;
+	const char *name;			/**< Hash name (static string) */
+	const char *pathname;		/**< File being hashed (atom), NULL if idle */
+	filesize_t hashed;			/**< Amount hashed in current file */
+	filesize_t size;			/**< Amount to hash in current file */
+	long extents;				/**< Extents of current file, -1 if unknown */
+	filesize_t queued_bytes;	/**< Amount of data queued for hashing */
+	uint64 bytes;				/**< Total amount of bytes hashed */
+	uint64 busy_ms;				/**< Total time spent hashing, in ms */
+	uint64 rate;				/**< Hashing rate of current file, bytes/s */
+	uint64 avg_rate;			/**< Average hashing rate, bytes/s */
+	size_t queued;				/**< Amount of files queued */
+	size_t files;				/**< Amount of files fully hashed */
+} verify_info_t;
+
+static inline void
+verify_info_check(const verify_info_t * const vi)
+{
+	g_assert(vi != NULL);
+	g_assert(VERIFY_INFO_MAGIC == vi->magic);
+}
+
+struct pslist;
+
+struct pslist *verify_info_list(void);
+void verify_info_list_free_null(struct pslist **sl_ptr);
+
 #endif	/* _core_verify_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
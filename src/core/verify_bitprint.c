@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Combined SHA-1 and Tigertree hash verification.
+ *
+ * Files for which both the SHA-1 and the TTH need to be computed are read
+ * only once from disk, each buffer being fed to both hash contexts, which
+ * halves the I/O compared to sequential SHA-1 and TTH verifications.
+ *
+ * Callbacks receive the usual verification events, and can then query
+ * both digests (and the TTH leaves) when VERIFY_DONE is reported.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "verify_bitprint.h"
+
+#include "lib/halloc.h"
+#include "lib/once.h"
+#include "lib/sha1.h"
+#include "lib/tigertree.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+static struct {
+	struct verify	*verify;
+	SHA1_context	sha1_context;
+	TTH_CONTEXT		*tth_context;
+	struct sha1		sha1;
+	struct tth		tth;
+} verify_bitprint;
+
+static const char *
+verify_bitprint_name(void)
+{
+	return "bitprint";
+}
+
+static void
+verify_bitprint_reset(filesize_t size)
+{
+	int ret;
+
+	ret = SHA1_reset(&verify_bitprint.sha1_context);
+	g_assert(SHA_SUCCESS == ret);
+
+	if G_LIKELY(verify_bitprint.tth_context != NULL)
+		tt_init(verify_bitprint.tth_context, size);
+}
+
+static int
+verify_bitprint_update(const void *data, size_t size)
+{
+	int ret;
+
+	if G_UNLIKELY(NULL == verify_bitprint.tth_context)
+		return -1;
+
+	ret = SHA1_input(&verify_bitprint.sha1_context, data, size);
+	if (SHA_SUCCESS != ret)
+		return -1;
+
+	tt_update(verify_bitprint.tth_context, data, size);
+	return 0;
+}
+
+static int
+verify_bitprint_final(void)
+{
+	int ret;
+
+	if G_UNLIKELY(NULL == verify_bitprint.tth_context)
+		return -1;
+
+	ret = SHA1_result(&verify_bitprint.sha1_context, &verify_bitprint.sha1);
+	if (SHA_SUCCESS != ret)
+		return -1;
+
+	tt_digest(verify_bitprint.tth_context, &verify_bitprint.tth);
+	return 0;
+}
+
+static void
+verify_bitprint_threads(uint n)
+{
+	if G_LIKELY(verify_bitprint.tth_context != NULL)
+		tt_set_threads(verify_bitprint.tth_context, n);
+}
+
+static const struct verify_hash verify_hash_bitprint = {
+	verify_bitprint_name,
+	verify_bitprint_reset,
+	verify_bitprint_update,
+	verify_bitprint_final,
+	verify_bitprint_threads,
+};
+
+/**
+ * Enqueue file for combined SHA-1 and TTH computation.
+ *
+ * @param high_priority	whether item should be treated quickly
+ * @param pathname		file to be hashed
+ * @param filesize		size of the file
+ * @param callback		callback routine to invoke in the calling thread
+ * @param user_data		context to pass to the calling routine
+ *
+ * @return TRUE if the item was enqueued, FALSE if it was already queued.
+ */
+bool
+verify_bitprint_enqueue(int high_priority,
+	const char *pathname, filesize_t filesize,
+	verify_callback callback, void *user_data)
+{
+	g_return_val_if_fail(verify_bitprint.verify != NULL, FALSE);
+
+	return verify_enqueue(verify_bitprint.verify, high_priority,
+		pathname, 0, filesize, callback, user_data);
+}
+
+/**
+ * @return the computed SHA-1, valid only when reporting VERIFY_DONE.
+ */
+const struct sha1 *
+verify_bitprint_sha1(const struct verify *ctx)
+{
+	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
+	return &verify_bitprint.sha1;
+}
+
+/**
+ * @return the computed TTH, valid only when reporting VERIFY_DONE.
+ */
+const struct tth *
+verify_bitprint_tth(const struct verify *ctx)
+{
+	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
+	return &verify_bitprint.tth;
+}
+
+/**
+ * @return the TTH leaves, valid only when reporting VERIFY_DONE.
+ */
+const struct tth *
+verify_bitprint_leaves(const struct verify *ctx)
+{
+	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
+	return tt_leaves(verify_bitprint.tth_context);
+}
+
+/**
+ * @return the amount of TTH leaves, valid only when reporting VERIFY_DONE.
+ */
+size_t
+verify_bitprint_leave_count(const struct verify *ctx)
+{
+	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, 0);
+	return tt_leave_count(verify_bitprint.tth_context);
+}
+
+static void G_COLD
+verify_bitprint_init_once(void)
+{
+	verify_bitprint.tth_context = halloc(tt_size());
+	verify_bitprint.verify = verify_new(&verify_hash_bitprint);
+}
+
+void G_COLD
+verify_bitprint_init(void)
+{
+	static once_flag_t initialized;
+
+	/*
+	 * Must use once_flag_runwait() because verify_new() can create a
+	 * thread, see verify_tth_init() for details.
+	 */
+
+	once_flag_runwait(&initialized, verify_bitprint_init_once);
+}
+
+void G_COLD
+verify_bitprint_shutdown(void)
+{
+	verify_free(&verify_bitprint.verify);
+}
+
+void G_COLD
+verify_bitprint_close(void)
+{
+	HFREE_NULL(verify_bitprint.tth_context);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -88,6 +88,7 @@ static const struct verify_hash verify_hash_sha1 = {
 	verify_sha1_reset,
 	verify_sha1_update,
 	verify_sha1_final,
+	NULL,					/* No parallel hashing */
 };
 
 int
@@ -90,11 +90,19 @@ verify_tth_final(void)
 	return 0;
 }
 
+static void
+verify_tth_threads(uint n)
+{
+	if G_LIKELY(verify_tth.context != NULL)
+		tt_set_threads(verify_tth.context, n);
+}
+
 static const struct verify_hash verify_hash_tth = {
 	verify_tth_name,
 	verify_tth_reset,
 	verify_tth_update,
 	verify_tth_final,
+	verify_tth_threads,
 };
 
 const struct tth *
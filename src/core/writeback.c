@@ -0,0 +1,596 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Asynchronous write-behind of downloaded data.
+ *
+ * Downloaded data used to be written to disk by the main thread, which
+ * stalled all the network I/O whenever the disk was slow.  Instead, the
+ * buffers filled by a download are handed over to a dedicated thread which
+ * writes them whilst the download goes on receiving data.
+ *
+ * The writing thread talks to the main thread via a pair of asynchronous
+ * queues, the same way the ADNS thread does: write requests are put in the
+ * request queue and completed requests come back through the answer queue,
+ * whose waiter is part of the main I/O event set.  Completion callbacks are
+ * therefore always invoked in the main thread.
+ *
+ * All the requests pending in the queue when the thread wakes up are
+ * processed as a batch: requests for adjacent ranges of the same file are
+ * coalesced into a single pwritev() call.
+ *
+ * The amount of data queued is limited by the "download_writeback_size"
+ * property.  Submitting never blocks, but once the budget is exhausted the
+ * layer is congested and submitters must stop producing data until enough
+ * of it has been written: downloads then stop reading from their sources,
+ * which throttles them to the speed of the disk.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "writeback.h"
+
+#include "if/gnet_property.h"
+#include "if/gnet_property_priv.h"
+
+#include "lib/aq.h"
+#include "lib/file_object.h"
+#include "lib/inputevt.h"
+#include "lib/iovec.h"
+#include "lib/pmsg.h"
+#include "lib/slist.h"
+#include "lib/thread.h"
+#include "lib/tm.h"
+#include "lib/vsort.h"
+#include "lib/waiter.h"
+#include "lib/walloc.h"
+#include "lib/xmalloc.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#define WRITEBACK_STACK		THREAD_STACK_MIN
+#define WRITEBACK_BATCH		64	/* Max requests processed at once */
+
+enum writeback_req_magic { WRITEBACK_REQ_MAGIC = 0x3a1f7c52 };
+
+/**
+ * A write request.
+ *
+ * The request is allocated and freed by the main thread.  The writing
+ * thread only reads the I/O vector and fills the result fields.
+ */
+struct writeback_req {
+	enum writeback_req_magic magic;
+	file_object_t *fo;			/**< File to write to (our own reference) */
+	int fd;						/**< File descriptor, to coalesce requests */
+	filesize_t offset;			/**< Starting file offset */
+	size_t size;				/**< Amount of data to write */
+	iovec_t *iov;				/**< I/O vector describing the data */
+	int iovcnt;					/**< Amount of entries in the I/O vector */
+	slist_t *list;				/**< Buffers holding the data (pmsg_t) */
+	tm_t start;					/**< Submission time */
+	uint64 seq;					/**< Submission order */
+	writeback_cb_t cb;			/**< Completion callback */
+	void *arg;					/**< Completion callback argument */
+	/* Result, filled by the writing thread */
+	size_t written;				/**< Amount of bytes written */
+	int error;					/**< errno, when not all data was written */
+	uint syscalls;				/**< System calls made for the request */
+};
+
+static inline void
+writeback_req_check(const struct writeback_req * const req)
+{
+	g_assert(req != NULL);
+	g_assert(WRITEBACK_REQ_MAGIC == req->magic);
+}
+
+/**
+ * Global write-behind state, only accessed from the main thread.
+ */
+static struct {
+	aqueue_t *requests;			/**< Requests for the writing thread */
+	aqueue_t *answers;			/**< Completed requests */
+	uint event_id;				/**< I/O event for the answer queue */
+	int thread_id;				/**< The writing thread, -1 if none */
+	size_t pending;				/**< Amount of requests in progress */
+	size_t queued;				/**< Amount of bytes in progress */
+	uint64 seq;					/**< Sequence number of next request */
+	uint64 writes;				/**< Completed requests */
+	uint64 syscalls;			/**< System calls made for these */
+	uint64 written;				/**< Bytes written */
+	uint64 errors;				/**< Failed requests */
+	uint64 stalls;				/**< Times the budget was exhausted */
+	uint latency;				/**< Average latency, in ms */
+} writeback = { NULL, NULL, 0, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+/**
+ * Free a completed request.
+ */
+static void
+writeback_req_free(struct writeback_req *req)
+{
+	writeback_req_check(req);
+
+	file_object_release(&req->fo);
+	iov_free(req->iov);
+	pmsg_slist_free_all(&req->list);
+	req->magic = 0;
+	WFREE(req);
+}
+
+/**
+ * vsort() callback to order requests by file and offset.
+ */
+static int
+writeback_req_cmp(const void *a, const void *b)
+{
+	const struct writeback_req * const *ra = a, * const *rb = b;
+	const struct writeback_req *r1 = *ra, *r2 = *rb;
+
+	if (r1->fd != r2->fd)
+		return CMP(r1->fd, r2->fd);
+	if (r1->offset != r2->offset)
+		return CMP(r1->offset, r2->offset);
+	return CMP(r1->seq, r2->seq);
+}
+
+/**
+ * vsort() callback to order requests by submission order.
+ */
+static int
+writeback_req_seq_cmp(const void *a, const void *b)
+{
+	const struct writeback_req * const *ra = a, * const *rb = b;
+
+	return CMP((*ra)->seq, (*rb)->seq);
+}
+
+/**
+ * Write a run of requests for adjacent ranges of the same file.
+ *
+ * @param run		the requests, sorted by increasing offsets
+ * @param n			amount of requests in the run
+ */
+static void
+writeback_run(struct writeback_req **run, size_t n)
+{
+	const struct writeback_req *first = run[0];
+	iovec_t *iov, *v;
+	size_t i, done = 0;
+	int cnt = 0, error = 0;
+	uint syscalls = 0;
+
+	for (i = 0; i < n; i++)
+		cnt += run[i]->iovcnt;
+
+	/*
+	 * The concatenated I/O vector is ours, so we can advance it in place
+	 * as partial writes are made.
+	 */
+
+	iov = v = iov_alloc_n(cnt);
+	for (cnt = 0, i = 0; i < n; i++) {
+		memcpy(&iov[cnt], run[i]->iov, run[i]->iovcnt * sizeof iov[0]);
+		cnt += run[i]->iovcnt;
+	}
+
+	while (cnt > 0) {
+		ssize_t r;
+		size_t w;
+
+		r = file_object_pwritev(first->fo, v, MIN(cnt, MAX_IOV_COUNT),
+				first->offset + done);
+		syscalls++;
+
+		if ((ssize_t) -1 == r) {
+			if (EINTR == errno)
+				continue;
+			error = errno;
+			break;
+		} else if (0 == r) {
+			error = EIO;		/* Nothing written, do not loop forever */
+			break;
+		}
+
+		done += r;
+
+		for (w = r; w != 0; /* empty */) {
+			size_t len = iovec_len(v);
+
+			if (w >= len) {
+				w -= len;
+				v++;
+				cnt--;
+			} else {
+				iovec_set(v, ptr_add_offset(iovec_base(v), w), len - w);
+				w = 0;
+			}
+		}
+	}
+
+	iov_free(iov);
+
+	/*
+	 * Dispatch the outcome to each request of the run.
+	 */
+
+	for (i = 0; i < n; i++) {
+		struct writeback_req *req = run[i];
+		size_t rel = req->offset - first->offset;
+
+		req->written = done > rel ? MIN(done - rel, req->size) : 0;
+		req->error = req->written < req->size ? error : 0;
+		req->syscalls = 0 == i ? syscalls : 0;
+	}
+}
+
+/**
+ * Process a batch of requests, coalescing adjacent ones.
+ */
+static void
+writeback_batch(struct writeback_req **batch, size_t n)
+{
+	size_t i, j;
+
+	vsort_almost(batch, n, sizeof batch[0], writeback_req_cmp);
+
+	for (i = 0; i < n; i = j) {
+		filesize_t end = batch[i]->offset + batch[i]->size;
+
+		for (j = i + 1; j < n; j++) {
+			if (batch[j]->fd != batch[i]->fd || batch[j]->offset != end)
+				break;
+			end += batch[j]->size;
+		}
+
+		writeback_run(&batch[i], j - i);
+	}
+}
+
+struct writeback_args {
+	aqueue_t *requests;		/* Where the thread receives requests from */
+	aqueue_t *answers;		/* Where the thread sends completed requests to */
+};
+
+/**
+ * The writing thread.
+ */
+static void *
+writeback_thread(void *p)
+{
+	struct writeback_args *args = p;
+	aqueue_t *rq = aq_refcnt_inc(args->requests);
+	aqueue_t *aq = aq_refcnt_inc(args->answers);
+	bool exiting = FALSE;
+
+	thread_set_name("writeback");
+	WFREE(args);
+
+	while (!exiting) {
+		void *vec[WRITEBACK_BATCH];
+		size_t i, n;
+
+		vec[0] = aq_remove(rq);
+		if G_UNLIKELY(NULL == vec[0])
+			break;
+
+		n = 1 + aq_drain(rq, &vec[1], N_ITEMS(vec) - 1);
+
+		/*
+		 * A NULL request signals the end of processing.  It is the last
+		 * request ever queued.
+		 */
+
+		for (i = 1; i < n; i++) {
+			if G_UNLIKELY(NULL == vec[i]) {
+				exiting = TRUE;
+				n = i;
+				break;
+			}
+		}
+
+		for (i = 0; i < n; i++)
+			writeback_req_check(vec[i]);
+
+		writeback_batch((struct writeback_req **) vec, n);
+
+		/*
+		 * Completed requests go back in submission order, which the
+		 * batch processing lost by sorting them by file and offset.
+		 */
+
+		vsort_almost(vec, n, sizeof vec[0], writeback_req_seq_cmp);
+
+		for (i = 0; i < n; i++)
+			aq_put(aq, vec[i]);
+	}
+
+	aq_refcnt_dec(rq);
+	aq_refcnt_dec(aq);
+
+	return NULL;
+}
+
+/**
+ * Handle a completed request, in the main thread.
+ */
+static void
+writeback_done(struct writeback_req *req)
+{
+	tm_t now;
+	uint ms;
+
+	writeback_req_check(req);
+	g_assert(writeback.pending != 0);
+	g_assert(writeback.queued >= req->size);
+
+	writeback.pending--;
+	writeback.queued -= req->size;
+
+	tm_now_exact(&now);
+	ms = MAX(0, tm_elapsed_ms(&now, &req->start));
+
+	writeback.writes++;
+	writeback.syscalls += req->syscalls;
+	writeback.written += req->written;
+	writeback.latency = (writeback.latency * 7 + ms) / 8;
+
+	if (req->error != 0)
+		writeback.errors++;
+
+	(*req->cb)(req->arg, req->written, req->error, ms);
+
+	writeback_req_free(req);
+}
+
+/**
+ * Process all the completed requests.
+ */
+static void
+writeback_drain(void)
+{
+	void *vec[WRITEBACK_BATCH];
+	size_t i, n;
+
+	while (0 != (n = aq_drain(writeback.answers, vec, N_ITEMS(vec)))) {
+		for (i = 0; i < n; i++)
+			writeback_done(vec[i]);
+	}
+}
+
+/**
+ * Callback for inputevt_add(), invoked when requests have been completed.
+ */
+static void
+writeback_reply_callback(void *data, int source, inputevt_cond_t condition)
+{
+	waiter_t *w = data;
+
+	g_assert(condition & INPUT_EVENT_RX);
+
+	(void) source;
+
+	waiter_ack(w);		/* Acknowledge reception of event */
+	writeback_drain();
+}
+
+/**
+ * Wait until at least one pending request is completed, and process all
+ * the completed requests.
+ *
+ * Returns immediately when there are no pending requests.
+ */
+static void
+writeback_wait(void)
+{
+	g_assert(thread_is_main());
+
+	if (0 == writeback.pending)
+		return;
+
+	writeback_done(aq_remove(writeback.answers));
+	writeback_drain();
+}
+
+/**
+ * @return whether downloaded data should be written asynchronously.
+ */
+bool
+writeback_enabled(void)
+{
+	return -1 != writeback.thread_id &&
+		0 != GNET_PROPERTY(download_writeback_size);
+}
+
+/**
+ * @return whether the amount of data queued for writing exhausted the budget,
+ * in which case no more data should be submitted until some completion
+ * callbacks are invoked.
+ */
+bool
+writeback_congested(void)
+{
+	size_t budget = GNET_PROPERTY(download_writeback_size);
+
+	return 0 != budget && writeback.queued >= budget;
+}
+
+/**
+ * Queue data for writing.
+ *
+ * This never waits: the caller is expected to check writeback_congested()
+ * afterwards to know whether it can go on submitting data.
+ *
+ * @param fo		the file to write to
+ * @param offset	the file offset where data are to be written
+ * @param list		list of pmsg_t holding the data, taken over on success
+ * @param size		total amount of data in the list
+ * @param cb		completion callback, invoked in the main thread
+ * @param arg		additional callback argument
+ *
+ * @return TRUE if the write was queued, FALSE if data have to be written
+ * synchronously by the caller.
+ */
+bool
+writeback_submit(file_object_t *fo, filesize_t offset,
+	slist_t *list, size_t size, writeback_cb_t cb, void *arg)
+{
+	struct writeback_req *req;
+	file_object_t *wfo;
+	slist_iter_t *iter;
+	bool congested;
+	int i;
+
+	g_assert(thread_is_main());
+	g_assert(fo != NULL);
+	g_assert(list != NULL);
+	g_assert(size != 0);
+	g_assert(cb != NULL);
+
+	if (!writeback_enabled())
+		return FALSE;
+
+	/*
+	 * The file object of the caller may be released before the write
+	 * happens, so get our own reference on the file.
+	 */
+
+	wfo = file_object_open(file_object_pathname(fo), O_WRONLY);
+	if (NULL == wfo)
+		return FALSE;
+
+	WALLOC0(req);
+	req->magic = WRITEBACK_REQ_MAGIC;
+	req->fo = wfo;
+	req->fd = file_object_fd(wfo);
+	req->offset = offset;
+	req->size = size;
+	req->list = list;
+	req->iovcnt = slist_length(list);
+	req->iov = iov_alloc_n(req->iovcnt);
+	req->seq = writeback.seq++;
+	req->cb = cb;
+	req->arg = arg;
+	tm_now_exact(&req->start);
+
+	iter = slist_iter_before_head(list);
+	for (i = 0; i < req->iovcnt; i++) {
+		pmsg_t *mb = slist_iter_next(iter);
+
+		iovec_set(&req->iov[i],
+			deconstify_pointer(pmsg_start(mb)), pmsg_size(mb));
+	}
+	slist_iter_free(&iter);
+
+	congested = writeback_congested();
+
+	writeback.pending++;
+	writeback.queued += size;
+
+	if (!congested && writeback_congested())
+		writeback.stalls++;
+
+	aq_put(writeback.requests, req);
+
+	return TRUE;
+}
+
+/**
+ * Fill write-behind statistics.
+ */
+void
+writeback_info(writeback_info_t *wi)
+{
+	g_assert(wi != NULL);
+
+	wi->pending = writeback.pending;
+	wi->queued = writeback.queued;
+	wi->budget = GNET_PROPERTY(download_writeback_size);
+	wi->writes = writeback.writes;
+	wi->syscalls = writeback.syscalls;
+	wi->written = writeback.written;
+	wi->errors = writeback.errors;
+	wi->stalls = writeback.stalls;
+	wi->latency = writeback.latency;
+}
+
+/**
+ * Initialize the write-behind layer, launching the writing thread.
+ */
+void G_COLD
+writeback_init(void)
+{
+	struct writeback_args *args;
+	waiter_t *waiter;
+
+	waiter = waiter_make(NULL);
+	writeback.requests = aq_make();
+	writeback.answers = aq_make();
+	aq_waiter_add(writeback.answers, waiter);
+	writeback.event_id = inputevt_add(waiter_fd(waiter), INPUT_EVENT_RX,
+		writeback_reply_callback, waiter);
+	waiter_destroy_null(&waiter);	/* Is now referenced by the queue */
+
+	WALLOC(args);
+	args->requests = writeback.requests;
+	args->answers = writeback.answers;
+
+	writeback.thread_id = thread_create(writeback_thread, args,
+		THREAD_F_NO_POOL, WRITEBACK_STACK);
+
+	if (-1 == writeback.thread_id) {
+		g_warning("%s(): cannot launch writing thread, "
+			"downloaded data will be written synchronously: %m", G_STRFUNC);
+		WFREE(args);
+	}
+}
+
+/**
+ * Wait for all the pending writes and stop the writing thread.
+ */
+void G_COLD
+writeback_close(void)
+{
+	while (0 != writeback.pending)
+		writeback_wait();
+
+	if (-1 != writeback.thread_id) {
+		aq_put(writeback.requests, NULL);	/* Signals: end of processing */
+		if (-1 == thread_join(writeback.thread_id, NULL))
+			g_warning("%s(): cannot join with writing thread: %m", G_STRFUNC);
+		writeback.thread_id = -1;
+	}
+
+	inputevt_remove(&writeback.event_id);
+	aq_destroy_null(&writeback.requests);
+	aq_destroy_null(&writeback.answers);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
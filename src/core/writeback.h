@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Asynchronous write-behind of downloaded data.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#ifndef _core_writeback_h_
+#define _core_writeback_h_
+
+#include "common.h"
+
+struct file_object;
+struct slist;
+
+/**
+ * Completion callback, invoked in the main thread.
+ *
+ * @param arg		user-supplied argument
+ * @param written	amount of bytes written from the start of the range
+ * @param error		errno value when not all the data could be written
+ * @param ms		latency of the write, in milliseconds
+ */
+typedef void (*writeback_cb_t)(void *arg, size_t written, int error, uint ms);
+
+/**
+ * Write-behind statistics.
+ */
+typedef struct writeback_info {
+	size_t pending;			/**< Amount of queued writes */
+	size_t queued;			/**< Amount of queued bytes */
+	size_t budget;			/**< Maximum amount of queued bytes */
+	uint64 writes;			/**< Amount of completed writes */
+	uint64 syscalls;		/**< Amount of system calls issued for them */
+	uint64 written;			/**< Amount of bytes written */
+	uint64 errors;			/**< Amount of failed writes */
+	uint64 stalls;			/**< Times the budget was exhausted */
+	uint latency;			/**< Average write latency, in ms */
+} writeback_info_t;
+
+/*
+ * Public interface.
+ */
+
+void writeback_init(void);
+void writeback_close(void);
+
+bool writeback_enabled(void);
+bool writeback_congested(void);
+bool writeback_submit(struct file_object *fo, filesize_t offset,
+	struct slist *list, size_t size, writeback_cb_t cb, void *arg);
+void writeback_info(writeback_info_t *wi);
+
+#endif	/* _core_writeback_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
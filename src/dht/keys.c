@@ -1638,6 +1638,9 @@ keys_init(void)
 		kv, packing, KEYS_DB_CACHE_SIZE, kuid_hash, kuid_eq,
 		GNET_PROPERTY(dht_storage_in_memory));
 
+	dbmw_set_map_mmap(db_keydata, GNET_PROPERTY(dht_storage_mmap));
+	dbmw_set_map_bgflush(db_keydata, GNET_PROPERTY(dht_storage_bgflush));
+
 	for (i = 0; i < N_ITEMS(decimation_factor); i++)
 		decimation_factor[i] = pow(KEYS_DECIMATION_BASE, i);
 
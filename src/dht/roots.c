@@ -1141,6 +1141,10 @@ roots_init(void)
 		GNET_PROPERTY(dht_storage_in_memory));
 
 	dbmw_set_map_cache(db_contact, CONTACT_MAP_CACHE_SIZE);
+	dbmw_set_map_mmap(db_rootdata, GNET_PROPERTY(dht_storage_mmap));
+	dbmw_set_map_mmap(db_contact, GNET_PROPERTY(dht_storage_mmap));
+	dbmw_set_map_bgflush(db_rootdata, GNET_PROPERTY(dht_storage_bgflush));
+	dbmw_set_map_bgflush(db_contact, GNET_PROPERTY(dht_storage_bgflush));
 
 	roots_init_rootinfo();
 	cq_periodic_add(roots_cq, ROOTS_SYNC_PERIOD, roots_sync, NULL);
@@ -122,7 +122,9 @@
  * immediate restarts can reuse the information collected from a past run.
  *
  * When no updates are seen on a given node for more than 2 * republish period,
- * we consider the node dead and reclaim its entry.
+ * we consider the node dead and reclaim its entry.  A second table, kept
+ * sorted by time last seen, lets us find these nodes without traversing the
+ * whole table.
  *
  * @author Raphael Manfredi
  * @date 2009
@@ -146,6 +148,8 @@
 #include "lib/crash.h"
 #include "lib/dbmw.h"
 #include "lib/dbstore.h"
+#include "lib/endian.h"
+#include "lib/hashing.h"
 #include "lib/stringify.h"
 #include "lib/tm.h"
 #include "lib/override.h"		/* Must be the last header included */
@@ -170,6 +174,19 @@ static dbmw_t *db_lifedata;
 static char db_stable_base[] = "dht_stable";
 static char db_stable_what[] = "DHT stable nodes";
 
+/**
+ * DBM wrapper indexing the nodes by time last seen, in an ordered database
+ * whose keys are the big-endian time followed by the KUID of the node.
+ *
+ * This is NULL when DHT data are kept in core, since traversing the whole
+ * "stable" table is then cheap enough.
+ */
+static dbmw_t *db_lastseen;
+static char db_lastseen_base[] = "dht_stable_seen";
+static char db_lastseen_what[] = "DHT stable nodes by last seen";
+
+#define LASTSEEN_KEY_SIZE	(8 + KUID_RAW_SIZE)
+
 #define LIFEDATA_STRUCT_VERSION	0
 
 /**
@@ -201,6 +218,54 @@ get_lifedata(const kuid_t *id)
 	return ld;
 }
 
+/**
+ * Build the key of a node in the last-seen index.
+ */
+static void
+lastseen_key(char key[LASTSEEN_KEY_SIZE], const kuid_t *id, time_t last_seen)
+{
+	poke_be64(key, last_seen);
+	memcpy(&key[8], id->v, KUID_RAW_SIZE);
+}
+
+static uint
+lastseen_hash(const void *key)
+{
+	return binary_hash(key, LASTSEEN_KEY_SIZE);
+}
+
+static bool
+lastseen_eq(const void *a, const void *b)
+{
+	return binary_eq(a, b, LASTSEEN_KEY_SIZE);
+}
+
+/**
+ * Record in the last-seen index that the node was last seen at a new time.
+ *
+ * @param id		the node KUID
+ * @param old		previous time last seen, 0 if node was not indexed
+ * @param now		new time last seen, 0 to remove node from the index
+ */
+static void
+lastseen_update(const kuid_t *id, time_t old, time_t now)
+{
+	char key[LASTSEEN_KEY_SIZE];
+
+	if (NULL == db_lastseen)
+		return;
+
+	if (old != 0) {
+		lastseen_key(key, id, old);
+		dbmw_delete(db_lastseen, key);
+	}
+
+	if (now != 0) {
+		lastseen_key(key, id, now);
+		dbmw_write(db_lastseen, key, NULL, 0);
+	}
+}
+
 /**
  * Given a node who has been alive for t seconds, return the probability
  * that it will be alive in d seconds.
@@ -302,9 +367,11 @@ stable_record_activity(const knode_t *kn)
 		new_ld.last_seen = kn->last_seen;
 
 		gnet_stats_inc_general(GNR_DHT_STABLE_NODES_HELD);
+		lastseen_update(kn->id, 0, kn->last_seen);
 	} else {
 		if (kn->last_seen <= ld->last_seen)
 			return;
+		lastseen_update(kn->id, ld->last_seen, kn->last_seen);
 		ld->last_seen = kn->last_seen;
 	}
 
@@ -340,6 +407,7 @@ stable_replace(const knode_t *kn, const knode_t *rn)
 	 * Remove the old node and create an entry for the new one.
 	 */
 
+	lastseen_update(kn->id, ld->last_seen, 0);
 	dbmw_delete(db_lifedata, kn->id->v);
 	gnet_stats_dec_general(GNR_DHT_STABLE_NODES_HELD);
 	stable_record_activity(rn);
@@ -438,10 +506,81 @@ prune_old(void *key, void *value, size_t u_len, void *u_data)
 	return expired;
 }
 
+/**
+ * DBMW range iterator over the last-seen index to remove old entries.
+ * @return  TRUE if entry must be deleted from the index.
+ */
+static bool
+prune_lastseen(void *key, void *u_value, size_t u_len, void *u_data)
+{
+	const char *k = key;
+	kuid_t id;
+	struct lifedata *ld;
+
+	(void) u_value;
+	(void) u_len;
+	(void) u_data;
+
+	memcpy(id.v, &k[8], KUID_RAW_SIZE);
+	ld = get_lifedata(&id);
+
+	/*
+	 * Entries left over after a crash may no longer match the table, they
+	 * are simply discarded.
+	 */
+
+	if (NULL == ld || UNSIGNED(ld->last_seen) != peek_be64(k))
+		return TRUE;
+
+	if (!prune_old(&id, ld, sizeof *ld, NULL))
+		return FALSE;
+
+	dbmw_delete(db_lifedata, id.v);
+	return TRUE;
+}
+
+/**
+ * DBMW foreach iterator to index an entry by time last seen.
+ */
+static void
+index_lastseen(void *key, void *value, size_t u_len, void *u_data)
+{
+	const struct lifedata *ld = value;
+
+	(void) u_len;
+	(void) u_data;
+
+	lastseen_update(key, 0, ld->last_seen);
+}
+
+/**
+ * Rebuild the last-seen index if it does not match the "stable" table, which
+ * happens when one of them could not be synchronized before we stopped.
+ */
+static void
+stable_check_lastseen(void)
+{
+	size_t count = dbmw_count(db_lifedata);
+
+	if (dbmw_count(db_lastseen) == count)
+		return;
+
+	if (GNET_PROPERTY(dht_stable_debug)) {
+		g_debug("DHT STABLE rebuilding last-seen index (%zu/%zu entries)",
+			dbmw_count(db_lastseen), count);
+	}
+
+	dbmw_clear(db_lastseen);
+	dbmw_foreach(db_lifedata, index_lastseen, NULL);
+}
+
 /**
  * Prune the database, removing old entries not updated since at least
  * STABLE_EXPIRE seconds and which have less than STABLE_PROBA chance of
  * still being alive, given our probability density function.
+ *
+ * When the last-seen index is available, only the entries old enough to be
+ * candidates are visited.
  */
 static void
 stable_prune_old(void)
@@ -451,7 +590,15 @@ stable_prune_old(void)
 			dbmw_count(db_lifedata));
 	}
 
-	dbmw_foreach_remove(db_lifedata, prune_old, NULL);
+	if (db_lastseen != NULL) {
+		char hi[LASTSEEN_KEY_SIZE];
+
+		ZERO(&hi);
+		poke_be64(hi, tm_time() - STABLE_EXPIRE);
+		dbmw_foreach_range_remove(db_lastseen, NULL, hi, prune_lastseen, NULL);
+	} else {
+		dbmw_foreach_remove(db_lifedata, prune_old, NULL);
+	}
 	gnet_stats_set_general(GNR_DHT_STABLE_NODES_HELD, dbmw_count(db_lifedata));
 
 	if (GNET_PROPERTY(dht_stable_debug)) {
@@ -483,6 +630,9 @@ stable_sync(void *unused_obj)
 	(void) unused_obj;
 
 	dbstore_sync(db_lifedata);
+	if (db_lastseen != NULL)
+		dbstore_sync(db_lastseen);
+
 	return TRUE;		/* Keep calling */
 }
 
@@ -521,8 +671,10 @@ void G_COLD
 stable_init(void)
 {
 	dbstore_kv_t kv = { KUID_RAW_SIZE, NULL, sizeof(struct lifedata), 0 };
+	dbstore_kv_t seen_kv = { LASTSEEN_KEY_SIZE, NULL, 0, 0, TRUE };
 	dbstore_packing_t packing =
 		{ serialize_lifedata, deserialize_lifedata, NULL };
+	dbstore_packing_t no_packing = { NULL, NULL, NULL };
 
 	g_assert(NULL == db_lifedata);
 	g_assert(NULL == stable_sync_ev);
@@ -533,6 +685,15 @@ stable_init(void)
 		GNET_PROPERTY(dht_storage_in_memory));
 
 	dbmw_set_map_cache(db_lifedata, STABLE_MAP_CACHE_SIZE);
+	dbmw_set_map_mmap(db_lifedata, GNET_PROPERTY(dht_storage_mmap));
+	dbmw_set_map_bgflush(db_lifedata, GNET_PROPERTY(dht_storage_bgflush));
+
+	if (dbmw_map_type(db_lifedata) != DBMAP_MAP) {
+		db_lastseen = dbstore_open(db_lastseen_what, settings_dht_db_dir(),
+			db_lastseen_base, seen_kv, no_packing, 0,
+			lastseen_hash, lastseen_eq, FALSE);
+		stable_check_lastseen();
+	}
 
 	if (!crash_was_restarted())
 		stable_prune_old();
@@ -551,7 +712,8 @@ void G_COLD
 stable_close(void)
 {
 	dbstore_close(db_lifedata, settings_dht_db_dir(), db_stable_base);
-	db_lifedata = NULL;
+	dbstore_close(db_lastseen, settings_dht_db_dir(), db_lastseen_base);
+	db_lifedata = db_lastseen = NULL;
 	cq_periodic_remove(&stable_sync_ev);
 	cq_periodic_remove(&stable_prune_ev);
 }
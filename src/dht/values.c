@@ -128,6 +128,8 @@
 #define VALUES_DB_CACHE_SIZE 1024	/**< Amount of values to keep cached */
 #define RAW_DB_CACHE_SIZE	 512	/**< Amount of raw data to keep cached */
 
+#define VALUES_COMPACT_MIN	1024	/**< Min reclaimed values to compact DBs */
+
 /**
  * Information about a value that is stored to disk and not kept in memory.
  * The structure is serialized first, not written as-is.
@@ -196,6 +198,11 @@ static acct_net_t *values_per_class_c;
  */
 static hset_t *expired;
 
+/**
+ * Amount of expired values reclaimed since the last database compaction.
+ */
+static size_t values_reclaimed;
+
 /**
  * DBM wrapper to store valuedata.
  */
@@ -1016,7 +1023,22 @@ reclaim_dbkey(const void *key, void *u_data)
 void
 values_reclaim_expired(void)
 {
-	hset_foreach_remove(expired, reclaim_dbkey, NULL);
+	values_reclaimed += hset_foreach_remove(expired, reclaim_dbkey, NULL);
+
+	/*
+	 * Reclaimed values leave holes in the database pages.  Once we have
+	 * reclaimed more values than we are currently holding, the databases
+	 * are mostly made of holes: compact them in the background.
+	 */
+
+	if (
+		values_reclaimed >= VALUES_COMPACT_MIN &&
+		values_reclaimed > UNSIGNED(values_managed)
+	) {
+		dbstore_compact_online(db_rawdata);
+		dbstore_compact_online(db_valuedata);
+		values_reclaimed = 0;
+	}
 }
 
 /**
@@ -2116,6 +2138,11 @@ values_init(void)
 		raw_kv, no_packing, RAW_DB_CACHE_SIZE, uint64_mem_hash, uint64_mem_eq,
 		GNET_PROPERTY(dht_storage_in_memory));
 
+	dbmw_set_map_mmap(db_valuedata, GNET_PROPERTY(dht_storage_mmap));
+	dbmw_set_map_mmap(db_rawdata, GNET_PROPERTY(dht_storage_mmap));
+	dbmw_set_map_bgflush(db_valuedata, GNET_PROPERTY(dht_storage_bgflush));
+	dbmw_set_map_bgflush(db_rawdata, GNET_PROPERTY(dht_storage_bgflush));
+
 	db_expired = dbstore_create(db_expwhat, settings_dht_db_dir(), db_expbase,
 		expired_kv, no_packing, 0, kuid_pair_hash, kuid_pair_eq,
 		GNET_PROPERTY(dht_storage_in_memory));
@@ -2218,6 +2245,7 @@ values_close(void)
 	acct_net_free_null(&values_per_class_c);
 	cq_periodic_remove(&values_expire_ev);
 	values_managed = 0;
+	values_reclaimed = 0;
 
 	gnet_stats_set_general(GNR_DHT_VALUES_HELD, 0);
 
@@ -25,6 +25,8 @@
 #ifndef _if_core_downloads_h_
 #define _if_core_downloads_h_
 
+#include "lib/elist.h"
+#include "lib/erbtree.h"
 #include "lib/event.h"			/* For frequency_t */
 #include "lib/hashlist.h"
 #include "lib/htable.h"
@@ -86,6 +88,15 @@ struct dl_key {
 	uint16 port;				/**< Port of server */
 };
 
+/**
+ * Scheduling state of a server.
+ */
+enum dl_sched {
+	DL_SCHED_NONE = 0,			/**< Not scheduled, nothing to start */
+	DL_SCHED_TIMER,				/**< Sleeping in the scheduling timer tree */
+	DL_SCHED_READY				/**< In the list of ready servers */
+};
+
 enum dl_server_magic { DL_SERVER_MAGIC = 0x5e45e4ffU };
 
 struct dl_server {
@@ -100,6 +111,10 @@ struct dl_server {
 	time_t retry_after;		/**< Time at which we may retry from this host */
 	time_t dns_lookup;		/**< Last DNS lookup for hostname */
 	time_t last_connect;	/**< When we last connected to that server */
+	time_t sched_after;		/**< When the scheduler must consider it again */
+	enum dl_sched sched;	/**< Scheduling state */
+	rbnode_t sched_node;	/**< Embedded node in the scheduling timer tree */
+	link_t sched_link;		/**< Embedded link in the list of ready servers */
 	struct vernum parq_version; /**< Supported queueing version */
 	uint speed_avg;			/**< Average (EMA) upload speed, in bytes/sec */
 	unsigned latency;		/**< HTTP latency, in ms (EMA) */
@@ -259,6 +274,11 @@ struct download {
 	uint32 header_read_eof;		/**< EOF errors with empty headers */
 	uint32 data_timeouts;		/**< # of timeouts after getting headers */
 
+	uint32 writes_pending;		/**< Asynchronous writes in progress */
+	size_t writes_queued;		/**< Amount of data being written */
+	uint write_latency;			/**< Average write latency, in ms */
+	int write_error;			/**< Failed asynchronous write errno */
+
 	const char *remove_msg;
 
 	const struct sha1 *sha1;	/**< Known SHA1 (binary atom), NULL if none */
@@ -279,6 +299,9 @@ struct download {
 	unsigned got_giv:1;			/**< Whether initiated from GIV reception */
 	unsigned unavailable:1;		/**< Set on Timout, Push route lost */
 	unsigned tls_upgraded:1;	/**< Was successfully upgraded to TLS */
+	unsigned write_throttled:1;	/**< Not reading, too much data being written */
+	unsigned write_parked:1;	/**< Not reading, waiting for our writes */
+	unsigned write_trimmed:1;	/**< Whether data was trimmed when parked */
 
 	struct cproxy *cproxy;		/**< Push proxy being used currently */
 	struct parq_dl_queued *parq_dl;	/**< Queuing status */
@@ -26,6 +26,7 @@
 
 #include "common.h"
 
+#include "lib/erbtree.h"
 #include "lib/eslist.h"
 #include "lib/http_range.h"
 #include "lib/path.h"
@@ -133,6 +134,7 @@ enum fi_magic {
 };
 
 struct guid;
+struct fi_slice;
 
 /**
  * File downloading information.
@@ -157,6 +159,7 @@ typedef struct dl_file_info {
 		struct tth *leaves;	/**< Tigertree leaves */
 		size_t num_leaves;	/**< Number of tigertree leaves */
 		filesize_t slice_size;	/* Slice size (bytes covered by a leaf) */
+		struct fi_slice *slices;	/**< Slice verification state */
 	} tigertree;
 	int32 refcount;			/**< Reference count of file (number of sources)*/
 	pslist_t *sources;		/**< list of sources (struct download *) */
@@ -172,6 +175,9 @@ typedef struct dl_file_info {
 	filesize_t buffered;	/**< Amount of buffered data (unflushed) */
 	filesize_t uploaded;	/**< Amount of bytes uploaded */
 	eslist_t chunklist;		/**< List of ranges within file */
+	erbtree_t chunkmap;		/**< Chunks from chunklist, indexed by offset */
+	erbtree_t chunkholes;	/**< EMPTY chunks, indexed by offset */
+	erbtree_t chunkbusy;	/**< BUSY chunks, indexed by offset */
 	eslist_t available;		/**< List of ranges available, with source count */
 	http_rangeset_t *seen_on_network;  /**< Ranges available on network */
 	uint32 generation;		/**< Generation number, incremented on disk update */
@@ -1,5 +1,5 @@
 /*
- * Generated on Tue May 22 23:29:14 2018 by enum-msg.pl -- DO NOT EDIT
+ * Generated on Mon Oct 19 01:24:04 2026 by enum-msg.pl -- DO NOT EDIT
  *
  * Command: ../../../scripts/enum-msg.pl stats.lst
  */
@@ -398,6 +398,12 @@ static const char *stats_symbols[] = {
 	"dht_successful_push_proxy_lookups",
 	"dht_successful_node_push_entry_lookups",
 	"dht_seeding_of_orphan",
+	"sdbm_bg_flushed_pages",
+	"sdbm_bg_flush_batches",
+	"sdbm_bg_flush_latency",
+	"sdbm_bg_flush_max_latency",
+	"sdbm_bg_flush_stalls",
+	"sdbm_bg_flush_stall_time",
 	"stats_digest",
 	"stats_tcp_digest",
 	"stats_udp_digest",
@@ -805,6 +811,12 @@ static const char *stats_text[] = {
 	N_("DHT successful push-proxy lookups"),
 	N_("DHT successful node push-entry lookups"),
 	N_("DHT re-seeding of orphan downloads"),
+	N_("SDBM pages flushed in the background"),
+	N_("SDBM background flush batches"),
+	N_("SDBM background flush average latency (usecs)"),
+	N_("SDBM background flush maximum latency (usecs)"),
+	N_("SDBM stalls waiting for background flush"),
+	N_("SDBM time stalled on background flush (usecs)"),
 	N_("Digests computed on general statistics"),
 	N_("Digests computed on TCP statistics"),
 	N_("Digests computed on UDP statistics"),
@@ -1,5 +1,5 @@
 /*
- * Generated on Tue May 22 23:29:14 2018 by enum-msg.pl -- DO NOT EDIT
+ * Generated on Mon Oct 19 01:24:04 2026 by enum-msg.pl -- DO NOT EDIT
  *
  * Command: ../../../scripts/enum-msg.pl stats.lst
  */
@@ -8,7 +8,7 @@
 #define _if_gen_gnr_stats_h_
 
 /*
- * Enum count: 386
+ * Enum count: 392
  */
 typedef enum {
 	GNR_ROUTING_ERRORS = 0,
@@ -394,6 +394,12 @@ typedef enum {
 	GNR_DHT_SUCCESSFUL_PUSH_PROXY_LOOKUPS,
 	GNR_DHT_SUCCESSFUL_NODE_PUSH_ENTRY_LOOKUPS,
 	GNR_DHT_SEEDING_OF_ORPHAN,
+	GNR_SDBM_BG_FLUSHED_PAGES,
+	GNR_SDBM_BG_FLUSH_BATCHES,
+	GNR_SDBM_BG_FLUSH_LATENCY,
+	GNR_SDBM_BG_FLUSH_MAX_LATENCY,
+	GNR_SDBM_BG_FLUSH_STALLS,
+	GNR_SDBM_BG_FLUSH_STALL_TIME,
 	GNR_STATS_DIGEST,
 	GNR_STATS_TCP_DIGEST,
 	GNR_STATS_UDP_DIGEST,
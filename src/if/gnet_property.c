@@ -1132,6 +1132,18 @@ gboolean gnet_property_variable_lock_sleep_trace     = FALSE;
 static const gboolean gnet_property_variable_lock_sleep_trace_default = FALSE;
 gboolean gnet_property_variable_running_topless     = FALSE;
 static const gboolean gnet_property_variable_running_topless_default = FALSE;
+gboolean gnet_property_variable_dht_storage_mmap     = FALSE;
+static const gboolean gnet_property_variable_dht_storage_mmap_default = FALSE;
+gboolean gnet_property_variable_dht_storage_bgflush     = FALSE;
+static const gboolean gnet_property_variable_dht_storage_bgflush_default = FALSE;
+gboolean gnet_property_variable_verify_drop_cache     = FALSE;
+static const gboolean gnet_property_variable_verify_drop_cache_default = FALSE;
+guint32  gnet_property_variable_download_writeback_size     = 8388608;
+static const guint32  gnet_property_variable_download_writeback_size_default = 8388608;
+gboolean gnet_property_variable_download_preallocate     = TRUE;
+static const gboolean gnet_property_variable_download_preallocate_default = TRUE;
+guint64  gnet_property_variable_download_preallocate_min_size     = 16777216;
+static const guint64  gnet_property_variable_download_preallocate_min_size_default = 16777216;
 
 static prop_set_t *gnet_property;
 
@@ -11397,6 +11409,126 @@ gnet_prop_init(void) {
     gnet_property->props[487].data.boolean.def   = (void *) &gnet_property_variable_running_topless_default;
     gnet_property->props[487].data.boolean.value = (void *) &gnet_property_variable_running_topless;
 
+
+    /*
+     * PROP_DHT_STORAGE_MMAP:
+     *
+     * General data:
+     */
+    gnet_property->props[488].name = "dht_storage_mmap";
+    gnet_property->props[488].desc = _("Whether the DHT databases kept on disk should be read through memory mappings of their files, sparing a system call per page read.  An I/O error whilst reading a mapped file cannot be reported gracefully and kills the process, which is why this is off by default.");
+    gnet_property->props[488].ev_changed = event_new("dht_storage_mmap_changed");
+    gnet_property->props[488].save = TRUE;
+    gnet_property->props[488].internal = FALSE;
+    gnet_property->props[488].vector_size = 1;
+	mutex_init(&gnet_property->props[488].lock);
+
+    /* Type specific data: */
+    gnet_property->props[488].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[488].data.boolean.def   = (void *) &gnet_property_variable_dht_storage_mmap_default;
+    gnet_property->props[488].data.boolean.value = (void *) &gnet_property_variable_dht_storage_mmap;
+
+
+    /*
+     * PROP_DHT_STORAGE_BGFLUSH:
+     *
+     * General data:
+     */
+    gnet_property->props[489].name = "dht_storage_bgflush";
+    gnet_property->props[489].desc = _("Whether the dirty pages of the DHT databases kept on disk should be written by a background thread, so that flushing them never blocks the main thread.  This costs a dedicated thread and a copy of the dirty pages per database.");
+    gnet_property->props[489].ev_changed = event_new("dht_storage_bgflush_changed");
+    gnet_property->props[489].save = TRUE;
+    gnet_property->props[489].internal = FALSE;
+    gnet_property->props[489].vector_size = 1;
+	mutex_init(&gnet_property->props[489].lock);
+
+    /* Type specific data: */
+    gnet_property->props[489].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[489].data.boolean.def   = (void *) &gnet_property_variable_dht_storage_bgflush_default;
+    gnet_property->props[489].data.boolean.value = (void *) &gnet_property_variable_dht_storage_bgflush;
+
+
+    /*
+     * PROP_VERIFY_DROP_CACHE:
+     *
+     * General data:
+     */
+    gnet_property->props[490].name = "verify_drop_cache";
+    gnet_property->props[490].desc = _("When TRUE, the file data read to compute hashes is evicted from the page cache as soon as it has been hashed, so that verifying large libraries does not push out the data cached for uploads.");
+    gnet_property->props[490].ev_changed = event_new("verify_drop_cache_changed");
+    gnet_property->props[490].save = TRUE;
+    gnet_property->props[490].internal = FALSE;
+    gnet_property->props[490].vector_size = 1;
+	mutex_init(&gnet_property->props[490].lock);
+
+    /* Type specific data: */
+    gnet_property->props[490].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[490].data.boolean.def   = (void *) &gnet_property_variable_verify_drop_cache_default;
+    gnet_property->props[490].data.boolean.value = (void *) &gnet_property_variable_verify_drop_cache;
+
+
+    /*
+     * PROP_DOWNLOAD_WRITEBACK_SIZE:
+     *
+     * General data:
+     */
+    gnet_property->props[491].name = "download_writeback_size";
+    gnet_property->props[491].desc = _("Amount of downloaded data that can be queued for writing to disk by a background thread.  Downloads keep receiving data whilst their buffers are written, and writes to adjacent ranges of a file are coalesced.  When this much data is pending, sources stop reading from the network until the disk catches up.  Use 0 to write data synchronously.");
+    gnet_property->props[491].ev_changed = event_new("download_writeback_size_changed");
+    gnet_property->props[491].save = TRUE;
+    gnet_property->props[491].internal = FALSE;
+    gnet_property->props[491].vector_size = 1;
+	mutex_init(&gnet_property->props[491].lock);
+
+    /* Type specific data: */
+    gnet_property->props[491].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[491].data.guint32.def   = (void *) &gnet_property_variable_download_writeback_size_default;
+    gnet_property->props[491].data.guint32.value = (void *) &gnet_property_variable_download_writeback_size;
+    gnet_property->props[491].data.guint32.choices = NULL;
+    gnet_property->props[491].data.guint32.max   = 268435456;
+    gnet_property->props[491].data.guint32.min   = 0;
+
+
+    /*
+     * PROP_DOWNLOAD_PREALLOCATE:
+     *
+     * General data:
+     */
+    gnet_property->props[492].name = "download_preallocate";
+    gnet_property->props[492].desc = _("Whether to reserve disk space for the whole file when a download output file is created or grows.  The filesystem can then lay out the file contiguously although sources write it at random offsets, which makes later reads faster.  Space is only reserved when the filesystem supports it efficiently and enough free space remains afterwards.");
+    gnet_property->props[492].ev_changed = event_new("download_preallocate_changed");
+    gnet_property->props[492].save = TRUE;
+    gnet_property->props[492].internal = FALSE;
+    gnet_property->props[492].vector_size = 1;
+	mutex_init(&gnet_property->props[492].lock);
+
+    /* Type specific data: */
+    gnet_property->props[492].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[492].data.boolean.def   = (void *) &gnet_property_variable_download_preallocate_default;
+    gnet_property->props[492].data.boolean.value = (void *) &gnet_property_variable_download_preallocate;
+
+
+    /*
+     * PROP_DOWNLOAD_PREALLOCATE_MIN_SIZE:
+     *
+     * General data:
+     */
+    gnet_property->props[493].name = "download_preallocate_min_size";
+    gnet_property->props[493].desc = _("Minimum size of a download for its output file to be preallocated.  Small files are not worth it and are left sparse.");
+    gnet_property->props[493].ev_changed = event_new("download_preallocate_min_size_changed");
+    gnet_property->props[493].save = TRUE;
+    gnet_property->props[493].internal = FALSE;
+    gnet_property->props[493].vector_size = 1;
+	mutex_init(&gnet_property->props[493].lock);
+
+    /* Type specific data: */
+    gnet_property->props[493].type               = PROP_TYPE_GUINT64;
+    gnet_property->props[493].data.guint64.def   = (void *) &gnet_property_variable_download_preallocate_min_size_default;
+    gnet_property->props[493].data.guint64.value = (void *) &gnet_property_variable_download_preallocate_min_size;
+    gnet_property->props[493].data.guint64.choices = NULL;
+    gnet_property->props[493].data.guint64.max   = (guint64) -1;
+    gnet_property->props[493].data.guint64.min   = 0x0000000000000000;
+
     gnet_property->by_name = htable_create(HASH_KEY_STRING, 0);
     for (n = 0; n < GNET_PROPERTY_NUM; n ++) {
         htable_insert(gnet_property->by_name,
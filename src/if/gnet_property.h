@@ -524,6 +524,12 @@ typedef enum {
     PROP_LOCK_CONTENTION_TRACE,
     PROP_LOCK_SLEEP_TRACE,
     PROP_RUNNING_TOPLESS,
+    PROP_DHT_STORAGE_MMAP,
+    PROP_DHT_STORAGE_BGFLUSH,
+    PROP_VERIFY_DROP_CACHE,
+    PROP_DOWNLOAD_WRITEBACK_SIZE,
+    PROP_DOWNLOAD_PREALLOCATE,
+    PROP_DOWNLOAD_PREALLOCATE_MIN_SIZE,
     GNET_PROPERTY_END
 } gnet_property_t;
 
@@ -538,6 +538,12 @@ extern const gboolean gnet_property_variable_inputevt_trace;
 extern const gboolean gnet_property_variable_lock_contention_trace;
 extern const gboolean gnet_property_variable_lock_sleep_trace;
 extern const gboolean gnet_property_variable_running_topless;
+extern const gboolean gnet_property_variable_dht_storage_mmap;
+extern const gboolean gnet_property_variable_dht_storage_bgflush;
+extern const gboolean gnet_property_variable_verify_drop_cache;
+extern const guint32  gnet_property_variable_download_writeback_size;
+extern const gboolean gnet_property_variable_download_preallocate;
+extern const guint64  gnet_property_variable_download_preallocate_min_size;
 
 
 prop_set_t *gnet_prop_init(void);
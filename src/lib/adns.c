@@ -400,6 +400,7 @@ struct adns_helper_args {
 };
 
 #define ADNS_HELPER_STACK	THREAD_STACK_MIN
+#define ADNS_REPLY_BATCH	32	/* Max replies fetched at once from queue */
 
 /**
  * The ``main'' function of the adns helper thread (server).
@@ -528,7 +529,8 @@ adns_reply_ready(const struct adns_response *ans)
 static void
 adns_reply_callback(void *data, int source, inputevt_cond_t condition)
 {
-	struct adns_response *ans;
+	void *vec[ADNS_REPLY_BATCH];
+	size_t i, n;
 	waiter_t *w = data;
 
 	g_assert(condition & INPUT_EVENT_RX);
@@ -539,16 +541,20 @@ adns_reply_callback(void *data, int source, inputevt_cond_t condition)
 
 	/*
 	 * Consume all the data available in the queue, potentially handling
-	 * several pending replies.
+	 * several pending replies, fetching them in batches.
 	 */
 
-	while (NULL != (ans = aq_remove_try(adns_ans))) {
-		/*
-		 * Inform issuer of request by invoking the user callback.
-		 */
+	while (0 != (n = aq_drain(adns_ans, vec, N_ITEMS(vec)))) {
+		for (i = 0; i < n; i++) {
+			struct adns_response *ans = vec[i];
 
-		adns_reply_ready(ans);
-		WFREE(ans);
+			/*
+			 * Inform issuer of request by invoking the user callback.
+			 */
+
+			adns_reply_ready(ans);
+			WFREE(ans);
+		}
 	}
 }
 
@@ -44,6 +44,18 @@
  *
  * Messages are normally read in the order they were enqueued.
  *
+ * The queue is implemented on top of a bounded lock-free ring (see ringq.c)
+ * so that putting and removing messages does not require any locking in the
+ * common case.  When the ring is full, messages spill into an overflow list
+ * protected by the queue's mutex.  Once the overflow list is non-empty, all
+ * new messages are appended to it until readers have drained it, ensuring
+ * messages from a given thread are still read in the order they were put.
+ *
+ * The mutex and condition variable are only used when a reader has to block
+ * because the queue is empty, or when waiter objects are attached to the
+ * queue and need to be signaled.  Writers only need to grab the mutex when
+ * they detect that someone is waiting for new data.
+ *
  * Writing to the queue never blocks, but reading will if there is nothing
  * pending to be read, unless a non-blocking read is performed.
  *
@@ -102,6 +114,7 @@
 #include "eslist.h"
 #include "log.h"
 #include "mutex.h"
+#include "ringq.h"
 #include "stringify.h"
 #include "tm.h"
 #include "waiter.h"
@@ -109,6 +122,8 @@
 
 #include "override.h"			/* Must be the last header included */
 
+#define AQ_RING_SIZE	512		/* Amount of items in the lock-free ring */
+
 enum async_queue_magic { ASYNC_QUEUE_MAGIC = 0x51647584 };
 
 /**
@@ -117,7 +132,11 @@ enum async_queue_magic { ASYNC_QUEUE_MAGIC = 0x51647584 };
 struct async_queue {
 	enum async_queue_magic magic;	/* Magic number */
 	int refcnt;						/* Reference count */
-	eslist_t queue;					/* The list implementing the queue */
+	int overflowed;					/* Amount of items in the overflow list */
+	int sleeping;					/* Amount of threads blocked reading */
+	int waiters;					/* Amount of attached waiter objects */
+	ringq_t *ring;					/* Lock-free ring holding items */
+	eslist_t overflow;				/* Items that did not fit in the ring */
 	mutex_t lock;					/* Thread-safe lock */
 	cond_t event;					/* To wait/signal events on queue */
 };
@@ -166,7 +185,8 @@ aq_make_full(bool signals)
 	WALLOC0(aq);
 	aq->magic = ASYNC_QUEUE_MAGIC;
 	aq->refcnt = 1;
-	eslist_init(&aq->queue, offsetof(struct async_queue_item, lk));
+	aq->ring = ringq_make(AQ_RING_SIZE);
+	eslist_init(&aq->overflow, offsetof(struct async_queue_item, lk));
 	mutex_init(&aq->lock);
 	cond_init_full(&aq->event, &aq->lock, signals);
 
@@ -184,7 +204,10 @@ aq_waiter_add(aqueue_t *aq, waiter_t *w)
 {
 	aq_check(aq);
 
+	mutex_lock(&aq->lock);
 	cond_waiter_add(&aq->event, w);
+	aq->waiters++;
+	mutex_unlock(&aq->lock);
 }
 
 /**
@@ -195,9 +218,17 @@ aq_waiter_add(aqueue_t *aq, waiter_t *w)
 bool
 aq_waiter_remove(aqueue_t *aq, waiter_t *w)
 {
+	bool removed;
+
 	aq_check(aq);
 
-	return cond_waiter_remove(&aq->event, w);
+	mutex_lock(&aq->lock);
+	removed = cond_waiter_remove(&aq->event, w);
+	if (removed)
+		aq->waiters--;
+	mutex_unlock(&aq->lock);
+
+	return removed;
 }
 
 static void
@@ -215,16 +246,20 @@ aq_free_item(void *item, void *unused_data)
 static void
 aq_free(aqueue_t *aq)
 {
+	size_t count;
+
 	aq_check(aq);
 	g_assert(0 == aq->refcnt);
 
-	if G_UNLIKELY(0 != eslist_count(&aq->queue)) {
-		size_t count = eslist_count(&aq->queue);
+	count = ringq_count(aq->ring) + eslist_count(&aq->overflow);
+
+	if G_UNLIKELY(0 != count) {
 		s_carp("%s() freeing asynchronous queue still holding %zu item%s",
 			G_STRFUNC, count, plural(count));
 	}
 
-	eslist_foreach(&aq->queue, aq_free_item, NULL);
+	eslist_foreach(&aq->overflow, aq_free_item, NULL);
+	ringq_free_null(&aq->ring);
 	mutex_destroy(&aq->lock);
 	cond_destroy(&aq->event);
 
@@ -280,7 +315,11 @@ aq_destroy_null(aqueue_t **aq_ptr)
 }
 
 /**
- * Explicitly lock the queue to perform several operations atomically.
+ * Explicitly lock the queue.
+ *
+ * Since items are normally exchanged through a lock-free ring, this only
+ * prevents blocked readers from being woken up and items from being moved
+ * to or from the overflow list whilst the lock is held.
  */
 void
 aq_lock(aqueue_t *aq)
@@ -307,16 +346,100 @@ aq_unlock(aqueue_t *aq)
 size_t
 aq_count(const aqueue_t *aq)
 {
-	aqueue_t *waq = deconstify_pointer(aq);
-	size_t count;
-
 	aq_check(aq);
 
-	mutex_lock(&waq->lock);
-	count = eslist_count(&aq->queue);
-	mutex_unlock(&waq->lock);
+	return ringq_count(aq->ring) + atomic_int_get(&aq->overflowed);
+}
+
+/**
+ * Wakeup blocked readers and signal waiters after an item was put.
+ *
+ * This is done without taking the lock when nobody is waiting for data.
+ * Readers increment the "sleeping" count before checking for data one last
+ * time under the lock, and the memory barrier here ensures we either see
+ * that count or they see the item we just put.
+ */
+static void
+aq_wakeup(aqueue_t *aq)
+{
+	atomic_mb();
+
+	if (0 == aq->sleeping && 0 == aq->waiters)
+		return;
+
+	mutex_lock(&aq->lock);
+	cond_signal(&aq->event, &aq->lock);
+	mutex_unlock(&aq->lock);
+}
+
+/**
+ * Put item in the overflow list.
+ *
+ * The queue must be locked.
+ */
+static void
+aq_overflow_append(aqueue_t *aq, void *data)
+{
+	struct async_queue_item *aqi;
+
+	g_assert(mutex_is_owned(&aq->lock));
+
+	WALLOC0(aqi);
+	aqi->data = data;
+	eslist_append(&aq->overflow, aqi);
+	atomic_int_inc(&aq->overflowed);
+}
+
+/**
+ * Fetch next item, if any.
+ *
+ * The ring always holds the oldest items, so we only look at the overflow
+ * list when the ring is empty.
+ *
+ * @param aq		the async queue
+ * @param data_ptr	where the item is returned
+ * @param locked	whether the queue lock is already held by the caller
+ *
+ * @return TRUE if we fetched an item, FALSE if the queue was empty.
+ */
+static bool
+aq_fetch(aqueue_t *aq, void **data_ptr, bool locked)
+{
+	struct async_queue_item *aqi = NULL;
+	bool found = FALSE;
+
+	if G_LIKELY(ringq_get(aq->ring, data_ptr))
+		return TRUE;
+
+	if G_LIKELY(0 == atomic_int_get(&aq->overflowed))
+		return FALSE;
+
+	if (!locked)
+		mutex_lock(&aq->lock);
+
+	/*
+	 * Now that we hold the lock, the ring could have been refilled by a
+	 * writer that saw an empty overflow list before we had a chance to
+	 * look at it: since this item was put concurrently with the ones in
+	 * the overflow list, we can return it first.
+	 */
+
+	if (ringq_get(aq->ring, data_ptr)) {
+		found = TRUE;
+	} else if (NULL != (aqi = eslist_shift(&aq->overflow))) {
+		atomic_int_dec(&aq->overflowed);
+		found = TRUE;
+	}
+
+	if (!locked)
+		mutex_unlock(&aq->lock);
 
-	return count;
+	if (aqi != NULL) {
+		*data_ptr = aqi->data;
+		WFREE(aqi);
+	}
+
+	return found;
 }
 
 /**
@@ -333,23 +456,32 @@ aq_count(const aqueue_t *aq)
 size_t
 aq_put(aqueue_t *aq, void *data)
 {
-	struct async_queue_item *aqi;
-	size_t count;
-
 	aq_check(aq);
 
-	WALLOC0(aqi);
-	aqi->data = data;
+	/*
+	 * Fast path: nothing in the overflow list and room in the ring.
+	 */
 
-	mutex_lock(&aq->lock);
+	if G_UNLIKELY(
+		0 != atomic_int_get(&aq->overflowed) || !ringq_put(aq->ring, data)
+	) {
+		mutex_lock(&aq->lock);
 
-	eslist_append(&aq->queue, aqi);
-	count = eslist_count(&aq->queue);
-	cond_signal(&aq->event, &aq->lock);
+		/*
+		 * The overflow list may have been drained since we looked, in which
+		 * case we can try the ring again: items in the ring are always read
+		 * before the ones in the overflow list.
+		 */
 
-	mutex_unlock(&aq->lock);
+		if (0 != eslist_count(&aq->overflow) || !ringq_put(aq->ring, data))
+			aq_overflow_append(aq, data);
 
-	return count;
+		mutex_unlock(&aq->lock);
+	}
+
+	aq_wakeup(aq);
+
+	return aq_count(aq);
 }
 
 /**
@@ -369,35 +501,38 @@ aq_put(aqueue_t *aq, void *data)
 void *
 aq_timed_remove(aqueue_t *aq, const tm_t *timeout)
 {
-	struct async_queue_item *aqi = NULL;
 	void *data = NULL;
-	bool has_data = TRUE;
+	bool has_data;
 	tm_t end;
 
 	aq_check(aq);
 	g_assert(timeout != NULL);
 
+	if G_LIKELY(aq_fetch(aq, &data, FALSE))
+		goto done;
+
 	tm_now_exact(&end);
 	tm_add(&end, timeout);
 
 	mutex_lock(&aq->lock);
-	while (has_data && 0 == eslist_count(&aq->queue))
-		has_data = cond_wait_until_clean(&aq->event, &aq->lock, &end);
+	aq->sleeping++;
+	atomic_mb();
 
-	if (has_data)
-		aqi = eslist_shift(&aq->queue);
-	mutex_unlock(&aq->lock);
+	while (!(has_data = aq_fetch(aq, &data, TRUE))) {
+		if (!cond_wait_until_clean(&aq->event, &aq->lock, &end))
+			break;
+	}
 
-	if (has_data) {
-		g_assert(aqi != NULL);
+	aq->sleeping--;
+	mutex_unlock(&aq->lock);
 
-		data = aqi->data;
-		WFREE(aqi);
+	if (!has_data)
+		return NULL;
 
-		if G_UNLIKELY(NULL == data) {
-			s_carp("%s(): found NULL data exchanged with non-blocking reads",
-				G_STRFUNC);
-		}
+done:
+	if G_UNLIKELY(NULL == data) {
+		s_carp("%s(): found NULL data exchanged with non-blocking reads",
+			G_STRFUNC);
 	}
 
 	return data;
@@ -416,23 +551,28 @@ aq_timed_remove(aqueue_t *aq, const tm_t *timeout)
 void *
 aq_remove(aqueue_t *aq)
 {
-	struct async_queue_item *aqi;
 	void *data;
 
 	aq_check(aq);
 
+	if G_LIKELY(aq_fetch(aq, &data, FALSE))
+		return data;
+
+	/*
+	 * We have to block.  Announce that we are sleeping before checking
+	 * for data one last time, so that writers know they must signal us.
+	 */
+
 	mutex_lock(&aq->lock);
-	while (0 == eslist_count(&aq->queue))
+	aq->sleeping++;
+	atomic_mb();
+
+	while (!aq_fetch(aq, &data, TRUE))
 		cond_wait_clean(&aq->event, &aq->lock);
 
-	aqi = eslist_shift(&aq->queue);
+	aq->sleeping--;
 	mutex_unlock(&aq->lock);
 
-	g_assert(aqi != NULL);
-
-	data = aqi->data;
-	WFREE(aqi);
-
 	return data;
 }
 
@@ -449,26 +589,52 @@ aq_remove(aqueue_t *aq)
 void *
 aq_remove_try(aqueue_t *aq)
 {
-	struct async_queue_item *aqi;
-	void *data = NULL;
+	void *data;
 
 	aq_check(aq);
 
-	mutex_lock(&aq->lock);
-	aqi = eslist_shift(&aq->queue);
-	mutex_unlock(&aq->lock);
-
-	if (aqi != NULL) {
-		data = aqi->data;
-		WFREE(aqi);
+	if (!aq_fetch(aq, &data, FALSE))
+		return NULL;
 
-		if G_UNLIKELY(NULL == data) {
-			s_carp("%s(): found NULL data exchanged with non-blocking reads",
-				G_STRFUNC);
-		}
+	if G_UNLIKELY(NULL == data) {
+		s_carp("%s(): found NULL data exchanged with non-blocking reads",
+			G_STRFUNC);
 	}
 
 	return data;
 }
 
+/**
+ * Remove all the pending items from the queue, up to the size of the vector.
+ *
+ * This is more efficient than looping over aq_remove_try() since we avoid
+ * repeated checks on the queue and can fetch several items out of the
+ * overflow list with a single lock.  It never blocks.
+ *
+ * @param aq		the async queue
+ * @param vec		vector where removed items are written, in queue order
+ * @param vcnt		amount of entries in the vector
+ *
+ * @return the amount of items removed, 0 if the queue was empty.
+ */
+size_t
+aq_drain(aqueue_t *aq, void **vec, size_t vcnt)
+{
+	size_t n;
+
+	aq_check(aq);
+	g_assert(vec != NULL);
+
+	n = ringq_drain(aq->ring, vec, vcnt);
+
+	if (n < vcnt && 0 != atomic_int_get(&aq->overflowed)) {
+		mutex_lock(&aq->lock);
+		while (n < vcnt && aq_fetch(aq, &vec[n], TRUE))
+			n++;
+		mutex_unlock(&aq->lock);
+	}
+
+	return n;
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -60,6 +60,7 @@ size_t aq_put(aqueue_t *aq, void *data);
 void *aq_remove(aqueue_t *aq);
 void *aq_timed_remove(aqueue_t *aq, const struct tmval *timeout);
 void *aq_remove_try(aqueue_t *aq);
+size_t aq_drain(aqueue_t *aq, void **vec, size_t vcnt);
 
 void aq_lock(aqueue_t *aq);
 void aq_unlock(aqueue_t *aq);
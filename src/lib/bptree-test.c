@@ -0,0 +1,496 @@
+/*
+ * bptree-test -- B+tree consistency and crash recovery tests.
+ *
+ * Copyright (c) 2026 gtk-gnutella developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "bptree.h"
+#include "endian.h"
+#include "file.h"
+#include "halloc.h"
+#include "hstrfn.h"
+#include "misc.h"
+#include "parse.h"
+#include "path.h"
+#include "progname.h"
+#include "random.h"
+#include "stringify.h"
+#include "xmalloc.h"
+
+#define KEYS		20000		/* Default key space */
+#define CACHE		8			/* Default cache size, in pages */
+#define VALUE_MAX	3000		/* Larger than inline values */
+
+static bool verbose;
+static uint32 keys = KEYS;
+
+/*
+ * Reference contents of the tree: version[k] is the version of the value
+ * held under key k, 0 if key is absent.
+ */
+static uint32 *version;
+static size_t present;
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-hv] [-c pages] [-d dir] [-n keys]\n"
+		"  -c : amount of pages cached by the tree (default %u)\n"
+		"  -d : directory where the tree file is created (default \".\")\n"
+		"  -h : prints this help message\n"
+		"  -n : amount of distinct keys (default %u)\n"
+		"  -v : verbose mode\n"
+		, getprogname(), CACHE, KEYS);
+	exit(EXIT_FAILURE);
+}
+
+static unsigned
+get_number(const char *arg, int opt)
+{
+	int error;
+	uint32 val;
+
+	val = parse_v32(arg, NULL, &error);
+	if (0 == val && error != 0) {
+		fprintf(stderr, "%s: invalid -%c argument \"%s\": %s\n",
+			getprogname(), opt, arg, english_strerror(error));
+		exit(EXIT_FAILURE);
+	}
+
+	return val;
+}
+
+/**
+ * Generate the value for a given key and version.
+ *
+ * @return the value length.
+ */
+static size_t
+make_value(char *buf, uint32 k, uint32 v)
+{
+	size_t i, len = (k * 7 + v * 13) % 97;
+
+	/*
+	 * One value in 8 is large enough to go to overflow pages.
+	 */
+
+	if (0 == (k + v) % 8)
+		len = VALUE_MAX - (k + v) % 700;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (k + v + i) & 0xff;
+
+	return len;
+}
+
+static void
+make_key(char key[4], uint32 k)
+{
+	poke_be32(key, k);
+}
+
+static void
+store(bptree_t *bt, uint32 k)
+{
+	char key[4], value[VALUE_MAX];
+	size_t len;
+	bool existed;
+
+	make_key(key, k);
+	len = make_value(value, k, version[k] + 1);
+
+	g_assert_log(0 == bptree_store(bt, key, sizeof key, value, len, &existed),
+		"%s: cannot store key #%u: %m", G_STRFUNC, k);
+	g_assert_log(existed == (0 != version[k]),
+		"%s: key #%u existed=%s", G_STRFUNC, k, bool_to_string(existed));
+
+	if (0 == version[k]++)
+		present++;
+}
+
+static void
+delete(bptree_t *bt, uint32 k)
+{
+	char key[4];
+	int ret;
+
+	make_key(key, k);
+	ret = bptree_delete(bt, key, sizeof key);
+
+	g_assert_log(0 == ret ? 0 != version[k] : 0 == version[k] && 0 == errno,
+		"%s: key #%u ret=%d: %m", G_STRFUNC, k, ret);
+
+	if (0 != version[k]) {
+		version[k] = 0;
+		present--;
+	}
+}
+
+/**
+ * Apply random updates to the tree and its reference.
+ */
+static void
+update(bptree_t *bt, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		uint32 k = random_value(keys - 1);
+
+		if (random_value(3) != 0)
+			store(bt, k);
+		else
+			delete(bt, k);
+	}
+}
+
+/**
+ * Check that the value held in the tree is the one of the reference.
+ */
+static void
+check_value(uint32 k, const void *value, size_t len)
+{
+	char buf[VALUE_MAX];
+	size_t expected = make_value(buf, k, version[k]);
+
+	g_assert_log(len == expected && 0 == memcmp(value, buf, len),
+		"%s: key #%u has wrong value (len=%zu, expected %zu)",
+		G_STRFUNC, k, len, expected);
+}
+
+struct range_ctx {
+	uint32 next;			/* Next key we expect to see */
+	uint32 end;				/* End of range (excluded) */
+};
+
+/**
+ * Advance to the next present key of the reference.
+ */
+static uint32
+next_present(uint32 k, uint32 end)
+{
+	while (k < end && 0 == version[k])
+		k++;
+
+	return k;
+}
+
+static void
+range_check(const void *key, size_t klen, const void *value, size_t vlen,
+	void *arg)
+{
+	struct range_ctx *ctx = arg;
+	uint32 k;
+
+	g_assert(4 == klen);
+
+	k = peek_be32(key);
+	ctx->next = next_present(ctx->next, ctx->end);
+
+	g_assert_log(k == ctx->next, "%s: got key #%u, expected #%u",
+		G_STRFUNC, k, ctx->next);
+
+	check_value(k, value, vlen);
+	ctx->next++;
+}
+
+/**
+ * Check that iterating over [lo, hi) yields the keys of the reference,
+ * in order.
+ */
+static void
+check_range(bptree_t *bt, uint32 lo, uint32 hi)
+{
+	struct range_ctx ctx;
+	char klo[4], khi[4];
+
+	make_key(klo, lo);
+	make_key(khi, hi);
+	ctx.next = lo;
+	ctx.end = hi;
+
+	bptree_foreach_range(bt, klo, sizeof klo, khi, sizeof khi,
+		range_check, &ctx);
+
+	g_assert_log(next_present(ctx.next, hi) == hi,
+		"%s: missing key #%u in [%u, %u)", G_STRFUNC, ctx.next, lo, hi);
+}
+
+/**
+ * Check that the tree holds exactly the reference.
+ */
+static void
+check(bptree_t *bt, const char *what)
+{
+	uint32 k;
+	size_t i;
+
+	g_assert_log(bptree_count(bt) == present,
+		"%s: %s: tree has %zu keys, expected %zu",
+		G_STRFUNC, what, bptree_count(bt), present);
+
+	for (k = 0; k < keys; k++) {
+		char key[4];
+		const void *value;
+		size_t len;
+
+		make_key(key, k);
+		value = bptree_fetch(bt, key, sizeof key, &len);
+
+		if (0 == version[k]) {
+			g_assert_log(NULL == value && 0 == errno,
+				"%s: %s: deleted key #%u found", G_STRFUNC, what, k);
+		} else {
+			g_assert_log(value != NULL,
+				"%s: %s: key #%u not found: %m", G_STRFUNC, what, k);
+			check_value(k, value, len);
+		}
+	}
+
+	check_range(bt, 0, keys);
+
+	for (i = 0; i < 10; i++) {
+		uint32 lo = random_value(keys - 1);
+		check_range(bt, lo, lo + random_value(keys - lo));
+	}
+
+	g_assert_log(!bptree_error(bt), "%s: %s: I/O error", G_STRFUNC, what);
+
+	if (verbose)
+		printf("%s: %zu keys OK\n", what, present);
+}
+
+static bool
+remove_odd(const void *key, size_t klen, const void *value, size_t vlen,
+	void *arg)
+{
+	uint32 k = peek_be32(key);
+
+	(void) arg;
+	g_assert(4 == klen);
+	check_value(k, value, vlen);
+
+	if (0 == (k & 1))
+		return FALSE;
+
+	version[k] = 0;
+	present--;
+	return TRUE;
+}
+
+static bptree_t *
+open_tree(const char *path, int flags, long cache)
+{
+	bptree_t *bt;
+
+	bt = bptree_open(NULL, path, flags, S_IRUSR | S_IWUSR);
+	g_assert_log(bt != NULL, "cannot open \"%s\": %m", path);
+	bptree_set_cache(bt, cache);
+
+	return bt;
+}
+
+/**
+ * Modify the tree in a child process which then exits without closing it,
+ * as if we had crashed.  The reference is left untouched.
+ */
+static void
+crash(const char *path, long cache, size_t updates)
+{
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	pid = fork();
+	g_assert_log(pid != -1, "%s: cannot fork: %m", G_STRFUNC);
+
+	if (0 == pid) {
+		bptree_t *bt = open_tree(path, O_RDWR, cache);
+		update(bt, updates);
+		_exit(EXIT_SUCCESS);
+	}
+
+	g_assert_log(pid == waitpid(pid, &status, 0),
+		"%s: waitpid() failed: %m", G_STRFUNC);
+	g_assert_log(WIFEXITED(status) && EXIT_SUCCESS == WEXITSTATUS(status),
+		"%s: child process failed", G_STRFUNC);
+}
+
+struct salvage_ctx {
+	size_t count;			/* Amount of keys seen */
+	uint32 last;			/* Last key seen */
+};
+
+static void
+salvage_check(const void *key, size_t klen, const void *value, size_t vlen,
+	void *arg)
+{
+	struct salvage_ctx *ctx = arg;
+	uint32 k;
+
+	g_assert(4 == klen);
+
+	k = peek_be32(key);
+	g_assert_log(0 == ctx->count || k > ctx->last,
+		"%s: key #%u after #%u", G_STRFUNC, k, ctx->last);
+	g_assert_log(k < keys, "%s: bad key #%u", G_STRFUNC, k);
+
+	/*
+	 * A salvaged value can come from any version of the key, so only its
+	 * consistency with the version it comes from can be checked.
+	 */
+
+	if (vlen != 0) {
+		uint32 v = ((uchar *) value)[0] - k;
+		char buf[VALUE_MAX];
+		size_t i, len;
+
+		for (i = 0; i < 256; i++, v += 256) {
+			len = make_value(buf, k, v);
+			if (len == vlen && 0 == memcmp(buf, value, len))
+				break;
+		}
+		g_assert_log(i < 256, "%s: key #%u has a bogus value", G_STRFUNC, k);
+	}
+
+	ctx->last = k;
+	ctx->count++;
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	int c;
+	long cache = CACHE;
+	const char *dir = ".";
+	char *path, *jpath;
+	bptree_t *bt;
+	struct salvage_ctx sctx;
+	const char options[] = "c:d:hn:v";
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'c':			/* cache size */
+			cache = get_number(optarg, c);
+			break;
+		case 'd':			/* directory */
+			dir = optarg;
+			break;
+		case 'n':			/* amount of keys */
+			keys = get_number(optarg, c);
+			break;
+		case 'v':			/* verbose mode */
+			verbose = TRUE;
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0 || keys < 2 || cache < 1)
+		usage();
+
+	path = make_pathname(dir, "bptree-test" BPTREE_FEXT);
+	jpath = h_strconcat(path, BPTREE_JEXT, NULL_PTR);
+	XMALLOC0_ARRAY(version, keys);
+
+	/*
+	 * Random updates, with a small cache so that pages get evicted.
+	 */
+
+	bt = open_tree(path, O_CREAT | O_TRUNC | O_RDWR, cache);
+	update(bt, 4 * keys);
+	check(bt, "updates");
+
+	bptree_foreach_range_remove(bt, NULL, 0, NULL, 0, remove_odd, NULL);
+	check(bt, "range removal");
+
+	update(bt, keys);
+	g_assert(bptree_sync(bt) >= 0);
+	bptree_close(bt);
+
+	bt = open_tree(path, O_RDWR, cache);
+	check(bt, "re-opened");
+	bptree_close(bt);
+
+	/*
+	 * A tree modified after its last synchronization must be rolled back.
+	 */
+
+	crash(path, cache, 2 * keys);
+	g_assert_log(file_exists(jpath), "journal \"%s\" is missing", jpath);
+
+	bt = open_tree(path, O_RDWR, cache);
+	check(bt, "rolled back");
+	g_assert(bptree_rebuild(bt));
+	check(bt, "rebuilt");
+	bptree_close(bt);
+
+	g_assert_log(!file_exists(jpath), "journal \"%s\" not removed", jpath);
+
+	/*
+	 * Without its journal, an unclean tree is salvaged.
+	 */
+
+	crash(path, cache, 2 * keys);
+	g_assert_log(0 == unlink(jpath), "cannot unlink \"%s\": %m", jpath);
+
+	bt = open_tree(path, O_RDWR, cache);
+	ZERO(&sctx);
+	bptree_foreach_range(bt, NULL, 0, NULL, 0, salvage_check, &sctx);
+	g_assert_log(sctx.count == bptree_count(bt),
+		"salvaged tree has %zu keys, iterated over %zu",
+		bptree_count(bt), sctx.count);
+
+	printf("Salvaged %zu/%zu keys\n", sctx.count, present);
+
+	bptree_set_volatile(bt, TRUE);
+	bptree_close(bt);
+
+	g_assert_log(!file_exists(path), "tree \"%s\" not removed", path);
+
+	HFREE_NULL(path);
+	HFREE_NULL(jpath);
+	XFREE_NULL(version);
+
+	printf("All OK!\n");
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
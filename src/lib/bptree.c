@@ -0,0 +1,2474 @@
+/*
+ * Copyright (c) 2026 gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Disk-based B+tree with ordered iteration.
+ *
+ * SDBM hashes its keys, so finding all the keys within a range, for instance
+ * all the entries that expired before a given time, requires a traversal of
+ * the whole database.  This B+tree keeps its keys sorted instead, so that a
+ * range of keys can be iterated over by reading only the leaves covering
+ * that range.
+ *
+ * Keys are compared as byte strings, a shorter key sorting before the longer
+ * keys it is a prefix of.  Callers wishing to iterate over time ranges will
+ * therefore serialize the time in big-endian at the head of their keys.
+ *
+ * The tree is held in a single file made of fixed-size pages.  Page 0 holds
+ * the meta-data, all the other pages are either leaves, internal nodes,
+ * overflow pages holding large values or free pages.  Leaves are chained
+ * in both directions, in key order.
+ *
+ * Leaves and nodes are "slotted pages": an array of 16-bit offsets follows
+ * the page header and grows towards the end of the page, whilst the cells
+ * it points to are allocated from the end of the page, growing backwards.
+ * The offsets are kept sorted in key order, cells being laid out in any
+ * order and kept compact at all times.
+ *
+ * A full page is split in two, and the key separating the two halves is
+ * inserted in the parent node.  When inserting past the last key of the
+ * rightmost leaf, which is what happens when keys are monotonically
+ * increasing, the new key is moved alone to the new page, so that the tree
+ * fills its leaves completely.
+ *
+ * Pages are never merged: a leaf is freed when it becomes empty, which also
+ * removes its reference from the parent node, but partially filled pages
+ * are left alone.  Space is reclaimed by bptree_rebuild(), which rewrites the
+ * tree sequentially.
+ *
+ * Pages are held in a LRU cache and written back when they are evicted or
+ * when the tree is synchronized.  Since pages are updated in place, the tree
+ * is only consistent on disk after a synchronization, and the original image
+ * of each page is saved to a journal before the page is first overwritten.
+ * A synchronization writes the dirty pages and forces them to disk, then
+ * writes the meta-data flagging the tree as clean and forces it to disk, and
+ * only then discards the journal.  A tree re-opened with a journal is rolled
+ * back to its last synchronized state.  Should the journal have been lost,
+ * the keys held in the leaves of an unclean tree are salvaged into a new one.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "bptree.h"
+
+#include "bit_array.h"
+#include "compat_pio.h"
+#include "crc.h"
+#include "elist.h"
+#include "endian.h"
+#include "fd.h"
+#include "file.h"
+#include "halloc.h"
+#include "hevset.h"
+#include "hstrfn.h"
+#include "log.h"
+#include "misc.h"				/* For english_strerror() */
+#include "stringify.h"
+#include "vmm.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define BPT_PAGE		4096			/**< Page size */
+#define BPT_CACHE		64				/**< Default cache size, in pages */
+#define BPT_INLINE_MAX	(BPT_PAGE / 4)	/**< Max value length in leaves */
+#define BPT_MAXDEPTH	32				/**< Max tree depth */
+#define BPT_VERSION		1
+
+/*
+ * Meta-data page layout, all integers being stored in little-endian.
+ */
+#define BPT_M_MAGIC		0		/**< Magic number (32 bits) */
+#define BPT_M_VERSION	4		/**< Version (32 bits) */
+#define BPT_M_PAGESIZE	8		/**< Page size (32 bits) */
+#define BPT_M_ROOT		12		/**< Root page (32 bits) */
+#define BPT_M_FIRST		16		/**< First leaf (32 bits) */
+#define BPT_M_FREE		20		/**< Head of free page list (32 bits) */
+#define BPT_M_NPAGES	24		/**< Amount of pages in file (32 bits) */
+#define BPT_M_CLEAN		28		/**< Whether tree is synchronized (32 bits) */
+#define BPT_M_COUNT		32		/**< Amount of keys (64 bits) */
+#define BPT_M_LEN		40
+
+#define BPT_FILE_MAGIC	0x31545042	/**< "BPT1" */
+
+/*
+ * Journal layout, all integers being stored in little-endian.
+ *
+ * The header records the meta-data and the amount of pages of the tree as of
+ * the last synchronization.  It is followed by records holding the original
+ * image of the pages modified since then.
+ */
+#define BPT_J_MAGIC		0		/**< Magic number (32 bits) */
+#define BPT_J_NPAGES	4		/**< Amount of pages in tree (32 bits) */
+#define BPT_J_CRC		8		/**< CRC32 of saved meta-data (32 bits) */
+#define BPT_J_META		12		/**< Saved meta-data */
+#define BPT_J_LEN		(BPT_J_META + BPT_M_LEN)
+
+#define BPT_R_NUM		0		/**< Page number (32 bits) */
+#define BPT_R_CRC		4		/**< CRC32 of number and data (32 bits) */
+#define BPT_R_DATA		8		/**< Original page data */
+#define BPT_R_LEN		(BPT_R_DATA + BPT_PAGE)
+
+#define BPT_JOURNAL_MAGIC	0x314a5042	/**< "BPJ1" */
+
+/*
+ * Page header layout.
+ *
+ * The "link" field is the next leaf for leaves, the leftmost child for
+ * internal nodes, the next overflow page for overflow pages, and the next
+ * free page for free pages.  The "count" field is the amount of slots in
+ * leaves and nodes, the amount of data bytes in overflow pages.
+ */
+#define BPT_P_TYPE		0		/**< Page type (8 bits) */
+#define BPT_P_COUNT		2		/**< Amount of slots (16 bits) */
+#define BPT_P_START		4		/**< Offset of first cell (16 bits) */
+#define BPT_P_LINK		8		/**< Page link (32 bits) */
+#define BPT_P_PREV		12		/**< Previous leaf (32 bits) */
+#define BPT_P_SLOTS		16		/**< Start of slot array */
+
+#define BPT_OVFL_DATA	(BPT_PAGE - BPT_P_SLOTS)	/**< Overflow data size */
+
+enum bpt_page_type {
+	BPT_LEAF = 1,
+	BPT_NODE = 2,
+	BPT_OVFL = 3,
+	BPT_FREE = 4
+};
+
+/*
+ * Leaf cells are:
+ *
+ *    0  key length (8 bits)
+ *    1  flags (8 bits)
+ *    2  length of the value held in the cell (16 bits)
+ *    4  key bytes, followed by the value
+ *
+ * When the value is held in overflow pages, the cell holds its total length
+ * and the number of the first overflow page, as two 32-bit integers.
+ *
+ * Node cells are:
+ *
+ *    0  key length (8 bits)
+ *    1  unused (8 bits)
+ *    2  child page, holding keys greater than or equal to the key (32 bits)
+ *    6  key bytes
+ */
+#define BPT_LEAF_HDR	4
+#define BPT_NODE_HDR	6
+#define BPT_CELL_OVFL	(1 << 0)	/**< Value is held in overflow pages */
+
+#define BPT_MAXCELLS	((BPT_PAGE - BPT_P_SLOTS) / (BPT_LEAF_HDR + 2) + 2)
+
+enum bptree_magic { BPTREE_MAGIC = 0x6d2c07e5 };
+
+/**
+ * A cached page.
+ */
+struct bpt_page {
+	uint32 num;					/**< Page number (hashing key) */
+	link_t lnk;					/**< Links in LRU list */
+	char *data;					/**< Page data */
+	uint dirty:1;				/**< Whether page needs to be written */
+};
+
+/**
+ * Path followed from the root down to a leaf.
+ *
+ * For each internal node, we record the index of the cell whose child we
+ * followed, -1 meaning the leftmost child.
+ */
+struct bpt_path {
+	uint32 num[BPT_MAXDEPTH];	/**< Page numbers, root first */
+	int idx[BPT_MAXDEPTH];		/**< Child index within nodes */
+	uint depth;					/**< Amount of pages in path */
+};
+
+/**
+ * A B+tree.
+ */
+struct bptree {
+	enum bptree_magic magic;
+	char *name;					/**< Name of the tree, for logs */
+	char *path;					/**< Path of the tree file */
+	int fd;						/**< Opened tree file */
+	hevset_t *pages;			/**< Cached pages, by number */
+	elist_t lru;				/**< Cached pages, in LRU order */
+	long cache_max;				/**< Max amount of cached pages */
+	uint32 root;				/**< Root page */
+	uint32 first;				/**< First leaf */
+	uint32 freelist;			/**< Head of free page list */
+	uint32 npages;				/**< Amount of pages in file */
+	uint64 count;				/**< Amount of keys */
+	char *vbuf;					/**< Buffer for returned values */
+	size_t vbufsize;			/**< Size of value buffer */
+	char *kbuf;					/**< Buffer for keys to remove */
+	size_t kbufsize;			/**< Size of key buffer */
+	char *split;				/**< Scratch buffer for page splits */
+	char *jpath;				/**< Path of the journal file */
+	char *jbuf;					/**< Buffer for journal records */
+	bit_array_t *journaled;		/**< Pages saved to the journal */
+	size_t jbits;				/**< Amount of bits in journaled[] */
+	fileoffset_t jsize;			/**< Journal size, 0 if not started */
+	uint32 jpages;				/**< Amount of pages at last sync */
+	int jfd;					/**< Opened journal file, -1 if none */
+	uint ioerr:1;				/**< Whether an I/O error occurred */
+	uint clean:1;				/**< Whether tree is synchronized on disk */
+	uint wdelay:1;				/**< Whether writes are deferred */
+	uint is_volatile:1;			/**< Whether tree is discarded at close */
+	uint jsync:1;				/**< Whether journal must be synced */
+};
+
+static inline void
+bptree_check(const struct bptree * const bt)
+{
+	g_assert(bt != NULL);
+	g_assert(BPTREE_MAGIC == bt->magic);
+}
+
+/*
+ * Page accessors.
+ */
+
+static inline uint
+bpt_type(const char *data)
+{
+	return (uchar) data[BPT_P_TYPE];
+}
+
+static inline uint
+bpt_nslots(const char *data)
+{
+	return peek_le16(&data[BPT_P_COUNT]);
+}
+
+static inline uint
+bpt_start(const char *data)
+{
+	return peek_le16(&data[BPT_P_START]);
+}
+
+static inline uint32
+bpt_link(const char *data)
+{
+	return peek_le32(&data[BPT_P_LINK]);
+}
+
+static inline uint32
+bpt_prev(const char *data)
+{
+	return peek_le32(&data[BPT_P_PREV]);
+}
+
+static inline char *
+bpt_cell(const char *data, uint i)
+{
+	return deconstify_char(data) + peek_le16(&data[BPT_P_SLOTS + 2 * i]);
+}
+
+static inline uint
+bpt_cell_klen(const char *cell)
+{
+	return (uchar) cell[0];
+}
+
+static inline const char *
+bpt_cell_key(const char *data, const char *cell)
+{
+	return cell + (BPT_LEAF == bpt_type(data) ? BPT_LEAF_HDR : BPT_NODE_HDR);
+}
+
+static inline uint32
+bpt_cell_child(const char *cell)
+{
+	return peek_le32(&cell[2]);
+}
+
+static inline size_t
+bpt_cell_size(const char *data, const char *cell)
+{
+	if (BPT_LEAF == bpt_type(data))
+		return BPT_LEAF_HDR + bpt_cell_klen(cell) + peek_le16(&cell[2]);
+	else
+		return BPT_NODE_HDR + bpt_cell_klen(cell);
+}
+
+/**
+ * @return child page for the index recorded in a path.
+ */
+static inline uint32
+bpt_child(const char *data, int idx)
+{
+	return -1 == idx ? bpt_link(data) : bpt_cell_child(bpt_cell(data, idx));
+}
+
+/**
+ * Compare two keys.
+ */
+static inline int
+bpt_keycmp(const void *a, size_t alen, const void *b, size_t blen)
+{
+	int c = memcmp(a, b, MIN(alen, blen));
+	return 0 != c ? c : CMP(alen, blen);
+}
+
+/**
+ * Locate the first slot whose key is greater than or equal to the given key.
+ *
+ * @param data		the page data
+ * @param key		the key to look for
+ * @param klen		the key length
+ * @param found		set to whether the key was found at the returned slot
+ *
+ * @return the index of the slot.
+ */
+static uint
+bpt_search(const char *data, const void *key, size_t klen, bool *found)
+{
+	uint lo = 0, hi = bpt_nslots(data);
+
+	*found = FALSE;
+
+	while (lo < hi) {
+		uint mid = lo + (hi - lo) / 2;
+		const char *c = bpt_cell(data, mid);
+		int r = bpt_keycmp(bpt_cell_key(data, c), bpt_cell_klen(c), key, klen);
+
+		if (r < 0) {
+			lo = mid + 1;
+		} else {
+			if (0 == r)
+				*found = TRUE;
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/**
+ * Record an I/O error.
+ */
+static void
+bpt_ioerr(bptree_t *bt, const char *what, uint32 num)
+{
+	int saved = errno;
+
+	s_warning("BPTREE \"%s\" cannot %s page #%u of \"%s\": %s",
+		bt->name, what, num, bt->path, english_strerror(saved));
+
+	bt->ioerr = TRUE;
+	errno = 0 == saved ? EIO : saved;
+}
+
+/**
+ * Record an I/O error on the journal.
+ */
+static void
+bpt_jerr(bptree_t *bt, const char *what)
+{
+	int saved = errno;
+
+	s_warning("BPTREE \"%s\" cannot %s journal \"%s\": %s",
+		bt->name, what, bt->jpath, english_strerror(saved));
+
+	bt->ioerr = TRUE;
+	errno = 0 == saved ? EIO : saved;
+}
+
+/**
+ * Fill the meta-data buffer from the current tree state.
+ */
+static void
+bpt_meta_fill(const bptree_t *bt, char meta[BPT_M_LEN], bool clean)
+{
+	poke_le32(&meta[BPT_M_MAGIC], BPT_FILE_MAGIC);
+	poke_le32(&meta[BPT_M_VERSION], BPT_VERSION);
+	poke_le32(&meta[BPT_M_PAGESIZE], BPT_PAGE);
+	poke_le32(&meta[BPT_M_ROOT], bt->root);
+	poke_le32(&meta[BPT_M_FIRST], bt->first);
+	poke_le32(&meta[BPT_M_FREE], bt->freelist);
+	poke_le32(&meta[BPT_M_NPAGES], bt->npages);
+	poke_le32(&meta[BPT_M_CLEAN], clean ? 1 : 0);
+	poke_le64(&meta[BPT_M_COUNT], bt->count);
+}
+
+/**
+ * @return the journal record buffer.
+ */
+static char *
+bpt_jbuf(bptree_t *bt)
+{
+	if (NULL == bt->jbuf)
+		bt->jbuf = halloc(BPT_R_LEN);
+
+	return bt->jbuf;
+}
+
+/**
+ * Compute the checksum of a journal record.
+ */
+static uint32
+bpt_jcrc(const char *rec)
+{
+	uint32 crc = crc32_update(0, &rec[BPT_R_NUM], 4);
+	return crc32_update(crc, &rec[BPT_R_DATA], BPT_PAGE);
+}
+
+/**
+ * Start the journal, recording the meta-data of the tree which must be
+ * clean on disk at this point.
+ *
+ * The journal header is forced to disk before returning, so that the tree
+ * can be rolled back should any page be overwritten afterwards.
+ *
+ * @return TRUE on success.
+ */
+static bool
+bpt_journal_begin(bptree_t *bt)
+{
+	char hdr[BPT_J_LEN];
+
+	g_assert(0 == bt->jsize);
+
+	if (-1 == bt->jfd || bt->is_volatile)
+		return TRUE;
+
+	bpt_meta_fill(bt, &hdr[BPT_J_META], TRUE);
+	poke_le32(&hdr[BPT_J_MAGIC], BPT_JOURNAL_MAGIC);
+	poke_le32(&hdr[BPT_J_NPAGES], bt->npages);
+	poke_le32(&hdr[BPT_J_CRC], crc32_update(0, &hdr[BPT_J_META], BPT_M_LEN));
+
+	/*
+	 * Truncating first ensures no record from a previous journal that we
+	 * failed to discard can be taken as belonging to this one.
+	 */
+
+	if (
+		-1 == ftruncate(bt->jfd, 0) ||
+		sizeof hdr != compat_pwrite(bt->jfd, hdr, sizeof hdr, 0) ||
+		-1 == fd_fdatasync(bt->jfd)
+	) {
+		bpt_jerr(bt, "start");
+		return FALSE;
+	}
+
+	if (bt->npages > bt->jbits) {
+		bit_array_resize(&bt->journaled, bt->jbits, bt->npages);
+		bt->jbits = bt->npages;
+	}
+	bit_array_clear_range(bt->journaled, 0, bt->jbits - 1);
+
+	bt->jsize = sizeof hdr;
+	bt->jpages = bt->npages;
+
+	return TRUE;
+}
+
+/**
+ * Save the original image of a page to the journal, unless the page was
+ * allocated since the last synchronization or was already saved.
+ *
+ * The journal is only synchronized by bpt_journal_sync(), which must be
+ * called before the page is overwritten.
+ *
+ * @return TRUE on success.
+ */
+static bool
+bpt_journal_save(bptree_t *bt, uint32 num)
+{
+	char *rec;
+	ssize_t r;
+
+	if (0 == bt->jsize || num >= bt->jpages)
+		return TRUE;
+
+	if (bit_array_get(bt->journaled, num))
+		return TRUE;
+
+	rec = bpt_jbuf(bt);
+	r = compat_pread(bt->fd, &rec[BPT_R_DATA], BPT_PAGE,
+			(fileoffset_t) num * BPT_PAGE);
+
+	if (BPT_PAGE != r) {
+		if (r >= 0)
+			errno = EIO;
+		bpt_ioerr(bt, "save", num);
+		return FALSE;
+	}
+
+	poke_le32(&rec[BPT_R_NUM], num);
+	poke_le32(&rec[BPT_R_CRC], bpt_jcrc(rec));
+
+	if (BPT_R_LEN != compat_pwrite(bt->jfd, rec, BPT_R_LEN, bt->jsize)) {
+		bpt_jerr(bt, "append to");
+		return FALSE;
+	}
+
+	bit_array_set(bt->journaled, num);
+	bt->jsize += BPT_R_LEN;
+	bt->jsync = TRUE;
+
+	return TRUE;
+}
+
+/**
+ * Force the saved page images to disk.
+ *
+ * @return TRUE on success.
+ */
+static bool
+bpt_journal_sync(bptree_t *bt)
+{
+	if (!bt->jsync)
+		return TRUE;
+
+	if (-1 == fd_fdatasync(bt->jfd)) {
+		bpt_jerr(bt, "sync");
+		return FALSE;
+	}
+
+	bt->jsync = FALSE;
+	return TRUE;
+}
+
+/**
+ * Empty the journal file.
+ */
+static void
+bpt_journal_discard(bptree_t *bt)
+{
+	if (-1 == bt->jfd)
+		return;
+
+	if (-1 == ftruncate(bt->jfd, 0) || -1 == fd_fdatasync(bt->jfd))
+		bpt_jerr(bt, "discard");
+
+	bt->jsize = 0;
+	bt->jsync = FALSE;
+}
+
+/**
+ * Discard the journal, once the tree is clean on disk.
+ */
+static void
+bpt_journal_end(bptree_t *bt)
+{
+	if (0 != bt->jsize)
+		bpt_journal_discard(bt);
+}
+
+/**
+ * Roll the tree back to its last synchronized state, using the page images
+ * saved in the journal.
+ *
+ * Records are appended and forced to disk before the pages they save are
+ * overwritten, so an incomplete or corrupted record can only be found at
+ * the end of the journal and belongs to a page that was not overwritten.
+ *
+ * @return TRUE on success, FALSE on error with errno set.
+ */
+static bool
+bpt_journal_rollback(bptree_t *bt)
+{
+	char hdr[BPT_J_LEN];
+	filestat_t buf;
+	fileoffset_t off;
+	uint32 npages, num = 0, n = 0;
+	char *rec;
+
+	if (-1 == bt->jfd)
+		return TRUE;
+
+	if (-1 == fstat(bt->jfd, &buf)) {
+		bpt_jerr(bt, "stat");
+		return FALSE;
+	}
+
+	if (
+		buf.st_size < BPT_J_LEN ||
+		sizeof hdr != compat_pread(bt->jfd, hdr, sizeof hdr, 0) ||
+		BPT_JOURNAL_MAGIC != peek_le32(&hdr[BPT_J_MAGIC]) ||
+		peek_le32(&hdr[BPT_J_CRC]) !=
+			crc32_update(0, &hdr[BPT_J_META], BPT_M_LEN)
+	)
+		goto done;		/* Journal was not started, tree is untouched */
+
+	npages = peek_le32(&hdr[BPT_J_NPAGES]);
+	rec = bpt_jbuf(bt);
+
+	for (
+		off = BPT_J_LEN;
+		off + BPT_R_LEN <= buf.st_size;
+		off += BPT_R_LEN
+	) {
+		if (BPT_R_LEN != compat_pread(bt->jfd, rec, BPT_R_LEN, off))
+			break;
+
+		num = peek_le32(&rec[BPT_R_NUM]);
+		if (
+			0 == num || num >= npages ||
+			peek_le32(&rec[BPT_R_CRC]) != bpt_jcrc(rec)
+		)
+			break;
+
+		if (
+			BPT_PAGE != compat_pwrite(bt->fd, &rec[BPT_R_DATA], BPT_PAGE,
+				(fileoffset_t) num * BPT_PAGE)
+		)
+			goto failed;
+
+		n++;
+	}
+
+	num = 0;
+	if (
+		BPT_M_LEN != compat_pwrite(bt->fd, &hdr[BPT_J_META], BPT_M_LEN, 0) ||
+		-1 == ftruncate(bt->fd, (fileoffset_t) npages * BPT_PAGE) ||
+		-1 == fd_fdatasync(bt->fd)
+	)
+		goto failed;
+
+	s_message("BPTREE \"%s\" rolled back %u page%s in \"%s\"",
+		bt->name, n, plural(n), bt->path);
+
+	/* FALL THROUGH */
+
+done:
+	if (0 != buf.st_size && (-1 == ftruncate(bt->jfd, 0) ||
+		-1 == fd_fdatasync(bt->jfd))
+	) {
+		bpt_jerr(bt, "discard");
+		return FALSE;
+	}
+
+	return TRUE;
+
+failed:
+	bpt_ioerr(bt, "roll back", num);
+	return FALSE;
+}
+
+/**
+ * Write a page to disk, saving its original image to the journal first.
+ *
+ * @return TRUE on success.
+ */
+static bool
+bpt_page_write(bptree_t *bt, struct bpt_page *pg)
+{
+	ssize_t w;
+
+	if (!bpt_journal_save(bt, pg->num) || !bpt_journal_sync(bt))
+		return FALSE;
+
+	w = compat_pwrite(bt->fd, pg->data, BPT_PAGE,
+			(fileoffset_t) pg->num * BPT_PAGE);
+
+	if (BPT_PAGE != w) {
+		if (w >= 0)
+			errno = ENOSPC;
+		bpt_ioerr(bt, "write", pg->num);
+		return FALSE;
+	}
+
+	pg->dirty = FALSE;
+	return TRUE;
+}
+
+/**
+ * Remove page from the cache, without writing it.
+ */
+static void
+bpt_page_discard(bptree_t *bt, struct bpt_page *pg)
+{
+	hevset_remove(bt->pages, &pg->num);
+	elist_remove(&bt->lru, pg);
+	vmm_free(pg->data, BPT_PAGE);
+	WFREE(pg);
+}
+
+/**
+ * Insert a new page in the cache.
+ */
+static struct bpt_page *
+bpt_page_alloc(bptree_t *bt, uint32 num)
+{
+	struct bpt_page *pg;
+
+	WALLOC0(pg);
+	pg->num = num;
+	pg->data = vmm_alloc(BPT_PAGE);
+	hevset_insert(bt->pages, pg);
+	elist_prepend(&bt->lru, pg);
+
+	return pg;
+}
+
+/**
+ * Get page from the cache, reading it from disk if needed.
+ *
+ * Pages are only evicted from the cache by bpt_trim(), at the end of the
+ * public operations, so the returned page remains valid until then.
+ *
+ * @return the page, NULL on error.
+ */
+static struct bpt_page *
+bpt_page_get(bptree_t *bt, uint32 num)
+{
+	struct bpt_page *pg;
+	ssize_t r;
+
+	pg = hevset_lookup(bt->pages, &num);
+	if (pg != NULL) {
+		elist_moveto_head(&bt->lru, pg);
+		return pg;
+	}
+
+	if G_UNLIKELY(0 == num || num >= bt->npages) {
+		errno = EFAULT;
+		bpt_ioerr(bt, "access", num);
+		return NULL;
+	}
+
+	pg = bpt_page_alloc(bt, num);
+	r = compat_pread(bt->fd, pg->data, BPT_PAGE, (fileoffset_t) num * BPT_PAGE);
+
+	if (BPT_PAGE != r) {
+		if (r >= 0)
+			errno = EIO;
+		bpt_ioerr(bt, "read", num);
+		bpt_page_discard(bt, pg);
+		return NULL;
+	}
+
+	return pg;
+}
+
+/**
+ * Record that the tree is going to be modified.
+ *
+ * The first modification since the last synchronization starts the journal
+ * and flags the tree as unclean on disk.
+ */
+static void
+bpt_modified(bptree_t *bt)
+{
+	char meta[BPT_M_LEN];
+
+	if (!bt->clean)
+		return;
+
+	bt->clean = FALSE;
+	bpt_journal_begin(bt);		/* Error already logged */
+
+	/*
+	 * Only the "clean" field is rewritten: the remaining meta-data will be
+	 * updated at the next synchronization.
+	 */
+
+	poke_le32(meta, 0);
+	if (4 != compat_pwrite(bt->fd, meta, 4, BPT_M_CLEAN))
+		bpt_ioerr(bt, "mark", 0);
+}
+
+/**
+ * Allocate a new page of the given type, marked dirty.
+ *
+ * @return the page, NULL on error.
+ */
+static struct bpt_page *
+bpt_page_new(bptree_t *bt, enum bpt_page_type type)
+{
+	struct bpt_page *pg;
+
+	if (bt->freelist != 0) {
+		pg = bpt_page_get(bt, bt->freelist);
+		if (NULL == pg)
+			return NULL;
+		if G_UNLIKELY(BPT_FREE != bpt_type(pg->data)) {
+			errno = EFAULT;
+			bpt_ioerr(bt, "allocate", pg->num);
+			return NULL;
+		}
+		bt->freelist = bpt_link(pg->data);
+	} else {
+		if G_UNLIKELY(MAX_INT_VAL(uint32) == bt->npages) {
+			errno = EFBIG;
+			return NULL;
+		}
+		pg = bpt_page_alloc(bt, bt->npages++);
+	}
+
+	memset(pg->data, 0, BPT_PAGE);
+	pg->data[BPT_P_TYPE] = type;
+	poke_le16(&pg->data[BPT_P_START], BPT_PAGE);
+	pg->dirty = TRUE;
+
+	return pg;
+}
+
+/**
+ * Put page back to the free list.
+ */
+static void
+bpt_page_free(bptree_t *bt, struct bpt_page *pg)
+{
+	memset(pg->data, 0, BPT_P_SLOTS);
+	pg->data[BPT_P_TYPE] = BPT_FREE;
+	poke_le32(&pg->data[BPT_P_LINK], bt->freelist);
+	pg->dirty = TRUE;
+	bt->freelist = pg->num;
+}
+
+/**
+ * Write the meta-data page.
+ *
+ * @return TRUE on success.
+ */
+static bool
+bpt_meta_write(bptree_t *bt, bool clean)
+{
+	char meta[BPT_M_LEN];
+
+	bpt_meta_fill(bt, meta, clean);
+
+	if (sizeof meta != compat_pwrite(bt->fd, meta, sizeof meta, 0)) {
+		bpt_ioerr(bt, "write", 0);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Force the tree file to disk, unless the tree is volatile.
+ *
+ * @return TRUE on success.
+ */
+static bool
+bpt_fdatasync(bptree_t *bt)
+{
+	if (bt->is_volatile)
+		return TRUE;
+
+	if (-1 == fd_fdatasync(bt->fd)) {
+		s_warning("BPTREE \"%s\" cannot sync \"%s\": %m", bt->name, bt->path);
+		bt->ioerr = TRUE;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Write all the dirty pages and flag the tree as clean on disk.
+ *
+ * The pages must be on disk before the meta-data says the tree is clean,
+ * and the meta-data must be on disk before the journal is discarded.
+ *
+ * @return the amount of pages written, -1 on error.
+ */
+static ssize_t
+bpt_flush(bptree_t *bt)
+{
+	struct bpt_page *pg;
+	ssize_t n = 0;
+	bool ok = TRUE;
+
+	if (bt->clean)
+		return 0;
+
+	/*
+	 * Save all the original images first, so that the journal only needs
+	 * to be synchronized once.
+	 */
+
+	ELIST_FOREACH_DATA(&bt->lru, pg) {
+		if (pg->dirty && !bpt_journal_save(bt, pg->num))
+			return -1;
+	}
+
+	ELIST_FOREACH_DATA(&bt->lru, pg) {
+		if (pg->dirty) {
+			if (bpt_page_write(bt, pg))
+				n++;
+			else
+				ok = FALSE;
+		}
+	}
+
+	if (!ok || !bpt_fdatasync(bt))
+		return -1;
+
+	if (!bpt_meta_write(bt, TRUE) || !bpt_fdatasync(bt))
+		return -1;
+
+	bt->clean = TRUE;
+	bpt_journal_end(bt);
+
+	return n;
+}
+
+/**
+ * Trim the cache down to its maximum size, writing back evicted dirty pages.
+ *
+ * This is called at the end of each public operation, when no page is
+ * being referenced any more.
+ */
+static void
+bpt_trim(bptree_t *bt)
+{
+	struct bpt_page *pg;
+	long excess;
+
+	if (!bt->wdelay)
+		bpt_flush(bt);
+
+	excess = elist_count(&bt->lru) - bt->cache_max;
+	if (excess <= 0)
+		return;
+
+	/*
+	 * Save the original images of all the pages we are about to evict
+	 * before writing any of them, to synchronize the journal only once.
+	 */
+
+	for (
+		pg = elist_tail(&bt->lru);
+		pg != NULL && excess-- > 0;
+		pg = elist_prev_data(&bt->lru, pg)
+	) {
+		if (pg->dirty)
+			bpt_journal_save(bt, pg->num);	/* Error already logged */
+	}
+
+	while (elist_count(&bt->lru) > UNSIGNED(bt->cache_max)) {
+		pg = elist_tail(&bt->lru);
+
+		if (pg->dirty)
+			bpt_page_write(bt, pg);		/* Error already logged */
+		bpt_page_discard(bt, pg);
+	}
+}
+
+/**
+ * Discard all the cached pages, without writing them.
+ */
+static void
+bpt_discard_all(bptree_t *bt)
+{
+	struct bpt_page *pg;
+
+	while (NULL != (pg = elist_head(&bt->lru)))
+		bpt_page_discard(bt, pg);
+}
+
+/**
+ * Reset the tree to an empty tree, truncating its file.
+ *
+ * @return TRUE on success.
+ */
+static bool
+bpt_init(bptree_t *bt)
+{
+	bpt_discard_all(bt);
+	bpt_journal_discard(bt);	/* Nothing to roll back to any more */
+
+	if (-1 == ftruncate(bt->fd, 0)) {
+		s_warning("BPTREE \"%s\" cannot truncate \"%s\": %m",
+			bt->name, bt->path);
+		return FALSE;
+	}
+
+	bt->npages = 1;			/* The meta-data page */
+	bt->freelist = 0;
+	bt->count = 0;
+	bt->clean = FALSE;
+
+	bt->root = bt->first = bpt_page_new(bt, BPT_LEAF)->num;
+
+	return -1 != bpt_flush(bt);
+}
+
+static bool bpt_salvage(bptree_t *bt, const filestat_t *buf);
+
+/**
+ * Load the meta-data page.
+ *
+ * @return TRUE if the tree can be used as-is.
+ */
+static bool
+bpt_load(bptree_t *bt)
+{
+	char meta[BPT_M_LEN];
+	filestat_t buf;
+	const char *problem = NULL;
+
+	if (-1 == fstat(bt->fd, &buf)) {
+		s_warning("BPTREE \"%s\" cannot stat \"%s\": %m", bt->name, bt->path);
+		return FALSE;
+	}
+
+	if (0 == buf.st_size)
+		return FALSE;
+
+	if (sizeof meta != compat_pread(bt->fd, meta, sizeof meta, 0)) {
+		problem = "cannot read meta-data";
+		goto bad;
+	}
+
+	if (
+		BPT_FILE_MAGIC != peek_le32(&meta[BPT_M_MAGIC]) ||
+		BPT_VERSION != peek_le32(&meta[BPT_M_VERSION]) ||
+		BPT_PAGE != peek_le32(&meta[BPT_M_PAGESIZE])
+	) {
+		problem = "bad meta-data";
+		goto bad;
+	}
+
+	/*
+	 * An unclean tree should have been rolled back using its journal.
+	 * If we get here, the journal was lost and the best we can do is to
+	 * salvage the keys held in the leaves.
+	 */
+
+	if (0 == peek_le32(&meta[BPT_M_CLEAN])) {
+		s_warning("BPTREE \"%s\" was not synchronized and has no journal "
+			"in \"%s\", salvaging its keys", bt->name, bt->path);
+		return bpt_salvage(bt, &buf);
+	}
+
+	bt->root = peek_le32(&meta[BPT_M_ROOT]);
+	bt->first = peek_le32(&meta[BPT_M_FIRST]);
+	bt->freelist = peek_le32(&meta[BPT_M_FREE]);
+	bt->npages = peek_le32(&meta[BPT_M_NPAGES]);
+	bt->count = peek_le64(&meta[BPT_M_COUNT]);
+	bt->clean = TRUE;
+
+	if (
+		(fileoffset_t) bt->npages * BPT_PAGE != buf.st_size ||
+		0 == bt->root || bt->root >= bt->npages ||
+		0 == bt->first || bt->first >= bt->npages ||
+		bt->freelist >= bt->npages
+	) {
+		problem = "inconsistent meta-data";
+		goto bad;
+	}
+
+	return TRUE;
+
+bad:
+	s_warning("BPTREE \"%s\" %s in \"%s\", discarding %s byte%s",
+		bt->name, problem, bt->path,
+		filesize_to_string(buf.st_size), plural(buf.st_size));
+
+	return FALSE;
+}
+
+/**
+ * Open a B+tree, creating it if needed.
+ *
+ * A tree that was not synchronized before being closed is rolled back to
+ * its last synchronized state.
+ *
+ * @param name		name of the tree, for logs (may be NULL)
+ * @param path		path of the tree file
+ * @param flags		opening flags
+ * @param mode		file permissions, if the tree is created
+ *
+ * @return a new tree object, NULL on error with errno set.
+ */
+bptree_t *
+bptree_open(const char *name, const char *path, int flags, int mode)
+{
+	bptree_t *bt;
+	struct bpt_page dummy;
+	int fd;
+
+	g_assert(path != NULL);
+
+	fd = file_open(path, flags, mode);
+	if (-1 == fd)
+		return NULL;
+
+	WALLOC0(bt);
+	bt->magic = BPTREE_MAGIC;
+	bt->name = h_strdup(NULL == name ? path : name);
+	bt->path = h_strdup(path);
+	bt->fd = fd;
+	bt->cache_max = BPT_CACHE;
+	bt->wdelay = TRUE;
+	bt->pages = hevset_create(offsetof(struct bpt_page, num),
+		HASH_KEY_FIXED, sizeof(dummy.num));
+	elist_init(&bt->lru, offsetof(struct bpt_page, lnk));
+	bt->split = halloc(2 * BPT_PAGE);
+	bt->jpath = h_strconcat(path, BPTREE_JEXT, NULL_PTR);
+	bt->jfd = file_open(bt->jpath, O_CREAT | O_RDWR | (flags & O_TRUNC), mode);
+
+	if (-1 == bt->jfd) {
+		s_warning("BPTREE \"%s\" cannot open journal \"%s\", "
+			"tree will not be recoverable after a crash: %m",
+			bt->name, bt->jpath);
+	}
+
+	if (!(flags & O_TRUNC) && !bpt_journal_rollback(bt)) {
+		int saved = errno;
+		fd_close(&bt->jfd);		/* Keep journal for next time */
+		bt->clean = TRUE;		/* Nothing to flush */
+		bptree_close(bt);
+		errno = saved;
+		return NULL;
+	}
+
+	if ((flags & O_TRUNC) || !bpt_load(bt)) {
+		if (!bpt_init(bt)) {
+			int saved = errno;
+			bt->clean = TRUE;		/* Nothing to flush */
+			bptree_close(bt);
+			errno = saved;
+			return NULL;
+		}
+	}
+
+	return bt;
+}
+
+/**
+ * @return the name of the tree.
+ */
+const char *
+bptree_name(const bptree_t *bt)
+{
+	bptree_check(bt);
+
+	return bt->name;
+}
+
+/**
+ * Change the name of the tree, used in logs.
+ */
+void
+bptree_set_name(bptree_t *bt, const char *name)
+{
+	bptree_check(bt);
+	g_assert(name != NULL);
+
+	HFREE_NULL(bt->name);
+	bt->name = h_strdup(name);
+}
+
+/**
+ * @return amount of keys held in the tree.
+ */
+size_t
+bptree_count(const bptree_t *bt)
+{
+	bptree_check(bt);
+
+	return bt->count;
+}
+
+/**
+ * Make sure the value buffer can hold the given amount of bytes.
+ */
+static void
+bpt_vbuf_grow(bptree_t *bt, size_t len)
+{
+	if (len > bt->vbufsize || NULL == bt->vbuf) {
+		bt->vbufsize = MAX(len, 64);
+		bt->vbuf = hrealloc(bt->vbuf, bt->vbufsize);
+	}
+}
+
+/**
+ * Read value held in a leaf cell.
+ *
+ * @return pointer to the value, NULL on error.
+ */
+static const void *
+bpt_value(bptree_t *bt, const char *cell, size_t *vlen)
+{
+	const char *v = cell + BPT_LEAF_HDR + bpt_cell_klen(cell);
+	uint32 num;
+	size_t len, off = 0;
+
+	if (0 == (cell[1] & BPT_CELL_OVFL)) {
+		*vlen = peek_le16(&cell[2]);
+		return v;
+	}
+
+	len = peek_le32(v);
+	num = peek_le32(&v[4]);
+	bpt_vbuf_grow(bt, len);
+
+	while (off < len) {
+		struct bpt_page *pg = bpt_page_get(bt, num);
+		size_t n;
+
+		if (NULL == pg)
+			return NULL;
+
+		n = bpt_nslots(pg->data);
+		if G_UNLIKELY(
+			BPT_OVFL != bpt_type(pg->data) || 0 == n || n > len - off
+		) {
+			errno = EFAULT;
+			bpt_ioerr(bt, "use overflow", num);
+			return NULL;
+		}
+
+		memcpy(&bt->vbuf[off], &pg->data[BPT_P_SLOTS], n);
+		off += n;
+		num = bpt_link(pg->data);
+	}
+
+	*vlen = len;
+	return bt->vbuf;
+}
+
+/**
+ * Write a large value to a chain of overflow pages.
+ *
+ * @return the first overflow page, 0 on error.
+ */
+static uint32
+bpt_ovfl_store(bptree_t *bt, const void *value, size_t vlen)
+{
+	struct bpt_page *prev = NULL;
+	uint32 first = 0;
+	size_t off = 0;
+
+	while (off < vlen) {
+		struct bpt_page *pg = bpt_page_new(bt, BPT_OVFL);
+		size_t n = MIN(vlen - off, BPT_OVFL_DATA);
+
+		if (NULL == pg)
+			return 0;		/* Pages already allocated are leaked */
+
+		if (NULL == prev)
+			first = pg->num;
+		else
+			poke_le32(&prev->data[BPT_P_LINK], pg->num);
+
+		poke_le16(&pg->data[BPT_P_COUNT], n);
+		memcpy(&pg->data[BPT_P_SLOTS], const_ptr_add_offset(value, off), n);
+		off += n;
+		prev = pg;
+	}
+
+	return first;
+}
+
+/**
+ * Free the overflow pages referenced by a leaf cell, if any.
+ */
+static void
+bpt_ovfl_free(bptree_t *bt, const char *cell)
+{
+	const char *v = cell + BPT_LEAF_HDR + bpt_cell_klen(cell);
+	uint32 num;
+
+	if (0 == (cell[1] & BPT_CELL_OVFL))
+		return;
+
+	num = peek_le32(&v[4]);
+
+	while (num != 0) {
+		struct bpt_page *pg = bpt_page_get(bt, num);
+
+		if (NULL == pg || BPT_OVFL != bpt_type(pg->data))
+			return;
+
+		num = bpt_link(pg->data);
+		bpt_page_free(bt, pg);
+	}
+}
+
+/**
+ * Walk down the tree to the leaf that could hold the key.
+ *
+ * @param bt		the B+tree
+ * @param key		the key
+ * @param klen		key length
+ * @param path		if non-NULL, filled with the path followed
+ *
+ * @return the leaf page, NULL on error.
+ */
+static struct bpt_page *
+bpt_descend(bptree_t *bt, const void *key, size_t klen, struct bpt_path *path)
+{
+	uint32 num = bt->root;
+	uint depth = 0;
+
+	for (;;) {
+		struct bpt_page *pg = bpt_page_get(bt, num);
+		bool found;
+		uint i;
+		int idx;
+
+		if (NULL == pg)
+			return NULL;
+
+		if (path != NULL)
+			path->num[depth] = num;
+
+		if (BPT_LEAF == bpt_type(pg->data)) {
+			if (path != NULL)
+				path->depth = depth + 1;
+			return pg;
+		}
+
+		if G_UNLIKELY(
+			BPT_NODE != bpt_type(pg->data) || depth + 1 >= BPT_MAXDEPTH
+		) {
+			errno = EFAULT;
+			bpt_ioerr(bt, "descend through", num);
+			return NULL;
+		}
+
+		i = bpt_search(pg->data, key, klen, &found);
+		idx = found ? (int) i : (int) i - 1;
+
+		if (path != NULL)
+			path->idx[depth] = idx;
+
+		num = bpt_child(pg->data, idx);
+		depth++;
+	}
+}
+
+/**
+ * @return whether a cell of the given size fits in the page.
+ */
+static inline bool
+bpt_page_fits(const char *data, size_t csize)
+{
+	size_t used = BPT_P_SLOTS + 2 * bpt_nslots(data);
+	return used + 2 + csize <= bpt_start(data);
+}
+
+/**
+ * Insert cell in page at the given slot, the page having enough room.
+ */
+static void
+bpt_page_insert(char *data, uint pos, const char *cell, size_t csize)
+{
+	uint n = bpt_nslots(data);
+	uint start = bpt_start(data) - csize;
+	char *slot = &data[BPT_P_SLOTS + 2 * pos];
+
+	g_assert(pos <= n);
+	g_assert(bpt_page_fits(data, csize));
+
+	memcpy(&data[start], cell, csize);
+	memmove(slot + 2, slot, 2 * (n - pos));
+	poke_le16(slot, start);
+	poke_le16(&data[BPT_P_START], start);
+	poke_le16(&data[BPT_P_COUNT], n + 1);
+}
+
+/**
+ * Remove cell at the given slot, keeping the cells compact.
+ */
+static void
+bpt_page_remove(char *data, uint pos)
+{
+	uint n = bpt_nslots(data);
+	uint start = bpt_start(data);
+	char *cell = bpt_cell(data, pos);
+	uint off = cell - data;
+	size_t csize = bpt_cell_size(data, cell);
+	uint i;
+
+	g_assert(pos < n);
+
+	memmove(&data[start + csize], &data[start], off - start);
+
+	for (i = 0; i < n; i++) {
+		char *slot = &data[BPT_P_SLOTS + 2 * i];
+		uint o = peek_le16(slot);
+		if (o < off)
+			poke_le16(slot, o + csize);
+	}
+
+	memmove(&data[BPT_P_SLOTS + 2 * pos], &data[BPT_P_SLOTS + 2 * (pos + 1)],
+		2 * (n - pos - 1));
+	poke_le16(&data[BPT_P_START], start + csize);
+	poke_le16(&data[BPT_P_COUNT], n - 1);
+}
+
+/**
+ * Split a full page to insert a new cell.
+ *
+ * The lower half of the cells stays in the page, the upper half moves to
+ * a new page, to the right of the split page.
+ *
+ * @param bt		the B+tree
+ * @param pg		the page to split
+ * @param pos		the slot where the cell must be inserted
+ * @param cell		the cell to insert
+ * @param csize		size of the cell
+ * @param sep		where the key separating the two pages is written
+ * @param seplen	where the length of the separating key is written
+ *
+ * @return the new right page, NULL on error.
+ */
+static struct bpt_page *
+bpt_split(bptree_t *bt, struct bpt_page *pg, uint pos,
+	const char *cell, size_t csize, char *sep, size_t *seplen)
+{
+	uint16 offs[BPT_MAXCELLS + 1];
+	uint16 sizes[BPT_MAXCELLS + 1];
+	char *data = pg->data;
+	bool leaf = BPT_LEAF == bpt_type(data);
+	uint n = bpt_nslots(data), total = 0, acc, i, m;
+	uint cap = BPT_PAGE - BPT_P_SLOTS;
+	size_t off = 0;
+	struct bpt_page *right;
+	const char *mc;
+
+	g_assert(n + 1 <= G_N_ELEMENTS(offs));
+
+	/*
+	 * Gather all the cells, including the new one, in key order.
+	 */
+
+	for (i = 0; i <= n; i++) {
+		const char *c;
+		size_t len;
+
+		if (i == pos) {
+			c = cell;
+			len = csize;
+		} else {
+			c = bpt_cell(data, i < pos ? i : i - 1);
+			len = bpt_cell_size(data, c);
+		}
+
+		memcpy(&bt->split[off], c, len);
+		offs[i] = off;
+		sizes[i] = len;
+		off += len;
+		total += len + 2;
+	}
+
+	n++;
+
+	/*
+	 * Choose the split point.  For leaves, "m" is the amount of cells
+	 * staying in the left page.  For nodes, cell "m" moves up to the parent
+	 * and its child becomes the leftmost child of the right page.
+	 */
+
+	if (pos == n - 1 && (leaf ? 0 == bpt_link(data) : n > 3)) {
+		m = leaf ? n - 1 : n - 2;	/* Appending: fill the left page */
+	} else {
+		for (m = 0, acc = 0; m < n && acc < total / 2; m++)
+			acc += sizes[m] + 2;
+	}
+
+	m = MAX(m, 1);
+	m = MIN(m, leaf ? n - 1 : n - 2);
+
+	for (;;) {
+		uint left = 0, rest = 0;
+
+		for (i = 0; i < m; i++)
+			left += sizes[i] + 2;
+		for (i = leaf ? m : m + 1; i < n; i++)
+			rest += sizes[i] + 2;
+
+		if (left > cap)
+			m--;
+		else if (rest > cap)
+			m++;
+		else
+			break;
+	}
+
+	right = bpt_page_new(bt, leaf ? BPT_LEAF : BPT_NODE);
+	if (NULL == right)
+		return NULL;
+
+	mc = &bt->split[offs[m]];
+	*seplen = bpt_cell_klen(mc);
+	memcpy(sep, mc + (leaf ? BPT_LEAF_HDR : BPT_NODE_HDR), *seplen);
+
+	poke_le16(&data[BPT_P_COUNT], 0);
+	poke_le16(&data[BPT_P_START], BPT_PAGE);
+
+	for (i = 0; i < m; i++)
+		bpt_page_insert(data, i, &bt->split[offs[i]], sizes[i]);
+
+	if (leaf) {
+		uint32 next = bpt_link(data);
+
+		for (i = m; i < n; i++)
+			bpt_page_insert(right->data, i - m, &bt->split[offs[i]], sizes[i]);
+
+		if (next != 0) {
+			struct bpt_page *npg = bpt_page_get(bt, next);
+			if (NULL == npg)
+				return NULL;
+			poke_le32(&npg->data[BPT_P_PREV], right->num);
+			npg->dirty = TRUE;
+		}
+
+		poke_le32(&right->data[BPT_P_LINK], next);
+		poke_le32(&right->data[BPT_P_PREV], pg->num);
+		poke_le32(&data[BPT_P_LINK], right->num);
+	} else {
+		for (i = m + 1; i < n; i++) {
+			bpt_page_insert(right->data, i - m - 1,
+				&bt->split[offs[i]], sizes[i]);
+		}
+		poke_le32(&right->data[BPT_P_LINK], bpt_cell_child(mc));
+	}
+
+	pg->dirty = TRUE;
+	return right;
+}
+
+/**
+ * Insert cell in the leaf at the end of the path, splitting pages up to
+ * the root as needed.
+ *
+ * @return TRUE on success.
+ */
+static bool
+bpt_insert_cell(bptree_t *bt, struct bpt_path *path, uint pos,
+	const char *cell, size_t csize)
+{
+	char sep[BPTREE_MAXKEY];
+	char ncell[BPT_NODE_HDR + BPTREE_MAXKEY];
+	int level = path->depth - 1;
+
+	for (;;) {
+		struct bpt_page *pg = bpt_page_get(bt, path->num[level]);
+		struct bpt_page *right;
+		size_t seplen;
+
+		if (NULL == pg)
+			return FALSE;
+
+		if (bpt_page_fits(pg->data, csize)) {
+			bpt_page_insert(pg->data, pos, cell, csize);
+			pg->dirty = TRUE;
+			return TRUE;
+		}
+
+		right = bpt_split(bt, pg, pos, cell, csize, sep, &seplen);
+		if (NULL == right)
+			return FALSE;
+
+		ncell[0] = seplen;
+		ncell[1] = 0;
+		poke_le32(&ncell[2], right->num);
+		memcpy(&ncell[BPT_NODE_HDR], sep, seplen);
+		cell = ncell;
+		csize = BPT_NODE_HDR + seplen;
+
+		if (0 == level) {
+			struct bpt_page *root = bpt_page_new(bt, BPT_NODE);
+
+			if (NULL == root)
+				return FALSE;
+
+			poke_le32(&root->data[BPT_P_LINK], pg->num);
+			bpt_page_insert(root->data, 0, cell, csize);
+			bt->root = root->num;
+			return TRUE;
+		}
+
+		level--;
+		pos = path->idx[level] + 1;
+	}
+}
+
+/**
+ * Store key/value pair in the tree.
+ *
+ * @param bt		the B+tree
+ * @param key		the key
+ * @param klen		key length, at most BPTREE_MAXKEY
+ * @param value		the value
+ * @param vlen		value length
+ * @param existed	if non-NULL, set to whether the key was already present
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int
+bptree_store(bptree_t *bt, const void *key, size_t klen,
+	const void *value, size_t vlen, bool *existed)
+{
+	char cell[BPT_LEAF_HDR + BPTREE_MAXKEY + BPT_INLINE_MAX];
+	struct bpt_path path;
+	struct bpt_page *leaf;
+	size_t csize;
+	bool found;
+	uint pos;
+	int ret = -1;
+
+	bptree_check(bt);
+	g_assert(key != NULL);
+	g_assert(value != NULL || 0 == vlen);
+
+	if (klen > BPTREE_MAXKEY || vlen > MAX_INT_VAL(uint32)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	bpt_modified(bt);
+
+	leaf = bpt_descend(bt, key, klen, &path);
+	if (NULL == leaf)
+		goto done;
+
+	pos = bpt_search(leaf->data, key, klen, &found);
+
+	if (found) {
+		bpt_ovfl_free(bt, bpt_cell(leaf->data, pos));
+		bpt_page_remove(leaf->data, pos);
+		leaf->dirty = TRUE;
+	}
+
+	cell[0] = klen;
+	memcpy(&cell[BPT_LEAF_HDR], key, klen);
+
+	if (vlen <= BPT_INLINE_MAX) {
+		cell[1] = 0;
+		poke_le16(&cell[2], vlen);
+		memcpy(&cell[BPT_LEAF_HDR + klen], value, vlen);
+		csize = BPT_LEAF_HDR + klen + vlen;
+	} else {
+		uint32 first = bpt_ovfl_store(bt, value, vlen);
+
+		if (0 == first)
+			goto done;
+
+		cell[1] = BPT_CELL_OVFL;
+		poke_le16(&cell[2], 8);
+		poke_le32(&cell[BPT_LEAF_HDR + klen], vlen);
+		poke_le32(&cell[BPT_LEAF_HDR + klen + 4], first);
+		csize = BPT_LEAF_HDR + klen + 8;
+	}
+
+	if (!bpt_insert_cell(bt, &path, pos, cell, csize))
+		goto done;
+
+	if (!found)
+		bt->count++;
+
+	if (existed != NULL)
+		*existed = found;
+
+	ret = 0;
+
+done:
+	bpt_trim(bt);
+	return ret;
+}
+
+/**
+ * Fetch value associated with the key.
+ *
+ * @param bt		the B+tree
+ * @param key		the key
+ * @param klen		key length
+ * @param vlen		where the value length is written
+ *
+ * @return pointer to the value, valid until the next call, or NULL if the
+ * key is not present (errno being 0) or on error.
+ */
+const void *
+bptree_fetch(bptree_t *bt, const void *key, size_t klen, size_t *vlen)
+{
+	struct bpt_page *leaf;
+	const void *v = NULL;
+	size_t len;
+	bool found;
+	uint pos;
+
+	bptree_check(bt);
+	g_assert(key != NULL);
+	g_assert(vlen != NULL);
+
+	errno = 0;
+
+	leaf = bpt_descend(bt, key, klen, NULL);
+	if (NULL == leaf)
+		goto done;
+
+	pos = bpt_search(leaf->data, key, klen, &found);
+	if (!found)
+		goto done;
+
+	v = bpt_value(bt, bpt_cell(leaf->data, pos), &len);
+	if (v != NULL && v != bt->vbuf) {
+		bpt_vbuf_grow(bt, len);
+		memcpy(bt->vbuf, v, len);
+		v = bt->vbuf;
+	}
+	*vlen = len;
+
+done:
+	bpt_trim(bt);
+	return v;
+}
+
+/**
+ * Check whether key exists in the tree.
+ *
+ * @return 1 if present, 0 if not, -1 on error.
+ */
+int
+bptree_exists(bptree_t *bt, const void *key, size_t klen)
+{
+	struct bpt_page *leaf;
+	bool found = FALSE;
+
+	bptree_check(bt);
+	g_assert(key != NULL);
+
+	leaf = bpt_descend(bt, key, klen, NULL);
+	if (leaf != NULL)
+		bpt_search(leaf->data, key, klen, &found);
+
+	bpt_trim(bt);
+	return NULL == leaf ? -1 : found ? 1 : 0;
+}
+
+/**
+ * Remove reference to an emptied child page from its parent, recursively
+ * removing emptied nodes.
+ */
+static void
+bpt_remove_child(bptree_t *bt, struct bpt_path *path, int level)
+{
+	for (; level >= 0; level--) {
+		struct bpt_page *pg = bpt_page_get(bt, path->num[level]);
+		int idx = path->idx[level];
+
+		if (NULL == pg)
+			return;
+
+		pg->dirty = TRUE;
+
+		if (idx >= 0) {
+			bpt_page_remove(pg->data, idx);
+			return;
+		}
+
+		/*
+		 * The leftmost child was removed: the child of the first cell
+		 * becomes the leftmost child, its key being no longer needed.
+		 */
+
+		if (bpt_nslots(pg->data) != 0) {
+			uint32 child = bpt_cell_child(bpt_cell(pg->data, 0));
+			poke_le32(&pg->data[BPT_P_LINK], child);
+			bpt_page_remove(pg->data, 0);
+			return;
+		}
+
+		g_assert(level != 0);		/* Last leaf is never freed */
+		bpt_page_free(bt, pg);
+	}
+}
+
+/**
+ * Delete key from the tree.
+ *
+ * @return 1 if the key was deleted, 0 if it was not found, -1 on error.
+ */
+static int
+bpt_delete(bptree_t *bt, const void *key, size_t klen)
+{
+	struct bpt_path path;
+	struct bpt_page *leaf;
+	uint32 prev, next;
+	bool found;
+	uint pos;
+
+	leaf = bpt_descend(bt, key, klen, &path);
+	if (NULL == leaf)
+		return -1;
+
+	pos = bpt_search(leaf->data, key, klen, &found);
+	if (!found)
+		return 0;
+
+	bpt_modified(bt);
+	bpt_ovfl_free(bt, bpt_cell(leaf->data, pos));
+	bpt_page_remove(leaf->data, pos);
+	leaf->dirty = TRUE;
+	bt->count--;
+
+	prev = bpt_prev(leaf->data);
+	next = bpt_link(leaf->data);
+
+	/*
+	 * An emptied leaf is removed from the tree, unless it is the last one.
+	 */
+
+	if (0 != bpt_nslots(leaf->data) || (0 == prev && 0 == next))
+		goto collapse;
+
+	if (0 == prev) {
+		bt->first = next;
+	} else {
+		struct bpt_page *ppg = bpt_page_get(bt, prev);
+		if (NULL == ppg)
+			return -1;
+		poke_le32(&ppg->data[BPT_P_LINK], next);
+		ppg->dirty = TRUE;
+	}
+
+	if (next != 0) {
+		struct bpt_page *npg = bpt_page_get(bt, next);
+		if (NULL == npg)
+			return -1;
+		poke_le32(&npg->data[BPT_P_PREV], prev);
+		npg->dirty = TRUE;
+	}
+
+	bpt_page_free(bt, leaf);
+	bpt_remove_child(bt, &path, path.depth - 2);
+
+	/* FALL THROUGH */
+
+collapse:
+	for (;;) {
+		struct bpt_page *root = bpt_page_get(bt, bt->root);
+
+		if (NULL == root)
+			return -1;
+
+		if (BPT_NODE != bpt_type(root->data) || 0 != bpt_nslots(root->data))
+			break;
+
+		bt->root = bpt_link(root->data);
+		bpt_page_free(bt, root);
+	}
+
+	return 1;
+}
+
+/**
+ * Delete key from the tree.
+ *
+ * @return 0 on success, -1 if the key was not found (errno being 0) or on
+ * error.
+ */
+int
+bptree_delete(bptree_t *bt, const void *key, size_t klen)
+{
+	int ret;
+
+	bptree_check(bt);
+	g_assert(key != NULL);
+
+	errno = 0;
+	ret = bpt_delete(bt, key, klen);
+	bpt_trim(bt);
+
+	return 1 == ret ? 0 : -1;
+}
+
+/**
+ * Locate the first key of a range.
+ *
+ * @return the leaf page holding the first key, NULL on error.
+ */
+static struct bpt_page *
+bpt_range_start(bptree_t *bt, const void *lo, size_t lolen, uint *pos)
+{
+	struct bpt_page *pg;
+	bool found;
+
+	if (NULL == lo) {
+		*pos = 0;
+		return bpt_page_get(bt, bt->first);
+	}
+
+	pg = bpt_descend(bt, lo, lolen, NULL);
+	if (pg != NULL)
+		*pos = bpt_search(pg->data, lo, lolen, &found);
+
+	return pg;
+}
+
+/**
+ * Iterate over the keys within [lo, hi), in key order.
+ *
+ * @param bt		the B+tree
+ * @param lo		lowest key of range, NULL for the first key
+ * @param lolen		length of lowest key
+ * @param hi		key ending the range (excluded), NULL for no limit
+ * @param hilen		length of ending key
+ * @param cb		callback to invoke on each key/value pair
+ * @param arg		additional callback argument
+ */
+void
+bptree_foreach_range(bptree_t *bt,
+	const void *lo, size_t lolen, const void *hi, size_t hilen,
+	bptree_cb_t cb, void *arg)
+{
+	struct bpt_page *pg;
+	uint pos;
+
+	bptree_check(bt);
+	g_assert(cb != NULL);
+
+	pg = bpt_range_start(bt, lo, lolen, &pos);
+
+	while (pg != NULL) {
+		uint32 next;
+		uint i;
+
+		for (i = pos; i < bpt_nslots(pg->data); i++) {
+			const char *c = bpt_cell(pg->data, i);
+			const char *k = c + BPT_LEAF_HDR;
+			const void *v;
+			size_t vlen;
+
+			if (hi != NULL && bpt_keycmp(k, bpt_cell_klen(c), hi, hilen) >= 0)
+				goto done;
+
+			v = bpt_value(bt, c, &vlen);
+			if (NULL == v)
+				goto done;
+
+			(*cb)(k, bpt_cell_klen(c), v, vlen, arg);
+		}
+
+		next = bpt_link(pg->data);
+		bpt_trim(bt);
+		pg = 0 == next ? NULL : bpt_page_get(bt, next);
+		pos = 0;
+	}
+
+done:
+	bpt_trim(bt);
+}
+
+/**
+ * Iterate over the keys within [lo, hi), in key order, removing the keys
+ * for which the callback returns TRUE.
+ *
+ * @param bt		the B+tree
+ * @param lo		lowest key of range, NULL for the first key
+ * @param lolen		length of lowest key
+ * @param hi		key ending the range (excluded), NULL for no limit
+ * @param hilen		length of ending key
+ * @param cbr		callback to invoke on each key/value pair
+ * @param arg		additional callback argument
+ *
+ * @return the amount of keys removed.
+ */
+size_t
+bptree_foreach_range_remove(bptree_t *bt,
+	const void *lo, size_t lolen, const void *hi, size_t hilen,
+	bptree_cbr_t cbr, void *arg)
+{
+	struct bpt_page *pg;
+	size_t removed = 0;
+	bool stop = FALSE;
+	uint pos;
+
+	bptree_check(bt);
+	g_assert(cbr != NULL);
+
+	pg = bpt_range_start(bt, lo, lolen, &pos);
+
+	/*
+	 * Keys to remove are collected leaf by leaf, then deleted once we are
+	 * done with the leaf.  Since pages are never merged, removing keys from
+	 * a leaf cannot alter the following leaves.
+	 */
+
+	while (pg != NULL) {
+		uint32 next;
+		size_t off = 0;
+		uint i;
+
+		for (i = pos; i < bpt_nslots(pg->data); i++) {
+			const char *c = bpt_cell(pg->data, i);
+			const char *k = c + BPT_LEAF_HDR;
+			uint klen = bpt_cell_klen(c);
+			const void *v;
+			size_t vlen;
+
+			if (hi != NULL && bpt_keycmp(k, klen, hi, hilen) >= 0) {
+				stop = TRUE;
+				break;
+			}
+
+			v = bpt_value(bt, c, &vlen);
+			if (NULL == v) {
+				stop = TRUE;
+				break;
+			}
+
+			if ((*cbr)(k, klen, v, vlen, arg)) {
+				if (off + klen + 1 > bt->kbufsize) {
+					bt->kbufsize = MAX(bt->kbufsize * 2, BPT_PAGE);
+					bt->kbuf = hrealloc(bt->kbuf, bt->kbufsize);
+				}
+				bt->kbuf[off] = klen;
+				memcpy(&bt->kbuf[off + 1], k, klen);
+				off += klen + 1;
+			}
+		}
+
+		next = bpt_link(pg->data);
+
+		for (i = 0; i < off; i += 1 + (uchar) bt->kbuf[i]) {
+			if (1 == bpt_delete(bt, &bt->kbuf[i + 1], (uchar) bt->kbuf[i]))
+				removed++;
+		}
+
+		bpt_trim(bt);
+
+		if (stop || 0 == next)
+			break;
+
+		pg = bpt_page_get(bt, next);
+		pos = 0;
+	}
+
+	bpt_trim(bt);
+	return removed;
+}
+
+/**
+ * Write all the dirty pages and mark the tree as synchronized, forcing the
+ * tree file to disk so that the tree can be re-opened as-is after a crash.
+ *
+ * @return the amount of pages written, -1 on error.
+ */
+ssize_t
+bptree_sync(bptree_t *bt)
+{
+	bptree_check(bt);
+
+	return bpt_flush(bt);
+}
+
+/**
+ * Synchronize the tree and flush its file to disk.
+ *
+ * Since synchronizing already forces the tree file to disk, this is the
+ * same as bptree_sync(), only with a boolean status.
+ *
+ * @return TRUE on success.
+ */
+bool
+bptree_fsync(bptree_t *bt)
+{
+	bptree_check(bt);
+
+	return -1 != bpt_flush(bt);
+}
+
+/**
+ * Remove all the keys from the tree.
+ *
+ * @return TRUE on success.
+ */
+bool
+bptree_clear(bptree_t *bt)
+{
+	bptree_check(bt);
+
+	return bpt_init(bt);
+}
+
+/**
+ * Callback for bptree_rebuild(), copying key/value to the new tree.
+ */
+static void
+bpt_rebuild_copy(const void *key, size_t klen,
+	const void *value, size_t vlen, void *arg)
+{
+	bptree_t *nbt = arg;
+
+	if (-1 == bptree_store(nbt, key, klen, value, vlen, NULL))
+		nbt->ioerr = TRUE;
+}
+
+/**
+ * Create a new tree in a temporary file, to replace the given tree.
+ *
+ * @param bt		the tree to replace
+ * @param buf		the status of the tree file
+ * @param tmp_ptr	where the path of the temporary file is returned
+ *
+ * @return the new tree, NULL on error.
+ */
+static bptree_t *
+bpt_replacement(bptree_t *bt, const filestat_t *buf, char **tmp_ptr)
+{
+	bptree_t *nbt;
+	char *tmp;
+
+	tmp = h_strconcat(bt->path, ".tmp", NULL_PTR);
+	nbt = bptree_open(bt->name, tmp, O_CREAT | O_TRUNC | O_RDWR,
+			buf->st_mode & 0777);
+
+	if (NULL == nbt)
+		s_warning("BPTREE \"%s\" cannot create \"%s\": %m", bt->name, tmp);
+	else
+		bptree_set_cache(nbt, bt->cache_max);
+
+	*tmp_ptr = tmp;
+	return nbt;
+}
+
+/**
+ * Replace the tree with the one built in the temporary file, which is
+ * synchronized and closed.
+ *
+ * @return TRUE on success.
+ */
+static bool
+bpt_replace(bptree_t *bt, bptree_t *nbt, const char *tmp)
+{
+	int fd;
+
+	g_assert(0 == bt->jsize);	/* Old tree cannot be rolled back any more */
+
+	if (-1 == bpt_flush(nbt)) {
+		bptree_set_volatile(nbt, TRUE);
+		bptree_close(nbt);
+		return FALSE;
+	}
+
+	bptree_close(nbt);
+
+	fd = file_open(tmp, O_RDWR, 0);
+	if (-1 == fd)
+		return FALSE;
+
+	if (-1 == rename(tmp, bt->path)) {
+		s_warning("BPTREE \"%s\" cannot rename \"%s\" as \"%s\": %m",
+			bt->name, tmp, bt->path);
+		fd_close(&fd);
+		return FALSE;
+	}
+
+	bpt_discard_all(bt);
+	fd_close(&bt->fd);
+	bt->fd = fd;
+
+	return bpt_load(bt) || bpt_init(bt);
+}
+
+/**
+ * Check whether a page is a well-formed leaf.
+ */
+static bool
+bpt_leaf_valid(const char *data)
+{
+	uint i, n = bpt_nslots(data), start = bpt_start(data);
+
+	if (
+		BPT_LEAF != bpt_type(data) ||
+		start > BPT_PAGE || BPT_P_SLOTS + 2 * n > start
+	)
+		return FALSE;
+
+	for (i = 0; i < n; i++) {
+		uint off = peek_le16(&data[BPT_P_SLOTS + 2 * i]);
+		const char *c = &data[off];
+
+		if (off < start || off + BPT_LEAF_HDR > BPT_PAGE)
+			return FALSE;
+
+		if (off + bpt_cell_size(data, c) > BPT_PAGE)
+			return FALSE;
+
+		if ((c[1] & BPT_CELL_OVFL) && 8 != peek_le16(&c[2]))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Salvage the keys held in the leaves of an unclean tree, copying them to a
+ * new tree which then replaces the old one.
+ *
+ * Pages may have been written in any order since the last synchronization,
+ * so the pages are no longer trusted to form a tree: each well-formed leaf
+ * found in the file has its keys copied.  A key present in several leaves
+ * gets the value held in the last one, and keys whose pages were not written
+ * before the crash are lost.
+ *
+ * @return TRUE if the tree was salvaged.
+ */
+static bool
+bpt_salvage(bptree_t *bt, const filestat_t *buf)
+{
+	bptree_t *nbt;
+	char *tmp;
+	uint32 num;
+	bool ok = FALSE;
+
+	nbt = bpt_replacement(bt, buf, &tmp);
+	if (NULL == nbt)
+		goto done;
+
+	bt->npages = buf->st_size / BPT_PAGE;
+	bt->clean = TRUE;		/* Nothing to flush */
+
+	for (num = 1; num < bt->npages; num++) {
+		struct bpt_page *pg = bpt_page_get(bt, num);
+
+		if (pg != NULL && bpt_leaf_valid(pg->data)) {
+			uint i;
+
+			for (i = 0; i < bpt_nslots(pg->data); i++) {
+				const char *c = bpt_cell(pg->data, i);
+				const void *v;
+				size_t vlen;
+
+				v = bpt_value(bt, c, &vlen);
+				if (v != NULL) {
+					bpt_rebuild_copy(c + BPT_LEAF_HDR, bpt_cell_klen(c),
+						v, vlen, nbt);
+				}
+			}
+		}
+
+		bpt_trim(bt);
+	}
+
+	bt->ioerr = FALSE;		/* Errors on damaged pages were expected */
+
+	if (nbt->ioerr) {
+		s_warning("BPTREE \"%s\" salvage failed", bt->name);
+		bptree_set_volatile(nbt, TRUE);
+		bptree_close(nbt);
+		goto done;
+	}
+
+	s_warning("BPTREE \"%s\" salvaged %s key%s from \"%s\"",
+		bt->name, uint64_to_string(nbt->count), plural(nbt->count),
+		bt->path);
+
+	ok = bpt_replace(bt, nbt, tmp);
+
+done:
+	if (!ok && -1 == unlink(tmp) && errno != ENOENT)
+		s_warning("BPTREE \"%s\" cannot unlink \"%s\": %m", bt->name, tmp);
+
+	HFREE_NULL(tmp);
+	return ok;
+}
+
+/**
+ * Rebuild the tree, reclaiming the space of partially filled pages.
+ *
+ * Keys are copied sequentially into a new tree, which therefore ends up with
+ * full pages, and the new tree then replaces the old one.
+ *
+ * @return TRUE on success.
+ */
+bool
+bptree_rebuild(bptree_t *bt)
+{
+	bptree_t *nbt;
+	filestat_t buf;
+	char *tmp;
+	bool ok = FALSE;
+
+	bptree_check(bt);
+
+	if (-1 == fstat(bt->fd, &buf)) {
+		s_warning("BPTREE \"%s\" cannot stat \"%s\": %m", bt->name, bt->path);
+		return FALSE;
+	}
+
+	/*
+	 * The tree is synchronized first, so that there is no journal left to
+	 * roll back once the new file has replaced it.
+	 */
+
+	if (-1 == bpt_flush(bt))
+		return FALSE;
+
+	nbt = bpt_replacement(bt, &buf, &tmp);
+	if (NULL == nbt)
+		goto done;
+
+	bptree_foreach_range(bt, NULL, 0, NULL, 0, bpt_rebuild_copy, nbt);
+
+	if (nbt->ioerr || bt->ioerr || nbt->count != bt->count) {
+		s_warning("BPTREE \"%s\" rebuild failed (copied %s/%s key%s)",
+			bt->name, uint64_to_string(nbt->count),
+			uint64_to_string2(bt->count), plural(bt->count));
+		bptree_set_volatile(nbt, TRUE);
+		bptree_close(nbt);
+		goto done;
+	}
+
+	ok = bpt_replace(bt, nbt, tmp);
+
+done:
+	if (!ok && -1 == unlink(tmp) && errno != ENOENT)
+		s_warning("BPTREE \"%s\" cannot unlink \"%s\": %m", bt->name, tmp);
+
+	HFREE_NULL(tmp);
+	return ok;
+}
+
+/**
+ * @return whether an I/O error occurred.
+ */
+bool
+bptree_error(const bptree_t *bt)
+{
+	bptree_check(bt);
+
+	return bt->ioerr;
+}
+
+/**
+ * Clear the I/O error condition.
+ */
+void
+bptree_clearerr(bptree_t *bt)
+{
+	bptree_check(bt);
+
+	bt->ioerr = FALSE;
+}
+
+/**
+ * Set the maximum amount of pages held in the cache.
+ *
+ * @return 0 on success, -1 on error with errno set.
+ */
+int
+bptree_set_cache(bptree_t *bt, long pages)
+{
+	bptree_check(bt);
+
+	if (pages < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	bt->cache_max = pages;
+	bpt_trim(bt);
+
+	return 0;
+}
+
+/**
+ * Turn deferred writes on or off.
+ *
+ * When deferred writes are off, the tree is synchronized at the end of each
+ * operation.
+ *
+ * @return 0.
+ */
+int
+bptree_set_wdelay(bptree_t *bt, bool on)
+{
+	bptree_check(bt);
+
+	bt->wdelay = booleanize(on);
+	bpt_trim(bt);
+
+	return 0;
+}
+
+/**
+ * Mark the tree as volatile: its file is removed when it is closed.
+ *
+ * @return 0.
+ */
+int
+bptree_set_volatile(bptree_t *bt, bool on)
+{
+	bptree_check(bt);
+
+	bt->is_volatile = booleanize(on);
+
+	return 0;
+}
+
+/**
+ * Close the tree, synchronizing it unless it is volatile.
+ */
+void
+bptree_close(bptree_t *bt)
+{
+	bptree_check(bt);
+
+	if (!bt->is_volatile)
+		bpt_flush(bt);
+
+	bpt_discard_all(bt);
+	hevset_free_null(&bt->pages);
+	fd_close(&bt->fd);
+
+	if (bt->is_volatile && -1 == unlink(bt->path)) {
+		s_warning("BPTREE \"%s\" cannot unlink \"%s\": %m",
+			bt->name, bt->path);
+	}
+
+	/*
+	 * The journal is kept when the tree could not be synchronized, so that
+	 * it can be rolled back when re-opened.
+	 */
+
+	if (-1 != bt->jfd) {
+		fd_close(&bt->jfd);
+		if ((bt->clean || bt->is_volatile) && -1 == unlink(bt->jpath)) {
+			s_warning("BPTREE \"%s\" cannot unlink \"%s\": %m",
+				bt->name, bt->jpath);
+		}
+	}
+
+	HFREE_NULL(bt->name);
+	HFREE_NULL(bt->path);
+	HFREE_NULL(bt->vbuf);
+	HFREE_NULL(bt->kbuf);
+	HFREE_NULL(bt->split);
+	HFREE_NULL(bt->jpath);
+	HFREE_NULL(bt->jbuf);
+	HFREE_NULL(bt->journaled);
+	bt->magic = 0;
+	WFREE(bt);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
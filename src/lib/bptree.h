@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2026 gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Disk-based B+tree with ordered iteration.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#ifndef _bptree_h_
+#define _bptree_h_
+
+#define BPTREE_FEXT		".bpt"		/**< File extension for the tree */
+#define BPTREE_JEXT		".bpj"		/**< Appended to tree path for journal */
+#define BPTREE_MAXKEY	255			/**< Maximum key length */
+
+struct bptree;
+typedef struct bptree bptree_t;
+
+/**
+ * Range iterator callbacks.
+ *
+ * The key and value are only valid during the callback, which must not
+ * attempt to modify the tree.  The "remove" flavour returns TRUE when the
+ * key must be deleted from the tree.
+ */
+typedef void (*bptree_cb_t)(const void *key, size_t klen,
+	const void *value, size_t vlen, void *arg);
+typedef bool (*bptree_cbr_t)(const void *key, size_t klen,
+	const void *value, size_t vlen, void *arg);
+
+/*
+ * Public interface.
+ */
+
+bptree_t *bptree_open(const char *name, const char *path, int flags, int mode);
+void bptree_close(bptree_t *bt);
+const char *bptree_name(const bptree_t *bt);
+void bptree_set_name(bptree_t *bt, const char *name);
+
+int bptree_store(bptree_t *bt, const void *key, size_t klen,
+	const void *value, size_t vlen, bool *existed);
+const void *bptree_fetch(bptree_t *bt, const void *key, size_t klen,
+	size_t *vlen);
+int bptree_delete(bptree_t *bt, const void *key, size_t klen);
+int bptree_exists(bptree_t *bt, const void *key, size_t klen);
+size_t bptree_count(const bptree_t *bt);
+
+void bptree_foreach_range(bptree_t *bt,
+	const void *lo, size_t lolen, const void *hi, size_t hilen,
+	bptree_cb_t cb, void *arg);
+size_t bptree_foreach_range_remove(bptree_t *bt,
+	const void *lo, size_t lolen, const void *hi, size_t hilen,
+	bptree_cbr_t cbr, void *arg);
+
+ssize_t bptree_sync(bptree_t *bt);
+bool bptree_fsync(bptree_t *bt);
+bool bptree_clear(bptree_t *bt);
+bool bptree_rebuild(bptree_t *bt);
+bool bptree_error(const bptree_t *bt);
+void bptree_clearerr(bptree_t *bt);
+
+int bptree_set_cache(bptree_t *bt, long pages);
+int bptree_set_wdelay(bptree_t *bt, bool on);
+int bptree_set_volatile(bptree_t *bt, bool on);
+
+#endif /* _bptree_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -38,6 +38,13 @@
 
 #include "compat_misc.h"
 #include "log.h"
+#include "xmalloc.h"
+
+#ifdef HAS_FIEMAP
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 
 #include "override.h"			/* Must be the last header included */
 
@@ -230,6 +237,9 @@ compat_fadvise(int fd, fileoffset_t offset, fileoffset_t size, int hint)
 #ifndef POSIX_FADV_DONTNEED
 #define POSIX_FADV_DONTNEED 0
 #endif
+#ifndef POSIX_FADV_WILLNEED
+#define POSIX_FADV_WILLNEED 0
+#endif
 #endif	/* HAS_POSIX_FADVISE */
 
 void
@@ -256,4 +266,118 @@ compat_fadvise_dontneed(int fd, fileoffset_t offset, fileoffset_t size)
 	compat_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
 }
 
+void
+compat_fadvise_willneed(int fd, fileoffset_t offset, fileoffset_t size)
+{
+	compat_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+}
+
+/**
+ * Allocate disk space for the specified range of the file, extending the
+ * file if needed.  Data already present in the range are not changed.
+ *
+ * Contrary to posix_fallocate(), which the GNU libc emulates by writing
+ * to each block of the range when the filesystem does not support it,
+ * this routine fails when the allocation cannot be done efficiently.
+ *
+ * @param fd		a valid file descriptor of a regular file
+ * @param offset	start of the range
+ * @param size		size of the range
+ *
+ * @return 0 if OK, -1 on failure with errno set.
+ */
+int
+compat_fallocate(int fd, fileoffset_t offset, fileoffset_t size)
+{
+	g_assert(fd >= 0);
+	g_assert(offset >= 0);
+	g_assert(size > 0);
+
+#if defined(HAS_FALLOCATE)
+	return fallocate(fd, 0, offset, size);
+#elif defined(HAS_POSIX_FALLOCATE) && !defined(HAS_GNULIBC)
+	{
+		int error = posix_fallocate(fd, offset, size);
+
+		if (0 == error)
+			return 0;
+
+		errno = error;
+		return -1;
+	}
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/**
+ * Count the amount of extents used by the filesystem to lay out the file
+ * data on disk.
+ *
+ * Like filefrag(8), extents are only counted when they do not follow the
+ * previous one on disk, at the expected place given the hole between them,
+ * since only these cause a seek when reading the file sequentially.  In
+ * particular, filesystems split extents when preallocated blocks get
+ * written, which does not fragment the file.
+ *
+ * Data not yet flushed to disk may not be counted, depending on how the
+ * filesystem handles delayed allocation.
+ *
+ * @param fd		a valid file descriptor of a regular file
+ *
+ * @return the amount of extents, -1 on failure with errno set.
+ */
+long
+compat_extent_count(int fd)
+{
+	g_assert(fd >= 0);
+
+#ifdef HAS_FIEMAP
+	{
+		static const size_t count = 64;
+		struct fiemap *fm;
+		uint64 start = 0, expected = (uint64) -1;
+		long n = 0;
+		bool last = FALSE;
+
+		fm = xmalloc0(sizeof *fm + count * sizeof fm->fm_extents[0]);
+
+		while (!last) {
+			uint i;
+
+			fm->fm_start = start;
+			fm->fm_length = FIEMAP_MAX_OFFSET - start;
+			fm->fm_flags = 0;
+			fm->fm_extent_count = count;
+
+			if (-1 == ioctl(fd, FS_IOC_FIEMAP, fm)) {
+				n = -1;
+				break;
+			}
+
+			if (0 == fm->fm_mapped_extents)
+				break;
+
+			for (i = 0; i < fm->fm_mapped_extents; i++) {
+				const struct fiemap_extent *fe = &fm->fm_extents[i];
+
+				if (fe->fe_physical != expected + (fe->fe_logical - start))
+					n++;
+				expected = fe->fe_physical + fe->fe_length;
+				start = fe->fe_logical + fe->fe_length;
+				if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+					last = TRUE;
+			}
+		}
+
+		xfree(fm);
+		return n;
+	}
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
 /* vi: set ts=4 sw=4 cindent: */
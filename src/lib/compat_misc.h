@@ -46,8 +46,11 @@ void compat_fadvise_sequential(int fd, fileoffset_t offset, fileoffset_t size);
 void compat_fadvise_random(int fd, fileoffset_t offset, fileoffset_t size);
 void compat_fadvise_noreuse(int fd, fileoffset_t offset, fileoffset_t size);
 void compat_fadvise_dontneed(int fd, fileoffset_t offset, fileoffset_t size);
+void compat_fadvise_willneed(int fd, fileoffset_t offset, fileoffset_t size);
 void *compat_memmem(const void *data, size_t data_size,
 		const void *pattern, size_t pattern_size);
+int compat_fallocate(int fd, fileoffset_t offset, fileoffset_t size);
+long compat_extent_count(int fd);
 
 
 #endif /* _compat_misc_h_ */
@@ -79,9 +79,11 @@ enum cevent_magic {
  */
 struct cevent {
 	enum cevent_magic ce_magic;	/**< Magic number (must be at the top) */
+	uint32 ce_seq;				/**< Insertion sequence, for stable ordering */
 	cq_time_t ce_time;			/**< Absolute trigger time (virtual cq time) */
-	struct cevent *ce_bnext;	/**< Next item in hash bucket */
-	struct cevent *ce_bprev;	/**< Prev item in hash bucket */
+	struct cevent *ce_bnext;	/**< Next item in wheel slot */
+	struct cevent *ce_bprev;	/**< Prev item in wheel slot */
+	struct chash *ce_slot;		/**< Wheel slot (or list) holding the event */
 	cqueue_t *ce_cq;			/**< Callout queue where event is registered */
 	cq_service_t ce_fn;			/**< Callback routine */
 	void *ce_arg;				/**< Argument to pass to said callback */
@@ -136,18 +138,32 @@ cevent_is_extended(const cevent_t *ce)
  *
  * Callout queue descriptor.
  *
- * A callout queue is really a sorted linked list of events that are to
+ * A callout queue is logically a sorted list of events that are to
  * happen in the near future, most recent coming first.
  *
- * Naturally, the insertion/deletion of items has to be relatively efficient.
- * We don't want to go through all the items in the list to find the proper
- * position for insertion.
- *
- * To do that, we maintain a parallel hash list of all the events, each event
- * being inserted in the bucket i, where i is computed by abs_time % size,
- * abs_time being the absolute time where the event is to be triggered
- * and size being the size of the hash list. All the items under the bucket
- * list are further sorted by increasing trigger time.
+ * Naturally, the insertion/deletion of items has to be relatively efficient,
+ * since large nodes can have hundreds of thousands of pending events, most
+ * of which will be rescheduled or cancelled before they trigger.
+ *
+ * To do that, events are kept in a hierarchical timing wheel.  Virtual time
+ * is divided into ticks of CQ_TICK units, and the wheel has CQ_WHEEL_LEVELS
+ * levels of CQ_WHEEL_SIZE slots each.  An event is put on the lowest level
+ * whose slot span covers the distance between its trigger tick and the
+ * current tick: level 0 holds the events due within the current "round" of
+ * CQ_WHEEL_SIZE ticks, one slot per tick, level 1 holds the events due
+ * within the current round of CQ_WHEEL_SIZE^2 ticks, one slot per round of
+ * level 0, and so on.  Events due beyond the last level are kept in an
+ * overflow list.
+ *
+ * Each slot is an unsorted list, so that inserting, cancelling or
+ * rescheduling an event is O(1).  As the current tick moves forward and
+ * reaches the start of a new round at some level, the slot of the upper
+ * level corresponding to that round is "cascaded": its events are moved
+ * to lower levels, ultimately reaching level 0.
+ *
+ * When a tick expires, all the events in its level 0 slot are removed in
+ * one batch, which is then sorted by trigger time and insertion order to
+ * preserve the firing order of the events within the same tick.
  *
  * To be completely generic, the callout queue "absolute time" is a mere
  * unsigned long value. It can represent an amount of ms, or an amount of
@@ -157,10 +173,18 @@ cevent_is_extended(const cevent_t *ce)
  */
 
 struct chash {
-	cevent_t *ch_head;			/**< Bucket list head */
-	cevent_t *ch_tail;			/**< Bucket list tail */
+	cevent_t *ch_head;			/**< Slot list head */
+	cevent_t *ch_tail;			/**< Slot list tail */
 };
 
+#define CQ_TICK_SHIFT	5		/**< A tick is 2^5 units of virtual time */
+#define CQ_TICK			(1U << CQ_TICK_SHIFT)
+#define CQ_WHEEL_BITS	8		/**< Bits of tick handled by each level */
+#define CQ_WHEEL_SIZE	(1U << CQ_WHEEL_BITS)
+#define CQ_WHEEL_MASK	(CQ_WHEEL_SIZE - 1)
+#define CQ_WHEEL_LEVELS	4		/**< Amount of levels in the timing wheel */
+#define CQ_WHEEL_SLOTS	(CQ_WHEEL_LEVELS * CQ_WHEEL_SIZE)
+
 enum cqueue_magic  {
 	CQUEUE_MAGIC    = 0x140332ddU,
 	CSUBQUEUE_MAGIC = 0x64d037feU
@@ -171,8 +195,13 @@ struct cqueue {
 	tm_t cq_last_heartbeat;		/**< Real time of last heartbeat */
 	cq_time_t cq_time;			/**< "current time" */
 	const char *cq_name;		/**< Queue name, for logging */
-	struct chash *cq_hash;		/**< Array of buckets for hash list */
-	struct chash *cq_current;	/**< Current bucket scanned in cq_clock() */
+	cq_time_t cq_tick;			/**< Current wheel tick */
+	struct chash *cq_wheel;		/**< Timing wheel slots, level by level */
+	struct chash cq_overflow;	/**< Events beyond the last wheel level */
+	struct chash *cq_current;	/**< Batch being expired in cq_clock() */
+	size_t cq_level[CQ_WHEEL_LEVELS + 1];	/**< Events per level + overflow */
+	size_t cq_cascaded;			/**< Events moved down the wheel levels */
+	size_t cq_batch_max;		/**< Largest batch expired in one tick */
 	elist_t cq_periodic;		/**< Periodic events registered */
 	hset_t *cq_idle;			/**< Idle events registered */
 	const cevent_t *cq_call;	/**< Event being called out, for cq_zero() */
@@ -181,7 +210,7 @@ struct cqueue {
 	unsigned cq_stid;			/**< Thread where callout queue runs */
 	int cq_ticks;				/**< Number of cq_clock() calls processed */
 	int cq_items;				/**< Amount of recorded events */
-	int cq_last_bucket;			/**< Last bucket slot we were at */
+	uint32 cq_seq;				/**< Insertion sequence number */
 	int cq_period;				/**< Regular callout period, in ms */
 	uint8 cq_call_extended;		/**< Is cq_call an extended event? */
 	time_t cq_last_idle;		/**< Last time we ran the idle callbacks */
@@ -198,17 +227,15 @@ cqueue_check(const struct cqueue * const cq)
 	g_assert(CQUEUE_MAGIC == cq->cq_magic || CSUBQUEUE_MAGIC == cq->cq_magic);
 }
 
-#define HASH_SIZE	2048		/**< Hash list size, must be a power of 2 */
-#define HASH_MASK	(HASH_SIZE - 1)
-
 /*
- * The hashing function divides the time by 2^5 or 32, to avoid cq_clock()
- * scanning too many hash buckets each time.  This means our time resolution
+ * The tick is computed by dividing the time by 2^5 or 32, to avoid cq_clock()
+ * going through too many wheel slots each time.  This means our time resolution
  * is at least 32 units.  If we increment cq_clock() with milliseconds, we
- * won't trigger any queue run unless at least 32 milliseconds have elapsed.
+ * won't move to another tick unless at least 32 milliseconds have elapsed.
+ * Events within the current tick are however triggered as soon as their
+ * trigger time is reached.
  */
-#define EV_HASH(x) (((x) >> 5) & HASH_MASK)
-#define EV_OVER(x) (((x) >> 5) & ~HASH_MASK)
+#define EV_TICK(x)	((x) >> CQ_TICK_SHIFT)
 
 /**
  * Locking of the callout queue for short period of time, in sections that
@@ -298,14 +325,14 @@ static cqueue_t *
 cq_initialize(cqueue_t *cq, const char *name, cq_time_t now, int period)
 {
 	/*
-	 * The cq_hash hash list is used to speed up insert/delete operations.
+	 * The cq_wheel timing wheel is used to speed up insert/delete operations.
 	 */
 
 	cq->cq_magic = CQUEUE_MAGIC;
 	cq->cq_name = atom_str_get(name);
-	XMALLOC0_ARRAY(cq->cq_hash, HASH_SIZE);
+	XMALLOC0_ARRAY(cq->cq_wheel, CQ_WHEEL_SLOTS);
 	cq->cq_time = now;
-	cq->cq_last_bucket = EV_HASH(now);
+	cq->cq_tick = EV_TICK(now);
 	cq->cq_period = period;
 	cq->cq_stid = THREAD_INVALID_ID;
 	mutex_init(&cq->cq_lock);
@@ -382,7 +409,7 @@ EV_CQ_LOCK(const cevent_t *ev)
 
 	/*
 	 * An extended event is referenced twice: once by the callout queue
-	 * while it is linked into its bucket, awaiting trigger, and once by
+	 * while it is linked into its wheel slot, awaiting trigger, and once by
 	 * the thread that registered the event.
 	 *
 	 * This prevents freing race conditions since both parties need to
@@ -452,135 +479,287 @@ ev_free(cevent_t *ev)
 }
 
 /**
- * Link event into the callout queue.
+ * Compare two events by trigger time, then by insertion order.
+ *
+ * The sequence numbers are compared modulo 2^32, which is fine as long as
+ * two events with the same trigger time are not inserted more than 2^31
+ * insertions apart.
  */
-static void
-ev_link(cevent_t *ev)
+static inline int
+ev_cmp(const cevent_t *a, const cevent_t *b)
 {
-	struct chash *ch;		/* Hashing bucket */
-	cq_time_t trigger;		/* Trigger time */
-	cevent_t *hev;			/* To loop through the hash bucket */
-	cqueue_t *cq;
+	if (a->ce_time != b->ce_time)
+		return a->ce_time < b->ce_time ? -1 : +1;
 
-	cevent_check(ev);
+	return (int32) (a->ce_seq - b->ce_seq);
+}
 
-	cq = ev->ce_cq;
-	cqueue_check(cq);
-	g_assert(ev->ce_time > cq->cq_time || cq->cq_current);
-	assert_mutex_is_owned(&cq->cq_lock);
+/**
+ * @return the wheel level of a slot, CQ_WHEEL_LEVELS for the overflow list
+ * and -1 if the list is not part of the wheel (expiration batch).
+ */
+static inline int
+cq_slot_level(const cqueue_t *cq, const struct chash *ch)
+{
+	size_t offset = ptr_diff(ch, cq->cq_wheel);
 
-	trigger = ev->ce_time;
-	cq->cq_items++;
+	if (offset < CQ_WHEEL_SLOTS * sizeof cq->cq_wheel[0])
+		return offset / (CQ_WHEEL_SIZE * sizeof cq->cq_wheel[0]);
 
-	/*
-	 * Important corner case: we may be rescheduling an event BEFORE
-	 * the current clock time, in which case we must insert the event
-	 * in the current bucket, so it gets fired during the current
-	 * cq_clock() run.
-	 */
+	return ch == &cq->cq_overflow ? CQ_WHEEL_LEVELS : -1;
+}
 
-	if (trigger <= cq->cq_time)
-		ch = cq->cq_current;
-	else
-		ch = &cq->cq_hash[EV_HASH(trigger)];
+/**
+ * Compute the wheel slot where an event triggering at the given tick must
+ * be put, relative to the current tick of the callout queue.
+ *
+ * The event goes to the first level where its tick and the current tick
+ * only differ in the bits handled by that level.
+ */
+static struct chash *
+cq_wheel_slot(cqueue_t *cq, cq_time_t tick)
+{
+	cq_time_t diff;
+	uint level;
 
-	g_assert(ch);
+	if G_UNLIKELY(tick < cq->cq_tick)
+		tick = cq->cq_tick;		/* Late event, will fire at next run */
 
-	/*
-	 * If bucket is empty, the event is the new head.
-	 */
+	diff = tick ^ cq->cq_tick;
 
-	if (ch->ch_head == NULL) {
-		g_assert(ch->ch_tail == NULL);
-		ch->ch_tail = ch->ch_head = ev;
-		ev->ce_bnext = ev->ce_bprev = NULL;
-		return;
+	for (level = 0; level < CQ_WHEEL_LEVELS; level++) {
+		uint shift = level * CQ_WHEEL_BITS;
+
+		if (0 == (diff >> (shift + CQ_WHEEL_BITS))) {
+			uint idx = (tick >> shift) & CQ_WHEEL_MASK;
+			return &cq->cq_wheel[level * CQ_WHEEL_SIZE + idx];
+		}
+	}
+
+	return &cq->cq_overflow;
+}
+
+/**
+ * Append event at the tail of a slot list.
+ */
+static inline void
+ch_append(cqueue_t *cq, struct chash *ch, cevent_t *ev)
+{
+	int level = cq_slot_level(cq, ch);
+
+	ev->ce_slot = ch;
+	ev->ce_bnext = NULL;
+	ev->ce_bprev = ch->ch_tail;
+
+	if (NULL == ch->ch_tail) {
+		g_assert(NULL == ch->ch_head);
+		ch->ch_head = ev;
+	} else {
+		ch->ch_tail->ce_bnext = ev;
 	}
+	ch->ch_tail = ev;
 
-	g_assert(ch->ch_tail);
+	if G_LIKELY(level >= 0)
+		cq->cq_level[level]++;
+}
+
+/**
+ * Remove event from the slot list where it is held.
+ */
+static inline void
+ch_remove(cqueue_t *cq, cevent_t *ev)
+{
+	struct chash *ch = ev->ce_slot;
+	int level = cq_slot_level(cq, ch);
 
 	/*
-	 * If item is larger than the tail, insert at the end right away.
+	 * Unlinking the item is straigthforward, unlike insertion!
 	 */
 
-	hev = ch->ch_tail;
+	if (ch->ch_head == ev)
+		ch->ch_head = ev->ce_bnext;
+	if (ch->ch_tail == ev)
+		ch->ch_tail = ev->ce_bprev;
 
-	g_assert(hev->ce_bnext == NULL);
+	if (ev->ce_bprev)
+		ev->ce_bprev->ce_bnext = ev->ce_bnext;
+	if (ev->ce_bnext)
+		ev->ce_bnext->ce_bprev = ev->ce_bprev;
 
-	if (trigger >= hev->ce_time) {
-		hev->ce_bnext = ev;
-		ev->ce_bnext = NULL;
-		ev->ce_bprev = hev;
-		ch->ch_tail = ev;
-		return;
+	g_assert(ch->ch_head == NULL || ch->ch_head->ce_bprev == NULL);
+	g_assert(ch->ch_tail == NULL || ch->ch_tail->ce_bnext == NULL);
+
+	ev->ce_slot = NULL;
+
+	if G_LIKELY(level >= 0) {
+		g_assert(cq->cq_level[level] != 0);
+		cq->cq_level[level]--;
 	}
+}
+
+/**
+ * Insert event in the batch of expiring events, keeping it sorted.
+ *
+ * Since the event being inserted was just given a new sequence number, it
+ * will be put after all the events with the same trigger time.
+ */
+static void
+ch_insert_sorted(cqueue_t *cq, struct chash *ch, cevent_t *ev)
+{
+	cevent_t *hev;
 
 	/*
-	 * If item is smaller than the head...
+	 * Events are usually appended, so look for the insertion point starting
+	 * from the tail of the list.
 	 */
 
-	hev = ch->ch_head;
+	for (hev = ch->ch_tail; hev != NULL; hev = hev->ce_bprev) {
+		if (ev_cmp(hev, ev) <= 0)
+			break;
+	}
+
+	if (hev == ch->ch_tail) {
+		ch_append(cq, ch, ev);			/* Also handles empty list */
+		return;
+	}
 
-	g_assert(hev->ce_bprev == NULL);
+	ev->ce_slot = ch;
+	ev->ce_bprev = hev;
 
-	if (trigger < hev->ce_time) {
-		hev->ce_bprev = ev;
-		ev->ce_bnext = hev;
-		ev->ce_bprev = NULL;
+	if (NULL == hev) {
+		/* Becomes the new head */
+		ev->ce_bnext = ch->ch_head;
 		ch->ch_head = ev;
-		return;
+	} else {
+		/* Insert right after ``hev'' */
+		ev->ce_bnext = hev->ce_bnext;
+		hev->ce_bnext = ev;
 	}
 
+	ev->ce_bnext->ce_bprev = ev;
+}
+
+/**
+ * Sort the batch of expiring events by trigger time and insertion order.
+ *
+ * This is a merge sort on the list, which is stable and runs in O(n log n)
+ * without requiring any extra memory.
+ */
+static void
+ch_sort(struct chash *ch)
+{
+	cevent_t *list = ch->ch_head, *ev, *prev;
+	size_t width;
+
+	if (NULL == list || NULL == list->ce_bnext)
+		return;
+
 	/*
-	 * Insert before the first item whose trigger will come after ours.
+	 * Bottom-up merge sort, using only the ce_bnext links.  We rebuild
+	 * the backward links and the tail once the list is sorted.
 	 */
 
-	for (hev = hev->ce_bnext; hev; hev = hev->ce_bnext) {
-		if (trigger < hev->ce_time) {
-			hev->ce_bprev->ce_bnext = ev;
-			ev->ce_bprev = hev->ce_bprev;
-			hev->ce_bprev = ev;
-			ev->ce_bnext = hev;
-			return;
+	for (width = 1; /* empty */; width *= 2) {
+		cevent_t *p = list, *tail = NULL;
+		size_t merges = 0;
+
+		list = NULL;
+
+		while (p != NULL) {
+			cevent_t *q = p;
+			size_t psize = 0, qsize = width;
+
+			merges++;
+
+			while (psize < width && q != NULL) {
+				psize++;
+				q = q->ce_bnext;
+			}
+
+			while (psize != 0 || (qsize != 0 && q != NULL)) {
+				cevent_t *e;
+
+				if (0 == psize) {
+					e = q; q = q->ce_bnext; qsize--;
+				} else if (0 == qsize || NULL == q || ev_cmp(p, q) <= 0) {
+					e = p; p = p->ce_bnext; psize--;
+				} else {
+					e = q; q = q->ce_bnext; qsize--;
+				}
+
+				if (tail != NULL)
+					tail->ce_bnext = e;
+				else
+					list = e;
+				tail = e;
+			}
+
+			p = q;
 		}
+
+		tail->ce_bnext = NULL;
+
+		if (merges <= 1)
+			break;
 	}
 
-	g_assert_not_reached();	/* Must have found an event to insert before */
+	ch->ch_head = list;
+
+	for (prev = NULL, ev = list; ev != NULL; prev = ev, ev = ev->ce_bnext)
+		ev->ce_bprev = prev;
+
+	ch->ch_tail = prev;
 }
 
 /**
- * Unlink event from callout queue.
+ * Link event into the callout queue.
  */
 static void
-ev_unlink(cevent_t *ev)
+ev_link(cevent_t *ev)
 {
-	struct chash *ch;			/* Hashing bucket */
+	cq_time_t trigger;		/* Trigger time */
 	cqueue_t *cq;
 
 	cevent_check(ev);
+
 	cq = ev->ce_cq;
 	cqueue_check(cq);
+	g_assert(ev->ce_time > cq->cq_time || cq->cq_current);
 	assert_mutex_is_owned(&cq->cq_lock);
 
-	ch = &cq->cq_hash[EV_HASH(ev->ce_time)];
-	cq->cq_items--;
+	trigger = ev->ce_time;
+	ev->ce_seq = cq->cq_seq++;
+	cq->cq_items++;
 
 	/*
-	 * Unlinking the item is straigthforward, unlike insertion!
+	 * Important corner case: we may be rescheduling an event BEFORE
+	 * the current clock time, in which case we must insert the event
+	 * in the batch being expired, so it gets fired during the current
+	 * cq_clock() run.
 	 */
 
-	if (ch->ch_head == ev)
-		ch->ch_head = ev->ce_bnext;
-	if (ch->ch_tail == ev)
-		ch->ch_tail = ev->ce_bprev;
+	if (trigger <= cq->cq_time && cq->cq_current != NULL)
+		ch_insert_sorted(cq, cq->cq_current, ev);
+	else
+		ch_append(cq, cq_wheel_slot(cq, EV_TICK(trigger)), ev);
+}
 
-	if (ev->ce_bprev)
-		ev->ce_bprev->ce_bnext = ev->ce_bnext;
-	if (ev->ce_bnext)
-		ev->ce_bnext->ce_bprev = ev->ce_bprev;
+/**
+ * Unlink event from callout queue.
+ */
+static void
+ev_unlink(cevent_t *ev)
+{
+	cqueue_t *cq;
 
-	g_assert(ch->ch_head == NULL || ch->ch_head->ce_bprev == NULL);
-	g_assert(ch->ch_tail == NULL || ch->ch_tail->ce_bnext == NULL);
+	cevent_check(ev);
+	cq = ev->ce_cq;
+	cqueue_check(cq);
+	assert_mutex_is_owned(&cq->cq_lock);
+	g_assert(ev->ce_slot != NULL);
+
+	cq->cq_items--;
+	ch_remove(cq, ev);
 }
 
 /**
@@ -937,14 +1116,12 @@ cq_resched(cevent_t *ev, int delay)
 	g_assert(ev->ce_time > cq->cq_time || cq->cq_current);
 
 	/*
-	 * Events are sorted into the callout queue by trigger time, and are also
-	 * put into a hash list depending on that trigger time.
+	 * Events are put into a timing wheel slot depending on their trigger time.
 	 *
 	 * Therefore, since we are updating the trigger time, we need to remove
-	 * the event from the queue lists first, update the firing delay, and relink
-	 * the event. It's possible that it will end up being relinked at the exact
-	 * same place, but determining that in advance would probably cost as much
-	 * as doing the unlink/link blindly anyway.
+	 * the event from its slot first, update the firing delay, and relink
+	 * the event.  Both operations are O(1), so there is no point trying to
+	 * determine whether the event would end up in the same slot.
 	 *
 	 * For performance reasons, use hidden locks: we know the ev_link() and
 	 * ev_unlink() routines are not going to take locks, so it is safe.
@@ -1128,6 +1305,112 @@ cq_replace(cevent_t *ev, cq_service_t fn, void *arg)
 	return TRUE;
 }
 
+/**
+ * Cascade the events held in a wheel slot (or in the overflow list) down
+ * to the lower levels, after the current tick moved forward.
+ */
+static void
+cq_cascade(cqueue_t *cq, struct chash *ch)
+{
+	cevent_t *ev;
+
+	while (NULL != (ev = ch->ch_head)) {
+		ch_remove(cq, ev);
+		ch_append(cq, cq_wheel_slot(cq, EV_TICK(ev->ce_time)), ev);
+		cq->cq_cascaded++;
+	}
+}
+
+/**
+ * Move the current tick of the timing wheel forward, cascading the events
+ * from the upper levels as we reach the start of new rounds.
+ *
+ * When the lowest levels are empty, we can skip all the ticks up to the
+ * start of the next round of the first non-empty level, since there is
+ * nothing to expire or cascade in-between.
+ *
+ * @param cq		the callout queue
+ * @param target	the tick we want to reach, which we shall not go past
+ */
+static void
+cq_wheel_advance(cqueue_t *cq, cq_time_t target)
+{
+	cq_time_t tick;
+	uint level;
+
+	g_assert(cq->cq_tick < target);
+
+	for (level = 0; level <= CQ_WHEEL_LEVELS; level++) {
+		if (cq->cq_level[level] != 0)
+			break;
+	}
+
+	if (0 == level) {
+		tick = cq->cq_tick + 1;
+	} else if (level > CQ_WHEEL_LEVELS) {
+		tick = target;					/* Wheel is empty */
+	} else {
+		uint shift = level * CQ_WHEEL_BITS;
+		tick = ((cq->cq_tick >> shift) + 1) << shift;
+		tick = MIN(tick, target);
+	}
+
+	cq->cq_tick = tick;
+
+	/*
+	 * Cascade from the highest level down, since cascading a slot can move
+	 * events into the slot we need to cascade at the level below.
+	 */
+
+	for (level = CQ_WHEEL_LEVELS; level != 0; level--) {
+		uint shift = level * CQ_WHEEL_BITS;
+		cq_time_t mask = ((cq_time_t) 1 << shift) - 1;
+
+		if (0 != (tick & mask))
+			continue;
+
+		if (CQ_WHEEL_LEVELS == level) {
+			if (cq->cq_level[level] != 0)
+				cq_cascade(cq, &cq->cq_overflow);
+		} else {
+			uint idx = (tick >> shift) & CQ_WHEEL_MASK;
+			struct chash *ch = &cq->cq_wheel[level * CQ_WHEEL_SIZE + idx];
+
+			if (ch->ch_head != NULL)
+				cq_cascade(cq, ch);
+		}
+	}
+}
+
+/**
+ * Collect the events of the current tick that are due into the batch.
+ *
+ * @param cq		the callout queue
+ * @param batch		the batch where expired events are collected
+ * @param all		if TRUE, the whole tick is expired
+ *
+ * @return the amount of events collected.
+ */
+static size_t
+cq_wheel_collect(cqueue_t *cq, struct chash *batch, bool all)
+{
+	struct chash *ch = &cq->cq_wheel[cq->cq_tick & CQ_WHEEL_MASK];
+	cevent_t *ev, *next;
+	size_t n = 0;
+
+	for (ev = ch->ch_head; ev != NULL; ev = next) {
+		next = ev->ce_bnext;
+
+		if (all || ev->ce_time <= cq->cq_time) {
+			ch_remove(cq, ev);
+			ch_append(cq, batch, ev);
+			n++;
+		}
+	}
+
+	return n;
+}
+
 /**
  * The heartbeat of our callout queue.
  *
@@ -1144,13 +1427,11 @@ cq_replace(cevent_t *ev, cq_service_t fn, void *arg)
 static size_t
 cq_clock(cqueue_t *cq, int elapsed)
 {
-	int bucket;
-	int last_bucket, old_last_bucket;
-	struct chash *ch, *old_current;
+	struct chash batch, *old_current;
 	cevent_t *ev;
 	const cevent_t *old_call;
 	bool old_call_extended, force_idle = FALSE;
-	cq_time_t now;
+	cq_time_t target;
 	size_t processed = 0;
 
 	cqueue_check(cq);
@@ -1161,10 +1442,9 @@ cq_clock(cqueue_t *cq, int elapsed)
 	 * Recursive calls are possible: in the middle of an event, we could
 	 * trigger something that will call cq_dispatch() manually for instance.
 	 *
-	 * Therefore, we save the cq_current and cq_last_bucket fields upon
-	 * entry and restore them at the end as appropriate. If cq_current is
-	 * NULL initially, it means we were not in the middle of any recursion
-	 * so we won't have to restore cq_last_bucket.
+	 * Therefore, we save the cq_current field upon entry and restore it
+	 * at the end.  Each run uses its own batch of expiring events, and the
+	 * events collected by an outer run stay in that run's batch.
 	 *
 	 * Note that we enforce recursive calls to cq_clock() to be on the
 	 * same thread due to the use of a mutex. However, each initial run of
@@ -1174,75 +1454,56 @@ cq_clock(cqueue_t *cq, int elapsed)
 	old_current = cq->cq_current;
 	old_call = cq->cq_call;
 	old_call_extended = cq->cq_call_extended;
-	old_last_bucket = cq->cq_last_bucket;
 
 	cq->cq_ticks++;
 	cq->cq_time += elapsed;
-	now = cq->cq_time;
-
-	bucket = cq->cq_last_bucket;		/* Bucket we traversed last time */
-	ch = &cq->cq_hash[bucket];
-	last_bucket = EV_HASH(now);			/* Last bucket to traverse now */
-
-	/*
-	 * If `elapsed' has overflowed the hash size, then we'll need to look at
-	 * all the buckets in the table (wrap around).
-	 */
-
-	if (EV_OVER(elapsed))
-		last_bucket = bucket;
-
-	/*
-	 * Since the hashed time is a not a strictly monotonic function of time,
-	 * we have to rescan the last bucket, in case the earliest event have
-	 * expired now, before moving forward.
-	 */
-
-	cq->cq_current = ch;
+	target = EV_TICK(cq->cq_time);
 
-	while ((ev = ch->ch_head) && ev->ce_time <= now) {
-		cq_expire_internal(cq, ev);
-		processed++;
-	}
+	ZERO(&batch);
+	cq->cq_current = &batch;
 
 	/*
-	 * If we don't have to move forward (elapsed is too small), we're done.
+	 * Expire all the ticks up to the current time, one batch per tick.
+	 *
+	 * The last tick is only partially expired: events scheduled after the
+	 * current time remain in the wheel, and will be triggered by a later run.
+	 *
+	 * Because the wheel slots are not sorted, each batch is sorted before
+	 * being dispatched, so that events are triggered by increasing time and,
+	 * for the same trigger time, in the order they were inserted.
 	 */
 
-	if (cq->cq_last_bucket == last_bucket && !EV_OVER(elapsed))
-		goto done;
-
-	cq->cq_last_bucket = last_bucket;
+	for (;;) {
+		size_t n = cq_wheel_collect(cq, &batch, cq->cq_tick < target);
 
-	do {
-		ch++;
-		if (++bucket >= HASH_SIZE) {
-			bucket = 0;
-			ch = cq->cq_hash;
+		if (n != 0) {
+			ch_sort(&batch);
+			if G_UNLIKELY(n > cq->cq_batch_max)
+				cq->cq_batch_max = n;
 		}
 
 		/*
-		 * Since each bucket is sorted, we can stop our walkthrough as
-		 * soon as we reach an event scheduled after `now'.
+		 * Since the callbacks can cancel or reschedule events in the batch,
+		 * including the ones they are not dispatching, we always fire the
+		 * head of the batch.  Events rescheduled before the current time
+		 * are inserted in the batch at the proper place.
 		 */
 
-		cq->cq_current = ch;
-
-		while ((ev = ch->ch_head) && ev->ce_time <= now) {
+		while (NULL != (ev = batch.ch_head)) {
 			cq_expire_internal(cq, ev);
 			processed++;
 		}
 
-	} while (bucket != last_bucket);
+		if (cq->cq_tick >= target)
+			break;
+
+		cq_wheel_advance(cq, target);
+	}
 
-done:
 	cq->cq_current = old_current;
 	cq->cq_call = old_call;
 	cq->cq_call_extended = old_call_extended;
 
-	if G_UNLIKELY(old_current != NULL)
-		cq->cq_last_bucket = old_last_bucket;	/* Was in recursive call */
-
 	if (cq_debugging(5)) {
 		s_debug("CQ: %squeue \"%s\" %striggered %zu event%s (%d item%s)",
 			cq->cq_magic == CSUBQUEUE_MAGIC ? "sub" : "",
@@ -1284,6 +1545,70 @@ done:
 	return processed;		/* Do not count idle events */
 }
 
+/**
+ * Compute the earliest trigger time of the events held in the queue.
+ *
+ * For events in the upper levels of the wheel, we only return a lower bound,
+ * the starting time of the slot holding them: when that time is reached,
+ * the slot will have been cascaded and we will be able to be more precise.
+ *
+ * @return the earliest trigger time, or the maximum time if queue is empty.
+ */
+static cq_time_t
+cq_wheel_earliest(const cqueue_t *cq)
+{
+	const struct chash *ch;
+	const cevent_t *ev;
+	cq_time_t earliest = MAX_INT_VAL(cq_time_t);
+	uint level;
+
+	assert_mutex_is_owned(&cq->cq_lock);
+
+	/*
+	 * If we are in a callback, the remaining events in the batch are due.
+	 */
+
+	if (cq->cq_current != NULL && cq->cq_current->ch_head != NULL)
+		return cq->cq_current->ch_head->ce_time;
+
+	for (level = 0; level < CQ_WHEEL_LEVELS; level++) {
+		uint shift = level * CQ_WHEEL_BITS;
+		uint i;
+
+		if (0 == cq->cq_level[level])
+			continue;
+
+		for (i = (cq->cq_tick >> shift) & CQ_WHEEL_MASK; i < CQ_WHEEL_SIZE; i++) {
+			cq_time_t start;
+
+			ch = &cq->cq_wheel[level * CQ_WHEEL_SIZE + i];
+
+			if (NULL == ch->ch_head)
+				continue;
+
+			/*
+			 * Level 0 slots only hold events for a single tick, so they
+			 * are small enough to be scanned for the exact minimum.
+			 */
+
+			if (0 == level) {
+				for (ev = ch->ch_head; ev != NULL; ev = ev->ce_bnext)
+					earliest = MIN(earliest, ev->ce_time);
+				return earliest;
+			}
+
+			start = cq->cq_tick >> (shift + CQ_WHEEL_BITS);
+			start = (start << CQ_WHEEL_BITS) + i;
+			return (start << shift) << CQ_TICK_SHIFT;
+		}
+	}
+
+	for (ev = cq->cq_overflow.ch_head; ev != NULL; ev = ev->ce_bnext)
+		earliest = MIN(earliest, ev->ce_time);
+
+	return earliest;
+}
+
 /**
  * Compute delay until the next registered event, expressed in units of the
  * callout queue "virtual time".
@@ -1303,46 +1628,19 @@ int
 cq_delay(const cqueue_t *cq)
 {
 	int delay = MAX_INT_VAL(int);
-	int last_bucket;
-	int i;
-	cq_time_t now;
+	cq_time_t earliest;
 	bool adjusted = FALSE;
 
 	cqueue_check(cq);
 
 	mutex_lock_const(&cq->cq_lock);
 
-	last_bucket = cq->cq_last_bucket;	/* Last bucket scanned */
-	now = cq->cq_time;
-
-	for (i = 0; i < HASH_SIZE; i++) {
-		int b = (last_bucket + i) & HASH_MASK;
-		struct chash *ch = &cq->cq_hash[b];
-		cevent_t *ev = ch->ch_head;
-		int edelay;
-
-		/*
-		 * If the delay we have so far is not too large (does not overflow
-		 * the size of the hashing array) and we have moved away from the
-		 * last scanned bucket by an amount that is large-enough, we know
-		 * we cannot find a smaller delay ahead in the buckets.
-		 */
-
-		if (!EV_OVER(delay) && i > EV_HASH(delay))
-			break;
+	earliest = cq_wheel_earliest(cq);
 
-		if (NULL == ev)
-			continue;
-
-		edelay = ev->ce_time - now;
-
-		if G_UNLIKELY(edelay <= 0) {
-			delay = 0;
-			break;
-		}
-
-		delay = MIN(delay, edelay);
-	}
+	if (earliest <= cq->cq_time)
+		delay = 0;
+	else if (earliest - cq->cq_time < (cq_time_t) MAX_INT_VAL(int))
+		delay = earliest - cq->cq_time;
 
 	/*
 	 * If there are idle events registered in the queue, then we need to make
@@ -1369,9 +1667,8 @@ cq_delay(const cqueue_t *cq)
 	mutex_unlock_const(&cq->cq_lock);
 
 	if (cq_debugging(4)) {
-		s_debug("%s(%s): %smin delay is %d, scanned %d bucket%s",
-			G_STRFUNC, cq->cq_name, adjusted ? "adjusted " : "",
-			delay, i, plural(i));
+		s_debug("%s(%s): %smin delay is %d",
+			G_STRFUNC, cq->cq_name, adjusted ? "adjusted " : "", delay);
 	}
 
 	return delay;
@@ -1778,7 +2075,7 @@ cq_periodic_remove(cperiodic_t **cp_ptr)
  *** out of the main callout queue.
  ***
  *** The aim is to be able to have different scheduling periods for different
- *** activitie and not clutter the hash buckets of the main callout queue with
+ *** activitie and not clutter the timing wheel of the main callout queue with
  *** too many entries.
  ***
  *** Sub-systems making an heavy usage of callout events or which can
@@ -2163,7 +2460,7 @@ cq_global_init(void)
 void
 cq_init(cq_invoke_t idle, const uint32 *debug)
 {
-	STATIC_ASSERT(IS_POWER_OF_2(HASH_SIZE));
+	STATIC_ASSERT(CQ_WHEEL_LEVELS * CQ_WHEEL_BITS < 64 - CQ_TICK_SHIFT);
 
 	/*
 	 * Loudly warn if the callout queue already exists when this routine
@@ -2260,7 +2557,7 @@ cq_free(cqueue_t *cq)
 {
 	cevent_t *ev;
 	cevent_t *ev_next;
-	int i;
+	uint i;
 	struct chash *ch;
 
 	cqueue_check(cq);
@@ -2274,7 +2571,9 @@ cq_free(cqueue_t *cq)
 
 	mutex_lock(&cq->cq_lock);
 
-	for (ch = cq->cq_hash, i = 0; i < HASH_SIZE; i++, ch++) {
+	for (ch = cq->cq_wheel, i = 0; i <= CQ_WHEEL_SLOTS; i++, ch++) {
+		if G_UNLIKELY(CQ_WHEEL_SLOTS == i)
+			ch = &cq->cq_overflow;
 		for (ev = ch->ch_head; ev; ev = ev_next) {
 			ev_next = ev->ce_bnext;
 			ev_free(ev);
@@ -2291,7 +2590,7 @@ cq_free(cqueue_t *cq)
 		hset_free_null(&cq->cq_idle);
 	}
 
-	XFREE_NULL(cq->cq_hash);
+	XFREE_NULL(cq->cq_wheel);
 	atom_str_free_null(&cq->cq_name);
 
 	/*
@@ -2399,6 +2698,8 @@ cq_info_list(void)
 		cqi->period = cq->cq_period;
 		cqi->heartbeat_count = cq->cq_ticks;
 		cqi->triggered_count = cq->cq_triggered;
+		cqi->cascaded_count = cq->cq_cascaded;
+		cqi->batch_max = cq->cq_batch_max;
 		cqi->last_idle = cq->cq_last_idle;
 		CQ_UNLOCK(cq);
 
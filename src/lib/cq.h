@@ -75,6 +75,8 @@ typedef struct {
 	size_t event_count;			/**< Amount of registered events */
 	size_t heartbeat_count;		/**< Amount of heartbeats */
 	size_t triggered_count;		/**< Amount of triggered events */
+	size_t cascaded_count;		/**< Events cascaded between wheel levels */
+	size_t batch_max;			/**< Largest amount of events in one tick */
 	int period;					/**< Period, in ms */
 	time_t last_idle;			/**< Last idle scheduling */
 } cq_info_t;
@@ -47,6 +47,7 @@
 
 #include "dbmap.h"
 
+#include "bptree.h"
 #include "bstr.h"
 #include "debug.h"
 #include "map.h"
@@ -79,6 +80,10 @@ struct dbmap {
 			time_t last_check;		/**< When we last checked keys */
 			unsigned is_volatile:1;	/**< Whether DB can be discarded */
 		} s;
+		struct {
+			bptree_t *bt;
+			unsigned is_volatile:1;	/**< Whether DB can be discarded */
+		} b;
 	} u;
 	size_t key_size;		/**< Constant width keys are a requirement */
 	dbmap_keylen_t key_len;	/**< Optional, computes serialized key length */
@@ -292,6 +297,34 @@ dbmap_sdbm_error_check(const dbmap_t *dm)
 	return FALSE;
 }
 
+/**
+ * Check for B+tree errors, recording them in the DB map.
+ *
+ * @return TRUE if an I/O error occurred.
+ */
+static bool
+dbmap_btree_error_check(const dbmap_t *dm)
+{
+	dbmap_check(dm);
+	g_assert(DBMAP_BTREE == dm->type);
+
+	if (bptree_error(dm->u.b.bt)) {
+		dbmap_t *dmw = deconstify_pointer(dm);
+		dmw->ioerr = TRUE;
+		dmw->had_ioerr = TRUE;
+		dmw->error = errno;
+		if (dm->u.b.is_volatile)
+			bptree_clearerr(dm->u.b.bt);
+		return TRUE;
+	} else if (dm->ioerr) {
+		dbmap_t *dmw = deconstify_pointer(dm);
+		dmw->ioerr = FALSE;
+		dmw->error = 0;
+	}
+
+	return FALSE;
+}
+
 /**
  * Helper routine to count keys in an opened SDBM database.
  */
@@ -432,6 +465,22 @@ dbmap_type(const dbmap_t *dm)
 	return dm->type;
 }
 
+/**
+ * @return the name of the DB map type, for logging.
+ */
+const char *
+dbmap_type_to_string(enum dbmap_type type)
+{
+	switch (type) {
+	case DBMAP_MAP:		return "map";
+	case DBMAP_SDBM:	return "sdbm";
+	case DBMAP_BTREE:	return "btree";
+	case DBMAP_MAXTYPE:	break;
+	}
+
+	return "unknown";
+}
+
 /**
  * @return amount of items held in map
  */
@@ -530,6 +579,52 @@ dbmap_create_sdbm(size_t ksize, dbmap_keylen_t klen,
 	return dm;
 }
 
+/**
+ * Create a DB map implemented as a B+tree database, whose keys are kept
+ * sorted so that ranges of keys can be iterated over efficiently.
+ *
+ * Keys are ordered as byte strings, through their serialized form.
+ *
+ * When klen is NULL, ksize is the expected constant key length.
+ * When klen is not NULL, ksize is the expected maximum key length
+ * and the klen routine is used to compute the actual size of the key
+ * based on its serialized form.
+ *
+ * @param ksize		expected constant key length
+ * @param klen		optional, computes serialized key length
+ * @param name		name of the database, for logging (may be NULL)
+ * @param path		path of the database file
+ * @param flags		opening flags
+ * @param mode		file permissions
+ *
+ * @return the opened database, or NULL if an error occurred during opening.
+ */
+dbmap_t *
+dbmap_create_btree(size_t ksize, dbmap_keylen_t klen,
+	const char *name, const char *path, int flags, int mode)
+{
+	dbmap_t *dm;
+	bptree_t *bt;
+
+	g_assert(ksize != 0);
+	g_assert(ksize <= BPTREE_MAXKEY);
+	g_assert(path);
+
+	bt = bptree_open(name, path, flags, mode);
+	if (NULL == bt)
+		return NULL;
+
+	WALLOC0(dm);
+	dm->magic = DBMAP_MAGIC;
+	dm->type = DBMAP_BTREE;
+	dm->key_size = ksize;
+	dm->key_len = klen;
+	dm->u.b.bt = bt;
+	dm->count = bptree_count(bt);
+
+	return dm;
+}
+
 /**
  * Create a map out of an existing map.
  * Use dbmap_release() to discard the dbmap encapsulation.
@@ -679,6 +774,23 @@ dbmap_insert(dbmap_t *dm, const void *key, dbmap_datum_t value)
 				dm->count++;
 		}
 		break;
+	case DBMAP_BTREE:
+		{
+			bool existed = FALSE;
+			int ret;
+
+			errno = dm->error = 0;
+			ret = bptree_store(dm->u.b.bt, key, dbmap_keylen(dm, key),
+				value.data, value.len, &existed);
+			if (0 != ret) {
+				if (!dbmap_btree_error_check(dm))
+					dm->error = errno;
+				return FALSE;
+			}
+			if (!existed)
+				dm->count++;
+		}
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -757,6 +869,25 @@ dbmap_remove(dbmap_t *dm, const void *key)
 			}
 		}
 		break;
+	case DBMAP_BTREE:
+		{
+			int ret;
+
+			errno = dm->error = 0;
+			ret = bptree_delete(dm->u.b.bt, key, dbmap_keylen(dm, key));
+			dbmap_btree_error_check(dm);
+			if (-1 == ret) {
+				/* Could be that value was not found, errno == 0 then */
+				if (errno != 0) {
+					dm->error = errno;
+					return FALSE;
+				}
+			} else {
+				g_assert(dm->count);
+				dm->count--;
+			}
+		}
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -792,6 +923,19 @@ dbmap_contains(dbmap_t *dm, const void *key)
 			}
 			return 0 != ret;
 		}
+	case DBMAP_BTREE:
+		{
+			int ret;
+
+			dm->error = errno = 0;
+			ret = bptree_exists(dm->u.b.bt, key, dbmap_keylen(dm, key));
+			dbmap_btree_error_check(dm);
+			if (-1 == ret) {
+				dm->error = errno;
+				return FALSE;
+			}
+			return 0 != ret;
+		}
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -839,6 +983,19 @@ dbmap_lookup(dbmap_t *dm, const void *key)
 			result.len = value.dsize;
 		}
 		break;
+	case DBMAP_BTREE:
+		{
+			size_t len = 0;
+
+			errno = dm->error = 0;
+			result.data = deconstify_pointer(
+				bptree_fetch(dm->u.b.bt, key, dbmap_keylen(dm, key), &len));
+			dbmap_btree_error_check(dm);
+			if (errno)
+				dm->error = errno;
+			result.len = len;
+		}
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -859,6 +1016,8 @@ dbmap_implementation(const dbmap_t *dm)
 		return dm->u.m.map;
 	case DBMAP_SDBM:
 		return dm->u.s.sdbm;
+	case DBMAP_BTREE:
+		return dm->u.b.bt;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -905,7 +1064,7 @@ free_kv(void *key, void *value, void *u)
  * Destroy a DB map.
  *
  * A memory-backed map is lost.
- * An SDBM-backed map is lost if marked volatile.
+ * An SDBM-backed or B+tree-backed map is lost if marked volatile.
  */
 void
 dbmap_destroy(dbmap_t *dm)
@@ -920,6 +1079,9 @@ dbmap_destroy(dbmap_t *dm)
 	case DBMAP_SDBM:
 		sdbm_close(dm->u.s.sdbm);
 		break;
+	case DBMAP_BTREE:
+		bptree_close(dm->u.b.bt);
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -949,6 +1111,24 @@ insert_key(void *key, void *unused_value, void *u)
 	ctx->sl = pslist_prepend(ctx->sl, kdup);
 }
 
+/**
+ * B+tree iterator to insert a copy of the keys into a singly-linked list.
+ */
+static void
+insert_btree_key(const void *key, size_t klen,
+	const void *unused_value, size_t unused_vlen, void *u)
+{
+	struct insert_ctx *ctx = u;
+
+	(void) unused_value;
+	(void) unused_vlen;
+
+	if (dbmap_keylen(ctx->dm, key) != klen)
+		return;		/* Invalid key, corrupted file? */
+
+	ctx->sl = pslist_prepend(ctx->sl, wcopy(key, klen));
+}
+
 /**
  * Snapshot all the constant-width keys, returning them in a singly linked list.
  * To free the returned keys, use the dbmap_free_all_keys() helper.
@@ -993,6 +1173,18 @@ dbmap_all_keys(const dbmap_t *dm)
 			dbmap_sdbm_error_check(dm);
 		}
 		break;
+	case DBMAP_BTREE:
+		{
+			struct insert_ctx ctx;
+
+			ctx.sl = NULL;
+			ctx.dm = dm;
+			bptree_foreach_range(dm->u.b.bt, NULL, 0, NULL, 0,
+				insert_btree_key, &ctx);
+			dbmap_btree_error_check(dm);
+			sl = ctx.sl;
+		}
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1015,8 +1207,8 @@ dbmap_free_all_keys(const dbmap_t *dm, pslist_t *keys)
 }
 
 /**
- * Structure used as context by dbmap_foreach_*trampoline() and
- * dbmap_foreach_*sdbm().
+ * Structure used as context by dbmap_foreach_*trampoline(),
+ * dbmap_foreach_*sdbm() and dbmap_foreach_*btree().
  */
 struct foreach_ctx {
 	union {
@@ -1024,7 +1216,7 @@ struct foreach_ctx {
 		dbmap_cbr_t cbr;
 	} u;
 	void *arg;
-	const dbmap_t *dm;		/* Used only by SDBM iterators */
+	const dbmap_t *dm;		/* Used only by SDBM and B+tree iterators */
 	size_t deleted;			/* Used only by SDBM removal iterators */
 };
 
@@ -1103,6 +1295,44 @@ dbmap_foreach_remove_sdbm(const datum key, const datum value, void *arg)
 	return to_remove;
 }
 
+/**
+ * Trampoline to invoke the B+tree iterator and do the proper casts.
+ */
+static void
+dbmap_foreach_btree(const void *key, size_t klen,
+	const void *value, size_t vlen, void *arg)
+{
+	dbmap_datum_t d;
+	struct foreach_ctx *ctx = arg;
+
+	if (dbmap_keylen(ctx->dm, key) != klen)
+		return;		/* Invalid key, corrupted file? */
+
+	d.data = deconstify_pointer(value);
+	d.len  = vlen;
+
+	(*ctx->u.cb)(deconstify_pointer(key), &d, ctx->arg);
+}
+
+/**
+ * Trampoline to invoke the B+tree iterator and do the proper casts.
+ */
+static bool
+dbmap_foreach_remove_btree(const void *key, size_t klen,
+	const void *value, size_t vlen, void *arg)
+{
+	dbmap_datum_t d;
+	struct foreach_ctx *ctx = arg;
+
+	if (dbmap_keylen(ctx->dm, key) != klen)
+		return FALSE;		/* Invalid key, corrupted file, keep it */
+
+	d.data = deconstify_pointer(value);
+	d.len  = vlen;
+
+	return (*ctx->u.cbr)(deconstify_pointer(key), &d, ctx->arg);
+}
+
 /**
  * Reset count of items.
  *
@@ -1157,6 +1387,12 @@ dbmap_foreach(const dbmap_t *dm, dbmap_cb_t cb, void *arg)
 				dbmap_reset_count(dm, count);
 		}
 		break;
+	case DBMAP_BTREE:
+		ctx.dm = dm;
+		bptree_foreach_range(dm->u.b.bt, NULL, 0, NULL, 0,
+			dbmap_foreach_btree, &ctx);
+		dbmap_btree_error_check(dm);
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1205,6 +1441,13 @@ dbmap_foreach_remove(const dbmap_t *dm, dbmap_cbr_t cbr, void *arg)
 			deleted = ctx.deleted;
 		}
 		break;
+	case DBMAP_BTREE:
+		ctx.dm = dm;
+		deleted = bptree_foreach_range_remove(dm->u.b.bt, NULL, 0, NULL, 0,
+			dbmap_foreach_remove_btree, &ctx);
+		dbmap_btree_error_check(dm);
+		dbmap_reset_count(dm, bptree_count(dm->u.b.bt));
+		break;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1212,23 +1455,336 @@ dbmap_foreach_remove(const dbmap_t *dm, dbmap_cbr_t cbr, void *arg)
 	return deleted;
 }
 
+/**
+ * Structure used as context by dbmap_range_*filter().
+ */
+struct range_ctx {
+	union {
+		dbmap_cb_t cb;
+		dbmap_cbr_t cbr;
+	} u;
+	void *arg;
+	const dbmap_t *dm;
+	const void *lo;
+	const void *hi;
+};
+
+/**
+ * Compare two serialized keys, as byte strings.
+ */
+static int
+dbmap_keycmp(const dbmap_t *dm, const void *a, const void *b)
+{
+	size_t alen = dbmap_keylen(dm, a), blen = dbmap_keylen(dm, b);
+	int c = memcmp(a, b, MIN(alen, blen));
+
+	return 0 != c ? c : CMP(alen, blen);
+}
+
+/**
+ * @return whether key lies within the range held in the context.
+ */
+static bool
+dbmap_range_contains(const struct range_ctx *ctx, const void *key)
+{
+	if (ctx->lo != NULL && dbmap_keycmp(ctx->dm, key, ctx->lo) < 0)
+		return FALSE;
+
+	if (ctx->hi != NULL && dbmap_keycmp(ctx->dm, key, ctx->hi) >= 0)
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * Iterator filtering keys outside of the range.
+ */
+static void
+dbmap_range_filter(void *key, dbmap_datum_t *value, void *arg)
+{
+	struct range_ctx *ctx = arg;
+
+	if (dbmap_range_contains(ctx, key))
+		(*ctx->u.cb)(key, value, ctx->arg);
+}
+
+/**
+ * Removal iterator filtering keys outside of the range.
+ */
+static bool
+dbmap_range_filter_remove(void *key, dbmap_datum_t *value, void *arg)
+{
+	struct range_ctx *ctx = arg;
+
+	if (dbmap_range_contains(ctx, key))
+		return (*ctx->u.cbr)(key, value, ctx->arg);
+
+	return FALSE;
+}
+
+/**
+ * Iterate over the keys of the map within [lo, hi), invoking the callback
+ * on each item along with the supplied argument.
+ *
+ * Keys are compared as byte strings, through their serialized form.
+ * A B+tree map only visits the keys within the range, in key order.  Other
+ * maps are fully traversed, in no particular order, and filtered.
+ *
+ * @param dm		the DB map
+ * @param lo		lowest serialized key of range, NULL for no lower bound
+ * @param hi		serialized key ending range (excluded), NULL for no limit
+ * @param cb		callback to invoke on each item
+ * @param arg		additional callback argument
+ */
+void
+dbmap_foreach_range(const dbmap_t *dm, const void *lo, const void *hi,
+	dbmap_cb_t cb, void *arg)
+{
+	dbmap_check(dm);
+	g_assert(cb);
+
+	if (DBMAP_BTREE == dm->type) {
+		struct foreach_ctx ctx;
+
+		ctx.u.cb = cb;
+		ctx.arg = arg;
+		ctx.dm = dm;
+
+		bptree_foreach_range(dm->u.b.bt,
+			lo, NULL == lo ? 0 : dbmap_keylen(dm, lo),
+			hi, NULL == hi ? 0 : dbmap_keylen(dm, hi),
+			dbmap_foreach_btree, &ctx);
+		dbmap_btree_error_check(dm);
+	} else {
+		struct range_ctx ctx;
+
+		ctx.u.cb = cb;
+		ctx.arg = arg;
+		ctx.dm = dm;
+		ctx.lo = lo;
+		ctx.hi = hi;
+
+		dbmap_foreach(dm, dbmap_range_filter, &ctx);
+	}
+}
+
+/**
+ * Iterate over the keys of the map within [lo, hi), invoking the callback
+ * on each item along with the supplied argument and removing the item when
+ * the callback returns TRUE.
+ *
+ * @see dbmap_foreach_range() for the iteration order.
+ *
+ * @return the amount of items deleted
+ */
+size_t
+dbmap_foreach_range_remove(const dbmap_t *dm,
+	const void *lo, const void *hi, dbmap_cbr_t cbr, void *arg)
+{
+	size_t deleted;
+
+	dbmap_check(dm);
+	g_assert(cbr);
+
+	if (DBMAP_BTREE == dm->type) {
+		struct foreach_ctx ctx;
+
+		ctx.u.cbr = cbr;
+		ctx.arg = arg;
+		ctx.dm = dm;
+
+		deleted = bptree_foreach_range_remove(dm->u.b.bt,
+			lo, NULL == lo ? 0 : dbmap_keylen(dm, lo),
+			hi, NULL == hi ? 0 : dbmap_keylen(dm, hi),
+			dbmap_foreach_remove_btree, &ctx);
+		dbmap_btree_error_check(dm);
+		dbmap_reset_count(dm, bptree_count(dm->u.b.bt));
+	} else {
+		struct range_ctx ctx;
+
+		ctx.u.cbr = cbr;
+		ctx.arg = arg;
+		ctx.dm = dm;
+		ctx.lo = lo;
+		ctx.hi = hi;
+
+		deleted = dbmap_foreach_remove(dm, dbmap_range_filter_remove, &ctx);
+	}
+
+	return deleted;
+}
+
+enum dbmap_bulk_magic { DBMAP_BULK_MAGIC = 0x2e7d14c9U };
+
+/**
+ * Bulk loading context.
+ */
+struct dbmap_bulk {
+	enum dbmap_bulk_magic magic;
+	dbmap_t *dm;				/**< The DB map being loaded */
+	struct sdbm_bulk *bulk;		/**< SDBM bulk loading, NULL if inserting */
+};
+
+static inline void
+dbmap_bulk_check(const dbmap_bulk_t *db)
+{
+	g_assert(db != NULL);
+	g_assert(DBMAP_BULK_MAGIC == db->magic);
+}
+
+/**
+ * Start bulk loading of the DB map.
+ *
+ * When the map is an empty SDBM database, all the pairs supplied through
+ * dbmap_bulk_add() are buffered and laid out in one sequential pass by
+ * dbmap_bulk_end().  Otherwise, or when there are too many pairs to buffer,
+ * pairs are simply inserted as they come.
+ *
+ * The DB map must not be otherwise modified until dbmap_bulk_end() is called.
+ *
+ * @return a bulk loading context.
+ */
+dbmap_bulk_t *
+dbmap_bulk_start(dbmap_t *dm)
+{
+	dbmap_bulk_t *db;
+
+	dbmap_check(dm);
+
+	WALLOC0(db);
+	db->magic = DBMAP_BULK_MAGIC;
+	db->dm = dm;
+
+	if (DBMAP_SDBM == dm->type) {
+		db->bulk = sdbm_bulk_start(dm->u.s.sdbm);
+
+		if (NULL == db->bulk && dbg_ds_debugging(dm->dbg, 1, DBG_DSF_INSERT)) {
+			dbg_ds_log(dm->dbg, dm, "%s: cannot bulk-load SDBM \"%s\": %m",
+				G_STRFUNC, sdbm_name(dm->u.s.sdbm));
+		}
+	}
+
+	return db;
+}
+
+/**
+ * Write all the pairs buffered so far, the remaining ones being inserted
+ * as they come.
+ *
+ * @return TRUE on success.
+ */
+static bool
+dbmap_bulk_flush(dbmap_bulk_t *db)
+{
+	dbmap_t *dm = db->dm;
+	long loaded;
+
+	g_assert(db->bulk != NULL);
+
+	errno = dm->error = 0;
+	loaded = sdbm_bulk_end(&db->bulk);
+
+	if (-1 == loaded) {
+		if (!dbmap_sdbm_error_check(dm))
+			dm->error = errno;
+		return FALSE;
+	}
+
+	dm->count += loaded;
+	return TRUE;
+}
+
+/**
+ * Add key/value pair to the DB map being bulk-loaded.
+ *
+ * The first value supplied for a key is the one that is kept.
+ *
+ * @return TRUE on success.
+ */
+bool
+dbmap_bulk_add(dbmap_bulk_t *db, const void *key, dbmap_datum_t value)
+{
+	dbmap_t *dm;
+	datum dkey, dval;
+
+	dbmap_bulk_check(db);
+
+	dm = db->dm;
+
+	if (NULL == db->bulk) {
+		if (dbmap_contains(dm, key))
+			return TRUE;
+		return dbmap_insert(dm, key, value);
+	}
+
+	dkey.dptr = deconstify_pointer(key);
+	dkey.dsize = dbmap_keylen(dm, key);
+	dval.dptr = deconstify_pointer(value.data);
+	dval.dsize = value.len;
+
+	if (-1 == sdbm_bulk_add(db->bulk, dkey, dval)) {
+		/*
+		 * Too many pairs to buffer them all: load those we have and insert
+		 * the remaining ones.
+		 */
+
+		if (EFBIG == errno) {
+			if (!dbmap_bulk_flush(db))
+				return FALSE;
+			return dbmap_bulk_add(db, key, value);
+		}
+
+		dm->error = errno;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * End bulk loading of the DB map, writing all the pairs to disk if they
+ * were buffered.  The bulk loading context is freed and nullified.
+ *
+ * @return TRUE on success.
+ */
+bool
+dbmap_bulk_end(dbmap_bulk_t **db_ptr)
+{
+	dbmap_bulk_t *db = *db_ptr;
+	bool ok = TRUE;
+
+	if (NULL == db)
+		return TRUE;
+
+	dbmap_bulk_check(db);
+
+	if (db->bulk != NULL)
+		ok = dbmap_bulk_flush(db);
+
+	db->magic = 0;
+	WFREE(db);
+	*db_ptr = NULL;
+
+	return ok;
+}
+
 static void
 dbmap_store_entry(void *key, dbmap_datum_t *d, void *arg)
 {
-	dbmap_insert(arg, key, *d);
+	dbmap_bulk_add(arg, key, *d);
 }
 
 /**
  * Store DB map to disk in an SDBM database, at the specified base.
  * Two files are created (using suffixes .pag and .dir).
  *
- * If the map was already backed by an SDBM database and ``inplace'' is TRUE,
- * then the map is simply persisted as such.  It is marked non-volatile as
- * a side effect.
+ * If the map was already backed by an SDBM or a B+tree database and
+ * ``inplace'' is TRUE, then the map is simply persisted as such.  It is
+ * marked non-volatile as a side effect.
  *
  * @param dm		the DB map to store
  * @param base		base path for the persistent database
- * @param inplace	if TRUE and map was an SDBM already, persist as itself
+ * @param inplace	if TRUE and map was on disk already, persist as itself
  *
  * @return TRUE on success.
  */
@@ -1236,6 +1792,7 @@ bool
 dbmap_store(dbmap_t *dm, const char *base, bool inplace)
 {
 	dbmap_t *ndm;
+	dbmap_bulk_t *bulk;
 	bool ok = TRUE;
 
 	dbmap_check(dm);
@@ -1253,6 +1810,11 @@ dbmap_store(dbmap_t *dm, const char *base, bool inplace)
 		/* FALL THROUGH */
 	}
 
+	if (inplace && DBMAP_BTREE == dm->type) {
+		dbmap_set_volatile(dm, FALSE);
+		return -1 != dbmap_sync(dm);
+	}
+
 	if (NULL == base)
 		return FALSE;
 
@@ -1265,9 +1827,14 @@ dbmap_store(dbmap_t *dm, const char *base, bool inplace)
 		return FALSE;
 	}
 
-	dbmap_foreach(dm, dbmap_store_entry, ndm);
+	/*
+	 * The new database is empty: bulk-load it to avoid page splits.
+	 */
 
-	if (sdbm_error(ndm->u.s.sdbm)) {
+	bulk = dbmap_bulk_start(ndm);
+	dbmap_foreach(dm, dbmap_store_entry, bulk);
+
+	if (!dbmap_bulk_end(&bulk) || sdbm_error(ndm->u.s.sdbm)) {
 		s_warning("SDBM \"%s\": cannot store to %s: errors during dump",
 			sdbm_name(dm->u.s.sdbm), base);
 		ok = FALSE;
@@ -1341,6 +1908,12 @@ dbmap_sync(dbmap_t *dm)
 		return 0;
 	case DBMAP_SDBM:
 		return sdbm_sync(dm->u.s.sdbm);
+	case DBMAP_BTREE:
+		{
+			ssize_t n = bptree_sync(dm->u.b.bt);
+			dbmap_btree_error_check(dm);
+			return n;
+		}
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1348,6 +1921,135 @@ dbmap_sync(dbmap_t *dm)
 	return 0;
 }
 
+/**
+ * Force the data written to the database files down to the disk.
+ *
+ * This does not flush any cached page, dbmap_sync() must be called first.
+ *
+ * @return TRUE if no error occurred.
+ */
+bool
+dbmap_fsync(dbmap_t *dm)
+{
+	dbmap_check(dm);
+
+	switch (dm->type) {
+	case DBMAP_MAP:
+		return TRUE;
+	case DBMAP_SDBM:
+		if (-1 == sdbm_fsync(dm->u.s.sdbm)) {
+			dm->ioerr = TRUE;
+			dm->had_ioerr = TRUE;
+			dm->error = errno;
+			return FALSE;
+		}
+		return TRUE;
+	case DBMAP_BTREE:
+		if (!bptree_fsync(dm->u.b.bt)) {
+			dm->ioerr = TRUE;
+			dm->had_ioerr = TRUE;
+			dm->error = errno;
+			return FALSE;
+		}
+		return TRUE;
+	case DBMAP_MAXTYPE:
+		g_assert_not_reached();
+	}
+
+	return FALSE;
+}
+
+enum dbmap_fsync_magic { DBMAP_FSYNC_MAGIC = 0x6b0d27e3 };
+
+/**
+ * A pending synchronization of the DB map files.
+ */
+struct dbmap_fsync {
+	enum dbmap_fsync_magic magic;
+	struct sdbm_fsync *sf;		/**< SDBM synchronization, NULL if none */
+};
+
+static inline void
+dbmap_fsync_check(const dbmap_fsync_t *fs)
+{
+	g_assert(fs != NULL);
+	g_assert(DBMAP_FSYNC_MAGIC == fs->magic);
+}
+
+/**
+ * Prepare for forcing the data written to the database files down to the
+ * disk, without keeping the map busy whilst the kernel is writing.
+ *
+ * This does not flush any cached page, dbmap_sync() must be called first.
+ * The returned object is then given to dbmap_fsync_finish(), which can be
+ * called from another thread whilst the map is used.
+ *
+ * @return synchronization object, NULL on error.
+ */
+dbmap_fsync_t *
+dbmap_fsync_start(dbmap_t *dm)
+{
+	dbmap_fsync_t *fs;
+	struct sdbm_fsync *sf = NULL;
+
+	dbmap_check(dm);
+
+	switch (dm->type) {
+	case DBMAP_MAP:
+		break;
+	case DBMAP_SDBM:
+		sf = sdbm_fsync_start(dm->u.s.sdbm);
+		if (NULL == sf) {
+			dm->ioerr = TRUE;
+			dm->had_ioerr = TRUE;
+			dm->error = errno;
+			return NULL;
+		}
+		break;
+	case DBMAP_BTREE:
+		/*
+		 * The B+tree cannot be synchronized asynchronously, do it now.
+		 */
+		if (!dbmap_fsync(dm))
+			return NULL;
+		break;
+	case DBMAP_MAXTYPE:
+		g_assert_not_reached();
+	}
+
+	WALLOC0(fs);
+	fs->magic = DBMAP_FSYNC_MAGIC;
+	fs->sf = sf;
+
+	return fs;
+}
+
+/**
+ * Complete the synchronization started by dbmap_fsync_start(), freeing the
+ * object and nullifying its pointer.
+ *
+ * This can be called from any thread and does not access the DB map.
+ *
+ * @return TRUE if the data is now on disk, FALSE on error with errno set.
+ */
+bool
+dbmap_fsync_finish(dbmap_fsync_t **fs_ptr)
+{
+	dbmap_fsync_t *fs = *fs_ptr;
+	bool ok = TRUE;
+
+	dbmap_fsync_check(fs);
+
+	if (fs->sf != NULL)
+		ok = 0 == sdbm_fsync_finish(&fs->sf);
+
+	fs->magic = 0;
+	WFREE(fs);
+	*fs_ptr = NULL;
+
+	return ok;
+}
+
 /**
  * Attempt to shrink the database.
  * @return TRUE if no error occurred.
@@ -1362,6 +2064,8 @@ dbmap_shrink(dbmap_t *dm)
 		return TRUE;
 	case DBMAP_SDBM:
 		return sdbm_shrink(dm->u.s.sdbm);
+	case DBMAP_BTREE:
+		return TRUE;		/* Free pages are reused, use dbmap_rebuild() */
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1383,6 +2087,34 @@ dbmap_rebuild(dbmap_t *dm)
 		return TRUE;
 	case DBMAP_SDBM:
 		return 0 == sdbm_rebuild(dm->u.s.sdbm);
+	case DBMAP_BTREE:
+		return bptree_rebuild(dm->u.b.bt);
+	case DBMAP_MAXTYPE:
+		g_assert_not_reached();
+	}
+
+	return FALSE;
+}
+
+/**
+ * Start incremental compaction of the database, which remains usable
+ * whilst dbmap_compact_step() is called to make progress.
+ *
+ * @return TRUE if compaction was started, FALSE if there is nothing to
+ * compact or on error.
+ */
+bool
+dbmap_compact_start(dbmap_t *dm)
+{
+	dbmap_check(dm);
+
+	switch (dm->type) {
+	case DBMAP_MAP:
+		return FALSE;
+	case DBMAP_SDBM:
+		return 0 == sdbm_compact_start(dm->u.s.sdbm);
+	case DBMAP_BTREE:
+		return FALSE;		/* Use dbmap_rebuild() */
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1390,6 +2122,47 @@ dbmap_rebuild(dbmap_t *dm)
 	return FALSE;
 }
 
+/**
+ * Perform one step of incremental compaction, migrating at most the given
+ * amount of pages.
+ *
+ * @param dm		the DB map being compacted
+ * @param pages		maximum amount of pages to migrate
+ * @param info		if non-NULL, filled with compaction progress
+ *
+ * @return 1 if there is more work, 0 when compaction is done, -1 on error
+ * with compaction aborted.
+ */
+int
+dbmap_compact_step(dbmap_t *dm, long pages, struct sdbm_compact_info *info)
+{
+	dbmap_check(dm);
+
+	switch (dm->type) {
+	case DBMAP_MAP:
+	case DBMAP_BTREE:
+		return 0;
+	case DBMAP_SDBM:
+		return sdbm_compact_step(dm->u.s.sdbm, pages, info);
+	case DBMAP_MAXTYPE:
+		g_assert_not_reached();
+	}
+
+	return -1;
+}
+
+/**
+ * Abort incremental compaction, if any.
+ */
+void
+dbmap_compact_abort(dbmap_t *dm)
+{
+	dbmap_check(dm);
+
+	if (DBMAP_SDBM == dm->type)
+		sdbm_compact_abort(dm->u.s.sdbm);
+}
+
 /**
  * Discard all data from the database.
  * @return TRUE if no error occurred.
@@ -1411,6 +2184,14 @@ dbmap_clear(dbmap_t *dm)
 			return TRUE;
 		}
 		return FALSE;
+	case DBMAP_BTREE:
+		if (bptree_clear(dm->u.b.bt)) {
+			bptree_clearerr(dm->u.b.bt);
+			dm->ioerr = FALSE;
+			dm->count = 0;
+			return TRUE;
+		}
+		return FALSE;
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1419,7 +2200,7 @@ dbmap_clear(dbmap_t *dm)
 }
 
 /**
- * Set SDBM cache size, in amount of pages (must be >= 1).
+ * Set SDBM or B+tree cache size, in amount of pages (must be >= 1).
  * @return 0 if OK, -1 on errors with errno set.
  */
 int
@@ -1432,6 +2213,8 @@ dbmap_set_cachesize(dbmap_t *dm, long pages)
 		return 0;
 	case DBMAP_SDBM:
 		return sdbm_set_cache(dm->u.s.sdbm, pages);
+	case DBMAP_BTREE:
+		return bptree_set_cache(dm->u.b.bt, pages);
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1440,7 +2223,7 @@ dbmap_set_cachesize(dbmap_t *dm, long pages)
 }
 
 /**
- * Turn SDBM deferred writes on or off.
+ * Turn SDBM or B+tree deferred writes on or off.
  * @return 0 if OK, -1 on errors with errno set.
  */
 int
@@ -1453,6 +2236,52 @@ dbmap_set_deferred_writes(dbmap_t *dm, bool on)
 		return 0;
 	case DBMAP_SDBM:
 		return sdbm_set_wdelay(dm->u.s.sdbm, on);
+	case DBMAP_BTREE:
+		return bptree_set_wdelay(dm->u.b.bt, on);
+	case DBMAP_MAXTYPE:
+		g_assert_not_reached();
+	}
+
+	return 0;
+}
+
+/**
+ * Turn SDBM memory-mapped file access on or off.
+ * @return 0 if OK, -1 on errors with errno set.
+ */
+int
+dbmap_set_mmap(dbmap_t *dm, bool on)
+{
+	dbmap_check(dm);
+
+	switch (dm->type) {
+	case DBMAP_MAP:
+	case DBMAP_BTREE:
+		return 0;
+	case DBMAP_SDBM:
+		return sdbm_set_mmap(dm->u.s.sdbm, on);
+	case DBMAP_MAXTYPE:
+		g_assert_not_reached();
+	}
+
+	return 0;
+}
+
+/**
+ * Turn SDBM background flushing of dirty pages on or off.
+ * @return 0 if OK, -1 on errors with errno set.
+ */
+int
+dbmap_set_bgflush(dbmap_t *dm, bool on)
+{
+	dbmap_check(dm);
+
+	switch (dm->type) {
+	case DBMAP_MAP:
+	case DBMAP_BTREE:
+		return 0;
+	case DBMAP_SDBM:
+		return sdbm_set_bgflush(dm->u.s.sdbm, on);
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1461,7 +2290,7 @@ dbmap_set_deferred_writes(dbmap_t *dm, bool on)
 }
 
 /**
- * Tell SDBM whether it is volatile.
+ * Tell SDBM or B+tree whether it is volatile.
  * @return 0 if OK, -1 on errors with errno set.
  */
 int
@@ -1475,6 +2304,9 @@ dbmap_set_volatile(dbmap_t *dm, bool is_volatile)
 	case DBMAP_SDBM:
 		dm->u.s.is_volatile = booleanize(is_volatile);
 		return sdbm_set_volatile(dm->u.s.sdbm, is_volatile);
+	case DBMAP_BTREE:
+		dm->u.b.is_volatile = booleanize(is_volatile);
+		return bptree_set_volatile(dm->u.b.bt, is_volatile);
 	case DBMAP_MAXTYPE:
 		g_assert_not_reached();
 	}
@@ -1494,7 +2326,7 @@ dbmap_set_debugging(dbmap_t *dm, const dbg_config_t *dbg)
 
 	if (dbg_ds_debugging(dm->dbg, 1, DBG_DSF_DEBUGGING)) {
 		dbg_ds_log(dm->dbg, dm, "%s: attached with %s back-end (count=%zu)",
-			G_STRFUNC, DBMAP_SDBM == dm->type ? "sdbm" : "map", dm->count);
+			G_STRFUNC, dbmap_type_to_string(dm->type), dm->count);
 	}
 }
 
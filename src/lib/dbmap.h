@@ -45,6 +45,7 @@
 enum dbmap_type {
 	DBMAP_MAP = 0,			/* Map in memory */
 	DBMAP_SDBM,				/* SDBM database */
+	DBMAP_BTREE,			/* B+tree database, ordered */
 
 	DBMAP_MAXTYPE
 };
@@ -52,6 +53,12 @@ enum dbmap_type {
 struct dbmap;
 typedef struct dbmap dbmap_t;
 
+struct dbmap_bulk;
+typedef struct dbmap_bulk dbmap_bulk_t;
+
+struct dbmap_fsync;
+typedef struct dbmap_fsync dbmap_fsync_t;
+
 typedef struct dbmap_datum {
 	void *data;
 	size_t len;
@@ -79,6 +86,8 @@ dbmap_t *dbmap_create_hash(size_t ks, dbmap_keylen_t kl,
 	hash_fn_t hashf, eq_fn_t key_eqf);
 dbmap_t * dbmap_create_sdbm(size_t ks, dbmap_keylen_t kl, const char *name,
 	const char *path, int flags, int mode);
+dbmap_t *dbmap_create_btree(size_t ks, dbmap_keylen_t kl, const char *name,
+	const char *path, int flags, int mode);
 dbmap_t *dbmap_create_from_map(size_t ks, dbmap_keylen_t kl, map_t *map);
 dbmap_t *dbmap_create_from_sdbm(const char *name,
 	size_t ks, dbmap_keylen_t kl, DBM *sdbm);
@@ -101,10 +110,15 @@ dbmap_keylen_t dbmap_key_length(const dbmap_t *dm);
 bool dbmap_has_ioerr(const dbmap_t *dm);
 const char *dbmap_strerror(const dbmap_t *dm);
 enum dbmap_type dbmap_type(const dbmap_t *dm);
+const char *dbmap_type_to_string(enum dbmap_type type);
 size_t dbmap_count(const dbmap_t *dm);
 
 void dbmap_foreach(const dbmap_t *dm, dbmap_cb_t cb, void *arg);
 size_t dbmap_foreach_remove(const dbmap_t *dm, dbmap_cbr_t cbr, void *arg);
+void dbmap_foreach_range(const dbmap_t *dm, const void *lo, const void *hi,
+	dbmap_cb_t cb, void *arg);
+size_t dbmap_foreach_range_remove(const dbmap_t *dm,
+	const void *lo, const void *hi, dbmap_cbr_t cbr, void *arg);
 
 /**
  * Key snapshot utilities.
@@ -117,12 +131,23 @@ struct dbg_config;
 
 bool dbmap_store(dbmap_t *dm, const char *base, bool inplace);
 bool dbmap_copy(dbmap_t *from, dbmap_t *to);
+dbmap_bulk_t *dbmap_bulk_start(dbmap_t *dm);
+bool dbmap_bulk_add(dbmap_bulk_t *db, const void *key, dbmap_datum_t value);
+bool dbmap_bulk_end(dbmap_bulk_t **db_ptr);
 bool dbmap_shrink(dbmap_t *dm);
 bool dbmap_rebuild(dbmap_t *dm);
+bool dbmap_compact_start(dbmap_t *dm);
+int dbmap_compact_step(dbmap_t *dm, long pages, struct sdbm_compact_info *info);
+void dbmap_compact_abort(dbmap_t *dm);
 bool dbmap_clear(dbmap_t *dm);
 ssize_t dbmap_sync(dbmap_t *dm);
+bool dbmap_fsync(dbmap_t *dm);
+dbmap_fsync_t *dbmap_fsync_start(dbmap_t *dm);
+bool dbmap_fsync_finish(dbmap_fsync_t **fs_ptr);
 int dbmap_set_cachesize(dbmap_t *dm, long pages);
 int dbmap_set_deferred_writes(dbmap_t *dm, bool on);
+int dbmap_set_mmap(dbmap_t *dm, bool on);
+int dbmap_set_bgflush(dbmap_t *dm, bool on);
 int dbmap_set_volatile(dbmap_t *dm, bool is_volatile);
 void dbmap_set_debugging(dbmap_t *dm, const struct dbg_config *dbg);
 
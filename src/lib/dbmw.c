@@ -36,16 +36,21 @@
 
 #include "dbmw.h"
 
+#include "atoms.h"
 #include "bstr.h"
 #include "dbmap.h"
+#include "dbwal.h"
 #include "debug.h"
-#include "hashlist.h"
+#include "elist.h"
+#include "hashing.h"
 #include "map.h"
 #include "misc.h"				/* For english_strerror() */
+#include "mutex.h"
 #include "pmsg.h"
 #include "pslist.h"
 #include "stacktrace.h"
 #include "stringify.h"
+#include "tm.h"
 #include "walloc.h"
 #include "zalloc.h"
 
@@ -53,8 +58,42 @@
 
 #define DBMW_CACHE	128			/**< Default amount of items to cache */
 
+#define DBMW_SHARD_BITS		3		/**< At most 2^3 shards per cache */
+#define DBMW_SHARD_MIN		256		/**< Minimum amount of items per shard */
+#define DBMW_ADAPT_PERIOD	60		/**< Secs between cache size adaptations */
+#define DBMW_ADAPT_MIN		256		/**< Min accesses to adapt cache size */
+#define DBMW_GROW_MAX		8		/**< Maximum cache growth factor */
+#define DBMW_BUDGET			(16 * 1024 * 1024)	/**< Default memory budget */
+
 enum dbmw_magic { DBMW_MAGIC = 0x28e7e7d2U };
 
+/**
+ * Cache statistics.
+ */
+struct dbmw_cstats {
+	uint64 r_access;			/**< Number of read accesses */
+	uint64 w_access;			/**< Number of write accesses */
+	uint64 r_hits;				/**< Number of read cache hits */
+	uint64 w_hits;				/**< Number of write cache hits */
+	uint64 evictions;			/**< Number of entries evicted from cache */
+	uint64 writebacks;			/**< Number of dirty entries written back */
+};
+
+/**
+ * A cache shard.
+ *
+ * Entries are linked in a ring swept by the CLOCK hand, which sits at the
+ * head of the list.  Cache hits only set the "referenced" bit of the entry,
+ * and the hand gives referenced entries a second chance by moving them to
+ * the tail after clearing their bit.
+ */
+struct dbmw_shard {
+	map_t *values;				/**< Map of values cached */
+	elist_t clock;				/**< CLOCK ring of cached entries */
+	size_t max_cached;			/**< Max amount of items to cache in shard */
+	struct dbmw_cstats stats;	/**< Shard statistics */
+};
+
 /**
  * Our DBM wrapper.
  */
@@ -64,23 +103,26 @@ struct dbmw {
 	const char *name;			/**< DB name, for logging */
 	pmsg_t *mb;					/**< Message block used for serialization */
 	bstr_t *bs;					/**< Binary stream used for deserialization */
-	hash_list_t *keys;			/**< LRU list of keys cached */
-	map_t *values;				/**< Map of values cached */
-	uint64 r_access;			/**< Number of read accesses */
-	uint64 w_access;			/**< Number of write accesses */
-	uint64 r_hits;				/**< Number of read cache hits */
-	uint64 w_hits;				/**< Number of write cache hits */
+	struct dbmw_shard *shards;	/**< Cache shards */
+	hash_fn_t hash;				/**< Key hash function, to select shards */
+	link_t lnk;					/**< Links all the DBMW objects */
+	struct dbmw_cstats last;	/**< Statistics at last cache size adaptation */
+	uint nshards;				/**< Amount of cache shards */
+	uint shard_bits;			/**< log2(nshards) */
 	size_t key_size;			/**< Size of keys (constant or maximum) */
 	dbmap_keylen_t key_len;		/**< Optional, computes actual key length */
 	size_t value_size;			/**< Maximum size of values (structure) */
 	size_t value_data_size;		/**< Maximum size of values (serialized form) */
 	size_t max_cached;			/**< Max amount of items to cache */
+	size_t base_cached;			/**< Amount of items requested at creation */
+	size_t target_cached;		/**< Cache size computed by adaptation */
 	ssize_t cached;				/**< Cached entries not present in dbmap */
 	dbmw_serialize_t pack;		/**< Serialization routine for values */
 	dbmw_deserialize_t unpack;	/**< Deserialization routine for values */
 	dbmw_free_t valfree;		/**< Free routine for deserialized values */
 	const dbg_config_t *dbg;	/**< Optional debugging */
 	dbg_config_t *dbmap_dbg;	/**< Object created for DBMAP debugging */
+	dbwal_t *wal;				/**< Optional write-ahead log */
 	int error;					/**< Last errno value */
 	unsigned ioerr:1;			/**< Had I/O error */
 	unsigned count_needs_sync:1;/**< Whether we need to sync to get count */
@@ -104,13 +146,49 @@ dbmw_check(const dbmw_t *dw)
  */
 struct cached {
 	void *data;					/**< Value data */
+	void *key;					/**< Saved key, shared with the map */
 	size_t len;					/**< Length of data */
+	link_t lnk;					/**< Embedded link in the CLOCK ring */
 	unsigned dirty:1;			/**< Whether entry is dirty */
 	unsigned absent:1;			/**< Whether entry is absent from database */
 	unsigned traversed:1;		/**< Whether entry was traversed by iteration */
 	unsigned removable:1;		/**< Entry must be removed after iteration? */
+	unsigned referenced:1;		/**< Accessed since last CLOCK sweep */
 };
 
+/*
+ * All the DBMW objects, for statistics and cache size adaptation.
+ */
+static elist_t dbmw_list = ELIST_INIT(offsetof(struct dbmw, lnk));
+static mutex_t dbmw_list_mtx = MUTEX_INIT;
+static size_t dbmw_budget = DBMW_BUDGET;
+static time_t dbmw_last_adapt;
+
+#define DBMW_LIST_LOCK		mutex_lock(&dbmw_list_mtx)
+#define DBMW_LIST_UNLOCK	mutex_unlock(&dbmw_list_mtx)
+
+/**
+ * @return the cache shard holding key.
+ */
+static inline struct dbmw_shard *
+dbmw_shard(const dbmw_t *dw, const void *key)
+{
+	if G_LIKELY(1 == dw->nshards)
+		return &dw->shards[0];
+
+	return &dw->shards[hashing_fold((*dw->hash)(key), dw->shard_bits)];
+}
+
+/**
+ * @return approximate memory used by a cached entry.
+ */
+static inline size_t
+dbmw_entry_cost(const dbmw_t *dw)
+{
+	return dw->key_size + dw->value_size + sizeof(struct cached) +
+		4 * sizeof(void *);		/* Map overhead */
+}
+
 /**
  * Computes key length.
  */
@@ -173,10 +251,29 @@ dbmw_count(dbmw_t *dw)
 	 * proper count in the underlying map.
 	 */
 
+	size_t count;
+
 	if (dw->count_needs_sync)
 		dbmw_sync(dw, DBMW_SYNC_CACHE);
 
-	return dbmap_count(dw->dm) + dw->cached;
+	count = dbmap_count(dw->dm) + dw->cached;
+
+	return count;
+}
+
+/**
+ * Compute the maximum amount of items that the i-th shard can hold, so
+ * that the shards share the maximum amount of cached items.
+ */
+static size_t
+dbmw_shard_max(const dbmw_t *dw, uint i)
+{
+	size_t max = dw->max_cached / dw->nshards;
+
+	if (i < dw->max_cached % dw->nshards)
+		max++;
+
+	return MAX(max, 1);
 }
 
 /**
@@ -206,6 +303,7 @@ dbmw_create(dbmap_t *dm, const char *name,
 	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func)
 {
 	dbmw_t *dw;
+	uint i;
 
 	g_assert(pack == NULL || value_size);
 	g_assert((pack != NULL) == (unpack != NULL));
@@ -231,22 +329,6 @@ dbmw_create(dbmap_t *dm, const char *name,
 	 */
 	g_assert(dw->value_size == dw->value_data_size || pack != NULL);
 
-	/*
-	 * For a small amount of items, a PATRICIA tree is more efficient
-	 * than a hash table although it uses more memory.
-	 */
-
-	if (
-		NULL == dw->key_len &&
-		dw->key_size * 8 <= PATRICIA_MAXBITS &&
-		cache_size <= DBMW_CACHE
-	) {
-		dw->values = map_create_patricia(dw->key_size * 8);
-	} else {
-		dw->values = map_create_hash(hash_func, eq_func);
-	}
-
-	dw->keys = hash_list_new(hash_func, eq_func);
 	dw->pack = pack;
 	dw->unpack = unpack;
 	dw->valfree = valfree;
@@ -281,12 +363,56 @@ dbmw_create(dbmap_t *dm, const char *name,
 	else
 		dw->max_cached = cache_size;
 
+	dw->base_cached = dw->target_cached = dw->max_cached;
+
+	/*
+	 * Large caches are split into shards, each with its own CLOCK ring, so
+	 * that the CLOCK hand sweeps shorter rings when looking for a victim.
+	 */
+
+	while (
+		dw->shard_bits < DBMW_SHARD_BITS &&
+		dw->max_cached >> (dw->shard_bits + 1) >= DBMW_SHARD_MIN
+	)
+		dw->shard_bits++;
+
+	dw->nshards = 1U << dw->shard_bits;
+	dw->hash = hash_func;
+	WALLOC0_ARRAY(dw->shards, dw->nshards);
+
+	for (i = 0; i < dw->nshards; i++) {
+		struct dbmw_shard *s = &dw->shards[i];
+
+		/*
+		 * For a small amount of items, a PATRICIA tree is more efficient
+		 * than a hash table although it uses more memory.
+		 */
+
+		if (
+			NULL == dw->key_len &&
+			dw->key_size * 8 <= PATRICIA_MAXBITS &&
+			cache_size <= DBMW_CACHE
+		) {
+			s->values = map_create_patricia(dw->key_size * 8);
+		} else {
+			s->values = map_create_hash(hash_func, eq_func);
+		}
+
+		elist_init(&s->clock, offsetof(struct cached, lnk));
+		s->max_cached = dbmw_shard_max(dw, i);
+	}
+
+	DBMW_LIST_LOCK;
+	elist_append(&dbmw_list, dw);
+	DBMW_LIST_UNLOCK;
+
 	if (common_dbg)
 		s_debug("DBMW created \"%s\" with %s back-end "
-			"(max cached = %zu, key=%zu bytes, value=%zu bytes, "
+			"(max cached = %zu in %u shard%s, key=%zu bytes, value=%zu bytes, "
 			"%zu max serialized)",
-			dw->name, dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
-			dw->max_cached, dw->key_size, dw->value_size, dw->value_data_size);
+			dw->name, dbmap_type_to_string(dbmw_map_type(dw)),
+			dw->max_cached, dw->nshards, plural(dw->nshards),
+			dw->key_size, dw->value_size, dw->value_data_size);
 
 	return dw;
 }
@@ -410,19 +536,16 @@ free_value(const dbmw_t *dw, struct cached *cv, bool reclaim)
  * indeed cached, NULL otherwise.
  */
 static struct cached *
-remove_entry(dbmw_t *dw, const void *key, bool dispose, bool flush)
+remove_entry(dbmw_t *dw, struct dbmw_shard *s, const void *key,
+	bool dispose, bool flush)
 {
 	struct cached *old;
-	void *old_key;
-	bool found;
 
-	found = map_lookup_extended(dw->values, key, &old_key, (void *) &old);
+	old = map_lookup(s->values, key);
 
-	if (!found)
+	if (NULL == old)
 		return NULL;
 
-	g_assert(old != NULL);
-
 	if (dbg_ds_debugging(dw->dbg, 3, DBG_DSF_CACHING)) {
 		dbg_ds_log(dw->dbg, dw, "%s: %s key=%s (%s)",
 			G_STRFUNC, old->dirty ? "dirty" : "clean",
@@ -430,12 +553,19 @@ remove_entry(dbmw_t *dw, const void *key, bool dispose, bool flush)
 			flush ? "flushing" : " discarding");
 	}
 
-	if (old->dirty && flush)
-		write_back(dw, key, old);
+	if (old->dirty && flush && write_back(dw, key, old))
+		s->stats.writebacks++;
 
-	hash_list_remove(dw->keys, key);
-	map_remove(dw->values, key);
-	wfree(old_key, dbmw_keylen(dw, old_key));
+	/*
+	 * The key we were given may be the one saved in the entry, so we must
+	 * not use it once the saved key has been freed.
+	 */
+
+	elist_remove(&s->clock, old);
+	map_remove(s->values, old->key);
+	wfree(old->key, dbmw_keylen(dw, old->key));
+	old->key = NULL;
+	old->referenced = FALSE;
 
 	if (!dispose)
 		return old;
@@ -450,10 +580,37 @@ remove_entry(dbmw_t *dw, const void *key, bool dispose, bool flush)
 	return NULL;
 }
 
+/**
+ * Evict an entry from the shard, flushing it if dirty.
+ *
+ * The CLOCK hand sweeps the ring from its head: entries referenced since
+ * the last sweep get a second chance and are moved to the tail once their
+ * reference bit is cleared, the first unreferenced entry being evicted.
+ *
+ * @return the reusable cached entry if dispose was FALSE, NULL otherwise.
+ */
+static struct cached *
+evict_entry(dbmw_t *dw, struct dbmw_shard *s, bool dispose)
+{
+	struct cached *victim;
+
+	g_assert(elist_count(&s->clock) != 0);
+
+	while ((victim = elist_head(&s->clock))->referenced) {
+		victim->referenced = FALSE;
+		elist_rotate_left(&s->clock);
+	}
+
+	s->stats.evictions++;
+
+	return remove_entry(dw, s, victim->key, dispose, TRUE);
+}
+
 /**
  * Allocate a new entry in the cache to hold the deserialized value.
  *
  * @param dw		the DBM wrapper
+ * @param s			the cache shard where key belongs
  * @param key		key we want a cache entry for
  * @param filled	optionally, a new cache entry already filled with the data
  *
@@ -466,34 +623,29 @@ remove_entry(dbmw_t *dw, const void *key, bool dispose, bool flush)
  * @return a cache entry object that can be filled with the value.
  */
 static struct cached *
-allocate_entry(dbmw_t *dw, const void *key, struct cached *filled)
+allocate_entry(dbmw_t *dw, struct dbmw_shard *s, const void *key,
+	struct cached *filled)
 {
 	struct cached *entry;
 	void *saved_key;
 
-	g_assert(!hash_list_contains(dw->keys, key));
-	g_assert(!map_contains(dw->values, key));
+	g_assert(!map_contains(s->values, key));
 	g_assert(!filled || (!filled->len == !filled->data));
 
 	saved_key = wcopy(key, dbmw_keylen(dw, key));
 
 	/*
 	 * If we have less keys cached than our maximum, add it.
-	 * Otherwise evict the least recently used key, at the head.
+	 * Otherwise evict the entry selected by the CLOCK hand.
 	 */
 
-	if (hash_list_length(dw->keys) < dw->max_cached) {
+	if (elist_count(&s->clock) < s->max_cached) {
 		if (filled)
 			entry = filled;
 		else
 			WALLOC0(entry);
 	} else {
-		void *head;
-
-		g_assert(hash_list_length(dw->keys) == dw->max_cached);
-
-		head = hash_list_head(dw->keys);
-		entry = remove_entry(dw, head, filled != NULL, TRUE);
+		entry = evict_entry(dw, s, filled != NULL);
 
 		g_assert(filled != NULL || entry != NULL);
 
@@ -507,12 +659,24 @@ allocate_entry(dbmw_t *dw, const void *key, struct cached *filled)
 
 	g_assert(entry);
 
-	hash_list_append(dw->keys, saved_key);
-	map_insert(dw->values, saved_key, entry);
+	entry->key = saved_key;
+	elist_append(&s->clock, entry);
+	map_insert(s->values, saved_key, entry);
 
 	return entry;
 }
 
+/**
+ * Trim the shard so that it does not hold more than its maximum amount of
+ * items, flushing the evicted dirty entries.
+ */
+static void
+trim_shard(dbmw_t *dw, struct dbmw_shard *s)
+{
+	while (elist_count(&s->clock) > s->max_cached)
+		(void) evict_entry(dw, s, TRUE);
+}
+
 /**
  * Fill cache entry structure with value data, marking it dirty and present.
  */
@@ -681,18 +845,50 @@ cache_free_removable(void *key, void *value, void *data)
 		return FALSE;
 
 	free_value(dw, entry, TRUE);
-	hash_list_remove(dw->keys, key);
+	elist_remove(&dbmw_shard(dw, key)->clock, entry);
 	wfree(key, dbmw_keylen(dw, key));
 	WFREE(entry);
 
 	return TRUE;
 }
 
+/**
+ * Iterate over the cached entries of all the shards.
+ */
+static void
+dbmw_cache_foreach(const dbmw_t *dw, keyval_fn_t cb, void *data)
+{
+	uint i;
+
+	for (i = 0; i < dw->nshards; i++) {
+		struct dbmw_shard *s = &dw->shards[i];
+
+		map_foreach(s->values, cb, data);
+	}
+}
+
+/**
+ * Remove the cached entries of all the shards for which the callback
+ * returns TRUE.
+ */
+static void
+dbmw_cache_foreach_remove(const dbmw_t *dw, keyval_rm_fn_t cb, void *data)
+{
+	uint i;
+
+	for (i = 0; i < dw->nshards; i++) {
+		struct dbmw_shard *s = &dw->shards[i];
+
+		map_foreach_remove(s->values, cb, data);
+	}
+}
+
 /**
  * Context for flushes.
  */
 struct flush_context {
 	dbmw_t *dw;
+	struct dbmw_shard *s;
 	ssize_t amount;
 	unsigned error:1;
 	unsigned deleted_only:1;
@@ -710,13 +906,160 @@ flush_dirty(void *key, void *value, void *data)
 	if (entry->dirty) {
 		if (!entry->absent && ctx->deleted_only)
 			return;
-		if (write_back(ctx->dw, key, entry))
+		if (write_back(ctx->dw, key, entry)) {
 			ctx->amount++;
-		else
+			ctx->s->stats.writebacks++;
+		} else
 			ctx->error = TRUE;
 	}
 }
 
+/**
+ * @return amount of entries held in the cache.
+ */
+static size_t
+dbmw_cache_count(const dbmw_t *dw)
+{
+	size_t count = 0;
+	uint i;
+
+	for (i = 0; i < dw->nshards; i++) {
+		struct dbmw_shard *s = &dw->shards[i];
+
+		count += elist_count(&s->clock);
+	}
+
+	return count;
+}
+
+/**
+ * Sum statistics of all the cache shards.
+ */
+static void
+dbmw_cache_stats(const dbmw_t *dw, struct dbmw_cstats *st)
+{
+	uint i;
+
+	ZERO(st);
+
+	for (i = 0; i < dw->nshards; i++) {
+		struct dbmw_shard *s = &dw->shards[i];
+
+		st->r_access   += s->stats.r_access;
+		st->w_access   += s->stats.w_access;
+		st->r_hits     += s->stats.r_hits;
+		st->w_hits     += s->stats.w_hits;
+		st->evictions  += s->stats.evictions;
+		st->writebacks += s->stats.writebacks;
+	}
+}
+
+/**
+ * Compute the cache size of all the DBMW objects, once every
+ * DBMW_ADAPT_PERIOD seconds.
+ *
+ * A cache that had to evict entries whilst missing more than 5% of its
+ * reads since the last adaptation grows by 25%, up to DBMW_GROW_MAX times
+ * its initial size.  A cache less than half full shrinks back by 25%, down
+ * to its initial size.
+ *
+ * When all the caches would use more memory than the global budget, the
+ * growth beyond the initial sizes is scaled down proportionally.  Initial
+ * sizes are always granted since they were explicitly requested.
+ *
+ * The new size is only recorded here and each DBMW will apply it at its
+ * next map synchronization.
+ */
+static void
+dbmw_cache_adapt(void)
+{
+	time_t now = tm_time();
+	size_t base = 0, extra = 0;
+	dbmw_t *dw;
+
+	DBMW_LIST_LOCK;
+
+	if (delta_time(now, dbmw_last_adapt) < DBMW_ADAPT_PERIOD)
+		goto done;
+
+	dbmw_last_adapt = now;
+
+	ELIST_FOREACH_DATA(&dbmw_list, dw) {
+		struct dbmw_cstats st;
+		uint64 access, hits;
+		size_t want = dw->max_cached;
+
+		dbmw_check(dw);
+
+		if (dw->base_cached <= 1)
+			continue;		/* Not caching, only keeping latest value */
+
+		dbmw_cache_stats(dw, &st);
+		access = st.r_access - dw->last.r_access;
+		hits = st.r_hits - dw->last.r_hits;
+
+		if (
+			access >= DBMW_ADAPT_MIN &&
+			st.evictions != dw->last.evictions &&
+			hits * 20 < access * 19
+		) {
+			want += want / 4;
+			want = MIN(want, dw->base_cached * DBMW_GROW_MAX);
+		} else if (dbmw_cache_count(dw) < want / 2) {
+			want -= want / 4;
+			want = MAX(want, dw->base_cached);
+		}
+
+		dw->last = st;
+		dw->target_cached = want;
+		base += dw->base_cached * dbmw_entry_cost(dw);
+		extra += (want - dw->base_cached) * dbmw_entry_cost(dw);
+	}
+
+	if (0 == extra || base + extra <= dbmw_budget)
+		goto done;
+
+	ELIST_FOREACH_DATA(&dbmw_list, dw) {
+		double room = dbmw_budget > base ? dbmw_budget - base : 0;
+		size_t more;
+
+		if (dw->base_cached <= 1)
+			continue;
+
+		more = dw->target_cached - dw->base_cached;
+		dw->target_cached = dw->base_cached + (size_t) (more * room / extra);
+	}
+
+done:
+	DBMW_LIST_UNLOCK;
+}
+
+/**
+ * Resize the cache to the size computed by the last adaptation, evicting
+ * entries when the cache shrinks.
+ */
+static void
+dbmw_cache_resize(dbmw_t *dw)
+{
+	size_t old = dw->max_cached;
+	uint i;
+
+	dw->max_cached = dw->target_cached;
+
+	for (i = 0; i < dw->nshards; i++) {
+		struct dbmw_shard *s = &dw->shards[i];
+
+		s->max_cached = dbmw_shard_max(dw, i);
+		trim_shard(dw, s);
+	}
+
+	if (dbg_ds_debugging(dw->dbg, 1, DBG_DSF_CACHING)) {
+		dbg_ds_log(dw->dbg, dw, "%s: cache %s from %zu to %zu entries",
+			G_STRFUNC, old < dw->max_cached ? "grown" : "shrunk",
+			old, dw->max_cached);
+	}
+}
+
 /**
  * Synchronize dirty values.
  *
@@ -741,9 +1084,21 @@ dbmw_sync(dbmw_t *dw, int which)
 	ssize_t amount = 0;
 	size_t pages = 0, values = 0;
 	bool error = FALSE;
+	uint i;
 
 	dbmw_check(dw);
 
+	/*
+	 * Map synchronizations being periodic, they are a good time to adapt
+	 * the size of the caches.
+	 */
+
+	if (which & DBMW_SYNC_MAP) {
+		dbmw_cache_adapt();
+		if G_UNLIKELY(dw->target_cached != dw->max_cached)
+			dbmw_cache_resize(dw);
+	}
+
 	if (which & DBMW_SYNC_CACHE) {
 		struct flush_context ctx;
 
@@ -757,7 +1112,10 @@ dbmw_sync(dbmw_t *dw, int which)
 				G_STRFUNC, ctx.deleted_only ? " (deleted only)" : "");
 		}
 
-		map_foreach(dw->values, flush_dirty, &ctx);
+		for (i = 0; i < dw->nshards; i++) {
+			ctx.s = &dw->shards[i];
+			map_foreach(ctx.s->values, flush_dirty, &ctx);
+		}
 
 		if (!ctx.error && !ctx.deleted_only)
 			dw->count_needs_sync = FALSE;
@@ -782,6 +1140,7 @@ dbmw_sync(dbmw_t *dw, int which)
 			dbg_ds_log(dw->dbg, dw, "%s: syncing map", G_STRFUNC);
 
 		ret = dbmap_sync(dw->dm);
+
 		if (-1 == ret) {
 			error = TRUE;
 		} else {
@@ -807,7 +1166,11 @@ dbmw_sync(dbmw_t *dw, int which)
 bool
 dbmw_shrink(dbmw_t *dw)
 {
-	return dbmap_shrink(dw->dm);
+	bool ok;
+
+	ok = dbmap_shrink(dw->dm);
+
+	return ok;
 }
 
 /**
@@ -818,6 +1181,8 @@ dbmw_shrink(dbmw_t *dw)
 bool
 dbmw_rebuild(dbmw_t *dw)
 {
+	bool ok;
+
 	/*
 	 * We're going to work at the SDBM level, so we need to flush the cache
 	 * to make sure SDBM knows the latest database state: cached data pending
@@ -826,7 +1191,239 @@ dbmw_rebuild(dbmw_t *dw)
 
 	dbmw_sync(dw, DBMW_SYNC_CACHE);
 
-	return dbmap_rebuild(dw->dm);
+	ok = dbmap_rebuild(dw->dm);
+
+	return ok;
+}
+
+/**
+ * Start incremental compaction of the DB on disk.
+ *
+ * Unlike dbmw_rebuild(), there is no need to flush the cache first: values
+ * written later on will be propagated to the database being built.
+ *
+ * @return TRUE if compaction was started.
+ */
+bool
+dbmw_compact_start(dbmw_t *dw)
+{
+	bool ok;
+
+	dbmw_check(dw);
+
+	ok = dbmap_compact_start(dw->dm);
+
+	return ok;
+}
+
+/**
+ * Perform one step of incremental compaction.
+ *
+ * @param dw		the DBMW being compacted
+ * @param pages		maximum amount of pages to migrate
+ * @param info		if non-NULL, filled with compaction progress
+ *
+ * @return 1 if there is more work, 0 when compaction is done, -1 on error
+ * with compaction aborted.
+ */
+int
+dbmw_compact_step(dbmw_t *dw, long pages, struct sdbm_compact_info *info)
+{
+	int r;
+
+	dbmw_check(dw);
+
+	r = dbmap_compact_step(dw->dm, pages, info);
+
+	return r;
+}
+
+/**
+ * Abort incremental compaction, if any.
+ */
+void
+dbmw_compact_abort(dbmw_t *dw)
+{
+	dbmw_check(dw);
+
+	dbmap_compact_abort(dw->dm);
+}
+
+/**
+ * Make all the updates durable in the underlying map and discard the
+ * write-ahead log.
+ *
+ * This is a no-op when no log is attached to the database.
+ *
+ * @return amount of value flushes plus amount of sdbm page flushes, -1 if
+ * an error occurred, in which case the log is kept.
+ */
+ssize_t
+dbmw_checkpoint(dbmw_t *dw)
+{
+	ssize_t n;
+	bool ok;
+
+	dbmw_check(dw);
+
+	if (NULL == dw->wal)
+		return 0;
+
+	n = dbmw_sync(dw, DBMW_SYNC_CACHE | DBMW_SYNC_MAP);
+	if (-1 == n)
+		return -1;
+
+	ok = dbmap_fsync(dw->dm);
+
+	if (!ok) {
+		dw->ioerr = TRUE;
+		dw->error = errno;
+		s_warning("DBMW \"%s\" I/O error whilst checkpointing: %s",
+			dw->name, dbmap_strerror(dw->dm));
+		return -1;
+	}
+
+	if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_CACHING)) {
+		fileoffset_t size = dbwal_size(dw->wal);
+		dbg_ds_log(dw->dbg, dw, "%s: discarding %s logged byte%s",
+			G_STRFUNC, filesize_to_string(size), plural(size));
+	}
+
+	return dbwal_truncate(dw->wal) ? n : -1;
+}
+
+/**
+ * Write-ahead log synchronization routine, invoked from the log thread.
+ */
+static bool
+dbmw_fsync_finish(void *arg)
+{
+	dbmap_fsync_t *fs = arg;
+
+	return dbmap_fsync_finish(&fs);
+}
+
+/**
+ * Start a checkpoint without waiting for the disk: the updates are flushed
+ * to the underlying map, whose files are then synchronized by the log
+ * thread, which discards the log once done.
+ *
+ * This is a no-op when no log is attached to the database or when a
+ * checkpoint is already in progress.
+ *
+ * @return amount of value flushes plus amount of sdbm page flushes, -1 if
+ * an error occurred, in which case the log is kept.
+ */
+ssize_t
+dbmw_checkpoint_async(dbmw_t *dw)
+{
+	dbmap_fsync_t *fs;
+	ssize_t n;
+
+	dbmw_check(dw);
+
+	if (NULL == dw->wal || dbwal_checkpointing(dw->wal))
+		return 0;
+
+	n = dbmw_sync(dw, DBMW_SYNC_CACHE | DBMW_SYNC_MAP);
+	if (-1 == n)
+		return -1;
+
+	fs = dbmap_fsync_start(dw->dm);
+
+	if (NULL == fs) {
+		dw->ioerr = TRUE;
+		dw->error = errno;
+		s_warning("DBMW \"%s\" I/O error whilst checkpointing: %s",
+			dw->name, dbmap_strerror(dw->dm));
+		return -1;
+	}
+
+	if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_CACHING)) {
+		fileoffset_t size = dbwal_size(dw->wal);
+		dbg_ds_log(dw->dbg, dw, "%s: checkpointing %s logged byte%s",
+			G_STRFUNC, filesize_to_string(size), plural(size));
+	}
+
+	dbwal_checkpoint(dw->wal, dbmw_fsync_finish, fs);
+
+	return n;
+}
+
+/**
+ * Checkpoint callback for the write-ahead log, when it grows too large.
+ */
+static void
+dbmw_wal_checkpoint(void *arg)
+{
+	dbmw_t *dw = arg;
+
+	if (-1 == dbmw_checkpoint_async(dw)) {
+		s_warning("DBMW \"%s\" could not checkpoint write-ahead log",
+			dw->name);
+	}
+}
+
+/**
+ * Write-ahead log replaying callback.
+ */
+static void
+dbmw_wal_replay(const void *key, size_t klen,
+	const void *value, size_t vlen, void *arg)
+{
+	dbmw_t *dw = arg;
+
+	if (klen != dbmw_keylen(dw, key) || vlen > dw->value_data_size) {
+		s_warning("DBMW \"%s\" ignoring logged record "
+			"(key=%zu byte%s, value=%zu byte%s)",
+			dw->name, klen, plural(klen), vlen, plural(vlen));
+		return;
+	}
+
+	if (NULL == value) {
+		dbmap_remove(dw->dm, key);
+	} else {
+		dbmap_datum_t dval;
+
+		dval.data = deconstify_pointer(value);
+		dval.len = vlen;
+		dbmap_insert(dw->dm, key, dval);
+	}
+}
+
+/**
+ * Attach a write-ahead log to the database, which becomes owned by the
+ * DBMW layer.
+ *
+ * Records still present in the log are first replayed into the map, and
+ * they are discarded once made durable.  From then on, all the updates
+ * are logged.
+ *
+ * This must be called before the database is used.
+ *
+ * @return the amount of records replayed.
+ */
+size_t
+dbmw_set_wal(dbmw_t *dw, dbwal_t *wal)
+{
+	size_t n;
+
+	dbmw_check(dw);
+	g_assert(NULL == dw->wal);
+	g_assert(0 == dbmw_cache_count(dw));
+
+	n = dbwal_replay(wal, dbmw_wal_replay, dw);
+	dw->wal = wal;
+	dbwal_set_checkpoint(wal, dbmw_wal_checkpoint, dw);
+
+	if (0 != n || 0 != dbwal_size(wal)) {
+		if (-1 == dbmw_checkpoint(dw)) {
+			s_warning("DBMW \"%s\" could not checkpoint write-ahead log",
+				dw->name);
+		}
+	}
+
+	return n;
 }
 
 /**
@@ -858,6 +1455,39 @@ dbmw_deserialize(const dbmw_t *dw, bstr_t *bs, void *valptr, size_t len)
 	return TRUE;
 }
 
+/**
+ * Record the update of a key in the write-ahead log, if any.
+ */
+static void
+dbmw_log_write(dbmw_t *dw, const void *key, void *value, size_t length)
+{
+	const void *data = value;
+	size_t len = length;
+
+	if G_LIKELY(NULL == dw->wal)
+		return;
+
+	if (dw->pack) {
+		pmsg_reset(dw->mb);
+		(*dw->pack)(dw->mb, value);
+
+		data = pmsg_start(dw->mb);
+		len = pmsg_size(dw->mb);
+
+		/*
+		 * The serialization overflow will be reported by write_back(),
+		 * and the value will not make it to the map either.
+		 */
+
+		if (len > dw->value_data_size)
+			goto done;
+	}
+
+	dbwal_put(dw->wal, key, dbmw_keylen(dw, key), data, len);
+
+done:
+}
+
 /**
  * Write data to disk immediately.
  */
@@ -895,6 +1525,8 @@ write_immediately(dbmw_t *dw, const void *key, void *value, size_t length)
 void
 dbmw_write_nocache(dbmw_t *dw, const void *key, void *value, size_t length)
 {
+	struct dbmw_shard *s;
+
 	dbmw_check(dw);
 	g_assert(key);
 	g_assert(length <= dw->value_size);
@@ -909,8 +1541,11 @@ dbmw_write_nocache(dbmw_t *dw, const void *key, void *value, size_t length)
 	 * Therefore, we must remove the cached entry only after flushing its value.
 	 */
 
+	s = dbmw_shard(dw, key);
+
+	dbmw_log_write(dw, key, value, length);
 	write_immediately(dw, key, value, length);
-	(void) remove_entry(dw, key, TRUE, FALSE);	/* Discard any cached data */
+	(void) remove_entry(dw, s, key, TRUE, FALSE);	/* Discard cached data */
 }
 
 /**
@@ -928,6 +1563,7 @@ dbmw_write_nocache(dbmw_t *dw, const void *key, void *value, size_t length)
 void
 dbmw_write(dbmw_t *dw, const void *key, void *value, size_t length)
 {
+	struct dbmw_shard *s;
 	struct cached *entry;
 
 	dbmw_check(dw);
@@ -936,9 +1572,12 @@ dbmw_write(dbmw_t *dw, const void *key, void *value, size_t length)
 	g_assert(length || value == NULL);
 	g_assert(length == 0 || value);
 
-	dw->w_access++;
+	s = dbmw_shard(dw, key);
 
-	entry = map_lookup(dw->values, key);
+	s->stats.w_access++;
+	dbmw_log_write(dw, key, value, length);
+
+	entry = map_lookup(s->values, key);
 	if (entry) {
 		if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_CACHING | DBG_DSF_UPDATE)) {
 			dbg_ds_log(dw->dbg, dw, "%s: %s key=%s%s",
@@ -948,11 +1587,11 @@ dbmw_write(dbmw_t *dw, const void *key, void *value, size_t length)
 		}
 
 		if (entry->dirty)
-			dw->w_hits++;
+			s->stats.w_hits++;
 		if (entry->absent)
 			dw->cached++;			/* Key exists now, in unflushed status */
 		fill_entry(dw, entry, value, length);
-		hash_list_moveto_tail(dw->keys, key);
+		entry->referenced = TRUE;
 
 	} else if (dw->max_cached > 1) {
 		if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_CACHING | DBG_DSF_UPDATE)) {
@@ -960,7 +1599,7 @@ dbmw_write(dbmw_t *dw, const void *key, void *value, size_t length)
 				G_STRFUNC, dbg_ds_keystr(dw->dbg, key, (size_t) -1));
 		}
 
-		entry = allocate_entry(dw, key, NULL);
+		entry = allocate_entry(dw, s, key, NULL);
 		fill_entry(dw, entry, value, length);
 		dw->count_needs_sync = TRUE;	/* Does not know whether key exists */
 
@@ -972,6 +1611,7 @@ dbmw_write(dbmw_t *dw, const void *key, void *value, size_t length)
 
 		write_immediately(dw, key, value, length);
 	}
+
 }
 
 /**
@@ -993,15 +1633,18 @@ dbmw_write(dbmw_t *dw, const void *key, void *value, size_t length)
 void * G_HOT
 dbmw_read(dbmw_t *dw, const void *key, size_t *lenptr)
 {
+	struct dbmw_shard *s;
 	struct cached *entry;
 	dbmap_datum_t dval;
 
 	dbmw_check(dw);
 	g_assert(key);
 
-	dw->r_access++;
+	s = dbmw_shard(dw, key);
 
-	entry = map_lookup(dw->values, key);
+	s->stats.r_access++;
+
+	entry = map_lookup(s->values, key);
 	if (entry) {
 		if (dbg_ds_debugging(dw->dbg, 5, DBG_DSF_CACHING | DBG_DSF_ACCESS)) {
 			dbg_ds_log(dw->dbg, dw, "%s: read cache hit on %s key=%s%s",
@@ -1010,7 +1653,8 @@ dbmw_read(dbmw_t *dw, const void *key, size_t *lenptr)
 				entry->absent ? " (absent)" : "");
 		}
 
-		dw->r_hits++;
+		s->stats.r_hits++;
+		entry->referenced = TRUE;
 		if (lenptr)
 			*lenptr = entry->len;
 		return entry->data;
@@ -1029,9 +1673,9 @@ dbmw_read(dbmw_t *dw, const void *key, size_t *lenptr)
 		s_warning_once_per(LOG_PERIOD_SECOND,
 			"DBMW \"%s\" I/O error whilst reading entry: %s",
 			dw->name, dbmap_strerror(dw->dm));
-		return NULL;
+		goto not_found;
 	} else if (NULL == dval.data)
-		return NULL;	/* Not found in DB */
+		goto not_found;		/* Not found in DB */
 
 	/*
 	 * Value was found, allocate a cache entry object for it.
@@ -1060,7 +1704,7 @@ dbmw_read(dbmw_t *dw, const void *key, size_t *lenptr)
 			/* Not calling value free routine on deserialization failures */
 			wfree(entry->data, dw->value_size);
 			WFREE(entry);
-			return NULL;
+			goto not_found;
 		}
 
 		if (lenptr)
@@ -1086,7 +1730,7 @@ dbmw_read(dbmw_t *dw, const void *key, size_t *lenptr)
 	 * Insert into cache.
 	 */
 
-	(void) allocate_entry(dw, key, entry);
+	(void) allocate_entry(dw, s, key, entry);
 
 	if (dbg_ds_debugging(dw->dbg, 4, DBG_DSF_CACHING)) {
 		dbg_ds_log(dw->dbg, dw, "%s: cached %s key=%s%s",
@@ -1096,6 +1740,9 @@ dbmw_read(dbmw_t *dw, const void *key, size_t *lenptr)
 	}
 
 	return entry->data;
+
+not_found:
+	return NULL;
 }
 
 /**
@@ -1104,15 +1751,18 @@ dbmw_read(dbmw_t *dw, const void *key, size_t *lenptr)
 bool
 dbmw_exists(dbmw_t *dw, const void *key)
 {
+	struct dbmw_shard *s;
 	struct cached *entry;
 	bool ret;
 
 	dbmw_check(dw);
 	g_assert(key);
 
-	dw->r_access++;
+	s = dbmw_shard(dw, key);
 
-	entry = map_lookup(dw->values, key);
+	s->stats.r_access++;
+
+	entry = map_lookup(s->values, key);
 	if (entry) {
 		if (dbg_ds_debugging(dw->dbg, 5, DBG_DSF_CACHING | DBG_DSF_ACCESS)) {
 			dbg_ds_log(dw->dbg, dw, "%s: read cache hit on %s key=%s%s",
@@ -1121,8 +1771,10 @@ dbmw_exists(dbmw_t *dw, const void *key)
 				entry->absent ? " (absent)" : "");
 		}
 
-		dw->r_hits++;
-		return !entry->absent;
+		s->stats.r_hits++;
+		entry->referenced = TRUE;
+		ret = !entry->absent;
+		return ret;
 	}
 
 	dw->ioerr = FALSE;
@@ -1152,7 +1804,7 @@ dbmw_exists(dbmw_t *dw, const void *key)
 	if (0 == dw->value_size || !ret) {
 		WALLOC0(entry);
 		entry->absent = !ret;
-		(void) allocate_entry(dw, key, entry);
+		(void) allocate_entry(dw, s, key, entry);
 
 		if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_CACHING)) {
 			dbg_ds_log(dw->dbg, dw, "%s: cached %s key=%s",
@@ -1170,14 +1822,20 @@ dbmw_exists(dbmw_t *dw, const void *key)
 void
 dbmw_delete(dbmw_t *dw, const void *key)
 {
+	struct dbmw_shard *s;
 	struct cached *entry;
 
 	dbmw_check(dw);
 	g_assert(key);
 
-	dw->w_access++;
+	s = dbmw_shard(dw, key);
+
+	s->stats.w_access++;
 
-	entry = map_lookup(dw->values, key);
+	if (dw->wal != NULL)
+		dbwal_delete(dw->wal, key, dbmw_keylen(dw, key));
+
+	entry = map_lookup(s->values, key);
 	if (entry) {
 		if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_CACHING | DBG_DSF_DELETE)) {
 			dbg_ds_log(dw->dbg, dw, "%s: %s key=%s%s",
@@ -1187,7 +1845,7 @@ dbmw_delete(dbmw_t *dw, const void *key)
 		}
 
 		if (entry->dirty)
-			dw->w_hits++;
+			s->stats.w_hits++;
 		if (!entry->absent) {
 			/*
 			 * Entry was present but is now deleted.
@@ -1209,7 +1867,7 @@ dbmw_delete(dbmw_t *dw, const void *key)
 			fill_entry(dw, entry, NULL, 0);
 			entry->absent = TRUE;
 		}
-		hash_list_moveto_tail(dw->keys, key);
+		entry->referenced = TRUE;
 
 	} else {
 		if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_DELETE)) {
@@ -1240,7 +1898,7 @@ dbmw_delete(dbmw_t *dw, const void *key)
 		if (0 == dw->value_size) {
 			WALLOC0(entry);
 			entry->absent = TRUE;
-			(void) allocate_entry(dw, key, entry);
+			(void) allocate_entry(dw, s, key, entry);
 
 			if (dbg_ds_debugging(dw->dbg, 2, DBG_DSF_CACHING)) {
 				dbg_ds_log(dw->dbg, dw, "%s: cached absent key=%s",
@@ -1248,6 +1906,7 @@ dbmw_delete(dbmw_t *dw, const void *key)
 			}
 		}
 	}
+
 }
 
 /**
@@ -1274,16 +1933,22 @@ free_cached(void *key, void *value, void *data)
 static void
 dbmw_clear_cache(dbmw_t *dw)
 {
+	uint i;
+
 	dbmw_check(dw);
 
 	/*
-	 * In the cache, the hash list and the value cache share the same
-	 * key pointers.  Therefore, we need to iterate on the map only
+	 * In the cache, the CLOCK ring links the entries that the map
+	 * references.  Therefore, we need to iterate on the map only
 	 * to free both at the same time.
 	 */
 
-	hash_list_clear(dw->keys);
-	map_foreach_remove(dw->values, free_cached, dw);
+	for (i = 0; i < dw->nshards; i++) {
+		struct dbmw_shard *s = &dw->shards[i];
+
+		elist_clear(&s->clock);
+		map_foreach_remove(s->values, free_cached, dw);
+	}
 }
 
 /**
@@ -1294,7 +1959,11 @@ dbmw_clear_cache(dbmw_t *dw)
 bool
 dbmw_clear(dbmw_t *dw)
 {
-	if (!dbmap_clear(dw->dm))
+	bool ok;
+
+	ok = dbmap_clear(dw->dm);
+
+	if (!ok)
 		return FALSE;
 
 	dbmw_clear_cache(dw);
@@ -1302,6 +1971,14 @@ dbmw_clear(dbmw_t *dw)
 	dw->count_needs_sync = FALSE;
 	dw->cached = 0;
 
+	/*
+	 * The map was physically emptied, replaying the log would resurrect
+	 * keys that are now gone.
+	 */
+
+	if (dw->wal != NULL)
+		dbwal_truncate(dw->wal);
+
 	return TRUE;
 }
 
@@ -1311,28 +1988,41 @@ dbmw_clear(dbmw_t *dw)
 void
 dbmw_destroy(dbmw_t *dw, bool close_map)
 {
+	struct dbmw_cstats st;
+	uint i;
+
 	dbmw_check(dw);
 
+	DBMW_LIST_LOCK;
+	elist_remove(&dbmw_list, dw);
+	DBMW_LIST_UNLOCK;
+
+	dbmw_cache_stats(dw, &st);
+
 	if (common_stats) {
 		s_debug("DBMW destroying \"%s\" with %s back-end "
 			"(read cache hits = %.2f%% on %s request%s, "
-			"write cache hits = %.2f%% on %s request%s)",
-			dw->name, dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
-			dw->r_hits * 100.0 / MAX(1, dw->r_access),
-			uint64_to_string(dw->r_access), plural(dw->r_access),
-			dw->w_hits * 100.0 / MAX(1, dw->w_access),
-			uint64_to_string2(dw->w_access), plural(dw->w_access));
+			"write cache hits = %.2f%% on %s request%s, "
+			"%s eviction%s)",
+			dw->name, dbmap_type_to_string(dbmw_map_type(dw)),
+			st.r_hits * 100.0 / MAX(1, st.r_access),
+			uint64_to_string(st.r_access), plural(st.r_access),
+			st.w_hits * 100.0 / MAX(1, st.w_access),
+			uint64_to_string2(st.w_access), plural(st.w_access),
+			uint64_to_string3(st.evictions), plural(st.evictions));
 	}
 
 	if (dbg_ds_debugging(dw->dbg, 1, DBG_DSF_DESTROY)) {
 		dbg_ds_log(dw->dbg, dw, "%s: with %s back-end "
 			"(read cache hits = %.2f%% on %s request%s, "
-			"write cache hits = %.2f%% on %s request%s)",
-			G_STRFUNC, dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
-			dw->r_hits * 100.0 / MAX(1, dw->r_access),
-			uint64_to_string(dw->r_access), plural(dw->r_access),
-			dw->w_hits * 100.0 / MAX(1, dw->w_access),
-			uint64_to_string2(dw->w_access), plural(dw->w_access));
+			"write cache hits = %.2f%% on %s request%s, "
+			"%s eviction%s)",
+			G_STRFUNC, dbmap_type_to_string(dbmw_map_type(dw)),
+			st.r_hits * 100.0 / MAX(1, st.r_access),
+			uint64_to_string(st.r_access), plural(st.r_access),
+			st.w_hits * 100.0 / MAX(1, st.w_access),
+			uint64_to_string2(st.w_access), plural(st.w_access),
+			uint64_to_string3(st.evictions), plural(st.evictions));
 	}
 
 	/*
@@ -1344,9 +2034,26 @@ dbmw_destroy(dbmw_t *dw, bool close_map)
 		dbmw_sync(dw, DBMW_SYNC_CACHE);
 	}
 
+	/*
+	 * The log is removed if we can checkpoint the map, otherwise it will
+	 * be replayed when the database is re-opened.
+	 */
+
+	if (dw->wal != NULL) {
+		dbmw_checkpoint(dw);
+		dbwal_close(&dw->wal);
+	}
+
 	dbmw_clear_cache(dw);
-	hash_list_free(&dw->keys);
-	map_destroy(dw->values);
+
+	for (i = 0; i < dw->nshards; i++) {
+		struct dbmw_shard *s = &dw->shards[i];
+
+		map_destroy(s->values);
+		elist_discard(&s->clock);
+	}
+
+	WFREE_ARRAY(dw->shards, dw->nshards);
 
 	if (dw->mb)
 		pmsg_free(dw->mb);
@@ -1369,12 +2076,17 @@ dbmw_foreach_common(bool removing, void *key, dbmap_datum_t *d, void *arg)
 {
 	struct foreach_ctx *ctx = arg;
 	dbmw_t *dw = ctx->dw;
+	struct dbmw_shard *s;
 	struct cached *entry;
 
 	dbmw_check(dw);
 
-	entry = map_lookup(dw->values, key);
+	s = dbmw_shard(dw, key);
+
+	entry = map_lookup(s->values, key);
 	if (entry != NULL) {
+		bool status = FALSE;
+
 		/*
 		 * Key / value pair is present in the cache.
 		 *
@@ -1401,20 +2113,17 @@ dbmw_foreach_common(bool removing, void *key, dbmap_datum_t *d, void *arg)
 		if (entry->absent) {
 			s_carp("%s(): DBMW \"%s\" iterating over a %s absent key in cache!",
 				G_STRFUNC, dw->name, entry->dirty ? "dirty" : "clean");
-			return TRUE;		/* Key was already deleted, info cached */
-		}
-
-		if (removing) {
-			bool status;
+			status = TRUE;		/* Key was already deleted, info cached */
+		} else if (removing) {
 			status = (*ctx->u.cbr)(key, entry->data, entry->len, ctx->arg);
 			if (status) {
 				entry->removable = TRUE;	/* Discard it after traversal */
 			}
-			return status;
 		} else {
 			(*ctx->u.cb)(key, entry->data, entry->len, ctx->arg);
-			return FALSE;
 		}
+
+		return status;
 	} else {
 		bool status = FALSE;
 		void *data = d->data;
@@ -1473,7 +2182,16 @@ dbmw_foreach_trampoline(void *key, dbmap_datum_t *d, void *arg)
 static bool
 dbmw_foreach_remove_trampoline(void *key, dbmap_datum_t *d, void *arg)
 {
-	return dbmw_foreach_common(TRUE, key, d, arg);
+	struct foreach_ctx *ctx = arg;
+	dbmw_t *dw = ctx->dw;
+	bool removed;
+
+	removed = dbmw_foreach_common(TRUE, key, d, arg);
+
+	if (removed && dw->wal != NULL)
+		dbwal_delete(dw->wal, key, dbmw_keylen(dw, key));
+
+	return removed;
 }
 
 /**
@@ -1515,7 +2233,7 @@ dbmw_foreach(dbmw_t *dw, dbmw_cb_t cb, void *arg)
 	ctx.arg = arg;
 	ctx.dw = dw;
 
-	map_foreach(dw->values, cache_reset_before_traversal, NULL);
+	dbmw_cache_foreach(dw, cache_reset_before_traversal, NULL);
 	dbmap_foreach(dw->dm, dbmw_foreach_trampoline, &ctx);
 
 	/*
@@ -1531,7 +2249,7 @@ dbmw_foreach(dbmw_t *dw, dbmw_cb_t cb, void *arg)
 	fctx.foreach = &ctx;
 	fctx.u.cb = dbmw_foreach_trampoline;
 
-	map_foreach(dw->values, cache_finish_traversal, &fctx);
+	dbmw_cache_foreach(dw, cache_finish_traversal, &fctx);
 	dw->cached = fctx.cached;
 	dw->count_needs_sync = FALSE;	/* We just counted items the slow way! */
 
@@ -1585,7 +2303,7 @@ dbmw_foreach_remove(dbmw_t *dw, dbmw_cbr_t cbr, void *arg)
 	ctx.arg = arg;
 	ctx.dw = dw;
 
-	map_foreach(dw->values, cache_reset_before_traversal, NULL);
+	dbmw_cache_foreach(dw, cache_reset_before_traversal, NULL);
 	pruned = dbmap_foreach_remove(dw->dm, dbmw_foreach_remove_trampoline, &ctx);
 
 	ZERO(&fctx);
@@ -1606,8 +2324,8 @@ dbmw_foreach_remove(dbmw_t *dw, dbmw_cbr_t cbr, void *arg)
 	 * the entries that have been marked as "removable" during the traversal.
 	 */
 
-	map_foreach(dw->values, cache_finish_traversal, &fctx);
-	map_foreach_remove(dw->values, cache_free_removable, dw);
+	dbmw_cache_foreach(dw, cache_finish_traversal, &fctx);
+	dbmw_cache_foreach_remove(dw, cache_free_removable, dw);
 	dw->cached = fctx.cached;
 	dw->count_needs_sync = FALSE;	/* We just counted items the slow way! */
 
@@ -1624,6 +2342,102 @@ dbmw_foreach_remove(dbmw_t *dw, dbmw_cbr_t cbr, void *arg)
 	return pruned + fctx.removed;
 }
 
+/**
+ * Iterate over the keys of the DB within [lo, hi), invoking the callback on
+ * each item along with the supplied argument.
+ *
+ * Keys are compared as byte strings, through their serialized form.  When
+ * the DB is backed by a B+tree, only the keys within the range are visited,
+ * in key order.  Otherwise the whole DB is traversed, in no particular order.
+ *
+ * @param dw		the DBM wrapper
+ * @param lo		lowest serialized key of range, NULL for no lower bound
+ * @param hi		serialized key ending range (excluded), NULL for no limit
+ * @param cb		callback to invoke on each item
+ * @param arg		additional callback argument
+ */
+void
+dbmw_foreach_range(dbmw_t *dw, const void *lo, const void *hi,
+	dbmw_cb_t cb, void *arg)
+{
+	struct foreach_ctx ctx;
+
+	dbmw_check(dw);
+
+	if (dbg_ds_debugging(dw->dbg, 1, DBG_DSF_ITERATOR)) {
+		dbg_ds_log(dw->dbg, dw, "%s: starting with %s(%p)", G_STRFUNC,
+			stacktrace_function_name(cb), arg);
+	}
+
+	/*
+	 * Unlike dbmw_foreach(), we cannot traverse the cached entries that are
+	 * not yet present in the underlying map afterwards, since we would
+	 * have to filter them and could not honour the key order.  Flushing
+	 * the whole cache first ensures all the values are present in the map.
+	 */
+
+	dbmw_sync(dw, DBMW_SYNC_CACHE);
+
+	ctx.u.cb = cb;
+	ctx.arg = arg;
+	ctx.dw = dw;
+
+	dbmw_cache_foreach(dw, cache_reset_before_traversal, NULL);
+	dbmap_foreach_range(dw->dm, lo, hi, dbmw_foreach_trampoline, &ctx);
+
+	if (dbg_ds_debugging(dw->dbg, 1, DBG_DSF_ITERATOR)) {
+		dbg_ds_log(dw->dbg, dw, "%s: done with %s(%p)", G_STRFUNC,
+			stacktrace_function_name(cb), arg);
+	}
+}
+
+/**
+ * Iterate over the keys of the DB within [lo, hi), invoking the callback on
+ * each item along with the supplied argument and removing the item when the
+ * callback returns TRUE.
+ *
+ * @see dbmw_foreach_range() for the iteration order.
+ *
+ * @return the amount of removed entries.
+ */
+size_t
+dbmw_foreach_range_remove(dbmw_t *dw, const void *lo, const void *hi,
+	dbmw_cbr_t cbr, void *arg)
+{
+	struct foreach_ctx ctx;
+	size_t pruned;
+
+	dbmw_check(dw);
+
+	if (dbg_ds_debugging(dw->dbg, 1, DBG_DSF_ITERATOR)) {
+		dbg_ds_log(dw->dbg, dw, "%s: starting with %s(%p)", G_STRFUNC,
+			stacktrace_function_name(cbr), arg);
+	}
+
+	dbmw_sync(dw, DBMW_SYNC_CACHE);		/* See dbmw_foreach_range() */
+
+	ctx.u.cbr = cbr;
+	ctx.arg = arg;
+	ctx.dw = dw;
+
+	/*
+	 * Cached entries removed during the traversal are flagged "removable"
+	 * and discarded from the cache once we are done.
+	 */
+
+	dbmw_cache_foreach(dw, cache_reset_before_traversal, NULL);
+	pruned = dbmap_foreach_range_remove(dw->dm, lo, hi,
+		dbmw_foreach_remove_trampoline, &ctx);
+	dbmw_cache_foreach_remove(dw, cache_free_removable, dw);
+
+	if (dbg_ds_debugging(dw->dbg, 1, DBG_DSF_ITERATOR)) {
+		dbg_ds_log(dw->dbg, dw, "%s: done with %s(%p): pruned %zu",
+			G_STRFUNC, stacktrace_function_name(cbr), arg, pruned);
+	}
+
+	return pruned;
+}
+
 /**
  * Snapshot all the keys, returning them into a singly linked list.
  * To free the returned keys, use the dbmw_free_all_keys() helper.
@@ -1631,10 +2445,15 @@ dbmw_foreach_remove(dbmw_t *dw, dbmw_cbr_t cbr, void *arg)
 pslist_t *
 dbmw_all_keys(dbmw_t *dw)
 {
+	pslist_t *keys;
+
 	dbmw_check(dw);
 
 	dbmw_sync(dw, DBMW_SYNC_CACHE);
-	return dbmap_all_keys(dw->dm);
+
+	keys = dbmap_all_keys(dw->dm);
+
+	return keys;
 }
 
 /**
@@ -1661,10 +2480,15 @@ dbmw_free_all_keys(const dbmw_t *dw, pslist_t *keys)
 bool
 dbmw_store(dbmw_t *dw, const char *base, bool inplace)
 {
+	bool ok;
+
 	dbmw_check(dw);
 
 	dbmw_sync(dw, DBMW_SYNC_CACHE);
-	return dbmap_store(dw->dm, base, inplace);
+
+	ok = dbmap_store(dw->dm, base, inplace);
+
+	return ok;
 }
 
 /**
@@ -1676,6 +2500,8 @@ dbmw_store(dbmw_t *dw, const char *base, bool inplace)
 bool
 dbmw_copy(dbmw_t *from, dbmw_t *to)
 {
+	bool ok;
+
 	dbmw_check(from);
 	dbmw_check(to);
 
@@ -1688,7 +2514,9 @@ dbmw_copy(dbmw_t *from, dbmw_t *to)
 	 * we can ignore caches and handle the copy at the dbmap level.
 	 */
 
-	return dbmap_copy(from->dm, to->dm);
+	ok = dbmap_copy(from->dm, to->dm);
+
+	return ok;
 }
 
 /**
@@ -1703,6 +2531,30 @@ dbmw_set_map_cache(dbmw_t *dw, long pages)
 	return 0 == dbmap_set_cachesize(dw->dm, pages);
 }
 
+/**
+ * Turn memory-mapped access to the map files on or off.
+ * @return TRUE on success.
+ */
+bool
+dbmw_set_map_mmap(dbmw_t *dw, bool on)
+{
+	dbmw_check(dw);
+
+	return 0 == dbmap_set_mmap(dw->dm, on);
+}
+
+/**
+ * Turn background flushing of the map dirty pages on or off.
+ * @return TRUE on success.
+ */
+bool
+dbmw_set_map_bgflush(dbmw_t *dw, bool on)
+{
+	dbmw_check(dw);
+
+	return 0 == dbmap_set_bgflush(dw->dm, on);
+}
+
 /**
  * Flag whether database is volatile (never outlives a close).
  *
@@ -1731,7 +2583,7 @@ dbmw_set_debugging(dbmw_t *dw, const dbg_config_t *dbg)
 		dbg_ds_log(dw->dbg, dw, "%s: attached with %s back-end "
 			"(max cached = %zu, key=%zu bytes, value=%zu bytes, "
 			"%zu max serialized)", G_STRFUNC,
-			dbmw_map_type(dw) == DBMAP_SDBM ? "sdbm" : "map",
+			dbmap_type_to_string(dbmw_map_type(dw)),
 			dw->max_cached, dw->key_size, dw->value_size, dw->value_data_size);
 	}
 
@@ -1748,4 +2600,85 @@ dbmw_set_debugging(dbmw_t *dw, const dbg_config_t *dbg)
 	dbmap_set_debugging(dw->dm, dw->dbmap_dbg);
 }
 
+/**
+ * Set the global memory budget shared by the caches of all the DBMW objects,
+ * which limits how much caches can grow beyond their initial size.
+ */
+void
+dbmw_set_cache_budget(size_t bytes)
+{
+	DBMW_LIST_LOCK;
+	dbmw_budget = bytes;
+	DBMW_LIST_UNLOCK;
+}
+
+/**
+ * Retrieve cache statistics about all the DBMW objects.
+ *
+ * @return list of dbmw_cache_info_t that must be freed by calling
+ * dbmw_cache_info_list_free_null().
+ */
+pslist_t *
+dbmw_cache_info_list(void)
+{
+	pslist_t *sl = NULL;
+	dbmw_t *dw;
+
+	DBMW_LIST_LOCK;
+
+	ELIST_FOREACH_DATA(&dbmw_list, dw) {
+		dbmw_cache_info_t *ci;
+		struct dbmw_cstats st;
+
+		dbmw_check(dw);
+
+		dbmw_cache_stats(dw, &st);
+
+		WALLOC0(ci);
+		ci->magic = DBMW_CACHE_INFO_MAGIC;
+		ci->name = atom_str_get(NULL == dw->name ? "" : dw->name);
+		ci->r_access = st.r_access;
+		ci->r_hits = st.r_hits;
+		ci->w_access = st.w_access;
+		ci->w_hits = st.w_hits;
+		ci->evictions = st.evictions;
+		ci->writebacks = st.writebacks;
+		ci->count = dbmw_cache_count(dw);
+		ci->max_cached = dw->max_cached;
+		ci->base_cached = dw->base_cached;
+		ci->memory = ci->count * dbmw_entry_cost(dw);
+		ci->shards = dw->nshards;
+
+		sl = pslist_prepend(sl, ci);
+	}
+
+	DBMW_LIST_UNLOCK;
+
+	return sl;
+}
+
+static void
+dbmw_cache_info_free(void *data, void *udata)
+{
+	dbmw_cache_info_t *ci = data;
+
+	dbmw_cache_info_check(ci);
+	(void) udata;
+
+	atom_str_free_null(&ci->name);
+	WFREE(ci);
+}
+
+/**
+ * Free list created by dbmw_cache_info_list() and nullify pointer.
+ */
+void
+dbmw_cache_info_list_free_null(pslist_t **sl_ptr)
+{
+	pslist_t *sl = *sl_ptr;
+
+	pslist_foreach(sl, dbmw_cache_info_free, NULL);
+	pslist_free_null(sl_ptr);
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -91,7 +91,36 @@ typedef bool (*dbmw_cbr_t)(void *key, void *value, size_t len, void *u);
 #define DBMW_SYNC_MAP		(1 << 1)	/**< Sync DBMW underlying map */
 #define DBMW_DELETED_ONLY	(1 << 2)	/**< Only sync deleted keys */
 
+enum dbmw_cache_info_magic { DBMW_CACHE_INFO_MAGIC = 0x2c5d0a97 };
+
+/**
+ * Cache statistics that can be retrieved.
+ */
+typedef struct dbmw_cache_info {
+	enum dbmw_cache_info_magic magic;
+	const char *name;			/**< DB name (atom) */
+	uint64 r_access;			/**< Number of read accesses */
+	uint64 r_hits;				/**< Number of read cache hits */
+	uint64 w_access;			/**< Number of write accesses */
+	uint64 w_hits;				/**< Number of write cache hits */
+	uint64 evictions;			/**< Number of entries evicted from cache */
+	uint64 writebacks;			/**< Number of dirty entries written back */
+	size_t count;				/**< Amount of entries cached */
+	size_t max_cached;			/**< Current cache size, in entries */
+	size_t base_cached;			/**< Initial cache size, in entries */
+	size_t memory;				/**< Approximate memory used by the cache */
+	uint shards;				/**< Amount of cache shards */
+} dbmw_cache_info_t;
+
+static inline void
+dbmw_cache_info_check(const dbmw_cache_info_t * const ci)
+{
+	g_assert(ci != NULL);
+	g_assert(DBMW_CACHE_INFO_MAGIC == ci->magic);
+}
+
 struct dbg_config;
+struct dbwal;
 
 dbmw_t *dbmw_create(dbmap_t *dm, const char *name,
 	size_t value_size, size_t value_data_size,
@@ -99,6 +128,9 @@ dbmw_t *dbmw_create(dbmap_t *dm, const char *name,
 	size_t cache_size, hash_fn_t hash_func, eq_fn_t eq_func);
 void dbmw_destroy(dbmw_t *dw, bool close_sdbm);
 ssize_t dbmw_sync(dbmw_t *dw, int which);
+ssize_t dbmw_checkpoint(dbmw_t *dw);
+ssize_t dbmw_checkpoint_async(dbmw_t *dw);
+size_t dbmw_set_wal(dbmw_t *dw, struct dbwal *wal);
 void dbmw_write(dbmw_t *dw, const void *key, void *value, size_t length);
 void dbmw_write_nocache(
 	dbmw_t *dw, const void *key, void *value, size_t length);
@@ -110,10 +142,15 @@ size_t dbmw_count(dbmw_t *dw);
 bool dbmw_has_ioerr(const dbmw_t *dw);
 const char *dbmw_name(const dbmw_t *dw);
 bool dbmw_set_map_cache(dbmw_t *dw, long pages);
+bool dbmw_set_map_mmap(dbmw_t *dw, bool on);
+bool dbmw_set_map_bgflush(dbmw_t *dw, bool on);
 bool dbmw_set_volatile(dbmw_t *dw, bool is_volatile);
 void dbmw_set_debugging(dbmw_t *dw, const struct dbg_config *dbg);
 bool dbmw_shrink(dbmw_t *dw);
 bool dbmw_rebuild(dbmw_t *dw);
+bool dbmw_compact_start(dbmw_t *dw);
+int dbmw_compact_step(dbmw_t *dw, long pages, struct sdbm_compact_info *info);
+void dbmw_compact_abort(dbmw_t *dw);
 bool dbmw_clear(dbmw_t *dw);
 const char *dbmw_strerror(const dbmw_t *dw);
 
@@ -122,10 +159,18 @@ void dbmw_free_all_keys(const dbmw_t *dw, struct pslist *keys);
 
 void dbmw_foreach(dbmw_t *dw, dbmw_cb_t cb, void *arg);
 size_t dbmw_foreach_remove(dbmw_t *dw, dbmw_cbr_t cbr, void *arg);
+void dbmw_foreach_range(dbmw_t *dw, const void *lo, const void *hi,
+	dbmw_cb_t cb, void *arg);
+size_t dbmw_foreach_range_remove(dbmw_t *dw, const void *lo, const void *hi,
+	dbmw_cbr_t cbr, void *arg);
 
 bool dbmw_store(dbmw_t *dw, const char *base, bool inplace);
 bool dbmw_copy(dbmw_t *from, dbmw_t *to);
 
+void dbmw_set_cache_budget(size_t bytes);
+struct pslist *dbmw_cache_info_list(void);
+void dbmw_cache_info_list_free_null(struct pslist **sl_ptr);
+
 #endif /* _dbmw_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -42,20 +42,61 @@
 #include "if/gnet_property_priv.h"
 
 #include "atoms.h"
+#include "bg.h"
+#include "bptree.h"
 #include "dbmap.h"
 #include "dbmw.h"
+#include "dbwal.h"
 #include "file.h"
 #include "halloc.h"
 #include "hstrfn.h"
+#include "htable.h"
 #include "log.h"
 #include "path.h"
+#include "pslist.h"
 #include "stringify.h"
+#include "tm.h"
+#include "walloc.h"
 
 #include "override.h"		/* Must be the last header included */
 
 static const mode_t STORAGE_FILE_MODE = S_IRUSR | S_IWUSR; /* 0600 */
 static unsigned dbstore_debug;
 
+#define DBSTORE_COMPACT_PAGES	64	/* Max pages migrated per compaction slice */
+
+enum dbstore_compact_magic { DBSTORE_COMPACT_MAGIC = 0x6c8e30a5 };
+
+/**
+ * An online compaction, driven by a background task.
+ *
+ * The record is kept after compaction is over so that its outcome can
+ * be reported, until the database is closed.
+ */
+struct dbstore_compact {
+	enum dbstore_compact_magic magic;
+	dbmw_t *dw;						/**< Compacted DB, NULL once closed */
+	const char *name;				/**< DB name (atom) */
+	bgtask_t *task;					/**< Task driving compaction */
+	struct sdbm_compact_info info;	/**< Last progress report */
+	time_t start;					/**< Start time */
+	time_t end;						/**< End time, 0 if not finished */
+	uint running:1;					/**< Whether compaction is running */
+	uint failed:1;					/**< Whether compaction failed */
+};
+
+static inline void
+dbstore_compact_check(const struct dbstore_compact * const dc)
+{
+	g_assert(dc != NULL);
+	g_assert(DBSTORE_COMPACT_MAGIC == dc->magic);
+}
+
+/**
+ * Online compactions, indexed by DBMW.
+ */
+static htable_t *dbstore_compactions;
+
 /**
  * Set debugging level.
  */
@@ -71,6 +112,10 @@ dbstore_set_debug(unsigned level)
  * If we can't create the SDBM files on disk, we'll transparently use
  * an in-core version.
  *
+ * When the key/value description requests ordered keys, a B+tree back-end
+ * is used instead of SDBM.  The in-core version does not keep keys sorted,
+ * but ranges of keys can still be iterated over, only less efficiently.
+ *
  * @param name				the name of the storage created, for logs
  * @param dir				the directory where SDBM files will be put
  * @param base				the base name of SDBM files
@@ -100,8 +145,16 @@ dbstore_create_internal(const char *name, const char *dir, const char *base,
 		g_assert(base != NULL);
 
 		path = make_pathname(dir, base);
-		dm = dbmap_create_sdbm(kv.key_size, kv.key_len,
-				name, path, flags, STORAGE_FILE_MODE);
+
+		if (kv.ordered) {
+			char *file = h_strconcat(path, BPTREE_FEXT, NULL_PTR);
+			dm = dbmap_create_btree(kv.key_size, kv.key_len,
+					name, file, flags, STORAGE_FILE_MODE);
+			HFREE_NULL(file);
+		} else {
+			dm = dbmap_create_sdbm(kv.key_size, kv.key_len,
+					name, path, flags, STORAGE_FILE_MODE);
+		}
 
 		/*
 		 * For performance reasons, always use deferred writes.  Maps which
@@ -112,7 +165,8 @@ dbstore_create_internal(const char *name, const char *dir, const char *base,
 		if (dm != NULL) {
 			dbmap_set_deferred_writes(dm, TRUE);
 		} else {
-			s_warning("DBSTORE cannot open SDBM at %s for %s: %m", path, name);
+			s_warning("DBSTORE cannot open %s at %s for %s: %m",
+				kv.ordered ? "B+tree" : "SDBM", path, name);
 		}
 		HFREE_NULL(path);
 	} else {
@@ -136,6 +190,54 @@ dbstore_create_internal(const char *name, const char *dir, const char *base,
 	return dw;
 }
 
+static void
+dbstore_unlink_file(const char *path, const char *ext)
+{
+	char *file = h_strconcat(path, ext, NULL_PTR);
+
+	if (file_exists(file)) {
+		if (-1 == unlink(file)) {
+			s_carp("could not unlink \"%s\": %m", file);
+		}
+	}
+
+	HFREE_NULL(file);
+}
+
+/**
+ * Attach a write-ahead log to a persistent database, replaying the updates
+ * that were not yet durably recorded in the SDBM files when we last stopped.
+ *
+ * @param dw				the DBMW database, freshly opened
+ * @param dir				the directory where SDBM files are stored
+ * @param base				the base name of SDBM files
+ */
+static void
+dbstore_attach_wal(dbmw_t *dw, const char *dir, const char *base)
+{
+	char *path, *file;
+	dbwal_t *wal;
+
+	if (dbmw_map_type(dw) != DBMAP_SDBM)
+		return;
+
+	path = make_pathname(dir, base);
+	file = h_strconcat(path, DBWAL_FEXT, NULL_PTR);
+	wal = dbwal_open(dbmw_name(dw), file, STORAGE_FILE_MODE);
+
+	if (wal != NULL) {
+		size_t n = dbmw_set_wal(dw, wal);
+
+		if (n != 0) {
+			g_message("DBSTORE replayed %zu logged update%s in DBMW \"%s\"",
+				n, plural(n), dbmw_name(dw));
+		}
+	}
+
+	HFREE_NULL(file);
+	HFREE_NULL(path);
+}
+
 /**
  * Creates a disk database with an SDBM back-end.
  *
@@ -166,6 +268,17 @@ dbstore_create(const char *name, const char *dir, const char *base,
 	dw = dbstore_create_internal(name, dir, base, O_CREAT | O_TRUNC | O_RDWR,
 			kv, packing, cache_size, hash_func, eq_func, incore);
 
+	/*
+	 * A log left over by a persistent instance of the database is obsolete
+	 * now that the SDBM files were truncated.
+	 */
+
+	if (!incore) {
+		char *path = make_pathname(dir, base);
+		dbstore_unlink_file(path, DBWAL_FEXT);
+		HFREE_NULL(path);
+	}
+
 	dbmw_set_volatile(dw, TRUE);
 
 	return dw;
@@ -201,6 +314,16 @@ dbstore_open(const char *name, const char *dir, const char *base,
 	dw = dbstore_create_internal(name, dir, base, O_CREAT | O_RDWR,
 			kv, packing, cache_size, hash_func, eq_func, FALSE);
 
+	/*
+	 * Updates to a persistent database are logged, so that we do not lose
+	 * the ones made since the last synchronization if we crash.  Replaying
+	 * must happen before the database is copied to RAM below, which does
+	 * not need logging since it is only persisted when closed.
+	 */
+
+	if (dw != NULL)
+		dbstore_attach_wal(dw, dir, base);
+
 	if (dw != NULL && dbstore_debug > 0) {
 		size_t count = dbmw_count(dw);
 		g_debug("DBSTORE opened DBMW \"%s\" (%u key%s) from %s",
@@ -274,12 +397,69 @@ dbstore_flush(dbmw_t *dw)
 
 /**
  * Fully synchronize DBMW database: flush local cache, then the SDBM layer.
+ *
+ * When the database has a write-ahead log, this starts a checkpoint: the
+ * log thread waits for the SDBM pages flushed in the background, if any,
+ * forces the SDBM files to disk and then discards the log.
  */
 void
 dbstore_sync_flush(dbmw_t *dw)
 {
 	dbstore_flush(dw);		/* Flush cached dirty values... */
 	dbstore_sync(dw);		/* ...then sync database layer */
+
+	if (-1 == dbmw_checkpoint_async(dw)) {
+		g_warning("DBSTORE could not checkpoint DBMW \"%s\": %m",
+			dbmw_name(dw));
+	}
+}
+
+static void
+dbstore_compact_free(struct dbstore_compact *dc)
+{
+	dbstore_compact_check(dc);
+
+	atom_str_free_null(&dc->name);
+	dc->magic = 0;
+	WFREE(dc);
+}
+
+/**
+ * Forget about any online compaction of the DB, aborting it if running.
+ *
+ * This must be called before the DBMW is destroyed.
+ */
+static void
+dbstore_compact_forget(dbmw_t *dw)
+{
+	struct dbstore_compact *dc;
+
+	if (NULL == dbstore_compactions)
+		return;
+
+	dc = htable_lookup(dbstore_compactions, dw);
+	if (NULL == dc)
+		return;
+
+	dbstore_compact_check(dc);
+
+	htable_remove(dbstore_compactions, dw);
+	if (0 == htable_count(dbstore_compactions))
+		htable_free_null(&dbstore_compactions);
+
+	dc->dw = NULL;
+
+	if (dc->running) {
+		/*
+		 * The record will be freed by dbstore_compact_done() when the task
+		 * is terminated, which may not happen synchronously.
+		 */
+
+		dbmw_compact_abort(dw);
+		bg_task_cancel(dc->task);
+	} else {
+		dbstore_compact_free(dc);
+	}
 }
 
 /**
@@ -296,6 +476,8 @@ dbstore_close(dbmw_t *dw, const char *dir, const char *base)
 	if (NULL == dw)
 		return;
 
+	dbstore_compact_forget(dw);
+
 	path = make_pathname(dir, base);
 
 	if (dbstore_debug > 1)
@@ -320,8 +502,10 @@ dbstore_close(dbmw_t *dw, const char *dir, const char *base)
 void
 dbstore_delete(dbmw_t *dw)
 {
-	if (dw)
+	if (dw) {
+		dbstore_compact_forget(dw);
 		dbmw_destroy(dw, TRUE);
+	}
 }
 
 /**
@@ -368,6 +552,213 @@ dbstore_compact(dbmw_t *dw)
 	}
 }
 
+/**
+ * Background task step: migrate some pages to the compacted database.
+ */
+static bgret_t
+dbstore_compact_step(bgtask_t *bt, void *ctx, int ticks)
+{
+	struct dbstore_compact *dc = ctx;
+	long pages;
+	int r;
+
+	dbstore_compact_check(dc);
+
+	if G_UNLIKELY(NULL == dc->dw)
+		return BGR_ERROR;		/* Database was closed */
+
+	/*
+	 * Each tick accounts for the migration of one page, the scheduler
+	 * adjusting the amount of ticks to keep each slice short.
+	 */
+
+	pages = MIN(ticks, DBSTORE_COMPACT_PAGES);
+	pages = MAX(pages, 1);
+
+	if (pages < ticks)
+		bg_task_ticks_used(bt, pages);
+
+	r = dbmw_compact_step(dc->dw, pages, &dc->info);
+
+	if (r > 0)
+		return BGR_MORE;
+
+	if G_UNLIKELY(r < 0) {
+		g_warning("DBSTORE compaction of DBMW \"%s\" failed: %m", dc->name);
+		dc->failed = TRUE;
+		return BGR_ERROR;
+	}
+
+	return BGR_DONE;
+}
+
+/**
+ * Background task completion callback.
+ */
+static void
+dbstore_compact_done(bgtask_t *bt, void *ctx, bgstatus_t status, void *arg)
+{
+	struct dbstore_compact *dc = ctx;
+
+	dbstore_compact_check(dc);
+	(void) bt;
+	(void) arg;
+
+	dc->running = FALSE;
+	dc->task = NULL;
+	dc->end = tm_time();
+
+	if (NULL == dc->dw) {
+		dbstore_compact_free(dc);	/* DB was closed whilst compacting */
+		return;
+	}
+
+	if (BGS_OK != status) {
+		dc->failed = TRUE;
+		dbmw_compact_abort(dc->dw);
+	} else if (dbstore_debug) {
+		const struct sdbm_compact_info *ci = &dc->info;
+
+		g_debug("DBSTORE compacted DBMW \"%s\" in %s: %ld page%s, "
+			"%zu item%s, size went from %s to %s bytes",
+			dc->name, compact_time(delta_time(dc->end, dc->start)),
+			ci->pages, plural(ci->pages), ci->items, plural(ci->items),
+			filesize_to_string(ci->old_size),
+			filesize_to_string2(ci->new_size));
+	}
+}
+
+/**
+ * Compact the DBMW database online, without preventing its usage.
+ *
+ * Contrary to dbstore_compact(), the work is done in the background, a
+ * few pages at a time, and the compacted database replaces the original
+ * one when all the pages have been migrated.
+ *
+ * @return TRUE if compaction was launched.
+ */
+bool
+dbstore_compact_online(dbmw_t *dw)
+{
+	struct dbstore_compact *dc;
+	static const bgstep_cb_t steps[] = { dbstore_compact_step };
+
+	if (dbstore_compactions != NULL) {
+		dc = htable_lookup(dbstore_compactions, dw);
+		if (dc != NULL && dc->running)
+			return FALSE;		/* Already compacting */
+	} else {
+		dbstore_compactions = htable_create(HASH_KEY_SELF, 0);
+		dc = NULL;
+	}
+
+	if (!dbmw_compact_start(dw)) {
+		if (dbstore_debug && DBMAP_SDBM == dbmw_map_type(dw)) {
+			g_warning("DBSTORE cannot compact DBMW \"%s\": %m",
+				dbmw_name(dw));
+		}
+		goto failed;
+	}
+
+	if (NULL == dc) {
+		WALLOC0(dc);
+		dc->magic = DBSTORE_COMPACT_MAGIC;
+		dc->dw = dw;
+		dc->name = atom_str_get(dbmw_name(dw));
+		htable_insert(dbstore_compactions, dw, dc);
+	} else {
+		ZERO(&dc->info);
+		dc->end = 0;
+		dc->failed = FALSE;
+	}
+
+	dc->start = tm_time();
+	dc->running = TRUE;
+	dc->task = bg_task_create(NULL, "DB compaction", steps, N_ITEMS(steps),
+		dc, NULL, dbstore_compact_done, NULL);
+
+	if (NULL == dc->task) {
+		dbmw_compact_abort(dw);		/* Shutting down */
+		dc->running = FALSE;
+		dc->failed = TRUE;
+		return FALSE;
+	}
+
+	if (dbstore_debug > 1)
+		g_debug("DBSTORE compacting DBMW \"%s\" online", dbmw_name(dw));
+
+	return TRUE;
+
+failed:
+	if (0 == htable_count(dbstore_compactions))
+		htable_free_null(&dbstore_compactions);
+
+	return FALSE;
+}
+
+static void
+dbstore_compact_info_get(const void *unused_key, void *value, void *data)
+{
+	const struct dbstore_compact *dc = value;
+	pslist_t **sl_ptr = data;
+	dbstore_compact_info_t *ci;
+
+	dbstore_compact_check(dc);
+	(void) unused_key;
+
+	WALLOC0(ci);
+	ci->magic = DBSTORE_COMPACT_INFO_MAGIC;
+	ci->name = atom_str_get(dc->name);
+	ci->progress = dc->info;		/* struct copy */
+	ci->start = dc->start;
+	ci->elapsed = delta_time(0 == dc->end ? tm_time() : dc->end, dc->start);
+	ci->running = dc->running;
+	ci->failed = dc->failed;
+
+	*sl_ptr = pslist_prepend(*sl_ptr, ci);
+}
+
+/**
+ * Retrieve information about online compactions.
+ *
+ * @return list of dbstore_compact_info_t that must be freed by calling
+ * dbstore_compact_info_list_free_null().
+ */
+pslist_t *
+dbstore_compact_info_list(void)
+{
+	pslist_t *sl = NULL;
+
+	if (dbstore_compactions != NULL)
+		htable_foreach(dbstore_compactions, dbstore_compact_info_get, &sl);
+
+	return sl;
+}
+
+static void
+dbstore_compact_info_free(void *data, void *udata)
+{
+	dbstore_compact_info_t *ci = data;
+
+	dbstore_compact_info_check(ci);
+	(void) udata;
+
+	atom_str_free_null(&ci->name);
+	WFREE(ci);
+}
+
+/**
+ * Free list created by dbstore_compact_info_list() and nullify pointer.
+ */
+void
+dbstore_compact_info_list_free_null(pslist_t **sl_ptr)
+{
+	pslist_t *sl = *sl_ptr;
+
+	pslist_foreach(sl, dbstore_compact_info_free, NULL);
+	pslist_free_null(sl_ptr);
+}
+
 static void
 dbstore_move_file(const char *old_path, const char *new_path, const char *ext)
 {
@@ -404,25 +795,14 @@ dbstore_move(const char *src, const char *dst, const char *base)
 	dbstore_move_file(old_path, new_path, DBM_DIRFEXT);
 	dbstore_move_file(old_path, new_path, DBM_PAGFEXT);
 	dbstore_move_file(old_path, new_path, DBM_DATFEXT);
+	dbstore_move_file(old_path, new_path, DBWAL_FEXT);
+	dbstore_move_file(old_path, new_path, BPTREE_FEXT);
+	dbstore_move_file(old_path, new_path, BPTREE_FEXT BPTREE_JEXT);
 
 	HFREE_NULL(old_path);
 	HFREE_NULL(new_path);
 }
 
-static void
-dbstore_unlink_file(const char *path, const char *ext)
-{
-	char *file = h_strconcat(path, ext, NULL_PTR);
-
-	if (file_exists(file)) {
-		if (-1 == unlink(file)) {
-			s_carp("could not unlink \"%s\": %m", file);
-		}
-	}
-
-	HFREE_NULL(file);
-}
-
 /**
  * Remove SDBM files from "dir".
  *
@@ -439,6 +819,9 @@ dbstore_unlink(const char *dir, const char *base)
 	dbstore_unlink_file(path, DBM_DIRFEXT);
 	dbstore_unlink_file(path, DBM_PAGFEXT);
 	dbstore_unlink_file(path, DBM_DATFEXT);
+	dbstore_unlink_file(path, DBWAL_FEXT);
+	dbstore_unlink_file(path, BPTREE_FEXT);
+	dbstore_unlink_file(path, BPTREE_FEXT BPTREE_JEXT);
 
 	HFREE_NULL(path);
 }
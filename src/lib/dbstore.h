@@ -36,6 +36,7 @@
 
 #include "dbmw.h"
 #include "dbmap.h"
+#include "tm.h"			/* For time_delta_t */
 
 /**
  * Key/value description.
@@ -46,12 +47,17 @@
  * based on its serialized form.
  *
  * When value_data_size is 0, it is taken as being identical to value_size.
+ *
+ * When ordered is TRUE, keys are kept sorted on disk (as byte strings, through
+ * their serialized form) so that dbmw_foreach_range() only needs to visit the
+ * keys within the range.
  */
 typedef struct dbstore_kv {
 	size_t key_size;			/**< Constant key size, in bytes */
 	dbmap_keylen_t key_len;		/**< Optional, computes serialized key length */
 	size_t value_size;			/**< Maximum value size, (bytes, structure) */
 	size_t value_data_size;		/**< Maximum value size, (bytes, serialized) */
+	bool ordered;				/**< Whether keys are kept sorted */
 } dbstore_kv_t;
 
 /**
@@ -63,6 +69,28 @@ typedef struct dbstore_packing {
 	dbmw_free_t valfree;		/**< Free allocated deserialization data */
 } dbstore_packing_t;
 
+enum dbstore_compact_info_magic { DBSTORE_COMPACT_INFO_MAGIC = 0x5b3ee4f1 };
+
+/**
+ * Online compaction information that can be retrieved.
+ */
+typedef struct dbstore_compact_info {
+	enum dbstore_compact_info_magic magic;
+	const char *name;					/**< DB name (atom) */
+	struct sdbm_compact_info progress;	/**< Last progress report */
+	time_t start;						/**< Start time */
+	time_delta_t elapsed;				/**< Running time, in seconds */
+	uint running:1;						/**< Is compaction running? */
+	uint failed:1;						/**< Has compaction failed? */
+} dbstore_compact_info_t;
+
+static inline void
+dbstore_compact_info_check(const dbstore_compact_info_t * const ci)
+{
+	g_assert(ci != NULL);
+	g_assert(DBSTORE_COMPACT_INFO_MAGIC == ci->magic);
+}
+
 /*
  * Public interface.
  */
@@ -85,6 +113,9 @@ void dbstore_sync_flush(dbmw_t *dw);
 void dbstore_close(dbmw_t *dw, const char *dir, const char *base);
 void dbstore_delete(dbmw_t *dw);
 void dbstore_compact(dbmw_t *dw);
+bool dbstore_compact_online(dbmw_t *dw);
+struct pslist *dbstore_compact_info_list(void);
+void dbstore_compact_info_list_free_null(struct pslist **sl_ptr);
 void dbstore_move(const char *src, const char *dst, const char *base);
 void dbstore_unlink(const char *dir, const char *base);
 
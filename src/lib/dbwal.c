@@ -0,0 +1,1020 @@
+/*
+ * Copyright (c) 2026 gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Group-commit write-ahead log for DB maps.
+ *
+ * Persistent databases use deferred writes: updates linger in the DBMW
+ * cache and in the SDBM page cache until the next periodic synchronization,
+ * and are lost if we crash in-between.  Forcing each update to disk would
+ * mean random writes all over the .pag file, followed by an fsync().
+ *
+ * Instead, each update is appended to a log file as a self-contained
+ * record (serialized key and value, protected by a CRC).  Records are
+ * accumulated in memory and written to the log in one sequential write,
+ * followed by a single fdatasync(), at most DBWAL_DELAY ms after the first
+ * of them was logged: all the updates made during that window are committed
+ * together.
+ *
+ * When the database is re-opened, the records present in the log are
+ * replayed into the map.  Replaying is idempotent, so the log only needs to
+ * be truncated once the database files have been synchronized with the data
+ * it holds, which we call a checkpoint.  Checkpoints happen whenever the
+ * database is fully synchronized, and are also requested by the log itself
+ * when it grows beyond DBWAL_CHECKPOINT bytes.
+ *
+ * Writing and synchronizing the log, as well as synchronizing the database
+ * files during checkpoints, is done by a dedicated thread shared by all the
+ * logs, so that the main thread does not have to wait for the disk.  The
+ * outcome of each operation is reported back to the thread owning the log
+ * through its thread event queue.  Records logged whilst a commit is in
+ * progress are committed by the next one.
+ *
+ * To be able to keep logging updates whilst the database files are being
+ * synchronized, the log is renamed with a DBWAL_OLDFEXT suffix and a new
+ * log is started when a checkpoint begins.  The old log is removed when the
+ * checkpoint completes, and is replayed before the current log otherwise.
+ *
+ * A record that was not fully written when we crashed is detected through
+ * its CRC at replay time, and it is discarded along with anything that
+ * follows it.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "dbwal.h"
+
+#include "aq.h"
+#include "compat_pio.h"
+#include "cond.h"
+#include "cq.h"
+#include "crc.h"
+#include "debug.h"
+#include "endian.h"
+#include "fd.h"
+#include "file.h"
+#include "halloc.h"
+#include "hstrfn.h"
+#include "log.h"
+#include "misc.h"				/* For english_strerror() */
+#include "mutex.h"
+#include "once.h"
+#include "stringify.h"
+#include "teq.h"
+#include "thread.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define DBWAL_BUFSIZE		(64 * 1024)			/**< Initial buffer size */
+#define DBWAL_DELAY			1000				/**< Group commit delay (ms) */
+#define DBWAL_CHECKPOINT	(4 * 1024 * 1024)	/**< Log size for checkpoint */
+#define DBWAL_OLDFEXT		".old"				/**< Log being checkpointed */
+#define DBWAL_STACK			THREAD_STACK_MIN	/**< Log thread stack */
+
+/*
+ * Record layout, all integers being stored in little-endian:
+ *
+ *    0  CRC-32 of the remaining of the record
+ *    4  operation (DBWAL_OP_PUT or DBWAL_OP_DEL)
+ *    5  key length (16 bits)
+ *    7  value length (32 bits), 0 for deletions
+ *   11  key bytes, followed by the value bytes
+ */
+#define DBWAL_HDRLEN		11
+
+enum dbwal_op {
+	DBWAL_OP_PUT = 1,
+	DBWAL_OP_DEL = 2
+};
+
+enum dbwal_magic { DBWAL_MAGIC = 0x1c5e83a9 };
+
+/**
+ * A write-ahead log.
+ *
+ * Fields marked "locked" are shared with the log thread and only accessed
+ * with the `lock' mutex held.
+ */
+struct dbwal {
+	enum dbwal_magic magic;
+	const char *name;			/**< Name of the logged database, for logs */
+	char *path;					/**< Path of the log file */
+	char *oldpath;				/**< Path of the log being checkpointed */
+	int fd;						/**< Opened log file */
+	int mode;					/**< File permissions, to create new logs */
+	uint owner;					/**< Thread owning the log */
+	char *buf;					/**< Records pending commit */
+	size_t bufsize;				/**< Size of buffer */
+	size_t buflen;				/**< Amount of data held in buffer */
+	fileoffset_t size;			/**< Amount of data committed to the log */
+	cevent_t *commit_ev;		/**< Group commit event */
+	dbwal_checkpoint_t checkpoint;	/**< Checkpoint callback */
+	void *checkpoint_arg;		/**< Checkpoint callback argument */
+	struct dbwal_job *commit_job;	/**< Commit in progress */
+	struct dbwal_job *ckpt_job;		/**< Checkpoint in progress */
+	mutex_t lock;				/**< Thread-safe lock */
+	cond_t done;				/**< Signals completion of a job */
+	uint running;				/**< Locked: amount of jobs not completed */
+	ulong records;				/**< Stats: amount of records logged */
+	ulong commits;				/**< Stats: amount of commits */
+	ulong checkpoints;			/**< Stats: amount of log truncations */
+	uint failed:1;				/**< Whether last write failed */
+	uint old:1;					/**< Whether old log was not checkpointed */
+};
+
+enum dbwal_job_magic { DBWAL_JOB_MAGIC = 0x4f2e7b15 };
+
+enum dbwal_job_kind {
+	DBWAL_JOB_COMMIT,			/**< Write and synchronize records */
+	DBWAL_JOB_CHECKPOINT		/**< Same, then synchronize the database */
+};
+
+/**
+ * An operation performed by the log thread.
+ *
+ * The `wal' field is only valid until the job is reaped by the log owner:
+ * the job itself is freed when the completion event is processed, which can
+ * happen after the log was closed.
+ */
+struct dbwal_job {
+	enum dbwal_job_magic magic;
+	enum dbwal_job_kind kind;
+	dbwal_t *wal;				/**< The log, until job is reaped */
+	int fd;						/**< Log file to write to, -1 if none */
+	char *buf;					/**< Records to write, NULL if none */
+	size_t len;					/**< Length of records */
+	fileoffset_t off;			/**< Offset where records are written */
+	dbwal_sync_t sync;			/**< Database synchronization routine */
+	void *sync_arg;				/**< Argument for synchronization routine */
+	int error;					/**< Write error, 0 if none */
+	int sync_error;				/**< Database synchronization error */
+	uint8 reaped;				/**< Whether log owner processed outcome */
+};
+
+static aqueue_t *dbwal_requests;	/**< Jobs for the log thread */
+static once_flag_t dbwal_thread_inited;
+static int dbwal_thread_id = -1;
+
+static inline void
+dbwal_check(const struct dbwal * const wal)
+{
+	g_assert(wal != NULL);
+	g_assert(DBWAL_MAGIC == wal->magic);
+}
+
+static inline void
+dbwal_job_check(const struct dbwal_job * const job)
+{
+	g_assert(job != NULL);
+	g_assert(DBWAL_JOB_MAGIC == job->magic);
+}
+
+static void dbwal_job_run(struct dbwal_job *job);
+static void dbwal_job_event(void *data);
+
+/**
+ * The log thread, performing the jobs it is given in submission order.
+ */
+static void *
+dbwal_thread(void *unused_arg)
+{
+	(void) unused_arg;
+
+	thread_set_name("DB log");
+
+	for (;;) {
+		struct dbwal_job *job = aq_remove(dbwal_requests);
+		dbwal_t *wal;
+		uint owner;
+
+		dbwal_job_check(job);
+
+		dbwal_job_run(job);
+
+		/*
+		 * Once the job is flagged as completed, the log can be freed by its
+		 * owner, which reaps all the completed jobs before closing it.
+		 */
+
+		wal = job->wal;
+		owner = wal->owner;
+
+		mutex_lock(&wal->lock);
+		g_assert(wal->running != 0);
+		wal->running--;
+		cond_broadcast(&wal->done, &wal->lock);
+		mutex_unlock(&wal->lock);
+
+		teq_safe_post(owner, dbwal_job_event, job);
+	}
+
+	return NULL;
+}
+
+/**
+ * Launch the log thread.
+ */
+static void
+dbwal_thread_init(void)
+{
+	dbwal_requests = aq_make();
+	dbwal_thread_id = thread_create(dbwal_thread, NULL,
+		THREAD_F_DETACH | THREAD_F_NO_CANCEL |
+			THREAD_F_NO_POOL | THREAD_F_WARN,
+		DBWAL_STACK);
+
+	if (-1 == dbwal_thread_id)
+		s_warning("DBWAL logs will be written synchronously");
+}
+
+/**
+ * @return whether I/O operations on the log can be delegated to the log
+ * thread, which requires the log owner to be able to process completion
+ * events from its I/O loop.
+ */
+static bool
+dbwal_async(const dbwal_t *wal)
+{
+	if (wal->owner != THREAD_MAIN_ID || !teq_is_supported(wal->owner))
+		return FALSE;
+
+	ONCE_FLAG_RUN(dbwal_thread_inited, dbwal_thread_init);
+
+	return dbwal_thread_id != -1;
+}
+
+/**
+ * Allocate a new job for the log.
+ */
+static struct dbwal_job *
+dbwal_job_alloc(dbwal_t *wal, enum dbwal_job_kind kind)
+{
+	struct dbwal_job *job;
+
+	WALLOC0(job);
+	job->magic = DBWAL_JOB_MAGIC;
+	job->kind = kind;
+	job->wal = wal;
+	job->fd = -1;
+
+	return job;
+}
+
+static void
+dbwal_job_free(struct dbwal_job *job)
+{
+	dbwal_job_check(job);
+	g_assert(job->reaped);
+
+	HFREE_NULL(job->buf);
+	job->magic = 0;
+	WFREE(job);
+}
+
+/**
+ * Hand the pending records over to the job, which will write them at the
+ * given offset.
+ */
+static void
+dbwal_job_take_pending(struct dbwal_job *job, fileoffset_t off)
+{
+	dbwal_t *wal = job->wal;
+
+	job->fd = wal->fd;
+	job->off = off;
+
+	if (wal->buflen != 0) {
+		job->buf = wal->buf;
+		job->len = wal->buflen;
+		wal->buf = halloc(wal->bufsize);
+		wal->buflen = 0;
+	}
+}
+
+/**
+ * Perform the job, from the log thread or synchronously from the owner.
+ */
+static void
+dbwal_job_run(struct dbwal_job *job)
+{
+	if (job->buf != NULL) {
+		ssize_t w = compat_pwrite(job->fd, job->buf, job->len, job->off);
+
+		if G_UNLIKELY(UNSIGNED(w) != job->len)
+			job->error = -1 == w ? errno : EIO;
+		else if G_UNLIKELY(-1 == fd_fdatasync(job->fd))
+			job->error = errno;
+	}
+
+	if (DBWAL_JOB_CHECKPOINT == job->kind) {
+		errno = 0;
+		if (!(*job->sync)(job->sync_arg))
+			job->sync_error = 0 == errno ? EIO : errno;
+
+		/*
+		 * The checkpointed log is never written to again.
+		 */
+
+		if (job->fd != -1)
+			fd_close(&job->fd);
+	}
+}
+
+/**
+ * Process the outcome of a completed job, in the thread owning the log.
+ */
+static void
+dbwal_job_reap(struct dbwal_job *job)
+{
+	dbwal_t *wal = job->wal;
+
+	dbwal_check(wal);
+	g_assert(!job->reaped);
+
+	job->reaped = TRUE;
+
+	switch (job->kind) {
+	case DBWAL_JOB_COMMIT:
+		g_assert(job == wal->commit_job);
+		wal->commit_job = NULL;
+
+		/*
+		 * On errors, we drop the records: the database itself is still being
+		 * updated, we just lose the durability of these changes.  Because we
+		 * do not update the log size, the next write will overwrite any
+		 * partially written record.
+		 */
+
+		if G_UNLIKELY(job->error != 0) {
+			if (!wal->failed) {
+				s_warning("DBWAL \"%s\" cannot commit %zu byte%s to \"%s\": %s",
+					wal->name, job->len, plural(job->len), wal->path,
+					english_strerror(job->error));
+			}
+			wal->failed = TRUE;
+			break;
+		}
+
+		wal->failed = FALSE;
+		wal->commits++;
+
+		/*
+		 * If a checkpoint started since, the records were written to the
+		 * log being checkpointed.
+		 */
+
+		if (job->fd == wal->fd)
+			wal->size = job->off + job->len;
+		break;
+	case DBWAL_JOB_CHECKPOINT:
+		g_assert(job == wal->ckpt_job);
+		wal->ckpt_job = NULL;
+
+		if G_UNLIKELY(job->sync_error != 0) {
+			s_warning("DBWAL \"%s\" cannot checkpoint: %s -- keeping \"%s\"",
+				wal->name, english_strerror(job->sync_error), wal->oldpath);
+			break;
+		}
+
+		if (-1 == unlink(wal->oldpath) && ENOENT != errno) {
+			s_warning("DBWAL \"%s\" cannot unlink \"%s\": %m",
+				wal->name, wal->oldpath);
+		}
+		wal->old = FALSE;
+		wal->checkpoints++;
+		break;
+	}
+}
+
+/**
+ * Submit job to the log thread, or perform it right away when there is none.
+ */
+static void
+dbwal_job_submit(struct dbwal_job *job)
+{
+	dbwal_t *wal = job->wal;
+
+	if (dbwal_async(wal)) {
+		mutex_lock(&wal->lock);
+		wal->running++;
+		mutex_unlock(&wal->lock);
+		aq_put(dbwal_requests, job);
+	} else {
+		dbwal_job_run(job);
+		dbwal_job_reap(job);
+		dbwal_job_free(job);
+	}
+}
+
+/**
+ * Wait for all the jobs submitted to the log thread to complete, and
+ * process their outcome.
+ */
+static void
+dbwal_wait(dbwal_t *wal)
+{
+	mutex_lock(&wal->lock);
+	while (wal->running != 0)
+		cond_wait_clean(&wal->done, &wal->lock);
+	mutex_unlock(&wal->lock);
+
+	/*
+	 * The completion events will find the jobs already reaped.
+	 */
+
+	if (wal->commit_job != NULL)
+		dbwal_job_reap(wal->commit_job);
+	if (wal->ckpt_job != NULL)
+		dbwal_job_reap(wal->ckpt_job);
+}
+
+/**
+ * Start committing the records logged since the last commit, unless there
+ * is already one in progress.
+ */
+static void
+dbwal_commit_start(dbwal_t *wal)
+{
+	struct dbwal_job *job;
+
+	if (wal->commit_job != NULL || 0 == wal->buflen)
+		return;
+
+	cq_cancel(&wal->commit_ev);
+
+	job = dbwal_job_alloc(wal, DBWAL_JOB_COMMIT);
+	dbwal_job_take_pending(job, wal->size);
+	wal->commit_job = job;
+	dbwal_job_submit(job);
+}
+
+/**
+ * Request a checkpoint when the log has grown too large.
+ */
+static void
+dbwal_check_size(dbwal_t *wal)
+{
+	if (
+		wal->size >= DBWAL_CHECKPOINT && NULL == wal->ckpt_job &&
+		wal->checkpoint != NULL
+	)
+		(*wal->checkpoint)(wal->checkpoint_arg);
+}
+
+/**
+ * Thread event queue callback, invoked in the thread owning the log when
+ * the log thread completed a job.
+ */
+static void
+dbwal_job_event(void *data)
+{
+	struct dbwal_job *job = data;
+
+	dbwal_job_check(job);
+
+	if (!job->reaped) {
+		dbwal_t *wal = job->wal;
+
+		dbwal_job_reap(job);
+
+		/*
+		 * Commit the records logged whilst we were committing.
+		 */
+
+		if (DBWAL_JOB_COMMIT == job->kind) {
+			dbwal_commit_start(wal);
+			dbwal_check_size(wal);
+		}
+	}
+
+	dbwal_job_free(job);
+}
+
+/**
+ * Open write-ahead log, creating it if needed.
+ *
+ * Any data held in the log should be replayed by the caller before logging
+ * new records.
+ *
+ * The log can only be used by the calling thread.
+ *
+ * @param name		name of the logged database, for logs
+ * @param path		path of the log file
+ * @param mode		file permissions, if the log is created
+ *
+ * @return a new log object, NULL on error.
+ */
+dbwal_t *
+dbwal_open(const char *name, const char *path, int mode)
+{
+	dbwal_t *wal;
+	filestat_t buf;
+	int fd;
+
+	g_assert(name != NULL);
+	g_assert(path != NULL);
+
+	fd = file_create(path, O_RDWR, mode);
+	if (-1 == fd)
+		return NULL;
+
+	if (-1 == fstat(fd, &buf)) {
+		s_warning("DBWAL \"%s\" cannot stat \"%s\": %m", name, path);
+		fd_close(&fd);
+		return NULL;
+	}
+
+	WALLOC0(wal);
+	wal->magic = DBWAL_MAGIC;
+	wal->name = name;
+	wal->path = h_strdup(path);
+	wal->oldpath = h_strconcat(path, DBWAL_OLDFEXT, NULL_PTR);
+	wal->fd = fd;
+	wal->mode = mode;
+	wal->owner = thread_small_id();
+	wal->size = buf.st_size;
+	wal->bufsize = DBWAL_BUFSIZE;
+	wal->buf = halloc(wal->bufsize);
+	wal->old = file_exists(wal->oldpath);
+	mutex_init(&wal->lock);
+	cond_init(&wal->done, &wal->lock);
+
+	return wal;
+}
+
+/**
+ * Commit all the logged records to disk, waiting for completion.
+ *
+ * @return TRUE on success.
+ */
+bool
+dbwal_commit(dbwal_t *wal)
+{
+	struct dbwal_job *job;
+	bool ok;
+
+	dbwal_check(wal);
+
+	dbwal_wait(wal);
+
+	if (0 == wal->buflen)
+		return !wal->failed;
+
+	cq_cancel(&wal->commit_ev);
+
+	job = dbwal_job_alloc(wal, DBWAL_JOB_COMMIT);
+	dbwal_job_take_pending(job, wal->size);
+	wal->commit_job = job;
+	dbwal_job_run(job);
+	ok = 0 == job->error;
+	dbwal_job_reap(job);
+	dbwal_job_free(job);
+
+	return ok;
+}
+
+/**
+ * Callout queue callback to commit the records logged since the last commit.
+ */
+static void
+dbwal_commit_ev(cqueue_t *cq, void *obj)
+{
+	dbwal_t *wal = obj;
+
+	dbwal_check(wal);
+
+	cq_zero(cq, &wal->commit_ev);
+	dbwal_commit_start(wal);
+	dbwal_check_size(wal);
+}
+
+/**
+ * Append a new record to the log.
+ */
+static void
+dbwal_append(dbwal_t *wal, enum dbwal_op op,
+	const void *key, size_t klen, const void *value, size_t vlen)
+{
+	size_t len = DBWAL_HDRLEN + klen + vlen;
+	char *p;
+
+	dbwal_check(wal);
+	g_assert(key != NULL);
+	g_assert(klen <= MAX_INT_VAL(uint16));
+	g_assert(vlen <= MAX_INT_VAL(uint32));
+	g_assert(0 == vlen || value != NULL);
+
+	/*
+	 * When the buffer is full, commit it right away.  If a commit is already
+	 * in progress, we have to accumulate more records until it completes.
+	 */
+
+	if (wal->buflen + len > wal->bufsize) {
+		dbwal_commit_start(wal);
+
+		if G_UNLIKELY(wal->buflen + len > wal->bufsize) {
+			wal->bufsize = MAX(wal->bufsize * 2, wal->buflen + len);
+			wal->buf = hrealloc(wal->buf, wal->bufsize);
+		}
+	}
+
+	p = &wal->buf[wal->buflen];
+	p[4] = op;
+	poke_le16(&p[5], klen);
+	poke_le32(&p[7], vlen);
+	memcpy(&p[DBWAL_HDRLEN], key, klen);
+	if (vlen != 0)
+		memcpy(&p[DBWAL_HDRLEN + klen], value, vlen);
+	poke_le32(p, crc32_update(-1U, &p[4], len - 4));
+
+	wal->buflen += len;
+	wal->records++;
+
+	if (NULL == wal->commit_ev)
+		wal->commit_ev = cq_main_insert(DBWAL_DELAY, dbwal_commit_ev, wal);
+}
+
+/**
+ * Log insertion or replacement of a key.
+ *
+ * @param wal		the write-ahead log
+ * @param key		the key
+ * @param klen		the key length
+ * @param value		the serialized value
+ * @param vlen		the length of the serialized value
+ */
+void
+dbwal_put(dbwal_t *wal,
+	const void *key, size_t klen, const void *value, size_t vlen)
+{
+	dbwal_append(wal, DBWAL_OP_PUT, key, klen, value, vlen);
+}
+
+/**
+ * Log deletion of a key.
+ *
+ * @param wal		the write-ahead log
+ * @param key		the key
+ * @param klen		the key length
+ */
+void
+dbwal_delete(dbwal_t *wal, const void *key, size_t klen)
+{
+	dbwal_append(wal, DBWAL_OP_DEL, key, klen, NULL, 0);
+}
+
+/**
+ * Replay records from a log file, up to the first invalid one.
+ *
+ * @param fd		the log file
+ * @param size		the log file size
+ * @param cb		callback to invoke on each record
+ * @param arg		additional callback argument
+ * @param n			incremented with the amount of records replayed
+ *
+ * @return the offset of the first invalid record, the file size if all the
+ * records were valid.
+ */
+static fileoffset_t
+dbwal_replay_file(int fd, fileoffset_t size,
+	dbwal_replay_cb_t cb, void *arg, size_t *n)
+{
+	char hdr[DBWAL_HDRLEN];
+	char *data = NULL;
+	size_t datalen = 0;
+	fileoffset_t off = 0;
+
+	while (off + DBWAL_HDRLEN <= size) {
+		uint8 op;
+		size_t klen, vlen, len;
+		uint32 crc;
+
+		if (sizeof hdr != compat_pread(fd, hdr, sizeof hdr, off))
+			break;
+
+		op = hdr[4];
+		klen = peek_le16(&hdr[5]);
+		vlen = peek_le32(&hdr[7]);
+		len = klen + vlen;
+
+		if (DBWAL_OP_PUT != op && (DBWAL_OP_DEL != op || vlen != 0))
+			break;
+		if (off + DBWAL_HDRLEN + len > size)
+			break;
+
+		if (len > datalen) {
+			datalen = len;
+			data = hrealloc(data, datalen);
+		}
+
+		if (len != 0 && UNSIGNED(compat_pread(fd, data, len,
+				off + DBWAL_HDRLEN)) != len)
+			break;
+
+		crc = crc32_update(-1U, &hdr[4], DBWAL_HDRLEN - 4);
+		crc = crc32_update(crc, data, len);
+
+		if (crc != peek_le32(hdr))
+			break;
+
+		(*cb)(data, klen, DBWAL_OP_DEL == op ? NULL : &data[klen], vlen, arg);
+
+		off += DBWAL_HDRLEN + len;
+		(*n)++;
+	}
+
+	HFREE_NULL(data);
+
+	return off;
+}
+
+/**
+ * Replay the log, invoking the callback on each record, in the order they
+ * were logged.
+ *
+ * If a checkpoint did not complete, the log being checkpointed at that time
+ * is replayed first.
+ *
+ * Replaying stops at the first invalid record, which can only happen when
+ * we crashed whilst writing to the log: the remaining of the log is then
+ * discarded.
+ *
+ * @param wal		the write-ahead log
+ * @param cb		callback to invoke on each record
+ * @param arg		additional callback argument
+ *
+ * @return the amount of records replayed.
+ */
+size_t
+dbwal_replay(dbwal_t *wal, dbwal_replay_cb_t cb, void *arg)
+{
+	size_t n = 0;
+	fileoffset_t off;
+
+	dbwal_check(wal);
+	g_assert(cb != NULL);
+	g_assert(0 == wal->buflen);
+
+	if (wal->old) {
+		int fd = file_open_missing(wal->oldpath, O_RDONLY);
+		filestat_t buf;
+
+		if (fd != -1 && 0 == fstat(fd, &buf))
+			dbwal_replay_file(fd, buf.st_size, cb, arg, &n);
+
+		fd_close(&fd);
+	}
+
+	off = dbwal_replay_file(wal->fd, wal->size, cb, arg, &n);
+
+	if (off != wal->size) {
+		fileoffset_t extra = wal->size - off;
+
+		s_warning("DBWAL \"%s\" discarding %s trailing byte%s from \"%s\"",
+			wal->name, filesize_to_string(extra), plural(extra), wal->path);
+
+		if (-1 == ftruncate(wal->fd, off)) {
+			s_warning("DBWAL \"%s\" cannot truncate \"%s\": %m",
+				wal->name, wal->path);
+		}
+		wal->size = off;
+	}
+
+	return n;
+}
+
+/**
+ * Register the routine to call when the log becomes too large.
+ */
+void
+dbwal_set_checkpoint(dbwal_t *wal, dbwal_checkpoint_t cb, void *arg)
+{
+	dbwal_check(wal);
+
+	wal->checkpoint = cb;
+	wal->checkpoint_arg = arg;
+}
+
+/**
+ * @return whether a checkpoint started by dbwal_checkpoint() is in progress.
+ */
+bool
+dbwal_checkpointing(const dbwal_t *wal)
+{
+	dbwal_check(wal);
+
+	return wal->ckpt_job != NULL;
+}
+
+/**
+ * Discard all the logged records, including those pending commit.
+ *
+ * This must only be called once the database has durably recorded all the
+ * updates made so far.
+ *
+ * @return TRUE on success.
+ */
+bool
+dbwal_truncate(dbwal_t *wal)
+{
+	dbwal_check(wal);
+
+	dbwal_wait(wal);
+	cq_cancel(&wal->commit_ev);
+
+	wal->buflen = 0;
+
+	if (wal->old) {
+		if (-1 == unlink(wal->oldpath) && ENOENT != errno) {
+			s_warning("DBWAL \"%s\" cannot unlink \"%s\": %m",
+				wal->name, wal->oldpath);
+		}
+		wal->old = FALSE;
+	}
+
+	if (0 == wal->size)
+		return TRUE;
+
+	if (-1 == ftruncate(wal->fd, 0)) {
+		s_warning("DBWAL \"%s\" cannot truncate \"%s\": %m",
+			wal->name, wal->path);
+		return FALSE;
+	}
+
+	wal->size = 0;
+	wal->checkpoints++;
+
+	return TRUE;
+}
+
+/**
+ * Start a checkpoint, without waiting for the disk.
+ *
+ * The database must have been flushed before calling this routine, so that
+ * synchronizing its files, which is the purpose of the supplied routine,
+ * makes all the updates logged so far durable.  The routine is invoked
+ * from the log thread, and the records logged so far are discarded if it
+ * succeeds.  Records logged in the meantime are kept.
+ *
+ * There must not be any checkpoint in progress.
+ *
+ * @param wal		the write-ahead log
+ * @param sync		routine synchronizing the database, invoked exactly once
+ * @param arg		argument for the synchronization routine
+ */
+void
+dbwal_checkpoint(dbwal_t *wal, dbwal_sync_t sync, void *arg)
+{
+	struct dbwal_job *job;
+	fileoffset_t off;
+	int fd;
+
+	dbwal_check(wal);
+	g_assert(NULL == wal->ckpt_job);
+	g_assert(sync != NULL);
+
+	if (!dbwal_async(wal))
+		goto synchronous;
+
+	job = dbwal_job_alloc(wal, DBWAL_JOB_CHECKPOINT);
+	job->sync = sync;
+	job->sync_arg = arg;
+
+	/*
+	 * Unless a previous checkpoint failed, in which case the log it was
+	 * checkpointing is still there, start a new log.  The pending records
+	 * are written to the log being checkpointed, after the ones being
+	 * committed.
+	 */
+
+	if (!wal->old) {
+		if (-1 == rename(wal->path, wal->oldpath)) {
+			s_warning("DBWAL \"%s\" cannot rename \"%s\" as \"%s\": %m",
+				wal->name, wal->path, wal->oldpath);
+			goto failed;
+		}
+
+		fd = file_create(wal->path, O_RDWR | O_TRUNC, wal->mode);
+
+		if (-1 == fd) {
+			if (-1 == rename(wal->oldpath, wal->path)) {
+				s_warning("DBWAL \"%s\" cannot rename \"%s\" as \"%s\": %m",
+					wal->name, wal->oldpath, wal->path);
+			}
+			goto failed;
+		}
+
+		off = wal->size;
+		if (wal->commit_job != NULL)
+			off += wal->commit_job->len;
+
+		cq_cancel(&wal->commit_ev);
+		dbwal_job_take_pending(job, off);
+		wal->fd = fd;
+		wal->size = 0;
+		wal->old = TRUE;
+	}
+
+	wal->ckpt_job = job;
+	dbwal_job_submit(job);
+	return;
+
+failed:
+	job->reaped = TRUE;
+	dbwal_job_free(job);
+	/* FALL THROUGH */
+
+synchronous:
+	dbwal_wait(wal);
+	errno = 0;
+
+	if ((*sync)(arg)) {
+		dbwal_truncate(wal);
+	} else {
+		s_warning("DBWAL \"%s\" cannot checkpoint: %s",
+			wal->name, english_strerror(0 == errno ? EIO : errno));
+	}
+}
+
+/**
+ * @return the amount of bytes logged, including those pending commit.
+ */
+fileoffset_t
+dbwal_size(const dbwal_t *wal)
+{
+	dbwal_check(wal);
+
+	return wal->size + wal->buflen +
+		(NULL == wal->commit_job ? 0 : wal->commit_job->len);
+}
+
+/**
+ * Commit pending records and close the log, nullifying its pointer.
+ *
+ * The log file is removed when it is empty.
+ */
+void
+dbwal_close(dbwal_t **wal_ptr)
+{
+	dbwal_t *wal = *wal_ptr;
+
+	if (wal != NULL) {
+		dbwal_check(wal);
+
+		cq_cancel(&wal->commit_ev);
+		dbwal_commit(wal);
+
+		if (common_stats) {
+			s_debug("DBWAL closing \"%s\" (%lu record%s, %lu commit%s, "
+				"%lu checkpoint%s, %s byte%s left)",
+				wal->name, wal->records, plural(wal->records),
+				wal->commits, plural(wal->commits),
+				wal->checkpoints, plural(wal->checkpoints),
+				filesize_to_string(wal->size), plural(wal->size));
+		}
+
+		fd_close(&wal->fd);
+
+		if (0 == wal->size && -1 == unlink(wal->path))
+			s_warning("DBWAL \"%s\" cannot unlink \"%s\": %m",
+				wal->name, wal->path);
+
+		cond_destroy(&wal->done);
+		mutex_destroy(&wal->lock);
+		HFREE_NULL(wal->path);
+		HFREE_NULL(wal->oldpath);
+		HFREE_NULL(wal->buf);
+		wal->magic = 0;
+		WFREE(wal);
+		*wal_ptr = NULL;
+	}
+}
+
+/* vi: set ts=4 sw=4 cindent: */
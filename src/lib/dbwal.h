@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2026 gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Group-commit write-ahead log for DB maps.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#ifndef _dbwal_h_
+#define _dbwal_h_
+
+#define DBWAL_FEXT	".wal"		/**< File extension for the log */
+
+struct dbwal;
+typedef struct dbwal dbwal_t;
+
+/**
+ * Replay callback, invoked for each valid record found in the log.
+ *
+ * @param key		the key
+ * @param klen		the key length
+ * @param value		the serialized value, NULL for a deletion
+ * @param vlen		the value length
+ * @param arg		user-supplied argument
+ */
+typedef void (*dbwal_replay_cb_t)(const void *key, size_t klen,
+	const void *value, size_t vlen, void *arg);
+
+/**
+ * Checkpoint callback, invoked when the log grows too large.
+ *
+ * It is expected to make all the logged operations durable in the underlying
+ * database, then call dbwal_truncate(), or to flush the database and call
+ * dbwal_checkpoint() to have its files synchronized by the log thread.
+ */
+typedef void (*dbwal_checkpoint_t)(void *arg);
+
+/**
+ * Database synchronization routine, invoked from the log thread during
+ * checkpoints.
+ *
+ * @return TRUE if the database files were synchronized, FALSE on error
+ * with errno set.
+ */
+typedef bool (*dbwal_sync_t)(void *arg);
+
+/*
+ * Public interface.
+ */
+
+dbwal_t *dbwal_open(const char *name, const char *path, int mode);
+void dbwal_close(dbwal_t **wal_ptr);
+
+size_t dbwal_replay(dbwal_t *wal, dbwal_replay_cb_t cb, void *arg);
+void dbwal_set_checkpoint(dbwal_t *wal, dbwal_checkpoint_t cb, void *arg);
+
+void dbwal_put(dbwal_t *wal,
+	const void *key, size_t klen, const void *value, size_t vlen);
+void dbwal_delete(dbwal_t *wal, const void *key, size_t klen);
+bool dbwal_commit(dbwal_t *wal);
+bool dbwal_truncate(dbwal_t *wal);
+void dbwal_checkpoint(dbwal_t *wal, dbwal_sync_t sync, void *arg);
+bool dbwal_checkpointing(const dbwal_t *wal);
+
+fileoffset_t dbwal_size(const dbwal_t *wal);
+
+#endif /* _dbwal_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -521,6 +521,48 @@ erbtree_lookup(const erbtree_t *tree, const void *key)
 	return NULL == rn ? NULL : ptr_add_offset(rn, -tree->offset);
 }
 
+/**
+ * Look up key in the tree, returning the associated key item if found or
+ * the item immediately following the key otherwise.
+ *
+ * When the comparison routine treats overlapping intervals as equal, this
+ * yields the first item lying at or after the point described by the key.
+ *
+ * @param tree		the red-black tree
+ * @param key		pointer to the key structure (NOT a node)
+ *
+ * @return found item associated with key, or its successor in the tree,
+ * NULL if all the items in the tree are smaller than the key.
+ */
+void *
+erbtree_lookup_ceil(const erbtree_t *tree, const void *key)
+{
+	rbnode_t *parent;
+	bool is_left;
+	rbnode_t *rn;
+
+	erbtree_check(tree);
+	g_assert(key != NULL);
+
+	if (erbtree_is_extended(tree)) {
+		rn = do_lookup_ext(ERBTREE_E(tree), key, &parent, &is_left);
+	} else {
+		rn = do_lookup(tree, key, &parent, &is_left);
+	}
+
+	/*
+	 * On a miss, `parent' is the last node visited, where the key would be
+	 * inserted.  The key would become its left child if it is smaller than
+	 * the parent, which is then the successor, otherwise the successor is
+	 * the one of the parent.
+	 */
+
+	if (NULL == rn && parent != NULL)
+		rn = is_left ? parent : erbtree_next(parent);
+
+	return NULL == rn ? NULL : ptr_add_offset(rn, -tree->offset);
+}
+
 /**
  * Look up key in the tree, returning the associated node pointer.
  *
@@ -161,6 +161,7 @@ struct file_descriptor {
 	int refcnt;					/* Reference count */
 	int fd;						/* The file descriptor, opened O_RDWR usually */
 	int omode;					/* Opening mode of file descriptor */
+	long extents;				/* Cached extent count, -1 if unknown */
 	bool revoked;				/* Whether descriptor was revoked */
 	spinlock_t lock;			/* Concurrent access protection */
 };
@@ -322,6 +323,7 @@ file_object_new_descriptor(const int d, const char * const pathname, int omode)
 	WALLOC0(fdn);
 	fdn->magic = FILE_DESCRIPTOR_MAGIC;
 	fdn->fd = d;
+	fdn->extents = -1;
 	spinlock_init(&fdn->lock);
 
 	FILE_OBJECTS_LOCK;
@@ -874,6 +876,7 @@ reopen:
 
 	if (FO_OP_MOVED == op || is_running_on_mingw()) {
 		fd->fd = file_absolute_open(fd->pathname, fd->omode, 0);
+		fd->extents = -1;		/* Copied file has its own layout */
 
 		if (!is_valid_fd(fd->fd)) {
 			s_warning("%s(): cannot reopen \"%s\" %s "
@@ -1012,7 +1015,7 @@ ssize_t
 file_object_pwrite(const file_object_t * const fo,
 	const void * const data, const size_t size, const filesize_t offset)
 {
-	const struct file_descriptor *fd;
+	struct file_descriptor *fd;
 	ssize_t w;
 
 	file_object_check(fo);
@@ -1024,8 +1027,10 @@ file_object_pwrite(const file_object_t * const fo,
 		w = file_object_ebadf();
 	else if G_UNLIKELY(!file_object_writable(fo))
 		w = file_object_eperm(fo, "write", G_STRFUNC);
-	else
+	else {
 		w = compat_pwrite(fd->fd, data, size, offset);
+		fd->extents = -1;
+	}
 
 	FILE_DESCRIPTOR_UNLOCK(fd);
 
@@ -1047,7 +1052,7 @@ ssize_t
 file_object_pwritev(const file_object_t * const fo,
 	const iovec_t * iov, const int iov_cnt, const filesize_t offset)
 {
-	const struct file_descriptor *fd;
+	struct file_descriptor *fd;
 	ssize_t w;
 
 	file_object_check(fo);
@@ -1061,8 +1066,10 @@ file_object_pwritev(const file_object_t * const fo,
 		w = file_object_ebadf();
 	else if G_UNLIKELY(!file_object_writable(fo))
 		w = file_object_eperm(fo, "write", G_STRFUNC);
-	else
+	else {
 		w = compat_pwritev(fd->fd, iov, iov_cnt, offset);
+		fd->extents = -1;
+	}
 
 	FILE_DESCRIPTOR_UNLOCK(fd);
 
@@ -1180,7 +1187,7 @@ file_object_fstat(const file_object_t * const fo, filestat_t *buf)
 int
 file_object_ftruncate(const file_object_t * const fo, filesize_t off)
 {
-	const struct file_descriptor *fd;
+	struct file_descriptor *fd;
 	int s;
 
 	file_object_check(fo);
@@ -1196,6 +1203,7 @@ file_object_ftruncate(const file_object_t * const fo, filesize_t off)
 	} else {
 		g_assert(is_valid_fd(fd->fd));
 		s = ftruncate(fd->fd, off);
+		fd->extents = -1;
 	}
 
 	FILE_DESCRIPTOR_UNLOCK(fd);
@@ -1204,10 +1212,88 @@ file_object_ftruncate(const file_object_t * const fo, filesize_t off)
 }
 
 /**
- * Predeclare a sequential access pattern for file data.
+ * Allocate disk space for the specified range of the file, letting the
+ * filesystem lay out the data contiguously even if it is later written
+ * at random offsets.
+ *
+ * @return 0 if OK, -1 on failure with errno set.
  */
-void
-file_object_fadvise_sequential(const file_object_t * const fo)
+int
+file_object_preallocate(const file_object_t * const fo,
+	filesize_t offset, filesize_t size)
+{
+	struct file_descriptor *fd;
+	int s;
+
+	file_object_check(fo);
+	g_return_val_if_fail(size != 0, 0);
+
+	fd = fo->fd;
+	FILE_DESCRIPTOR_LOCK(fd);
+
+	if G_UNLIKELY(fd->revoked) {
+		s_carp("%s(): descriptor for \"%s\" was revoked",
+			G_STRFUNC, fd->pathname);
+		s = -1;
+		errno = EBADF;
+	} else {
+		g_assert(is_valid_fd(fd->fd));
+		s = compat_fallocate(fd->fd, offset, size);
+		fd->extents = -1;
+	}
+
+	FILE_DESCRIPTOR_UNLOCK(fd);
+
+	return s;
+}
+
+/**
+ * Count the extents used to store the file on disk.
+ *
+ * Walking the extent map is costly on fragmented files, so the count is
+ * cached with the shared descriptor until the file is written, truncated
+ * or preallocated through any of its file objects.
+ *
+ * @return the amount of extents, -1 on failure with errno set.
+ */
+long
+file_object_extents(const file_object_t * const fo)
+{
+	struct file_descriptor *fd;
+	long n;
+
+	file_object_check(fo);
+
+	fd = fo->fd;
+	FILE_DESCRIPTOR_LOCK(fd);
+
+	if G_UNLIKELY(fd->revoked) {
+		n = -1;
+		errno = EBADF;
+	} else if (fd->extents >= 0) {
+		n = fd->extents;
+	} else {
+		g_assert(is_valid_fd(fd->fd));
+		n = fd->extents = compat_extent_count(fd->fd);
+	}
+
+	FILE_DESCRIPTOR_UNLOCK(fd);
+
+	return n;
+}
+
+/**
+ * Apply file access advice to the specified range.
+ *
+ * @param fo		the file object
+ * @param offset	start of the range
+ * @param size		size of the range, 0 meaning up to the end of the file
+ * @param advise	the compat_fadvise_xxx() routine to apply
+ */
+static void
+file_object_fadvise(const file_object_t * const fo,
+	filesize_t offset, filesize_t size,
+	void (*advise)(int, fileoffset_t, fileoffset_t))
 {
 	const struct file_descriptor *fd;
 
@@ -1221,12 +1307,47 @@ file_object_fadvise_sequential(const file_object_t * const fo)
 			G_STRFUNC, fd->pathname);
 	} else {
 		g_assert(is_valid_fd(fd->fd));
-		compat_fadvise_sequential(fd->fd, 0, 0);
+		(*advise)(fd->fd, offset, size);
 	}
 
 	FILE_DESCRIPTOR_UNLOCK(fd);
 }
 
+/**
+ * Predeclare a sequential access pattern for file data.
+ */
+void
+file_object_fadvise_sequential(const file_object_t * const fo)
+{
+	file_object_fadvise(fo, 0, 0, compat_fadvise_sequential);
+}
+
+/**
+ * Request asynchronous read-ahead of the specified range, which we are
+ * going to read soon.
+ */
+void
+file_object_fadvise_willneed(const file_object_t * const fo,
+	filesize_t offset, filesize_t size)
+{
+	g_return_if_fail(size != 0);
+
+	file_object_fadvise(fo, offset, size, compat_fadvise_willneed);
+}
+
+/**
+ * Let the kernel drop the cached pages of the specified range, which we
+ * are not going to read again.
+ */
+void
+file_object_fadvise_dontneed(const file_object_t * const fo,
+	filesize_t offset, filesize_t size)
+{
+	g_return_if_fail(size != 0);
+
+	file_object_fadvise(fo, offset, size, compat_fadvise_dontneed);
+}
+
 /**
  * Get the file descriptor associated with a file object. This should
  * not be used lightly and the returned file descriptor should not be
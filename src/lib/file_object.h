@@ -94,7 +94,14 @@ bool file_object_unlink(const char * const path);
 void file_object_moved(const char * const o, const char * const n);
 int file_object_fstat(const file_object_t * const fo, filestat_t *b);
 int file_object_ftruncate(const file_object_t * const fo, filesize_t off);
+int file_object_preallocate(const file_object_t * const fo,
+	filesize_t offset, filesize_t size);
+long file_object_extents(const file_object_t * const fo);
 void file_object_fadvise_sequential(const file_object_t * const fo);
+void file_object_fadvise_willneed(const file_object_t * const fo,
+	filesize_t offset, filesize_t size);
+void file_object_fadvise_dontneed(const file_object_t * const fo,
+	filesize_t offset, filesize_t size);
 
 struct pslist *file_object_info_list(void) WARN_UNUSED_RESULT;
 void file_object_info_list_free_nulll(struct pslist **sl_ptr);
@@ -0,0 +1,429 @@
+/*
+ * iprange-test -- IP range database tests and lookup benchmarks.
+ *
+ * Copyright (c) 2026 gtk-gnutella developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "endian.h"
+#include "iprange.h"
+#include "misc.h"
+#include "parse.h"
+#include "progname.h"
+#include "random.h"
+#include "str.h"
+#include "stringify.h"
+#include "tm.h"
+#include "xmalloc.h"
+
+#define RANGES		200000		/* Default amount of networks */
+#define LOOKUPS		2000000		/* Default amount of lookups */
+
+static bool verbose;
+
+struct net4 {
+	uint32 ip;
+	uint8 bits;
+	uint16 value;
+};
+
+struct net6 {
+	uint8 ip[16];
+	uint8 bits;
+	uint16 value;
+};
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-hv] [-l lookups] [-n ranges]\n"
+		"  -h : prints this help message\n"
+		"  -l : amount of lookups to perform (default %u)\n"
+		"  -n : amount of networks in database (default %u)\n"
+		"  -v : verbose mode\n"
+		, getprogname(), LOOKUPS, RANGES);
+	exit(EXIT_FAILURE);
+}
+
+static unsigned
+get_number(const char *arg, int opt)
+{
+	int error;
+	uint32 val;
+
+	val = parse_v32(arg, NULL, &error);
+	if (0 == val && error != 0) {
+		fprintf(stderr, "%s: invalid -%c argument \"%s\": %s\n",
+			getprogname(), opt, arg, english_strerror(error));
+		exit(EXIT_FAILURE);
+	}
+
+	return val;
+}
+
+/**
+ * Generate random disjoint IPv4 networks, spread over the address space.
+ *
+ * Most networks are /20 to /28 ones, with a few wider and narrower ones.
+ *
+ * @return amount of networks generated.
+ */
+static size_t
+generate4(struct net4 *nets, size_t n)
+{
+	uint64 pos = 0, stride = (1ULL << 32) / n;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		uint bits = 20 + random_value(8);
+		uint32 size;
+
+		if (0 == random_value(19))
+			bits = 12 + random_value(20);
+
+		size = 1U << (32 - bits);
+		pos += random_value(stride);
+		pos = (pos + size - 1) & ~((uint64) size - 1);		/* Align */
+
+		if (pos + size > (1ULL << 32))
+			break;
+
+		nets[i].ip = pos;
+		nets[i].bits = bits;
+		nets[i].value = 1 + random_value(250);
+		pos += size;
+	}
+
+	return i;
+}
+
+/**
+ * Generate random disjoint IPv6 networks, /16 to /64 ones mostly.
+ *
+ * @return amount of networks generated.
+ */
+static size_t
+generate6(struct net6 *nets, size_t n)
+{
+	uint64 pos = (uint64) 1 << 61, stride = ((uint64) 1 << 58) / n;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		uint bits = 24 + random_value(40);
+		uint64 size;
+
+		size = (uint64) 1 << (64 - bits);
+		pos += random_u64() % (2 * stride);
+		pos = (pos + size - 1) & ~(size - 1);		/* Align */
+
+		ZERO(&nets[i].ip);
+		poke_be64(&nets[i].ip[0], pos);
+
+		if (0 == random_value(19)) {
+			uint64 lo = random_u64();
+
+			bits = 64 + random_value(64);	/* Narrower, within that /64 */
+			if (bits < 128)
+				lo &= ~((uint64) -1 >> (bits - 64));
+			poke_be64(&nets[i].ip[8], lo);
+		}
+
+		nets[i].bits = bits;
+		nets[i].value = 1 + random_value(250);
+		pos += size;
+	}
+
+	return i;
+}
+
+static void
+load(struct iprange_db *idb, const struct net4 *n4, size_t c4,
+	const struct net6 *n6, size_t c6)
+{
+	size_t i;
+
+	iprange_reset_ipv4(idb);
+	iprange_reset_ipv6(idb);
+
+	for (i = 0; i < c4; i++) {
+		iprange_err_t e =
+			iprange_add_cidr(idb, n4[i].ip, n4[i].bits, n4[i].value);
+		g_assert_log(IPR_ERR_OK == e, "%s", iprange_strerror(e));
+	}
+
+	for (i = 0; i < c6; i++) {
+		iprange_err_t e =
+			iprange_add_cidr6(idb, n6[i].ip, n6[i].bits, n6[i].value);
+		g_assert_log(IPR_ERR_OK == e, "%s", iprange_strerror(e));
+	}
+
+	iprange_sync(idb);
+}
+
+/**
+ * Pick an address to look up: either a random one or one near the boundary
+ * of a network.
+ */
+static uint32
+pick4(const struct net4 *nets, size_t n)
+{
+	const struct net4 *net;
+
+	if (0 == n || random_value(1))
+		return random_u32();
+
+	net = &nets[random_value(n - 1)];
+
+	switch (random_value(3)) {
+	case 0:	return net->ip;
+	case 1:	return net->ip - 1;
+	case 2:	return net->ip | ~cidr_to_netmask(net->bits);
+	default: return (net->ip | ~cidr_to_netmask(net->bits)) + 1;
+	}
+}
+
+static void
+pick6(uint8 *ip6, const struct net6 *nets, size_t n)
+{
+	const struct net6 *net;
+	uint64 hi, lo;
+
+	if (0 == n || random_value(1)) {
+		poke_be64(&ip6[0], (uint64) 1 << 61 | random_u64() >> 6);
+		poke_be64(&ip6[8], random_u64());
+		return;
+	}
+
+	net = &nets[random_value(n - 1)];
+	hi = peek_be64(&net->ip[0]);
+	lo = peek_be64(&net->ip[8]);
+
+	switch (random_value(1)) {
+	case 0:
+		if (0 == lo--)
+			hi--;
+		break;
+	default:
+		if (net->bits < 64) {
+			hi |= (uint64) -1 >> net->bits;
+			lo = (uint64) -1;
+		} else if (net->bits < 128) {
+			lo |= (uint64) -1 >> (net->bits - 64);
+		}
+		if (random_value(1) && 0 == ++lo)
+			hi++;
+		break;
+	}
+
+	poke_be64(&ip6[0], hi);
+	poke_be64(&ip6[8], lo);
+}
+
+/**
+ * Check that compiled lookups match the original ones.
+ */
+static void
+check(struct iprange_db *plain, struct iprange_db *compiled,
+	const struct net4 *n4, size_t c4, const struct net6 *n6, size_t c6,
+	size_t lookups)
+{
+	size_t i, hits = 0;
+
+	for (i = 0; i < lookups; i++) {
+		uint32 ip = pick4(n4, c4);
+		uint16 v = iprange_get(plain, ip);
+		uint16 w = iprange_get(compiled, ip);
+
+		g_assert_log(v == w, "%s: IPv4 %s: plain=%u, compiled=%u",
+			G_STRFUNC, ip_to_string(ip), v, w);
+
+		if (v != 0)
+			hits++;
+	}
+
+	for (i = 0; i < lookups; i++) {
+		uint8 ip6[16];
+		uint16 v, w;
+
+		pick6(ip6, n6, c6);
+		v = iprange_get6(plain, ip6);
+		w = iprange_get6(compiled, ip6);
+
+		g_assert_log(v == w, "%s: IPv6 %s: plain=%u, compiled=%u",
+			G_STRFUNC, ipv6_to_string(ip6), v, w);
+
+		if (v != 0)
+			hits++;
+	}
+
+	if (verbose) {
+		printf("%s(): %zu lookups OK, %zu hits\n",
+			G_STRFUNC, 2 * lookups, hits);
+	}
+}
+
+static double
+bench4(struct iprange_db *idb, const uint32 *ips, size_t n)
+{
+	tm_t start, end;
+	size_t i;
+	uint sum = 0;
+
+	tm_now_exact(&start);
+	for (i = 0; i < n; i++)
+		sum += iprange_get(idb, ips[i]);
+	tm_now_exact(&end);
+
+	if (verbose)
+		printf("(checksum %u) ", sum);
+
+	return tm_elapsed_f(&end, &start) * 1e9 / MAX(n, 1);
+}
+
+static double
+bench6(struct iprange_db *idb, const uint8 *ips, size_t n)
+{
+	tm_t start, end;
+	size_t i;
+	uint sum = 0;
+
+	tm_now_exact(&start);
+	for (i = 0; i < n; i++)
+		sum += iprange_get6(idb, &ips[16 * i]);
+	tm_now_exact(&end);
+
+	if (verbose)
+		printf("(checksum %u) ", sum);
+
+	return tm_elapsed_f(&end, &start) * 1e9 / MAX(n, 1);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	int c;
+	size_t ranges = RANGES, lookups = LOOKUPS, c4, c6, i;
+	struct iprange_db *plain, *compiled;
+	struct net4 *n4;
+	struct net6 *n6;
+	uint32 *ips;
+	uint8 *ips6;
+	const char options[] = "hl:n:v";
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'l':			/* amount of lookups */
+			lookups = get_number(optarg, c);
+			break;
+		case 'n':			/* amount of networks */
+			ranges = get_number(optarg, c);
+			break;
+		case 'v':			/* verbose mode */
+			verbose = TRUE;
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0 || 0 == ranges)
+		usage();
+
+	XMALLOC_ARRAY(n4, ranges);
+	XMALLOC_ARRAY(n6, ranges);
+
+	c4 = generate4(n4, ranges);
+	c6 = generate6(n6, ranges);
+
+	plain = iprange_new();
+	compiled = iprange_new();
+	iprange_compile(compiled);
+
+	/*
+	 * Load a small database first, then reload the full one to make sure
+	 * compiled tables are properly replaced.
+	 */
+
+	load(compiled, n4, MIN(c4, 10), n6, MIN(c6, 10));
+	load(plain, n4, MIN(c4, 10), n6, MIN(c6, 10));
+	check(plain, compiled, n4, MIN(c4, 10), n6, MIN(c6, 10), lookups / 10);
+
+	load(compiled, n4, c4, n6, c6);
+	load(plain, n4, c4, n6, c6);
+
+	printf("Loaded %u IPv4 and %u IPv6 networks\n",
+		iprange_get_item_count4(compiled), iprange_get_item_count6(compiled));
+
+	check(plain, compiled, n4, c4, n6, c6, lookups);
+
+	XMALLOC_ARRAY(ips, lookups);
+	XMALLOC_ARRAY(ips6, 16 * lookups);
+
+	for (i = 0; i < lookups; i++) {
+		ips[i] = pick4(n4, c4);
+		pick6(&ips6[16 * i], n6, c6);
+	}
+
+	printf("IPv4: %.1f ns/lookup sorted, ", bench4(plain, ips, lookups));
+	printf("%.1f ns/lookup compiled\n", bench4(compiled, ips, lookups));
+	printf("IPv6: %.1f ns/lookup sorted, ", bench6(plain, ips6, lookups));
+	printf("%.1f ns/lookup compiled\n", bench6(compiled, ips6, lookups));
+
+	/*
+	 * Empty databases must answer 0 for everything.
+	 */
+
+	iprange_reset_ipv4(compiled);
+	iprange_reset_ipv6(compiled);
+	iprange_sync(compiled);
+
+	g_assert(0 == iprange_get(compiled, ips[0]));
+	g_assert(0 == iprange_get6(compiled, &ips6[0]));
+
+	iprange_free(&plain);
+	iprange_free(&compiled);
+	XFREE_NULL(ips);
+	XFREE_NULL(ips6);
+	XFREE_NULL(n4);
+	XFREE_NULL(n6);
+
+	printf("All OK!\n");
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
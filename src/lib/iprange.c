@@ -31,6 +31,21 @@
  * Lookup IP addresses from a set of IP ranges defined by a list of addresses
  * in CIDR (Classless Internet Domain Routing) format.
  *
+ * Databases that are looked up often can be compiled through iprange_compile()
+ * so that lookups no longer need a binary search through the whole set of
+ * networks.  The compiled form is rebuilt by iprange_sync() once the new
+ * set is completely loaded, lookups using the previous data until then.
+ * Like the database itself, compiled tables are not thread-safe: they must
+ * be looked up and rebuilt by the same thread.
+ *
+ * Compiled IPv4 lookups index a directory by the leading 16 bits of the
+ * address: this gives the segment of address intervals covering that /16,
+ * which is usually reduced to one or a handful of entries within the same
+ * cache line.  Compiled IPv6 lookups use a sorted array of intervals laid
+ * out in Eytzinger (breadth-first) order, which keeps the top of the implicit
+ * search tree packed in the first cache lines and lets us prefetch the next
+ * levels.
+ *
  * @author Raphael Manfredi
  * @date 2004, 2011
  * @author Christian Biere
@@ -39,13 +54,18 @@
 
 #include "common.h"
 
-#include "host_addr.h"
 #include "iprange.h"
+
+#include "endian.h"
+#include "host_addr.h"
 #include "misc.h"			/* For bitcmp() */
 #include "parse.h"
+#include "pow2.h"
 #include "sorted_array.h"
 #include "stringify.h"
+#include "vsort.h"
 #include "walloc.h"
+#include "xmalloc.h"
 
 #include "override.h"		/* Must be the last header included */
 
@@ -71,6 +91,63 @@ struct iprange_net6 {
 	uint8 bits;		/**< Leading meaningful bits */
 };
 
+#define IPRANGE_BLOCKS	65536	/**< Amount of /16 blocks in IPv4 space */
+#define IPRANGE_SCAN	8		/**< Linear scan up to that many intervals */
+
+/**
+ * An IPv4 address interval, within a compiled table.
+ *
+ * Intervals are contiguous, hence they are only described by their last
+ * address, the first one being the address following the previous interval.
+ */
+struct iprange_seg4 {
+	uint16 last;	/**< Last address in interval (lower 16 bits) */
+	uint16 value;	/**< Associated token value, 0 if none */
+};
+
+/**
+ * Compiled IPv4 lookup table.
+ *
+ * The intervals of each /16 block are stored consecutively in the segment
+ * array, the directory giving the index of the first interval in each block.
+ * The intervals of a block always cover the whole block.
+ */
+struct iprange_table4 {
+	uint32 dir[IPRANGE_BLOCKS + 1];	/**< Index of block intervals in seg[] */
+	struct iprange_seg4 *seg;		/**< Intervals, block after block */
+	size_t count;					/**< Amount of intervals */
+};
+
+/**
+ * An IPv6 address, as two 64-bit integers in host order.
+ */
+struct iprange_addr6 {
+	uint64 hi, lo;
+};
+
+/**
+ * An IPv6 address interval, within a compiled table.
+ */
+struct iprange_seg6 {
+	struct iprange_addr6 last;	/**< Last address in interval */
+	uint16 value;				/**< Associated token value, 0 if none */
+};
+
+/**
+ * Compiled IPv6 lookup table.
+ *
+ * The intervals cover the whole address space and are stored in Eytzinger
+ * order, starting at index 1.  The upper 64 bits of the last address, which
+ * are almost always enough to compare addresses, are kept in their own array
+ * so that a cache line holds 8 tree nodes.
+ */
+struct iprange_table6 {
+	uint64 *hi;						/**< Upper 64 bits of last address */
+	uint64 *lo;						/**< Lower 64 bits of last address */
+	uint16 *value;					/**< Value of each interval */
+	size_t count;					/**< Amount of intervals */
+};
+
 /*
  * A "database" descriptor, holding the CIDR networks and their attached value.
  */
@@ -78,8 +155,13 @@ struct iprange_db {
 	enum iprange_db_magic magic;	/**< Magic number */
 	struct sorted_array *tab4;		/**< IPv4 */
 	struct sorted_array *tab6;		/**< IPv6 */
+	struct iprange_table4 *c4;		/**< Compiled IPv4 lookup table */
+	struct iprange_table6 *c6;		/**< Compiled IPv6 lookup table */
 	unsigned tab4_unsorted:1;
 	unsigned tab6_unsorted:1;
+	unsigned tab4_changed:1;		/**< Compiled IPv4 table is stale */
+	unsigned tab6_changed:1;		/**< Compiled IPv6 table is stale */
+	unsigned compiled:1;			/**< Whether to compile lookup tables */
 };
 
 static inline void
@@ -120,6 +202,7 @@ iprange_reset_ipv4(struct iprange_db *idb)
 	sorted_array_free(&idb->tab4);
 	idb->tab4 = sorted_array_new(sizeof(struct iprange_net4), iprange_net4_cmp);
 	idb->tab4_unsorted = FALSE;
+	idb->tab4_changed = TRUE;
 }
 
 /**
@@ -133,6 +216,426 @@ iprange_reset_ipv6(struct iprange_db *idb)
 	sorted_array_free(&idb->tab6);
 	idb->tab6 = sorted_array_new(sizeof(struct iprange_net6), iprange_net6_cmp);
 	idb->tab6_unsorted = FALSE;
+	idb->tab6_changed = TRUE;
+}
+
+/**
+ * Free compiled IPv4 table and nullify its pointer.
+ */
+static void
+iprange_table4_free(struct iprange_table4 **t_ptr)
+{
+	struct iprange_table4 *t = *t_ptr;
+
+	if (t != NULL) {
+		XFREE_NULL(t->seg);
+		xfree(t);
+		*t_ptr = NULL;
+	}
+}
+
+/**
+ * Free compiled IPv6 table and nullify its pointer.
+ */
+static void
+iprange_table6_free(struct iprange_table6 **t_ptr)
+{
+	struct iprange_table6 *t = *t_ptr;
+
+	if (t != NULL) {
+		XFREE_NULL(t->hi);
+		XFREE_NULL(t->lo);
+		XFREE_NULL(t->value);
+		WFREE(t);
+		*t_ptr = NULL;
+	}
+}
+
+/**
+ * Lookup IPv4 address in compiled table.
+ *
+ * @return the value of the interval containing the address.
+ */
+static inline uint16
+iprange_table4_get(const struct iprange_table4 *t, uint32 ip)
+{
+	const struct iprange_seg4 *seg;
+	uint32 first, n;
+	uint16 low = ip & 0xffff;
+
+	first = t->dir[ip >> 16];
+	n = t->dir[(ip >> 16) + 1] - first;
+	seg = &t->seg[first];
+
+	/*
+	 * The last interval of the block always ends at 0xffff, so scanning
+	 * is guaranteed to stop within the block.
+	 */
+
+	if G_UNLIKELY(n > IPRANGE_SCAN) {
+		uint32 lo = 0, hi = n - 1;
+
+		while (lo < hi) {
+			uint32 mid = lo + (hi - lo) / 2;
+
+			if (seg[mid].last < low)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return seg[lo].value;
+	}
+
+	while (seg->last < low)
+		seg++;
+
+	return seg->value;
+}
+
+static inline int
+iprange_addr6_cmp(const struct iprange_addr6 *a, const struct iprange_addr6 *b)
+{
+	return a->hi == b->hi ? CMP(a->lo, b->lo) : CMP(a->hi, b->hi);
+}
+
+static inline void
+iprange_addr6_load(struct iprange_addr6 *a, const uint8 *ip6)
+{
+	a->hi = peek_be64(&ip6[0]);
+	a->lo = peek_be64(&ip6[8]);
+}
+
+/**
+ * Lookup IPv6 address in compiled table.
+ *
+ * @return the value of the interval containing the address.
+ */
+static inline uint16
+iprange_table6_get(const struct iprange_table6 *t, const uint8 *ip6)
+{
+	const uint64 *hi = t->hi;
+	struct iprange_addr6 a;
+	uint32 k = 1, n = t->count;
+
+	iprange_addr6_load(&a, ip6);
+
+	/*
+	 * Look for the first interval whose last address is greater or equal
+	 * to the address.  The bits of the final index record the path taken
+	 * in the implicit tree: the result is the node where we last went left,
+	 * found by stripping the trailing 1 bits (right moves) and the final
+	 * left move.
+	 *
+	 * The 16 nodes four levels below lie in two cache lines, which we
+	 * prefetch to overlap memory latency with the descent.
+	 */
+
+	while (k <= n) {
+		if G_LIKELY(16 * k + 8 <= n) {
+			G_PREFETCH_R(&hi[16 * k]);
+			G_PREFETCH_R(&hi[16 * k + 8]);
+		}
+		if G_UNLIKELY(hi[k] == a.hi)
+			k = 2 * k + (t->lo[k] < a.lo);
+		else
+			k = 2 * k + (hi[k] < a.hi);
+	}
+	k >>= ctz(~k) + 1;
+
+	g_assert(k != 0);		/* Last interval ends at the last address */
+
+	return t->value[k];
+}
+
+/**
+ * A CIDR network, as an address interval to compile.
+ */
+struct iprange_span4 {
+	uint32 first, last;
+	uint16 value;
+	uint8 bits;
+};
+
+struct iprange_span6 {
+	struct iprange_addr6 first, last;
+	uint16 value;
+	uint8 bits;
+};
+
+/**
+ * Sort spans by increasing start address, then by increasing prefix length
+ * so that wider networks come first.
+ */
+static int
+iprange_span4_cmp(const void *p, const void *q)
+{
+	const struct iprange_span4 *a = p, *b = q;
+
+	return a->first == b->first ? CMP(a->bits, b->bits) :
+		CMP(a->first, b->first);
+}
+
+static int
+iprange_span6_cmp(const void *p, const void *q)
+{
+	const struct iprange_span6 *a = p, *b = q;
+	int c = iprange_addr6_cmp(&a->first, &b->first);
+
+	return 0 == c ? CMP(a->bits, b->bits) : c;
+}
+
+/**
+ * Append interval to the list of contiguous intervals, merging it with the
+ * previous one when they bear the same value.
+ */
+static void
+iprange_interval4_add(struct iprange_span4 *iv, size_t *n,
+	uint32 last, uint16 value)
+{
+	if (*n != 0 && iv[*n - 1].value == value) {
+		iv[*n - 1].last = last;
+	} else {
+		iv[*n].last = last;
+		iv[*n].value = value;
+		(*n)++;
+	}
+}
+
+static void
+iprange_interval6_add(struct iprange_seg6 *iv, size_t *n,
+	const struct iprange_addr6 *last, uint16 value)
+{
+	if (*n != 0 && iv[*n - 1].value == value) {
+		iv[*n - 1].last = *last;
+	} else {
+		iv[*n].last = *last;
+		iv[*n].value = value;
+		(*n)++;
+	}
+}
+
+/**
+ * Build compiled IPv4 table from the (sorted) list of networks.
+ *
+ * @return new compiled table.
+ */
+static struct iprange_table4 *
+iprange_table4_build(const struct sorted_array *tab)
+{
+	struct iprange_table4 *t;
+	struct iprange_span4 *span, *iv;
+	size_t i, j, n, count = 0;
+	uint32 next = 0;
+	bool done = FALSE;
+
+	n = sorted_array_count(tab);
+	XMALLOC_ARRAY(span, n + 1);
+
+	for (i = 0; i < n; i++) {
+		const struct iprange_net4 *item = sorted_array_item(tab, i);
+
+		span[i].first = item->ip;
+		span[i].last = item->ip | ~cidr_to_netmask(item->bits);
+		span[i].value = item->value;
+		span[i].bits = item->bits;
+	}
+
+	vsort(span, n, sizeof span[0], iprange_span4_cmp);
+
+	/*
+	 * Flatten the networks into contiguous intervals covering the whole
+	 * address space, unlisted addresses having a zero value.
+	 *
+	 * Should networks still overlap, the wider one wins, as done when
+	 * synchronizing the sorted array.  CIDR networks can only be nested,
+	 * and the wider network comes first.
+	 */
+
+	XMALLOC_ARRAY(iv, 2 * n + 1);
+
+	for (i = 0; i < n && !done; i++) {
+		if (span[i].first < next)
+			continue;		/* Nested within previous network */
+		if (span[i].first > next)
+			iprange_interval4_add(iv, &count, span[i].first - 1, 0);
+		iprange_interval4_add(iv, &count, span[i].last, span[i].value);
+		next = span[i].last + 1;
+		done = 0 == next;		/* Reached end of address space */
+	}
+
+	if (!done)
+		iprange_interval4_add(iv, &count, (uint32) -1, 0);
+
+	XFREE_NULL(span);
+
+	/*
+	 * Now split the intervals by /16 blocks.  There is at most one interval
+	 * per block, plus one for each interval end within a block.
+	 */
+
+	XMALLOC(t);
+	XMALLOC_ARRAY(t->seg, IPRANGE_BLOCKS + count);
+	t->count = 0;
+
+	for (i = 0, j = 0; i < IPRANGE_BLOCKS; i++) {
+		uint32 end = ((uint32) i << 16) | 0xffff;
+
+		t->dir[i] = t->count;
+
+		for (;;) {
+			struct iprange_seg4 *seg = &t->seg[t->count++];
+
+			g_assert(j < count);
+
+			seg->value = iv[j].value;
+
+			if (iv[j].last >= end) {
+				seg->last = 0xffff;
+				if (iv[j].last == end)
+					j++;
+				break;
+			}
+			seg->last = iv[j++].last & 0xffff;
+		}
+	}
+
+	t->dir[IPRANGE_BLOCKS] = t->count;
+
+	g_assert(j == count);
+
+	XFREE_NULL(iv);
+	XREALLOC_ARRAY(t->seg, t->count);
+
+	return t;
+}
+
+/**
+ * Fill Eytzinger array from sorted array, recursively.
+ *
+ * @param dst		the Eytzinger array, base 1
+ * @param src		the sorted array, base 0
+ * @param i			next item to take from the sorted array
+ * @param k			index of the node to fill in the Eytzinger array
+ * @param n			amount of items
+ *
+ * @return next item to take from the sorted array.
+ */
+static size_t
+iprange_eytzinger(struct iprange_table6 *dst, const struct iprange_seg6 *src,
+	size_t i, size_t k, size_t n)
+{
+	if (k <= n) {
+		i = iprange_eytzinger(dst, src, i, 2 * k, n);
+		dst->hi[k] = src[i].last.hi;
+		dst->lo[k] = src[i].last.lo;
+		dst->value[k] = src[i].value;
+		i++;
+		i = iprange_eytzinger(dst, src, i, 2 * k + 1, n);
+	}
+	return i;
+}
+
+/**
+ * Build compiled IPv6 table from the (sorted) list of networks.
+ *
+ * @return new compiled table.
+ */
+static struct iprange_table6 *
+iprange_table6_build(const struct sorted_array *tab)
+{
+	struct iprange_table6 *t;
+	struct iprange_span6 *span;
+	struct iprange_seg6 *iv;
+	struct iprange_addr6 next = { 0, 0 };
+	size_t i, n, count = 0;
+	bool done = FALSE;
+
+	n = sorted_array_count(tab);
+	XMALLOC_ARRAY(span, n + 1);
+
+	for (i = 0; i < n; i++) {
+		const struct iprange_net6 *item = sorted_array_item(tab, i);
+		uint64 mhi, mlo;
+
+		iprange_addr6_load(&span[i].first, item->ip);
+
+		/* Host part mask */
+		mhi = item->bits >= 64 ? 0 : (uint64) -1 >> item->bits;
+		mlo = item->bits <= 64 ? (uint64) -1 :
+			128 == item->bits ? 0 : (uint64) -1 >> (item->bits - 64);
+
+		span[i].last.hi = span[i].first.hi | mhi;
+		span[i].last.lo = span[i].first.lo | mlo;
+		span[i].value = item->value;
+		span[i].bits = item->bits;
+	}
+
+	vsort(span, n, sizeof span[0], iprange_span6_cmp);
+
+	/*
+	 * Flatten the networks into contiguous intervals, as for IPv4.
+	 */
+
+	XMALLOC_ARRAY(iv, 2 * n + 1);
+
+	for (i = 0; i < n && !done; i++) {
+		int c = iprange_addr6_cmp(&span[i].first, &next);
+
+		if (c < 0)
+			continue;		/* Nested within previous network */
+
+		if (c > 0) {
+			struct iprange_addr6 before = span[i].first;
+
+			if (0 == before.lo--)
+				before.hi--;
+			iprange_interval6_add(iv, &count, &before, 0);
+		}
+		iprange_interval6_add(iv, &count, &span[i].last, span[i].value);
+
+		next = span[i].last;
+		if (0 == ++next.lo)
+			next.hi++;
+		done = 0 == next.hi && 0 == next.lo;
+	}
+
+	if (!done) {
+		struct iprange_addr6 end = { (uint64) -1, (uint64) -1 };
+		iprange_interval6_add(iv, &count, &end, 0);
+	}
+
+	XFREE_NULL(span);
+
+	WALLOC(t);
+	t->count = count;
+	XMALLOC0_ARRAY(t->hi, count + 1);		/* Index 0 is not used */
+	XMALLOC0_ARRAY(t->lo, count + 1);
+	XMALLOC0_ARRAY(t->value, count + 1);
+	iprange_eytzinger(t, iv, 0, 1, count);
+
+	XFREE_NULL(iv);
+
+	return t;
+}
+
+/**
+ * Replace the compiled IPv4 table.
+ */
+static void
+iprange_table4_swap(struct iprange_db *idb, struct iprange_table4 *t)
+{
+	iprange_table4_free(&idb->c4);
+	idb->c4 = t;
+}
+
+/**
+ * Replace the compiled IPv6 table.
+ */
+static void
+iprange_table6_swap(struct iprange_db *idb, struct iprange_table6 *t)
+{
+	iprange_table6_free(&idb->c6);
+	idb->c6 = t;
 }
 
 /**
@@ -165,6 +668,8 @@ iprange_free(struct iprange_db **idb_ptr)
 		iprange_db_check(idb);
 		sorted_array_free(&idb->tab4);
 		sorted_array_free(&idb->tab6);
+		iprange_table4_free(&idb->c4);
+		iprange_table6_free(&idb->c6);
 		WFREE(idb);
 		*idb_ptr = NULL;
 	}
@@ -186,6 +691,9 @@ iprange_get(const struct iprange_db *idb, uint32 ip)
 
 	iprange_db_check(idb);
 
+	if G_LIKELY(idb->c4 != NULL)
+		return iprange_table4_get(idb->c4, ip);
+
 	key.ip = ip;
 	key.bits = 32;
 	item = sorted_array_lookup(idb->tab4, &key);
@@ -208,6 +716,9 @@ iprange_get6(const struct iprange_db *idb, const uint8 *ip6)
 
 	iprange_db_check(idb);
 
+	if G_LIKELY(idb->c6 != NULL)
+		return iprange_table6_get(idb->c6, ip6);
+
 	memcpy(&key.ip[0], ip6, sizeof key.ip);
 	key.bits = 128;
 	item = sorted_array_lookup(idb->tab6, &key);
@@ -272,6 +783,7 @@ iprange_add_cidr(struct iprange_db *idb,
 	} else {
 		sorted_array_add(idb->tab4, &item);
 		idb->tab4_unsorted = TRUE;
+		idb->tab4_changed = TRUE;
 		return IPR_ERR_OK;
 	}
 }
@@ -324,6 +836,7 @@ iprange_add_cidr6(struct iprange_db *idb,
 
 	sorted_array_add(idb->tab6, &item);
 	idb->tab6_unsorted = TRUE;
+	idb->tab6_changed = TRUE;
 
 	return IPR_ERR_OK;
 }
@@ -357,6 +870,9 @@ iprange_net6_collision(const void *p, const void *q)
  * called each time but rather after the complete list of addresses
  * has been added to the database.
  *
+ * When the database is compiled, this is also where the lookup tables are
+ * rebuilt to replace the previous ones.
+ *
  * @param db	the IP range database
  */
 void
@@ -372,6 +888,35 @@ iprange_sync(struct iprange_db *idb)
 		sorted_array_sync(idb->tab6, iprange_net6_collision);
 		idb->tab6_unsorted = FALSE;
 	}
+
+	if (idb->compiled) {
+		if (idb->tab4_changed)
+			iprange_table4_swap(idb, iprange_table4_build(idb->tab4));
+		if (idb->tab6_changed)
+			iprange_table6_swap(idb, iprange_table6_build(idb->tab6));
+	}
+
+	idb->tab4_changed = idb->tab6_changed = FALSE;
+}
+
+/**
+ * Request compiled lookups for the database.
+ *
+ * This trades memory for speed, and is meant for databases that are looked
+ * up very often.  The compiled tables are (re)built by iprange_sync(), and
+ * until then the previous tables remain in use, if any.
+ *
+ * @param db	the IP range database
+ */
+void
+iprange_compile(struct iprange_db *idb)
+{
+	iprange_db_check(idb);
+
+	if (!idb->compiled) {
+		idb->compiled = TRUE;
+		idb->tab4_changed = idb->tab6_changed = TRUE;
+	}
 }
 
 /**
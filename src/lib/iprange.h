@@ -56,6 +56,7 @@ uint16 iprange_get(const struct iprange_db *db, uint32 ip);
 uint16 iprange_get6(const struct iprange_db *db, const uint8 *ip6);
 uint16 iprange_get_addr(const struct iprange_db *idb, const host_addr_t ha);
 void iprange_sync(struct iprange_db *idb);
+void iprange_compile(struct iprange_db *idb);
 void iprange_free(struct iprange_db **idb_ptr);
 void iprange_reset_ipv4(struct iprange_db *idb);
 void iprange_reset_ipv6(struct iprange_db *idb);
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2026 gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Bounded lock-free ring queue.
+ *
+ * This is a fixed-size multi-producer / multi-consumer FIFO of pointers
+ * which does not require any lock: producers and consumers only contend
+ * through compare-and-swap operations on the head and tail indices.
+ *
+ * Each slot in the ring carries a sequence number telling whether it is
+ * free for the producer at a given lap around the ring, or holds a value
+ * ready for the consumer at that lap.  A producer claims the slot by
+ * advancing the tail index, then stores its pointer and publishes it by
+ * bumping the slot sequence number.  Consumers proceed symmetrically on
+ * the head index.
+ *
+ * The queue never blocks nor allocates memory once created: ringq_put()
+ * returns FALSE when the ring is full and ringq_get() returns FALSE when
+ * it is empty.  It is up to the upper layers to provide an overflow area
+ * and a wakeup mechanism when they need one (see aq.c and teq.c).
+ *
+ * NULL is a valid value to exchange through the ring.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "ringq.h"
+
+#include "atomic.h"
+#include "pow2.h"
+#include "unsigned.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define RINGQ_MIN		8				/**< Minimum ring size */
+#define RINGQ_MAX		(1U << 20)		/**< Maximum ring size */
+#define RINGQ_LINE		64				/**< Assumed CPU cache line size */
+
+enum ringq_magic { RINGQ_MAGIC = 0x7a5e02c1 };
+
+/**
+ * A slot in the ring.
+ */
+struct ringq_cell {
+	uint seq;					/**< Sequence number, for lap detection */
+	void *data;					/**< Stored value */
+};
+
+/**
+ * A bounded lock-free ring queue.
+ *
+ * The producer and consumer indices are kept on separate cache lines to
+ * avoid false sharing between threads enqueuing and threads dequeuing.
+ */
+struct ringq {
+	enum ringq_magic magic;		/**< Magic number */
+	uint mask;					/**< Ring size - 1 (size is a power of 2) */
+	struct ringq_cell *cells;	/**< The ring slots */
+	char pad1[RINGQ_LINE];
+	uint tail;					/**< Next slot to fill (producers) */
+	char pad2[RINGQ_LINE];
+	uint head;					/**< Next slot to read (consumers) */
+	char pad3[RINGQ_LINE];
+};
+
+static inline void
+ringq_check(const struct ringq * const rq)
+{
+	g_assert(rq != NULL);
+	g_assert(RINGQ_MAGIC == rq->magic);
+}
+
+/**
+ * Create a new ring queue.
+ *
+ * @param capacity		the amount of entries, rounded up to a power of 2
+ *
+ * @return a new ring queue.
+ */
+ringq_t *
+ringq_make(size_t capacity)
+{
+	ringq_t *rq;
+	size_t i, n;
+
+	g_assert(size_is_positive(capacity));
+	g_assert(capacity <= RINGQ_MAX);
+
+	n = next_pow2(MAX(capacity, RINGQ_MIN));
+
+	WALLOC0(rq);
+	rq->magic = RINGQ_MAGIC;
+	rq->mask = n - 1;
+	WALLOC_ARRAY(rq->cells, n);
+
+	for (i = 0; i < n; i++) {
+		rq->cells[i].seq = i;
+		rq->cells[i].data = NULL;
+	}
+
+	atomic_mb();
+	return rq;
+}
+
+/**
+ * Free ring queue and nullify its pointer.
+ *
+ * Any value still held in the ring is lost, the caller must drain it first
+ * if needed.
+ */
+void
+ringq_free_null(ringq_t **rq_ptr)
+{
+	ringq_t *rq = *rq_ptr;
+
+	if (rq != NULL) {
+		ringq_check(rq);
+
+		WFREE_ARRAY(rq->cells, rq->mask + 1);
+		rq->magic = 0;
+		WFREE(rq);
+		*rq_ptr = NULL;
+	}
+}
+
+/**
+ * @return the maximum amount of entries the ring can hold.
+ */
+size_t
+ringq_capacity(const ringq_t *rq)
+{
+	ringq_check(rq);
+
+	return rq->mask + 1;
+}
+
+/**
+ * Amount of values held in the ring.
+ *
+ * This is only a snapshot when there are concurrent producers or consumers,
+ * but it is exact when the ring is quiescent.
+ */
+size_t
+ringq_count(const ringq_t *rq)
+{
+	uint head, tail;
+
+	ringq_check(rq);
+
+	atomic_mb();
+	head = rq->head;
+	tail = rq->tail;
+
+	/*
+	 * A concurrent consumer may have advanced the head past the tail we
+	 * read, so clamp the result: a "negative" count means empty.
+	 */
+
+	return (int) (tail - head) <= 0 ? 0 : tail - head;
+}
+
+/**
+ * Append value to the ring.
+ *
+ * @param rq		the ring queue
+ * @param data		the value to enqueue (can be NULL)
+ *
+ * @return TRUE if value was enqueued, FALSE if the ring was full.
+ */
+bool
+ringq_put(ringq_t *rq, void *data)
+{
+	struct ringq_cell *cell;
+	uint pos;
+
+	ringq_check(rq);
+
+	pos = atomic_uint_get(&rq->tail);
+
+	for (;;) {
+		int diff;
+
+		cell = &rq->cells[pos & rq->mask];
+		diff = (int) (atomic_uint_get(&cell->seq) - pos);
+
+		if G_LIKELY(0 == diff) {
+			/* Slot is free for this lap, try to claim it */
+			if (atomic_uint_xchg_if_eq(&rq->tail, pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			return FALSE;		/* Slot still used one lap behind: full */
+		}
+
+		pos = atomic_uint_get(&rq->tail);
+	}
+
+	/*
+	 * The value must be visible before the slot is published, hence the
+	 * explicit barrier before updating the sequence number.
+	 */
+
+	cell->data = data;
+	atomic_mb();
+	atomic_uint_set(&cell->seq, pos + 1);	/* Publish to consumers */
+
+	return TRUE;
+}
+
+/**
+ * Remove oldest value from the ring.
+ *
+ * @param rq		the ring queue
+ * @param data_ptr	where the dequeued value is written
+ *
+ * @return TRUE if a value was dequeued, FALSE if the ring was empty.
+ */
+bool
+ringq_get(ringq_t *rq, void **data_ptr)
+{
+	struct ringq_cell *cell;
+	uint pos;
+
+	ringq_check(rq);
+	g_assert(data_ptr != NULL);
+
+	pos = atomic_uint_get(&rq->head);
+
+	for (;;) {
+		int diff;
+
+		cell = &rq->cells[pos & rq->mask];
+		diff = (int) (atomic_uint_get(&cell->seq) - (pos + 1));
+
+		if G_LIKELY(0 == diff) {
+			/* Slot holds a value for this lap, try to claim it */
+			if (atomic_uint_xchg_if_eq(&rq->head, pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			return FALSE;		/* Slot not yet published: empty */
+		}
+
+		pos = atomic_uint_get(&rq->head);
+	}
+
+	*data_ptr = cell->data;
+	atomic_mb();
+	atomic_uint_set(&cell->seq, pos + rq->mask + 1);	/* Free for next lap */
+
+	return TRUE;
+}
+
+/**
+ * Look for a value still held in the ring.
+ *
+ * Only values that were published and not yet dequeued are considered, but
+ * with concurrent consumers a matching value can be dequeued as soon as it
+ * has been found.  The caller must therefore ensure that values remain valid
+ * whilst the ring is being searched, should the comparison routine need to
+ * dereference them.
+ *
+ * @param rq		the ring queue
+ * @param key		the key to look for
+ * @param cmp		comparison routine, called as (*cmp)(value, key)
+ *
+ * @return TRUE if a matching value was found.
+ */
+bool
+ringq_contains(const ringq_t *rq, const void *key, cmp_fn_t cmp)
+{
+	uint pos, tail;
+
+	ringq_check(rq);
+	g_assert(cmp != NULL);
+
+	atomic_mb();
+	pos = rq->head;
+	tail = rq->tail;
+
+	for (; (int) (tail - pos) > 0; pos++) {
+		const struct ringq_cell *cell = &rq->cells[pos & rq->mask];
+		void *data;
+
+		if (atomic_uint_get(&cell->seq) != pos + 1)
+			continue;		/* Not yet published, or already dequeued */
+
+		data = cell->data;
+		atomic_mb();
+
+		if (atomic_uint_get(&cell->seq) != pos + 1)
+			continue;		/* Dequeued whilst we were reading it */
+
+		if (0 == (*cmp)(data, key))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Remove as many values as possible from the ring, in FIFO order.
+ *
+ * @param rq		the ring queue
+ * @param vec		vector where dequeued values are written
+ * @param vcnt		amount of entries in the vector
+ *
+ * @return the amount of values dequeued, 0 if the ring was empty.
+ */
+size_t
+ringq_drain(ringq_t *rq, void **vec, size_t vcnt)
+{
+	size_t n = 0;
+
+	g_assert(vec != NULL);
+
+	while (n < vcnt && ringq_get(rq, &vec[n]))
+		n++;
+
+	return n;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2026 gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Bounded lock-free ring queue.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#ifndef _ringq_h_
+#define _ringq_h_
+
+struct ringq;
+typedef struct ringq ringq_t;
+
+/*
+ * Public interface.
+ */
+
+ringq_t *ringq_make(size_t capacity);
+void ringq_free_null(ringq_t **rq_ptr);
+
+size_t ringq_capacity(const ringq_t *rq) G_PURE;
+size_t ringq_count(const ringq_t *rq);
+
+bool ringq_put(ringq_t *rq, void *data);
+bool ringq_get(ringq_t *rq, void **data_ptr);
+size_t ringq_drain(ringq_t *rq, void **vec, size_t vcnt);
+bool ringq_contains(const ringq_t *rq, const void *key, cmp_fn_t cmp);
+
+#endif /* _ringq_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,385 @@
+/*
+ * sha1-test -- SHA-1 implementation tests and benchmarking.
+ *
+ * Copyright (c) 2026 gtk-gnutella developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "lib/misc.h"
+#include "lib/progname.h"
+#include "lib/rand31.h"
+#include "lib/sha1.h"
+#include "lib/tm.h"
+#include "lib/xmalloc.h"
+
+#define TEST_LOOPS		200			/* Random cross-checks per implementation */
+#define TEST_MAXLEN		10000		/* Maximum length of random messages */
+#define TEST_STREAMS	19			/* Maximum amount of parallel streams */
+
+#define BENCH_SIZE		(4 * 1024 * 1024)	/* Bytes hashed per stream */
+#define BENCH_STREAMS	8					/* Streams for multi-buffer */
+
+static bool verbose_mode;
+static unsigned initial_seed;
+
+static const struct {
+	enum sha1_impl impl;
+	const char *name;
+} implementations[] = {
+	{ SHA1_IMPL_GENERIC,	"generic" },
+	{ SHA1_IMPL_SHANI,		"SHA-NI" },
+	{ SHA1_IMPL_AVX2,		"AVX2" },
+	{ SHA1_IMPL_AUTO,		"auto" },
+};
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-htV] [-n loops] [-s size] [-R seed]\n"
+		"  -h : prints this help message\n"
+		"  -n : amount of benchmark loops (default = 10)\n"
+		"  -s : bytes hashed per stream during benchmark\n"
+		"  -t : benchmark each implementation\n"
+		"  -R : seed for repeatable random message sequence\n"
+		"  -V : verbose mode -- print status after each successful test\n"
+		, getprogname());
+	exit(EXIT_FAILURE);
+}
+
+static void G_NORETURN
+test_abort(const char *what)
+{
+	printf("%s - %s - FAILED\n", SHA1_impl_name(), what);
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+/**
+ * Hash ``len'' bytes from ``data'', feeding them by random-sized chunks.
+ */
+static void
+test_hash(const void *data, size_t len, struct sha1 *digest)
+{
+	SHA1_context ctx;
+	const char *p = data;
+
+	SHA1_reset(&ctx);
+
+	while (len != 0) {
+		size_t n = 1 + rand31_value(MIN(len, 3 * 64) - 1);
+
+		if (0 == rand31_value(3))
+			n = len;				/* Everything at once, sometimes */
+
+		SHA1_input(&ctx, p, n);
+		p += n;
+		len -= n;
+	}
+
+	SHA1_result(&ctx, digest);
+}
+
+/**
+ * Check the RFC 3174 test vectors.
+ */
+static void
+test_vectors(void)
+{
+	static const struct {
+		const char *data;
+		size_t repeat;
+		const char *digest;
+	} vectors[] = {
+		{ "abc", 1,
+			"a9993e364706816aba3e25717850c26c9cd0d89d" },
+		{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+			"84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+		{ "a", 1000000,
+			"34aa973cd4c4daa4f61eeb2bdbad27316534016f" },
+		{ "0123456701234567012345670123456701234567012345670123456701234567",
+			10, "dea356a2cddd90c7a7ecedc5ebb563934f460452" },
+	};
+	uint i;
+
+	for (i = 0; i < N_ITEMS(vectors); i++) {
+		SHA1_context ctx;
+		struct sha1 digest;
+		size_t j, len = strlen(vectors[i].data);
+		char *buf;
+
+		/*
+		 * Hash the vector both one repetition at a time and as a single
+		 * buffer, to exercise both the slow and fast paths.
+		 */
+
+		SHA1_reset(&ctx);
+		for (j = 0; j < vectors[i].repeat; j++)
+			SHA1_input(&ctx, vectors[i].data, len);
+		SHA1_result(&ctx, &digest);
+
+		if (0 != strcmp(vectors[i].digest, sha1_base16(&digest)))
+			test_abort("RFC 3174 vectors");
+
+		buf = xmalloc(len * vectors[i].repeat);
+		for (j = 0; j < vectors[i].repeat; j++)
+			memcpy(&buf[j * len], vectors[i].data, len);
+
+		test_hash(buf, len * vectors[i].repeat, &digest);
+		xfree(buf);
+
+		if (0 != strcmp(vectors[i].digest, sha1_base16(&digest)))
+			test_abort("RFC 3174 vectors");
+	}
+
+	if (verbose_mode)
+		printf("%s - RFC 3174 vectors - OK\n", SHA1_impl_name());
+}
+
+/**
+ * Check that random messages hash to the same digest as the generic code.
+ */
+static void
+test_random(const char *data, const struct sha1 *expected, size_t loops)
+{
+	size_t i;
+
+	for (i = 0; i < loops; i++) {
+		size_t len = rand31_value(TEST_MAXLEN);
+		struct sha1 digest;
+
+		test_hash(data, len, &digest);
+
+		if (0 != memcmp(&digest, &expected[len], sizeof digest))
+			test_abort("random messages");
+	}
+
+	if (verbose_mode)
+		printf("%s - random messages - OK\n", SHA1_impl_name());
+}
+
+/**
+ * Check parallel hashing of independent streams.
+ */
+static void
+test_multi(const char *data, const struct sha1 *expected, size_t loops)
+{
+	size_t i;
+
+	for (i = 0; i < loops; i++) {
+		SHA1_context ctx[TEST_STREAMS], *vctx[TEST_STREAMS];
+		const void *vdata[TEST_STREAMS];
+		size_t off[TEST_STREAMS];
+		size_t j, n = 1 + rand31_value(TEST_STREAMS - 1);
+		size_t len = rand31_value(TEST_MAXLEN / 2), done = 0;
+
+		/*
+		 * Each stream hashes a prefix of the data: the first ``off'' bytes
+		 * are fed with SHA1_input(), which leaves some of the streams at a
+		 * non-block boundary, then the next ``len'' bytes are fed to all
+		 * the streams in parallel.
+		 */
+
+		for (j = 0; j < n; j++) {
+			off[j] = rand31_value(TEST_MAXLEN - len);
+			vctx[j] = &ctx[j];
+			SHA1_reset(&ctx[j]);
+			SHA1_input(&ctx[j], data, off[j]);
+		}
+
+		while (done < len) {
+			size_t chunk = 1 + rand31_value(MIN(len - done, 4 * 64) - 1);
+
+			for (j = 0; j < n; j++)
+				vdata[j] = &data[off[j] + done];
+
+			SHA1_input_multi(vctx, vdata, chunk, n);
+			done += chunk;
+		}
+
+		for (j = 0; j < n; j++) {
+			struct sha1 digest;
+
+			SHA1_result(&ctx[j], &digest);
+			if (0 != memcmp(&digest, &expected[off[j] + len], sizeof digest))
+				test_abort("multi-buffer");
+		}
+	}
+
+	if (verbose_mode)
+		printf("%s - multi-buffer - OK\n", SHA1_impl_name());
+}
+
+/**
+ * Benchmark the current implementation.
+ */
+static void
+bench(size_t size, size_t loops)
+{
+	SHA1_context ctx[BENCH_STREAMS], *vctx[BENCH_STREAMS];
+	const void *vdata[BENCH_STREAMS];
+	struct sha1 digest;
+	tm_t start, end;
+	char *data;
+	size_t i, j;
+	double single, multi;
+
+	data = xmalloc(size * BENCH_STREAMS);
+	rand31_bytes(data, size * BENCH_STREAMS);
+
+	tm_now_exact(&start);
+	for (i = 0; i < loops; i++) {
+		SHA1_reset(&ctx[0]);
+		SHA1_input(&ctx[0], data, size);
+		SHA1_result(&ctx[0], &digest);
+	}
+	tm_now_exact(&end);
+	single = tm_elapsed_f(&end, &start);
+
+	for (j = 0; j < BENCH_STREAMS; j++) {
+		vctx[j] = &ctx[j];
+		vdata[j] = &data[j * size];
+	}
+
+	tm_now_exact(&start);
+	for (i = 0; i < loops; i++) {
+		for (j = 0; j < BENCH_STREAMS; j++)
+			SHA1_reset(&ctx[j]);
+		SHA1_input_multi(vctx, vdata, size, BENCH_STREAMS);
+		for (j = 0; j < BENCH_STREAMS; j++)
+			SHA1_result(&ctx[j], &digest);
+	}
+	tm_now_exact(&end);
+	multi = tm_elapsed_f(&end, &start);
+
+	printf("%-17s - single: %7.2f MiB/s, %u streams: %7.2f MiB/s\n",
+		SHA1_impl_name(),
+		single <= 0.0 ? 0.0 : size * loops / single / (1024 * 1024),
+		BENCH_STREAMS,
+		multi <= 0.0 ? 0.0 :
+			size * loops * BENCH_STREAMS / multi / (1024 * 1024));
+
+	xfree(data);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	bool tflag = FALSE;
+	size_t loops = 10;
+	size_t size = BENCH_SIZE;
+	unsigned rseed = 0;
+	struct sha1 *expected;
+	char *data;
+	uint i;
+	int c;
+	const char options[] = "hn:s:tR:V";
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'n':			/* amount of benchmark loops */
+			loops = atol(optarg);
+			break;
+		case 's':			/* bytes per stream */
+			size = atol(optarg);
+			break;
+		case 't':			/* timing report */
+			tflag++;
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'V':			/* verbose mode */
+			verbose_mode = TRUE;
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0 || 0 == loops || 0 == size)
+		usage();
+
+	rand31_set_seed(rseed);
+	initial_seed = rand31_current_seed();
+
+	/*
+	 * Compute the reference digests of all the prefixes of our random data
+	 * with the generic implementation.
+	 */
+
+	data = xmalloc(TEST_MAXLEN);
+	rand31_bytes(data, TEST_MAXLEN);
+	XMALLOC_ARRAY(expected, TEST_MAXLEN + 1);
+
+	if (!SHA1_set_impl(SHA1_IMPL_GENERIC))
+		test_abort("generic implementation");
+
+	{
+		SHA1_context ctx;
+		size_t len;
+
+		SHA1_reset(&ctx);
+		for (len = 0; len <= TEST_MAXLEN; len++) {
+			SHA1_intermediate(&ctx, &expected[len]);
+			if (len < TEST_MAXLEN)
+				SHA1_input(&ctx, &data[len], 1);
+		}
+	}
+
+	for (i = 0; i < N_ITEMS(implementations); i++) {
+		if (!SHA1_set_impl(implementations[i].impl)) {
+			printf("%s - not supported by this CPU - SKIPPED\n",
+				implementations[i].name);
+			continue;
+		}
+
+		test_vectors();
+		test_random(data, expected, TEST_LOOPS);
+		test_multi(data, expected, TEST_LOOPS);
+
+		if (tflag)
+			bench(size, loops);
+	}
+
+	printf("using %s SHA-1 implementation\n", SHA1_impl_name());
+
+	xfree(data);
+	xfree(expected);
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
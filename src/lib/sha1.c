@@ -68,13 +68,43 @@
 #include "endian.h"
 #include "sha1.h"
 #include "misc.h"			/* For RCSID */
+
+/*
+ * On x86, we can use the SHA extensions (SHA-NI) or AVX2 when the CPU has
+ * them.  Since we do not know the target CPU at compile time, these kernels
+ * are compiled with function-specific target attributes and the one to use
+ * is selected at runtime by probing the CPU.
+ */
+#if defined(HASATTRIBUTE) && (defined(__x86_64__) || defined(__i386__)) && \
+	(HAS_GCC(5, 0) || defined(__clang__))
+#define SHA1_X86_KERNELS
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA1_TARGET_SHANI	__attribute__((target("sha,ssse3,sse4.1")))
+#define SHA1_TARGET_AVX2	__attribute__((target("avx2")))
+#endif
+
 #include "override.h"		/* Must be the last header included */
 
 #define SHA1_BLEN	64		/**< Message block length */
+#define SHA1_LANES	8		/**< Streams hashed by the multi-buffer kernel */
+
+/**
+ * A kernel processes consecutive 64-byte message blocks, updating the
+ * intermediate hash.  The multi-buffer flavour processes the same amount
+ * of blocks from SHA1_LANES independent messages at once.
+ */
+typedef void (*sha1_blocks_fn_t)(uint32 *ihash, const void *data, size_t n);
+typedef void (*sha1_blocks_x8_fn_t)(uint32 *ihash[SHA1_LANES],
+	const void *data[SHA1_LANES], size_t n);
+
+static sha1_blocks_fn_t sha1_blocks;		/* Single-stream kernel */
+static sha1_blocks_x8_fn_t sha1_blocks_x8;	/* Multi-buffer kernel, if any */
 
 /* Local Function Prototyptes */
 static void SHA1_pad_message(SHA1_context *);
-static void SHA1_process_message_block(SHA1_context *, const void *mblock);
+static void sha1_blocks_generic(uint32 *ihash, const void *data, size_t n);
+static void sha1_impl_select(void);
 
 /**
  *  SHA1_reset
@@ -97,11 +127,8 @@ SHA1_reset(SHA1_context *context)
 	if (!context)
 		return SHA_NULL;
 
-	/*
-	 * We rely on mblock[] being aligned on a 32-bit boundary, to be able
-	 * to cast it to a uint32 * in SHA1_process_message_block().
-	 */
-	STATIC_ASSERT(0 == offsetof(struct SHA1_context, mblock) % 4);
+	if G_UNLIKELY(NULL == sha1_blocks)
+		sha1_impl_select();
 
 	ZERO(context);
 
@@ -199,6 +226,31 @@ SHA1_intermediate(const SHA1_context *context, struct sha1 *digest)
 	return ret;
 }
 
+/**
+ * Feed whole message blocks to the context, which must have no pending
+ * bytes in its message buffer.
+ *
+ * @return sha Error Code.
+ */
+static inline int
+SHA1_input_blocks(SHA1_context *context, const void *data, size_t n)
+{
+	uint64 bits = (uint64) n * 8 * SHA1_BLEN;	/* Counts bits, not bytes */
+
+	g_assert(0 == context->midx);
+
+	if G_UNLIKELY(context->length + bits < context->length) {
+		/* Message is too long */
+		context->corrupted = SHA_INPUT_TOO_LONG;
+		return SHA_INPUT_TOO_LONG;
+	}
+
+	context->length += bits;
+	(*sha1_blocks)(context->ihash, data, n);
+
+	return SHA_SUCCESS;
+}
+
 /**
  *  SHA1_input
  *
@@ -240,28 +292,27 @@ SHA1_input(SHA1_context *context, const void *data, size_t length)
 		 return SHA_STATE_ERROR;
 
 	/*
-	 * Optimization: if the data block is aligned on a 32-bit boundary and
-	 * is at least 64-byte long, we can avoid moving data around and feed
-	 * them directly to SHA1_process_message_block(), as long as there are
-	 * no pending bytes in the context.  This will likely be happening when
-	 * large chunks of data are fed to the routine, e.g. when processing a file.
+	 * Optimization: if the data block is at least 64-byte long, we can avoid
+	 * moving data around and feed all the complete blocks directly to the
+	 * kernel, as long as there are no pending bytes in the context.  This
+	 * will likely be happening when large chunks of data are fed to the
+	 * routine, e.g. when processing a file.
 	 *		--RAM, 2015-03-14
 	 */
 
-	if G_UNLIKELY(0 != context->midx || 0 != pointer_to_long(mp) % 4)
+	if G_UNLIKELY(0 != context->midx)
 		goto slowpath;
 
 fastpath:
-	for (/**/; length >= SHA1_BLEN; mp += SHA1_BLEN, length -= SHA1_BLEN) {
-		context->length += 8 * SHA1_BLEN;		/* Counts bits, not bytes */
+	if (length >= SHA1_BLEN) {
+		size_t n = length / SHA1_BLEN;
+		int ret = SHA1_input_blocks(context, mp, n);
 
-		if G_UNLIKELY(context->length < 8 * SHA1_BLEN) {
-			/* Message is too long */
-			context->corrupted = SHA_INPUT_TOO_LONG;
-			return SHA_INPUT_TOO_LONG;
-		}
+		if G_UNLIKELY(ret != SHA_SUCCESS)
+			return ret;
 
-		SHA1_process_message_block(context, mp);
+		mp += n * SHA1_BLEN;
+		length -= n * SHA1_BLEN;
 	}
 
 	/* FALL THROUGH */
@@ -282,8 +333,9 @@ slowpath:
 		}
 
 		if G_UNLIKELY(SHA1_BLEN == context->midx) {
-			SHA1_process_message_block(context, context->mblock);
-			if (length >= SHA1_BLEN && 0 == pointer_to_long(mp) % 4)
+			(*sha1_blocks)(context->ihash, context->mblock, 1);
+			context->midx = 0;
+			if (length >= SHA1_BLEN)
 				goto fastpath;		/* Can use faster processing now */
 		}
 	}
@@ -292,13 +344,111 @@ slowpath:
 }
 
 /**
- *  SHA1_process_message_block
+ * Feed the same amount of bytes from ``n'' independent messages to their
+ * respective contexts: data[i] is the next portion of the message hashed
+ * by ctx[i].
+ *
+ * This is equivalent to calling SHA1_input() on each context, but when
+ * the CPU supports it, complete message blocks are processed by a
+ * multi-buffer kernel which hashes up to 8 streams at a time.  This pays
+ * off when hashing several large files concurrently.
+ *
+ * @param ctx		the contexts to update
+ * @param data		the data to feed to each context
+ * @param length	the amount of bytes to take from each data[] buffer
+ * @param n			amount of contexts and buffers
+ *
+ * @return sha Error Code, the first error seen if several streams fail.
+ */
+int
+SHA1_input_multi(SHA1_context *ctx[], const void *data[],
+	size_t length, size_t n)
+{
+	size_t i, blocks = length / SHA1_BLEN;
+	uint64 bits = (uint64) blocks * 8 * SHA1_BLEN;
+	int ret = SHA_SUCCESS;
+
+	g_assert(ctx != NULL);
+	g_assert(data != NULL);
+
+	if G_UNLIKELY(NULL == sha1_blocks)
+		sha1_impl_select();
+
+	if (NULL == sha1_blocks_x8 || n < 2 || 0 == blocks)
+		goto sequential;
+
+	/*
+	 * All the streams must be at a block boundary and in a sane state for
+	 * the multi-buffer kernel, otherwise let SHA1_input() deal with them.
+	 */
+
+	for (i = 0; i < n; i++) {
+		const SHA1_context *c = ctx[i];
+
+		SHA1_check(c);
+
+		if (
+			NULL == c || NULL == data[i] || c->computed || c->corrupted ||
+			0 != c->midx || c->length + bits < c->length
+		)
+			goto sequential;
+	}
+
+	for (i = 0; i < n; i += SHA1_LANES) {
+		uint32 *ihash[SHA1_LANES], scratch[SHA1_LANES][SHA1_RAW_SIZE / 4];
+		const void *mp[SHA1_LANES];
+		size_t j;
+
+		/*
+		 * Unused lanes hash the first buffer into a scratch state.
+		 */
+
+		for (j = 0; j < SHA1_LANES; j++) {
+			if (i + j < n) {
+				ihash[j] = ctx[i + j]->ihash;
+				mp[j] = data[i + j];
+				ctx[i + j]->length += bits;
+			} else {
+				ihash[j] = scratch[j];
+				mp[j] = data[i];
+				ZERO(&scratch[j]);
+			}
+		}
+
+		(*sha1_blocks_x8)(ihash, mp, blocks);
+	}
+
+	for (i = 0; i < n; i++) {
+		int r = SHA1_input(ctx[i], const_ptr_add_offset(data[i],
+			blocks * SHA1_BLEN), length - blocks * SHA1_BLEN);
+
+		if (SHA_SUCCESS == ret)
+			ret = r;
+	}
+
+	return ret;
+
+sequential:
+	for (i = 0; i < n; i++) {
+		int r = SHA1_input(ctx[i], data[i], length);
+
+		if (SHA_SUCCESS == ret)
+			ret = r;
+	}
+
+	return ret;
+}
+
+/**
+ *  sha1_block_generic
  *
  *  Description:
  *      This function will process the next 512 bits of the message
  *      stored in the mblock parameter.
  *
  *  Parameters:
+ *      ihash: [in/out]
+ *          The intermediate message digest to update
  *      mblock: [in]
  *          Start of the next 64 message bytes to process
  *
@@ -310,8 +460,8 @@ slowpath:
  *      single character names, were used because those were the
  *      names used in the publication.
  */
-static void G_HOT
-SHA1_process_message_block(SHA1_context *context, const void *mblock)
+static inline void G_HOT
+sha1_block_generic(uint32 *ihash, const uint8 *mblock)
 {
 	const uint32 K[] = {       /* Constants defined in SHA-1 */
 		0x5A827999,
@@ -328,13 +478,7 @@ SHA1_process_message_block(SHA1_context *context, const void *mblock)
 	 *  Initialize the first 16 words in the array W
 	 */
 
-#ifdef IS_LITTLE_ENDIAN
-#define INIT(x)			W[x] = UINT32_SWAP(*wp); wp++
-#else
-#define INIT(x)			W[x] = *wp++
-#endif
-
-	wp = (uint32 *) mblock;
+#define INIT(x)			W[x] = peek_be32(&mblock[4 * (x)])
 
 	/* Unrolling this loop saves time */
 	INIT(0);  INIT(1);  INIT(2);  INIT(3);
@@ -365,11 +509,11 @@ SHA1_process_message_block(SHA1_context *context, const void *mblock)
 		CRUNCH; wp++;		/* t+9 */
 	}
 
-	a = context->ihash[0];
-	b = context->ihash[1];
-	c = context->ihash[2];
-	d = context->ihash[3];
-	e = context->ihash[4];
+	a = ihash[0];
+	b = ihash[1];
+	c = ihash[2];
+	d = ihash[3];
+	e = ihash[4];
 
 	wp = &W[0];
 
@@ -489,13 +633,329 @@ SHA1_process_message_block(SHA1_context *context, const void *mblock)
 	ROTATE(3, c, d, e, a, b, M3);
 	ROTATE(3, b, c, d, e, a, M3);
 
-	context->ihash[0] += a;
-	context->ihash[1] += b;
-	context->ihash[2] += c;
-	context->ihash[3] += d;
-	context->ihash[4] += e;
+	ihash[0] += a;
+	ihash[1] += b;
+	ihash[2] += c;
+	ihash[3] += d;
+	ihash[4] += e;
+
+#undef INIT
+#undef CRUNCH
+#undef ROTATE
+#undef M0
+#undef M1
+#undef M2
+#undef M3
+}
 
-	context->midx = 0;
+/**
+ * Portable kernel, processing ``n'' consecutive message blocks.
+ */
+static void G_HOT
+sha1_blocks_generic(uint32 *ihash, const void *data, size_t n)
+{
+	const uint8 *p = data;
+
+	for (/**/; n != 0; n--, p += SHA1_BLEN)
+		sha1_block_generic(ihash, p);
+}
+
+#ifdef SHA1_X86_KERNELS
+/**
+ * SHA-NI kernel, processing ``n'' consecutive message blocks.
+ *
+ * The SHA extensions compute 4 rounds per instruction and also handle the
+ * message schedule, the 80-round loop being expressed as 20 groups of 4
+ * rounds where the roles of the message and "E" registers rotate.
+ */
+static void G_HOT SHA1_TARGET_SHANI
+sha1_blocks_shani(uint32 *ihash, const void *data, size_t n)
+{
+	const __m128i mask = _mm_set_epi64x(
+		0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd, e0, e1, abcd_save, e0_save;
+	__m128i m0, m1, m2, m3;
+	const uint8 *p = data;
+
+	abcd = _mm_loadu_si128((const __m128i *) ihash);
+	abcd = _mm_shuffle_epi32(abcd, 0x1b);
+	e0 = _mm_set_epi32(ihash[4], 0, 0, 0);
+
+#define LOAD(m, i) \
+	m = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) &p[16 * (i)]), mask)
+
+	/*
+	 * Four rounds with function ``f'', starting with message ``ma'' and
+	 * preparing the schedule of the next ones.
+	 */
+#define ROUNDS(ea, eb, ma, mb, mc, md, f) \
+	ea = _mm_sha1nexte_epu32(ea, ma); \
+	eb = abcd; \
+	mb = _mm_sha1msg2_epu32(mb, ma); \
+	abcd = _mm_sha1rnds4_epu32(abcd, ea, f); \
+	md = _mm_sha1msg1_epu32(md, ma); \
+	mc = _mm_xor_si128(mc, ma);
+
+	for (/**/; n != 0; n--, p += SHA1_BLEN) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		/* Rounds 0-3 */
+		LOAD(m0, 0);
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		/* Rounds 4-7 */
+		LOAD(m1, 1);
+		e1 = _mm_sha1nexte_epu32(e1, m1);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		m0 = _mm_sha1msg1_epu32(m0, m1);
+
+		/* Rounds 8-11 */
+		LOAD(m2, 2);
+		e0 = _mm_sha1nexte_epu32(e0, m2);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		m1 = _mm_sha1msg1_epu32(m1, m2);
+		m0 = _mm_xor_si128(m0, m2);
+
+		LOAD(m3, 3);
+		ROUNDS(e1, e0, m3, m0, m1, m2, 0);		/* Rounds 12-15 */
+		ROUNDS(e0, e1, m0, m1, m2, m3, 0);		/* Rounds 16-19 */
+		ROUNDS(e1, e0, m1, m2, m3, m0, 1);		/* Rounds 20-23 */
+		ROUNDS(e0, e1, m2, m3, m0, m1, 1);		/* Rounds 24-27 */
+		ROUNDS(e1, e0, m3, m0, m1, m2, 1);		/* Rounds 28-31 */
+		ROUNDS(e0, e1, m0, m1, m2, m3, 1);		/* Rounds 32-35 */
+		ROUNDS(e1, e0, m1, m2, m3, m0, 1);		/* Rounds 36-39 */
+		ROUNDS(e0, e1, m2, m3, m0, m1, 2);		/* Rounds 40-43 */
+		ROUNDS(e1, e0, m3, m0, m1, m2, 2);		/* Rounds 44-47 */
+		ROUNDS(e0, e1, m0, m1, m2, m3, 2);		/* Rounds 48-51 */
+		ROUNDS(e1, e0, m1, m2, m3, m0, 2);		/* Rounds 52-55 */
+		ROUNDS(e0, e1, m2, m3, m0, m1, 2);		/* Rounds 56-59 */
+		ROUNDS(e1, e0, m3, m0, m1, m2, 3);		/* Rounds 60-63 */
+		ROUNDS(e0, e1, m0, m1, m2, m3, 3);		/* Rounds 64-67 */
+		ROUNDS(e1, e0, m1, m2, m3, m0, 3);		/* Rounds 68-71 */
+		ROUNDS(e0, e1, m2, m3, m0, m1, 3);		/* Rounds 72-75 */
+
+		/* Rounds 76-79 */
+		e1 = _mm_sha1nexte_epu32(e1, m3);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+#undef LOAD
+#undef ROUNDS
+
+	abcd = _mm_shuffle_epi32(abcd, 0x1b);
+	_mm_storeu_si128((__m128i *) ihash, abcd);
+	ihash[4] = _mm_extract_epi32(e0, 3);
+}
+
+/**
+ * AVX2 multi-buffer kernel, processing ``n'' consecutive message blocks
+ * from SHA1_LANES independent messages.
+ *
+ * Each 32-bit lane of the vector registers holds the state of one message,
+ * so this is the generic algorithm, only run on 8 messages at a time.
+ */
+static void G_HOT SHA1_TARGET_AVX2
+sha1_blocks_avx2(uint32 *ihash[SHA1_LANES],
+	const void *data[SHA1_LANES], size_t n)
+{
+	const uint8 *p[SHA1_LANES];
+	uint32 out[SHA1_LANES];
+	__m256i h[5], W[16];
+	uint i, t;
+
+	for (i = 0; i < SHA1_LANES; i++)
+		p[i] = data[i];
+
+	for (i = 0; i < N_ITEMS(h); i++) {
+		h[i] = _mm256_setr_epi32(
+			ihash[0][i], ihash[1][i], ihash[2][i], ihash[3][i],
+			ihash[4][i], ihash[5][i], ihash[6][i], ihash[7][i]);
+	}
+
+#define ADD(x, y)		_mm256_add_epi32((x), (y))
+#define XOR(x, y)		_mm256_xor_si256((x), (y))
+#define AND(x, y)		_mm256_and_si256((x), (y))
+#define OR(x, y)		_mm256_or_si256((x), (y))
+#define ROTL(x, s) \
+	OR(_mm256_slli_epi32((x), (s)), _mm256_srli_epi32((x), 32 - (s)))
+
+#define M0(B, C, D)		XOR(D, AND(B, XOR(C, D)))
+#define M1(B, C, D)		XOR(XOR(B, C), D)
+#define M2(B, C, D)		OR(AND(B, OR(C, D)), AND(C, D))
+#define M3(B, C, D)		XOR(XOR(B, C), D)
+
+#define WORD(x) \
+	(t < 16 ? W[x] : \
+	(W[x] = ROTL(XOR(XOR(W[((x) + 13) & 15], W[((x) + 8) & 15]), \
+		XOR(W[((x) + 2) & 15], W[x])), 1)))
+
+#define STEPS(from, k, mix) \
+	for (t = from; t < (from) + 20; t++) { \
+		__m256i tmp = ADD(ADD(ROTL(a, 5), mix(b, c, d)), \
+			ADD(ADD(e, _mm256_set1_epi32(k)), WORD(t & 15))); \
+		e = d; d = c; c = ROTL(b, 30); b = a; a = tmp; \
+	}
+
+	for (/**/; n != 0; n--) {
+		__m256i a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+		for (t = 0; t < 16; t++) {
+			W[t] = _mm256_setr_epi32(
+				peek_be32(&p[0][4 * t]), peek_be32(&p[1][4 * t]),
+				peek_be32(&p[2][4 * t]), peek_be32(&p[3][4 * t]),
+				peek_be32(&p[4][4 * t]), peek_be32(&p[5][4 * t]),
+				peek_be32(&p[6][4 * t]), peek_be32(&p[7][4 * t]));
+		}
+
+		STEPS(0,  0x5A827999, M0);
+		STEPS(20, 0x6ED9EBA1, M1);
+		STEPS(40, 0x8F1BBCDC, M2);
+		STEPS(60, 0xCA62C1D6, M3);
+
+		h[0] = ADD(h[0], a);
+		h[1] = ADD(h[1], b);
+		h[2] = ADD(h[2], c);
+		h[3] = ADD(h[3], d);
+		h[4] = ADD(h[4], e);
+
+		for (i = 0; i < SHA1_LANES; i++)
+			p[i] += SHA1_BLEN;
+	}
+
+#undef ADD
+#undef XOR
+#undef AND
+#undef OR
+#undef ROTL
+#undef M0
+#undef M1
+#undef M2
+#undef M3
+#undef WORD
+#undef STEPS
+
+	for (i = 0; i < N_ITEMS(h); i++) {
+		uint j;
+
+		_mm256_storeu_si256((__m256i *) out, h[i]);
+		for (j = 0; j < SHA1_LANES; j++)
+			ihash[j][i] = out[j];
+	}
+}
+
+/**
+ * @return whether the CPU supports the SHA extensions, along with the
+ * SSSE3 and SSE4.1 instructions used by the SHA-NI kernel.
+ */
+static bool
+sha1_cpu_has_shani(void)
+{
+	uint a, b, c, d;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return FALSE;
+
+	__cpuid_count(7, 0, a, b, c, d);
+	(void) a; (void) c; (void) d;
+
+	return booleanize(b & (1U << 29)) &&		/* EBX bit 29 is SHA */
+		__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1");
+}
+#endif	/* SHA1_X86_KERNELS */
+
+/**
+ * Select the SHA-1 implementation to use.
+ *
+ * This is meant to be used by test programs, to compare the kernels, or
+ * at startup: changing the implementation whilst other threads are hashing
+ * is safe since the kernels all compute the same thing.
+ *
+ * The automatic selection picks the fastest single-stream kernel and the
+ * multi-buffer kernel when the CPU supports AVX2: hashing 8 streams with
+ * AVX2 yields a higher aggregated throughput than SHA-NI does on a single
+ * stream.
+ *
+ * @param impl		the implementation to use, SHA1_IMPL_AUTO for the best
+ *
+ * @return TRUE if OK, FALSE if the CPU does not support the implementation,
+ * in which case the current one is left unchanged.
+ */
+bool
+SHA1_set_impl(enum sha1_impl impl)
+{
+	sha1_blocks_fn_t blocks = sha1_blocks_generic;
+	sha1_blocks_x8_fn_t blocks_x8 = NULL;
+
+	switch (impl) {
+	case SHA1_IMPL_AUTO:
+#ifdef SHA1_X86_KERNELS
+		if (sha1_cpu_has_shani())
+			blocks = sha1_blocks_shani;
+		if (__builtin_cpu_supports("avx2"))
+			blocks_x8 = sha1_blocks_avx2;
+#endif
+		break;
+	case SHA1_IMPL_GENERIC:
+		break;
+	case SHA1_IMPL_SHANI:
+#ifdef SHA1_X86_KERNELS
+		if (sha1_cpu_has_shani()) {
+			blocks = sha1_blocks_shani;
+			break;
+		}
+#endif
+		return FALSE;
+	case SHA1_IMPL_AVX2:
+#ifdef SHA1_X86_KERNELS
+		if (__builtin_cpu_supports("avx2")) {
+			blocks_x8 = sha1_blocks_avx2;
+			break;
+		}
+#endif
+		return FALSE;
+	}
+
+	sha1_blocks_x8 = blocks_x8;
+	sha1_blocks = blocks;
+
+	return TRUE;
+}
+
+/**
+ * @return the name of the SHA-1 implementation being used.
+ */
+const char *
+SHA1_impl_name(void)
+{
+	if G_UNLIKELY(NULL == sha1_blocks)
+		sha1_impl_select();
+
+	if (NULL == sha1_blocks_x8)
+		return sha1_blocks_generic == sha1_blocks ? "generic" : "SHA-NI";
+
+	return sha1_blocks_generic == sha1_blocks ?
+		"AVX2 multi-buffer" : "SHA-NI + AVX2 multi-buffer";
+}
+
+/**
+ * Select the best SHA-1 implementation for the CPU we are running on.
+ *
+ * Concurrent threads may perform the selection at the same time, but they
+ * will all pick the same implementation.
+ */
+static void
+sha1_impl_select(void)
+{
+	SHA1_set_impl(SHA1_IMPL_AUTO);
 }
 
 /**
@@ -534,7 +994,8 @@ SHA1_pad_message(SHA1_context *context)
 			context->mblock[context->midx++] = 0;
 		}
 
-		SHA1_process_message_block(context, context->mblock);
+		(*sha1_blocks)(context->ihash, context->mblock, 1);
+		context->midx = 0;
 
 		while (context->midx < SHA1_BUP) {
 			context->mblock[context->midx++] = 0;
@@ -551,7 +1012,8 @@ SHA1_pad_message(SHA1_context *context)
 	 */
 
 	poke_be64(&context->mblock[SHA1_BUP], context->length);
-	SHA1_process_message_block(context, context->mblock);
+	(*sha1_blocks)(context->ihash, context->mblock, 1);
+	context->midx = 0;
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -70,6 +70,16 @@ typedef struct SHA1_context {
 	enum SHA_code corrupted;  /* Is the message digest corrupted? */
 } SHA1_context;
 
+/**
+ * Available SHA-1 implementations.
+ */
+enum sha1_impl {
+	SHA1_IMPL_AUTO = 0,		/**< Best one for the running CPU */
+	SHA1_IMPL_GENERIC,		/**< Portable C code */
+	SHA1_IMPL_SHANI,		/**< x86 SHA extensions */
+	SHA1_IMPL_AVX2			/**< Generic, with 8-way AVX2 multi-buffer */
+};
+
 static inline void
 SHA1_check(const SHA1_context * const ctx)
 {
@@ -84,6 +94,11 @@ int SHA1_reset(SHA1_context *);
 int SHA1_input(SHA1_context *, const void *, size_t);
 int SHA1_result(SHA1_context *, struct sha1 *digest);
 int SHA1_intermediate(const SHA1_context *, struct sha1 *digest);
+int SHA1_input_multi(SHA1_context *ctx[], const void *data[],
+	size_t length, size_t n);
+
+bool SHA1_set_impl(enum sha1_impl impl);
+const char *SHA1_impl_name(void);
 
 /**
  * Feed the SHA1 context with the content of a variable.
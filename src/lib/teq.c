@@ -58,6 +58,13 @@
  * can be viewed as specialized AQs since clients of the TEQs do not need to
  * bother with the message sent, only with higher-level semantics.
  *
+ * Events are posted to a bounded lock-free ring (see ringq.c), so that
+ * posting does not require any locking in the common case.  When the ring
+ * is full, events spill into an overflow list protected by the queue lock,
+ * and all subsequent events are appended there until the receiving thread
+ * has drained the list, to preserve the ordering of events sent by a given
+ * thread.  The receiving thread fetches events by batches.
+ *
  * Each thread can limit the processing it does out of its TEQ by requesting
  * a time limit for processing (checked every so-many items processed, not
  * after every item) and a delay for further processing should it end up
@@ -80,6 +87,7 @@
 #include "log.h"
 #include "once.h"
 #include "pow2.h"
+#include "ringq.h"
 #include "spinlock.h"
 #include "stacktrace.h"
 #include "stringify.h"			/* For plural() */
@@ -97,6 +105,8 @@
 #define TEQ_THROTTLE_DELAY_DFLT	951		/**< 951 ms */
 #define TEQ_THROTTLE_MASK		0x1f
 #define TEQ_RPC_TIMEOUT			5000	/* ms: 5 seconds */
+#define TEQ_RING_SIZE			1024	/**< Events held in lock-free ring */
+#define TEQ_BATCH				(TEQ_THROTTLE_MASK + 1)
 
 /**
  * Magic numbers for thread event objects share the leading 24 bits.
@@ -193,8 +203,10 @@ struct teq {
 	int throttle_ms;			/**< Max processing time (ms) */
 	int throttle_delay;			/**< If throttled, delay in ms */
 	int refcnt;					/**< Reference count */
+	int overflowed;				/**< Amount of events in overflow list */
 	time_t last_handling;		/**< When we last handled the TSIG_TEQ signal */
-	eslist_t queue;				/**< Queue receiving events */
+	ringq_t *ring;				/**< Lock-free ring receiving events */
+	eslist_t overflow;			/**< Events that did not fit in the ring */
 	spinlock_t lock;			/**< Thread-safe lock protecting the queue */
 	cevent_t *throttle_ev;		/**< Throttle event (no throttling if NULL) */
 };
@@ -329,6 +341,61 @@ teq_destroy_event(const struct teq *teq, void *ev)
 	g_assert_not_reached();
 }
 
+/**
+ * Fetch the next pending events from the queue.
+ *
+ * Events held in the ring are always older than the ones in the overflow
+ * list, hence we only look at the latter once the ring is empty.
+ *
+ * The ring is drained under the lock, once per batch, so that teq_put()
+ * can safely look at the events it holds when checking for uniqueness.
+ *
+ * @param teq		the event queue
+ * @param vec		vector where fetched events are written, in queue order
+ * @param vcnt		amount of entries in the vector
+ *
+ * @return the amount of events fetched, 0 if none were pending.
+ */
+static size_t
+teq_fetch(struct teq *teq, void **vec, size_t vcnt)
+{
+	size_t n;
+
+	teq_check(teq);
+
+	TEQ_LOCK(teq);
+
+	n = ringq_drain(teq->ring, vec, vcnt);
+
+	if (n < vcnt && 0 != atomic_int_get(&teq->overflowed)) {
+		while (n < vcnt) {
+			void *ev;
+
+			if (ringq_get(teq->ring, &vec[n])) {
+				n++;
+			} else if (NULL != (ev = eslist_shift(&teq->overflow))) {
+				atomic_int_dec(&teq->overflowed);
+				vec[n++] = ev;
+			} else {
+				break;
+			}
+		}
+	}
+
+	TEQ_UNLOCK(teq);
+
+	return n;
+}
+
+/**
+ * @return amount of events pending in the queue.
+ */
+static size_t
+teq_pending(const struct teq *teq)
+{
+	return ringq_count(teq->ring) + atomic_int_get(&teq->overflowed);
+}
+
 /**
  * Destroy a thread event queue.
  */
@@ -336,6 +403,8 @@ static void
 teq_destroy(struct teq *teq)
 {
 	void *ev;
+	void *vec[TEQ_BATCH];
+	size_t i, n;
 
 	teq_check(teq);
 	g_assert(0 == teq->refcnt);
@@ -351,10 +420,13 @@ teq_destroy(struct teq *teq)
 	 * events in its queue, but it is not necessarily critical.
 	 */
 
-	while (NULL != (ev = eslist_shift(&teq->queue))) {
-		teq_destroy_event(teq, ev);
+	while (0 != (n = teq_fetch(teq, vec, N_ITEMS(vec)))) {
+		for (i = 0; i < n; i++)
+			teq_destroy_event(teq, vec[i]);
 	}
 
+	ringq_free_null(&teq->ring);
+
 	if (teq_is_io(teq)) {
 		struct teq_io *teq_io = TEQ_IO(teq);
 		size_t count = eslist_count(&teq_io->ioq);
@@ -537,6 +609,11 @@ teq_ev_cmp(const void *a, const void *b)
 /**
  * Add event to the queue, signaling targeted thread.
  *
+ * When "unique" is requested, the event is looked for both in the ring and
+ * in the overflow list.  This is done under the lock, which prevents the
+ * consumer from dequeuing (and then freeing) the events we are comparing
+ * since it only drains the ring with the lock held (see teq_fetch()).
+ *
  * @param teq		the event queue
  * @param ev		the event
  * @param unique	if TRUE, do not post if identical event pending
@@ -554,20 +631,48 @@ teq_put(struct teq *teq, void *ev, bool unique)
 	/* We only support "unique" for plain events */
 	g_assert(implies(unique, tevent_is_plain(ev)));
 
+	/*
+	 * Fast path: nothing in the overflow list and room in the ring.
+	 */
+
+	if G_LIKELY(
+		!unique &&
+		0 == atomic_int_get(&teq->overflowed) &&
+		ringq_put(teq->ring, ev)
+	)
+		goto signal;
+
 	TEQ_LOCK(teq);
 
-	if G_UNLIKELY(unique && NULL != eslist_find(&teq->queue, ev, teq_ev_cmp))
-		posted = FALSE;
+	if G_UNLIKELY(unique) {
+		if (
+			ringq_contains(teq->ring, ev, teq_ev_cmp) ||
+			NULL != eslist_find(&teq->overflow, ev, teq_ev_cmp)
+		)
+			posted = FALSE;
+	}
 
-	if (posted)
-		eslist_append(&teq->queue, ev);
+	if (
+		posted &&
+		0 == eslist_count(&teq->overflow) && ringq_put(teq->ring, ev)
+	)
+		goto unlock;		/* Overflow is empty and ring had room */
 
+	if (posted) {
+		eslist_append(&teq->overflow, ev);
+		atomic_int_inc(&teq->overflowed);
+	}
+
+unlock:
 	TEQ_UNLOCK(teq);
 
-	if (posted)
-		thread_kill(teq->stid, TSIG_TEQ);
+	if (!posted)
+		return FALSE;
 
-	return posted;
+signal:
+	thread_kill(teq->stid, TSIG_TEQ);
+
+	return TRUE;
 }
 
 /**
@@ -593,25 +698,6 @@ teq_io_enqueue(struct teq *teq, void *ev)
 	waiter_signal(teq_io->w);
 }
 
-/**
- * Remove next event from the queue, if any.
- *
- * @return the unqueued event, NULL if no more events are pending.
- */
-static void *
-teq_remove(struct teq *teq)
-{
-	void *ev;
-
-	teq_check(teq);
-
-	TEQ_LOCK(teq);
-	ev = eslist_shift(&teq->queue);
-	TEQ_UNLOCK(teq);
-
-	return ev;
-}
-
 /**
  * Fetch next event from the I/O queue.
  *
@@ -679,20 +765,85 @@ teq_io_unthrottle(cqueue_t *cq, void *data)
 	waiter_signal(teq_io->w);
 }
 
+/**
+ * Process one event fetched from the queue.
+ */
+static void
+teq_process_event(struct teq *teq, void *ev)
+{
+	tevent_check(ev);
+
+	switch (((struct tevent *) ev)->magic) {
+	case THREAD_EVENT_MAGIC:			/* Invoke routine */
+		{
+			struct tevent_plain *evp = ev;
+			(*evp->event)(evp->data);
+			evp->magic = 0;
+			WFREE(evp);
+		}
+		return;
+	case THREAD_EVENT_ACK_MAGIC:		/* Invoke routine, acknowledge */
+		{
+			struct tevent_acked *eva = ev;
+			(*eva->event)(eva->event_data);
+			teq_ack(eva);
+			eva->magic = 0;
+			WFREE(eva);
+		}
+		return;
+	case THREAD_EVENT_RPC_MAGIC:		/* Plain inter-thread RPC */
+		{
+			struct tevent_rpc *evr = ev;
+
+			evr->result = (*evr->routine)(evr->data);
+			atomic_bool_set(&evr->done, TRUE);
+			thread_unblock(evr->id);
+
+			/* Do not free, event structure lies on the caller's stack */
+		}
+		return;
+	case THREAD_EVENT_ARPC_MAGIC:		/* Asynchronous "safe" RPC */
+		{
+			/*
+			 * Request asynchronous processing via the callout queue.
+			 */
+
+			cq_main_insert(1, teq_async_rpc, ev);
+
+			/* Do not free, event structure lies on the caller's stack */
+		}
+		return;
+	case THREAD_EVENT_IRPC_MAGIC:		/* Asynchronous "safe" RPC */
+	case THREAD_EVENT_IO_MAGIC:			/* Asynchronous "safe" routine */
+		{
+			/*
+			 * Simply move the event to the I/O queue, which will be
+			 * processed later from the main I/O event loop.
+			 */
+
+			teq_io_enqueue(teq, ev);
+		}
+		return;
+	}
+
+	g_assert_not_reached();
+}
+
 /**
  * Process enqueued events.
  *
+ * Events are fetched by batches from the queue, and throttling conditions
+ * are checked after each batch.
+ *
  * @return the amount of events processed
  */
 static size_t
 teq_process(struct teq *teq)
 {
-	size_t n = 0;
-	void *ev;
+	size_t i, n = 0, cnt;
+	void *vec[TEQ_BATCH];
 	tm_t start = TM_ZERO;
 
-	STATIC_ASSERT(IS_POWER_OF_2(TEQ_THROTTLE_MASK + 1));
-
 	teq_check(teq);
 
 	if (teq->throttle_ev != NULL)
@@ -701,72 +852,18 @@ teq_process(struct teq *teq)
 	if (teq->throttle_ms != 0)
 		tm_now_exact(&start);
 
-	while (NULL != (ev = teq_remove(teq))) {
-		tevent_check(ev);
-		n++;
-
-		switch (((struct tevent *) ev)->magic) {
-		case THREAD_EVENT_MAGIC:			/* Invoke routine */
-			{
-				struct tevent_plain *evp = ev;
-				(*evp->event)(evp->data);
-				evp->magic = 0;
-				WFREE(evp);
-			}
-			goto next;
-		case THREAD_EVENT_ACK_MAGIC:		/* Invoke routine, acknowledge */
-			{
-				struct tevent_acked *eva = ev;
-				(*eva->event)(eva->event_data);
-				teq_ack(eva);
-				eva->magic = 0;
-				WFREE(eva);
-			}
-			goto next;
-		case THREAD_EVENT_RPC_MAGIC:		/* Plain inter-thread RPC */
-			{
-				struct tevent_rpc *evr = ev;
-
-				evr->result = (*evr->routine)(evr->data);
-				atomic_bool_set(&evr->done, TRUE);
-				thread_unblock(evr->id);
-
-				/* Do not free, event structure lies on the caller's stack */
-			}
-			goto next;
-		case THREAD_EVENT_ARPC_MAGIC:		/* Asynchronous "safe" RPC */
-			{
-				/*
-				 * Request asynchronous processing via the callout queue.
-				 */
+	while (0 != (cnt = teq_fetch(teq, vec, N_ITEMS(vec)))) {
+		for (i = 0; i < cnt; i++)
+			teq_process_event(teq, vec[i]);
 
-				cq_main_insert(1, teq_async_rpc, ev);
+		n += cnt;
 
-				/* Do not free, event structure lies on the caller's stack */
-			}
-			goto next;
-		case THREAD_EVENT_IRPC_MAGIC:		/* Asynchronous "safe" RPC */
-		case THREAD_EVENT_IO_MAGIC:			/* Asynchronous "safe" routine */
-			{
-				/*
-				 * Simply move the event to the I/O queue, which will be
-				 * processed later from the main I/O event loop.
-				 */
-
-				teq_io_enqueue(teq, ev);
-			}
-			goto next;
-		}
-
-		g_assert_not_reached();
-
-	next:
 		/*
 		 * If we have to throttle processing, create a callout queue trigger
 		 * which will post back a signal to this thread.
 		 */
 
-		if G_UNLIKELY(0 == (n & TEQ_THROTTLE_MASK) && teq->throttle_ms != 0) {
+		if G_UNLIKELY(teq->throttle_ms != 0) {
 			tm_t now;
 
 			tm_now_exact(&now);
@@ -1351,13 +1448,14 @@ teq_count(unsigned id)
 	if (NULL == teq)
 		return 0;
 
-	TEQ_LOCK(teq);
-	count = eslist_count(&teq->queue);
+	count = teq_pending(teq);
 	if (teq_is_io(teq)) {
 		struct teq_io *teq_io = TEQ_IO(teq);
+
+		TEQ_LOCK(teq);
 		count += eslist_count(&teq_io->ioq);
+		TEQ_UNLOCK(teq);
 	}
-	TEQ_UNLOCK(teq);
 
 	teq_release(teq);
 	return count;
@@ -1372,7 +1470,8 @@ teq_initialize(struct teq *teq, unsigned id)
 	teq->stid = id;
 	teq->generation = atomic_uint_inc(&teq_generation);
 	teq->refcnt = 1;
-	eslist_init(&teq->queue, offsetof(struct tevent, lk));
+	teq->ring = ringq_make(TEQ_RING_SIZE);
+	eslist_init(&teq->overflow, offsetof(struct tevent, lk));
 	spinlock_init(&teq->lock);
 }
 
@@ -1509,8 +1608,8 @@ teq_monitor(void *unused_obj)
 
 			teq_check(teq);
 
+			count = teq_pending(teq);
 			TEQ_LOCK(teq);
-			count = eslist_count(&teq->queue);
 			last = teq->last_handling;
 			throttled = teq->throttle_ev != NULL;
 			TEQ_UNLOCK(teq);
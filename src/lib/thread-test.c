@@ -92,7 +92,7 @@ static void G_NORETURN
 usage(void)
 {
 	fprintf(stderr,
-		"Usage: %s [-hejsvwxABCDEFHIKMNOPQRSUVWX]\n"
+		"Usage: %s [-hejqsvwxABCDEFHIKLMNOPQRSUVWX]\n"
 		"       [-a type] [-b size] [-c CPU]\n"
 		"       [-f count] [-n count] [-r percent] [-t ms] [-T msecs]\n"
 		"       [-z fn1,fn2...]\n"
@@ -104,6 +104,7 @@ usage(void)
 		"  -h : prints this help message\n"
 		"  -j : join created threads\n"
 		"  -n : amount of times to repeat tests\n"
+		"  -q : benchmark asynchronous and thread event queues\n"
 		"  -r : let remote threads free some objects during -X tests\n"
 		"  -s : let each created thread sleep for 1 second before ending\n"
 		"  -t : timeout value (ms) for condition waits\n"
@@ -120,6 +121,7 @@ usage(void)
 		"  -H : test thread interrupts\n"
 		"  -I : test inter-thread waiter signaling\n"
 		"  -K : test thread cancellation\n"
+		"  -L : benchmark callout queue with many pending events\n"
 		"  -M : monitors tennis match via waiters\n"
 		"  -N : add broadcast noise during tennis session\n"
 		"  -O : test thread stack overflow\n"
@@ -1149,6 +1151,193 @@ test_aqueue(bool emulated)
 	emit("%s() all done.", G_STRFUNC);
 }
 
+#define AQB_ITEMS		200000	/* Items posted by each producer */
+#define AQB_PINGS		20000	/* Round-trips for latency measurement */
+#define AQB_PRODUCERS	4		/* Maximum amount of producers */
+#define AQB_BATCH		64		/* Batch size for aq_drain() */
+
+static void *
+aqb_producer(void *arg)
+{
+	aqueue_t *aq = aq_refcnt_inc(arg);
+	uint i;
+
+	for (i = 0; i < AQB_ITEMS; i++)
+		aq_put(aq, uint_to_pointer(i));
+
+	aq_refcnt_dec(aq);
+	return NULL;
+}
+
+static void *
+aqb_echo(void *arg)
+{
+	struct aqt_arg *aa = arg;
+
+	for (;;) {
+		void *msg = aq_remove(aa->r);
+
+		aq_put(aa->a, msg);
+		if (NULL == msg)
+			break;
+	}
+
+	return NULL;
+}
+
+static uint teq_bench_cnt;
+
+static void
+teq_bench_event(void *unused_arg)
+{
+	(void) unused_arg;
+
+	teq_bench_cnt++;
+}
+
+static bool
+teq_bench_done(void *arg)
+{
+	return teq_bench_cnt >= pointer_to_uint(arg);
+}
+
+static void *
+teq_bench_receiver(void *arg)
+{
+	barrier_t *b = arg;
+
+	teq_bench_cnt = 0;
+	teq_create();
+	barrier_wait(b);			/* Event queue is installed */
+	barrier_free_null(&b);
+	teq_wait(teq_bench_done, uint_to_pointer(AQB_ITEMS));
+
+	return NULL;
+}
+
+static void
+test_aqueue_producers(bool drain)
+{
+	aqueue_t *aq;
+	int t[AQB_PRODUCERS];
+	uint i, n, total, got = 0;
+	tm_t start, end;
+
+	n = MAX(cpu_count - 1, 1);
+	n = MIN(n, AQB_PRODUCERS);
+	total = n * AQB_ITEMS;
+
+	aq = aq_make();
+
+	tm_now_exact(&start);
+
+	for (i = 0; i < n; i++) {
+		t[i] = thread_create(aqb_producer, aq, THREAD_F_PANIC,
+			THREAD_STACK_MIN);
+	}
+
+	while (got < total) {
+		if (drain) {
+			void *vec[AQB_BATCH];
+			size_t cnt = aq_drain(aq, vec, N_ITEMS(vec));
+
+			if (0 == cnt)
+				(void) aq_remove(aq);	/* Block until something comes */
+			got += MAX(cnt, 1);
+		} else {
+			(void) aq_remove(aq);
+			got++;
+		}
+	}
+
+	tm_now_exact(&end);
+
+	for (i = 0; i < n; i++)
+		thread_join(t[i], NULL);
+
+	emit("%s(): %u producer%s, %u items %s in %u ms (%.0f items/s)",
+		G_STRFUNC, n, plural(n), total, drain ? "drained" : "removed",
+		(uint) tm_elapsed_ms(&end, &start),
+		total / MAX(tm_elapsed_f(&end, &start), 1e-6));
+
+	aq_refcnt_dec(aq);
+}
+
+static void
+test_aqueue_latency(void)
+{
+	struct aqt_arg arg;
+	int t;
+	uint i;
+	tm_t start, end;
+
+	arg.r = aq_make();
+	arg.a = aq_make();
+
+	t = thread_create(aqb_echo, &arg, THREAD_F_PANIC, THREAD_STACK_MIN);
+
+	tm_now_exact(&start);
+
+	for (i = 0; i < AQB_PINGS; i++) {
+		aq_put(arg.r, uint_to_pointer(i + 1));
+		(void) aq_remove(arg.a);
+	}
+
+	tm_now_exact(&end);
+
+	aq_put(arg.r, NULL);
+	(void) aq_remove(arg.a);
+	thread_join(t, NULL);
+
+	emit("%s(): %u round-trips in %u ms (%.2f us per wakeup)",
+		G_STRFUNC, AQB_PINGS, (uint) tm_elapsed_ms(&end, &start),
+		tm_elapsed_us(&end, &start) / (2.0 * AQB_PINGS));
+
+	aq_refcnt_dec(arg.a);
+	aq_refcnt_dec(arg.r);
+}
+
+static void
+test_teq_throughput(void)
+{
+	barrier_t *b;
+	int r;
+	uint i;
+	tm_t start, end;
+
+	b = barrier_new(2);
+	r = thread_create(teq_bench_receiver, barrier_refcnt_inc(b),
+			THREAD_F_PANIC, THREAD_STACK_MIN);
+	barrier_wait(b);
+	barrier_free_null(&b);
+
+	tm_now_exact(&start);
+
+	for (i = 0; i < AQB_ITEMS; i++)
+		teq_post(r, teq_bench_event, NULL);
+
+	thread_join(r, NULL);
+
+	tm_now_exact(&end);
+
+	emit("%s(): %u events in %u ms (%.0f events/s)",
+		G_STRFUNC, AQB_ITEMS, (uint) tm_elapsed_ms(&end, &start),
+		AQB_ITEMS / MAX(tm_elapsed_f(&end, &start), 1e-6));
+}
+
+static void
+test_queue_bench(unsigned repeat)
+{
+	TESTING(G_STRFUNC);
+
+	while (repeat--) {
+		test_aqueue_producers(FALSE);
+		test_aqueue_producers(TRUE);
+		test_aqueue_latency();
+		test_teq_throughput();
+	}
+}
+
 static qlock_t qsync_plain = QLOCK_PLAIN_INIT;
 static qlock_t qsync_recursive = QLOCK_RECURSIVE_INIT;
 
@@ -2112,6 +2301,58 @@ teq_recv_plain(void *arg)
 	teq_recv_cnt++;
 }
 
+static int teq_recv_unique_cnt;
+
+static void
+teq_recv_unique(void *unused_arg)
+{
+	(void) unused_arg;
+	teq_recv_unique_cnt++;
+}
+
+/*
+ * Check that unique events are not posted when an identical event is still
+ * pending, be it in the ring or in the overflow list.
+ */
+static void
+teq_check_unique(void)
+{
+	unsigned id = thread_small_id();
+	tsigset_t nset, oset;
+	uint i;
+
+	teq_recv_unique_cnt = 0;
+
+	tsig_emptyset(&nset);
+	tsig_addset(&nset, TSIG_TEQ);
+	thread_sigmask(TSIG_BLOCK, &nset, &oset);	/* Let events accumulate */
+
+	g_assert(teq_post_unique(id, teq_recv_unique, NULL));
+	g_assert(!teq_post_unique(id, teq_recv_unique, NULL));
+
+	teq_post(id, teq_recv_unique, int_to_pointer(1));
+	g_assert(!teq_post_unique(id, teq_recv_unique, int_to_pointer(1)));
+
+	/* Fill the ring so that the next events spill to the overflow list */
+
+	for (i = 0; i < 1024; i++)
+		teq_post(id, teq_recv_unique, int_to_pointer(2));
+
+	g_assert(teq_post_unique(id, teq_recv_unique, int_to_pointer(3)));
+	g_assert(!teq_post_unique(id, teq_recv_unique, int_to_pointer(3)));
+	g_assert(!teq_post_unique(id, teq_recv_unique, NULL));
+
+	thread_sigmask(TSIG_SETMASK, &oset, NULL);
+
+	while (teq_recv_unique_cnt != 1027)
+		thread_sleep_ms(10);
+
+	g_assert(teq_post_unique(id, teq_recv_unique, NULL));
+
+	while (teq_recv_unique_cnt != 1028)
+		thread_sleep_ms(10);
+}
+
 static void
 teq_recv_done(void *arg)
 {
@@ -2149,6 +2390,7 @@ teq_receiver(void *arg)
 	teq_recv_completed = FALSE;
 	teq_create();
 	s_message("%s(): thread event queue installed", G_STRFUNC);
+	teq_check_unique();
 	barrier_wait(b);			/* Receiver installed event queue */
 	barrier_free_null(&b);
 	s_message("%s(): sender created its thread event queue", G_STRFUNC);
@@ -2235,6 +2477,102 @@ test_teq(unsigned repeat)
 	}
 }
 
+#define CQB_EVENTS		500000	/* Pending events in callout queue benchmark */
+#define CQB_PERIOD		50		/* Heartbeat period, in ms */
+
+static size_t cqb_fired;
+
+static void
+cqb_event(cqueue_t *cq, void *arg)
+{
+	cevent_t **ev = arg;
+
+	cq_zero(cq, ev);
+	cqb_fired++;
+}
+
+static double
+cqb_ns(const tm_t *end, const tm_t *start, size_t n)
+{
+	return tm_elapsed_f(end, start) * 1e9 / MAX(n, 1);
+}
+
+static void
+test_cq_bench(unsigned repeat)
+{
+	TESTING(G_STRFUNC);
+
+	while (repeat--) {
+		cqueue_t *cq;
+		cevent_t **evs;
+		size_t i, beats = 0, fired = 0;
+		tm_t start, end;
+		double beat_ns = 0.0;
+
+		cq = cq_make("bench", 0, CQB_PERIOD);
+		XMALLOC0_ARRAY(evs, CQB_EVENTS);
+		cqb_fired = 0;
+
+		/*
+		 * Most events are far in the future (up to one hour), like RPC
+		 * timeouts and expiry timers, but 1% of them are due within the
+		 * next few heartbeats.
+		 */
+
+		(void) cq_heartbeat(cq);	/* Binds queue to current thread */
+
+		tm_now_exact(&start);
+		for (i = 0; i < CQB_EVENTS; i++) {
+			int delay = 0 == i % 100 ?
+				(int) (1 + random_value(10 * CQB_PERIOD)) :
+				(int) (1000 + random_value(3600 * 1000));
+			evs[i] = cq_insert(cq, delay, cqb_event, &evs[i]);
+		}
+		tm_now_exact(&end);
+
+		emit("%s(): inserted %u events, %.0f ns/insert",
+			G_STRFUNC, CQB_EVENTS, cqb_ns(&end, &start, CQB_EVENTS));
+
+		tm_now_exact(&start);
+		for (i = 0; i < CQB_EVENTS; i++) {
+			if (evs[i] != NULL && 0 != i % 100)
+				cq_resched(evs[i], 1000 + random_value(3600 * 1000));
+		}
+		tm_now_exact(&end);
+
+		emit("%s(): rescheduled events, %.0f ns/resched",
+			G_STRFUNC, cqb_ns(&end, &start, CQB_EVENTS));
+
+		while (cqb_fired < CQB_EVENTS / 100 && beats < 20) {
+			tm_t bs, be;
+
+			compat_sleep_ms(CQB_PERIOD);
+			tm_now_exact(&bs);
+			fired += cq_heartbeat(cq);
+			tm_now_exact(&be);
+			beat_ns += tm_elapsed_f(&be, &bs) * 1e9;
+			beats++;
+		}
+
+		emit("%s(): %zu heartbeats fired %zu events with %d pending, "
+			"%.0f ns/heartbeat",
+			G_STRFUNC, beats, fired, cq_count(cq), beat_ns / MAX(beats, 1));
+
+		tm_now_exact(&start);
+		for (i = 0; i < CQB_EVENTS; i++)
+			cq_cancel(&evs[i]);
+		tm_now_exact(&end);
+
+		emit("%s(): cancelled events, %.0f ns/cancel",
+			G_STRFUNC, cqb_ns(&end, &start, CQB_EVENTS));
+
+		g_assert(0 == cq_count(cq));
+
+		XFREE_NULL(evs);
+		cq_free_null(&cq);
+	}
+}
+
 static void
 evq_event(void *arg)
 {
@@ -2467,9 +2805,9 @@ main(int argc, char **argv)
 	bool inter = FALSE, forking = FALSE, aqueue = FALSE, rwlock = FALSE;
 	bool signals = FALSE, barrier = FALSE, overflow = FALSE, memory = FALSE;
 	bool stats = FALSE, teq = FALSE, cancel = FALSE, dam = FALSE, evq = FALSE;
-	bool interrupts = FALSE, qlock = FALSE;
+	bool interrupts = FALSE, qlock = FALSE, qbench = FALSE, cqbench = FALSE;
 	unsigned repeat = 1, play_time = 0;
-	const char options[] = "a:b:c:ef:hjn:r:st:vwxz:ABCDEFHIKMNOPQRST:UVWX";
+	const char options[] = "a:b:c:ef:hjn:qr:st:vwxz:ABCDEFHIKLMNOPQRST:UVWX";
 
 	progstart(argc, argv);
 	thread_set_main(TRUE);		/* We're the main thread, we can block */
@@ -2504,6 +2842,9 @@ main(int argc, char **argv)
 		case 'K':			/* test thread cancellation */
 			cancel = TRUE;
 			break;
+		case 'L':			/* benchmark callout queue */
+			cqbench = TRUE;
+			break;
 		case 'M':			/* monitor tennis match */
 			monitor = TRUE;
 			break;
@@ -2562,6 +2903,9 @@ main(int argc, char **argv)
 		case 'n':			/* repeat tests */
 			repeat = get_number(optarg, c);
 			break;
+		case 'q':			/* benchmark queues */
+			qbench = TRUE;
+			break;
 		case 'r':			/* ratio (percentage) of objects to free remotely */
 			percentage = get_number(optarg, c);
 			break;
@@ -2693,6 +3037,12 @@ main(int argc, char **argv)
 	if (evq)
 		test_evq(repeat);
 
+	if (qbench)
+		test_queue_bench(repeat);
+
+	if (cqbench)
+		test_cq_bench(repeat);
+
 	/*
 	 * Print final statistics.
 	 */
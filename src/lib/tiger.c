@@ -50,6 +50,21 @@
 #include "misc.h"
 #include "base32.h"
 #include "tiger.h"
+
+/*
+ * On x86, tiger_prefixed_multi() can use AVX2 to run the compression
+ * function on 4 messages at a time, the S-box lookups being done with the
+ * gather instructions.  Since we do not know the target CPU at compile time,
+ * the kernel is compiled with a function-specific target attribute and is
+ * only used when the CPU supports it.
+ */
+#if defined(HASATTRIBUTE) && (defined(__x86_64__) || defined(__i386__)) && \
+	(HAS_GCC(5, 0) || defined(__clang__))
+#define TIGER_X86_KERNELS
+#include <immintrin.h>
+#define TIGER_TARGET_AVX2	__attribute__((target("avx2")))
+#endif
+
 #include "override.h"		/* Must be the last header included */
 
 /* NOTE that this code is NOT FULLY OPTIMIZED for any  */
@@ -238,6 +253,272 @@ tiger(const void *data, uint64 length, char hash[24])
 }
 
 /* vi: set ai et sts=2 sw=2 cindent: */
+
+#define TIGER_BLEN	64		/**< Size of the blocks fed to the compression */
+#define TIGER_LANES	4		/**< Messages hashed at once by the AVX2 kernel */
+
+/**
+ * Initial state of the hash.
+ */
+static inline void
+tiger_state_init(uint64 state[3])
+{
+	state[0] = U64_FROM_2xU32(0x01234567UL, 0x89ABCDEFUL);
+	state[1] = U64_FROM_2xU32(0xFEDCBA98UL, 0x76543210UL);
+	state[2] = U64_FROM_2xU32(0xF096A5B4UL, 0xC3B2E187UL);
+}
+
+/**
+ * @return the amount of blocks to compress for a message of ``total'' bytes,
+ * including the final padding.
+ */
+static inline uint64
+tiger_block_count(uint64 total)
+{
+	return total / TIGER_BLEN + (total % TIGER_BLEN < 56 ? 1 : 2);
+}
+
+/**
+ * Load the words of block ``i'' of the message made of the ``prefix'' byte
+ * followed by the ``len'' bytes at ``data'', including the final padding.
+ *
+ * The prefix allows the Tiger Tree nodes to be hashed without having to
+ * copy their data to a buffer starting with the prefix byte.
+ */
+static inline void
+tiger_prefixed_load(uint8 prefix, const uint8 *data, uint64 len, uint64 i,
+	uint64 x[8])
+{
+	uint64 total = len + 1;				/* Includes the prefix byte */
+	uint64 full = total / TIGER_BLEN;	/* Amount of complete blocks */
+	uint k;
+
+	if G_LIKELY(i < full) {
+		const uint8 *p = &data[TIGER_BLEN * i];
+
+		/*
+		 * Message bytes are shifted by one because of the prefix.
+		 */
+
+		if G_UNLIKELY(0 == i)
+			x[0] = prefix | (peek_le64(p) << 8);
+		else
+			x[0] = peek_le64(p - 1);
+
+		for (k = 1; k < 8; k++)
+			x[k] = peek_le64(&p[8 * k - 1]);
+	} else {
+		uint8 buf[2 * TIGER_BLEN];
+		uint64 rem = total - TIGER_BLEN * full;
+		size_t j;
+
+		/*
+		 * Last partial block, followed by the padding and the message length
+		 * in bits, which may require another block.
+		 */
+
+		ZERO(&buf);
+		for (j = 0; j < rem; j++) {
+			uint64 o = TIGER_BLEN * full + j;	/* Offset in message */
+			buf[j] = 0 == o ? prefix : data[o - 1];
+		}
+		buf[rem] = 0x01;
+		poke_le64(&buf[rem < 56 ? 56 : TIGER_BLEN + 56], total << 3);
+
+		for (k = 0; k < 8; k++)
+			x[k] = peek_le64(&buf[TIGER_BLEN * (i - full) + 8 * k]);
+	}
+}
+
+/**
+ * Compute the Tiger hash of the ``prefix'' byte followed by ``len'' bytes
+ * from ``data''.
+ */
+void
+tiger_prefixed(uint8 prefix, const void *data, uint64 len, char hash[24])
+{
+	uint64 i, n, state[3], x[8];
+
+	tiger_state_init(state);
+	n = tiger_block_count(len + 1);
+
+	for (i = 0; i < n; i++) {
+		tiger_prefixed_load(prefix, data, len, i, x);
+		tiger_compress(x, state);
+	}
+
+	for (i = 0; i < 3; i++)
+		poke_le64(&hash[i * 8], state[i]);
+}
+
+#ifdef TIGER_X86_KERNELS
+/**
+ * AVX2 kernel computing tiger_prefixed() on TIGER_LANES messages at once.
+ *
+ * Each 64-bit lane of the vector registers holds the state of one message.
+ * There is no 64-bit multiplication in AVX2 but the multipliers are small
+ * enough to be computed with shifts.
+ */
+static void G_HOT TIGER_TARGET_AVX2
+tiger_prefixed_avx2(uint8 prefix, const void *data[TIGER_LANES],
+	uint64 len, char *hash)
+{
+	const __m256i mask = _mm256_set1_epi64x(0xFF);
+	__m256i a, b, c, aa, bb, cc, x[8];
+	uint64 i, n, w[TIGER_LANES][8], out[TIGER_LANES];
+	uint64 state[3];
+	uint k, l;
+
+#define ADD(u, v)		_mm256_add_epi64((u), (v))
+#define SUB(u, v)		_mm256_sub_epi64((u), (v))
+#define XOR(u, v)		_mm256_xor_si256((u), (v))
+#define NOT(u)			XOR((u), _mm256_set1_epi64x(-1))
+#define SBOX(t, v, s) \
+	_mm256_i64gather_epi64((const long long *) (t), \
+		_mm256_and_si256(_mm256_srli_epi64((v), (s)), mask), 8)
+
+#define MUL(v, mul) \
+	(5 == (mul) ? ADD(_mm256_slli_epi64((v), 2), (v)) : \
+	 7 == (mul) ? SUB(_mm256_slli_epi64((v), 3), (v)) : \
+	 ADD(_mm256_slli_epi64((v), 3), (v)))
+
+#define VROUND(a, b, c, x, mul) \
+	c = XOR(c, x); \
+	a = SUB(a, XOR(XOR(SBOX(t1, c, 0), SBOX(t2, c, 16)), \
+		XOR(SBOX(t3, c, 32), SBOX(t4, c, 48)))); \
+	b = ADD(b, XOR(XOR(SBOX(t4, c, 8), SBOX(t3, c, 24)), \
+		XOR(SBOX(t2, c, 40), SBOX(t1, c, 56)))); \
+	b = MUL(b, mul);
+
+#define VPASS(a, b, c, mul) \
+	VROUND(a, b, c, x[0], mul) \
+	VROUND(b, c, a, x[1], mul) \
+	VROUND(c, a, b, x[2], mul) \
+	VROUND(a, b, c, x[3], mul) \
+	VROUND(b, c, a, x[4], mul) \
+	VROUND(c, a, b, x[5], mul) \
+	VROUND(a, b, c, x[6], mul) \
+	VROUND(b, c, a, x[7], mul)
+
+#define VKEY_SCHEDULE \
+	x[0] = SUB(x[0], XOR(x[7], _mm256_set1_epi64x( \
+		U64_FROM_2xU32(0xA5A5A5A5UL, 0xA5A5A5A5UL)))); \
+	x[1] = XOR(x[1], x[0]); \
+	x[2] = ADD(x[2], x[1]); \
+	x[3] = SUB(x[3], XOR(x[2], _mm256_slli_epi64(NOT(x[1]), 19))); \
+	x[4] = XOR(x[4], x[3]); \
+	x[5] = ADD(x[5], x[4]); \
+	x[6] = SUB(x[6], XOR(x[5], _mm256_srli_epi64(NOT(x[4]), 23))); \
+	x[7] = XOR(x[7], x[6]); \
+	x[0] = ADD(x[0], x[7]); \
+	x[1] = SUB(x[1], XOR(x[0], _mm256_slli_epi64(NOT(x[7]), 19))); \
+	x[2] = XOR(x[2], x[1]); \
+	x[3] = ADD(x[3], x[2]); \
+	x[4] = SUB(x[4], XOR(x[3], _mm256_srli_epi64(NOT(x[2]), 23))); \
+	x[5] = XOR(x[5], x[4]); \
+	x[6] = ADD(x[6], x[5]); \
+	x[7] = SUB(x[7], XOR(x[6], _mm256_set1_epi64x( \
+		U64_FROM_2xU32(0x01234567UL, 0x89ABCDEFUL))));
+
+	STATIC_ASSERT(3 == PASSES);		/* Unrolled below */
+
+	tiger_state_init(state);
+	a = _mm256_set1_epi64x(state[0]);
+	b = _mm256_set1_epi64x(state[1]);
+	c = _mm256_set1_epi64x(state[2]);
+	n = tiger_block_count(len + 1);
+
+	for (i = 0; i < n; i++) {
+		for (l = 0; l < TIGER_LANES; l++)
+			tiger_prefixed_load(prefix, data[l], len, i, w[l]);
+
+		for (k = 0; k < 8; k++)
+			x[k] = _mm256_setr_epi64x(w[0][k], w[1][k], w[2][k], w[3][k]);
+
+		aa = a;
+		bb = b;
+		cc = c;
+
+		VPASS(a, b, c, 5)
+		VKEY_SCHEDULE
+		VPASS(c, a, b, 7)
+		VKEY_SCHEDULE
+		VPASS(b, c, a, 9)
+
+		a = XOR(a, aa);
+		b = SUB(b, bb);
+		c = ADD(c, cc);
+	}
+
+#undef ADD
+#undef SUB
+#undef XOR
+#undef NOT
+#undef SBOX
+#undef MUL
+#undef VROUND
+#undef VPASS
+#undef VKEY_SCHEDULE
+
+	x[0] = a;
+	x[1] = b;
+	x[2] = c;
+
+	for (k = 0; k < 3; k++) {
+		_mm256_storeu_si256((__m256i *) out, x[k]);
+		for (l = 0; l < TIGER_LANES; l++)
+			poke_le64(&hash[l * 24 + k * 8], out[l]);
+	}
+}
+
+/**
+ * @return whether the CPU supports AVX2.
+ */
+static bool
+tiger_has_avx2(void)
+{
+	static int avx2 = -1;
+
+	/*
+	 * Concurrent threads may probe the CPU at the same time, but they will
+	 * all reach the same conclusion.
+	 */
+
+	if G_UNLIKELY(-1 == avx2)
+		avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+
+	return 1 == avx2;
+}
+#endif	/* TIGER_X86_KERNELS */
+
+/**
+ * Compute tiger_prefixed() on ``n'' messages of the same length, using the
+ * multi-message kernel when the CPU supports it.
+ *
+ * @param prefix	the byte prefixing each message
+ * @param data		the ``n'' messages to hash
+ * @param len		length of each message, not counting the prefix
+ * @param n			amount of messages
+ * @param hash		where the ``n'' consecutive 24-byte digests are written
+ */
+void
+tiger_prefixed_multi(uint8 prefix, const void *data[], uint64 len, size_t n,
+	void *hash)
+{
+	char *h = hash;
+	size_t i = 0;
+
+#ifdef TIGER_X86_KERNELS
+	if (tiger_has_avx2()) {
+		for (/**/; i + TIGER_LANES <= n; i += TIGER_LANES)
+			tiger_prefixed_avx2(prefix, &data[i], len, &h[i * 24]);
+	}
+#endif
+
+	for (/**/; i < n; i++)
+		tiger_prefixed(prefix, data[i], len, &h[i * 24]);
+}
+
 /**
  * Runs some test cases to check whether the implementation of the tiger
  * hash algorithm is alright.
@@ -262,9 +543,11 @@ tiger_check(void)
 	uint i;
 
 	for (i = 0; i < N_ITEMS(tests); i++) {
-		char hash[24];
+		char hash[24], multi[5][24];
+		const void *data[N_ITEMS(multi)];
 		char buf[40];
 		bool ok;
+		uint j;
 
 		ZERO(&buf);
 		tiger(tests[i].s, tests[i].len, hash);
@@ -276,6 +559,25 @@ tiger_check(void)
 			g_warning("i=%u, buf=\"%s\"", i, buf);
 			g_assert_not_reached();
 		}
+
+		/*
+		 * Check the prefixed variants, used by the Tiger Tree, which must
+		 * compute the same digest when the first byte is the prefix.
+		 */
+
+		tiger_prefixed(tests[i].s[0], &tests[i].s[1], tests[i].len - 1, buf);
+		g_assert_log(0 == memcmp(hash, buf, sizeof hash), "i=%u", i);
+
+		for (j = 0; j < N_ITEMS(data); j++)
+			data[j] = &tests[i].s[1];
+
+		tiger_prefixed_multi(tests[i].s[0], data, tests[i].len - 1,
+			N_ITEMS(data), multi);
+
+		for (j = 0; j < N_ITEMS(multi); j++) {
+			g_assert_log(0 == memcmp(hash, multi[j], sizeof hash),
+				"i=%u, j=%u", i, j);
+		}
 	}
 }
 
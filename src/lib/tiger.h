@@ -38,6 +38,9 @@
 
 void tiger_check(void);
 void tiger(const void *data, uint64 length, char hash[24]);
+void tiger_prefixed(uint8 prefix, const void *data, uint64 len, char hash[24]);
+void tiger_prefixed_multi(uint8 prefix, const void *data[], uint64 len,
+	size_t n, void *hash);
 
 #endif /* _tiger_h_ */
 /* vi: set ts=4 sw=4 cindent: */
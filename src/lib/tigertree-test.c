@@ -0,0 +1,224 @@
+/*
+ * tigertree-test -- parallel Tiger tree hashing tests.
+ *
+ * Copyright (c) 2026 gtk-gnutella developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include "common.h"
+
+#include "atoms.h"
+#include "misc.h"
+#include "parse.h"
+#include "pow2.h"
+#include "progname.h"
+#include "random.h"
+#include "tigertree.h"
+#include "xmalloc.h"
+
+#define COUNT		50			/* Default amount of inputs hashed */
+#define SIZE_MAX_KB	4096		/* Default maximum input size, in KiB */
+#define THREADS		8			/* Default amount of hashing threads */
+
+static bool verbose;
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-hv] [-n count] [-s KiB] [-t threads]\n"
+		"  -h : prints this help message\n"
+		"  -n : amount of random inputs to hash (default %u)\n"
+		"  -s : maximum input size, in KiB (default %u)\n"
+		"  -t : amount of threads for parallel hashing (default %u)\n"
+		"  -v : verbose mode\n"
+		, getprogname(), COUNT, SIZE_MAX_KB, THREADS);
+	exit(EXIT_FAILURE);
+}
+
+static unsigned
+get_number(const char *arg, int opt)
+{
+	int error;
+	uint32 val;
+
+	val = parse_v32(arg, NULL, &error);
+	if (0 == val && error != 0) {
+		fprintf(stderr, "%s: invalid -%c argument \"%s\": %s\n",
+			getprogname(), opt, arg, english_strerror(error));
+		exit(EXIT_FAILURE);
+	}
+
+	return val;
+}
+
+/**
+ * Pick a random input length, up to max bytes.
+ *
+ * A quarter of the lengths are a multiple of the block size, and another
+ * quarter are a power of two amount of blocks, to exercise complete subtrees.
+ */
+static size_t
+random_length(size_t max)
+{
+	size_t blocks = max / TTH_BLOCKSIZE;
+
+	switch (random_value(3)) {
+	case 0:
+		return random_value(blocks) * TTH_BLOCKSIZE;
+	case 1:
+		return MIN(max, ((size_t) 1 << random_value(highest_bit_set(blocks)))
+			* TTH_BLOCKSIZE);
+	default:
+		return random_ulong_value(max);
+	}
+}
+
+/**
+ * Hash data, feeding it in random chunks when chunked is set.
+ *
+ * @return the amount of leaves, copied into the supplied array.
+ */
+static size_t
+hash(TTH_CONTEXT *ctx, const char *data, size_t len, unsigned threads,
+	bool chunked, struct tth *root, struct tth *leaves)
+{
+	size_t n, off = 0;
+
+	tt_init(ctx, len);
+	if (threads > 1)
+		tt_set_threads(ctx, threads);
+
+	while (off < len) {
+		n = len - off;
+
+		/*
+		 * Starting with a few bytes leaves pending data in the context,
+		 * so that the next chunks are not aligned on blocks.
+		 */
+
+		if (chunked)
+			n = 0 == off ? MIN(n, random_value(3)) : random_ulong_value(n);
+
+		if (n != 0)
+			tt_update(ctx, &data[off], n);
+		off += n;
+	}
+
+	tt_digest(ctx, root);
+	n = tt_leave_count(ctx);
+	memcpy(leaves, tt_leaves(ctx), n * sizeof leaves[0]);
+
+	return n;
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	int c;
+	unsigned i, count = COUNT, threads = THREADS, max_kb = SIZE_MAX_KB;
+	size_t max;
+	char *data;
+	TTH_CONTEXT *ctx;
+	struct tth *leaves[2];
+	const char options[] = "hn:s:t:v";
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'n':			/* amount of inputs */
+			count = get_number(optarg, c);
+			break;
+		case 's':			/* maximum input size */
+			max_kb = get_number(optarg, c);
+			break;
+		case 't':			/* amount of threads */
+			threads = get_number(optarg, c);
+			break;
+		case 'v':			/* verbose mode */
+			verbose = TRUE;
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0 || 0 == max_kb || threads < 2)
+		usage();
+
+	tt_check();
+
+	max = (size_t) max_kb * 1024;
+	data = xmalloc(max);
+	random_bytes(data, max);
+	ctx = xmalloc(tt_size());
+	XMALLOC_ARRAY(leaves[0], TTH_MAX_LEAVES);
+	XMALLOC_ARRAY(leaves[1], TTH_MAX_LEAVES);
+
+	for (i = 0; i < count; i++) {
+		size_t len = random_length(max);
+		bool chunked = random_value(1);
+		struct tth root[2];
+		size_t n[2];
+
+		n[0] = hash(ctx, data, len, 1, FALSE, &root[0], leaves[0]);
+		n[1] = hash(ctx, data, len, threads, chunked, &root[1], leaves[1]);
+
+		if (verbose) {
+			printf("%zu bytes%s: %s, %zu leaves\n",
+				len, chunked ? " (chunked)" : "", tth_base32(&root[0]), n[0]);
+		}
+
+		g_assert_log(tth_eq(&root[0], &root[1]),
+			"%zu bytes%s: sequential root %s, parallel root %s",
+			len, chunked ? " (chunked)" : "",
+			tth_base32(&root[0]), tth_base32(&root[1]));
+		g_assert_log(n[0] == n[1],
+			"%zu bytes: sequential has %zu leaves, parallel has %zu",
+			len, n[0], n[1]);
+		g_assert_log(0 == memcmp(leaves[0], leaves[1], n[0] * sizeof root[0]),
+			"%zu bytes: leaves differ", len);
+	}
+
+	XFREE_NULL(leaves[0]);
+	XFREE_NULL(leaves[1]);
+	XFREE_NULL(ctx);
+	XFREE_NULL(data);
+
+	printf("All OK!\n");
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
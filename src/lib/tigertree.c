@@ -80,11 +80,19 @@
 
 #include "tigertree.h"
 
+#include "aq.h"
 #include "base32.h"
+#include "cond.h"
 #include "endian.h"
 #include "halloc.h"
+#include "log.h"
 #include "misc.h"
+#include "mutex.h"
+#include "once.h"
+#include "pow2.h"
+#include "thread.h"
 #include "unsigned.h"
+#include "xmalloc.h"
 
 #include "override.h"		/* Must be the last header included */
 
@@ -97,6 +105,30 @@
  * longer than 2^64 in size), havoc may ensue. */
 #define TTH_STACKSIZE	(TIGERSIZE * 56)
 
+/* amount of leaves hashed per tiger_prefixed_multi() call */
+#define TTH_MULTI_LEAVES	64
+
+/* maximum amount of threads used to hash a single input */
+#define TTH_THREAD_MAX		16
+
+/* minimum amount of blocks per thread, as log2, for parallel hashing */
+#define TTH_THREAD_LEVEL	8
+
+/* stack size requested for each hashing thread */
+#define TTH_THREAD_STACK	THREAD_STACK_MIN
+
+/*
+ * Parallel hashing is handled by a pool of threads shared by all the
+ * contexts, created on demand and kept around afterwards.  The work to do
+ * is queued and each batch records how many pieces remain to be processed.
+ */
+static aqueue_t *tt_requests;		/* work queued for the hashing threads */
+static once_flag_t tt_pool_inited;
+static mutex_t tt_pool_mtx = MUTEX_INIT;
+static unsigned tt_pool_count;		/* amount of hashing threads created */
+static mutex_t tt_done_mtx = MUTEX_INIT;
+static cond_t tt_done = COND_INIT;	/* signaled when a batch is completed */
+
 enum {
 	TTH_F_INITIALIZED	= 1 << 0,
 	TTH_F_FINISHED		= 1 << 1
@@ -110,6 +142,7 @@ struct TTH_CONTEXT {
 	unsigned li;         	/* current leave index */
 	unsigned depth;			/* current tree depth */
 	unsigned good_depth;	/* the desired depth of the final leaves */
+	unsigned threads;		/* amount of threads to use */
 	unsigned flags;
 	union {
 		uint64 u64;	/* Better alignment */
@@ -280,15 +313,19 @@ tt_compose(TTH_CONTEXT *ctx)
     ctx->si--;
 }
 
+/**
+ * Compose the nodes on the stack after a subtree covering 2^level blocks
+ * was pushed.
+ */
 static void
-tt_collapse(TTH_CONTEXT *ctx)
+tt_collapse(TTH_CONTEXT *ctx, unsigned level)
 {
 	filesize_t n, x;
 
 	g_assert(ctx);
 
-	x = ctx->bpl;
-	n = ctx->n;
+	x = ctx->bpl >> level;
+	n = ctx->n >> level;
 	while (0 == (n & 1)) {
 		tt_compose(ctx);
 		n /= 2;
@@ -301,27 +338,308 @@ tt_collapse(TTH_CONTEXT *ctx)
 	}
 }
 
+/**
+ * Push the root of a complete subtree covering 2^level blocks, the amount
+ * of blocks already processed being a multiple of that.
+ */
 static void
-tt_block(TTH_CONTEXT *ctx)
+tt_push(TTH_CONTEXT *ctx, const struct tth *node, unsigned level)
 {
+	filesize_t blocks = (filesize_t) 1 << level;
+
 	g_assert(ctx);
+	g_assert(0 == ctx->n % blocks);
+	g_assert(ctx->si < N_ITEMS(ctx->stack));
 
-	tiger(ctx->block.bytes, ctx->block_fill, ctx->stack[ctx->si].data);
-	if (ctx->bpl == 1) {
-		ctx->leaves[ctx->li] = ctx->stack[ctx->si];
+	ctx->stack[ctx->si] = *node;
+	if (ctx->bpl == blocks) {
+		g_assert(ctx->li < N_ITEMS(ctx->leaves));
+		ctx->leaves[ctx->li] = *node;
 		ctx->li++;
 	}
 
-	ctx->block_fill = 1;
-
 	ctx->si++;
-	ctx->n++;
+	ctx->n += blocks;
 
-	if (ctx->n > (1U << ctx->depth)) {
+	while (ctx->n > ((filesize_t) 1 << ctx->depth)) {
 		ctx->depth++;
 	}
 
-	tt_collapse(ctx);
+	tt_collapse(ctx, level);
+}
+
+static void
+tt_block(TTH_CONTEXT *ctx)
+{
+	struct tth leaf;
+
+	g_assert(ctx);
+
+	tiger(ctx->block.bytes, ctx->block_fill, leaf.data);
+	ctx->block_fill = 1;
+	tt_push(ctx, &leaf, 0);
+}
+
+/**
+ * Hash complete blocks, without copying them to a buffer to prefix them.
+ *
+ * @param data		the start of the first block
+ * @param blocks	amount of blocks to hash
+ * @param dst		where the leaf hashes are written
+ */
+static void
+tt_leaves_hash(const char *data, size_t blocks, struct tth *dst)
+{
+	const void *ptr[TTH_MULTI_LEAVES];
+
+	STATIC_ASSERT(TIGERSIZE == sizeof dst[0]);
+
+	while (blocks != 0) {
+		size_t i, n = MIN(blocks, N_ITEMS(ptr));
+
+		for (i = 0; i < n; i++)
+			ptr[i] = &data[i * TTH_BLOCKSIZE];
+
+		tiger_prefixed_multi(0x00, ptr, TTH_BLOCKSIZE, n, dst);
+
+		data += n * TTH_BLOCKSIZE;
+		dst += n;
+		blocks -= n;
+	}
+}
+
+/**
+ * Process complete blocks directly from the data, when there is no pending
+ * data in the context block buffer.
+ *
+ * @return the amount of blocks processed.
+ */
+static size_t
+tt_blocks(TTH_CONTEXT *ctx, const char *data, size_t blocks)
+{
+	struct tth leaves[TTH_MULTI_LEAVES];
+	size_t i, n = MIN(blocks, N_ITEMS(leaves));
+
+	g_assert(1 == ctx->block_fill);
+
+	tt_leaves_hash(data, n, leaves);
+
+	for (i = 0; i < n; i++)
+		tt_push(ctx, &leaves[i], 0);
+
+	return n;
+}
+
+/**
+ * A batch of work handed to the hashing threads.
+ */
+struct tt_batch {
+	unsigned pending;		/* pieces still processed, under tt_done_mtx */
+};
+
+/**
+ * Work given to each thread during parallel hashing: a set of contiguous
+ * subtrees covering 2^level blocks each.
+ */
+struct tt_work {
+	struct tt_batch *batch;	/* batch to which this piece belongs */
+	const char *data;		/* first block of first subtree */
+	struct tth *roots;		/* where the subtree roots are written */
+	struct tth *leaves;		/* where the leaves are written, NULL if none */
+	size_t count;			/* amount of subtrees */
+	unsigned level;			/* log2 of the amount of blocks per subtree */
+	unsigned leaf_level;	/* level of the leaves we have to keep */
+};
+
+/**
+ * Compute the root of the subtrees assigned to a thread, along with the
+ * leaves they contain when these are below the subtree roots.
+ */
+static void
+tt_subtree_work(struct tt_work *w)
+{
+	size_t i, blocks = (size_t) 1 << w->level;
+	size_t per = NULL == w->leaves ? 0 : blocks >> w->leaf_level;
+	struct tth *buf;
+
+	XMALLOC_ARRAY(buf, blocks);
+
+	for (i = 0; i < w->count; i++) {
+		size_t n = blocks;
+		unsigned l;
+
+		tt_leaves_hash(&w->data[i * blocks * TTH_BLOCKSIZE], n, buf);
+
+		for (l = 0; l < w->level; l++) {
+			if (per != 0 && l == w->leaf_level)
+				memcpy(&w->leaves[i * per], buf, per * sizeof buf[0]);
+			n = tt_compute_parents(buf, buf, n);
+		}
+
+		g_assert(1 == n);
+		w->roots[i] = buf[0];
+	}
+
+	xfree(buf);
+}
+
+/**
+ * A hashing thread, processing the work queued by tt_blocks_parallel().
+ */
+static void *
+tt_pool_thread(void *unused_arg)
+{
+	(void) unused_arg;
+
+	thread_set_name("TTH hashing");
+
+	for (;;) {
+		struct tt_work *w = aq_remove(tt_requests);
+		struct tt_batch *b = w->batch;
+
+		tt_subtree_work(w);
+
+		mutex_lock(&tt_done_mtx);
+		g_assert(b->pending != 0);
+		if (0 == --b->pending)
+			cond_broadcast(&tt_done, &tt_done_mtx);
+		mutex_unlock(&tt_done_mtx);
+	}
+
+	return NULL;
+}
+
+static void
+tt_pool_init(void)
+{
+	tt_requests = aq_make();
+}
+
+/**
+ * Make sure there are at least n hashing threads in the pool.
+ *
+ * @return the amount of hashing threads available, which can be less than
+ * requested when threads cannot be created.
+ */
+static unsigned
+tt_pool_grow(unsigned n)
+{
+	unsigned count;
+
+	ONCE_FLAG_RUN(tt_pool_inited, tt_pool_init);
+
+	mutex_lock(&tt_pool_mtx);
+
+	while (tt_pool_count < n) {
+		int r = thread_create(tt_pool_thread, NULL,
+			THREAD_F_DETACH | THREAD_F_NO_CANCEL | THREAD_F_NO_POOL,
+			TTH_THREAD_STACK);
+
+		if G_UNLIKELY(-1 == r) {
+			s_warning_once_per(LOG_PERIOD_MINUTE,
+				"%s(): cannot create new thread: %m", G_STRFUNC);
+			break;
+		}
+
+		tt_pool_count++;
+	}
+
+	count = tt_pool_count;
+	mutex_unlock(&tt_pool_mtx);
+
+	return count;
+}
+
+/**
+ * Process complete blocks directly from the data by spreading the work
+ * among several threads, when there is no pending data in the context
+ * block buffer.
+ *
+ * The blocks are split into complete subtrees, aligned on the amount of
+ * blocks already processed.  The hashing threads of the pool compute the
+ * roots of these subtrees in parallel, which we then push on the stack.
+ *
+ * Each thread is given at least 2^TTH_THREAD_LEVEL blocks, so that small
+ * inputs are hashed by fewer threads, or by the calling thread only.
+ *
+ * @return the amount of blocks processed, 0 if there are not enough blocks
+ * to make it worth using threads.
+ */
+static size_t
+tt_blocks_parallel(TTH_CONTEXT *ctx, const char *data, size_t blocks)
+{
+	struct tt_work work[TTH_THREAD_MAX];
+	struct tt_batch batch;
+	unsigned threads, level, leaf_level, t;
+	size_t i, count, per;
+	struct tth *roots;
+
+	g_assert(1 == ctx->block_fill);
+	g_assert(ctx->threads > 1);
+
+	threads = MIN(ctx->threads, N_ITEMS(work));
+	threads = MIN(threads, blocks >> TTH_THREAD_LEVEL);
+
+	if (threads < 2)
+		return 0;
+
+	level = highest_bit_set64(blocks / threads);
+	if (ctx->n != 0)
+		level = MIN(level, (unsigned) ctz64(ctx->n));
+
+	if (level < TTH_THREAD_LEVEL)
+		return 0;
+
+	count = blocks >> level;
+	threads = MIN(threads, count);
+	threads = MIN(threads, 1 + tt_pool_grow(threads - 1));
+
+	if (threads < 2)
+		return 0;
+	leaf_level = highest_bit_set64(ctx->bpl);
+	per = leaf_level < level ? (size_t) 1 << (level - leaf_level) : 0;
+
+	g_assert(ctx->li + count * per <= N_ITEMS(ctx->leaves));
+
+	XMALLOC_ARRAY(roots, count);
+
+	for (t = 0; t < threads; t++) {
+		size_t start = count * t / threads;
+		struct tt_work *w = &work[t];
+
+		w->batch = &batch;
+		w->data = &data[(start << level) * TTH_BLOCKSIZE];
+		w->roots = &roots[start];
+		w->leaves = 0 == per ? NULL : &ctx->leaves[ctx->li + start * per];
+		w->count = count * (t + 1) / threads - start;
+		w->level = level;
+		w->leaf_level = leaf_level;
+	}
+
+	/*
+	 * The current thread processes the first share of the work whilst
+	 * the hashing threads process the others.
+	 */
+
+	batch.pending = threads - 1;
+
+	for (t = 1; t < threads; t++)
+		aq_put(tt_requests, &work[t]);
+
+	tt_subtree_work(&work[0]);
+
+	mutex_lock(&tt_done_mtx);
+	while (batch.pending != 0)
+		cond_wait_clean(&tt_done, &tt_done_mtx);
+	mutex_unlock(&tt_done_mtx);
+
+	for (i = 0; i < count; i++) {
+		ctx->li += per;
+		tt_push(ctx, &roots[i], level);
+	}
+
+	xfree(roots);
+	return count << level;
 }
 
 static void
@@ -415,9 +733,27 @@ tt_init(TTH_CONTEXT *ctx, filesize_t filesize)
 	ctx->bpl = tt_blocks_per_leaf(filesize);
 	ctx->depth = 0;
 	ctx->good_depth = tt_good_depth(filesize);
+	ctx->threads = 1;
 	ctx->flags = TTH_F_INITIALIZED;
 }
 
+/**
+ * Set the amount of threads that can be used to hash the data given to
+ * tt_update(), for large inputs.
+ *
+ * This must be called after tt_init(), which resets the context to use
+ * the calling thread only.
+ */
+void
+tt_set_threads(TTH_CONTEXT *ctx, unsigned n)
+{
+	g_assert(ctx);
+	g_assert(TTH_F_INITIALIZED & ctx->flags);
+	g_assert(n != 0);
+
+	ctx->threads = MIN(n, TTH_THREAD_MAX);
+}
+
 void
 tt_update(TTH_CONTEXT *ctx, const void *data, size_t size)
 {
@@ -429,8 +765,27 @@ tt_update(TTH_CONTEXT *ctx, const void *data, size_t size)
 	g_assert(size == 0 || NULL != data);
 
 	while (size > 0) {
-		size_t n = sizeof ctx->block.bytes - ctx->block_fill;
+		size_t n;
+
+		/*
+		 * When there are no pending data, complete blocks are hashed
+		 * directly from the supplied buffer, possibly by several threads.
+		 */
+
+		if (1 == ctx->block_fill && size >= TTH_BLOCKSIZE) {
+			size_t blocks = 0;
+
+			if (ctx->threads > 1)
+				blocks = tt_blocks_parallel(ctx, block, size / TTH_BLOCKSIZE);
+			if (0 == blocks)
+				blocks = tt_blocks(ctx, block, size / TTH_BLOCKSIZE);
+
+			block += blocks * TTH_BLOCKSIZE;
+			size -= blocks * TTH_BLOCKSIZE;
+			continue;
+		}
 
+		n = sizeof ctx->block.bytes - ctx->block_fill;
 		n = MIN(n, size);
 		memmove(&ctx->block.bytes[ctx->block_fill], block, n);
 		ctx->block_fill += n;
@@ -78,6 +78,10 @@
 #include "thread.h"				/* For thread_assert_no_locks() */
 #include "walloc.h"
 
+#ifdef HAS_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 #include "override.h"			/* Must be the last header included */
 
 enum waiter_magic {
@@ -105,7 +109,7 @@ struct waiter {
 struct mwaiter {
 	struct waiter waiter;
 	/* Extra fields for the master */
-	socket_fd_t wfd[2];			/* Socket-pair used for waiting / signalling */
+	socket_fd_t wfd[2];			/* Channel used for waiting / signalling */
 	uint m_notified:1;			/* Notification sent on the pipe */
 	uint m_blocking:1;			/* One thread is blocked reading the pipe */
 	size_t children;			/* Amount of children, for assertions */
@@ -150,12 +154,65 @@ cast_to_mwaiter(const struct waiter *w)
 
 #define MWAITER_LOCK_IS_HELD(m)	spinlock_is_held(&(m)->lock)
 
-#ifdef HAS_SOCKETPAIR
+/*
+ * The notification channel is an eventfd() when available: a single file
+ * descriptor is then used for both reading and writing, and signaling does
+ * not need to go through the socket layer.  Otherwise, we use a socketpair()
+ * or a pipe().
+ */
+#if defined(HAS_EVENTFD)
+#define INVALID_FD		-1
+#elif defined(HAS_SOCKETPAIR)
 #define INVALID_FD		INVALID_SOCKET
 #else
 #define INVALID_FD		-1
 #endif
 
+/**
+ * Post a notification on the master waiter's channel.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+static int
+waiter_channel_post(const struct mwaiter *mw)
+{
+#ifdef HAS_EVENTFD
+	return eventfd_write(mw->wfd[1], 1);
+#else
+	char c = '\0';
+
+	/*
+	 * Portability note: we use s_write() here, even though we could be using
+	 * a pipe if there is no socketpair()...  However, s_write() only exists
+	 * for Windows, and on UNIX s_write() is transparently remapped to write().
+	 * Given that on Windows we have socketpair(), because we emulate it, it is
+	 * completely safe to use s_write().
+	 */
+
+	return -1 == s_write(mw->wfd[1], &c, 1) ? -1 : 0;
+#endif	/* HAS_EVENTFD */
+}
+
+/**
+ * Consume the notification from the master waiter's channel, blocking
+ * if none was posted yet.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+static int
+waiter_channel_consume(const struct mwaiter *mw)
+{
+#ifdef HAS_EVENTFD
+	eventfd_t value;
+
+	return eventfd_read(mw->wfd[0], &value);
+#else
+	char c;
+
+	return -1 == s_read(mw->wfd[0], &c, 1) ? -1 : 0;
+#endif	/* HAS_EVENTFD */
+}
+
 /**
  * Create a new asynchronous master waiter.
  *
@@ -230,19 +287,24 @@ waiter_close_master_fd(struct mwaiter *mw)
 {
 	g_assert(MWAITER_LOCK_IS_HELD(mw));
 
-#ifdef HAS_SOCKETPAIR
+#if defined(HAS_EVENTFD)
+	if (-1 != mw->wfd[0]) {
+		fd_close(&mw->wfd[0]);
+		mw->wfd[1] = -1;		/* Was the same file descriptor */
+	}
+#elif defined(HAS_SOCKETPAIR)
 	if (INVALID_SOCKET != mw->wfd[0]) {
 		s_close(mw->wfd[0]);
 		s_close(mw->wfd[1]);
 		mw->wfd[0] = INVALID_SOCKET;
 		mw->wfd[1] = INVALID_SOCKET;
 	}
-#else	/* !HAS_SOCKETPAIR */
+#else	/* !HAS_EVENTFD && !HAS_SOCKETPAIR */
 	if (-1 != mw->wfd[0]) {
 		fd_close(&mw->wfd[0]);
 		fd_close(&mw->wfd[1]);
 	}
-#endif	/* HAS_SOCKETPAIR */
+#endif	/* HAS_EVENTFD */
 }
 
 /**
@@ -348,10 +410,9 @@ waiter_signal_internal(struct mwaiter *mw, waiter_t *w)
 		elist_append(&mw->active, w);
 	}
 	if (!mw->m_notified) {
-		char c = '\0';
 		if G_UNLIKELY(INVALID_FD == mw->wfd[0]) {
 			mw->m_notified = TRUE;
-		} else if G_UNLIKELY(-1 == s_write(mw->wfd[1], &c, 1)) {
+		} else if G_UNLIKELY(-1 == waiter_channel_post(mw)) {
 			s_minicarp("%s(): cannot notify about event: %m", G_STRFUNC);
 		} else {
 			mw->m_notified = TRUE;
@@ -471,8 +532,7 @@ waiter_master_clear(struct mwaiter *mw)
 	g_assert(spinlock_is_held(&mw->lock));
 
 	if (mw->m_notified) {
-		char c;
-		if G_UNLIKELY(-1 == s_read(mw->wfd[0], &c, 1)) {
+		if G_UNLIKELY(-1 == waiter_channel_consume(mw)) {
 			s_minicarp("%s(): cannot acknowledge event: %m", G_STRFUNC);
 		} else {
 			mw->m_notified = FALSE;
@@ -536,7 +596,7 @@ waiter_ack(waiter_t *w)
 
 	/*
 	 * Regardless, clear notification information on the master waiter if
-	 * a signal was sent on the notification channel (pipe or socketpair).
+	 * a signal was sent on the notification channel (eventfd, pipe, socketpair).
 	 */
 
 	waiter_master_clear(mw);
@@ -596,13 +656,17 @@ waiter_fd(const waiter_t *w)
 	 * Of course, since we use sockets we need to use s_read() and s_write()
 	 * as well, again for our friend Windows.
 	 *
-	 * FIXME:
-	 * On Linux, we could use eventfd() to save one file descriptor?  Will
-	 * need a new metaconfig unit.  Only the master waiter needs a file
-	 * descriptor, and we won't have many, so it's not a big win.
+	 * On Linux, we use eventfd() which saves one file descriptor and lets
+	 * the kernel coalesce notifications in a counter.
 	 */
 
-#ifdef HAS_SOCKETPAIR
+#if defined(HAS_EVENTFD)
+	mw->wfd[0] = eventfd(0, 0);
+	if (-1 == mw->wfd[0])
+		s_error("%s(): eventfd() failed: %m", G_STRFUNC);
+	mw->wfd[1] = mw->wfd[0];
+	fd_set_close_on_exec(mw->wfd[0]);
+#elif defined(HAS_SOCKETPAIR)
 	if (-1 == socketpair(AF_LOCAL, SOCK_STREAM, 0, mw->wfd))
 		s_error("%s(): socketpair() failed: %m", G_STRFUNC);
 #else
@@ -623,17 +687,8 @@ waiter_fd(const waiter_t *w)
 done:
 	MWAITER_UNLOCK(mw);
 
-	/*
-	 * Portability note: we use s_write() here, even though we could be using
-	 * a pipe if there is no socketpair()...  However, s_write() only exists
-	 * for Windows, and on UNIX s_write() is transparently remapped to write().
-	 * Given that on Windows we have socketpair(), because we emulate it, it is
-	 * completely safe to use s_write().
-	 */
-
 	if (need_event) {
-		char c = '\0';
-		if G_UNLIKELY(-1 == s_write(mw->wfd[1], &c, 1)) {
+		if G_UNLIKELY(-1 == waiter_channel_post(mw)) {
 			s_minicarp("%s(): cannot notify ourselves about pending event: %m",
 				G_STRFUNC);
 		}
@@ -732,7 +787,6 @@ bool
 waiter_suspend(const waiter_t *w)
 {
 	struct mwaiter *mw;
-	char c;
 	bool allowed = TRUE;
 
 	waiter_check(w);
@@ -774,7 +828,7 @@ waiter_suspend(const waiter_t *w)
 
 	thread_assert_no_locks(G_STRFUNC);
 
-	if G_UNLIKELY(-1 == s_read(mw->wfd[0], &c, 1)) {
+	if G_UNLIKELY(-1 == waiter_channel_consume(mw)) {
 		s_minicarp("%s(): could not receive event: %m", G_STRFUNC);
 		MWAITER_LOCK_QUICK(mw);
 		mw->m_blocking = FALSE;
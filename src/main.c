@@ -100,6 +100,7 @@
 #include "core/uhc.h"
 #include "core/upload_stats.h"
 #include "core/urpc.h"
+#include "core/verify_bitprint.h"
 #include "core/verify_sha1.h"
 #include "core/verify_tth.h"
 #include "core/version.h"
@@ -720,6 +721,7 @@ gtk_gnutella_exit(int exit_code)
 	DO(parq_close_pre);
 	DO(verify_sha1_close);
 	DO(verify_tth_shutdown);
+	DO(verify_bitprint_shutdown);
 	DO(download_close);
 	DO(file_info_store_if_dirty);	/* In case downloads had buffered data */
 	DO(parq_close);
@@ -983,6 +985,7 @@ gtk_gnutella_exit(int exit_code)
 	DO(misc_close);
 	DO(mingw_close);
 	DO(verify_tth_close);
+	DO(verify_bitprint_close);
 	DO(inputevt_close);
 	DO(locale_close);
 	DO(wq_close);
@@ -2536,6 +2539,7 @@ main(int argc, char **argv)
 	gwc_init();
 	verify_sha1_init();
 	verify_tth_init();
+	verify_bitprint_init();
 	move_init();
 	ignore_init();
 	pattern_init();
@@ -2551,6 +2555,7 @@ main(int argc, char **argv)
     hcache_retrieve_all();	/* after settings_init() and node_init() */
 	routing_init();
 	search_init();
+	crc_init();			/* before share_init() */
 	share_init();
 	dmesh_init();			/* MUST be done BEFORE download_init() */
 	download_init();		/* MUST be done AFTER file_info_init() */
@@ -2560,7 +2565,6 @@ main(int argc, char **argv)
 	whitelist_init();
 	ext_init();
 	inet_init();
-	crc_init();
 	parq_init();
 	hsep_init();
 	clock_init();
@@ -0,0 +1,812 @@
+/*
+ * sdbm - ndbm work-alike hashed database library
+ *
+ * Background flushing of dirty pages.
+ * author: gtk-gnutella developers
+ * status: public domain.
+ *
+ * When enabled on a database, synchronizing the LRU cache no longer writes
+ * the dirty pages from the calling thread.  Instead, the dirty pages are
+ * copied into a batch which is handed over to a dedicated writer thread,
+ * the pages being marked as clean in the cache.  The application can then
+ * resume its processing whilst the kernel is busy writing the pages.
+ *
+ * Because the batch holds snapshots of the pages, the cached pages can be
+ * freely modified again whilst they are being written.  The only times the
+ * calling thread needs to wait for the writer are when it has to read back
+ * from disk a page that is not written yet, or when it has to write that
+ * page itself, to make sure the latest copy is the one that ends up on disk.
+ * These waits are accounted for as "stalls".
+ *
+ * There is only one batch per database: submitting a new batch before the
+ * previous one was completely written also stalls the caller.
+ *
+ * Other threads can also wait for a given batch to be written, for instance
+ * before synchronizing the database files: they hold a reference on the
+ * flusher so that it is not freed under their feet.
+ *
+ * @ingroup sdbm
+ * @file
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "sdbm.h"
+#include "tune.h"
+#include "bgflush.h"
+#include "private.h"
+
+#include "lib/compat_pio.h"
+#include "lib/cond.h"
+#include "lib/debug.h"
+#include "lib/halloc.h"
+#include "lib/iovec.h"
+#include "lib/log.h"
+#include "lib/mutex.h"
+#include "lib/spinlock.h"
+#include "lib/stringify.h"		/* For plural() */
+#include "lib/thread.h"
+#include "lib/tm.h"
+#include "lib/vmm.h"
+#include "lib/walloc.h"
+#include "lib/xsort.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#if defined(LRU) && defined(THREADS)
+
+#define BGFLUSH_IOV		32		/* Max amount of pages written at once */
+#define BGFLUSH_TIMEOUT	5		/* Max blocking time before checking, secs */
+
+/*
+ * Global statistics, across all the databases.
+ */
+static struct sdbm_bgflush_stats bgflush_stats;
+static spinlock_t bgflush_stats_slk = SPINLOCK_INIT;
+
+#define BGFLUSH_STATS_LOCK		spinlock_hidden(&bgflush_stats_slk)
+#define BGFLUSH_STATS_UNLOCK	spinunlock_hidden(&bgflush_stats_slk)
+
+/**
+ * A page in the batch.
+ */
+struct bgflush_slot {
+	long num;					/* Page number */
+	size_t idx;					/* Index of page snapshot in arena */
+	uint8 failed;				/* Writer could not write the page */
+};
+
+enum sdbm_bgflush_magic { SDBM_BGFLUSH_MAGIC = 0x3a1e08c5 };
+
+/**
+ * The background flusher.
+ *
+ * Fields marked "locked" are only accessed with the `lock' mutex held once
+ * the batch has been submitted.  Other fields are only updated by the
+ * thread owning the database lock, whilst no batch is submitted.
+ */
+struct bgflush {
+	enum sdbm_bgflush_magic magic;	/* Magic number */
+	DBM *db;					/* Database we're flushing */
+	struct bgflush_slot *slots;	/* Batch pages, sorted on submission */
+	char *arena;				/* Page snapshots */
+	size_t capacity;			/* Amount of pages we can hold in arena */
+	size_t count;				/* Amount of pages in batch */
+	size_t done;				/* Locked: amount of pages processed */
+	int fd;						/* File descriptor of .pag file */
+	int error;					/* Locked: first write error seen */
+	ulong seq;					/* Locked: sequence number of batch */
+	ulong completed;			/* Locked: last batch fully written */
+	ulong failed;				/* Locked: last batch with write errors */
+	uint64 waiters;				/* Locked: threads blocked, by small ID */
+	uint refcnt;				/* Locked: references held by other threads */
+	tm_t start;					/* Submission time of batch */
+	mutex_t lock;				/* Thread-safe lock */
+	cond_t event;				/* Signals new batch or exit request */
+	uint8 submitted;			/* Batch submitted to writer */
+	uint8 exiting;				/* Locked: writer thread must exit */
+	uint8 exited;				/* Locked: writer thread exited */
+	ulong pages;				/* Stats: amount of pages written */
+	ulong batches;				/* Stats: amount of batches written */
+	ulong stalls;				/* Stats: amount of stalls */
+	uint64 stall_us;			/* Stats: total stalling time, in usecs */
+	uint64 latency_us;			/* Stats: total batch latency, in usecs */
+	uint64 max_latency_us;		/* Stats: max batch latency, in usecs */
+};
+
+static inline void
+sdbm_bgflush_check(const struct bgflush * const bf)
+{
+	g_assert(bf != NULL);
+	g_assert(SDBM_BGFLUSH_MAGIC == bf->magic);
+}
+
+static inline const char *
+bgflush_page(const struct bgflush *bf, const struct bgflush_slot *s)
+{
+	return &bf->arena[s->idx * DBM_PBLKSIZ];
+}
+
+/**
+ * Write a contiguous run of pages from the batch.
+ *
+ * Called from the writer thread, without the lock held.
+ *
+ * @return TRUE if all the pages were written.
+ */
+static bool
+bgflush_write_run(const struct bgflush *bf, size_t from, size_t n)
+{
+	iovec_t iov[BGFLUSH_IOV];
+	size_t i, len = n * DBM_PBLKSIZ;
+	ssize_t w;
+
+	g_assert(n <= N_ITEMS(iov));
+
+	for (i = 0; i < n; i++) {
+		const char *pag = bgflush_page(bf, &bf->slots[from + i]);
+
+		iovec_set_base(&iov[i], deconstify_char(pag));
+		iovec_set_len(&iov[i], DBM_PBLKSIZ);
+	}
+
+	w = compat_pwritev(bf->fd, iov, n, OFF_PAG(bf->slots[from].num));
+
+	return UNSIGNED(w) == len;
+}
+
+/**
+ * Write a single page from the batch.
+ *
+ * @return TRUE if the page was written.
+ */
+static bool
+bgflush_write_page(const struct bgflush *bf, const struct bgflush_slot *s)
+{
+	ssize_t w;
+
+	w = compat_pwrite(bf->fd, bgflush_page(bf, s), DBM_PBLKSIZ,
+			OFF_PAG(s->num));
+
+	return DBM_PBLKSIZ == w;
+}
+
+/**
+ * Wake up all the threads waiting for the writer to make progress.
+ *
+ * Called from the writer thread, with the lock held.
+ */
+static void
+bgflush_wakeup(const struct bgflush *bf)
+{
+	uint64 w;
+	uint id;
+
+	for (w = bf->waiters, id = 0; w != 0; w >>= 1, id++) {
+		if (w & 1)
+			thread_unblock(id);
+	}
+}
+
+/**
+ * Block until the writer makes progress, or until BGFLUSH_TIMEOUT seconds
+ * have elapsed.
+ *
+ * Since the caller may hold the database locks, it cannot block on a
+ * condition variable: like threads waiting for a lock, we register ourselves
+ * and block, the writer unblocking us each time it has written pages.  Our
+ * timeout is short enough to be allowed when holding locks.
+ *
+ * Called with the lock held, which is released whilst blocking.
+ */
+static void
+bgflush_block(struct bgflush *bf)
+{
+	uint64 bit = (uint64) 1 << thread_small_id();
+	unsigned events;
+	tm_t tmout;
+
+	STATIC_ASSERT(THREAD_MAX <= 8 * sizeof bf->waiters);
+	STATIC_ASSERT(BGFLUSH_TIMEOUT < THREAD_SUSPEND_TIMEOUT);
+
+	tmout.tv_sec = BGFLUSH_TIMEOUT;
+	tmout.tv_usec = 0;
+
+	/*
+	 * Preparing before registering ensures we cannot miss the unblocking
+	 * event, should the writer make progress before we actually block.
+	 */
+
+	events = thread_block_prepare();
+	bf->waiters |= bit;
+	mutex_unlock(&bf->lock);
+
+	thread_timed_block_self(events, &tmout);
+
+	mutex_lock(&bf->lock);
+	bf->waiters &= ~bit;
+}
+
+/**
+ * Account for completion of the batch.
+ *
+ * Called from the writer thread, with the lock held.
+ */
+static void
+bgflush_completed(struct bgflush *bf)
+{
+	tm_t end;
+	uint64 latency;
+
+	bf->completed = bf->seq;
+	if (bf->error != 0)
+		bf->failed = bf->seq;
+
+	bgflush_wakeup(bf);
+
+	tm_now_exact(&end);
+	latency = tm_elapsed_us(&end, &bf->start);
+
+	bf->pages += bf->count;
+	bf->batches++;
+	bf->latency_us += latency;
+	bf->max_latency_us = MAX(bf->max_latency_us, latency);
+
+	BGFLUSH_STATS_LOCK;
+	bgflush_stats.pages += bf->count;
+	bgflush_stats.batches++;
+	bgflush_stats.latency += latency;
+	bgflush_stats.max_latency = MAX(bgflush_stats.max_latency, latency);
+	BGFLUSH_STATS_UNLOCK;
+}
+
+/**
+ * Dispose of the background flusher, once the writer thread exited and no
+ * other thread references it.
+ */
+static void
+bgflush_destroy(struct bgflush *bf)
+{
+	sdbm_bgflush_check(bf);
+
+	cond_destroy(&bf->event);
+	mutex_destroy(&bf->lock);
+	HFREE_NULL(bf->slots);
+	if (bf->arena != NULL)
+		vmm_free(bf->arena, bf->capacity * DBM_PBLKSIZ);
+	bf->magic = 0;
+	WFREE(bf);
+}
+
+/**
+ * The writer thread.
+ */
+static void *
+bgflush_thread(void *arg)
+{
+	struct bgflush *bf = arg;
+	bool done;
+
+	sdbm_bgflush_check(bf);
+
+	thread_set_name("SDBM flusher");
+
+	mutex_lock(&bf->lock);
+
+	for (;;) {
+		size_t i;
+
+		while (!bf->exiting && (!bf->submitted || bf->done == bf->count))
+			cond_wait_clean(&bf->event, &bf->lock);
+
+		if (bf->exiting && (!bf->submitted || bf->done == bf->count))
+			break;
+
+		/*
+		 * Write the batch, coalescing runs of consecutive pages.
+		 *
+		 * The batch cannot change whilst it is submitted, so we can release
+		 * the lock whilst performing I/O.
+		 */
+
+		for (i = bf->done; i < bf->count; /* empty */) {
+			size_t n = 1, j;
+
+			while (
+				i + n < bf->count && n < BGFLUSH_IOV &&
+				bf->slots[i + n].num == bf->slots[i].num + (long) n
+			)
+				n++;
+
+			mutex_unlock(&bf->lock);
+
+			if (!bgflush_write_run(bf, i, n)) {
+				/*
+				 * Retry page by page, to precisely flag the failing ones.
+				 */
+
+				for (j = i; j < i + n; j++) {
+					if (!bgflush_write_page(bf, &bf->slots[j])) {
+						int error = errno;
+
+						mutex_lock(&bf->lock);
+						bf->slots[j].failed = TRUE;
+						if (0 == bf->error)
+							bf->error = error;
+						mutex_unlock(&bf->lock);
+					}
+				}
+			}
+
+			mutex_lock(&bf->lock);
+			i += n;
+			bf->done = i;
+			if (i < bf->count)
+				bgflush_wakeup(bf);
+		}
+
+		bgflush_completed(bf);
+	}
+
+	/*
+	 * The writer thread is detached because the database owner cannot join
+	 * it whilst holding the database locks: unless other threads still hold
+	 * a reference, we are the last one to reference the object, so we
+	 * dispose of it.
+	 */
+
+	bf->exited = TRUE;
+	done = 0 == bf->refcnt;
+	mutex_unlock(&bf->lock);
+
+	if (done)
+		bgflush_destroy(bf);
+
+	return NULL;
+}
+
+/**
+ * Allocate a new background flusher and launch its writer thread.
+ *
+ * @param db		the database whose dirty pages we shall flush
+ *
+ * @return the new background flusher, NULL if we could not create the
+ * writer thread, with errno set.
+ */
+struct bgflush *
+bgflush_alloc(DBM *db)
+{
+	struct bgflush *bf;
+	int t;
+
+	WALLOC0(bf);
+	bf->magic = SDBM_BGFLUSH_MAGIC;
+	bf->db = db;
+	bf->fd = -1;
+	mutex_init(&bf->lock);
+	cond_init(&bf->event, &bf->lock);
+
+	t = thread_create(bgflush_thread, bf,
+			THREAD_F_DETACH | THREAD_F_NO_CANCEL |
+				THREAD_F_NO_POOL | THREAD_F_WARN,
+			THREAD_STACK_MIN);
+
+	if (-1 == t) {
+		int error = errno;
+		bgflush_destroy(bf);
+		errno = error;
+		return NULL;
+	}
+
+	return bf;
+}
+
+/**
+ * Retry synchronously writing a page that the writer could not write.
+ *
+ * Called with the lock held.
+ *
+ * @return TRUE if the page could be written.
+ */
+static bool
+bgflush_retry(struct bgflush *bf, struct bgflush_slot *s)
+{
+	DBM *db = bf->db;
+	bool ok = TRUE;
+
+	g_assert(s->failed);
+
+	if (!bgflush_write_page(bf, s)) {
+		s_critical("sdbm: \"%s\": cannot flush page #%ld: %m -- page lost",
+			sdbm_name(db), s->num);
+		ioerr(db, TRUE);
+		db->flush_errors++;
+		ok = FALSE;
+	}
+
+	s->failed = FALSE;
+	return ok;
+}
+
+/**
+ * Record a stall of the calling thread.
+ *
+ * @param bf		the background flusher
+ * @param start		when the stall started
+ */
+static void
+bgflush_stalled(struct bgflush *bf, const tm_t *start)
+{
+	tm_t end;
+	uint64 elapsed;
+
+	tm_now_exact(&end);
+	elapsed = tm_elapsed_us(&end, start);
+
+	bf->stalls++;
+	bf->stall_us += elapsed;
+
+	BGFLUSH_STATS_LOCK;
+	bgflush_stats.stalls++;
+	bgflush_stats.stall_time += elapsed;
+	BGFLUSH_STATS_UNLOCK;
+}
+
+/**
+ * Wait for the writer to have processed the page at given index.
+ *
+ * Called with the lock held.
+ */
+static void
+bgflush_wait_index(struct bgflush *bf, size_t idx)
+{
+	if (bf->done <= idx) {
+		tm_t start;
+
+		tm_now_exact(&start);
+
+		while (bf->done <= idx)
+			bgflush_block(bf);
+
+		bgflush_stalled(bf, &start);
+	}
+}
+
+/**
+ * Wait for the submitted batch to be fully written and dispose of it,
+ * retrying any page the writer could not write.
+ *
+ * @return TRUE if all the pages were written.
+ */
+static bool
+bgflush_collect(struct bgflush *bf)
+{
+	size_t i;
+	bool ok = TRUE;
+
+	if (!bf->submitted)
+		return TRUE;
+
+	mutex_lock(&bf->lock);
+
+	if (bf->count != 0)
+		bgflush_wait_index(bf, bf->count - 1);
+
+	if (0 != bf->error) {
+		errno = bf->error;
+		s_warning("sdbm: \"%s\": background flush failed: %m",
+			sdbm_name(bf->db));
+		for (i = 0; i < bf->count; i++) {
+			struct bgflush_slot *s = &bf->slots[i];
+
+			if (s->failed && !bgflush_retry(bf, s))
+				ok = FALSE;
+		}
+	}
+
+	bf->count = bf->done = 0;
+	bf->error = 0;
+	bf->submitted = FALSE;
+
+	mutex_unlock(&bf->lock);
+
+	return ok;
+}
+
+/**
+ * Free the background flusher, waiting for the current batch to be written
+ * and stopping the writer thread, then nullify its pointer.
+ *
+ * The object is actually freed by the writer thread when it exits.
+ */
+void
+bgflush_free_null(struct bgflush **bf_ptr)
+{
+	struct bgflush *bf = *bf_ptr;
+
+	if (NULL == bf)
+		return;
+
+	sdbm_bgflush_check(bf);
+
+	bgflush_collect(bf);
+
+	if (common_stats) {
+		s_info("sdbm: \"%s\" background flush: %lu page%s in %lu batch%s, "
+			"avg latency = %s us, max = %s us",
+			sdbm_name(bf->db), bf->pages, plural(bf->pages),
+			bf->batches, plural_es(bf->batches),
+			uint64_to_string(bf->latency_us / MAX(bf->batches, 1)),
+			uint64_to_string2(bf->max_latency_us));
+		s_info("sdbm: \"%s\" background flush: %lu stall%s, "
+			"total stalling time = %s us",
+			sdbm_name(bf->db), bf->stalls, plural(bf->stalls),
+			uint64_to_string(bf->stall_us));
+	}
+
+	mutex_lock(&bf->lock);
+	bf->exiting = TRUE;
+	cond_signal(&bf->event, &bf->lock);
+	mutex_unlock(&bf->lock);
+
+	*bf_ptr = NULL;
+}
+
+/**
+ * Add a snapshot of a dirty page to the next batch.
+ *
+ * If the previous batch is still being written, we have to wait until it
+ * is completed.
+ *
+ * @param bf		the background flusher
+ * @param num		the page number
+ * @param pag		the page data
+ */
+void
+bgflush_add(struct bgflush *bf, long num, const char *pag)
+{
+	struct bgflush_slot *s;
+
+	sdbm_bgflush_check(bf);
+	g_assert(num >= 0);
+
+	if G_UNLIKELY(bf->submitted)
+		bgflush_collect(bf);
+
+	if G_UNLIKELY(bf->count == bf->capacity) {
+		size_t ncap = MAX(bf->capacity * 2, LRU_PAGES);
+
+		HREALLOC_ARRAY(bf->slots, ncap);
+		if (NULL == bf->arena) {
+			bf->arena = vmm_alloc(ncap * DBM_PBLKSIZ);
+		} else {
+			bf->arena = vmm_resize(bf->arena,
+				bf->capacity * DBM_PBLKSIZ, ncap * DBM_PBLKSIZ);
+		}
+		bf->capacity = ncap;
+	}
+
+	s = &bf->slots[bf->count];
+	s->num = num;
+	s->idx = bf->count;
+	s->failed = FALSE;
+	memcpy(&bf->arena[s->idx * DBM_PBLKSIZ], pag, DBM_PBLKSIZ);
+	bf->count++;
+}
+
+static int
+bgflush_slot_cmp(const void *a, const void *b)
+{
+	const struct bgflush_slot *sa = a, *sb = b;
+
+	return CMP(sa->num, sb->num);
+}
+
+/**
+ * Submit the batch of pages to the writer thread.
+ *
+ * @param bf		the background flusher
+ * @param fd		the file descriptor of the .pag file
+ */
+void
+bgflush_submit(struct bgflush *bf, int fd)
+{
+	sdbm_bgflush_check(bf);
+
+	/*
+	 * Adding a page to the batch collects the previous one, so if the batch
+	 * is still submitted, no new page was added since then.
+	 */
+
+	if (bf->submitted || 0 == bf->count)
+		return;
+
+	xsort(bf->slots, bf->count, sizeof bf->slots[0], bgflush_slot_cmp);
+
+	mutex_lock(&bf->lock);
+	bf->fd = fd;
+	bf->done = 0;
+	bf->seq++;
+	bf->submitted = TRUE;
+	tm_now_exact(&bf->start);
+	cond_signal(&bf->event, &bf->lock);
+	mutex_unlock(&bf->lock);
+}
+
+/**
+ * Wait until the given page is written, if it belongs to the submitted batch.
+ *
+ * This must be called before reading the page from disk, or writing it
+ * synchronously, to make sure we do not see or overwrite stale data.
+ *
+ * @param bf		the background flusher
+ * @param num		the page number
+ */
+void
+bgflush_wait(struct bgflush *bf, long num)
+{
+	struct bgflush_slot *s;
+	size_t lo, hi;
+
+	sdbm_bgflush_check(bf);
+
+	if G_LIKELY(!bf->submitted)
+		return;
+
+	/*
+	 * The batch is sorted by page number on submission.
+	 */
+
+	lo = 0;
+	hi = bf->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		s = &bf->slots[mid];
+
+		if (s->num == num)
+			goto found;
+		else if (s->num < num)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return;			/* Page not part of the batch */
+
+found:
+	mutex_lock(&bf->lock);
+	bgflush_wait_index(bf, ptr_diff(s, bf->slots) / sizeof *s);
+	if G_UNLIKELY(s->failed)
+		(void) bgflush_retry(bf, s);
+	mutex_unlock(&bf->lock);
+}
+
+/**
+ * Wait for the submitted batch, if any, to be completely written.
+ *
+ * @return TRUE if all the pages were written, FALSE on I/O errors.
+ */
+bool
+bgflush_drain(struct bgflush *bf)
+{
+	sdbm_bgflush_check(bf);
+
+	return bgflush_collect(bf);
+}
+
+/**
+ * @return the highest page number of the batch being written, -1 if none.
+ */
+long
+bgflush_tail(const struct bgflush *bf)
+{
+	sdbm_bgflush_check(bf);
+
+	if (!bf->submitted || 0 == bf->count)
+		return -1;
+
+	return bf->slots[bf->count - 1].num;
+}
+
+/**
+ * Get a reference on the background flusher, to later wait for the batch
+ * being written, if any, from another thread.
+ *
+ * @param bf		the background flusher
+ * @param seq		written with the sequence number of the batch
+ *
+ * @return the background flusher, to be released with bgflush_release(),
+ * NULL if there is no batch being written.
+ */
+struct bgflush *
+bgflush_hold(struct bgflush *bf, ulong *seq)
+{
+	sdbm_bgflush_check(bf);
+	g_assert(seq != NULL);
+
+	if (!bf->submitted)
+		return NULL;
+
+	mutex_lock(&bf->lock);
+	bf->refcnt++;
+	*seq = bf->seq;
+	mutex_unlock(&bf->lock);
+
+	return bf;
+}
+
+/**
+ * Wait until the batch bearing the given sequence number is written.
+ *
+ * This can be called from any thread holding a reference on the flusher.
+ *
+ * @return TRUE if all the pages were written, FALSE if the writer could not
+ * write some of them, which will be retried by the database owner.
+ */
+bool
+bgflush_await(struct bgflush *bf, ulong seq)
+{
+	bool ok;
+
+	sdbm_bgflush_check(bf);
+
+	mutex_lock(&bf->lock);
+	g_assert(bf->refcnt != 0);
+	while (bf->completed < seq)
+		bgflush_block(bf);
+	ok = bf->failed != seq;
+	mutex_unlock(&bf->lock);
+
+	return ok;
+}
+
+/**
+ * Release reference on the background flusher and nullify its pointer.
+ *
+ * The flusher is freed if its writer thread exited in the meantime.
+ */
+void
+bgflush_release(struct bgflush **bf_ptr)
+{
+	struct bgflush *bf = *bf_ptr;
+	bool done;
+
+	sdbm_bgflush_check(bf);
+
+	mutex_lock(&bf->lock);
+	g_assert(bf->refcnt != 0);
+	bf->refcnt--;
+	done = bf->exited && 0 == bf->refcnt;
+	mutex_unlock(&bf->lock);
+
+	if (done)
+		bgflush_destroy(bf);
+
+	*bf_ptr = NULL;
+}
+
+#endif	/* LRU && THREADS */
+
+/**
+ * Fill supplied structure with the background flushing statistics,
+ * aggregated over all the databases.
+ */
+void
+sdbm_bgflush_stats(struct sdbm_bgflush_stats *s)
+{
+	g_assert(s != NULL);
+
+#if defined(LRU) && defined(THREADS)
+	BGFLUSH_STATS_LOCK;
+	*s = bgflush_stats;
+	BGFLUSH_STATS_UNLOCK;
+#else
+	ZERO(s);
+#endif
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,26 @@
+/* Mini EMBED (bgflush.c) */
+#define bgflush_alloc sdbm__bgflush_alloc
+#define bgflush_free_null sdbm__bgflush_free_null
+#define bgflush_add sdbm__bgflush_add
+#define bgflush_submit sdbm__bgflush_submit
+#define bgflush_wait sdbm__bgflush_wait
+#define bgflush_drain sdbm__bgflush_drain
+#define bgflush_tail sdbm__bgflush_tail
+#define bgflush_hold sdbm__bgflush_hold
+#define bgflush_await sdbm__bgflush_await
+#define bgflush_release sdbm__bgflush_release
+
+struct bgflush;
+
+struct bgflush *bgflush_alloc(DBM *);
+void bgflush_free_null(struct bgflush **);
+void bgflush_add(struct bgflush *, long, const char *);
+void bgflush_submit(struct bgflush *, int);
+void bgflush_wait(struct bgflush *, long);
+bool bgflush_drain(struct bgflush *);
+long bgflush_tail(const struct bgflush *);
+struct bgflush *bgflush_hold(struct bgflush *, ulong *);
+bool bgflush_await(struct bgflush *, ulong);
+void bgflush_release(struct bgflush **);
+
+/* vi: set ts=4 sw=4 cindent: */
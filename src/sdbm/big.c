@@ -16,6 +16,7 @@
 #include "sdbm.h"
 #include "tune.h"
 #include "big.h"
+#include "fmap.h"
 #include "private.h"
 #include "pair.h"				/* For sdbm_page_dump() */
 
@@ -83,6 +84,9 @@ struct DBMBIG {
 	buf_t *valbuf;			/* scratch buffer where values are read */
 	long bitbno;			/* page number of the bitmap in bitbuf */
 	int fd;					/* data file descriptor */
+#ifdef MMAP
+	struct fmap *map;		/* if non-NULL, memory-mapped data file */
+#endif
 	long bitmaps;			/* amount of bitmaps allocated */
 	ulong bitfetch;			/* stats: amount of bitmap fetch calls */
 	ulong bitread;			/* stats: amount of bitmap read requests */
@@ -141,6 +145,34 @@ bigbcnt(size_t s)
 	return (int) bcnt;
 }
 
+/**
+ * Read from the .dat file.
+ */
+static inline ssize_t
+big_pread(DBMBIG *dbg, void *p, size_t len, fileoffset_t off)
+{
+#ifdef MMAP
+	if (dbg->map != NULL)
+		return fmap_pread(dbg->map, dbg->fd, p, len, off);
+#endif
+
+	return compat_pread(dbg->fd, p, len, off);
+}
+
+/**
+ * Write to the .dat file.
+ */
+static inline ssize_t
+big_pwrite(DBMBIG *dbg, const void *p, size_t len, fileoffset_t off)
+{
+#ifdef MMAP
+	if (dbg->map != NULL)
+		return fmap_pwrite(dbg->map, dbg->fd, p, len, off);
+#endif
+
+	return compat_pwrite(dbg->fd, p, len, off);
+}
+
 static void
 log_bigstats(DBM *db)
 {
@@ -169,6 +201,10 @@ log_bigstats(DBM *db)
 	g_info("sdbm: \"%s\" big blocks written = %lu (%lu system call%s)",
 		sdbm_name(db),
 		dbg->bigwrite_blk, dbg->bigwrite, plural(dbg->bigwrite));
+#ifdef MMAP
+	if (dbg->map != NULL)
+		fmap_log_stats(dbg->map, db, ".dat");
+#endif
 }
 
 /**
@@ -207,10 +243,38 @@ big_close(DBM *db)
 	if (-1 == dbg->fd)
 		return FALSE;
 
+#ifdef MMAP
+	fmap_discard(dbg->map);
+#endif
 	fd_forget_and_close(&dbg->fd);
 	return TRUE;
 }
 
+/**
+ * Turn memory-mapped access to the .dat file on or off.
+ */
+void
+big_set_mmap(DBM *db, bool on)
+{
+	DBMBIG *dbg = db->big;
+
+	if (NULL == dbg)
+		return;
+
+	sdbm_big_check(dbg);
+
+#ifdef MMAP
+	if (on) {
+		if (NULL == dbg->map)
+			dbg->map = fmap_alloc();
+	} else {
+		fmap_free_null(&dbg->map);
+	}
+#else
+	(void) on;
+#endif
+}
+
 /**
  * Prepare the bitmap cache.
  */
@@ -294,6 +358,9 @@ big_free(DBM *db)
 	HFREE_NULL(dbg->bitcheck);
 	buf_free_null(&dbg->keybuf);
 	buf_free_null(&dbg->valbuf);
+#ifdef MMAP
+	fmap_free_null(&dbg->map);
+#endif
 	fd_forget_and_close(&dbg->fd);
 	dbg->magic = 0;
 	WFREE(dbg);
@@ -378,7 +445,7 @@ flush_bitbuf(DBM *db)
 	ssize_t w;
 
 	dbg->bitwrite++;
-	w = compat_pwrite(dbg->fd, dbg->bitbuf, BIG_BLKSIZE, OFF_DAT(dbg->bitbno));
+	w = big_pwrite(dbg, dbg->bitbuf, BIG_BLKSIZE, OFF_DAT(dbg->bitbno));
 
 	/*
 	 * The bitmap is a critical part hence request immediate flushing of the
@@ -419,7 +486,7 @@ fetch_bitbuf(DBM *db, long num)
 			return FALSE;
 
 		dbg->bitread++;
-		got = compat_pread(dbg->fd, dbg->bitbuf, BIG_BLKSIZE, OFF_DAT(bno));
+		got = big_pread(dbg, dbg->bitbuf, BIG_BLKSIZE, OFF_DAT(bno));
 		if (got < 0) {
 			s_critical("sdbm: \"%s\": could not read bitmap block #%ld: %m",
 				sdbm_name(db), num);
@@ -822,7 +889,7 @@ big_fetch(DBM *db, const void *bvec, size_t len, buf_t *buf)
 		}
 
 		dbg->bigread++;
-		if (-1 == compat_pread(dbg->fd, q, toread, OFF_DAT(bno))) {
+		if (-1 == big_pread(dbg, q, toread, OFF_DAT(bno))) {
 			s_critical("sdbm: \"%s\": "
 				"could not read %zu bytes starting at data block #%u: %m",
 				sdbm_name(db), toread, bno);
@@ -1115,7 +1182,7 @@ big_store(DBM *db, const void *bvec, const void *data, size_t len)
 		}
 
 		dbg->bigwrite++;
-		if (-1 == compat_pwrite(dbg->fd, q, towrite, OFF_DAT(bno))) {
+		if (-1 == big_pwrite(dbg, q, towrite, OFF_DAT(bno))) {
 			s_critical("sdbm: \"%s\": "
 				"could not write %zu bytes starting at data block #%u: %m",
 				sdbm_name(db), towrite, bno);
@@ -1846,6 +1913,10 @@ big_shrink(DBM *db)
 		}
 	}
 
+#ifdef MMAP
+	fmap_discard(dbg->map);		/* Truncated part must no longer be mapped */
+#endif
+
 	if (-1 == ftruncate(dbg->fd, offset))
 		return FALSE;
 
@@ -1884,6 +1955,10 @@ big_clear(DBM *db)
 
 	g_assert(dbg->fd != -1);
 
+#ifdef MMAP
+	fmap_discard(dbg->map);
+#endif
+
 	if (-1 == fd_forget_and_close(&dbg->fd))
 		return FALSE;
 
@@ -18,6 +18,7 @@
 #define big_sync sdbm__big_sync
 #define big_close sdbm__big_close
 #define big_reopen sdbm__big_reopen
+#define big_set_mmap sdbm__big_set_mmap
 #define bigkey_free sdbm__bigkey_free
 #define bigval_free sdbm__bigval_free
 #define bigkey_check sdbm__bigkey_check
@@ -43,6 +44,7 @@ bool big_shrink(DBM *);
 bool big_clear(DBM *);
 bool big_close(DBM *);
 int big_reopen(DBM *);
+void big_set_mmap(DBM *, bool);
 size_t big_check_end(DBM *, bool);
 bool bigkey_put(DBM *, char *, size_t, const char *, size_t);
 bool bigval_put(DBM *, char *, size_t, const char *, size_t);
@@ -0,0 +1,675 @@
+/*
+ * sdbm - ndbm work-alike hashed database library
+ *
+ * Bulk loading of empty databases.
+ * author: gtk-gnutella developers
+ * status: public domain.
+ *
+ * Inserting keys one at a time in an empty database, in random hash order,
+ * causes many page splits, each of them rewriting pages that were already
+ * written.  When all the pairs are known beforehand, we can do better.
+ *
+ * The pairs handed to sdbm_bulk_add() are buffered, then sdbm_bulk_end()
+ * sorts them by bit-reversed hash value.  Since the .dir bitmap is a trie
+ * indexed by the low-order bits of the hash, starting with bit 0, that
+ * ordering guarantees that the pairs belonging to any node of the trie are
+ * contiguous.  We can then recursively split the sorted set, exactly as
+ * page splits would, until each subset fits in a page, and directly lay out
+ * the final pages and the directory bitmap.
+ *
+ * Pages are written in increasing block order, a batch of consecutive pages
+ * being written in one single system call, and the directory bitmap is
+ * written once at the end.  Big keys and values are written to the .dat file
+ * as pages are laid out, which allocates their blocks contiguously.
+ *
+ * The memory used to buffer the pairs is capped by BULK_MAX: callers must
+ * be prepared to see sdbm_bulk_add() fail with EFBIG, and then load the
+ * database by regular insertions.
+ *
+ * @ingroup sdbm
+ * @file
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "sdbm.h"
+#include "tune.h"
+#include "private.h"
+#include "fmap.h"
+#include "lru.h"
+#include "pair.h"
+
+#include "lib/compat_pio.h"
+#include "lib/fd.h"
+#include "lib/halloc.h"
+#include "lib/log.h"
+#include "lib/misc.h"
+#include "lib/pow2.h"
+#include "lib/qlock.h"
+#include "lib/rwlock.h"
+#include "lib/vmm.h"
+#include "lib/walloc.h"
+#include "lib/xsort.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#define BULK_RUN		64		/* Max amount of pages written at once */
+#define BULK_ARENA		(256 * 1024)	/* Initial size of the data arena */
+#define BULK_LEVEL_MAX	31		/* Max hash bits used by the .dir trie */
+#define BULK_MAX		(64 * 1024 * 1024)	/* Max memory for buffered pairs */
+
+enum sdbm_bulk_magic { SDBM_BULK_MAGIC = 0x3b5e91d7 };
+
+/*
+ * A pair to load, whose data lies in the arena.
+ */
+struct bulk_pair {
+	uint32 rhash;		/* Bit-reversed hash of the key */
+	uint16 need;		/* Room needed in the page, including the index */
+	size_t seq;			/* Insertion order, for duplicate keys */
+	size_t off;			/* Offset of the key in the arena, value follows */
+	size_t klen;		/* Key length */
+	size_t vlen;		/* Value length */
+};
+
+/*
+ * A page to lay out, holding a range of sorted pairs.
+ */
+struct bulk_leaf {
+	long num;			/* Page number */
+	size_t lo;			/* Index of first pair */
+	size_t hi;			/* Index after the last pair */
+};
+
+struct sdbm_bulk {
+	enum sdbm_bulk_magic magic;
+	DBM *db;					/* Database being loaded */
+	struct bulk_pair *pairs;	/* Pairs to load */
+	size_t count;				/* Amount of pairs */
+	size_t capacity;			/* Allocated pairs */
+	char *arena;				/* Key and value data */
+	size_t used;				/* Used arena bytes */
+	size_t size;				/* Arena size */
+	struct bulk_leaf *leaves;	/* Pages to lay out */
+	size_t lcount;				/* Amount of leaves */
+	size_t lcapacity;			/* Allocated leaves */
+	char *dir;					/* Directory bitmap */
+	size_t dirlen;				/* Bitmap length, multiple of DBM_DBLKSIZ */
+};
+
+static inline void
+sdbm_bulk_check(const struct sdbm_bulk * const b)
+{
+	g_assert(b != NULL);
+	g_assert(SDBM_BULK_MAGIC == b->magic);
+}
+
+/**
+ * @return the 32-bit value with its bits reversed.
+ */
+static inline uint32
+bulk_reverse(uint32 v)
+{
+	return (uint32) reverse_byte(v & 0xff) << 24 |
+		(uint32) reverse_byte((v >> 8) & 0xff) << 16 |
+		(uint32) reverse_byte((v >> 16) & 0xff) << 8 |
+		(uint32) reverse_byte(v >> 24);
+}
+
+/**
+ * Check whether database is empty, i.e. has never been written to.
+ */
+static bool
+bulk_db_is_empty(DBM *db)
+{
+	assert_sdbm_locked(db);
+
+#ifdef LRU
+	if (db->cache != NULL && lru_tail_offset(db) != 0)
+		return FALSE;		/* Has dirty pages not flushed yet */
+#endif
+
+	return 0 == db->maxbno &&
+		0 == lseek(db->pagf, 0L, SEEK_END) &&
+		0 == lseek(db->dirf, 0L, SEEK_END);
+}
+
+/**
+ * Check whether bulk loading can proceed on the database.
+ *
+ * @return TRUE if OK, FALSE if not with errno set.
+ */
+static bool
+sdbm_can_bulk_load(DBM *db)
+{
+	assert_sdbm_locked(db);
+
+	if (sdbm_rdonly(db)) {
+		errno = EPERM;
+		return FALSE;
+	}
+	if (db->flags & DBM_BROKEN) {
+		errno = ESTALE;
+		return FALSE;
+	}
+	if (sdbm_error(db)) {
+		errno = EIO;
+		return FALSE;
+	}
+	if (db->rdb != NULL || (db->flags & DBM_ITERATING)) {
+		errno = EBUSY;
+		return FALSE;
+	}
+	if (!bulk_db_is_empty(db)) {
+		errno = ENOTEMPTY;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Start bulk loading of an empty database.
+ *
+ * The pairs are supplied with sdbm_bulk_add() and are only written to the
+ * database by sdbm_bulk_end(), all the data being buffered in memory until
+ * then.  The database must not be modified by other means meanwhile.
+ *
+ * @param db		the database to load, which must be empty
+ *
+ * @return a bulk loading context, NULL on error with errno set.
+ */
+struct sdbm_bulk *
+sdbm_bulk_start(DBM *db)
+{
+	struct sdbm_bulk *b;
+	bool ok;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+	ok = sdbm_can_bulk_load(db);
+	sdbm_unsynchronize(db);
+
+	if (!ok)
+		return NULL;		/* errno was already set */
+
+	WALLOC0(b);
+	b->magic = SDBM_BULK_MAGIC;
+	b->db = db;
+
+	return b;
+}
+
+/**
+ * Add key/value pair to the bulk loading set.
+ *
+ * The data is copied, so the key and value buffers can be reused by the
+ * caller.  Should the same key be added several times, the first value is
+ * the one that will be kept, as if DBM_INSERT had been used.
+ *
+ * @return 0 if OK, -1 on error with errno set, EFBIG meaning that the
+ * amount of data to buffer would exceed BULK_MAX bytes.
+ */
+int
+sdbm_bulk_add(struct sdbm_bulk *b, datum key, datum val)
+{
+	struct bulk_pair *p;
+	size_t need, len;
+
+	sdbm_bulk_check(b);
+
+	if G_UNLIKELY(0 == val.dsize) {
+		val.dptr = "";
+	}
+	if G_UNLIKELY(NULL == key.dptr || NULL == val.dptr) {
+		errno = EINVAL;
+		return -1;
+	}
+	if G_UNLIKELY(!sdbm_storage_needs(key.dsize, val.dsize, &need)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if G_UNLIKELY(b->count == b->capacity) {
+		size_t ncap = MAX(b->capacity * 2, 1024);
+
+		HREALLOC_ARRAY(b->pairs, ncap);
+		b->capacity = ncap;
+	}
+
+	len = key.dsize + val.dsize;
+
+	if G_UNLIKELY(b->used + len + b->count * sizeof b->pairs[0] > BULK_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if G_UNLIKELY(b->size - b->used < len) {
+		size_t nsize = MAX(b->size * 2, BULK_ARENA);
+
+		while (nsize - b->used < len)
+			nsize *= 2;
+
+		if (NULL == b->arena)
+			b->arena = vmm_alloc(nsize);
+		else
+			b->arena = vmm_resize(b->arena, b->size, nsize);
+		b->size = nsize;
+	}
+
+	p = &b->pairs[b->count];
+	p->rhash = bulk_reverse(sdbm_hash(key.dptr, key.dsize));
+	p->need = need + 2 * sizeof(unsigned short);
+	p->seq = b->count++;
+	p->off = b->used;
+	p->klen = key.dsize;
+	p->vlen = val.dsize;
+
+	memcpy(&b->arena[b->used], key.dptr, key.dsize);
+	memcpy(&b->arena[b->used + key.dsize], val.dptr, val.dsize);
+	b->used += len;
+
+	return 0;
+}
+
+/**
+ * Free bulk loading context and nullify its pointer.
+ */
+static void
+sdbm_bulk_free_null(struct sdbm_bulk **b_ptr)
+{
+	struct sdbm_bulk *b = *b_ptr;
+
+	if (b != NULL) {
+		sdbm_bulk_check(b);
+
+		HFREE_NULL(b->pairs);
+		HFREE_NULL(b->leaves);
+		if (b->arena != NULL)
+			vmm_free(b->arena, b->size);
+		if (b->dir != NULL)
+			vmm_free(b->dir, b->dirlen);
+		b->magic = 0;
+		WFREE(b);
+		*b_ptr = NULL;
+	}
+}
+
+/**
+ * Abort bulk loading, discarding all the pairs added so far.
+ *
+ * The database is left untouched.
+ */
+void
+sdbm_bulk_abort(struct sdbm_bulk **b_ptr)
+{
+	sdbm_bulk_free_null(b_ptr);
+}
+
+/**
+ * Sort pairs by increasing bit-reversed hash, then by insertion order.
+ */
+static int
+bulk_pair_cmp(const void *a, const void *b)
+{
+	const struct bulk_pair *pa = a, *pb = b;
+
+	if (pa->rhash != pb->rhash)
+		return pa->rhash < pb->rhash ? -1 : +1;
+
+	return CMP(pa->seq, pb->seq);
+}
+
+/**
+ * Sort leaves by increasing page number.
+ */
+static int
+bulk_leaf_cmp(const void *a, const void *b)
+{
+	const struct bulk_leaf *la = a, *lb = b;
+
+	return CMP(la->num, lb->num);
+}
+
+/**
+ * Remove duplicate keys from the sorted set, keeping the first one added.
+ *
+ * Identical keys have identical hashes, hence they are adjacent in the
+ * sorted set, ordered by insertion.
+ */
+static void
+bulk_dedup(struct sdbm_bulk *b)
+{
+	size_t i, j, n = 0, run = 0;
+
+	for (i = 0; i < b->count; i++) {
+		const struct bulk_pair *p = &b->pairs[i];
+		bool duplicate = FALSE;
+
+		/*
+		 * Compare with the pairs already kept that have the same hash.
+		 */
+
+		if (0 == n || b->pairs[n - 1].rhash != p->rhash)
+			run = n;
+
+		for (j = run; j < n; j++) {
+			const struct bulk_pair *q = &b->pairs[j];
+
+			if (
+				q->klen == p->klen &&
+				0 == memcmp(&b->arena[q->off], &b->arena[p->off], p->klen)
+			) {
+				duplicate = TRUE;
+				break;
+			}
+		}
+
+		if (!duplicate)
+			b->pairs[n++] = *p;
+	}
+
+	b->count = n;
+}
+
+/**
+ * Set bit in the directory bitmap.
+ */
+static void
+bulk_setdbit(struct sdbm_bulk *b, long dbit)
+{
+	size_t c = dbit / BYTESIZ;
+
+	if G_UNLIKELY(c >= b->dirlen) {
+		size_t nlen = (c / DBM_DBLKSIZ + 1) * DBM_DBLKSIZ;
+
+		if (NULL == b->dir)
+			b->dir = vmm_alloc(nlen);
+		else
+			b->dir = vmm_resize(b->dir, b->dirlen, nlen);
+		memset(&b->dir[b->dirlen], 0, nlen - b->dirlen);
+		b->dirlen = nlen;
+	}
+
+	b->dir[c] |= 1 << (dbit % BYTESIZ);
+}
+
+/**
+ * Record page to lay out.
+ */
+static void
+bulk_leaf_add(struct sdbm_bulk *b, long num, size_t lo, size_t hi)
+{
+	struct bulk_leaf *l;
+
+	if G_UNLIKELY(b->lcount == b->lcapacity) {
+		size_t ncap = MAX(b->lcapacity * 2, 256);
+
+		HREALLOC_ARRAY(b->leaves, ncap);
+		b->lcapacity = ncap;
+	}
+
+	l = &b->leaves[b->lcount++];
+	l->num = num;
+	l->lo = lo;
+	l->hi = hi;
+}
+
+/**
+ * Split the sorted range of pairs until each subset fits in a page, as
+ * page splits would have done, recording the pages and the trie bits.
+ *
+ * @param b			the bulk loading context
+ * @param lo		first pair in the range
+ * @param hi		index after the last pair in the range
+ * @param level		amount of hash bits determining the page number
+ * @param dbit		the bit of the trie node in the directory
+ * @param num		the page number
+ *
+ * @return TRUE if OK, FALSE if the range cannot be split.
+ */
+static bool
+bulk_layout(struct sdbm_bulk *b,
+	size_t lo, size_t hi, int level, long dbit, long num)
+{
+	size_t i, mid, need = sizeof(unsigned short);	/* ino[0] */
+	uint32 bit;
+
+	for (i = lo; i < hi && need <= DBM_PBLKSIZ; i++) {
+		need += b->pairs[i].need;
+	}
+
+	if (need <= DBM_PBLKSIZ) {
+		if (lo != hi)
+			bulk_leaf_add(b, num, lo, hi);
+		return TRUE;		/* Empty pages are holes in the .pag file */
+	}
+
+	if G_UNLIKELY(level >= BULK_LEVEL_MAX)
+		return FALSE;		/* Too many keys with identical hashes */
+
+	/*
+	 * Hash bit ``level'' is bit (31 - level) of the reversed hash, and all
+	 * the pairs in the range share the same upper bits of the reversed hash.
+	 * Locate the first pair with the bit set by dichotomy.
+	 */
+
+	bit = 1U << (31 - level);
+	i = lo;
+	mid = hi;
+
+	while (i < mid) {
+		size_t m = i + (mid - i) / 2;
+
+		if (b->pairs[m].rhash & bit)
+			mid = m;
+		else
+			i = m + 1;
+	}
+
+	bulk_setdbit(b, dbit);
+
+	return
+		bulk_layout(b, lo, mid, level + 1, 2 * dbit + 1, num) &&
+		bulk_layout(b, mid, hi, level + 1, 2 * dbit + 2, num | (1L << level));
+}
+
+/**
+ * Write run of consecutive pages to the .pag file.
+ *
+ * @return TRUE if OK.
+ */
+static bool
+bulk_flush(DBM *db, const char *buf, long first, long n)
+{
+	ssize_t w;
+	size_t len = n * DBM_PBLKSIZ;
+
+	if (0 == n)
+		return TRUE;
+
+	db->pagwrite++;
+	w = compat_pwrite(db->pagf, buf, len, OFF_PAG(first));
+
+	if G_UNLIKELY(w < 0 || UNSIGNED(w) != len) {
+		s_critical("sdbm: \"%s\": cannot write %ld page%s at #%ld: %s",
+			sdbm_name(db), n, 1 == n ? "" : "s", first,
+			-1 == w ? english_strerror(errno) : "Partial write");
+		ioerr(db, TRUE);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Lay out all the pages and write them to disk, along with the .dir bitmap.
+ *
+ * @return 0 if OK, the errno value otherwise.
+ */
+static int
+bulk_write(struct sdbm_bulk *b)
+{
+	DBM *db = b->db;
+	char *buf;
+	long first = 0, n = 0;
+	size_t i;
+	int error = 0;
+
+	assert_sdbm_locked(db);
+
+	xsort(b->leaves, b->lcount, sizeof b->leaves[0], bulk_leaf_cmp);
+	buf = vmm_alloc(BULK_RUN * DBM_PBLKSIZ);
+
+	for (i = 0; i < b->lcount; i++) {
+		const struct bulk_leaf *l = &b->leaves[i];
+		char *pag;
+		size_t j;
+
+		if (n != 0 && (l->num != first + n || BULK_RUN == n)) {
+			if (!bulk_flush(db, buf, first, n))
+				goto failed;
+			n = 0;
+		}
+
+		if (0 == n)
+			first = l->num;
+
+		pag = &buf[n++ * DBM_PBLKSIZ];
+		memset(pag, 0, DBM_PBLKSIZ);
+
+		for (j = l->lo; j < l->hi; j++) {
+			const struct bulk_pair *p = &b->pairs[j];
+			datum key, val;
+
+			key.dptr = &b->arena[p->off];
+			key.dsize = p->klen;
+			val.dptr = &b->arena[p->off + p->klen];
+			val.dsize = p->vlen;
+
+			if G_UNLIKELY(!bulkpair(db, pag, key, val))
+				goto failed;
+		}
+	}
+
+	if (!bulk_flush(db, buf, first, n))
+		goto failed;
+
+	/*
+	 * The bitmap forest is a critical part, make sure the kernel flushes
+	 * it immediately to disk, as flush_dirbuf() does.
+	 */
+
+	if (b->dirlen != 0) {
+		ssize_t w;
+
+		db->dirwrite++;
+		w = compat_pwrite(db->dirf, b->dir, b->dirlen, 0);
+
+		if G_UNLIKELY(w < 0 || UNSIGNED(w) != b->dirlen) {
+			s_critical("sdbm: \"%s\": cannot write %zu dir block%s: %s",
+				sdbm_name(db), b->dirlen / DBM_DBLKSIZ,
+				DBM_DBLKSIZ == b->dirlen ? "" : "s",
+				-1 == w ? english_strerror(errno) : "Partial write");
+			ioerr(db, TRUE);
+			goto failed;
+		}
+
+		fd_fdatasync(db->dirf);
+	}
+
+	/* FALL THROUGH */
+
+done:
+	vmm_free(buf, BULK_RUN * DBM_PBLKSIZ);
+	return error;
+
+failed:
+	error = 0 == errno ? EIO : errno;
+	goto done;
+}
+
+/**
+ * End bulk loading, writing all the pairs to the database.
+ *
+ * The bulk loading context is freed and its pointer nullified, regardless
+ * of the outcome.
+ *
+ * @return the amount of pairs stored (duplicate keys being counted once),
+ * -1 on error with errno set.
+ */
+long
+sdbm_bulk_end(struct sdbm_bulk **b_ptr)
+{
+	struct sdbm_bulk *b = *b_ptr;
+	DBM *db;
+	long result;
+	int error = 0;
+
+	sdbm_bulk_check(b);
+
+	db = b->db;
+	sdbm_check(db);
+
+	xsort(b->pairs, b->count, sizeof b->pairs[0], bulk_pair_cmp);
+	bulk_dedup(b);
+
+	if (!bulk_layout(b, 0, b->count, 0, 0, 0)) {
+		s_warning("sdbm: \"%s\": cannot lay out %zu pairs for bulk loading",
+			sdbm_name(db), b->count);
+		error = ENOSPC;
+		goto freed;
+	}
+
+	sdbm_synchronize(db);
+
+	if (!sdbm_can_bulk_load(db)) {
+		error = errno;
+		goto unlock;
+	}
+
+#ifdef MMAP
+	fmap_discard(db->pagmap);	/* We are writing behind its back */
+#endif
+
+	error = bulk_write(b);
+
+	/*
+	 * Whatever happened, pages were written behind the back of the cache
+	 * and the directory buffer, which must be invalidated.
+	 */
+
+#ifdef LRU
+	if (db->cache != NULL)
+		lru_discard(db, 0);
+#endif
+	db->pagbno = -1;
+	db->dirbno = -1;
+	db->maxbno = b->dirlen * BYTESIZ;
+
+	if (0 == error)
+		db->delta += b->count;
+
+	/* FALL THROUGH */
+
+unlock:
+	sdbm_unsynchronize(db);
+
+	/* FALL THROUGH */
+
+freed:
+	result = b->count;
+	sdbm_bulk_free_null(b_ptr);
+
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+
+	return result;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -43,6 +43,7 @@
 #include "lib/stringify.h"	/* For plural() */
 #include "lib/thread.h"
 #include "lib/tm.h"
+#include "lib/xmalloc.h"
 
 #include "lib/override.h"
 
@@ -50,6 +51,7 @@ extern void oops(char *fmt, ...) G_PRINTF(1, 2);
 
 static bool progress;
 static bool shrink, rebuild, thread_safe;
+static bool mapped, bgflush;
 static bool randomize;
 static unsigned rseed;
 static bool unlink_db;
@@ -58,6 +60,7 @@ static bool large_keys, large_values, common_head_tail;
 static bool loose_delete;
 static bool async_rebuild, async_rebuild_launched;
 static int async_thread = -1;
+static int mt_readers;
 
 #define WR_DELAY	(1 << 0)
 #define WR_VOLATILE	(1 << 1)
@@ -68,8 +71,8 @@ static void G_NORETURN
 usage(void)
 {
 	fprintf(stderr,
-		"Usage: %s [-abdeiklprstvwyABCDEKSTUVX] [-R seed] [-c pages]\n"
-		"       dbname [count]\n"
+		"Usage: %s [-abdeikloprstvwyABCDEFKLMSTUVX] [-R seed] [-c pages]\n"
+		"       [-m readers] dbname [count]\n"
 		"  -a : rebuild the database asynchronously whilst testing\n"
 		"  -b : rebuild the database\n"
 		"  -c : set LRU cache size\n"
@@ -78,6 +81,8 @@ usage(void)
 		"  -i : perform iteration test\n"
 		"  -k : use large keys\n"
 		"  -l : perform loose iteration test (implies -T)\n"
+		"  -m : perform multi-threaded read/write test (implies -T)\n"
+		"  -o : compact database online, rewriting \"count\" keys meanwhile\n"
 		"  -p : show test progress\n"
 		"  -r : perform a read test\n"
 		"  -s : perform safe iteration test\n"
@@ -91,7 +96,10 @@ usage(void)
 		"  -C : count database items\n"
 		"  -D : enable LRU cache write delay\n"
 		"  -E : empty existing database on write test\n"
+		"  -F : flush dirty pages from a background thread\n"
 		"  -K : use large keys with common head/tail parts\n"
+		"  -L : bulk-load \"count\" keys in emptied database\n"
+		"  -M : access database files through memory mappings\n"
 		"  -R : seed for repeatable random key sequence\n"
 		"  -S : shrink database before testing\n"
 		"  -T : make database handle thread-safe\n"
@@ -147,6 +155,16 @@ open_db(const char *name, bool writeable, long cache, int wflags)
 		oops("error %sabling write delay for \"%s\"",
 			(wflags & WR_DELAY) ? "en" : "dis", name);
 	}
+	if (mapped) {
+		if (-1 == sdbm_set_mmap(db, TRUE)) {
+			oops("error enabling memory mappings for \"%s\"", name);
+		}
+	}
+	if (bgflush) {
+		if (-1 == sdbm_set_bgflush(db, TRUE)) {
+			oops("error enabling background flushing for \"%s\"", name);
+		}
+	}
 	if (shrink)
 		sdbm_shrink(db);
 
@@ -322,6 +340,25 @@ exist_db(const char *name, long count, long cache, int wflags, tm_t *done)
 	sdbm_close(db);
 }
 
+static void
+fill_value(datum *val, const datum *key, char *buf, size_t len)
+{
+	val->dptr = key->dptr;
+	if (large_values) {
+		if (large_keys) {
+			val->dsize = key->dsize;
+		} else {
+			g_assert(len > NORMAL_KEY_LEN);
+			memset(buf, 0, len);
+			memcpy(buf, key->dptr, NORMAL_KEY_LEN);
+			val->dsize = len;
+			val->dptr = buf;
+		}
+	} else {
+		val->dsize = NORMAL_KEY_LEN;
+	}
+}
+
 static void
 write_db(const char *name, long count, long cache, int wflags, tm_t *done)
 {
@@ -348,27 +385,67 @@ write_db(const char *name, long count, long cache, int wflags, tm_t *done)
 			show_progress(i, count);
 
 		fill_key(ARYLEN(buf), i);
-
-		val.dptr = key.dptr;
-		if (large_values) {
-			if (large_keys) {
-				val.dsize = key.dsize;
-			} else {
-				ZERO(&valbuf);
-				memcpy(valbuf, key.dptr, NORMAL_KEY_LEN);
-				val.dsize = sizeof valbuf;
-				val.dptr = valbuf;
-			}
-		} else {
-			val.dsize = NORMAL_KEY_LEN;
-		}
+		fill_value(&val, &key, ARYLEN(valbuf));
 
 		if (-1 == sdbm_store(db, key, val, DBM_REPLACE))
 			oops("write error at item #%ld", i);
+
+		/*
+		 * With background flushing, periodically sync to exercise the
+		 * concurrent writing of the dirty pages.
+		 */
+
+		if (bgflush && 0 == (i + 1) % 1000 && -1 == sdbm_sync(db))
+			oops("sync error at item #%ld", i);
+	}
+
+	show_done(done);
+
+	sdbm_close(db);
+}
+
+static void
+load_db(const char *name, long count, long cache, int wflags, tm_t *done)
+{
+	DBM *db = open_db(name, TRUE, cache, wflags | WR_EMPTY);
+	struct sdbm_bulk *bulk;
+	long i, loaded;
+	datum key;
+	char buf[1024];
+	long cpage = 0 == cache ? 64 : cache;
+
+	printf("Starting bulk load test (%ld item%s), cache=%ld page%s...\n",
+		count, plural(count), cpage, plural(cpage));
+
+	bulk = sdbm_bulk_start(db);
+	if (NULL == bulk)
+		oops("cannot start bulk loading");
+
+	key.dsize = large_keys ? sizeof buf : NORMAL_KEY_LEN;
+	key.dptr = buf;
+
+	for (i = 0; i < count; i++) {
+		datum val;
+		char valbuf[DBM_PBLKSIZ];
+
+		if (progress && 0 == i % 500)
+			show_progress(i, count);
+
+		fill_key(ARYLEN(buf), i);
+		fill_value(&val, &key, ARYLEN(valbuf));
+
+		if (-1 == sdbm_bulk_add(bulk, key, val))
+			oops("cannot add item #%ld", i);
 	}
 
+	loaded = sdbm_bulk_end(&bulk);
+	if (-1 == loaded)
+		oops("bulk loading failed");
+
 	show_done(done);
 
+	printf("(loaded %ld item%s)\n", loaded, plural(loaded));
+
 	sdbm_close(db);
 }
 
@@ -606,6 +683,208 @@ loose_db(const char *name, long count, long cache, int safe, tm_t *done)
 	sdbm_close(db);
 }
 
+struct mt_args {
+	DBM *db;
+	long count;			/* Amount of keys in the database */
+	ulong ops;			/* Amount of operations performed */
+	double elapsed;		/* Time spent performing operations */
+	const bool *stop;	/* If non-NULL, where we check whether to stop */
+};
+
+/**
+ * Reader thread for the multi-threaded test: fetch "count" random keys.
+ */
+static void *
+mt_reader(void *arg)
+{
+	struct mt_args *a = arg;
+	char buf[1024];
+	datum key;
+	tm_t start, end;
+	long i;
+
+	key.dsize = large_keys ? sizeof buf : NORMAL_KEY_LEN;
+	key.dptr = buf;
+
+	tm_now_exact(&start);
+
+	for (i = 0; i < a->count; i++) {
+		datum val;
+
+		fill_key(ARYLEN(buf), random_value(a->count - 1));
+		val = sdbm_fetch(a->db, key);
+		if (NULL == val.dptr) {
+			if (sdbm_error(a->db))
+				oops("%s(): read error at item #%ld", G_STRFUNC, i);
+			oops("%s(): item #%ld not found", G_STRFUNC, i);
+		}
+		a->ops++;
+	}
+
+	tm_now_exact(&end);
+	a->elapsed = tm_elapsed_f(&end, &start);
+	sdbm_unref(&a->db);
+
+	return NULL;
+}
+
+/**
+ * Writer thread for the multi-threaded test: rewrite random keys with
+ * their current value until told to stop.
+ */
+static void *
+mt_writer(void *arg)
+{
+	struct mt_args *a = arg;
+	char buf[1024];
+	datum key;
+	tm_t start, end;
+
+	key.dsize = large_keys ? sizeof buf : NORMAL_KEY_LEN;
+	key.dptr = buf;
+
+	tm_now_exact(&start);
+
+	while (!atomic_bool_get(a->stop)) {
+		datum val;
+
+		fill_key(ARYLEN(buf), random_value(a->count - 1));
+
+		sdbm_lock(a->db);
+		val = sdbm_fetch(a->db, key);
+		if (NULL != val.dptr) {
+			if (-1 == sdbm_store(a->db, key, val, DBM_REPLACE))
+				oops("%s(): cannot rewrite key", G_STRFUNC);
+			a->ops++;
+		}
+		sdbm_unlock(a->db);
+	}
+
+	tm_now_exact(&end);
+	a->elapsed = tm_elapsed_f(&end, &start);
+	sdbm_unref(&a->db);
+
+	return NULL;
+}
+
+static void
+mt_db(const char *name, long count, long cache, int wflags, tm_t *done)
+{
+	DBM *db = open_db(name, TRUE, cache, wflags);
+	long cpage = 0 == cache ? 64 : cache;
+	struct mt_args *readers, writer;
+	int *rt, wt, i;
+	bool stop = FALSE;
+	ulong reads = 0;
+	double elapsed = 0.0;
+
+	printf("Starting multi-threaded test (%d reader%s, %ld read%s each), "
+		"cache=%ld page%s...\n",
+		mt_readers, plural(mt_readers), count, plural(count),
+		cpage, plural(cpage));
+
+	XMALLOC0_ARRAY(readers, mt_readers);
+	XMALLOC_ARRAY(rt, mt_readers);
+
+	ZERO(&writer);
+	writer.db = sdbm_ref(db);
+	writer.count = count;
+	writer.stop = &stop;
+
+	wt = thread_create(mt_writer, &writer, THREAD_F_PANIC, 0);
+
+	for (i = 0; i < mt_readers; i++) {
+		readers[i].db = sdbm_ref(db);
+		readers[i].count = count;
+		rt[i] = thread_create(mt_reader, &readers[i], THREAD_F_PANIC, 0);
+	}
+
+	for (i = 0; i < mt_readers; i++) {
+		if (-1 == thread_join(rt[i], NULL))
+			oops("%s(): cannot join with reader thread", G_STRFUNC);
+		reads += readers[i].ops;
+		elapsed = MAX(elapsed, readers[i].elapsed);
+	}
+
+	atomic_bool_set(&stop, TRUE);
+
+	if (-1 == thread_join(wt, NULL))
+		oops("%s(): cannot join with writer thread", G_STRFUNC);
+
+	show_done(done);
+
+	printf("Readers did %lu fetch%s in %.3f secs (%.0f fetches/sec)\n",
+		reads, plural_es(reads), elapsed, reads / MAX(elapsed, 1e-6));
+	printf("Writer did %lu update%s in %.3f secs (%.0f updates/sec)\n",
+		writer.ops, plural(writer.ops), writer.elapsed,
+		writer.ops / MAX(writer.elapsed, 1e-6));
+
+	XFREE_NULL(readers);
+	XFREE_NULL(rt);
+	sdbm_close(db);
+}
+
+#define COMPACT_SLICE	8	/* Pages migrated at each compaction step */
+
+static void
+compact_db(const char *name, long count, long cache, int wflags, tm_t *done)
+{
+	DBM *db = open_db(name, TRUE, cache, wflags);
+	struct sdbm_compact_info info;
+	long i = 0, steps = 0;
+	datum key;
+	char buf[1024];
+	int r;
+
+	printf("Starting online compaction test (%ld item%s rewritten)...\n",
+		count, plural(count));
+
+	if (-1 == sdbm_compact_start(db))
+		oops("cannot start compaction of \"%s\"", name);
+
+	key.dsize = large_keys ? sizeof buf : NORMAL_KEY_LEN;
+	key.dptr = buf;
+
+	while (0 != (r = sdbm_compact_step(db, COMPACT_SLICE, &info))) {
+		long n;
+
+		if (-1 == r)
+			oops("compaction step #%ld failed", steps);
+
+		steps++;
+
+		if (progress)
+			show_progress(info.done, MAX(info.pages, 1));
+
+		/*
+		 * Between two steps, delete and re-insert some of the keys to
+		 * exercise the replication of updates to the shadow database.
+		 */
+
+		for (n = 0; n < COMPACT_SLICE && i < count; n++, i++) {
+			datum val;
+			char valbuf[DBM_PBLKSIZ];
+
+			fill_key(ARYLEN(buf), i);
+			fill_value(&val, &key, ARYLEN(valbuf));
+
+			(void) sdbm_delete(db, key);
+			if (-1 == sdbm_store(db, key, val, DBM_REPLACE))
+				oops("write error at item #%ld", i);
+		}
+	}
+
+	show_done(done);
+
+	printf("Migrated %ld page%s in %ld step%s, copied %zu item%s, "
+		"size went from %s to %s bytes\n",
+		info.pages, plural(info.pages), steps + 1, plural(steps + 1),
+		info.items, plural(info.items),
+		uint64_to_string(info.old_size), uint64_to_string2(info.new_size));
+
+	sdbm_close(db);
+}
+
 static void
 count_db(const char *name, long count, long cache, int safe, tm_t *done)
 {
@@ -652,14 +931,15 @@ main(int argc, char **argv)
 	extern int optind;
 	extern char *optarg;
 	bool wflag = 0, rflag = 0, iflag = 0, tflag = 0, sflag = 0;
-	bool eflag = 0, dflag = 0, bflag = 0, lflag = 0, xflag = 0;
+	bool eflag = 0, dflag = 0, bflag = 0, lflag = 0, xflag = 0, oflag = 0;
+	bool Lflag = 0;
 	bool stats = 0, count_items = 0;
 	int wflags = 0;
 	int c;
 	const char *name;
 	long count;
 	long cache = 0;
-	const char options[] = "aAbBc:CdDeEiklKprR:sStTUvVwxXy";
+	const char options[] = "aAbBc:CdDeEFiklKLm:MoprR:sStTUvVwxXy";
 
 	progstart(argc, argv);
 
@@ -693,6 +973,9 @@ main(int argc, char **argv)
 		case 'E':			/* empty database on write tests */
 			wflags |= WR_EMPTY;
 			break;
+		case 'F':			/* background flushing */
+			bgflush++;
+			break;
 		case 'e':			/* exists test */
 			eflag++;
 			break;
@@ -706,6 +989,19 @@ main(int argc, char **argv)
 			large_keys++;
 			common_head_tail++;
 			break;
+		case 'L':			/* bulk loading test */
+			Lflag++;
+			break;
+		case 'm':			/* multi-threaded test (implies -T) */
+			mt_readers = atoi(optarg);
+			thread_safe++;
+			break;
+		case 'M':			/* memory-mapped files */
+			mapped++;
+			break;
+		case 'o':			/* online compaction test */
+			oflag++;
+			break;
 		case 'l':			/* loose iteration (implies -T) */
 			lflag++;
 			thread_safe++;
@@ -830,12 +1126,27 @@ main(int argc, char **argv)
 	if (count < 0)
 		oops("count must be positive (is %ld)", count);
 
+	if (mt_readers < 0)
+		oops("amount of readers must be positive (is %d)", mt_readers);
+
+	if (mt_readers != 0 && randomize) {
+		printf("Cannot use random keys with -m\n");
+		return 1;
+	}
+
 	if (count_items)
 		timeit(count_db, name, count, cache, tflag, 0, "count test");
 
 	if (bflag)
 		timeit(rebuild_db, name, count, cache, tflag, wflags, "rebuild test");
 
+	if (oflag)
+		timeit(compact_db, name, count, cache, tflag, wflags,
+			"compaction test");
+
+	if (Lflag)
+		timeit(load_db, name, count, cache, tflag, wflags, "bulk load test");
+
 	if (wflag)
 		timeit(write_db, name, count, cache, tflag, wflags, "write test");
 
@@ -848,6 +1159,9 @@ main(int argc, char **argv)
 	if (lflag)
 		timeit(loose_db, name, count, cache, tflag, sflag, "loose test");
 
+	if (mt_readers != 0)
+		timeit(mt_db, name, count, cache, tflag, wflags, "multi-threaded test");
+
 	if (eflag)
 		timeit(exist_db, name, count, cache, tflag, 0, "existence test");
 
@@ -0,0 +1,302 @@
+/*
+ * sdbm - ndbm work-alike hashed database library
+ *
+ * Memory-mapped file access.
+ * author: gtk-gnutella developers
+ * status: public domain.
+ *
+ * When enabled on a database, the .pag and .dat files are read through a
+ * shared read-only memory mapping instead of issuing pread() system calls:
+ * reading a page is then a mere memory copy from the mapped file.
+ *
+ * Writes always go through pwrite(), so that errors such as a full disk are
+ * reported as error codes: storing into a shared mapping would instead get
+ * the process killed by a SIGBUS when the kernel cannot allocate the blocks
+ * of a sparse page during write-back.  The kernel keeps the mapping coherent
+ * with the data written.
+ *
+ * Only the part of the mapping that lies within the file is ever accessed.
+ * The file size is determined once when the file is first mapped and then
+ * tracked from the outcome of our own I/O operations, which can only make
+ * it grow: reads beyond the known size are served by pread() and the mapping
+ * is lazily enlarged the next time we need to access data past its end.
+ *
+ * Because all the I/O operations are performed with the database locked,
+ * there is no need for any locking here.
+ *
+ * @attention
+ * An I/O error whilst reading a mapped page is still reported with a SIGBUS
+ * instead of an error code, so this mode should only be used on databases
+ * that can be rebuilt.
+ *
+ * @ingroup sdbm
+ * @file
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "sdbm.h"
+#include "tune.h"
+#include "fmap.h"
+#include "private.h"
+
+#include "lib/compat_pio.h"
+#include "lib/log.h"
+#include "lib/stringify.h"		/* For plural() */
+#include "lib/vmm.h"
+#include "lib/walloc.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#ifdef MMAP
+
+#define FMAP_MINLEN		(64 * 1024)		/* Minimum mapping length */
+
+enum sdbm_fmap_magic { SDBM_FMAP_MAGIC = 0x3dcb41f6 };
+
+/**
+ * A memory-mapped file.
+ */
+struct fmap {
+	enum sdbm_fmap_magic magic;	/* Magic number */
+	char *base;					/* Start of mapped region, NULL if none */
+	size_t len;					/* Length of mapped region */
+	fileoffset_t size;			/* Known minimum file size */
+	uint8 sized;				/* Whether file size was determined */
+	uint8 failed;				/* Could not map, do not retry */
+	ulong reads;				/* Stats: amount of reads from mapping */
+	ulong remaps;				/* Stats: amount of file (re)mappings */
+};
+
+static inline void
+sdbm_fmap_check(const struct fmap * const fm)
+{
+	g_assert(fm != NULL);
+	g_assert(SDBM_FMAP_MAGIC == fm->magic);
+}
+
+/**
+ * Allocate a new file mapping descriptor.
+ *
+ * The file is not mapped until it is first accessed.
+ */
+struct fmap *
+fmap_alloc(void)
+{
+	struct fmap *fm;
+
+	WALLOC0(fm);
+	fm->magic = SDBM_FMAP_MAGIC;
+
+	return fm;
+}
+
+/**
+ * Unmap the file.
+ *
+ * This must be called whenever the underlying file descriptor is closed
+ * or the file is truncated.  The file will be remapped on the next access.
+ */
+void
+fmap_discard(struct fmap *fm)
+{
+	if (NULL == fm)
+		return;
+
+	sdbm_fmap_check(fm);
+
+	if (fm->base != NULL) {
+		if (-1 == vmm_munmap(fm->base, fm->len))
+			s_warning("sdbm: cannot unmap %zu bytes at %p: %m",
+				fm->len, fm->base);
+	}
+
+	fm->base = NULL;
+	fm->len = 0;
+	fm->size = 0;
+	fm->sized = FALSE;
+	fm->failed = FALSE;
+}
+
+/**
+ * Unmap the file and free the mapping descriptor, nullifying its pointer.
+ */
+void
+fmap_free_null(struct fmap **fm_ptr)
+{
+	struct fmap *fm = *fm_ptr;
+
+	if (fm != NULL) {
+		fmap_discard(fm);
+		fm->magic = 0;
+		WFREE(fm);
+		*fm_ptr = NULL;
+	}
+}
+
+/**
+ * Record that the file is known to extend at least up to the given offset.
+ */
+static inline void
+fmap_grown(struct fmap *fm, fileoffset_t end)
+{
+	if (end > fm->size)
+		fm->size = end;
+}
+
+/**
+ * Make sure the mapping covers the file up to the given offset, if the
+ * file is known to be large enough.
+ *
+ * The file size is only fetched when the file is first mapped: afterwards,
+ * reading past the known end of the file simply fails here, letting the
+ * caller use pread() which will tell us whether the file was larger.
+ *
+ * @return TRUE if the range [0, end) is now accessible through the mapping.
+ */
+static bool
+fmap_refresh(struct fmap *fm, int fd, fileoffset_t end)
+{
+	size_t len;
+	void *p;
+
+	if G_UNLIKELY(fm->failed)
+		return FALSE;
+
+	if G_UNLIKELY(!fm->sized) {
+		filestat_t buf;
+
+		if (-1 == fstat(fd, &buf))
+			return FALSE;
+
+		fm->sized = TRUE;
+		fmap_grown(fm, buf.st_size);
+	}
+
+	if (end > fm->size)
+		return FALSE;				/* Not known to be part of the file */
+
+	if G_LIKELY(fm->base != NULL && UNSIGNED(end) <= fm->len)
+		return TRUE;
+
+	/*
+	 * Enlarge the mapping, leaving room for the file to grow so that we
+	 * do not have to remap each time a page is appended.
+	 */
+
+	if (UNSIGNED(fm->size) >= MAX_INT_VAL(size_t) / 2) {
+		fm->failed = TRUE;
+		return FALSE;
+	}
+
+	len = fm->size + fm->size / 4;
+	len = MAX(len, FMAP_MINLEN);
+	len = round_pagesize(len);
+
+	if (fm->base != NULL) {
+		if (-1 == vmm_munmap(fm->base, fm->len))
+			s_warning("sdbm: cannot unmap %zu bytes at %p: %m",
+				fm->len, fm->base);
+		fm->base = NULL;
+		fm->len = 0;
+	}
+
+	p = vmm_mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+
+	if G_UNLIKELY(MAP_FAILED == p) {
+		s_warning("sdbm: cannot map %zu bytes from fd #%d: %m", len, fd);
+		fm->failed = TRUE;
+		return FALSE;
+	}
+
+	fm->base = p;
+	fm->len = len;
+	fm->remaps++;
+
+	return TRUE;
+}
+
+/**
+ * Read data from the file, through the mapping when possible.
+ *
+ * @return the amount of bytes read, -1 on error with errno set, with the
+ * same semantics as pread().
+ */
+ssize_t
+fmap_pread(struct fmap *fm, int fd, void *buf, size_t len, fileoffset_t off)
+{
+	fileoffset_t end = off + len;
+	ssize_t r;
+
+	sdbm_fmap_check(fm);
+
+	if G_LIKELY(
+		fm->base != NULL && end <= fm->size && UNSIGNED(end) <= fm->len
+	) {
+		goto mapped;
+	}
+
+	if (fmap_refresh(fm, fd, end))
+		goto mapped;
+
+	r = compat_pread(fd, buf, len, off);
+
+	if (r > 0)
+		fmap_grown(fm, off + r);
+
+	return r;
+
+mapped:
+	memcpy(buf, fm->base + off, len);
+	fm->reads++;
+
+	return len;
+}
+
+/**
+ * Write data to the file.
+ *
+ * This always uses pwrite(), to be able to report errors such as a full
+ * disk, but we take note of how far the file now extends so that the data
+ * can be read back through the mapping.
+ *
+ * @return the amount of bytes written, -1 on error with errno set, with the
+ * same semantics as pwrite().
+ */
+ssize_t
+fmap_pwrite(struct fmap *fm, int fd, const void *buf, size_t len,
+	fileoffset_t off)
+{
+	ssize_t w;
+
+	sdbm_fmap_check(fm);
+
+	w = compat_pwrite(fd, buf, len, off);
+
+	if (w > 0)
+		fmap_grown(fm, off + w);
+
+	return w;
+}
+
+/**
+ * Log mapping statistics.
+ *
+ * @param fm		the file mapping
+ * @param db		the database to which the file belongs
+ * @param what		file kind, for logging
+ */
+void
+fmap_log_stats(const struct fmap *fm, const DBM *db, const char *what)
+{
+	sdbm_fmap_check(fm);
+
+	s_info("sdbm: \"%s\" %s mapped reads = %lu (%lu mapping%s)",
+		sdbm_name(db), what, fm->reads, fm->remaps, plural(fm->remaps));
+}
+
+#endif	/* MMAP */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,18 @@
+/* Mini EMBED (fmap.c) */
+#define fmap_alloc sdbm__fmap_alloc
+#define fmap_free_null sdbm__fmap_free_null
+#define fmap_discard sdbm__fmap_discard
+#define fmap_pread sdbm__fmap_pread
+#define fmap_pwrite sdbm__fmap_pwrite
+#define fmap_log_stats sdbm__fmap_log_stats
+
+struct fmap;
+
+struct fmap *fmap_alloc(void);
+void fmap_free_null(struct fmap **);
+void fmap_discard(struct fmap *);
+ssize_t fmap_pread(struct fmap *, int, void *, size_t, fileoffset_t);
+ssize_t fmap_pwrite(struct fmap *, int, const void *, size_t, fileoffset_t);
+void fmap_log_stats(const struct fmap *, const DBM *, const char *);
+
+/* vi: set ts=4 sw=4 cindent: */
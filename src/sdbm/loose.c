@@ -24,6 +24,7 @@
 #include "lib/log.h"
 #include "lib/pow2.h"
 #include "lib/qlock.h"
+#include "lib/rwlock.h"
 #include "lib/stringify.h"
 #include "lib/thread.h"
 #include "lib/tm.h"
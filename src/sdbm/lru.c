@@ -16,6 +16,8 @@
 #include "sdbm.h"
 #include "tune.h"
 #include "lru.h"
+#include "bgflush.h"
+#include "fmap.h"
 #include "pair.h"				/* For sdbm_page_dump() */
 #include "private.h"
 
@@ -55,6 +57,7 @@ struct lru_cache {
 	elist_t wired;				/* Wired (non-removable) cached pages */
 	uint pages;					/* Configured amount of pages to cache */
 	uint8 write_deferred;		/* Whether writes should be deferred */
+	struct bgflush *bg;			/* Background flusher, NULL if none */
 	unsigned long rhits;		/* Stats: amount of cache hits on reads */
 	unsigned long rmisses;		/* Stats: amount of cache misses on reads */
 	unsigned long whits;		/* Stats: amount of cache hits on writes */
@@ -240,6 +243,9 @@ free_cached_page(void *data, void *unused)
 static void
 free_cache(struct lru_cache *cache)
 {
+#ifdef THREADS
+	bgflush_free_null(&cache->bg);
+#endif
 	hevset_foreach(cache->pagnum, free_cached_page, NULL);
 	hevset_free_null(&cache->pagnum);
 	elist_discard(&cache->lru);
@@ -287,9 +293,10 @@ log_lrustats(DBM *db)
 
 	sdbm_lru_check(cache);
 
-	s_info("sdbm: \"%s\" LRU cache size = %u page%s, %s writes, %s DB",
+	s_info("sdbm: \"%s\" LRU cache size = %u page%s, %s%s writes, %s DB",
 		sdbm_name(db), cache->pages, plural(cache->pages),
 		cache->write_deferred ? "deferred" : "synchronous",
+		NULL == cache->bg ? "" : " background",
 		db->is_volatile ? "volatile" : "persistent");
 	s_info("sdbm: \"%s\" LRU read cache hits = %.2f%% on %lu request%s",
 		sdbm_name(db), cache->rhits * 100.0 / MAX(raccesses, 1), raccesses,
@@ -325,7 +332,7 @@ lru_page_log(const DBM *db, const char *pag)
 	}
 
 	sdbm_lru_check(cache);
-	assert_sdbm_locked(db);
+	assert_sdbm_readable(db);
 
 	cp = sdbm_lru_cpage_get(db, pag, TRUE);
 
@@ -403,6 +410,16 @@ flush_dirtypag(const DBM *db)
 	sdbm_lru_check(cache);
 	assert_sdbm_locked(db);
 
+#ifdef THREADS
+	/*
+	 * Pages being written by the background flusher must reach the disk
+	 * before we return, since callers expect all the pages to be flushed.
+	 */
+
+	if (cache->bg != NULL && !bgflush_drain(cache->bg))
+		saved_errno = EIO;
+#endif
+
 	ELIST_FOREACH_DATA(&cache->lru, cp) {
 		sdbm_lru_cpage_valid(cp, db);
 		if (!flush_cpage(cp, &amount, &saved_errno))
@@ -425,6 +442,195 @@ flush_dirtypag(const DBM *db)
 	return amount;
 }
 
+#ifdef THREADS
+/**
+ * Snapshot dirty page for the background flusher, marking it clean.
+ */
+static inline void
+queue_cpage(struct lru_cache *cache, struct lru_cpage *cp, ssize_t *amount)
+{
+	sdbm_lru_cpage_check(cp);
+
+	if (cp->dirty) {
+		DBM *db = cp->db;
+
+		/*
+		 * Same check as flushpag(): we cannot write back a corrupted page.
+		 */
+
+		if G_UNLIKELY(!sdbm_chkpage(cp->page)) {
+			sdbm_page_dump(db, cp->page, cp->numpag);
+			s_error("SDBM internal page corruption for %s\"%s\" (refcnt=%d)",
+				sdbm_is_thread_safe(db) ? "thread-safe " :"", sdbm_name(db),
+				sdbm_refcnt(db));
+		}
+
+		bgflush_add(cache->bg, cp->numpag, cp->page);
+		db->pagwrite++;
+		cache->cp_flushed++;
+		cp->dirty = FALSE;
+		(*amount)++;
+	}
+}
+#endif	/* THREADS */
+
+/**
+ * Synchronize the dirty pages to disk.
+ *
+ * When a background flusher is configured, the dirty pages are handed over
+ * to it and we do not wait for them to be written, otherwise this is the
+ * same as flush_dirtypag().
+ *
+ * @return the amount of pages successfully flushed or queued as a positive
+ * number if everything was fine, 0 if there was nothing to flush, and -1
+ * if there were I/O errors (errno is set).
+ */
+ssize_t
+sync_dirtypag(DBM *db)
+{
+	struct lru_cache *cache = db->cache;
+#ifdef THREADS
+	struct lru_cpage *cp;
+	ssize_t amount = 0;
+#endif
+
+	if (NULL == cache || NULL == cache->bg)
+		return flush_dirtypag(db);
+
+	sdbm_lru_check(cache);
+	assert_sdbm_locked(db);
+
+#ifdef THREADS
+	ELIST_FOREACH_DATA(&cache->lru, cp) {
+		sdbm_lru_cpage_valid(cp, db);
+		queue_cpage(cache, cp, &amount);
+	}
+
+	ELIST_FOREACH_DATA(&cache->wired, cp) {
+		sdbm_lru_cpage_valid(cp, db);
+		queue_cpage(cache, cp, &amount);
+	}
+
+	bgflush_submit(cache->bg, db->pagf);
+
+	return amount;
+#else
+	g_assert_not_reached();
+#endif
+}
+
+/**
+ * Wait for all the pages handed over to the background flusher, if any,
+ * to be written to disk.
+ *
+ * This must be called before the .pag file is truncated, closed or replaced.
+ *
+ * @return TRUE if OK, FALSE on I/O errors.
+ */
+bool
+lru_drain(const DBM *db)
+{
+	const struct lru_cache *cache = db->cache;
+
+	if (NULL == cache || NULL == cache->bg)
+		return TRUE;
+
+	sdbm_lru_check(cache);
+	assert_sdbm_locked(db);
+
+#ifdef THREADS
+	return bgflush_drain(cache->bg);
+#else
+	g_assert_not_reached();
+#endif
+}
+
+/**
+ * Get a reference on the background flusher, if any, so that another thread
+ * can wait for the pages being written via bgflush_await().
+ *
+ * @param db		the database
+ * @param seq		written with the sequence number of the batch to wait for
+ *
+ * @return the background flusher, to be released with bgflush_release(),
+ * NULL if no pages are being written.
+ */
+struct bgflush *
+lru_bgflush_hold(const DBM *db, ulong *seq)
+{
+	const struct lru_cache *cache = db->cache;
+
+	if (NULL == cache || NULL == cache->bg)
+		return NULL;
+
+	sdbm_lru_check(cache);
+	assert_sdbm_locked(db);
+
+#ifdef THREADS
+	return bgflush_hold(cache->bg, seq);
+#else
+	(void) seq;
+	g_assert_not_reached();
+#endif
+}
+
+/**
+ * @return whether dirty pages are flushed by a background thread.
+ */
+bool
+getbgflush(const DBM *db)
+{
+	const struct lru_cache *cache = db->cache;
+
+	return cache != NULL && cache->bg != NULL;
+}
+
+/**
+ * Turn background flushing of dirty pages on or off.
+ *
+ * @return -1 on error with errno set, 0 if OK.
+ */
+int
+setbgflush(DBM *db, bool on)
+{
+#ifdef THREADS
+	struct lru_cache *cache = db->cache;
+
+	if (NULL == cache) {
+		if (!on)
+			return 0;
+		init_cache(db, LRU_PAGES, FALSE);
+		cache = db->cache;
+	}
+
+	sdbm_lru_check(cache);
+	assert_sdbm_locked(db);
+
+	if (on == (cache->bg != NULL))
+		return 0;
+
+	if (on) {
+		cache->bg = bgflush_alloc(db);
+		if (NULL == cache->bg)
+			return -1;
+	} else {
+		bool ok = bgflush_drain(cache->bg);
+		bgflush_free_null(&cache->bg);
+		if (!ok) {
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	return 0;
+#else
+	(void) db;
+	(void) on;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
 /*
  * @return the configured max amount of pages in cache, 0 for no cache.
  */
@@ -826,7 +1032,7 @@ lru_unwire(DBM *db, const char *pag)
 
 			sdbm_lru_cpage_valid(old, db);
 
-			if (old->dirty && writebuf(old)) {
+			if (!old->dirty || writebuf(old)) {
 				if (db->pagbno == old->numpag)
 					db->pagbno = -1;
 				elist_remove(&cache->lru, old);
@@ -1145,6 +1351,16 @@ lru_invalidate(DBM *db, long bno)
 	sdbm_lru_check(cache);
 	assert_sdbm_locked(db);
 
+#ifdef THREADS
+	/*
+	 * The caller is about to write a new copy of the page on disk, which
+	 * must not be superseded by an older copy from the background flusher.
+	 */
+
+	if (cache->bg != NULL)
+		bgflush_wait(cache->bg, bno);
+#endif
+
 	cp = hevset_lookup(cache->pagnum, &bno);
 
 	if (cp != NULL) {
@@ -1178,7 +1394,8 @@ lru_invalidate(DBM *db, long bno)
 }
 
 /**
- * Compute the file offset right after the last dirty page of the cache.
+ * Compute the file offset right after the last dirty page of the cache,
+ * including the pages still being written by the background flusher.
  *
  * @return 0 if no dirty page, the offset after the last dirty one otherwise.
  */
@@ -1204,6 +1421,11 @@ lru_tail_offset(const DBM *db)
 			bno = MAX(bno, cp->numpag);
 	}
 
+#ifdef THREADS
+	if (cache->bg != NULL)
+		bno = MAX(bno, bgflush_tail(cache->bg));
+#endif
+
 	return OFF_PAG(bno + 1);
 }
 
@@ -1255,6 +1477,52 @@ readbuf(DBM *db, long num, bool *loaded)
 	return TRUE;
 }
 
+/**
+ * Pin page in the cache on behalf of a concurrent reader.
+ *
+ * The page is loaded in the LRU cache if needed, then wired so that other
+ * concurrent readers loading pages cannot evict it whilst it is being read.
+ * Unlike lru_wire(), a page that was not cached remains in the cache
+ * once it is unpinned by lru_unwire().
+ *
+ * @param db		the database (latched)
+ * @param num		the page number to pin
+ *
+ * @return the base address of the pinned page, NULL if it cannot be read.
+ */
+const char *
+lru_pin(DBM *db, long num)
+{
+	struct lru_cache *cache = db->cache;
+	struct lru_cpage *cp;
+
+	sdbm_lru_check(cache);
+	assert_sdbm_locked(db);
+	g_assert(num >= 0);
+
+	cp = hevset_lookup(cache->pagnum, &num);
+
+	if (cp != NULL) {
+		sdbm_lru_cpage_valid(cp, db);
+		cache->rhits++;
+	} else {
+		cache->rmisses++;
+		cp = getcpage(db, num);
+
+		if (cp != NULL && !readpag(db, cp->page, num)) {
+			lru_invalidate(db, num);
+			return NULL;
+		}
+
+		/*
+		 * If we could not get a slot in the cache, lru_wire() will read the
+		 * page in a private wired page, discarded when unpinned.
+		 */
+	}
+
+	return lru_wire(db, num, NULL);
+}
+
 /**
  * Cache new page held in memory if there are deferred writes configured.
  * @return TRUE on success.
@@ -1387,8 +1655,18 @@ readpag(DBM *db, char *pag, long num)
 	 * no holes on these systems.  See makroom().
 	 */
 
+#if defined(LRU) && defined(THREADS)
+	if (db->cache != NULL && db->cache->bg != NULL)
+		bgflush_wait(db->cache->bg, num);	/* Page could be still in flight */
+#endif
+
 	db->pagread++;
-	got = compat_pread(db->pagf, pag, DBM_PBLKSIZ, OFF_PAG(num));
+#ifdef MMAP
+	if (db->pagmap != NULL)
+		got = fmap_pread(db->pagmap, db->pagf, pag, DBM_PBLKSIZ, OFF_PAG(num));
+	else
+#endif
+		got = compat_pread(db->pagf, pag, DBM_PBLKSIZ, OFF_PAG(num));
 	if G_UNLIKELY(got < 0) {
 		s_critical("sdbm: \"%s\": cannot read page #%ld: %m",
 			sdbm_name(db), num);
@@ -1452,8 +1730,18 @@ flushpag(DBM *db, char *pag, long num)
 			sdbm_refcnt(db));
 	}
 
+#if defined(LRU) && defined(THREADS)
+	if (db->cache != NULL && db->cache->bg != NULL)
+		bgflush_wait(db->cache->bg, num);	/* Older copy must land first */
+#endif
+
 	db->pagwrite++;
-	w = compat_pwrite(db->pagf, pag, DBM_PBLKSIZ, OFF_PAG(num));
+#ifdef MMAP
+	if (db->pagmap != NULL)
+		w = fmap_pwrite(db->pagmap, db->pagf, pag, DBM_PBLKSIZ, OFF_PAG(num));
+	else
+#endif
+		w = compat_pwrite(db->pagf, pag, DBM_PBLKSIZ, OFF_PAG(num));
 
 	if (w < 0 || w != DBM_PBLKSIZ) {
 		if (w < 0) {
@@ -7,16 +7,22 @@
 #define lru_tail_offset sdbm__lru_tail_offset
 #define lru_wire sdbm__lru_wire
 #define lru_unwire sdbm__lru_unwire
+#define lru_pin sdbm__lru_pin
 #define lru_page_log sdbm__lru_page_log
 #define readbuf sdbm__readbuf
 #define flushpag sdbm__flushpag
 #define modifypag sdbm__modifypag
 #define dirtypag sdbm__dirtypag
 #define flush_dirtypag sdbm__flush_dirtypag
+#define sync_dirtypag sdbm__sync_dirtypag
+#define lru_drain sdbm__lru_drain
+#define lru_bgflush_hold sdbm__lru_bgflush_hold
 #define setcache sdbm__setcache
 #define getcache sdbm__getcache
 #define setwdelay sdbm__setwdelay
 #define getwdelay sdbm__getwdelay
+#define setbgflush sdbm__setbgflush
+#define getbgflush sdbm__getbgflush
 #define cachepag sdbm__cachepag
 #define readpag sdbm__readpag
 
@@ -28,10 +34,15 @@ bool dirtypag(DBM *, bool);
 bool flushpag(DBM *, char *, long);
 bool readpag(DBM *, char *, long);
 ssize_t flush_dirtypag(const DBM *);
+ssize_t sync_dirtypag(DBM *);
+bool lru_drain(const DBM *);
+struct bgflush *lru_bgflush_hold(const DBM *, ulong *);
 int setcache(DBM *, uint);
 uint getcache(const DBM *);
 int setwdelay(DBM *, bool);
 bool getwdelay(const DBM *);
+int setbgflush(DBM *, bool);
+bool getbgflush(const DBM *);
 bool cachepag(DBM *, char *, long);
 char *lru_cached_page(DBM *, long);
 void lru_discard(DBM *, long);
@@ -40,6 +51,7 @@ fileoffset_t lru_tail_offset(const DBM *);
 const char *lru_wire(DBM *, long, ulong *);
 ulong lru_wired_mstamp(DBM *, const char *);
 void lru_unwire(DBM *, const char *);
+const char *lru_pin(DBM *, long);
 void lru_page_log(const DBM *, const char *);
 
 /* vi: set ts=4 sw=4 cindent: */
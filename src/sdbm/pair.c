@@ -121,7 +121,7 @@ pair_count_invalid(const DBM *db, const char *pag)
 {
 	unsigned short n = INO(pag)[0];
 
-	assert_sdbm_locked(db);
+	assert_sdbm_readable(db);
 
 	if (db->pagbuf == pag) {
 		s_warning("sdbm: \"%s\": bad key & value count %u at %p in page #%ld",
@@ -144,7 +144,7 @@ pair_offset_invalid(const DBM *db, const char *pag, unsigned short off)
 {
 	unsigned short n = INO(pag)[0];
 
-	assert_sdbm_locked(db);
+	assert_sdbm_readable(db);
 
 	if (db->pagbuf == pag) {
 		s_warning("sdbm: \"%s\": bad offset %u at %p (%d item%s), page #%ld",
@@ -170,7 +170,7 @@ pair_index_invalid(const DBM *db, const char *pag, int i)
 {
 	unsigned short n = INO(pag)[0];
 
-	assert_sdbm_locked(db);
+	assert_sdbm_readable(db);
 
 	if (db->pagbuf == pag) {
 		s_warning("sdbm: \"%s\": bad key index %d (%d item%s on %p) page #%ld",
@@ -192,7 +192,7 @@ pair_kv_invalid(const DBM *db, const char *pag, int i, const char *reason)
 	const unsigned short *ino = INO(pag);
 	unsigned short n = ino[0];
 
-	assert_sdbm_locked(db);
+	assert_sdbm_readable(db);
 	g_assert(1 == (i & 0x1));		/* Key index, must be odd */
 
 	if (db->pagbuf == pag) {
@@ -455,13 +455,9 @@ putpair_ext(const DBM *db, char *pag,
 	ino[0] += 2;
 }
 
-bool
-putpair(DBM *db, char *pag, datum key, datum val)
+static bool
+putpair_internal(DBM *db, char *pag, datum key, datum val)
 {
-	g_return_val_unless(pair_count_check(db, pag), FALSE);
-
-	MODIFY(db, pag);
-
 #ifdef BIGDATA
 	/*
 	 * Our strategy for using big values is the following: if the key+value
@@ -553,6 +549,28 @@ putpair(DBM *db, char *pag, datum key, datum val)
 	return TRUE;
 }
 
+bool
+putpair(DBM *db, char *pag, datum key, datum val)
+{
+	g_return_val_unless(pair_count_check(db, pag), FALSE);
+
+	MODIFY(db, pag);
+
+	return putpair_internal(db, pag, key, val);
+}
+
+/**
+ * Insert pair in a page being laid out by bulk loading, which is not held
+ * in the LRU cache.
+ */
+bool
+bulkpair(DBM *db, char *pag, datum key, datum val)
+{
+	g_return_val_unless(pair_count_check(db, pag), FALSE);
+
+	return putpair_internal(db, pag, key, val);
+}
+
 /**
  * Get information about a key: length of its value and index within the page.
  *
@@ -1020,6 +1038,27 @@ paircount(const char *pag)
 	return n / 2;
 }
 
+/**
+ * @return whether the page holds big keys or values.
+ */
+bool
+pagbig(const char *pag)
+{
+#ifdef BIGDATA
+	const unsigned short *ino = INO(pag);
+	unsigned i, n = MIN(ino[0], INO_MAX);
+
+	for (i = 1; i <= n; i++) {
+		if (is_big(ino[i]))
+			return TRUE;
+	}
+#else
+	(void) pag;
+#endif	/* BIGDATA */
+
+	return FALSE;
+}
+
 void
 splpage(DBM *db, char *pag, char *pagzero, char *pagone, long int sbit)
 {
@@ -1,4 +1,5 @@
 /* Mini EMBED (pair.c) */
+#define bulkpair sdbm__bulkpair
 #define delpair sdbm__delpair
 #define duppair sdbm__duppair
 #define exipair sdbm__exipair
@@ -15,6 +16,7 @@
 #define replpair sdbm__replpair
 #define replaceable sdbm__replaceable
 #define paircount sdbm__paircount
+#define pagbig sdbm__pagbig
 #define readpairv sdbm__readpairv
 
 #define INO(p)		((unsigned short *) (p))
@@ -65,6 +67,7 @@ struct sdbm_pair {
 
 extern bool fitpair(const DBM *, const char *, size_t);
 extern bool putpair(DBM *, char *, datum, datum);
+extern bool bulkpair(DBM *, char *, datum, datum);
 extern datum getpair(DBM *, char *, datum);
 extern bool exipair(DBM *, const char *, datum);
 extern bool delpair(DBM *, char *, datum);
@@ -78,6 +81,7 @@ extern void splpage(DBM *, char *, char *, char *, long);
 extern bool replaceable(size_t, size_t, bool);
 extern int replpair(DBM *, char *, int, datum);
 extern int paircount(const char *);
+extern bool pagbig(const char *);
 extern int readpairv(const DBM *, const char *, struct sdbm_pair *, int, bool);
 #ifdef SEEDUPS
 extern bool duppair(DBM *, const char *, datum);
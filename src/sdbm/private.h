@@ -6,7 +6,11 @@
 
 struct DBMBIG;
 struct qlock;			/* Avoid including "qlock.h" here */
+struct rwlock;			/* Avoid including "rwlock.h" here */
+struct lmutex;			/* Avoid including "mutex.h" here */
 struct lru_cache;
+struct fmap;
+struct sdbm_compact;
 
 enum sdbm_magic { SDBM_MAGIC = 0x1dac340e };
 
@@ -29,11 +33,17 @@ struct DBM {
 #ifdef LRU
 	struct lru_cache *cache;	/* LRU page cache */
 #endif
+#ifdef MMAP
+	struct fmap *pagmap;	/* if non-NULL, memory-mapped .pag file */
+#endif
 #ifdef THREADS
 	struct qlock *lock;	/* thread-safe lock at the API level */
+	struct rwlock *rwlock;	/* readers/writer lock, for concurrent reads */
+	struct lmutex *latch;	/* protects state updated by concurrent readers */
 	int refcnt;			/* reference count */
 #endif
 	struct DBM *rdb;	/* if non-NULL, concurrent DB rebuild in progress */
+	struct sdbm_compact *compact;	/* if non-NULL, incremental compaction */
 	fileoffset_t pagtail;	/* end of page file descriptor, for iterating */
 	long maxbno;		/* size of dirfile in bits */
 	long curbit;		/* current bit number */
@@ -88,30 +98,46 @@ struct DBM {
 
 #ifdef THREADS
 
+/*
+ * The API-level lock is held by all the operations that can modify the
+ * database, along with the write lock of the readers/writer lock.
+ *
+ * Fetch operations only take the read lock, so that concurrent readers can
+ * proceed in parallel.  The shared data they may update during the lookup
+ * (LRU cache lists, .dir buffer, statistics) is protected by the latch,
+ * which is also deemed to be a "locked" state for internal routines.
+ */
+
 #define sdbm_synchronize(s) G_STMT_START {		\
 	if G_UNLIKELY((s)->lock != NULL) { 			\
 		DBM *ws = deconstify_pointer(s);		\
 		qlock_lock(ws->lock);					\
+		rwlock_wlock(ws->rwlock);				\
 	}											\
 } G_STMT_END
 
 #define sdbm_synchronize_yield(s) G_STMT_START {\
 	if G_UNLIKELY((s)->lock != NULL) { 			\
 		DBM *ws = deconstify_pointer(s);		\
+		rwlock_wunlock(ws->rwlock);				\
 		qlock_rotate(ws->lock);					\
+		rwlock_wlock(ws->rwlock);				\
 	}											\
 } G_STMT_END
 
 #define sdbm_unsynchronize(s) G_STMT_START {	\
 	if G_UNLIKELY((s)->lock != NULL) { 			\
 		DBM *ws = deconstify_pointer(s);		\
+		rwlock_wunlock(ws->rwlock);				\
 		qlock_unlock(ws->lock);					\
 	}											\
 } G_STMT_END
 
 #define sdbm_return(s, v) G_STMT_START {		\
-	if G_UNLIKELY((s)->lock != NULL) 			\
+	if G_UNLIKELY((s)->lock != NULL) {			\
+		rwlock_wunlock((s)->rwlock);			\
 		qlock_unlock((s)->lock);				\
+	}											\
 	return v;									\
 } G_STMT_END
 
@@ -119,14 +145,28 @@ struct DBM {
 	datum *rv = &(v);							\
 	if G_UNLIKELY((s)->lock != NULL) { 			\
 		rv = sdbm_thread_datum((s), &(v));		\
+		rwlock_wunlock((s)->rwlock);			\
 		qlock_unlock((s)->lock);				\
 	}											\
 	return *rv;									\
 } G_STMT_END
 
 #define assert_sdbm_locked(s) G_STMT_START {	\
+	if G_UNLIKELY((s)->lock != NULL) { 			\
+		if (!sdbm_is_latched(s))				\
+			assert_qlock_is_owned((s)->lock);	\
+	}											\
+} G_STMT_END
+
+/*
+ * Routines that only read the database and never alter shared state, such
+ * as diagnostic logging, can also be called by concurrent readers which
+ * do not hold the latch.
+ */
+
+#define assert_sdbm_readable(s) G_STMT_START {	\
 	if G_UNLIKELY((s)->lock != NULL) 			\
-		assert_qlock_is_owned((s)->lock);		\
+		g_assert(sdbm_is_readable(s));			\
 } G_STMT_END
 
 #else	/* !THREADS */
@@ -138,6 +178,7 @@ struct DBM {
 #define sdbm_return_datum(s, v)		return v
 #define sdbm_return_idatum(s, v)	return v
 #define assert_sdbm_locked(s)
+#define assert_sdbm_readable(s)
 
 #endif	/* THREADS */
 
@@ -177,6 +218,11 @@ ioerr(DBM *db, bool on_write)
  */
 
 void sdbm_return_free(struct dbm_returns *r);
+#ifdef THREADS
+bool sdbm_is_latched(const DBM *db);
+bool sdbm_is_readable(const DBM *db);
+#endif
 datum *sdbm_datum_copy(datum *v, struct dbm_returns *r);
+bool sdbm_storage_needs(size_t key_size, size_t value_size, size_t *needed);
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -17,7 +17,10 @@
 #include "tune.h"
 #include "private.h"
 #include "big.h"
+#include "fmap.h"
 #include "lru.h"
+#include "pair.h"
+#include "rebuild.h"
 #include "tmp.h"
 
 #include "lib/halloc.h"
@@ -25,7 +28,9 @@
 #include "lib/log.h"
 #include "lib/qlock.h"
 #include "lib/random.h"
+#include "lib/rwlock.h"
 #include "lib/str.h"
+#include "lib/walloc.h"
 
 #include "lib/override.h"		/* Must be the last header included */
 
@@ -54,6 +59,10 @@ sdbm_can_rebuild(const DBM *db, bool async)
 		errno = EBUSY;		/* Already iterating */
 		return FALSE;
 	}
+	if (db->compact != NULL) {
+		errno = EBUSY;		/* Already compacting incrementally */
+		return FALSE;
+	}
 	if (async && db->rdb != NULL) {
 		errno = EBUSY;		/* Already rebuilding concurrently */
 		return FALSE;
@@ -142,6 +151,8 @@ sdbm_replace_descriptor(DBM *db, DBM *ndb)
 	g_assert(NULL == ndb->lock);		/* Since `ndb' was not thread-safe */
 	g_assert(NULL == ndb->returned);
 	ndb->lock = db->lock;
+	ndb->rwlock = db->rwlock;
+	ndb->latch = db->latch;
 	ndb->returned = db->returned;
 	ndb->refcnt = db->refcnt;
 #endif
@@ -151,15 +162,24 @@ sdbm_replace_descriptor(DBM *db, DBM *ndb)
 #endif
 #ifdef LRU
 	lru_close(ndb);				/* We only keep the current LRU cache */
+	(void) lru_drain(db);		/* Old .pag file is about to be closed */
 	lru_discard(db, 0);			/* All pages invalid since DB was rebuilt */
 	ndb->cache = db->cache;		/* Keep current DB cache (invalidated) */
 	db->cache = NULL;			/* Must not be freed by sdbm_close_internal() */
+#endif
+#ifdef MMAP
+	g_assert(NULL == ndb->pagmap);
+	fmap_discard(db->pagmap);	/* Was mapping the old .pag file */
+	ndb->pagmap = db->pagmap;	/* Keep file mapping mode */
+	db->pagmap = NULL;			/* Must not be freed by sdbm_close_internal() */
 #endif
 	sdbm_close_internal(db, TRUE, FALSE);		/* Keep object around */
 	*db = *ndb;									/* struct copy */
 	db->pagbno = -1;							/* Restarting, no cached data */
 #ifdef THREADS
 	ndb->lock = NULL;							/* was copied over */
+	ndb->rwlock = NULL;
+	ndb->latch = NULL;
 	ndb->returned = NULL;
 #endif
 
@@ -216,6 +236,131 @@ rebuild_copy(const datum key, const datum value, void *arg)
 		ioerr(db, TRUE);
 }
 
+/**
+ * Copy all the keys/values from the database to the new database, one
+ * pair at a time.
+ *
+ * @param db		the database to rebuild, locked
+ * @param ndb		the new database
+ * @param items		incremented for each pair seen
+ * @param skipped	incremented for each pair not copied
+ * @param duplicate	incremented for each duplicate key
+ *
+ * @return 0 if OK, the errno value otherwise.
+ */
+static int
+rebuild_insert(DBM *db, DBM *ndb,
+	unsigned *items, unsigned *skipped, unsigned *duplicate)
+{
+	datum key;
+	int error = 0;
+
+	for (key = sdbm_firstkey_safe(db); key.dptr; key = sdbm_nextkey(db)) {
+		const datum value = sdbm_value(db);
+
+		(*items)++;
+
+		if (NULL == value.dptr) {
+			if (sdbm_error(db))
+				sdbm_clearerr(db);
+			(*skipped)++;			/* Unreadable value skipped */
+			continue;
+		}
+
+		if (0 != sdbm_store(ndb, key, value, DBM_INSERT)) {
+			if (sdbm_error(db))
+				sdbm_clearerr(db);
+			if (EEXIST == errno) {
+				/* Duplicate key, that's bad, but we can survive */
+				(*duplicate)++;
+				(*skipped)++;
+				continue;
+			}
+			/* Other errors are fatal */
+			error = errno;
+			sdbm_endkey(db);		/* Finish iteration */
+			break;
+		}
+	}
+
+	return error;
+}
+
+/**
+ * Copy all the keys/values from the database to the new database, by
+ * bulk-loading the latter.
+ *
+ * The pairs are laid out directly in their final pages, sequentially,
+ * instead of being inserted one at a time with all the page splits this
+ * causes.  Like rebuild_insert(), the first value seen for a key is the
+ * one kept.
+ *
+ * @param db		the database to rebuild, locked
+ * @param ndb		the new database, which is left untouched on failure
+ * @param items		incremented for each pair seen
+ * @param skipped	incremented for each pair not copied
+ * @param duplicate	incremented for each duplicate key
+ *
+ * @return 0 if OK, the errno value otherwise, EFBIG signalling that the
+ * database is too large to be bulk-loaded.
+ */
+static int
+rebuild_bulk(DBM *db, DBM *ndb,
+	unsigned *items, unsigned *skipped, unsigned *duplicate)
+{
+	struct sdbm_bulk *bulk;
+	datum key;
+	long loaded;
+	unsigned dups;
+	int error = 0;
+
+	bulk = sdbm_bulk_start(ndb);
+
+	if (NULL == bulk)
+		return errno;
+
+	for (key = sdbm_firstkey_safe(db); key.dptr; key = sdbm_nextkey(db)) {
+		const datum value = sdbm_value(db);
+
+		(*items)++;
+
+		if (NULL == value.dptr) {
+			if (sdbm_error(db))
+				sdbm_clearerr(db);
+			(*skipped)++;			/* Unreadable value skipped */
+			continue;
+		}
+
+		if (0 != sdbm_bulk_add(bulk, key, value)) {
+			if (sdbm_error(db))
+				sdbm_clearerr(db);
+			error = errno;
+			sdbm_endkey(db);		/* Finish iteration */
+			break;
+		}
+	}
+
+	if (error != 0) {
+		sdbm_bulk_abort(&bulk);
+		return error;
+	}
+
+	loaded = sdbm_bulk_end(&bulk);
+
+	if (-1 == loaded)
+		return errno;
+
+	/*
+	 * Duplicate keys were only loaded once, that's bad, but we can survive.
+	 */
+
+	dups = *items - *skipped - loaded;
+	*duplicate += dups;
+	*skipped += dups;
+
+	return 0;
+}
+
 /**
  * Rebuild database from scratch, thereby compacting it on disk since only
  * the required pages will be allocated.
@@ -232,7 +377,6 @@ sdbm_rebuild_internal(DBM *db, bool async)
 	char ext[11];
 	char *dirname, *pagname, *datname;
 	int error = 0, result;
-	datum key;
 	unsigned items = 0, skipped = 0, duplicate = 0;
 
 	sdbm_check(db);
@@ -321,35 +465,16 @@ sdbm_rebuild_internal(DBM *db, bool async)
 	 * Copy all the keys/values from the database to the new database.
 	 *
 	 * This is a synchronous rebuild operation, with the database being
-	 * locked.
+	 * locked.  Since the new database is empty, we bulk-load it, unless the
+	 * database is too large for all its pairs to be buffered in memory,
+	 * in which case they are inserted one at a time.
 	 */
 
-	for (key = sdbm_firstkey_safe(db); key.dptr; key = sdbm_nextkey(db)) {
-		const datum value = sdbm_value(db);
+	error = rebuild_bulk(db, ndb, &items, &skipped, &duplicate);
 
-		items++;
-
-		if (NULL == value.dptr) {
-			if (sdbm_error(db))
-				sdbm_clearerr(db);
-			skipped++;				/* Unreadable value skipped */
-			continue;
-		}
-
-		if (0 != sdbm_store(ndb, key, value, DBM_INSERT)) {
-			if (sdbm_error(db))
-				sdbm_clearerr(db);
-			if (EEXIST == errno) {
-				/* Duplicate key, that's bad, but we can survive */
-				duplicate++;
-				skipped++;
-				continue;
-			}
-			/* Other errors are fatal */
-			error = errno;
-			sdbm_endkey(db);		/* Finish iteration */
-			break;
-		}
+	if (EFBIG == error) {
+		items = skipped = duplicate = 0;
+		error = rebuild_insert(db, ndb, &items, &skipped, &duplicate);
 	}
 
 	if (error != 0)
@@ -442,4 +567,377 @@ sdbm_rebuild_async(DBM *db)
 	return sdbm_rebuild_internal(db, TRUE);
 }
 
+/*
+ * Incremental compaction.
+ *
+ * This is an asynchronous rebuild whose page traversal is driven by the
+ * application: each call to sdbm_compact_step() migrates a bounded amount
+ * of pages to the shadow database, and the database remains fully usable
+ * between two steps since all the updates are also applied to the shadow
+ * database, as for sdbm_rebuild_async().
+ *
+ * Because page splits only move keys to pages with a larger number, the keys
+ * held in pages not yet migrated cannot end up in pages we already migrated.
+ * Keys that moved forward may be seen twice, but they are already present
+ * in the shadow database and are therefore not copied again.
+ */
+
+struct sdbm_compact {
+	char ext[11];			/* File extension of the shadow database */
+	long next;				/* Next page to migrate */
+	size_t items;			/* Pairs copied to the shadow database */
+	size_t skipped;			/* Unreadable pairs we had to drop */
+	filesize_t old_size;	/* Size of the database files at start */
+};
+
+/**
+ * @return size of the specified file, 0 if it does not exist.
+ */
+static filesize_t
+compact_file_size(const char *path)
+{
+	filestat_t buf;
+
+	if (NULL == path || -1 == stat(path, &buf))
+		return 0;
+
+	return buf.st_size;
+}
+
+/**
+ * @return the total size of the database files on disk.
+ */
+static filesize_t
+compact_disk_size(const DBM *db)
+{
+	filesize_t size;
+
+	size = compact_file_size(db->dirname) + compact_file_size(db->pagname);
+#ifdef BIGDATA
+	size += compact_file_size(db->datname);
+#endif
+
+	return size;
+}
+
+/**
+ * @return the number of the last page in the database, -1 if empty.
+ */
+static long
+compact_last_page(DBM *db)
+{
+	fileoffset_t pagtail;
+
+	assert_sdbm_locked(db);
+
+	pagtail = lseek(db->pagf, 0L, SEEK_END);
+
+#ifdef LRU
+	{
+		/*
+		 * Account for possibly cached pages that have not yet been
+		 * flushed to disk, as in loose_iterate().
+		 */
+
+		fileoffset_t lrutail = lru_tail_offset(db);
+
+		if (lrutail > pagtail)
+			pagtail = lrutail - 1;
+	}
+#endif
+
+	return pagtail < 0 ? -1 : pagtail / DBM_PBLKSIZ;
+}
+
+/**
+ * Discard incremental compaction, removing the shadow database.
+ *
+ * This is also invoked when the database is closed whilst compacting.
+ */
+void
+rebuild_discard(DBM *db)
+{
+	struct sdbm_compact *c = db->compact;
+
+	assert_sdbm_locked(db);
+
+	if (NULL == c)
+		return;
+
+	g_assert(db->rdb != NULL);
+
+	sdbm_unlink(db->rdb);
+	db->rdb = NULL;
+	db->compact = NULL;
+	tmp_remove(db, c->ext);
+	WFREE(c);
+}
+
+/**
+ * Migrate all the pairs held in the specified page to the shadow database.
+ *
+ * @return 0 if OK, the errno value otherwise.
+ */
+static int
+compact_page(DBM *db, long num)
+{
+	struct sdbm_compact *c = db->compact;
+	const char *pag;
+	ulong mstamp;
+	int i, cnt, error = 0;
+
+	assert_sdbm_locked(db);
+
+#ifdef LRU
+	pag = lru_wire(db, num, &mstamp);
+#else
+	(void) mstamp;
+	pag = NULL;
+#endif
+
+	if G_UNLIKELY(NULL == pag)
+		return 0;			/* Unreadable page, skip it */
+
+	cnt = paircount(pag);
+
+	for (i = 1; i <= cnt; i++) {
+		datum key, value;
+
+		key = getnkey(db, pag, i);
+		value = NULL == key.dptr ? nullitem : getnval(db, pag, i);
+
+		if G_UNLIKELY(NULL == value.dptr) {
+			if (sdbm_error(db))
+				sdbm_clearerr(db);
+			c->skipped++;
+			continue;
+		}
+
+		/*
+		 * Use DBM_INSERT: if the key is already present in the shadow
+		 * database, then it holds the latest value since all updates
+		 * are replicated there.
+		 */
+
+		switch (sdbm_store(db->rdb, key, value, DBM_INSERT)) {
+		case 0:
+			c->items++;
+			break;
+		case 1:
+			break;			/* Already copied */
+		default:
+			error = errno;
+			goto done;
+		}
+	}
+
+done:
+#ifdef LRU
+	lru_unwire(db, pag);
+#endif
+
+	return error;
+}
+
+/**
+ * Start incremental compaction of the database.
+ *
+ * The shadow database is created and all further updates are replicated
+ * to it.  The application must then repeatedly call sdbm_compact_step()
+ * until it returns 0, or abort compaction with sdbm_compact_abort().
+ *
+ * @return 0 if OK, -1 on failure with errno set.
+ */
+int
+sdbm_compact_start(DBM *db)
+{
+	struct sdbm_compact *c;
+	char *dirname, *pagname, *datname;
+	DBM *ndb;
+	int result = -1;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+#ifndef LRU
+	errno = ENOTSUP;		/* We need to be able to wire pages */
+	goto done;
+#endif
+
+	if (!sdbm_can_rebuild(db, TRUE))
+		goto done;			/* errno was already set */
+
+	WALLOC0(c);
+	str_bprintf(ARYLEN(c->ext), ".%08x~", random_u32());
+	dirname = h_strconcat(db->dirname, c->ext, NULL_PTR);
+	pagname = h_strconcat(db->pagname, c->ext, NULL_PTR);
+	datname =
+		NULL == db->datname ? NULL : h_strconcat(db->datname, c->ext, NULL_PTR);
+
+	tmp_add(db, c->ext);
+
+	ndb = sdbm_prep(dirname, pagname, datname,
+		O_WRONLY | O_CREAT | O_EXCL, db->openmode);
+
+	HFREE_NULL(dirname);
+	HFREE_NULL(pagname);
+	HFREE_NULL(datname);
+
+	if (NULL == ndb) {
+		int error = errno;
+		tmp_remove(db, c->ext);
+		WFREE(c);
+		errno = error;
+		goto done;
+	}
+
+	sdbm_attr_propagate(ndb, db);
+
+	/*
+	 * Flush the dirty pages so that the initial size we record, used to
+	 * compute the reclaimed space, is accurate.
+	 */
+
+	(void) sdbm_sync(db);
+	c->old_size = compact_disk_size(db);
+
+	db->rdb = ndb;			/* Where all write / delete are now duplicated */
+	db->compact = c;
+	result = 0;
+
+done:
+	sdbm_return(db, result);
+}
+
+/**
+ * Perform one step of incremental compaction, migrating at most the given
+ * amount of pages to the shadow database.
+ *
+ * When all the pages have been migrated, the shadow database atomically
+ * replaces the original one and compaction is over.
+ *
+ * @param db		the database being compacted
+ * @param pages		maximum amount of pages to migrate
+ * @param info		if non-NULL, filled with compaction progress
+ *
+ * @return 1 if there are more pages to migrate, 0 if compaction is finished,
+ * -1 on failure with errno set, compaction being then aborted.
+ */
+int
+sdbm_compact_step(DBM *db, long pages, struct sdbm_compact_info *info)
+{
+	struct sdbm_compact *c;
+	long n, last;
+	int error = 0, result = -1;
+
+	sdbm_check(db);
+	g_assert(pages > 0);
+
+	sdbm_synchronize(db);
+
+	c = db->compact;
+
+	if (NULL == c) {
+		errno = ENOENT;		/* Not compacting */
+		goto done;
+	}
+
+	if G_UNLIKELY(db->flags & DBM_BROKEN) {
+		error = ESTALE;
+		goto failed;
+	}
+
+	last = compact_last_page(db);
+
+	for (n = 0; n < pages && c->next <= last; n++, c->next++) {
+		error = compact_page(db, c->next);
+		if G_UNLIKELY(error != 0)
+			goto failed;
+	}
+
+	if G_UNLIKELY(sdbm_error(db->rdb)) {
+		error = EIO;
+		goto failed;
+	}
+
+	if (info != NULL) {
+		info->done = c->next;
+		info->pages = last + 1;
+		info->items = c->items;
+		info->skipped = c->skipped;
+		info->old_size = c->old_size;
+		info->new_size = compact_disk_size(db->rdb);
+	}
+
+	if (c->next <= last) {
+		result = 1;			/* More pages to migrate */
+		goto done;
+	}
+
+	/*
+	 * All the pages were migrated, switch over to the shadow database.
+	 */
+
+	{
+		DBM *ndb = db->rdb;
+
+		db->rdb = NULL;
+		db->compact = NULL;
+		error = sdbm_replace_descriptor(db, ndb);
+		tmp_remove(db, c->ext);
+
+		if (c->skipped != 0) {
+			s_critical("sdbm: \"%s\": had to skip %zu/%zu item%s"
+				" during compaction",
+				sdbm_name(db), c->skipped, c->items + c->skipped,
+				1 == c->skipped ? "" : "s");
+		}
+
+		WFREE(c);
+	}
+
+	if (0 != error) {
+		errno = error;
+		goto done;
+	}
+
+	if (info != NULL)
+		info->new_size = compact_disk_size(db);
+
+	result = 0;
+
+done:
+	sdbm_return(db, result);
+
+failed:
+	rebuild_discard(db);
+	errno = error;
+	goto done;
+}
+
+/**
+ * Abort incremental compaction, if any, removing the shadow database.
+ */
+void
+sdbm_compact_abort(DBM *db)
+{
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+	rebuild_discard(db);
+	sdbm_unsynchronize(db);
+}
+
+/**
+ * @return whether incremental compaction is in progress.
+ */
+bool
+sdbm_is_compacting(const DBM *db)
+{
+	sdbm_check(db);
+
+	return db->compact != NULL;
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,6 @@
+/* Mini EMBED (rebuild.c) */
+#define rebuild_discard sdbm__rebuild_discard
+
+void rebuild_discard(DBM *);
+
+/* vi: set ts=4 sw=4 cindent: */
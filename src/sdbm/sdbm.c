@@ -13,7 +13,10 @@
 #include "tune.h"
 #include "pair.h"
 #include "lru.h"
+#include "bgflush.h"
 #include "big.h"
+#include "fmap.h"
+#include "rebuild.h"
 #include "tmp.h"
 #include "private.h"
 
@@ -27,8 +30,10 @@
 #include "lib/hstrfn.h"
 #include "lib/log.h"
 #include "lib/misc.h"
+#include "lib/mutex.h"
 #include "lib/pow2.h"
 #include "lib/qlock.h"
+#include "lib/rwlock.h"
 #include "lib/stringify.h"
 #include "lib/thread.h"
 #include "lib/vmm.h"
@@ -47,6 +52,7 @@ const datum nullitem = {0, 0};
 static bool getdbit(DBM *, long);
 static bool setdbit(DBM *, long);
 static bool getpage(DBM *, long);
+static long getpageb(DBM *, long, bool);
 static datum getnext(DBM *);
 static bool makroom(DBM *, long, size_t);
 static void validpage(DBM *, long);
@@ -86,7 +92,7 @@ static const long masks[] = {
  * @return FALSE if it will not fit, TRUE if it fits with the required
  * page size filled in ``needed'', if not NULL.
  */
-static bool
+bool
 sdbm_storage_needs(size_t key_size, size_t value_size, size_t *needed)
 {
 #ifdef BIGDATA
@@ -451,6 +457,9 @@ success:
  * Mark newly created database as being thread-safe.
  *
  * This will make all external operations on the database thread-safe.
+ *
+ * Fetches and existence checks can then be conducted concurrently by
+ * several threads, all the other operations being serialized.
  */
 void
 sdbm_thread_safe(DBM *db)
@@ -460,9 +469,44 @@ sdbm_thread_safe(DBM *db)
 
 	WALLOC0(db->lock);
 	qlock_recursive_init(db->lock);
+	WALLOC0(db->rwlock);
+	rwlock_init(db->rwlock);
+	WALLOC0(db->latch);
+	mutex_init(db->latch);
 	XMALLOC0_ARRAY(db->returned, THREAD_MAX);
 }
 
+/**
+ * Check whether the current thread holds the latch protecting the data
+ * updated by concurrent readers.
+ *
+ * This is only meant to be used in assertions.
+ */
+bool
+sdbm_is_latched(const DBM *db)
+{
+	sdbm_check(db);
+
+	return db->latch != NULL && mutex_is_owned(db->latch);
+}
+
+/**
+ * Check whether the current thread can read the database, either because
+ * it holds the API-level lock or because it is a concurrent reader.
+ *
+ * This is only meant to be used in assertions.
+ */
+bool
+sdbm_is_readable(const DBM *db)
+{
+	sdbm_check(db);
+
+	if (NULL == db->lock)
+		return TRUE;
+
+	return qlock_is_owned(db->lock) || rwlock_is_taken(db->rwlock);
+}
+
 /**
  * Lock the database to allow a sequence of operations to be atomically
  * conducted.
@@ -480,6 +524,7 @@ sdbm_lock(DBM *db)
 		"%s(): SDBM \"%s\" not marked thread-safe", G_STRFUNC, sdbm_name(db));
 
 	qlock_lock(db->lock);
+	rwlock_wlock(db->rwlock);
 }
 
 /*
@@ -495,6 +540,7 @@ sdbm_unlock(DBM *db)
 	g_assert_log(db->lock != NULL,
 		"%s(): SDBM \"%s\" not marked thread-safe", G_STRFUNC, sdbm_name(db));
 
+	rwlock_wunlock(db->rwlock);
 	qlock_unlock(db->lock);
 }
 
@@ -930,6 +976,17 @@ sdbm_close_internal(DBM *db, bool clearfiles, bool destroy)
 	WFREE_NULL(db->pagbuf, DBM_PBLKSIZ);
 #endif	/* LRU */
 
+#ifdef MMAP
+	if (db->pagmap != NULL) {
+		if (common_stats)
+			fmap_log_stats(db->pagmap, db, ".pag");
+		if (destroy)
+			fmap_free_null(&db->pagmap);
+		else
+			fmap_discard(db->pagmap);
+	}
+#endif	/* MMAP */
+
 	WFREE_NULL(db->dirbuf, DBM_DBLKSIZ);
 	fd_forget_and_close(&db->dirf);
 	fd_forget_and_close(&db->pagf);
@@ -941,6 +998,8 @@ sdbm_close_internal(DBM *db, bool clearfiles, bool destroy)
 		big_close(db);
 #endif
 
+	rebuild_discard(db);		/* Abort any incremental compaction */
+
 	if (db->rdb != NULL) {
 		sdbm_unlink(db->rdb);
 		db->rdb = NULL;
@@ -969,6 +1028,10 @@ sdbm_close_internal(DBM *db, bool clearfiles, bool destroy)
 
 	if (destroy) {
 		if (db->lock != NULL) {
+			mutex_destroy(db->latch);
+			WFREE(db->latch);
+			rwlock_destroy(db->rwlock);
+			WFREE(db->rwlock);
 			qlock_destroy(db->lock);
 			WFREE(db->lock);
 		}
@@ -1098,6 +1161,95 @@ sdbm_close(DBM *db)
 	}													\
 } G_STMT_END
 
+#if defined(THREADS) && defined(LRU)
+/**
+ * Should the current thread perform a concurrent read?
+ *
+ * This is the case for thread-safe databases, unless the thread already
+ * locked the database, in which case it can use the regular code path.
+ */
+static inline bool
+sdbm_concurrent_read(const DBM *db)
+{
+	return db->lock != NULL && !qlock_is_owned(db->lock);
+}
+
+/**
+ * Look for a key on behalf of a concurrent reader.
+ *
+ * The database is only read-locked, so other readers can run concurrently
+ * whilst writers are kept out.  The shared state that a lookup updates (the
+ * .dir block buffer, the LRU cache lists, statistics) is protected by the
+ * latch, and the page we need is wired in the LRU cache for the duration of
+ * the lookup, so that concurrent readers cannot evict it from underneath us.
+ *
+ * Since big keys and values are read through buffers shared at the database
+ * level, the latch is held during the whole lookup on pages with big data.
+ *
+ * @param db		the database
+ * @param key		the key we are looking for
+ * @param value		if non-NULL, filled with the thread-private value found
+ *
+ * @return -1 on error, 0 (FALSE) if the key is missing, 1 (TRUE) if found.
+ */
+static int
+sdbm_read_concurrent(DBM *db, datum key, datum *value)
+{
+	const char *pag;
+	long pagb;
+	bool latched;
+	int found;
+
+	rwlock_rlock(db->rwlock);
+	mutex_lock(db->latch);
+
+	if G_UNLIKELY(db->flags & DBM_BROKEN) {
+		errno = ESTALE;
+		goto error;
+	}
+
+	if G_UNLIKELY(NULL == db->cache)
+		lru_init(db);
+
+	db->pagfetch++;
+	pagb = getpageb(db, exhash(key), FALSE);
+	pag = lru_pin(db, pagb);
+
+	if G_UNLIKELY(NULL == pag) {
+		ioerr(db, FALSE);
+		goto error;
+	}
+
+	latched = pagbig(pag);
+	if (!latched)
+		mutex_unlock(db->latch);
+
+	if (value != NULL) {
+		datum v = getpair(db, deconstify_pointer(pag), key);
+		found = NULL != v.dptr;
+		*value = *sdbm_thread_datum(db, &v);
+	} else {
+		found = exipair(db, pag, key);
+	}
+
+	if (!latched)
+		mutex_lock(db->latch);
+	lru_unwire(db, pag);
+	mutex_unlock(db->latch);
+	rwlock_runlock(db->rwlock);
+
+	return found;
+
+error:
+	mutex_unlock(db->latch);
+	rwlock_runlock(db->rwlock);
+	return -1;
+}
+#else	/* !THREADS || !LRU */
+#define sdbm_concurrent_read(d)				FALSE
+#define sdbm_read_concurrent(d,k,v)			(-1)
+#endif	/* THREADS && LRU */
+
 datum
 sdbm_fetch(DBM *db, datum key)
 {
@@ -1107,6 +1259,15 @@ sdbm_fetch(DBM *db, datum key)
 	}
 	sdbm_check(db);
 
+	if (sdbm_concurrent_read(db)) {
+		datum value;
+
+		if (sdbm_read_concurrent(db, key, &value) <= 0)
+			return nullitem;
+
+		return value;
+	}
+
 	sdbm_synchronize(db);
 
 	if G_UNLIKELY(db->flags & DBM_BROKEN) {
@@ -1140,6 +1301,9 @@ sdbm_exists(DBM *db, datum key)
 	}
 	sdbm_check(db);
 
+	if (sdbm_concurrent_read(db))
+		return sdbm_read_concurrent(db, key, NULL);
+
 	sdbm_synchronize(db);
 
 	if G_UNLIKELY(db->flags & DBM_BROKEN) {
@@ -2568,7 +2732,7 @@ sdbm_sync(DBM *db)
 	}
 
 #ifdef LRU
-	npag = flush_dirtypag(db);
+	npag = sync_dirtypag(db);
 	if G_UNLIKELY(-1 == npag) {
 		npag = (ssize_t) -1;
 		goto done;
@@ -2725,6 +2889,11 @@ sdbm_shrink(DBM *db)
 		goto error;
 	}
 
+#ifdef LRU
+	if G_UNLIKELY(!lru_drain(db))	/* We're going to read the .pag file */
+		goto error;
+#endif
+
 	if G_UNLIKELY(-1 == fstat(db->pagf, &buf))
 		goto error;
 
@@ -2782,6 +2951,9 @@ sdbm_shrink(DBM *db)
 	offset = OFF_PAG(truncate_bno);
 
 	if (offset < paglen) {
+#ifdef MMAP
+		fmap_discard(db->pagmap);	/* Truncated part must no longer be mapped */
+#endif
 		if (-1 == ftruncate(db->pagf, offset))
 			goto error;
 #ifdef LRU
@@ -2947,10 +3119,19 @@ sdbm_rename_files(DBM *db,
 	 *
 	 * If any of the rename fails or we cannot re-open the new file, then
 	 * we undo the renaming and try to reopen the original files.
+	 *
+	 * However, pages being written by the background flusher must reach
+	 * the file before we close it.
 	 */
 
+#ifdef LRU
+	(void) lru_drain(db);
+#endif
 	fd_forget_and_close(&db->dirf);
 	fd_forget_and_close(&db->pagf);
+#ifdef MMAP
+	fmap_discard(db->pagmap);
+#endif
 
 #ifdef BIGDATA
 	dat_opened = big_close(db);
@@ -3173,6 +3354,12 @@ sdbm_clear(DBM *db)
 	if G_UNLIKELY(db->rdb != NULL)
 		sdbm_clear(db->rdb);		/* Also clear rebuilt DB */
 	db->delta = 0;
+#ifdef LRU
+	(void) lru_drain(db);	/* No more writes must happen after truncation */
+#endif
+#ifdef MMAP
+	fmap_discard(db->pagmap);
+#endif
 	if G_UNLIKELY(-1 == ftruncate(db->pagf, 0))
 		goto error;
 	db->pagbno = -1;
@@ -3339,6 +3526,285 @@ sdbm_set_volatile(DBM *db, bool yes)
 	sdbm_return(db, result);
 }
 
+/**
+ * @return whether the database files are accessed through memory mappings.
+ */
+bool
+sdbm_get_mmap(const DBM *db)
+{
+	bool mapped;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+#ifdef MMAP
+	mapped = db->pagmap != NULL;
+#else
+	mapped = FALSE;
+#endif
+
+	sdbm_return(db, mapped);
+}
+
+/**
+ * Turn memory-mapped access to the .pag and .dat files on or off.
+ *
+ * When on, pages are read from and written to a shared mapping of the files,
+ * which removes the system calls needed to move pages in and out of the LRU
+ * page cache.  This is only interesting for large read-mostly databases.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+int
+sdbm_set_mmap(DBM *db, bool on)
+{
+	int result;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+#ifdef MMAP
+	if (on) {
+		if (NULL == db->pagmap)
+			db->pagmap = fmap_alloc();
+	} else {
+		fmap_free_null(&db->pagmap);
+	}
+#ifdef BIGDATA
+	big_set_mmap(db, on);
+#endif
+	result = 0;
+#else
+	(void) on;
+	errno = ENOTSUP;
+	result = -1;
+#endif
+
+	sdbm_return(db, result);
+}
+
+/**
+ * @return whether dirty pages are flushed by a background thread.
+ */
+bool
+sdbm_get_bgflush(const DBM *db)
+{
+	bool on;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+#ifdef LRU
+	on = getbgflush(db);
+#else
+	on = FALSE;
+#endif
+
+	sdbm_return(db, on);
+}
+
+/**
+ * Turn background flushing of dirty pages on or off.
+ *
+ * When on, sdbm_sync() hands a snapshot of the dirty pages to a dedicated
+ * writer thread and returns without waiting for the pages to be written.
+ * The calling thread only needs to wait for the writer when it has to read
+ * back a page that is still being written.  Use sdbm_fsync() to make sure
+ * all the data are on disk.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+int
+sdbm_set_bgflush(DBM *db, bool on)
+{
+	int result;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+#ifdef LRU
+	result = setbgflush(db, on);
+#else
+	(void) on;
+	errno = ENOTSUP;
+	result = -1;
+#endif
+
+	sdbm_return(db, result);
+}
+
+/**
+ * Force the data written to the database files down to the disk.
+ *
+ * This does not flush any cached page, sdbm_sync() must be called first,
+ * but it waits for the pages being written by the background flusher.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+int
+sdbm_fsync(DBM *db)
+{
+	int result = 0;
+#ifdef BIGDATA
+	int datf;
+#endif
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+	if G_UNLIKELY(db->flags & DBM_BROKEN) {
+		errno = ESTALE;
+		result = -1;
+		goto done;
+	}
+
+#ifdef LRU
+	if G_UNLIKELY(!lru_drain(db)) {
+		errno = EIO;
+		result = -1;
+		goto done;
+	}
+#endif
+
+	if (-1 == fd_fdatasync(db->pagf) || -1 == fd_fdatasync(db->dirf)) {
+		result = -1;
+		goto done;
+	}
+
+#ifdef BIGDATA
+	datf = big_datfno(db);
+	if (datf != -1 && -1 == fd_fdatasync(datf))
+		result = -1;
+#endif
+
+done:
+	sdbm_return(db, result);
+}
+
+/**
+ * A pending synchronization of the database files.
+ */
+struct sdbm_fsync {
+	int fd[3];			/* Duplicates of the .pag, .dir and .dat descriptors */
+	struct bgflush *bg;	/* Background flusher writing pages, NULL if none */
+	ulong seq;			/* Sequence number of the batch being written */
+};
+
+/**
+ * Prepare for forcing the data written to the database files down to the
+ * disk from another thread.
+ *
+ * Like sdbm_fsync(), this does not flush any cached page.  The pages being
+ * written by the background flusher are waited for by sdbm_fsync_finish(),
+ * and the file descriptors are duplicated so that it can synchronize the
+ * files without accessing the database, which can be freely used in the
+ * meantime.
+ *
+ * @return a new synchronization object, NULL on error with errno set.
+ */
+struct sdbm_fsync *
+sdbm_fsync_start(DBM *db)
+{
+	struct sdbm_fsync *sf = NULL;
+	int fd[N_ITEMS(sf->fd)];
+	uint i;
+
+	sdbm_check(db);
+
+	sdbm_synchronize(db);
+
+	if G_UNLIKELY(db->flags & DBM_BROKEN) {
+		errno = ESTALE;
+		goto done;
+	}
+
+	fd[0] = db->pagf;
+	fd[1] = db->dirf;
+#ifdef BIGDATA
+	fd[2] = big_datfno(db);
+#else
+	fd[2] = -1;
+#endif
+
+	WALLOC0(sf);
+
+	for (i = 0; i < N_ITEMS(fd); i++) {
+		sf->fd[i] = -1 == fd[i] ? -1 : dup(fd[i]);
+
+		if G_UNLIKELY(-1 == sf->fd[i] && fd[i] != -1) {
+			int error = errno;
+			while (i-- != 0)
+				fd_close(&sf->fd[i]);
+			WFREE(sf);
+			errno = error;
+			goto done;
+		}
+	}
+
+#ifdef LRU
+	sf->bg = lru_bgflush_hold(db, &sf->seq);
+#endif
+
+done:
+	sdbm_return(db, sf);
+}
+
+/**
+ * Force the database files down to the disk and dispose of the object
+ * returned by sdbm_fsync_start(), nullifying its pointer.
+ *
+ * This can be called from any thread, even whilst the database is used.
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+int
+sdbm_fsync_finish(struct sdbm_fsync **sf_ptr)
+{
+	struct sdbm_fsync *sf = *sf_ptr;
+	int result = 0, error = 0;
+	uint i;
+
+	g_assert(sf != NULL);
+
+	/*
+	 * Pages that the background flusher could not write are retried by
+	 * the database owner later on, so they will not be synchronized.
+	 */
+
+#if defined(LRU) && defined(THREADS)
+	if (sf->bg != NULL) {
+		if (!bgflush_await(sf->bg, sf->seq)) {
+			error = EIO;
+			result = -1;
+		}
+		bgflush_release(&sf->bg);
+	}
+#endif
+
+	for (i = 0; i < N_ITEMS(sf->fd); i++) {
+		if (-1 == sf->fd[i])
+			continue;
+		if (-1 == fd_fdatasync(sf->fd[i]) && 0 == result) {
+			error = errno;
+			result = -1;
+		}
+		fd_close(&sf->fd[i]);
+	}
+
+	WFREE(sf);
+	*sf_ptr = NULL;
+
+	if (result != 0)
+		errno = error;
+
+	return result;
+}
+
 bool
 sdbm_rdonly(const DBM *db)
 {
@@ -50,6 +50,10 @@ extern const datum nullitem;
  */
 #define DBM_F_ALLKEYS	(1 << 3)	/* ensure we iterate on all keys */
 
+struct sdbm_compact_info;
+struct sdbm_bulk;
+struct sdbm_fsync;
+
 typedef void (*sdbm_cb_t)(const datum key, const datum value, void *arg);
 typedef bool (*sdbm_cbr_t)(const datum key, const datum value, void *arg);
 
@@ -91,6 +95,11 @@ int sdbm_set_wdelay(DBM *db, bool on);
 bool sdbm_get_wdelay(const DBM *) G_PURE;
 int sdbm_set_volatile(DBM *db, bool yes);
 bool sdbm_is_volatile(const DBM *) G_PURE;
+int sdbm_set_mmap(DBM *db, bool on);
+bool sdbm_get_mmap(const DBM *) G_PURE;
+int sdbm_fsync(DBM *db);
+struct sdbm_fsync *sdbm_fsync_start(DBM *db);
+int sdbm_fsync_finish(struct sdbm_fsync **sf_ptr);
 bool sdbm_shrink(DBM *db);
 ssize_t sdbm_count(const DBM *db);
 ssize_t sdbm_delta(const DBM *db);
@@ -101,6 +110,14 @@ int sdbm_rename(DBM *, const char *);
 int sdbm_rename_files(DBM *, const char *, const char *, const char *);
 int sdbm_rebuild(DBM *);
 int sdbm_rebuild_async(DBM *);
+int sdbm_compact_start(DBM *);
+int sdbm_compact_step(DBM *, long, struct sdbm_compact_info *);
+void sdbm_compact_abort(DBM *);
+bool sdbm_is_compacting(const DBM *);
+struct sdbm_bulk *sdbm_bulk_start(DBM *);
+int sdbm_bulk_add(struct sdbm_bulk *, datum, datum);
+long sdbm_bulk_end(struct sdbm_bulk **);
+void sdbm_bulk_abort(struct sdbm_bulk **);
 size_t sdbm_foreach(DBM *db, int flags, sdbm_cb_t cb, void *arg);
 size_t sdbm_foreach_remove(DBM *db, int flags, sdbm_cbr_t cb, void *arg);
 
@@ -115,6 +132,36 @@ bool sdbm_is_locked(const DBM *db);
 DBM *sdbm_ref(const DBM *db);
 void sdbm_unref(DBM **db_ptr);
 int sdbm_refcnt(const DBM *db);
+int sdbm_set_bgflush(DBM *db, bool on);
+bool sdbm_get_bgflush(const DBM *) G_PURE;
+
+/*
+ * Background flushing statistics, aggregated over all databases.
+ */
+
+struct sdbm_bgflush_stats {
+	uint64 pages;			/* Pages written by background flushers */
+	uint64 batches;			/* Batches of pages submitted */
+	uint64 latency;			/* Total batch latency, in usecs */
+	uint64 max_latency;		/* Maximum batch latency, in usecs */
+	uint64 stalls;			/* Times callers had to wait for the flusher */
+	uint64 stall_time;		/* Total stalling time, in usecs */
+};
+
+void sdbm_bgflush_stats(struct sdbm_bgflush_stats *);
+
+/*
+ * Incremental compaction progress, as reported by sdbm_compact_step().
+ */
+
+struct sdbm_compact_info {
+	long done;				/* Pages migrated so far */
+	long pages;				/* Pages in the database being compacted */
+	size_t items;			/* Pairs copied to the shadow database */
+	size_t skipped;			/* Unreadable pairs that had to be dropped */
+	filesize_t old_size;	/* Size of the database files at start */
+	filesize_t new_size;	/* Size of the shadow (or final) database files */
+};
 
 /*
  * Internal routines with clean semantics that can be used by user code.
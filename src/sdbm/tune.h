@@ -15,6 +15,9 @@
 #define LRU_PAGES	64	/* default amount of pages in LRU cache */
 #define BIGDATA			/* can store large keys/values */
 #define THREADS			/* thread-safe */
+#ifdef HAS_MMAP
+#define MMAP			/* can access files through memory mappings */
+#endif
 
 /*
  * misc
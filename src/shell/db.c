@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup shell
+ * @file
+ *
+ * The "db" command.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "cmd.h"
+
+#include "if/gnet_property.h"
+#include "if/gnet_property_priv.h"
+
+#include "lib/ascii.h"
+#include "lib/dbmw.h"
+#include "lib/dbstore.h"
+#include "lib/misc.h"				/* For compact_size() */
+#include "lib/pslist.h"
+#include "lib/str.h"
+#include "lib/stringify.h"			/* For compact_time() */
+
+#include "lib/override.h"		/* Must be the last header included */
+
+static enum shell_reply
+shell_exec_db_compact(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	bool metric = GNET_PROPERTY(display_metric_units);
+	pslist_t *info, *sl;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	shell_write(sh, "100~\n");
+	shell_write(sh,
+		"S Progress     Pages   Items  Before   After Reclaim    Time Name\n");
+
+	info = dbstore_compact_info_list();
+	s = str_new(80);
+
+	PSLIST_FOREACH(info, sl) {
+		const dbstore_compact_info_t *ci = sl->data;
+		const struct sdbm_compact_info *p;
+
+		dbstore_compact_info_check(ci);
+		p = &ci->progress;
+
+		str_printf(s, "%c ",
+			ci->running ? 'R' : ci->failed ? 'F' : 'D');
+		str_catf(s, "%7.2f%% ",
+			0 == p->pages ? 0.0 : 100.0 * p->done / p->pages);
+		str_catf(s, "%9ld ", p->pages);
+		str_catf(s, "%7zu ", p->items);
+		str_catf(s, "%7s ", compact_size(p->old_size, metric));
+		str_catf(s, "%7s ", compact_size(p->new_size, metric));
+
+		/*
+		 * Reclaimed space is only meaningful once compaction is over since
+		 * the new database files grow as pages are migrated.
+		 */
+
+		if (ci->running || ci->failed || p->new_size > p->old_size)
+			str_catf(s, "%7s ", "-");
+		else
+			str_catf(s, "%7s ",
+				compact_size(p->old_size - p->new_size, metric));
+
+		str_catf(s, "%7s ", compact_time(ci->elapsed));
+		str_catf(s, "\"%s\"\n", ci->name);
+		shell_write(sh, str_2c(s));
+	}
+
+	str_destroy_null(&s);
+	dbstore_compact_info_list_free_null(&info);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
+static enum shell_reply
+shell_exec_db_cache(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	bool metric = GNET_PROPERTY(display_metric_units);
+	pslist_t *info, *sl;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	shell_write(sh, "100~\n");
+	shell_write(sh,
+		"Sh  Cached     Max  Memory   Hits%    Reads Evicted Written Name\n");
+
+	info = dbmw_cache_info_list();
+	s = str_new(80);
+
+	PSLIST_FOREACH(info, sl) {
+		const dbmw_cache_info_t *ci = sl->data;
+
+		dbmw_cache_info_check(ci);
+
+		str_printf(s, "%2u ", ci->shards);
+		str_catf(s, "%7zu ", ci->count);
+		str_catf(s, "%7zu ", ci->max_cached);
+		str_catf(s, "%7s ", compact_size(ci->memory, metric));
+		str_catf(s, "%6.2f%% ",
+			0 == ci->r_access ? 0.0 : 100.0 * ci->r_hits / ci->r_access);
+		str_catf(s, "%8s ", uint64_to_string(ci->r_access));
+		str_catf(s, "%7s ", uint64_to_string(ci->evictions));
+		str_catf(s, "%7s ", uint64_to_string(ci->writebacks));
+		str_catf(s, "\"%s\"\n", ci->name);
+		shell_write(sh, str_2c(s));
+	}
+
+	str_destroy_null(&s);
+	dbmw_cache_info_list_free_null(&info);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
+/**
+ * Handles the db command.
+ */
+enum shell_reply
+shell_exec_db(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	if (argc < 2)
+		return REPLY_ERROR;
+
+#define CMD(name) G_STMT_START { \
+	if (0 == ascii_strcasecmp(argv[1], #name)) \
+		return shell_exec_db_ ## name(sh, argc - 1, argv + 1); \
+} G_STMT_END
+
+	CMD(cache);
+	CMD(compact);
+
+#undef CMD
+
+	shell_set_formatted(sh, _("Unknown operation \"%s\""), argv[1]);
+	return REPLY_ERROR;
+}
+
+const char *
+shell_summary_db(void)
+{
+	return "Database monitoring interface";
+}
+
+const char *
+shell_help_db(int argc, const char *argv[])
+{
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	if (argc > 1) {
+		if (0 == ascii_strcasecmp(argv[1], "cache")) {
+			return "db cache\n"
+				"list the value caches of all databases, with their read\n"
+				"hit ratio, evicted entries and dirty entries written back\n"
+				"T: T = concurrent reads allowed\n"
+				"Sh: amount of cache shards\n"
+				"Max: current cache size, adapted to the hit ratio\n";
+		}
+		if (0 == ascii_strcasecmp(argv[1], "compact")) {
+			return "db compact\n"
+				"list online database compactions, with their progress\n"
+				"and the disk space they reclaimed\n"
+				"S: R = running, D = done, F = failed\n";
+		}
+	} else {
+		return
+			"db cache\n"
+			"db compact\n";
+	}
+	return NULL;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
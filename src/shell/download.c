@@ -36,12 +36,18 @@
 #include "cmd.h"
 
 #include "core/downloads.h"
+#include "core/writeback.h"
 
 #include "if/core/fileinfo.h"
+#include "if/gnet_property.h"
+#include "if/gnet_property_priv.h"
 
 #include "lib/ascii.h"
 #include "lib/glib-missing.h"
 #include "lib/halloc.h"
+#include "lib/misc.h"				/* For compact_size() */
+#include "lib/pslist.h"
+#include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/timestamp.h"
 
@@ -335,6 +341,9 @@ shell_exec_download_show(struct gnutella_shell *sh,
 			show_property(sh, property, boolean_to_string(status.finished));
 		} else if (0 == strcmp(property, "complete")) {
 			show_property(sh, property, boolean_to_string(status.complete));
+		} else if (0 == strcmp(property, "extents")) {
+			long n = file_info_extents(fi);
+			show_property(sh, property, n < 0 ? "" : ulong_to_string(n));
 		} else if (0 == strcmp(property, "magnet")) {
 			char *magnet = file_info_build_magnet(fi->fi_handle);
 			show_property(sh, property, EMPTY_STRING(magnet));
@@ -377,6 +386,105 @@ shell_exec_download_list(struct gnutella_shell *sh,
 	return REPLY_READY;
 }
 
+static enum shell_reply
+shell_exec_download_writes(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	bool metric = GNET_PROPERTY(display_metric_units);
+	writeback_info_t wi;
+	pslist_t *info, *sl;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	writeback_info(&wi);
+	s = str_new(80);
+
+	shell_write(sh, "100~\n");
+
+	str_printf(s, "Pending: %zu writes, %s", wi.pending,
+		compact_size(wi.queued, metric));
+	str_catf(s, " (budget %s)\n", compact_size(wi.budget, metric));
+	shell_write(sh, str_2c(s));
+
+	str_printf(s, "Written: %s writes, %s", uint64_to_string(wi.writes),
+		compact_size(wi.written, metric));
+	str_catf(s, " in %s system calls\n", uint64_to_string(wi.syscalls));
+	shell_write(sh, str_2c(s));
+
+	str_printf(s, "Errors: %s, budget stalls: %s, average latency: %u ms\n",
+		uint64_to_string(wi.errors), uint64_to_string2(wi.stalls),
+		wi.latency);
+	shell_write(sh, str_2c(s));
+
+	shell_write(sh, "\nQueue  Queued Latency Host / File\n");
+
+	info = download_write_info_list();
+
+	PSLIST_FOREACH(info, sl) {
+		const download_write_info_t *dwi = sl->data;
+
+		download_write_info_check(dwi);
+
+		str_printf(s, "%5u ", dwi->pending);
+		str_catf(s, "%7s ", compact_size(dwi->queued, metric));
+		str_catf(s, "%5u ms ", dwi->latency);
+		str_catf(s, "%s \"%s\"\n", dwi->host, dwi->name);
+		shell_write(sh, str_2c(s));
+	}
+
+	str_destroy_null(&s);
+	download_write_info_list_free_null(&info);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
+static enum shell_reply
+shell_exec_download_sched(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	download_sched_info_t dsi;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	download_sched_info(&dsi);
+	s = str_new(80);
+
+	shell_write(sh, "100~\n");
+
+	str_printf(s, "Servers: %zu known, %zu ready, %zu sleeping\n",
+		dsi.servers, dsi.ready, dsi.sleeping);
+	shell_write(sh, str_2c(s));
+
+	str_printf(s, "Passes: %s, servers woken: %s, visited: %s\n",
+		uint64_to_string(dsi.runs), uint64_to_string2(dsi.woken),
+		uint64_to_string3(dsi.visits));
+	shell_write(sh, str_2c(s));
+
+	str_printf(s, "Downloads examined: %s, started: %s\n",
+		uint64_to_string(dsi.examined), uint64_to_string2(dsi.started));
+	shell_write(sh, str_2c(s));
+
+	str_printf(s, "Rates: %.2f visits/s, %.2f starts/s\n",
+		dsi.visit_rate, dsi.start_rate);
+	shell_write(sh, str_2c(s));
+
+	str_printf(s, "Scan cost: %.1f us per pass (average), %s total\n",
+		dsi.scan_cost, compact_time(dsi.scan_us / 1000000));
+	shell_write(sh, str_2c(s));
+
+	str_destroy_null(&s);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
 /**
  * Handles the download command.
  */
@@ -401,7 +509,9 @@ shell_exec_download(struct gnutella_shell *sh, int argc, const char *argv[])
 	CMD(pause);
 	CMD(resume);
 	CMD(rename);
+	CMD(sched);
 	CMD(show);
+	CMD(writes);
 #undef CMD
 
 	shell_set_msg(sh, _("Unknown operation"));
@@ -424,7 +534,17 @@ shell_help_download(int argc, const char *argv[])
 	g_assert(argc > 0);
 
 	if (argc > 1) {
-		/* FIXME */
+		if (0 == ascii_strcasecmp(argv[1], "sched")) {
+			return "download sched\n"
+				"show the download scheduler activity: servers ready to be\n"
+				"scheduled or waiting for their retry time, servers visited\n"
+				"and downloads started per second, and time spent scheduling\n";
+		}
+		if (0 == ascii_strcasecmp(argv[1], "writes")) {
+			return "download writes\n"
+				"show the data pending to be written to disk and, for each\n"
+				"active source, its queued writes and average write latency\n";
+		}
 		return NULL;
 	} else {
 		return
@@ -434,8 +554,10 @@ shell_help_download(int argc, const char *argv[])
 		"download show ID [filename|pathname|size|sha1|tth|bitprint]\n"
 		"download show ID [created|modified|downloaded|uploaded]\n"
 		"download show ID [paused|seeding|verifying|finished|complete]\n"
-		"download show ID [magnet|id]\n"
+		"download show ID [magnet|id|extents]\n"
 		"download rename ID filename\n"
+		"download sched\n"
+		"download writes\n"
 		"\n"
 		"multiple attributes can be requested with a \"download show ID\"\n"
 		"such as \"download show ID filename size magnet\"\n"
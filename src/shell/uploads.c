@@ -43,12 +43,13 @@
 #include "lib/misc.h"
 #include "lib/pslist.h"
 #include "lib/str.h"
+#include "lib/stringify.h"			/* For plural() */
 
 #include "lib/override.h"		/* Must be the last header included */
 
 static void
 print_upload_info(struct gnutella_shell *sh,
-	const struct gnet_upload_info *info)
+	const struct gnet_upload_info *info, bool extents)
 {
 	char buf[1024];
 
@@ -68,6 +69,21 @@ print_upload_info(struct gnutella_shell *sh,
 		info->name ? "\"" : ">");
 
 	shell_write(sh, buf);
+
+	/*
+	 * The disk layout of the file matters for the sequential reads done
+	 * by sendfile(), so report its fragmentation when asked to.
+	 */
+
+	if (extents) {
+		long n = upload_extents(info->upload_handle);
+
+		if (n >= 0) {
+			str_bprintf(ARYLEN(buf), " [%ld extent%s]", n, plural(n));
+			shell_write(sh, buf);
+		}
+	}
+
 	shell_write(sh, "\n");	/* Terminate line */
 }
 
@@ -77,20 +93,29 @@ print_upload_info(struct gnutella_shell *sh,
 enum shell_reply
 shell_exec_uploads(struct gnutella_shell *sh, int argc, const char *argv[])
 {
+	const char *opt_e;
+	const option_t options[] = {
+		{ "e", &opt_e },
+	};
 	const pslist_t *sl;
 	pslist_t *sl_info;
+	int parsed;
 
 	shell_check(sh);
 	g_assert(argv);
 	g_assert(argc > 0);
 
+	parsed = shell_options_parse(sh, argv, options, N_ITEMS(options));
+	if (parsed < 0)
+		return REPLY_ERROR;
+
 	shell_set_msg(sh, "");
 
 	shell_write(sh, "100~ \n");
 
 	sl_info = upload_get_info_list();
 	PSLIST_FOREACH(sl_info, sl) {
-		print_upload_info(sh, sl->data);
+		print_upload_info(sh, sl->data, NULL != opt_e);
 	}
 	upload_free_info_list(&sl_info);
 
@@ -111,7 +136,10 @@ shell_help_uploads(int argc, const char *argv[])
 	g_assert(argv);
 	g_assert(argc > 0);
 
-	return NULL;
+	return
+		"uploads [-e]\n"
+		"list the active uploads\n"
+		"-e: also show the amount of disk extents of each uploaded file\n";
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup shell
+ * @file
+ *
+ * The "verify" command.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "cmd.h"
+
+#include "core/verify.h"
+
+#include "if/gnet_property.h"
+#include "if/gnet_property_priv.h"
+
+#include "lib/misc.h"				/* For compact_size() */
+#include "lib/pslist.h"
+#include "lib/str.h"
+#include "lib/stringify.h"			/* For compact_time() */
+
+#include "lib/override.h"		/* Must be the last header included */
+
+/**
+ * Handles the verify command.
+ */
+enum shell_reply
+shell_exec_verify(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	bool metric = GNET_PROPERTY(display_metric_units);
+	pslist_t *info, *sl;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	shell_write(sh, "100~\n");
+	shell_write(sh,
+		"  Files Queue Q-Size  Hashed    Rate Average     ETA "
+		"Progress Extent Name [File]\n");
+
+	info = verify_info_list();
+	s = str_new(80);
+
+	PSLIST_FOREACH(info, sl) {
+		const verify_info_t *vi = sl->data;
+		filesize_t left;
+
+		verify_info_check(vi);
+
+		left = vi->queued_bytes + vi->size - vi->hashed;
+
+		str_printf(s, "%7zu ", vi->files);
+		str_catf(s, "%5zu ", vi->queued);
+		str_catf(s, "%6s ", compact_size(vi->queued_bytes, metric));
+		str_catf(s, "%7s ", compact_size(vi->bytes, metric));
+		str_catf(s, "%7s ",
+			NULL == vi->pathname ? "-" : compact_rate(vi->rate, metric));
+		str_catf(s, "%7s ", compact_rate(vi->avg_rate, metric));
+
+		if (0 == left || 0 == vi->avg_rate)
+			str_catf(s, "%7s ", "-");
+		else
+			str_catf(s, "%7s ", compact_time(left / vi->avg_rate));
+
+		if (NULL == vi->pathname) {
+			str_catf(s, "%8s %6s %s\n", "-", "-", vi->name);
+		} else {
+			str_catf(s, "%7.2f%% ",
+				0 == vi->size ? 100.0 : 100.0 * vi->hashed / vi->size);
+			if (vi->extents < 0)
+				str_catf(s, "%6s ", "-");
+			else
+				str_catf(s, "%6ld ", vi->extents);
+			str_catf(s, "%s \"%s\"\n", vi->name, vi->pathname);
+		}
+		shell_write(sh, str_2c(s));
+	}
+
+	str_destroy_null(&s);
+	verify_info_list_free_null(&info);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
+const char *
+shell_summary_verify(void)
+{
+	return "File hashing monitoring interface";
+}
+
+const char *
+shell_help_verify(int argc, const char *argv[])
+{
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	return "verify\n"
+		"list the file hashing queues, with the amount of files and data\n"
+		"waiting, the current and average hashing rates and the estimated\n"
+		"time to empty the queue\n"
+		"Extent: amount of disk extents of the file being hashed, only\n"
+		"counted when \"verify_debug\" is set\n";
+}
+
+/* vi: set ts=4 sw=4 cindent: */